@@ -67,7 +67,6 @@
         nativeBuildDeps =
           [
             buildPackages.bison
-            buildPackages.flex
             (lib.getBin buildPackages.lowdown)
             buildPackages.mdbook
             buildPackages.autoconf-archive
@@ -82,7 +81,7 @@
 
         buildDeps =
           [ curl
-            bzip2 xz brotli zlib editline
+            bzip2 xz brotli zstd zlib editline
             openssl sqlite
             libarchive
             boost
@@ -194,6 +193,8 @@
 
             enableParallelBuilding = true;
 
+            doInstallCheck = true;
+
             postUnpack = "sourceRoot=$sourceRoot/perl";
           };
 
@@ -32,8 +32,8 @@ sub copyToOpen {
     my @missing = grep { !$present{$_} } @closure;
     return if !@missing;
 
-    my $missingSize = 0;
-    $missingSize += (queryPathInfo($_, 1))[3] foreach @missing;
+    my $infos = queryPathInfos(1, @missing);
+    my $missingSize = sum(0, map { $_->[3] } values %{$infos});
 
     printf STDERR "copying %d missing paths (%.2f MiB) to '$sshHost'...\n",
         scalar(@missing), $missingSize / (1024**2);
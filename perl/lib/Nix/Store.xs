@@ -36,6 +36,25 @@ static ref<Store> store()
 }
 
 
+/* Parse the store paths in 'args', for the functions that query many
+   paths at once, which is much faster than one call per path when
+   talking to the daemon. */
+static StorePathSet parsePaths(SV * * args, int count)
+{
+    StorePathSet paths;
+    for (int n = 0; n < count; ++n)
+        paths.insert(store()->parseStorePath(SvPV_nolen(args[n])));
+    return paths;
+}
+
+
+static void storePath(HV * hash, const StorePath & path, SV * value)
+{
+    auto s = store()->printStorePath(path);
+    hv_store(hash, s.c_str(), s.size(), value, 0);
+}
+
+
 MODULE = Nix::Store PACKAGE = Nix::Store
 PROTOTYPES: ENABLE
 
@@ -121,6 +140,79 @@ SV * queryPathInfo(char * path, int base32)
         }
 
 
+SV * queryValidPaths(...)
+    PPCODE:
+        try {
+            auto paths = parsePaths(&ST(0), items);
+            for (auto & i : store()->queryValidPaths(paths))
+                XPUSHs(sv_2mortal(newSVpv(store()->printStorePath(i).c_str(), 0)));
+        } catch (Error & e) {
+            croak("%s", e.what());
+        }
+
+
+SV * queryPathInfos(int base32, ...)
+    PPCODE:
+        try {
+            auto infos = store()->queryPathInfos(parsePaths(&ST(1), items - 1));
+            HV * res = newHV();
+            for (auto & [path, info] : infos) {
+                /* The same fields as returned by queryPathInfo. */
+                AV * fields = newAV();
+                av_push(fields, info->deriver
+                    ? newSVpv(store()->printStorePath(*info->deriver).c_str(), 0)
+                    : newSV(0));
+                av_push(fields, newSVpv(info->narHash.to_string(base32 ? Base32 : Base16, true).c_str(), 0));
+                av_push(fields, newSViv(info->registrationTime));
+                av_push(fields, newSViv(info->narSize));
+                AV * refs = newAV();
+                for (auto & i : info->references)
+                    av_push(refs, newSVpv(store()->printStorePath(i).c_str(), 0));
+                av_push(fields, newRV_noinc((SV *) refs));
+                AV * sigs = newAV();
+                for (auto & i : info->sigs)
+                    av_push(sigs, newSVpv(i.c_str(), 0));
+                av_push(fields, newRV_noinc((SV *) sigs));
+                storePath(res, path, newRV_noinc((SV *) fields));
+            }
+            XPUSHs(sv_2mortal(newRV_noinc((SV *) res)));
+        } catch (Error & e) {
+            croak("%s", e.what());
+        }
+
+
+SV * queryReferencesOfPaths(...)
+    PPCODE:
+        try {
+            auto infos = store()->queryPathInfos(parsePaths(&ST(0), items));
+            HV * res = newHV();
+            for (auto & [path, info] : infos) {
+                AV * refs = newAV();
+                for (auto & i : info->references)
+                    av_push(refs, newSVpv(store()->printStorePath(i).c_str(), 0));
+                storePath(res, path, newRV_noinc((SV *) refs));
+            }
+            XPUSHs(sv_2mortal(newRV_noinc((SV *) res)));
+        } catch (Error & e) {
+            croak("%s", e.what());
+        }
+
+
+SV * queryDeriversOfPaths(...)
+    PPCODE:
+        try {
+            auto infos = store()->queryPathInfos(parsePaths(&ST(0), items));
+            HV * res = newHV();
+            for (auto & [path, info] : infos)
+                storePath(res, path, info->deriver
+                    ? newSVpv(store()->printStorePath(*info->deriver).c_str(), 0)
+                    : newSV(0));
+            XPUSHs(sv_2mortal(newRV_noinc((SV *) res)));
+        } catch (Error & e) {
+            croak("%s", e.what());
+        }
+
+
 SV * queryPathFromHashPart(char * hashPart)
     PPCODE:
         try {
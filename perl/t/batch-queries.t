@@ -0,0 +1,53 @@
+# Tests for the functions of Nix::Store that query many paths at once.
+# They use a local store in a temporary directory.
+
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+use Test::More;
+
+my $root;
+BEGIN {
+    $root = tempdir(CLEANUP => 1);
+    $ENV{NIX_REMOTE} = "local?root=$root";
+}
+
+use Nix::Store;
+
+my $src = "$root/src";
+mkdir $src or die;
+
+sub addFile {
+    my ($name, $contents) = @_;
+    open(my $fh, ">", "$src/$name") or die;
+    print $fh $contents;
+    close $fh;
+    return addToStore("$src/$name", 0, "sha256");
+}
+
+my $a = addFile("a", "foo");
+my $b = addFile("b", "bar");
+my $missing = getStoreDir() . "/00000000000000000000000000000000-missing";
+
+ok(isValidPath($a), "added path is valid");
+ok(!isValidPath($missing), "missing path is invalid");
+
+is_deeply([sort(queryValidPaths($a, $b, $missing))], [sort($a, $b)],
+    "queryValidPaths omits invalid paths");
+
+my $infos = queryPathInfos(1, $a, $b, $missing);
+is_deeply([sort(keys %$infos)], [sort($a, $b)], "queryPathInfos omits invalid paths");
+for my $path ($a, $b) {
+    is_deeply($infos->{$path}, [queryPathInfo($path, 1)],
+        "queryPathInfos agrees with queryPathInfo for $path");
+}
+
+my $refs = queryReferencesOfPaths($a, $missing);
+is_deeply($refs, { $a => [] }, "queryReferencesOfPaths");
+
+my $derivers = queryDeriversOfPaths($a, $b);
+is_deeply($derivers, { $a => undef, $b => undef }, "queryDeriversOfPaths");
+
+is_deeply([queryValidPaths()], [], "queryValidPaths with no arguments");
+
+done_testing();
@@ -5,6 +5,8 @@
 #include <memory>
 #include <tuple>
 #include <iomanip>
+#include <limits>
+#include <list>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -44,6 +46,56 @@ static bool allSupportedLocally(Store & store, const std::set<std::string>& requ
     return true;
 }
 
+static bool canBuildOn(const Machine & m, const std::string & neededSystem,
+    const std::set<std::string> & requiredFeatures)
+{
+    return m.enabled
+        && std::find(m.systemTypes.begin(), m.systemTypes.end(), neededSystem) != m.systemTypes.end()
+        && m.allSupported(requiredFeatures)
+        && m.mandatoryMet(requiredFeatures);
+}
+
+/* Return, for each suitable machine that we could connect to, the
+   number of bytes of the input closure of `drvPath' that it doesn't
+   have yet. The connections are kept in `connections' for reuse. */
+static std::map<std::string, uint64_t> getMissingInputSizes(
+    Store & store, const StorePath & drvPath,
+    const Machines & machines, const std::string & neededSystem,
+    const std::set<std::string> & requiredFeatures,
+    std::map<std::string, std::shared_ptr<Store>> & connections)
+{
+    std::map<std::string, uint64_t> res;
+
+    auto drv = store.readDerivation(drvPath);
+    StorePathSet inputs = drv.inputSrcs;
+    for (auto & [inputDrv, outputNames] : drv.inputDrvs)
+        for (auto & [name, path] : store.queryPartialDerivationOutputMap(inputDrv))
+            if (outputNames.count(name) && path) inputs.insert(*path);
+
+    StorePathSet closure;
+    store.computeFSClosure(inputs, closure);
+    auto infos = store.queryPathInfos(closure);
+
+    for (auto & m : machines) {
+        if (!canBuildOn(m, neededSystem, requiredFeatures)) continue;
+        try {
+            auto & sshStore = connections[m.storeUri];
+            if (!sshStore) sshStore = m.openStore();
+            auto present = sshStore->queryValidPaths(closure);
+            uint64_t missing = 0;
+            for (auto & [path, info] : infos)
+                if (!present.count(path)) missing += info->narSize;
+            debug("remote machine '%s' is missing %d bytes of inputs", m.storeUri, missing);
+            res[m.storeUri] = missing;
+        } catch (std::exception & e) {
+            debug("cannot query valid paths on '%s': %s", m.storeUri, e.what());
+            connections.erase(m.storeUri);
+        }
+    }
+
+    return res;
+}
+
 static int main_build_remote(int argc, char * * argv)
 {
     {
@@ -85,6 +137,7 @@ static int main_build_remote(int argc, char * * argv)
             currentLoad = settings.nixStateDir + currentLoadName;
 
         std::shared_ptr<Store> sshStore;
+        std::map<std::string, std::shared_ptr<Store>> connections;
         AutoCloseFD bestSlotLock;
 
         auto machines = getMachines();
@@ -118,6 +171,17 @@ static int main_build_remote(int argc, char * * argv)
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
+            /* Do this before acquiring the main lock, since it
+               involves talking to every machine. */
+            std::map<std::string, uint64_t> missingSizes;
+            if (settings.buildersPreferLocality)
+                missingSizes = getMissingInputSizes(*store, *drvPath, machines,
+                    neededSystem, requiredFeatures, connections);
+            auto missingSize = [&](const Machine & m) {
+                auto i = missingSizes.find(m.storeUri);
+                return i == missingSizes.end() ? std::numeric_limits<uint64_t>::max() : i->second;
+            };
+
             while (true) {
                 bestSlotLock = -1;
                 AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
@@ -130,11 +194,7 @@ static int main_build_remote(int argc, char * * argv)
                 for (auto & m : machines) {
                     debug("considering building on remote machine '%s'", m.storeUri);
 
-                    if (m.enabled && std::find(m.systemTypes.begin(),
-                            m.systemTypes.end(),
-                            neededSystem) != m.systemTypes.end() &&
-                        m.allSupported(requiredFeatures) &&
-                        m.mandatoryMet(requiredFeatures)) {
+                    if (canBuildOn(m, neededSystem, requiredFeatures)) {
                         rightType = true;
                         AutoCloseFD free;
                         uint64_t load = 0;
@@ -154,6 +214,8 @@ static int main_build_remote(int argc, char * * argv)
                         bool best = false;
                         if (!bestSlotLock) {
                             best = true;
+                        } else if (settings.buildersPreferLocality && missingSize(m) != missingSize(*bestMachine)) {
+                            best = missingSize(m) < missingSize(*bestMachine);
                         } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
                             best = true;
                         } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
@@ -228,7 +290,10 @@ static int main_build_remote(int argc, char * * argv)
 
                     Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", bestMachine->storeUri));
 
-                    sshStore = bestMachine->openStore();
+                    if (auto i = connections.find(bestMachine->storeUri); i != connections.end())
+                        sshStore = i->second;
+                    else
+                        sshStore = bestMachine->openStore();
                     sshStore->connect();
                     storeUri = bestMachine->storeUri;
 
@@ -248,21 +313,43 @@ static int main_build_remote(int argc, char * * argv)
 connected:
         close(5);
 
+        /* Don't keep the connections to the machines we didn't pick
+           open while building. */
+        connections.clear();
+
         std::cerr << "# accept\n" << storeUri << "\n";
 
         auto inputs = readStrings<PathSet>(source);
         auto outputs = readStrings<PathSet>(source);
 
-        AutoCloseFD uploadLock = openLockFile(currentLoad + "/" + escapeUri(storeUri) + ".upload-lock", true);
+        auto inputPaths = store->parseStorePathSet(inputs);
+
+        /* Lock the inputs that the remote machine doesn't have yet,
+           rather than the machine as a whole. This prevents concurrent
+           builds from uploading the same paths, while builds that need
+           different paths can upload in parallel. Each lock gets its
+           own timeout, so that one that's stuck doesn't use up the
+           time for waiting for the others. */
+        std::list<PathLocks> uploadLocks;
 
         {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("waiting for the upload lock to '%s'", storeUri));
+            Activity act(*logger, lvlTalkative, actUnknown, fmt("waiting for the upload locks to '%s'", storeUri));
+
+            PathSet lockPaths;
+            auto present = sshStore->queryValidPaths(inputPaths);
+            for (auto & path : inputPaths)
+                if (!present.count(path))
+                    lockPaths.insert(fmt("%s/%s-upload-%s", currentLoad, escapeUri(storeUri), path.hashPart()));
 
             auto old = signal(SIGALRM, handleAlarm);
-            alarm(15 * 60);
-            if (!lockFile(uploadLock.get(), ltWrite, true))
-                printError("somebody is hogging the upload lock for '%s', continuing...");
-            alarm(0);
+            for (auto & lockPath : lockPaths) {
+                auto & lock = uploadLocks.emplace_back();
+                lock.setDeletion(true);
+                alarm(15 * 60);
+                lock.lockPaths({lockPath});
+                if (!alarm(0))
+                    printError("somebody is hogging the upload lock '%s', continuing...", lockPath);
+            }
             signal(SIGALRM, old);
         }
 
@@ -270,10 +357,10 @@ connected:
 
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
-            copyPaths(store, ref<Store>(sshStore), store->parseStorePathSet(inputs), NoRepair, NoCheckSigs, substitute);
+            copyPaths(store, ref<Store>(sshStore), inputPaths, NoRepair, NoCheckSigs, substitute);
         }
 
-        uploadLock = -1;
+        uploadLocks.clear();
 
         auto drv = store->readDerivation(*drvPath);
         drv.inputSrcs = store->parseStorePathSet(inputs);
@@ -6,8 +6,12 @@
 #include "path.hh"
 #include "flake/lockfile.hh"
 #include "store-api.hh"
+#include "sync.hh"
 
+#include <future>
+#include <list>
 #include <optional>
+#include <thread>
 
 namespace nix {
 
@@ -214,6 +218,60 @@ static RegisterCommand registerCommand2(std::vector<std::string> && name)
     return RegisterCommand(std::move(name), [](){ return make_ref<T>(); });
 }
 
+/* A thread that builds paths while the main thread evaluates further
+   installables (see the `pipelined-builds' setting). Paths handed to
+   it with add() are built in batches, one buildPaths() call at a
+   time, so there is never more than one Worker. add() may be called
+   from any thread. Derivations that the evaluation imports from
+   should be built with buildImports() for the same reason. */
+struct BuildPipeline
+{
+    ref<Store> store;
+    BuildMode bMode;
+
+    BuildPipeline(ref<Store> store, BuildMode bMode = bmNormal);
+
+    ~BuildPipeline();
+
+    void add(std::vector<StorePathWithOutputs> && paths);
+
+    /* Build `paths' before anything else that is pending, and wait
+       until they have been built. Suitable as
+       EvalState::buildImports. */
+    void buildImports(const std::vector<StorePathWithOutputs> & paths);
+
+    /* Rethrow the error of a failed build, unless `keep-going' is
+       set, in which case it's rethrown by finish(). */
+    void checkFailure();
+
+    /* Wait until all paths have been built. */
+    void finish();
+
+private:
+
+    struct Import
+    {
+        std::vector<StorePathWithOutputs> paths;
+        std::promise<void> done;
+    };
+
+    struct State
+    {
+        std::vector<StorePathWithOutputs> pending;
+        std::list<Import> imports;
+        bool finished = false;
+        std::exception_ptr ex;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    std::thread thread;
+
+    void run();
+};
+
 Buildables build(ref<Store> store, Realise mode,
     std::vector<std::shared_ptr<Installable>> installables, BuildMode bMode = bmNormal);
 
@@ -12,9 +12,12 @@
 #include "eval-cache.hh"
 #include "url.hh"
 #include "registry.hh"
+#include "sync.hh"
+#include "finally.hh"
 
 #include <regex>
 #include <queue>
+#include <thread>
 
 #include <nlohmann/json.hpp>
 
@@ -417,6 +420,7 @@ std::vector<InstallableValue::DerivationInfo> InstallableAttrPath::toDerivations
 
     DrvInfos drvInfos;
     getDerivations(*state, *v, "", autoArgs, drvInfos, false);
+    prefetchDrvPaths(*state, drvInfos);
 
     std::vector<DerivationInfo> res;
     for (auto & drvInfo : drvInfos) {
@@ -689,6 +693,111 @@ std::shared_ptr<Installable> SourceExprCommand::parseInstallable(
     return installables.front();
 }
 
+BuildPipeline::BuildPipeline(ref<Store> store, BuildMode bMode)
+    : store(store), bMode(bMode)
+{
+    thread = std::thread([this]() { run(); });
+}
+
+BuildPipeline::~BuildPipeline()
+{
+    /* We get here without finish() if evaluation failed. Don't start
+       any more builds, but wait for the current one. */
+    if (thread.joinable()) {
+        {
+            auto state(state_.lock());
+            state->finished = true;
+            state->pending.clear();
+        }
+        wakeup.notify_one();
+        thread.join();
+    }
+}
+
+void BuildPipeline::run()
+{
+    while (true) {
+        std::vector<StorePathWithOutputs> batch;
+        std::list<Import> imports;
+        {
+            auto state(state_.lock());
+            /* After a failure, nothing else is built unless
+               `keep-going' is set, but imports still are, since the
+               evaluation may be waiting for them. */
+            auto stopped = [&]() { return state->ex && !settings.keepGoing; };
+            while (state->imports.empty() && (state->pending.empty() || stopped()) && !state->finished)
+                state.wait(wakeup);
+            if (!state->imports.empty())
+                std::swap(imports, state->imports);
+            else if (state->pending.empty() || stopped())
+                return;
+            else
+                std::swap(batch, state->pending);
+        }
+
+        /* The errors of imports are reported by the evaluation. */
+        if (!imports.empty()) {
+            for (auto & import : imports) {
+                try {
+                    store->buildPaths(import.paths);
+                    import.done.set_value();
+                } catch (...) {
+                    import.done.set_exception(std::current_exception());
+                }
+            }
+            continue;
+        }
+
+        try {
+            store->buildPaths(batch, bMode);
+        } catch (...) {
+            auto state(state_.lock());
+            if (!state->ex) state->ex = std::current_exception();
+            if (!settings.keepGoing)
+                state->pending.clear();
+        }
+    }
+}
+
+void BuildPipeline::checkFailure()
+{
+    auto state(state_.lock());
+    if (state->ex && !settings.keepGoing)
+        std::rethrow_exception(state->ex);
+}
+
+void BuildPipeline::add(std::vector<StorePathWithOutputs> && paths)
+{
+    if (paths.empty()) return;
+    {
+        auto state(state_.lock());
+        for (auto & path : paths)
+            state->pending.push_back(std::move(path));
+    }
+    wakeup.notify_one();
+}
+
+void BuildPipeline::buildImports(const std::vector<StorePathWithOutputs> & paths)
+{
+    std::future<void> done;
+    {
+        auto state(state_.lock());
+        state->imports.push_back(Import { .paths = paths });
+        done = state->imports.back().done.get_future();
+    }
+    wakeup.notify_one();
+    done.get();
+}
+
+void BuildPipeline::finish()
+{
+    state_.lock()->finished = true;
+    wakeup.notify_one();
+    thread.join();
+    if (auto ex = state_.lock()->ex)
+        std::rethrow_exception(ex);
+}
+
 Buildables build(ref<Store> store, Realise mode,
     std::vector<std::shared_ptr<Installable>> installables, BuildMode bMode)
 {
@@ -699,7 +808,31 @@ Buildables build(ref<Store> store, Realise mode,
 
     std::vector<StorePathWithOutputs> pathsToBuild;
 
+    std::unique_ptr<BuildPipeline> pipeline;
+    if (mode == Realise::Outputs && settings.pipelinedBuilds && installables.size() > 1)
+        pipeline = std::make_unique<BuildPipeline>(store, bMode);
+
+    /* Build imports from derivations with the pipeline, rather than
+       with a second Worker next to it. */
+    std::set<EvalState *> states;
+    if (pipeline)
+        for (auto & i : installables)
+            if (auto installable = std::dynamic_pointer_cast<InstallableValue>(i)) {
+                installable->state->buildImports = [&](auto & paths) { pipeline->buildImports(paths); };
+                states.insert(&*installable->state);
+            }
+    Finally resetBuildImports([&]() {
+        for (auto & state : states)
+            state->buildImports = nullptr;
+    });
+
     for (auto & i : installables) {
+        if (pipeline) {
+            pipeline->checkFailure();
+            pipeline->add(std::move(pathsToBuild));
+            pathsToBuild.clear();
+        }
+
         for (auto & b : i->toBuildables()) {
             std::visit(overloaded {
                 [&](BuildableOpaque bo) {
@@ -716,7 +849,11 @@ Buildables build(ref<Store> store, Realise mode,
         }
     }
 
-    if (mode == Realise::Nothing)
+    if (pipeline) {
+        pipeline->add(std::move(pathsToBuild));
+        pipeline->finish();
+    }
+    else if (mode == Realise::Nothing)
         printMissing(store, pathsToBuild, lvlError);
     else if (mode == Realise::Outputs)
         store->buildPaths(pathsToBuild, bMode);
@@ -740,18 +877,26 @@ std::set<RealisedPath> toRealisedPaths(
                 [&](BuildableFromDrv bfd) {
                     auto drv = store->readDerivation(bfd.drvPath);
                     auto outputHashes = staticOutputHashes(*store, drv);
-                    for (auto & output : bfd.outputs) {
-                        if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
+                    std::map<DrvOutput, Realisation> realisations;
+                    if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
+                        std::set<DrvOutput> outputIds;
+                        for (auto & output : bfd.outputs) {
                             if (!outputHashes.count(output.first))
                                 throw Error(
                                     "the derivation '%s' doesn't have an output named '%s'",
                                     store->printStorePath(bfd.drvPath),
                                     output.first);
+                            outputIds.insert(DrvOutput{outputHashes.at(output.first), output.first});
+                        }
+                        realisations = store->queryRealisations(outputIds);
+                    }
+                    for (auto & output : bfd.outputs) {
+                        if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
                             auto outputId = DrvOutput{outputHashes.at(output.first), output.first};
-                            auto realisation = store->queryRealisation(outputId);
-                            if (!realisation)
+                            auto realisation = realisations.find(outputId);
+                            if (realisation == realisations.end())
                                 throw Error("cannot operate on an output of unbuilt content-addresed derivation '%s'", outputId.to_string());
-                            res.insert(RealisedPath{*realisation});
+                            res.insert(RealisedPath{realisation->second});
                         }
                         else {
                             // If ca-derivations isn't enabled, behave as if
@@ -47,7 +47,7 @@ std::pair<Value *, Pos> findAlongAttrPath(EvalState & state, const string & attr
     Strings tokens = parseAttrPath(attrPath);
 
     Value * v = &vIn;
-    Pos pos = noPos;
+    PosIdx pos;
 
     for (auto & attr : tokens) {
 
@@ -77,7 +77,7 @@ std::pair<Value *, Pos> findAlongAttrPath(EvalState & state, const string & attr
             if (a == v->attrs->end())
                 throw AttrPathNotFound("attribute '%1%' in selection path '%2%' not found", attr, attrPath);
             v = &*a->value;
-            pos = *a->pos;
+            pos = a->pos;
         }
 
         else {
@@ -96,7 +96,7 @@ std::pair<Value *, Pos> findAlongAttrPath(EvalState & state, const string & attr
 
     }
 
-    return {v, pos};
+    return {v, state.positions[pos]};
 }
 
 
@@ -14,7 +14,9 @@ Bindings * EvalState::allocBindings(size_t capacity)
 {
     if (capacity > std::numeric_limits<Bindings::size_t>::max())
         throw Error("attribute set of size %d is too big", capacity);
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity
+            + (Bindings::hasIndex(capacity) ? sizeof(uint32_t *) : 0)))
+        Bindings((Bindings::size_t) capacity);
 }
 
 
@@ -47,9 +49,44 @@ Value * EvalState::allocAttr(Value & vAttrs, const std::string & name)
 }
 
 
+unsigned long nrSetIndexesBuilt = 0;
+unsigned long nrSetIndexHits = 0;
+unsigned long nrSetIndexMisses = 0;
+
+
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    resetIndex();
+}
+
+
+uint32_t * Bindings::buildIndex()
+{
+    /* Use a table at least twice the size of the set to keep probe
+       sequences short. */
+    uint32_t slots = 1;
+    while (slots < 2 * size_) slots <<= 1;
+
+    auto mask = slots - 1;
+    auto table = (uint32_t *) allocBytes((slots + 1) * sizeof(uint32_t));
+    table[0] = mask;
+
+    /* Note: if a name occurs more than once, lookups find the first
+       occurrence, since it's earlier in the probe sequence. */
+    for (size_t n = 0; n < size_; ++n) {
+        size_t h = hashSymbol(attrs[n].name) & mask;
+        while (table[h + 1]) h = (h + 1) & mask;
+        table[h + 1] = n + 1;
+    }
+
+    nrSetIndexesBuilt++;
+
+    uint32_t * expected = nullptr;
+    if (!__atomic_compare_exchange_n(indexPtr(), &expected, table,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return expected;
+    return table;
 }
 
 
@@ -17,16 +17,22 @@ struct Attr
 {
     Symbol name;
     Value * value;
-    Pos * pos;
-    Attr(Symbol name, Value * value, Pos * pos = &noPos)
+    PosIdx pos;
+    Attr(Symbol name, Value * value, PosIdx pos = noPos)
         : name(name), value(value), pos(pos) { };
-    Attr() : pos(&noPos) { };
+    Attr() { };
     bool operator < (const Attr & a) const
     {
         return name < a.name;
     }
 };
 
+/* Statistics about lookups in large attribute sets that go through a
+   hash index (see Bindings::lookup()). */
+extern unsigned long nrSetIndexesBuilt;
+extern unsigned long nrSetIndexHits;
+extern unsigned long nrSetIndexMisses;
+
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
@@ -36,13 +42,82 @@ class Bindings
 public:
     typedef uint32_t size_t;
 
+    /* Sets with at least this many attributes get a hash index on
+       their first lookup; smaller sets use binary search. */
+    static constexpr size_t indexThreshold = 32;
+
 private:
     size_t size_, capacity_;
+
     Attr attrs[0];
 
-    Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
+    /* Sets with a capacity of at least indexThreshold have a pointer
+       to their index stored after their attributes, so smaller sets,
+       which are the vast majority, don't pay for it; for the others
+       it's at most 1% of their size. The index is an open-addressing
+       hash table mapping attribute names to their position in
+       'attrs'. index[0] is the table's mask, and the slots follow it.
+       Each slot holds a position + 1, or 0 if it's empty. It's built
+       by the first lookup and discarded whenever the attributes are
+       changed. Since the set may be shared with other evaluator
+       threads by then, buildIndex() publishes it atomically; a thread
+       that loses the race uses the other thread's index. */
+    static bool hasIndex(size_t capacity)
+    {
+        return capacity >= indexThreshold;
+    }
+
+    uint32_t ** indexPtr()
+    {
+        return (uint32_t **) &attrs[capacity_];
+    }
+
+    void resetIndex()
+    {
+        if (hasIndex(capacity_))
+            __atomic_store_n(indexPtr(), nullptr, __ATOMIC_RELAXED);
+    }
+
+    Bindings(size_t capacity) : size_(0), capacity_(capacity)
+    {
+        resetIndex();
+    }
+
     Bindings(const Bindings & bindings) = delete;
 
+    static size_t hashSymbol(const Symbol & name)
+    {
+        /* Symbols are aligned pointers, so drop the low bits and
+           spread the rest over the table. */
+        return ((name.hash() >> 3) * 0x9E3779B97F4A7C15ULL) >> 32;
+    }
+
+    uint32_t * buildIndex();
+
+    Attr * lookup(const Symbol & name)
+    {
+        if (size_ >= indexThreshold) {
+            auto index = __atomic_load_n(indexPtr(), __ATOMIC_ACQUIRE);
+            if (!index) index = buildIndex();
+            auto mask = index[0];
+            for (size_t h = hashSymbol(name) & mask; ; h = (h + 1) & mask) {
+                auto n = index[h + 1];
+                if (!n) break;
+                if (attrs[n - 1].name == name) {
+                    nrSetIndexHits++;
+                    return &attrs[n - 1];
+                }
+            }
+            nrSetIndexMisses++;
+            return nullptr;
+        }
+
+        Attr key(name, 0);
+        iterator i = std::lower_bound(begin(), end(), key);
+        if (i != end() && i->name == name) return &*i;
+        return nullptr;
+    }
+
 public:
     size_t size() const { return size_; }
 
@@ -54,25 +129,21 @@ public:
     {
         assert(size_ < capacity_);
         attrs[size_++] = attr;
+        resetIndex();
     }
 
     iterator find(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
-        return end();
+        auto a = lookup(name);
+        return a ? a : end();
     }
 
     Attr * get(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        return lookup(name);
     }
 
-    Attr & need(const Symbol & name, const Pos & pos = noPos)
+    Attr & need(const Symbol & name, const Pos & pos = Pos())
     {
         auto a = get(name);
         if (!a)
@@ -89,11 +160,28 @@ public:
 
     Attr & operator[](size_t pos)
     {
+        /* The caller may overwrite the attribute's name. */
+        resetIndex();
         return attrs[pos];
     }
 
     void sort();
 
+    /* Return the first attribute in the sorted range [first, last)
+       whose name is not less than `name'. The range is probed at
+       exponentially increasing distances from `first' before doing a
+       binary search, so a walk over a sorted sequence of names takes
+       time proportional to the distances between the found positions.
+       This makes merging a set of size n into one of size m (n <= m)
+       O(n log(m / n)) rather than O(n log m), and O(n + m) at worst. */
+    static iterator gallop(iterator first, iterator last, const Symbol & name)
+    {
+        Attr key(name, 0);
+        size_t n = last - first, bound = 1;
+        while (bound <= n && first[bound - 1] < key) bound *= 2;
+        return std::lower_bound(first + bound / 2, first + std::min(bound, n), key);
+    }
+
     size_t capacity() { return capacity_; }
 
     /* Returns the attributes in lexicographically sorted order. */
@@ -0,0 +1,302 @@
+/* Micro-benchmarks for the evaluator. Run with `make bench', or run
+   the libexpr-bench program directly to select benchmarks by name:
+
+     libexpr-bench [--nixpkgs PATH] [--nix PATH] [--toml PATH] [NAME...]
+
+   Each benchmark evaluates an expression repeatedly in a fresh
+   EvalState and reports the time and the number of values,
+   environments and attribute sets allocated per evaluation. With
+   --nixpkgs, the derivation of `hello' in the given Nixpkgs tree is
+   also evaluated. With --nix, the startup time of the given `nix'
+   binary is measured as well (`make bench-startup'). The `parse' and
+   `parse-strings' benchmarks only parse their expression, the latter
+   being dominated by lexing. The `parse-url'
+   and `parse-flakeref' benchmarks measure the parsing of 1000 URLs
+   and flake references, respectively, without evaluating anything.
+   The `fromtoml-cargo' and `fromtoml-pyproject' benchmarks measure
+   builtins.fromTOML on a generated `Cargo.lock' of a large workspace
+   and a `pyproject.toml'; with --toml, the given TOML files are
+   measured as well. */
+
+#include "eval.hh"
+#include "eval-inline.hh"
+#include "flake/flakeref.hh"
+#include "globals.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "url.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iostream>
+
+using namespace nix;
+
+struct Benchmark
+{
+    std::string name;
+    std::string expr;
+
+    /* Whether to measure only parsing rather than evaluation. */
+    bool parseOnly = false;
+};
+
+static std::string largeAttrSet()
+{
+    std::string s = "{\n";
+    for (int n = 0; n < 5000; ++n)
+        s += fmt("  a%d = { x = %d; y = \"s%d\"; z = [ %d (x: x + %d) ]; };\n", n, n, n, n, n);
+    return s + "}";
+}
+
+/* A source consisting mostly of comments, strings and indented
+   strings, where most of the parse time is spent in the lexer. */
+static std::string stringHeavySource()
+{
+    std::string s = "[\n";
+    for (int n = 0; n < 2000; ++n)
+        s += fmt(
+            "  # Package %d.\n"
+            "  /* A longer comment describing\n"
+            "     the package below. */\n"
+            "  { name = \"pkg-%d\";\n"
+            "    description = \"A \\\"quoted\\\" description of package %d.\\n\";\n"
+            "    path = ./pkgs/p%d/default.nix;\n"
+            "    script = ''\n"
+            "      echo building %d\n"
+            "      cp -r $src $out/share/'''p%d'''\n"
+            "      ${toString %d}\n"
+            "    '';\n"
+            "  }\n",
+            n, n, n, n, n, n, n);
+    return s + "]";
+}
+
+/* A `Cargo.lock' of a workspace with 2000 crates. */
+static std::string cargoLock()
+{
+    std::string s = "# This file is automatically @generated by Cargo.\n# It is not intended for manual editing.\nversion = 3\n";
+    for (int n = 0; n < 2000; ++n) {
+        s += fmt(
+            "\n[[package]]\n"
+            "name = \"crate-%d\"\n"
+            "version = \"0.%d.%d\"\n"
+            "source = \"registry+https://github.com/rust-lang/crates.io-index\"\n"
+            "checksum = \"%064x\"\n",
+            n, n % 40, n % 7, n * 2654435761U);
+        if (n) {
+            s += "dependencies = [\n";
+            for (int d = 1; d <= 4 && d <= n; ++d)
+                s += fmt(" \"crate-%d\",\n", n - d * d);
+            s += "]\n";
+        }
+    }
+    return s;
+}
+
+/* A `pyproject.toml' with many dependencies and tool settings. */
+static std::string pyprojectToml()
+{
+    std::string s =
+        "[build-system]\n"
+        "requires = [\"poetry-core>=1.0.0\"]\n"
+        "build-backend = \"poetry.core.masonry.api\"\n"
+        "\n"
+        "[tool.poetry]\n"
+        "name = \"example\"\n"
+        "version = \"1.2.3\"\n"
+        "description = \"An example project\"\n"
+        "authors = [\"Jane Doe <jane@example.org>\"]\n"
+        "\n"
+        "[tool.poetry.dependencies]\n"
+        "python = \"^3.9\"\n";
+    for (int n = 0; n < 500; ++n)
+        s += fmt("package-%d = { version = \"^%d.%d\", optional = %s, extras = [\"a\", \"b\"] }\n",
+            n, n % 10, n % 3, n % 2 ? "true" : "false");
+    s += "\n[tool.poetry.dev-dependencies]\n";
+    for (int n = 0; n < 200; ++n)
+        s += fmt("dev-package-%d = \"^%d.0\"\n", n, n % 5);
+    s +=
+        "\n[tool.black]\n"
+        "line-length = 88\n"
+        "target-version = ['py39']\n"
+        "include = '\\.pyi?$'\n"
+        "\n[tool.pytest.ini_options]\n"
+        "minversion = \"6.0\"\n"
+        "addopts = \"\"\"\n  -ra -q\n  --strict-markers\n\"\"\"\n";
+    return s;
+}
+
+static std::vector<Benchmark> benchmarks()
+{
+    return {
+        { "parse", largeAttrSet(), true },
+        { "parse-strings", stringHeavySource(), true },
+        { "select",
+          "let s = builtins.listToAttrs (builtins.genList (n: { name = \"a${toString n}\"; value = n; }) 1000); "
+          "in builtins.foldl' (acc: n: acc + s.\"a${toString n}\") 0 (builtins.genList (x: x) 1000)" },
+        { "update",
+          "builtins.attrNames (builtins.foldl' (acc: n: acc // { \"a${toString n}\" = n; }) {} (builtins.genList (x: x) 1000))" },
+        { "map-foldl",
+          "builtins.foldl' (a: b: a + b) 0 (map (x: x * 2) (builtins.genList (x: x) 100000))" },
+        { "concat-context",
+          "let d = derivation { name = \"d\"; system = \"x\"; builder = \"/bin/sh\"; }; "
+          "in builtins.stringLength (builtins.foldl' (acc: n: \"${d}-${toString n}\" + acc) \"\" (builtins.genList (x: x) 1000))" },
+        { "fromjson",
+          "builtins.fromJSON (builtins.toJSON (builtins.genList (n: { a = n; b = \"s${toString n}\"; c = [ n true null ]; }) 10000))" },
+        { "derivation",
+          "map (n: (derivation { name = \"d${toString n}\"; system = \"x\"; builder = \"/bin/sh\"; }).drvPath) (builtins.genList (x: x) 1000)" },
+        { "listtoattrs",
+          "builtins.listToAttrs (builtins.genList (n: { name = \"a${toString n}\"; value = n; }) 10000)" },
+        { "mapattrs",
+          "let s = builtins.listToAttrs (builtins.genList (n: { name = \"a${toString n}\"; value = n; }) 10000); "
+          "in builtins.length (builtins.attrNames (builtins.mapAttrs (name: value: value + 1) s))" },
+        { "unique",
+          "let l = builtins.genList (n: { x = n / 2; y = [ (n / 2) ]; }) 4000; "
+          "in builtins.length (builtins.unique (builtins.deepSeq l l))" },
+    };
+}
+
+/* Run `fun' repeatedly for about a second, and print the time and
+   number of allocations per run. */
+template<typename F>
+static void measure(const std::string & name, F fun)
+{
+    using namespace std::chrono;
+
+    size_t runs = 0;
+    uint64_t allocations = 0;
+    nanoseconds total{0};
+
+    while (runs == 0 || (total < seconds(1) && runs < 1000)) {
+        auto state = std::make_unique<EvalState>(Strings(), openStore("dummy://"));
+        auto before = state->nrAllocations();
+        auto start = steady_clock::now();
+        fun(*state);
+        total += duration_cast<nanoseconds>(steady_clock::now() - start);
+        allocations += state->nrAllocations() - before;
+        runs++;
+    }
+
+    std::cout << fmt("%-16s %6d runs %14d ns/op %12d allocs/op\n",
+        name, runs, total.count() / runs, allocations / runs);
+}
+
+/* Run a command repeatedly for about a second, and print the time per
+   run. */
+static void measureCommand(const std::string & name, const Path & program, const Strings & args)
+{
+    using namespace std::chrono;
+
+    size_t runs = 0;
+    nanoseconds total{0};
+
+    while (runs == 0 || (total < seconds(1) && runs < 1000)) {
+        auto start = steady_clock::now();
+        runProgram(program, false, args);
+        total += duration_cast<nanoseconds>(steady_clock::now() - start);
+        runs++;
+    }
+
+    std::cout << fmt("%-16s %6d runs %14d ns/op\n", name, runs, total.count() / runs);
+}
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        initGC();
+
+        /* Don't write derivations; only compute their paths. */
+        settings.readOnlyMode = true;
+
+        std::optional<Path> nixpkgs, nix;
+        std::vector<Path> tomlFiles;
+        std::set<std::string> selected;
+        for (int n = 1; n < argc; ++n) {
+            std::string arg = argv[n];
+            if (arg == "--nixpkgs" && n + 1 < argc)
+                nixpkgs = absPath(argv[++n]);
+            else if (arg == "--nix" && n + 1 < argc)
+                nix = absPath(argv[++n]);
+            else if (arg == "--toml" && n + 1 < argc)
+                tomlFiles.push_back(absPath(argv[++n]));
+            else
+                selected.insert(arg);
+        }
+
+        auto wanted = [&](const std::string & name) {
+            return selected.empty() || selected.count(name);
+        };
+
+        if (nix) {
+            if (wanted("startup-version"))
+                measureCommand("startup-version", *nix, {"--version"});
+            if (wanted("startup-eval"))
+                measureCommand("startup-eval", *nix,
+                    {"eval", "--store", "dummy://", "--experimental-features", "nix-command", "--expr", "1"});
+        }
+
+        for (auto & b : benchmarks()) {
+            if (!wanted(b.name)) continue;
+            measure(b.name, [&](EvalState & state) {
+                auto e = state.parseExprFromString(b.expr, absPath("."));
+                if (b.parseOnly) return;
+                Value v;
+                state.eval(e, v);
+                state.forceValueDeep(v);
+            });
+        }
+
+        if (wanted("parse-url")) {
+            Strings urls;
+            for (int n = 0; n < 1000; ++n)
+                urls.push_back(fmt("https://user@example%d.org:8080/path/to/%d.tar.gz?rev=%040x&dir=sub%%2Fdir#frag", n, n, n));
+            measure("parse-url", [&](EvalState & state) {
+                for (auto & url : urls)
+                    parseURL(url);
+            });
+        }
+
+        if (wanted("parse-flakeref")) {
+            Strings refs;
+            for (int n = 0; n < 1000; ++n)
+                refs.push_back(
+                    n % 3 == 0 ? fmt("nixpkgs/release-%d#legacyPackages.x86_64-linux.hello", n) :
+                    n % 3 == 1 ? fmt("github:NixOS/nixpkgs/%040x#hello", n) :
+                    fmt("/path/to/flake%d?dir=sub#hello", n));
+            measure("parse-flakeref", [&](EvalState & state) {
+                for (auto & ref : refs)
+                    parseFlakeRefWithFragment(ref);
+            });
+        }
+
+        std::vector<std::pair<std::string, std::string>> tomls{
+            {"fromtoml-cargo", cargoLock()},
+            {"fromtoml-pyproject", pyprojectToml()},
+        };
+        for (auto & file : tomlFiles)
+            tomls.emplace_back("fromtoml-" + std::string(baseNameOf(file)), readFile(file));
+
+        for (auto & [name, toml] : tomls) {
+            if (!wanted(name) && !wanted("fromtoml")) continue;
+            /* Pass the TOML as a value, so that only fromTOML is
+               measured and not the parsing of a Nix string. */
+            measure(name, [&](EvalState & state) {
+                Value vFun, vToml, v;
+                state.eval(state.parseExprFromString("builtins.fromTOML", absPath(".")), vFun);
+                mkString(vToml, toml);
+                state.callFunction(vFun, vToml, v, noPos);
+                state.forceValueDeep(v);
+            });
+        }
+
+        if (nixpkgs && wanted("nixpkgs"))
+            measure("nixpkgs", [&](EvalState & state) {
+                Value v;
+                state.eval(state.parseExprFromString(
+                    fmt("(import %s {}).hello.drvPath", *nixpkgs), absPath(".")), v);
+                state.forceValue(v);
+            });
+    });
+}
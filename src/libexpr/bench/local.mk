@@ -0,0 +1,18 @@
+bench: libexpr-bench_RUN
+
+bench-startup: $(libexpr-bench_PATH) $(nix_PATH)
+	$(libexpr-bench_PATH) --nix $(nix_PATH) startup-version startup-eval
+
+programs += libexpr-bench
+
+libexpr-bench_DIR := $(d)
+
+libexpr-bench_INSTALL_DIR :=
+
+libexpr-bench_SOURCES := $(wildcard $(d)/*.cc)
+
+libexpr-bench_CXXFLAGS += -I src/libutil -I src/libstore -I src/libfetchers -I src/libexpr -I src/libmain
+
+libexpr-bench_LIBS = libexpr libmain libfetchers libstore libutil
+
+libexpr-bench_LDFLAGS := -pthread $(SODIUM_LIBS) $(BOOST_LDFLAGS) -lboost_context
@@ -17,18 +17,49 @@ create table if not exists Attributes (
 );
 )sql";
 
+/* Copy 'from' to 'to' such that concurrent readers of 'to' never see
+   a partially written file. */
+static void copyFileAtomically(const Path & from, const Path & to)
+{
+    auto tmp = fmt("%s.tmp-%d", to, getpid());
+    writeFile(tmp, readFile(from));
+    if (rename(tmp.c_str(), to.c_str()) == -1) {
+        SysError error("renaming '%s' to '%s'", tmp, to);
+        deletePath(tmp);
+        throw error;
+    }
+}
+
 struct AttrDb
 {
     std::atomic_bool failed{false};
 
+    /* Whether anything was written to the database. */
+    std::atomic_bool dirty{false};
+
+    Path dbPath;
+
+    /* The copy of this database in `shared-eval-cache-dir', if
+       set. */
+    std::optional<Path> sharedDbPath;
+
+    /* The number of placeholders inserted by a single execution of
+       the insertPlaceholders statement. */
+    static constexpr size_t placeholderBatchSize = 128;
+
     struct State
     {
         SQLite db;
         SQLiteStmt insertAttribute;
+        SQLiteStmt insertPlaceholders;
         SQLiteStmt insertAttributeWithContext;
         SQLiteStmt queryAttribute;
         SQLiteStmt queryAttributes;
         std::unique_ptr<SQLiteTxn> txn;
+
+        /* Number of writes since the current transaction was
+           started. */
+        uint64_t pendingWrites = 0;
     };
 
     std::unique_ptr<Sync<State>> _state;
@@ -38,10 +69,27 @@ struct AttrDb
     {
         auto state(_state->lock());
 
-        Path cacheDir = getCacheDir() + "/nix/eval-cache-v2";
+        Path cacheDir = getCacheDir() + "/nix/eval-cache-v3";
         createDirs(cacheDir);
 
-        Path dbPath = cacheDir + "/" + fingerprint.to_string(Base16, false) + ".sqlite";
+        auto dbName = fingerprint.to_string(Base16, false) + ".sqlite";
+        dbPath = cacheDir + "/" + dbName;
+
+        /* If there is a shared evaluation cache, seed our local cache
+           from it. The local database is only ever used by this
+           user, so we don't need to worry about concurrent writers
+           on the shared copy. */
+        if (evalSettings.sharedEvalCacheDir != "") {
+            sharedDbPath = evalSettings.sharedEvalCacheDir.get() + "/v3/" + dbName;
+            if (!pathExists(dbPath) && pathExists(*sharedDbPath)) {
+                try {
+                    debug("seeding evaluation cache from '%s'", *sharedDbPath);
+                    copyFileAtomically(*sharedDbPath, dbPath);
+                } catch (Error & e) {
+                    warn("cannot copy shared evaluation cache '%s': %s", *sharedDbPath, e.msg());
+                }
+            }
+        }
 
         state->db = SQLite(dbPath);
         state->db.isCache();
@@ -50,6 +98,13 @@ struct AttrDb
         state->insertAttribute.create(state->db,
             "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
 
+        {
+            std::string sql = "insert or replace into Attributes(parent, name, type, value) values ";
+            for (size_t n = 0; n < placeholderBatchSize; ++n)
+                sql += fmt("%s(?, ?, %d, null)", n ? ", " : "", (int) AttrType::Placeholder);
+            state->insertPlaceholders.create(state->db, sql);
+        }
+
         state->insertAttributeWithContext.create(state->db,
             "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
 
@@ -65,10 +120,19 @@ struct AttrDb
     ~AttrDb()
     {
         try {
-            auto state(_state->lock());
-            if (!failed)
-                state->txn->commit();
-            state->txn.reset();
+            {
+                auto state(_state->lock());
+                if (!failed)
+                    state->txn->commit();
+                state->txn.reset();
+            }
+            /* Close the database before publishing it. */
+            _state.reset();
+            if (sharedDbPath && dirty && !failed) {
+                debug("publishing evaluation cache to '%s'", *sharedDbPath);
+                createDirs(dirOf(*sharedDbPath));
+                copyFileAtomically(dbPath, *sharedDbPath);
+            }
         } catch (...) {
             ignoreException();
         }
@@ -78,8 +142,11 @@ struct AttrDb
     AttrId doSQLite(F && fun)
     {
         if (failed) return 0;
+        dirty = true;
         try {
-            return fun();
+            auto res = fun();
+            flush(false);
+            return res;
         } catch (SQLiteError &) {
             ignoreException();
             failed = true;
@@ -87,6 +154,21 @@ struct AttrDb
         }
     }
 
+    /* Commit the current transaction and start a new one, either
+       unconditionally or if `eval-cache-flush-interval' writes have
+       been done since the last commit. This makes the cache visible
+       to other processes and preserves it if we're interrupted. */
+    void flush(bool force)
+    {
+        auto state(_state->lock());
+        state->pendingWrites++;
+        auto interval = evalSettings.evalCacheFlushInterval.get();
+        if (!force && (!interval || state->pendingWrites < interval)) return;
+        state->txn->commit();
+        state->txn = std::make_unique<SQLiteTxn>(state->db);
+        state->pendingWrites = 0;
+    }
+
     AttrId setAttrs(
         AttrKey key,
         const std::vector<Symbol> & attrs)
@@ -104,10 +186,21 @@ struct AttrDb
             AttrId rowId = state->db.getLastInsertedRowId();
             assert(rowId);
 
-            for (auto & attr : attrs)
+            /* Insert the placeholders for the children in batches, to
+               reduce the number of statement executions for large
+               attribute sets. */
+            size_t n = 0;
+            for (; n + placeholderBatchSize <= attrs.size(); n += placeholderBatchSize) {
+                auto query(state->insertPlaceholders.use());
+                for (size_t i = n; i < n + placeholderBatchSize; ++i)
+                    query(rowId)(attrs[i]);
+                query.exec();
+            }
+
+            for (; n < attrs.size(); ++n)
                 state->insertAttribute.use()
                     (rowId)
-                    (attr)
+                    (attrs[n])
                     (AttrType::Placeholder)
                     (0, false).exec();
 
@@ -166,6 +259,44 @@ struct AttrDb
         });
     }
 
+    AttrId setInt(
+        AttrKey key,
+        NixInt n)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            state->insertAttribute.use()
+                (key.first)
+                (key.second)
+                (AttrType::Int)
+                (n).exec();
+
+            return state->db.getLastInsertedRowId();
+        });
+    }
+
+    /* The strings must not be empty or contain tabs, which separate
+       them in the database. */
+    AttrId setListOfStrings(
+        AttrKey key,
+        const std::vector<std::string> & l)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            state->insertAttribute.use()
+                (key.first)
+                (key.second)
+                (AttrType::ListOfStrings)
+                (concatStringsSep("\t", l)).exec();
+
+            return state->db.getLastInsertedRowId();
+        });
+    }
+
     AttrId setPlaceholder(AttrKey key)
     {
         return doSQLite([&]()
@@ -262,6 +393,10 @@ struct AttrDb
             }
             case AttrType::Bool:
                 return {{rowId, queryAttribute.getInt(2) != 0}};
+            case AttrType::Int:
+                return {{rowId, int_t{queryAttribute.getInt(2)}}};
+            case AttrType::ListOfStrings:
+                return {{rowId, tokenizeString<std::vector<std::string>>(queryAttribute.getStr(2), "\t")}};
             case AttrType::Missing:
                 return {{rowId, missing_t()}};
             case AttrType::Misc:
@@ -374,6 +509,26 @@ std::string AttrCursor::getAttrPathStr(Symbol name) const
     return concatStringsSep(".", getAttrPath(name));
 }
 
+/* Return the elements of the list 'v' if they are all strings
+   without context that can be stored in the cache. */
+static std::optional<std::vector<std::string>> cacheableStrings(EvalState & state, Value & v)
+{
+    std::vector<std::string> res;
+    for (size_t n = 0; n < v.listSize(); ++n) {
+        auto & elem = *v.listElems()[n];
+        try {
+            state.forceValue(elem);
+        } catch (EvalError &) {
+            return std::nullopt;
+        }
+        if (elem.type() != nString || elem.string.context) return std::nullopt;
+        std::string_view s(elem.string.s);
+        if (s.empty() || s.find('\t') != s.npos) return std::nullopt;
+        res.emplace_back(s);
+    }
+    return res;
+}
+
 Value & AttrCursor::forceValue()
 {
     debug("evaluating uncached attribute %s", getAttrPathStr());
@@ -397,6 +552,14 @@ Value & AttrCursor::forceValue()
             cachedValue = {root->db->setString(getKey(), v.path), string_t{v.path, {}}};
         else if (v.type() == nBool)
             cachedValue = {root->db->setBool(getKey(), v.boolean), v.boolean};
+        else if (v.type() == nInt)
+            cachedValue = {root->db->setInt(getKey(), v.integer), int_t{v.integer}};
+        else if (v.type() == nList) {
+            if (auto l = cacheableStrings(root->state, v))
+                cachedValue = {root->db->setListOfStrings(getKey(), *l), std::move(*l)};
+            else
+                cachedValue = {root->db->setMisc(getKey()), misc_t()};
+        }
         else if (v.type() == nAttrs)
             ; // FIXME: do something?
         else
@@ -573,6 +736,94 @@ bool AttrCursor::getBool()
     return v.boolean;
 }
 
+NixInt AttrCursor::getInt()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto i = std::get_if<int_t>(&cachedValue->second)) {
+                debug("using cached integer attribute '%s'", getAttrPathStr());
+                return i->x;
+            } else
+                throw TypeError("'%s' is not an integer", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != nInt)
+        throw TypeError("'%s' is not an integer", getAttrPathStr());
+
+    return v.integer;
+}
+
+std::vector<std::string> AttrCursor::getListOfStrings()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        /* A list of strings with context or empty strings is stored
+           as misc_t, so evaluate it. */
+        if (cachedValue
+            && !std::get_if<placeholder_t>(&cachedValue->second)
+            && !std::get_if<misc_t>(&cachedValue->second))
+        {
+            if (auto l = std::get_if<std::vector<std::string>>(&cachedValue->second)) {
+                debug("using cached list of strings attribute '%s'", getAttrPathStr());
+                return *l;
+            } else
+                throw TypeError("'%s' is not a list of strings", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != nList)
+        throw TypeError("'%s' is not a list", getAttrPathStr());
+
+    std::vector<std::string> res;
+    for (size_t n = 0; n < v.listSize(); ++n)
+        res.push_back(root->state.forceStringNoCtx(*v.listElems()[n]));
+
+    return res;
+}
+
+std::optional<std::variant<string_t, bool, int_t, std::vector<std::string>>> AttrCursor::getCachedValue()
+{
+    if (!root->db) return std::nullopt;
+
+    if (!cachedValue)
+        cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+
+    if (!cachedValue) return std::nullopt;
+
+    if (auto s = std::get_if<string_t>(&cachedValue->second)) {
+        for (auto & c : s->second)
+            if (!root->state.store->isValidPath(root->state.store->parseStorePath(c.first)))
+                return std::nullopt;
+        debug("using cached string attribute '%s'", getAttrPathStr());
+        return *s;
+    }
+
+    if (auto b = std::get_if<bool>(&cachedValue->second)) {
+        debug("using cached Boolean attribute '%s'", getAttrPathStr());
+        return *b;
+    }
+
+    if (auto i = std::get_if<int_t>(&cachedValue->second)) {
+        debug("using cached integer attribute '%s'", getAttrPathStr());
+        return *i;
+    }
+
+    if (auto l = std::get_if<std::vector<std::string>>(&cachedValue->second)) {
+        debug("using cached list of strings attribute '%s'", getAttrPathStr());
+        return *l;
+    }
+
+    return std::nullopt;
+}
+
 std::vector<Symbol> AttrCursor::getAttrs()
 {
     if (root->db) {
@@ -44,12 +44,15 @@ enum AttrType {
     Misc = 4,
     Failed = 5,
     Bool = 6,
+    ListOfStrings = 7,
+    Int = 8,
 };
 
 struct placeholder_t {};
 struct missing_t {};
 struct misc_t {};
 struct failed_t {};
+struct int_t { NixInt x; };
 typedef uint64_t AttrId;
 typedef std::pair<AttrId, Symbol> AttrKey;
 typedef std::pair<std::string, std::vector<std::pair<Path, std::string>>> string_t;
@@ -61,7 +64,9 @@ typedef std::variant<
     missing_t,
     misc_t,
     failed_t,
-    bool
+    bool,
+    int_t,
+    std::vector<std::string>
     > AttrValue;
 
 class AttrCursor : public std::enable_shared_from_this<AttrCursor>
@@ -110,6 +115,16 @@ public:
 
     bool getBool();
 
+    NixInt getInt();
+
+    std::vector<std::string> getListOfStrings();
+
+    /* Return the value of this attribute if it's a string, a
+       Boolean, an integer or a list of strings in the cache, without
+       evaluating anything. Strings that refer to store paths that are
+       no longer valid are not returned. */
+    std::optional<std::variant<string_t, bool, int_t, std::vector<std::string>>> getCachedValue();
+
     std::vector<Symbol> getAttrs();
 
     bool isDerivation();
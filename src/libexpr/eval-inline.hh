@@ -2,6 +2,9 @@
 
 #include "eval.hh"
 
+#include <atomic>
+#include <thread>
+
 #define LocalNoInline(f) static f __attribute__((noinline)); f
 #define LocalNoInlineNoReturn(f) static f __attribute__((noinline, noreturn)); f
 
@@ -30,24 +33,102 @@ LocalNoInlineNoReturn(void throwTypeError(const Pos & pos, const char * s, const
 }
 
 
-void EvalState::forceValue(Value & v, const Pos & pos)
+/* Identifies the calling thread in the black holes it creates, and
+   records the black hole it is waiting for, if any. */
+struct EvalThread
+{
+    std::atomic<const Value *> waitingFor{nullptr};
+};
+
+static inline EvalThread * currentEvalThread()
 {
-    if (v.isThunk()) {
-        Env * env = v.thunk.env;
-        Expr * expr = v.thunk.expr;
-        try {
-            v.mkBlackhole();
-            //checkInterrupt();
-            expr->eval(*this, *env, v);
-        } catch (...) {
-            v.mkThunk(env, expr);
-            throw;
+    static thread_local EvalThread thread;
+    return &thread;
+}
+
+
+/* Whether waiting for 'v' would deadlock, i.e. whether its owner is
+   (transitively) waiting for a black hole owned by the calling thread.
+   A thread only stops waiting once the value it waits for is no longer
+   a black hole, so a cycle found this way is permanent. The walk is
+   bounded in case it runs into a cycle that doesn't involve us. */
+LocalNoInline(bool waitIsCyclic(const Value & v))
+{
+    auto self = currentEvalThread();
+    auto w = &v;
+    for (size_t n = 0; n < 1024; ++n) {
+        auto owner = (const EvalThread *) w->blackholeOwner();
+        /* The owner is only meaningful if the value is still a black
+           hole after reading it. */
+        if (w->loadType() != tBlackhole) return false;
+        if (owner == self) return true;
+        w = owner->waitingFor.load();
+        if (!w) return false;
+    }
+    return false;
+}
+
+
+/* Values may be shared between threads, so a thunk or application is
+   claimed before it is forced. A thread that finds a black hole
+   created by another thread waits for that thread's result; one that
+   finds its own, or whose wait would close a cycle of threads waiting
+   for each other, has hit infinite recursion. */
+void EvalState::forceValue(Value & v, const PosIdx pos)
+{
+    while (true) {
+        auto type = v.loadType();
+
+        if (type == tThunk) {
+            if (memoryLimitExceeded) reclaimMemory();
+            if (!v.claim(tThunk)) continue;
+            Env * env = v.thunk.env;
+            Expr * expr = v.thunk.expr;
+            v.setBlackholeOwner(currentEvalThread());
+            Value result;
+            try {
+                //checkInterrupt();
+                expr->eval(*this, *env, result);
+            } catch (...) {
+                result.mkThunk(env, expr);
+                v.finishValue(result);
+                throw;
+            }
+            v.finishValue(result);
+        }
+
+        else if (type == tApp) {
+            if (!v.claim(tApp)) continue;
+            Value * left = v.app.left;
+            Value * right = v.app.right;
+            v.setBlackholeOwner(currentEvalThread());
+            Value result;
+            try {
+                callFunction(*left, *right, result, noPos);
+            } catch (...) {
+                result.mkApp(left, right);
+                v.finishValue(result);
+                throw;
+            }
+            v.finishValue(result);
+        }
+
+        else if (type == tBlackhole) {
+            auto self = currentEvalThread();
+            if (v.blackholeOwner() == self)
+                throwEvalError(positions[pos], "infinite recursion encountered");
+            self->waitingFor = &v;
+            bool cyclic = false;
+            while (v.loadType() == tBlackhole && !(cyclic = waitIsCyclic(v)))
+                std::this_thread::yield();
+            self->waitingFor = nullptr;
+            if (cyclic)
+                throwEvalError(positions[pos], "infinite recursion encountered");
+            continue;
         }
+
+        return;
     }
-    else if (v.isApp())
-        callFunction(*v.app.left, *v.app.right, v, noPos);
-    else if (v.isBlackhole())
-        throwEvalError(pos, "infinite recursion encountered");
 }
 
 
@@ -59,11 +140,11 @@ inline void EvalState::forceAttrs(Value & v)
 }
 
 
-inline void EvalState::forceAttrs(Value & v, const Pos & pos)
+inline void EvalState::forceAttrs(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (v.type() != nAttrs)
-        throwTypeError(pos, "value is %1% while a set was expected", v);
+        throwTypeError(positions[pos], "value is %1% while a set was expected", v);
 }
 
 
@@ -75,11 +156,11 @@ inline void EvalState::forceList(Value & v)
 }
 
 
-inline void EvalState::forceList(Value & v, const Pos & pos)
+inline void EvalState::forceList(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (!v.isList())
-        throwTypeError(pos, "value is %1% while a list was expected", v);
+        throwTypeError(positions[pos], "value is %1% while a list was expected", v);
 }
 
 /* Note: Various places expect the allocated memory to be zeroed. */
@@ -0,0 +1,572 @@
+#include "eval-snapshot.hh"
+#include "parse-cache.hh"
+#include "globals.hh"
+#include "store-api.hh"
+#include "util.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+
+namespace nix {
+
+
+static const std::string snapshotMagic = "nix-eval-snapshot-2";
+
+
+/* The kinds of nodes in a snapshot. */
+enum : uint64_t {
+    nodeValue = 1,
+    nodeEnv,
+    nodeBuiltin,
+};
+
+
+enum : uint64_t {
+    tagInt = 1,
+    tagFloat,
+    tagBool,
+    tagNull,
+    tagString,
+    tagPath,
+    tagAttrs,
+    tagList,
+    tagThunk,
+    tagApp,
+    tagLambda,
+    tagPrimOp,
+    tagPrimOpApp,
+};
+
+
+/* References to nodes: 0 is a null pointer, 1 is the base
+   environment, and n >= 2 is the (n - 2)th node. */
+static const uint64_t refNull = 0;
+static const uint64_t refBaseEnv = 1;
+static const uint64_t firstNodeRef = 2;
+
+
+/* Return a string that changes if the contents of 'path' might have
+   changed. */
+static std::optional<std::string> fingerprintFile(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) return {};
+    return fmt("%d:%d:%d:%d", st.st_ino, st.st_size, st.st_mtime, st.st_ctime);
+}
+
+
+struct SnapshotWriter
+{
+    EvalState & state;
+
+    /* The node records, written by an ExprWriter so that parse trees
+       and symbols (and the sources of positions) are shared across
+       the whole snapshot. */
+    ExprWriter writer;
+
+    struct Node
+    {
+        uint64_t kind;
+        void * p;
+    };
+
+    /* Values and environments are numbered in the order in which
+       they're first reached. Nodes are written in that order rather
+       than recursively, since the heap can be arbitrarily deep. */
+    std::vector<Node> nodes;
+    std::unordered_map<const void *, uint64_t> ids;
+
+    /* The values of the base environment, which are written by name
+       so that the reader uses its own. */
+    std::unordered_map<const Value *, std::string> builtins;
+
+    SnapshotWriter(EvalState & state) : state(state), writer(state.positions, true)
+    {
+        for (auto & [name, displ] : state.staticBaseEnv.vars)
+            builtins.emplace(state.baseEnv.values[displ], (const string &) name);
+    }
+
+    uint64_t ref(void * p, uint64_t kind)
+    {
+        auto [i, inserted] = ids.emplace(p, nodes.size() + firstNodeRef);
+        if (inserted) nodes.push_back({kind, p});
+        return i->second;
+    }
+
+    uint64_t valueRef(Value * v)
+    {
+        if (!v) return refNull;
+        return ref(v, builtins.count(v) ? nodeBuiltin : nodeValue);
+    }
+
+    uint64_t envRef(Env * env)
+    {
+        if (!env) return refNull;
+        if (env == &state.baseEnv) return refBaseEnv;
+        return ref(env, nodeEnv);
+    }
+
+    void writeValue(Value & v)
+    {
+        auto & sink(writer.sink);
+
+        if (v.isThunk()) {
+            sink << tagThunk << envRef(v.thunk.env);
+            writer.writeExpr(v.thunk.expr);
+        }
+
+        else if (v.isApp())
+            sink << tagApp << valueRef(v.app.left) << valueRef(v.app.right);
+
+        else if (v.isBlackhole())
+            throw Error("cannot snapshot a value that is being evaluated");
+
+        else if (v.isLambda()) {
+            sink << tagLambda << envRef(v.lambda.env);
+            writer.writeExpr(v.lambda.fun);
+        }
+
+        else if (v.isPrimOp()) {
+            sink << tagPrimOp;
+            writer.writeSymbol(v.primOp->name);
+        }
+
+        else if (v.isPrimOpApp())
+            sink << tagPrimOpApp << valueRef(v.primOpApp.left) << valueRef(v.primOpApp.right);
+
+        else switch (v.type()) {
+
+        case nInt:
+            sink << tagInt << (uint64_t) v.integer;
+            break;
+
+        case nFloat: {
+            uint64_t n;
+            static_assert(sizeof(n) == sizeof(v.fpoint));
+            memcpy(&n, &v.fpoint, sizeof(n));
+            sink << tagFloat << n;
+            break;
+        }
+
+        case nBool:
+            sink << tagBool << v.boolean;
+            break;
+
+        case nNull:
+            sink << tagNull;
+            break;
+
+        case nString: {
+            sink << tagString << v.string.s;
+            uint64_t n = 0;
+            if (v.string.context)
+                while (v.string.context[n]) n++;
+            sink << n;
+            for (uint64_t i = 0; i < n; ++i)
+                sink << v.string.context[i];
+            break;
+        }
+
+        case nPath:
+            sink << tagPath << v.path;
+            break;
+
+        case nAttrs:
+            sink << tagAttrs << v.attrs->size();
+            for (auto & i : *v.attrs) {
+                writer.writeSymbol(i.name);
+                sink << valueRef(i.value);
+                writer.writePos(i.pos);
+            }
+            break;
+
+        case nList:
+            sink << tagList << v.listSize();
+            for (size_t n = 0; n < v.listSize(); ++n)
+                sink << valueRef(v.listElems()[n]);
+            break;
+
+        default:
+            throw Error("cannot snapshot %s", showType(v));
+        }
+    }
+
+    void writeEnv(Env & env)
+    {
+        auto & sink(writer.sink);
+
+        sink << env.type << env.prevWith << envRef(env.up);
+
+        /* Environments are often larger than needed (e.g. the one of
+           the REPL), so only write up to the last value. */
+        uint32_t n = env.size;
+        while (n && !env.values[n - 1]) n--;
+        sink << n;
+
+        for (uint32_t i = 0; i < n; ++i)
+            if (i == 0 && env.type == Env::HasWithExpr)
+                writer.writeExpr((Expr *) env.values[0]);
+            else
+                sink << valueRef(env.values[i]);
+    }
+
+    void writeNodes()
+    {
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            auto node = nodes[n];
+            if (node.kind == nodeValue)
+                writeValue(*(Value *) node.p);
+            else if (node.kind == nodeEnv)
+                writeEnv(*(Env *) node.p);
+        }
+    }
+
+    void write(const SnapshotRoots & roots, const Path & path)
+    {
+        StringSink header;
+        header << snapshotMagic << nixVersion << state.store->storeDir;
+
+        header << roots.size();
+        for (auto & [name, v] : roots)
+            header << name << valueRef(v);
+
+        std::vector<std::tuple<Path, std::string, Value *>> files;
+        for (auto & [file, v] : *state.fileEvalCache.lock())
+            if (auto fingerprint = fingerprintFile(file))
+                files.emplace_back(file, *fingerprint, &v);
+        header << files.size();
+        for (auto & [file, fingerprint, v] : files)
+            header << file << fingerprint << valueRef(v);
+
+        writeNodes();
+
+        header << nodes.size();
+        for (auto & node : nodes) {
+            header << node.kind;
+            if (node.kind == nodeEnv)
+                header << ((Env *) node.p)->size;
+            else if (node.kind == nodeBuiltin)
+                header << builtins.at((Value *) node.p);
+        }
+
+        auto tmpPath = fmt("%s.tmp-%d", path, getpid());
+        AutoDelete tmp(tmpPath, false);
+        writeFile(tmpPath, *header.s + *writer.sink.s);
+        if (rename(tmpPath.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, path);
+        tmp.cancel();
+    }
+};
+
+
+void writeEvalSnapshot(EvalState & state, const SnapshotRoots & roots, const Path & path)
+{
+    SnapshotWriter(state).write(roots, path);
+}
+
+
+struct SnapshotReader
+{
+    EvalState & state;
+    const Path & path;
+    ExprReader reader;
+
+    struct Node
+    {
+        uint64_t kind;
+        void * p;
+    };
+
+    /* The nodes are kept in a traced vector, since nothing else refers
+       to them until the snapshot has been read completely. */
+#if HAVE_BOEHMGC
+    std::vector<Node, traceable_allocator<Node>> nodes;
+#else
+    std::vector<Node> nodes;
+#endif
+
+    std::map<Symbol, PrimOp *> primOps;
+
+    /* The store paths in string contexts, which must still be valid. */
+    StorePathSet storePaths;
+
+    SnapshotReader(EvalState & state, const Path & path, const std::string & data)
+        : state(state), path(path), reader(data, state.symbols, state.positions, true)
+    {
+        /* Constants are applications of a primop (see addPrimOp()), so
+           look for primops there as well. */
+        for (auto & [name, displ] : state.staticBaseEnv.vars) {
+            auto v = state.baseEnv.values[displ];
+            if (v->isApp() && v->app.left->isPrimOp()) v = v->app.left;
+            if (v->isPrimOp()) primOps.emplace(v->primOp->name, v->primOp);
+        }
+    }
+
+    [[noreturn]] void corrupt()
+    {
+        throw Error("snapshot '%s' is corrupt", path);
+    }
+
+    uint64_t readNum()
+    {
+        return reader.readNum();
+    }
+
+    std::string readString()
+    {
+        return nix::readString(reader.source);
+    }
+
+    Node & node(uint64_t ref)
+    {
+        if (ref < firstNodeRef || ref - firstNodeRef >= nodes.size()) corrupt();
+        return nodes[ref - firstNodeRef];
+    }
+
+    Value * readValueRef()
+    {
+        auto ref = readNum();
+        if (ref == refNull) return nullptr;
+        auto & n = node(ref);
+        if (n.kind == nodeEnv) corrupt();
+        return (Value *) n.p;
+    }
+
+    Value * readNonNullValueRef()
+    {
+        auto v = readValueRef();
+        if (!v) corrupt();
+        return v;
+    }
+
+    Env * readEnvRef()
+    {
+        auto ref = readNum();
+        if (ref == refNull) return nullptr;
+        if (ref == refBaseEnv) return &state.baseEnv;
+        auto & n = node(ref);
+        if (n.kind != nodeEnv) corrupt();
+        return (Env *) n.p;
+    }
+
+    Expr * readNonNullExpr()
+    {
+        auto e = reader.readExpr();
+        if (!e) corrupt();
+        return e;
+    }
+
+    void readNodeKinds()
+    {
+        auto count = readNum();
+        for (uint64_t n = 0; n < count; ++n) {
+            auto kind = readNum();
+            if (kind == nodeValue)
+                nodes.push_back({kind, state.allocValue()});
+            else if (kind == nodeEnv) {
+                auto size = readNum();
+                if (size > std::numeric_limits<uint32_t>::max()) corrupt();
+                nodes.push_back({kind, &state.allocEnv(size)});
+            }
+            else if (kind == nodeBuiltin) {
+                auto name = readString();
+                auto i = state.staticBaseEnv.vars.find(state.symbols.create(name));
+                if (i == state.staticBaseEnv.vars.end())
+                    throw Error("snapshot '%s' refers to unknown builtin '%s'", path, name);
+                nodes.push_back({kind, state.baseEnv.values[i->second]});
+            }
+            else
+                corrupt();
+        }
+    }
+
+    void readValue(Value & v)
+    {
+        switch (readNum()) {
+
+        case tagInt:
+            v.mkInt((NixInt) readNum());
+            break;
+
+        case tagFloat: {
+            auto n = readNum();
+            NixFloat f;
+            memcpy(&f, &n, sizeof(f));
+            v.mkFloat(f);
+            break;
+        }
+
+        case tagBool:
+            v.mkBool(readNum() != 0);
+            break;
+
+        case tagNull:
+            v.mkNull();
+            break;
+
+        case tagString: {
+            auto s = readString();
+            PathSet context;
+            auto n = readNum();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto c = readString();
+                storePaths.insert(state.store->parseStorePath(decodeContext(c).first));
+                context.insert(std::move(c));
+            }
+            mkString(v, s, context);
+            break;
+        }
+
+        case tagPath:
+            mkPath(v, readString().c_str());
+            break;
+
+        case tagAttrs: {
+            auto n = readNum();
+            state.mkAttrs(v, n);
+            for (uint64_t i = 0; i < n; ++i) {
+                auto name = reader.readSymbol();
+                auto value = readNonNullValueRef();
+                v.attrs->push_back(Attr(name, value, reader.readPos()));
+            }
+            /* Symbols are ordered differently in this process. */
+            v.attrs->sort();
+            break;
+        }
+
+        case tagList: {
+            auto n = readNum();
+            state.mkList(v, n);
+            for (uint64_t i = 0; i < n; ++i)
+                v.listElems()[i] = readNonNullValueRef();
+            break;
+        }
+
+        case tagThunk: {
+            auto env = readEnvRef();
+            if (!env) corrupt();
+            v.mkThunk(env, readNonNullExpr());
+            break;
+        }
+
+        case tagApp: {
+            auto left = readNonNullValueRef();
+            v.mkApp(left, readNonNullValueRef());
+            break;
+        }
+
+        case tagLambda: {
+            auto env = readEnvRef();
+            auto fun = dynamic_cast<ExprLambda *>(reader.readExpr());
+            if (!env || !fun) corrupt();
+            v.mkLambda(env, fun);
+            break;
+        }
+
+        case tagPrimOp: {
+            auto name = reader.readSymbol();
+            auto i = primOps.find(name);
+            if (i == primOps.end())
+                throw Error("snapshot '%s' refers to unknown primop '%s'", path, name);
+            v.mkPrimOp(i->second);
+            break;
+        }
+
+        case tagPrimOpApp: {
+            auto left = readNonNullValueRef();
+            v.mkPrimOpApp(left, readNonNullValueRef());
+            break;
+        }
+
+        default:
+            corrupt();
+        }
+    }
+
+    void readEnv(Env & env)
+    {
+        auto type = readNum();
+        if (type > Env::HasWithAttrs) corrupt();
+        env.type = (decltype(env.type)) type;
+        env.prevWith = readNum();
+        env.up = readEnvRef();
+
+        auto n = readNum();
+        if (n > env.size) corrupt();
+        for (uint64_t i = 0; i < n; ++i)
+            if (i == 0 && env.type == Env::HasWithExpr)
+                env.values[0] = (Value *) readNonNullExpr();
+            else
+                env.values[i] = readValueRef();
+    }
+
+    void readNodes()
+    {
+        for (auto & node : nodes) {
+            if (node.kind == nodeValue)
+                readValue(*(Value *) node.p);
+            else if (node.kind == nodeEnv)
+                readEnv(*(Env *) node.p);
+        }
+    }
+
+    SnapshotRoots read()
+    {
+        if (readString() != snapshotMagic || readString() != nixVersion)
+            throw Error("'%s' is not a snapshot written by this version of Nix", path);
+        if (readString() != state.store->storeDir)
+            throw Error("snapshot '%s' was written for a different Nix store", path);
+
+        /* The roots and files refer to nodes that are only allocated
+           later, so remember their references. */
+        std::vector<std::pair<std::string, uint64_t>> roots;
+        for (auto n = readNum(); n; --n) {
+            auto name = readString();
+            roots.emplace_back(name, readNum());
+        }
+
+        std::vector<std::pair<Path, uint64_t>> files;
+        for (auto n = readNum(); n; --n) {
+            auto file = readString();
+            auto fingerprint = readString();
+            auto ref = readNum();
+            if (fingerprintFile(file) == fingerprint)
+                files.emplace_back(file, ref);
+            else
+                debug("not using the snapshot of '%s' because it has changed", file);
+        }
+
+        readNodeKinds();
+        readNodes();
+
+        auto valid = state.store->queryValidPaths(storePaths);
+        if (valid.size() != storePaths.size())
+            throw Error("snapshot '%s' refers to store paths that are no longer valid", path);
+
+        auto getValue = [&](uint64_t ref) -> Value & {
+            auto & n = node(ref);
+            if (n.kind == nodeEnv) corrupt();
+            return *(Value *) n.p;
+        };
+
+        auto fileEvalCache(state.fileEvalCache.lock());
+        for (auto & [file, ref] : files)
+            fileEvalCache->emplace(file, getValue(ref));
+
+        SnapshotRoots result;
+        for (auto & [name, ref] : roots)
+            result.emplace(name, &getValue(ref));
+        return result;
+    }
+};
+
+
+SnapshotRoots readEvalSnapshot(EvalState & state, const Path & path)
+{
+    auto data = readFile(path);
+    return SnapshotReader(state, path, data).read();
+}
+
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "eval.hh"
+
+namespace nix {
+
+/* Snapshots of a part of the evaluator heap. A snapshot contains the
+   values reachable from a set of named roots, including unevaluated
+   thunks together with their environments and parse trees, and the
+   contents of the file evaluation cache. Reading it into another
+   EvalState reconstructs those values, so that evaluation continues
+   where the writer left off, without parsing or evaluating anything
+   again. References to builtins are resolved against the builtins of
+   the reading EvalState. */
+
+#if HAVE_BOEHMGC
+typedef std::map<std::string, Value *, std::less<std::string>, traceable_allocator<std::pair<const std::string, Value *> > > SnapshotRoots;
+#else
+typedef std::map<std::string, Value *> SnapshotRoots;
+#endif
+
+/* Write the values reachable from 'roots' to the file 'path'. Throws
+   an Error if a value can't be stored in a snapshot, e.g. because
+   it's an external value or is currently being evaluated. */
+void writeEvalSnapshot(EvalState & state, const SnapshotRoots & roots, const Path & path);
+
+/* Read a snapshot written by writeEvalSnapshot() and return its
+   roots. The evaluated files in the snapshot are added to the file
+   evaluation cache of 'state', unless they have changed since the
+   snapshot was written. Throws an Error if the snapshot is corrupt,
+   was written by another version of Nix, or refers to store paths
+   that are no longer valid. */
+SnapshotRoots readEvalSnapshot(EvalState & state, const Path & path);
+
+}
@@ -1,5 +1,6 @@
 #include "eval.hh"
 #include "hash.hh"
+#include "archive.hh"
 #include "util.hh"
 #include "store-api.hh"
 #include "derivations.hh"
@@ -8,8 +9,13 @@
 #include "filetransfer.hh"
 #include "json.hh"
 #include "function-trace.hh"
+#include "fetchers.hh"
+#include "thread-pool.hh"
+#include "fs-cache.hh"
+#include "value-traversal.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstring>
 #include <unistd.h>
@@ -250,6 +256,91 @@ static BoehmGCStackAllocator boehmGCStackAllocator;
 #endif
 
 
+EvalPhase & currentEvalPhase()
+{
+    static thread_local EvalPhase phase = EvalPhase::Evaluation;
+    return phase;
+}
+
+
+#if HAVE_BOEHMGC
+
+/* Statistics about garbage collection cycles, gathered through
+   libgc's collection event callback. */
+struct GCStats
+{
+    /* Number of collections, and the total and maximum time spent
+       in them, in microseconds. */
+    uint64_t cycles = 0;
+    uint64_t totalPause = 0;
+    uint64_t maxPause = 0;
+
+    /* Histogram of collection pauses: < 1 ms, < 10 ms, < 100 ms,
+       < 1 s, and longer. */
+    uint64_t pauses[5] = {};
+
+    /* The largest heap size seen at the end of a collection. */
+    uint64_t maxHeapSize = 0;
+
+    void record(uint64_t pause, uint64_t heapSize)
+    {
+        cycles++;
+        totalPause += pause;
+        maxPause = std::max(maxPause, pause);
+        size_t bucket = 0;
+        for (uint64_t limit = 1000; bucket < 4 && pause >= limit; limit *= 10) bucket++;
+        pauses[bucket]++;
+        maxHeapSize = std::max(maxHeapSize, heapSize);
+    }
+
+    void toJSON(JSONObject & obj) const
+    {
+        obj.attr("cycles", cycles);
+        obj.attr("totalPauseMicroseconds", totalPause);
+        obj.attr("maxPauseMicroseconds", maxPause);
+        obj.attr("maxHeapSize", maxHeapSize);
+        auto res = obj.object("pauses");
+        res.attr("<1ms", pauses[0]);
+        res.attr("<10ms", pauses[1]);
+        res.attr("<100ms", pauses[2]);
+        res.attr("<1s", pauses[3]);
+        res.attr(">=1s", pauses[4]);
+    }
+};
+
+/* Totals, and the same broken down by EvalPhase. */
+static GCStats gcStats;
+static GCStats gcPhaseStats[3];
+
+static std::chrono::steady_clock::time_point gcStart;
+
+/* Set at the end of every collection, so that the evaluator checks
+   the `eval-memory-limit` setting at its next allocation. The
+   collector's lock is held here, so the heap can't be queried
+   yet. */
+static std::atomic<bool> gcCollected{false};
+
+static void onGCEvent(GC_EventType event)
+{
+    if (event == GC_EVENT_START)
+        gcStart = std::chrono::steady_clock::now();
+
+    else if (event == GC_EVENT_END) {
+        uint64_t pause = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - gcStart).count();
+        /* The "unsafe" variant is the one meant to be called with
+           the collector's lock held. */
+        GC_prof_stats_s stats;
+        GC_get_prof_stats_unsafe(&stats, sizeof(stats));
+        gcStats.record(pause, stats.heapsize_full);
+        gcPhaseStats[(size_t) currentEvalPhase()].record(pause, stats.heapsize_full);
+        gcCollected.store(true, std::memory_order_relaxed);
+    }
+}
+
+#endif
+
+
 static Symbol getName(const AttrName & name, EvalState & state, Env & env)
 {
     if (name.symbol.set()) {
@@ -284,18 +375,53 @@ void initGC()
 
     GC_set_oom_fn(oomHandler);
 
+    GC_set_on_collection_event(onGCEvent);
+
     StackAllocator::defaultAllocator = &boehmGCStackAllocator;
 
+    if (evalSettings.gcIncremental)
+        GC_enable_incremental();
+
+#endif
+
+    gcInitialised = true;
+
+    startupPhase("garbage collector");
+}
+
+
+/* Size the garbage collector's heap. This is done when the first
+   EvalState is created rather than in initGC(), so that programs that
+   don't evaluate anything don't pay for it, and so that the settings
+   can be set on the command line. */
+static void sizeGCHeap()
+{
+#if HAVE_BOEHMGC
+    static bool gcHeapSized = false;
+    if (gcHeapSized) return;
+    gcHeapSized = true;
+
+    if (evalSettings.gcFreeSpaceDivisor)
+        GC_set_free_space_divisor(evalSettings.gcFreeSpaceDivisor);
+
+    if (evalSettings.gcMaxHeapSize)
+        GC_set_max_heap_size(evalSettings.gcMaxHeapSize);
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
        fairly significant overhead.)  The heap size can be overridden
-       through libgc's GC_INITIAL_HEAP_SIZE environment variable.  We
-       should probably also provide a nix.conf setting for this.  Note
-       that GC_expand_hp() causes a lot of virtual, but not physical
-       (resident) memory to be allocated.  This might be a problem on
-       systems that don't overcommit. */
-    if (!getEnv("GC_INITIAL_HEAP_SIZE")) {
+       through libgc's GC_INITIAL_HEAP_SIZE environment variable or
+       the `gc-initial-heap-size' setting.  Note that GC_expand_hp()
+       causes a lot of virtual, but not physical (resident) memory to
+       be allocated.  This might be a problem on systems that don't
+       overcommit. */
+    if (evalSettings.gcInitialHeapSize) {
+        debug("setting initial heap size to %1% bytes", evalSettings.gcInitialHeapSize);
+        GC_expand_hp(evalSettings.gcInitialHeapSize);
+    }
+
+    else if (!getEnv("GC_INITIAL_HEAP_SIZE")) {
         size_t size = 32 * 1024 * 1024;
 #if HAVE_SYSCONF && defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
         size_t maxSize = 384 * 1024 * 1024;
@@ -308,10 +434,7 @@ void initGC()
         debug(format("setting initial heap size to %1% bytes") % size);
         GC_expand_hp(size);
     }
-
 #endif
-
-    gcInitialised = true;
 }
 
 
@@ -386,6 +509,7 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , sEpsilon(symbols.create(""))
     , repair(NoRepair)
     , store(store)
+    , fsCache(std::make_shared<FSCache>(store->storeDir))
     , regexCache(makeRegexCache())
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
@@ -394,6 +518,8 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 
     assert(gcInitialised);
 
+    sizeGCHeap();
+
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
 
     /* Initialise the Nix expression search path. */
@@ -425,24 +551,54 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
         }
     }
 
+    if (evalSettings.profileFile != "" || evalSettings.evalMemoryLimit)
+        profiler = std::make_unique<EvalProfiler>(*this);
+
     vEmptySet.mkAttrs(allocBindings(0));
 
+    smallInts.reserve(smallIntCount);
+    for (NixInt n = 0; n < smallIntCount; ++n) {
+        auto v = allocValue();
+        mkInt(*v, n);
+        smallInts.push_back(v);
+    }
+
     createBaseEnv();
 }
 
 
 EvalState::~EvalState()
 {
+    try {
+        waitForSourceCopies();
+    } catch (...) {
+        ignoreException();
+    }
+
+    if (profiler && evalSettings.profileFile != "") {
+        try {
+            profiler->write(evalSettings.profileFile, evalSettings.profileWeight);
+        } catch (...) {
+            ignoreException();
+        }
+    }
 }
 
 
-Path EvalState::checkSourcePath(const Path & path_)
+Path EvalState::checkSourcePath(const Path & path0)
 {
+    auto path_ = rewriteLazyPath(path0);
+
+    if (trackedInputs) trackedInputs->paths.insert(path_);
+
     if (!allowedPaths) return path_;
 
-    auto i = resolvedPaths.find(path_);
-    if (i != resolvedPaths.end())
-        return i->second;
+    {
+        auto resolvedPaths_(resolvedPaths.lock());
+        auto i = resolvedPaths_->find(path_);
+        if (i != resolvedPaths_->end())
+            return i->second;
+    }
 
     bool found = false;
 
@@ -466,11 +622,11 @@ Path EvalState::checkSourcePath(const Path & path_)
 
     /* Resolve symlinks. */
     debug(format("checking access to '%s'") % abspath);
-    Path path = canonPath(abspath, true);
+    Path path = fsCache->canonPath(abspath);
 
     for (auto & i : *allowedPaths) {
         if (isDirOrInDir(path, i)) {
-            resolvedPaths[path_] = path;
+            resolvedPaths.lock()->insert_or_assign(path_, path);
             return path;
         }
     }
@@ -513,6 +669,9 @@ void EvalState::checkURI(const std::string & uri)
 
 Path EvalState::toRealPath(const Path & path, const PathSet & context)
 {
+    if (auto path2 = rewriteLazyPath(path); path2 != path)
+        return path2;
+
     // FIXME: check whether 'path' is in 'context'.
     return
         !context.empty() && store->isInStore(path)
@@ -521,6 +680,49 @@ Path EvalState::toRealPath(const Path & path, const PathSet & context)
 }
 
 
+void EvalState::registerTree(const fetchers::Tree & tree)
+{
+    auto storePath = store->printStorePath(tree.storePath);
+
+    if (tree.actualPath != store->toRealPath(storePath)) {
+        lazyTrees.insert_or_assign(storePath, tree.actualPath);
+        /* Allow access to the store path once it has been copied. */
+        if (allowedPaths)
+            allowedPaths->insert(store->toRealPath(storePath));
+    }
+
+    if (allowedPaths)
+        allowedPaths->insert(tree.actualPath);
+}
+
+
+Path EvalState::rewriteLazyPath(const Path & path)
+{
+    if (lazyTrees.empty() || !store->isInStore(path)) return path;
+
+    auto [storePath, rest] = store->toStorePath(path);
+
+    auto i = lazyTrees.find(store->printStorePath(storePath));
+    if (i == lazyTrees.end()) return path;
+
+    return i->second + rest;
+}
+
+
+void EvalState::copyLazyTree(const StorePath & storePath)
+{
+    if (sourceCopies_.lock()->pending.count(store->printStorePath(storePath)))
+        waitForSourceCopies();
+
+    auto i = lazyTrees.find(store->printStorePath(storePath));
+    if (i == lazyTrees.end()) return;
+
+    fetchers::ensureTreeInStore(store, fetchers::Tree(Path(i->second), StorePath(storePath)));
+
+    lazyTrees.erase(i);
+}
+
+
 Value * EvalState::addConstant(const string & name, Value & v)
 {
     Value * v2 = allocValue();
@@ -598,7 +800,7 @@ std::optional<EvalState::Doc> EvalState::getDoc(Value & v)
             v2 = v2->primOpApp.left;
         if (v2->primOp->doc)
             return Doc {
-                .pos = noPos,
+                .pos = Pos(),
                 .name = v2->primOp->name,
                 .arity = v2->primOp->arity,
                 .args = v2->primOp->args,
@@ -657,10 +859,10 @@ LocalNoInlineNoReturn(void throwTypeError(const Pos & pos, const char * s))
     });
 }
 
-LocalNoInlineNoReturn(void throwTypeError(const Pos & pos, const char * s, const ExprLambda & fun, const Symbol & s2))
+LocalNoInlineNoReturn(void throwTypeError(const Pos & pos, const char * s, const EvalState & state, const ExprLambda & fun, const Symbol & s2))
 {
     throw TypeError({
-        .msg = hintfmt(s, fun.showNamePos(), s2),
+        .msg = hintfmt(s, fun.showNamePos(state), s2),
         .errPos = pos
     });
 }
@@ -727,12 +929,17 @@ void mkPath(Value & v, const char * s)
 }
 
 
+static unsigned long nrWithLookups = 0;
+static unsigned long nrWithCacheHits = 0;
+
 inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 {
     for (size_t l = var.level; l; --l, env = env->up) ;
 
     if (!var.fromWith) return env->values[var.displ];
 
+    nrWithLookups++;
+
     while (1) {
         if (env->type == Env::HasWithExpr) {
             if (noEval) return 0;
@@ -741,13 +948,24 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
             env->values[0] = v;
             env->type = Env::HasWithAttrs;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
-            if (countCalls && j->pos) attrSelects[*j->pos]++;
+        Bindings * attrs = env->values[0]->attrs;
+        /* Since the names in a set are unique, the cached position is
+           valid if it has the right name, regardless of which set it
+           was cached for. */
+        Bindings::iterator j;
+        if (var.withCacheIndex < attrs->size()
+            && (j = attrs->begin() + var.withCacheIndex)->name == var.name)
+            nrWithCacheHits++;
+        else {
+            j = attrs->find(var.name);
+            if (j != attrs->end()) var.withCacheIndex = j - attrs->begin();
+        }
+        if (j != attrs->end()) {
+            if (countCalls && j->pos) attrSelects[j->pos]++;
             return j->value;
         }
         if (!env->prevWith)
-            throwUndefinedVarError(var.pos, "undefined variable '%1%'", var.name);
+            throwUndefinedVarError(positions[var.pos], "undefined variable '%1%'", var.name);
         for (size_t l = env->prevWith; l; --l, env = env->up) ;
     }
 }
@@ -760,21 +978,100 @@ void finalizeValue(void * obj, void * data)
     nrValuesFreed++;
 }
 
+#if HAVE_BOEHMGC
+/* Take an object from a free list returned by GC_malloc_many(),
+   refilling the list if it's empty. The first word of each object
+   points to the next one, so it must be cleared; the rest of the
+   object is already zeroed. */
+static inline void * allocFromList(void * & list, size_t size)
+{
+    if (!list) {
+        list = GC_malloc_many(size);
+        if (!list) throw std::bad_alloc();
+    }
+    void * p = list;
+    list = GC_NEXT(p);
+    GC_NEXT(p) = nullptr;
+    return p;
+}
+
+
+/* Free lists of Values and of Envs with up to maxCachedEnvSize values,
+   obtained in batches from GC_malloc_many(). They are per thread, so
+   evaluator threads neither contend for them nor need a lock. The
+   lists are kept in uncollectable memory, which the collector scans,
+   so that it doesn't reclaim the objects on them; it doesn't scan
+   thread-local storage. When the thread exits, the lists are freed
+   and the objects on them are left to the collector. */
+static constexpr size_t maxCachedEnvSize = 4;
+
+struct AllocCache
+{
+    void * values = nullptr;
+    void * envs[maxCachedEnvSize + 1] = {};
+};
+
+static AllocCache & getAllocCache()
+{
+    static thread_local std::unique_ptr<AllocCache, void (*)(AllocCache *)> cache(
+        []() {
+            auto p = GC_MALLOC_UNCOLLECTABLE(sizeof(AllocCache));
+            if (!p) throw std::bad_alloc();
+            return new (p) AllocCache;
+        }(),
+        [](AllocCache * p) { GC_FREE(p); });
+    return *cache;
+}
+#endif
+
+
 Value * EvalState::allocValue()
 {
     nrValues++;
+#if HAVE_BOEHMGC
+    if (gcCollected.load(std::memory_order_relaxed)) checkMemoryLimit();
+    auto v = (Value *) allocFromList(getAllocCache().values, sizeof(Value));
+#else
     auto v = (Value *) allocBytes(sizeof(Value));
+#endif
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
     return v;
 }
 
 
+Value * EvalState::allocInt(NixInt n)
+{
+    if (n >= 0 && n < smallIntCount) return smallInts[n];
+    auto v = allocValue();
+    mkInt(*v, n);
+    return v;
+}
+
+
+Value * EvalState::allocString(const Symbol & s)
+{
+    auto symbolStrings_(symbolStrings.lock());
+    auto & v = (*symbolStrings_)[s];
+    if (!v) mkString(*(v = allocValue()), s);
+    return v;
+}
+
+
 Env & EvalState::allocEnv(size_t size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+    auto bytes = sizeof(Env) + size * sizeof(Value *);
+#if HAVE_BOEHMGC
+    if (gcCollected.load(std::memory_order_relaxed)) checkMemoryLimit();
+    Env * env = (Env *) (size <= maxCachedEnvSize
+        ? allocFromList(getAllocCache().envs[size], bytes)
+        : allocBytes(bytes));
+#else
+    Env * env = (Env *) allocBytes(bytes);
+#endif
     env->type = Env::Plain;
+    env->size = size;
 
     /* We assume that env->values has been cleared by the allocator; maybeThunk() and lookupVar fromWith expect this. */
 
@@ -806,13 +1103,14 @@ void EvalState::mkThunk_(Value & v, Expr * expr)
 }
 
 
-void EvalState::mkPos(Value & v, Pos * pos)
+void EvalState::mkPos(Value & v, PosIdx p)
 {
-    if (pos && pos->file.set()) {
+    auto pos = positions[p];
+    if (pos.file.set()) {
         mkAttrs(v, 3);
-        mkString(*allocAttr(v, sFile), pos->file);
-        mkInt(*allocAttr(v, sLine), pos->line);
-        mkInt(*allocAttr(v, sColumn), pos->column);
+        mkString(*allocAttr(v, sFile), pos.file);
+        mkInt(*allocAttr(v, sLine), pos.line);
+        mkInt(*allocAttr(v, sColumn), pos.column);
         v.attrs->sort();
     } else
         mkNull(v);
@@ -872,29 +1170,49 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
 {
     auto path = checkSourcePath(path_);
 
-    FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
-    }
+    /* Files in lazy trees are evaluated under their store path
+       rather than their actual location, so that relative paths in
+       them have the same values as when the tree is in the store. */
+    bool lazy = rewriteLazyPath(canonPath(path_)) != canonPath(path_);
+    if (lazy) path = canonPath(path_);
 
-    Path path2 = resolveExprPath(path);
-    if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
+    auto lookup = [&](const Path & path) {
+        auto fileEvalCache_(fileEvalCache.lock());
+        auto i = fileEvalCache_->find(path);
+        if (i == fileEvalCache_->end()) return false;
         v = i->second;
-        return;
-    }
+        return true;
+    };
+
+    if (lookup(path)) return;
+
+    Path path2;
+    if (lazy) {
+        auto [storePath, rest] = store->toStorePath(path);
+        auto storePathS = store->printStorePath(storePath);
+        auto & root = lazyTrees.at(storePathS);
+        path2 = resolveExprPath(root + rest, fsCache.get());
+        if (isDirOrInDir(path2, root))
+            path2 = storePathS + path2.substr(root.size());
+    } else
+        path2 = resolveExprPath(path, fsCache.get());
+    if (lookup(path2)) return;
 
     printTalkative("evaluating file '%1%'", path2);
     Expr * e = nullptr;
 
-    auto j = fileParseCache.find(path2);
-    if (j != fileParseCache.end())
-        e = j->second;
-
-    if (!e)
-        e = parseExprFromFile(checkSourcePath(path2));
+    {
+        auto fileParseCache_(fileParseCache.lock());
+        auto j = fileParseCache_->find(path2);
+        if (j != fileParseCache_->end())
+            e = j->second;
+    }
 
-    fileParseCache[path2] = e;
+    if (!e) {
+        auto realPath2 = checkSourcePath(path2);
+        e = parseExprFromFile(lazy ? path2 : realPath2);
+        fileParseCache.lock()->insert_or_assign(path2, e);
+    }
 
     try {
         // Enforce that 'flake.nix' is a direct attrset, not a
@@ -908,15 +1226,71 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
         throw;
     }
 
-    fileEvalCache[path2] = v;
-    if (path != path2) fileEvalCache[path] = v;
+    auto fileEvalCache_(fileEvalCache.lock());
+    fileEvalCache_->insert_or_assign(path2, v);
+    if (path != path2) fileEvalCache_->insert_or_assign(path, v);
 }
 
 
 void EvalState::resetFileCache()
 {
-    fileEvalCache.clear();
-    fileParseCache.clear();
+    fileEvalCache.lock()->clear();
+    fileParseCache.lock()->clear();
+    fsCache->clear();
+}
+
+
+#if HAVE_BOEHMGC
+static uint64_t heapInUse()
+{
+    GC_word heapSize, freeBytes;
+    GC_get_heap_usage_safe(&heapSize, &freeBytes, 0, 0, 0);
+    return heapSize - freeBytes;
+}
+#endif
+
+
+void EvalState::checkMemoryLimit()
+{
+#if HAVE_BOEHMGC
+    gcCollected = false;
+
+    uint64_t limit = evalSettings.evalMemoryLimit;
+    if (limit && heapInUse() > limit)
+        memoryLimitExceeded = true;
+#endif
+}
+
+
+void EvalState::reclaimMemory()
+{
+#if HAVE_BOEHMGC
+    memoryLimitExceeded = false;
+
+    uint64_t limit = evalSettings.evalMemoryLimit;
+    auto used = heapInUse();
+    if (!limit || used <= limit) return;
+
+    /* Files are evaluated again when they're imported again, so the
+       only cost of dropping these caches is time. */
+    printTalkative("evaluation uses %d MiB, which exceeds the memory limit of %d MiB; dropping caches",
+        used >> 20, limit >> 20);
+    resetFileCache();
+    GC_gcollect();
+    gcCollected = false;
+
+    used = heapInUse();
+    if (used <= limit) return;
+
+    std::string report;
+    if (profiler)
+        for (auto & [name, bytes] : profiler->topAllocations(10))
+            report += fmt("\n  %10.1f MiB  %s", bytes / (1024.0 * 1024.0), name);
+
+    throw EvalError("evaluation uses %d MiB, which exceeds the memory limit of %d MiB (`eval-memory-limit`); "
+        "the functions that allocated the most are:%s",
+        used >> 20, limit >> 20, report.empty() ? " unknown" : report);
+#endif
 }
 
 
@@ -936,12 +1310,12 @@ inline bool EvalState::evalBool(Env & env, Expr * e)
 }
 
 
-inline bool EvalState::evalBool(Env & env, Expr * e, const Pos & pos)
+inline bool EvalState::evalBool(Env & env, Expr * e, const PosIdx pos)
 {
     Value v;
     e->eval(*this, env, v);
     if (v.type() != nBool)
-        throwTypeError(pos, "value is %1% while a Boolean was expected", v);
+        throwTypeError(positions[pos], "value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
 
@@ -1000,8 +1374,10 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 
         /* The recursive attributes are evaluated in the new
            environment, while the inherited attributes are evaluated
-           in the original environment. */
-        size_t displ = 0;
+           in the original environment. The environment is indexed by
+           the displacements assigned by bindVars(), which needn't
+           follow the order of `attrs' if the expression was read from
+           a snapshot written by another process. */
         for (auto & i : attrs) {
             Value * vAttr;
             if (hasOverrides && !i.second.inherited) {
@@ -1009,8 +1385,8 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
                 mkThunk(*vAttr, env2, i.second.e);
             } else
                 vAttr = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
-            env2.values[displ++] = vAttr;
-            v.attrs->push_back(Attr(i.first, vAttr, &i.second.pos));
+            env2.values[i.second.displ] = vAttr;
+            v.attrs->push_back(Attr(i.first, vAttr, i.second.pos));
         }
 
         /* If the rec contains an attribute called `__overrides', then
@@ -1022,7 +1398,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
            been substituted into the bodies of the other attributes.
            Hence we need __overrides.) */
         if (hasOverrides) {
-            Value * vOverrides = (*v.attrs)[overrides->second.displ].value;
+            Value * vOverrides = v.attrs->get(state.sOverrides)->value;
             state.forceAttrs(*vOverrides);
             Bindings * newBnds = state.allocBindings(v.attrs->capacity() + vOverrides->attrs->size());
             for (auto & i : *v.attrs)
@@ -1030,7 +1406,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
             for (auto & i : *vOverrides->attrs) {
                 AttrDefs::iterator j = attrs.find(i.name);
                 if (j != attrs.end()) {
-                    (*newBnds)[j->second.displ] = i;
+                    (*newBnds)[v.attrs->find(i.name) - v.attrs->begin()] = i;
                     env2.values[j->second.displ] = i.value;
                 } else
                     newBnds->push_back(i);
@@ -1042,7 +1418,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 
     else
         for (auto & i : attrs)
-            v.attrs->push_back(Attr(i.first, i.second.e->maybeThunk(state, env), &i.second.pos));
+            v.attrs->push_back(Attr(i.first, i.second.e->maybeThunk(state, env), i.second.pos));
 
     /* Dynamic attrs apply *after* rec and __overrides. */
     for (auto & i : dynamicAttrs) {
@@ -1055,11 +1431,11 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
         Symbol nameSym = state.symbols.create(nameVal.string.s);
         Bindings::iterator j = v.attrs->find(nameSym);
         if (j != v.attrs->end())
-            throwEvalError(i.pos, "dynamic attribute '%1%' already defined at %2%", nameSym, *j->pos);
+            throwEvalError(state.positions[i.pos], "dynamic attribute '%1%' already defined at %2%", nameSym, state.positions[j->pos]);
 
         i.valueExpr->setName(nameSym);
         /* Keep sorted order so find can catch duplicates */
-        v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), &i.pos));
+        v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), i.pos));
         v.attrs->sort(); // FIXME: inefficient
     }
 }
@@ -1074,10 +1450,10 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
 
     /* The recursive attributes are evaluated in the new environment,
        while the inherited attributes are evaluated in the original
-       environment. */
-    size_t displ = 0;
+       environment. As in ExprAttrs::eval(), the environment is
+       indexed by the displacements assigned by bindVars(). */
     for (auto & i : attrs->attrs)
-        env2.values[displ++] = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
+        env2.values[i.second.displ] = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
 
     body->eval(state, env2, v);
 }
@@ -1121,7 +1497,7 @@ unsigned long nrLookups = 0;
 void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
-    Pos * pos2 = 0;
+    PosIdx pos2;
     Value * vAttrs = &vTmp;
 
     e->eval(state, env, vTmp);
@@ -1143,19 +1519,22 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
             } else {
                 state.forceAttrs(*vAttrs, pos);
                 if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
-                    throwEvalError(pos, "attribute '%1%' missing", name);
+                    throwEvalError(state.positions[pos], "attribute '%1%' missing", name);
             }
             vAttrs = j->value;
             pos2 = j->pos;
-            if (state.countCalls && pos2) state.attrSelects[*pos2]++;
+            if (state.countCalls && pos2) state.attrSelects[pos2]++;
         }
 
-        state.forceValue(*vAttrs, ( pos2 != NULL ? *pos2 : this->pos ) );
+        state.forceValue(*vAttrs, pos2 ? pos2 : this->pos);
 
     } catch (Error & e) {
-        if (pos2 && pos2->file != state.sDerivationNix)
-            addErrorTrace(e, *pos2, "while evaluating the attribute '%1%'",
-                showAttrPath(state, env, attrPath));
+        if (pos2) {
+            auto attrPos = state.positions[pos2];
+            if (attrPos.file != state.sDerivationNix)
+                addErrorTrace(e, attrPos, "while evaluating the attribute '%1%'",
+                    showAttrPath(state, env, attrPath));
+        }
         throw;
     }
 
@@ -1196,14 +1575,56 @@ void ExprLambda::eval(EvalState & state, Env & env, Value & v)
 
 void ExprApp::eval(EvalState & state, Env & env, Value & v)
 {
-    /* FIXME: vFun prevents GCC from doing tail call optimisation. */
     Value vFun;
+    if (evalFunction(state, env, vFun, v))
+        state.callFunction(vFun, *(e2->maybeThunk(state, env)), v, pos);
+}
+
+
+bool ExprApp::evalFunction(EvalState & state, Env & env, Value & vFun, Value & v)
+{
+    /* Optimisation: if this is a saturated call to a primop, such as
+       the `__sub a b' that `a - b' desugars to, evaluate the function
+       once and pass all arguments to the primop directly. This avoids
+       allocating a partial application for every argument but the
+       last. */
+    if (!evalSettings.traceFunctionCalls) {
+        const size_t maxArgs = 4;
+        ExprApp * apps[maxArgs];
+        size_t nrArgs = 0;
+        Expr * head = this;
+        for (ExprApp * app; nrArgs < maxArgs && (app = dynamic_cast<ExprApp *>(head)); head = app->e1)
+            apps[nrArgs++] = app;
+
+        if (nrArgs > 1) {
+            head->eval(state, env, vFun);
+            state.forceValue(vFun, pos);
+
+            if (vFun.isPrimOp() && vFun.primOp->arity == nrArgs) {
+                Value * vArgs[maxArgs];
+                for (size_t n = 0; n < nrArgs; ++n)
+                    vArgs[n] = apps[nrArgs - n - 1]->e2->maybeThunk(state, env);
+                state.callPrimOp(vFun, vArgs, v, pos);
+                return false;
+            }
+
+            /* Not a saturated primop call, so apply all but the last
+               argument one at a time. */
+            for (size_t n = nrArgs - 1; n; --n) {
+                Value vTmp;
+                state.callFunction(vFun, *(apps[n]->e2->maybeThunk(state, env)), vTmp, apps[n]->pos);
+                vFun = vTmp;
+            }
+            return true;
+        }
+    }
+
     e1->eval(state, env, vFun);
-    state.callFunction(vFun, *(e2->maybeThunk(state, env)), v, pos);
+    return true;
 }
 
 
-void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
+void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const PosIdx pos)
 {
     /* Figure out the number of arguments still needed. */
     size_t argsDone = 0;
@@ -1227,9 +1648,7 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
             vArgs[n--] = arg->primOpApp.right;
 
         /* And call the primop. */
-        nrPrimOpCalls++;
-        if (countCalls) primOpCalls[primOp->primOp->name]++;
-        primOp->primOp->fun(*this, pos, vArgs, v);
+        callPrimOp(*primOp, vArgs, v, pos);
     } else {
         Value * fun2 = allocValue();
         *fun2 = fun;
@@ -1237,9 +1656,23 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
     }
 }
 
-void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & pos)
+void EvalState::callPrimOp(Value & primOp, Value * * args, Value & v, const PosIdx pos)
+{
+    nrPrimOpCalls++;
+    std::optional<PhaseTimer> timer;
+    if (countCalls) {
+        primOpCalls[primOp.primOp->name]++;
+        timer.emplace(primOpTimes[primOp.primOp->name]);
+    }
+    auto call = profiler ? std::make_unique<ProfiledCall>(*profiler, *primOp.primOp) : nullptr;
+    primOp.primOp->fun(*this, pos, args, v);
+}
+
+void EvalState::callFunction(Value & fun, Value & arg, Value & v, const PosIdx pos)
 {
-    auto trace = evalSettings.traceFunctionCalls ? std::make_unique<FunctionCallTrace>(pos) : nullptr;
+    if (memoryLimitExceeded) reclaimMemory();
+
+    auto trace = evalSettings.traceFunctionCalls ? std::make_unique<FunctionCallTrace>(positions[pos]) : nullptr;
 
     forceValue(fun, pos);
 
@@ -1265,73 +1698,117 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     }
 
     if (!fun.isLambda())
-        throwTypeError(pos, "attempt to call something which is not a function but %1%", fun);
-
-    ExprLambda & lambda(*fun.lambda.fun);
-
-    auto size =
-        (lambda.arg.empty() ? 0 : 1) +
-        (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
-    Env & env2(allocEnv(size));
-    env2.up = fun.lambda.env;
+        throwTypeError(positions[pos], "attempt to call something which is not a function but %1%", fun);
+
+    /* The function, argument and position of the current call. Calls
+       in tail position in the body of a lambda are done by the loop
+       below rather than recursively, so that tail-recursive functions
+       run in constant stack space. */
+    Value vFun = fun;
+    Value * vArg = &arg;
+    PosIdx callPos = pos;
+
+    while (true) {
+        ExprLambda & lambda(*vFun.lambda.fun);
+        Value & arg(*vArg);
+        const PosIdx pos(callPos);
+
+        auto size =
+            (lambda.arg.empty() ? 0 : 1) +
+            (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
+        Env & env2(allocEnv(size));
+        env2.up = vFun.lambda.env;
 
-    size_t displ = 0;
+        size_t displ = 0;
 
-    if (!lambda.matchAttrs)
-        env2.values[displ++] = &arg;
+        if (!lambda.matchAttrs)
+            env2.values[displ++] = &arg;
 
-    else {
-        forceAttrs(arg, pos);
+        else {
+            forceAttrs(arg, pos);
+
+            if (!lambda.arg.empty())
+                env2.values[displ++] = &arg;
+
+            /* For each formal argument, get the actual argument.  If
+               there is no matching actual argument but the formal
+               argument has a default, use the default. */
+            size_t attrsUsed = 0;
+            for (auto & i : lambda.formals->formals) {
+                Bindings::iterator j = arg.attrs->find(i.name);
+                if (j == arg.attrs->end()) {
+                    if (!i.def) throwTypeError(positions[pos], "%1% called without required argument '%2%'",
+                        *this, lambda, i.name);
+                    env2.values[displ++] = i.def->maybeThunk(*this, env2);
+                } else {
+                    attrsUsed++;
+                    env2.values[displ++] = j->value;
+                }
+            }
 
-        if (!lambda.arg.empty())
-            env2.values[displ++] = &arg;
+            /* Check that each actual argument is listed as a formal
+               argument (unless the attribute match specifies a `...'). */
+            if (!lambda.formals->ellipsis && attrsUsed != arg.attrs->size()) {
+                /* Nope, so show the first unexpected argument to the
+                   user. */
+                for (auto & i : *arg.attrs)
+                    if (lambda.formals->argNames.find(i.name) == lambda.formals->argNames.end())
+                        throwTypeError(positions[pos], "%1% called with unexpected argument '%2%'", *this, lambda, i.name);
+                abort(); // can't happen
+            }
+        }
 
-        /* For each formal argument, get the actual argument.  If
-           there is no matching actual argument but the formal
-           argument has a default, use the default. */
-        size_t attrsUsed = 0;
-        for (auto & i : lambda.formals->formals) {
-            Bindings::iterator j = arg.attrs->find(i.name);
-            if (j == arg.attrs->end()) {
-                if (!i.def) throwTypeError(pos, "%1% called without required argument '%2%'",
-                    lambda, i.name);
-                env2.values[displ++] = i.def->maybeThunk(*this, env2);
-            } else {
-                attrsUsed++;
-                env2.values[displ++] = j->value;
+        nrFunctionCalls++;
+        if (countCalls) incrFunctionCall(&lambda);
+
+        /* Evaluate the body.  This is conditional on showTrace, because
+           catching exceptions makes this function not tail-recursive. */
+        if (loggerSettings.showTrace.get()) {
+            auto call = profiler ? std::make_unique<ProfiledCall>(*profiler, lambda) : nullptr;
+            try {
+                lambda.body->eval(*this, env2, v);
+            } catch (Error & e) {
+                addErrorTrace(e, positions[lambda.pos], "while evaluating %s",
+                  (lambda.name.set()
+                      ? "'" + (string) lambda.name + "'"
+                      : "anonymous lambda"));
+                addErrorTrace(e, positions[pos], "from call site%s", "");
+                throw;
             }
+            return;
         }
 
-        /* Check that each actual argument is listed as a formal
-           argument (unless the attribute match specifies a `...'). */
-        if (!lambda.formals->ellipsis && attrsUsed != arg.attrs->size()) {
-            /* Nope, so show the first unexpected argument to the
-               user. */
-            for (auto & i : *arg.attrs)
-                if (lambda.formals->argNames.find(i.name) == lambda.formals->argNames.end())
-                    throwTypeError(pos, "%1% called with unexpected argument '%2%'", lambda, i.name);
-            abort(); // can't happen
+        /* Tail calls would hide calls from the trace and the
+           profiler, so don't do them if either is enabled. */
+        if (trace || profiler) {
+            auto call = profiler ? std::make_unique<ProfiledCall>(*profiler, lambda) : nullptr;
+            lambda.body->eval(*this, env2, v);
+            return;
         }
-    }
 
-    nrFunctionCalls++;
-    if (countCalls) incrFunctionCall(&lambda);
+        Expr * body = lambda.body;
+        while (auto e = dynamic_cast<ExprIf *>(body))
+            body = evalBool(env2, e->cond, e->pos) ? e->then : e->else_;
 
-    /* Evaluate the body.  This is conditional on showTrace, because
-       catching exceptions makes this function not tail-recursive. */
-    if (loggerSettings.showTrace.get())
-        try {
-            lambda.body->eval(*this, env2, v);
-        } catch (Error & e) {
-            addErrorTrace(e, lambda.pos, "while evaluating %s",
-              (lambda.name.set()
-                  ? "'" + (string) lambda.name + "'"
-                  : "anonymous lambda"));
-            addErrorTrace(e, pos, "from call site%s", "");
-            throw;
+        auto app = dynamic_cast<ExprApp *>(body);
+        if (!app) {
+            body->eval(*this, env2, v);
+            return;
         }
-    else
-        fun.lambda.fun->body->eval(*this, env2, v);
+
+        Value vFun2;
+        if (!app->evalFunction(*this, env2, vFun2, v)) return;
+        vArg = app->e2->maybeThunk(*this, env2);
+        forceValue(vFun2, app->pos);
+        if (!vFun2.isLambda()) {
+            callFunction(vFun2, *vArg, v, app->pos);
+            return;
+        }
+
+        nrTailCalls++;
+        vFun = vFun2;
+        callPos = app->pos;
+    }
 }
 
 
@@ -1379,7 +1856,7 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
             if (j != args.end()) {
                 actualArgs->attrs->push_back(*j);
             } else if (!i.def) {
-                throwMissingArgumentError(i.pos, R"(cannot evaluate a function that has an argument without a value ('%1%')
+                throwMissingArgumentError(positions[i.pos], R"(cannot evaluate a function that has an argument without a value ('%1%')
 
 Nix attempted to evaluate a function as a top level expression; in
 this case it must have its arguments supplied either by default
@@ -1419,7 +1896,7 @@ void ExprAssert::eval(EvalState & state, Env & env, Value & v)
     if (!state.evalBool(env, cond, pos)) {
         std::ostringstream out;
         cond->show(out);
-        throwAssertionError(pos, "assertion '%1%' failed", out.str());
+        throwAssertionError(state.positions[pos], "assertion '%1%' failed", out.str());
     }
     body->eval(state, env, v);
 }
@@ -1476,26 +1953,39 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
-    state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
-
     /* Merge the sets, preferring values from the second set.  Make
-       sure to keep the resulting vector in sorted order. */
-    Bindings::iterator i = v1.attrs->begin();
-    Bindings::iterator j = v2.attrs->begin();
-
-    while (i != v1.attrs->end() && j != v2.attrs->end()) {
-        if (i->name == j->name) {
-            v.attrs->push_back(*j);
-            ++i; ++j;
-        }
-        else if (i->name < j->name)
-            v.attrs->push_back(*i++);
-        else
-            v.attrs->push_back(*j++);
+       sure to keep the resulting vector in sorted order.  The smaller
+       set is merged into the larger one by galloping search, so the
+       larger set's attributes are copied without being compared.
+       This makes the common case of updating a large set with a few
+       attributes (as in overlays and overrides) cheap. */
+    bool secondSmaller = v2.attrs->size() <= v1.attrs->size();
+    Bindings & large = secondSmaller ? *v1.attrs : *v2.attrs;
+    Bindings & small = secondSmaller ? *v2.attrs : *v1.attrs;
+
+    /* Count the attributes that occur in both sets, so that the
+       result is allocated with the exact size. */
+    size_t common = 0;
+    Bindings::iterator p = large.begin();
+    for (auto & i : small) {
+        p = Bindings::gallop(p, large.end(), i.name);
+        if (p == large.end()) break;
+        if (p->name == i.name) common++;
     }
 
-    while (i != v1.attrs->end()) v.attrs->push_back(*i++);
-    while (j != v2.attrs->end()) v.attrs->push_back(*j++);
+    state.mkAttrs(v, large.size() + small.size() - common);
+
+    p = large.begin();
+    for (auto & i : small) {
+        Bindings::iterator q = Bindings::gallop(p, large.end(), i.name);
+        while (p != q) v.attrs->push_back(*p++);
+        if (q != large.end() && q->name == i.name) {
+            v.attrs->push_back(secondSmaller ? i : *q);
+            ++p;
+        } else
+            v.attrs->push_back(i);
+    }
+    while (p != large.end()) v.attrs->push_back(*p++);
 
     state.nrOpUpdateValuesCopied += v.attrs->size();
 }
@@ -1510,7 +2000,7 @@ void ExprOpConcatLists::eval(EvalState & state, Env & env, Value & v)
 }
 
 
-void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Pos & pos)
+void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const PosIdx pos)
 {
     nrListConcats++;
 
@@ -1542,13 +2032,20 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     PathSet context;
-    std::ostringstream s;
+    std::string s;
     NixInt n = 0;
     NixFloat nf = 0;
 
     bool first = !forceString;
     ValueType firstType = nString;
 
+    /* In the common case where only one of the strings has a context
+       (e.g. "${drv}/bin/foo"), the result can share that string's
+       context array instead of copying it through 'context'.
+       Context arrays are never modified after creation so this is
+       safe. */
+    const char * * sharedContext = nullptr;
+
     for (auto & i : *es) {
         Value vTmp;
         i->eval(state, env, vTmp);
@@ -1571,16 +2068,30 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf = n;
                 nf += vTmp.fpoint;
             } else
-                throwEvalError(pos, "cannot add %1% to an integer", showType(vTmp));
+                throwEvalError(state.positions[pos], "cannot add %1% to an integer", showType(vTmp));
         } else if (firstType == nFloat) {
             if (vTmp.type() == nInt) {
                 nf += vTmp.integer;
             } else if (vTmp.type() == nFloat) {
                 nf += vTmp.fpoint;
             } else
-                throwEvalError(pos, "cannot add %1% to a float", showType(vTmp));
+                throwEvalError(state.positions[pos], "cannot add %1% to a float", showType(vTmp));
+        } else if (vTmp.type() == nString) {
+            s.append(vTmp.string.s);
+            if (vTmp.string.context) {
+                if (!sharedContext && context.empty())
+                    sharedContext = vTmp.string.context;
+                else if (vTmp.string.context != sharedContext)
+                    copyContext(vTmp, context);
+            }
         } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == nString);
+            s.append(state.coerceToString(pos, vTmp, context, false, firstType == nString));
+    }
+
+    if (sharedContext && !context.empty()) {
+        for (const char * * p = sharedContext; *p; ++p)
+            context.insert(*p);
+        sharedContext = nullptr;
     }
 
     if (firstType == nInt)
@@ -1588,77 +2099,93 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     else if (firstType == nFloat)
         mkFloat(v, nf);
     else if (firstType == nPath) {
-        if (!context.empty())
-            throwEvalError(pos, "a string that refers to a store path cannot be appended to a path");
-        auto path = canonPath(s.str());
+        if (!context.empty() || sharedContext)
+            throwEvalError(state.positions[pos], "a string that refers to a store path cannot be appended to a path");
+        auto path = canonPath(s);
         mkPath(v, path.c_str());
+    } else if (sharedContext) {
+        mkString(v, s);
+        v.string.context = sharedContext;
     } else
-        mkString(v, s.str(), context);
+        mkString(v, s, context);
 }
 
 
 void ExprPos::eval(EvalState & state, Env & env, Value & v)
 {
-    state.mkPos(v, &pos);
+    state.mkPos(v, pos);
 }
 
 
 void EvalState::forceValueDeep(Value & v)
 {
-    std::set<const Value *> seen;
+    struct Node { };
+    ValueTraversal<Node> traversal;
+    PointerSet seen;
 
-    std::function<void(Value & v)> recurse;
+    auto enter = [&](const ValueTraversal<Node>::Child & child) {
+        auto & v(*child.value);
 
-    recurse = [&](Value & v) {
-        if (!seen.insert(&v).second) return;
+        if (!seen.insert(&v)) return;
 
         forceValue(v);
 
         if (v.type() == nAttrs) {
+            prefetchImports(v.attrs->size(), [&](size_t n) {
+                forceValue(*(v.attrs->begin() + n)->value);
+            });
+            traversal.push({});
             for (auto & i : *v.attrs)
-                try {
-                    recurse(*i.value);
-                } catch (Error & e) {
-                    addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
-                    throw;
-                }
+                traversal.addChild(i.value, &i);
         }
 
         else if (v.isList()) {
+            prefetchImports(v.listSize(), [&](size_t n) {
+                forceValue(*v.listElems()[n]);
+            });
+            traversal.push({});
             for (size_t n = 0; n < v.listSize(); ++n)
-                recurse(*v.listElems()[n]);
+                traversal.addChild(v.listElems()[n]);
         }
     };
 
-    recurse(v);
+    try {
+        traversal.run(v, enter, [](Node &) { });
+    } catch (Error & e) {
+        traversal.forEachActiveChild([&](const ValueTraversal<Node>::Child & child) {
+            if (child.attr)
+                addErrorTrace(e, positions[child.attr->pos], "while evaluating the attribute '%1%'", child.attr->name);
+        });
+        throw;
+    }
 }
 
 
-NixInt EvalState::forceInt(Value & v, const Pos & pos)
+NixInt EvalState::forceInt(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (v.type() != nInt)
-        throwTypeError(pos, "value is %1% while an integer was expected", v);
+        throwTypeError(positions[pos], "value is %1% while an integer was expected", v);
     return v.integer;
 }
 
 
-NixFloat EvalState::forceFloat(Value & v, const Pos & pos)
+NixFloat EvalState::forceFloat(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (v.type() == nInt)
         return v.integer;
     else if (v.type() != nFloat)
-        throwTypeError(pos, "value is %1% while a float was expected", v);
+        throwTypeError(positions[pos], "value is %1% while a float was expected", v);
     return v.fpoint;
 }
 
 
-bool EvalState::forceBool(Value & v, const Pos & pos)
+bool EvalState::forceBool(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (v.type() != nBool)
-        throwTypeError(pos, "value is %1% while a Boolean was expected", v);
+        throwTypeError(positions[pos], "value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
 
@@ -1669,20 +2196,20 @@ bool EvalState::isFunctor(Value & fun)
 }
 
 
-void EvalState::forceFunction(Value & v, const Pos & pos)
+void EvalState::forceFunction(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (v.type() != nFunction && !isFunctor(v))
-        throwTypeError(pos, "value is %1% while a function was expected", v);
+        throwTypeError(positions[pos], "value is %1% while a function was expected", v);
 }
 
 
-string EvalState::forceString(Value & v, const Pos & pos)
+string EvalState::forceString(Value & v, const PosIdx pos)
 {
     forceValue(v, pos);
     if (v.type() != nString) {
         if (pos)
-            throwTypeError(pos, "value is %1% while a string was expected", v);
+            throwTypeError(positions[pos], "value is %1% while a string was expected", v);
         else
             throwTypeError("value is %1% while a string was expected", v);
     }
@@ -1721,7 +2248,7 @@ std::vector<std::pair<Path, std::string>> Value::getContext()
 }
 
 
-string EvalState::forceString(Value & v, PathSet & context, const Pos & pos)
+string EvalState::forceString(Value & v, PathSet & context, const PosIdx pos)
 {
     string s = forceString(v, pos);
     copyContext(v, context);
@@ -1729,12 +2256,12 @@ string EvalState::forceString(Value & v, PathSet & context, const Pos & pos)
 }
 
 
-string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
+string EvalState::forceStringNoCtx(Value & v, const PosIdx pos)
 {
     string s = forceString(v, pos);
     if (v.string.context) {
         if (pos)
-            throwEvalError(pos, "the string '%1%' is not allowed to refer to a store path (such as '%2%')",
+            throwEvalError(positions[pos], "the string '%1%' is not allowed to refer to a store path (such as '%2%')",
                 v.string.s, v.string.context[0]);
         else
             throwEvalError("the string '%1%' is not allowed to refer to a store path (such as '%2%')",
@@ -1755,7 +2282,7 @@ bool EvalState::isDerivation(Value & v)
 }
 
 
-std::optional<string> EvalState::tryAttrsToString(const Pos & pos, Value & v,
+std::optional<string> EvalState::tryAttrsToString(const PosIdx pos, Value & v,
     PathSet & context, bool coerceMore, bool copyToStore)
 {
     auto i = v.attrs->find(sToString);
@@ -1768,7 +2295,7 @@ std::optional<string> EvalState::tryAttrsToString(const Pos & pos, Value & v,
     return {};
 }
 
-string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
+string EvalState::coerceToString(const PosIdx pos, Value & v, PathSet & context,
     bool coerceMore, bool copyToStore)
 {
     forceValue(v, pos);
@@ -1791,12 +2318,12 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
             return *maybeString;
         }
         auto i = v.attrs->find(sOutPath);
-        if (i == v.attrs->end()) throwTypeError(pos, "cannot coerce a set to a string");
+        if (i == v.attrs->end()) throwTypeError(positions[pos], "cannot coerce a set to a string");
         return coerceToString(pos, *i->value, context, coerceMore, copyToStore);
     }
 
     if (v.type() == nExternal)
-        return v.external->coerceToString(pos, context, coerceMore, copyToStore);
+        return v.external->coerceToString(positions[pos], context, coerceMore, copyToStore);
 
     if (coerceMore) {
 
@@ -1822,25 +2349,73 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
         }
     }
 
-    throwTypeError(pos, "cannot coerce %1% to a string", v);
+    throwTypeError(positions[pos], "cannot coerce %1% to a string", v);
 }
 
 
 string EvalState::copyPathToStore(PathSet & context, const Path & path)
 {
+    PhaseTimer timer(storeTime, EvalPhase::Store);
+
     if (nix::isDerivation(path))
         throwEvalError("file names are not allowed to end in '%1%'", drvExtension);
 
     Path dstPath;
-    auto i = srcToStore.find(path);
-    if (i != srcToStore.end())
-        dstPath = store->printStorePath(i->second);
+    std::optional<StorePath> cached;
+    {
+        auto sourceCopies(sourceCopies_.lock());
+        auto i = sourceCopies->srcToStore.find(path);
+        if (i != sourceCopies->srcToStore.end())
+            cached = i->second;
+    }
+    if (cached)
+        dstPath = store->printStorePath(*cached);
     else {
-        auto p = settings.readOnlyMode
-            ? store->computeStorePathForPath(std::string(baseNameOf(path)), checkSourcePath(path)).first
-            : store->addToStore(std::string(baseNameOf(path)), checkSourcePath(path), FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
+        auto name = std::string(baseNameOf(path));
+        auto srcPath = checkSourcePath(path);
+
+        /* Only compute the store path here, and copy the source in
+           the background, so that evaluation doesn't wait for the
+           store. Sources that are already in the store (the common
+           case when evaluating the same expressions again) aren't
+           copied at all. copyLazyTree() waits for the copy before
+           the store path is used.
+
+           The copy is added with the NAR hash computed here, so the
+           store only checks it rather than hashing the source again
+           to find its store path. A source that changes in the
+           meantime fails that check. */
+        std::optional<ValidPathInfo> info;
+        if (settings.readOnlyMode || !repair) {
+            auto [narHash, narSize] = hashPath(htSHA256, srcPath);
+            info.emplace(store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, name), narHash);
+            info->narSize = narSize;
+            info->ca = FixedOutputHash { .method = FileIngestionMethod::Recursive, .hash = narHash };
+        }
+        auto p = info
+            ? info->path
+            : store->addToStore(name, srcPath, FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
         dstPath = store->printStorePath(p);
-        srcToStore.insert_or_assign(path, std::move(p));
+
+        /* Another thread may have done the same in the meantime,
+           which is harmless. */
+        auto sourceCopies(sourceCopies_.lock());
+
+        if (!settings.readOnlyMode && !repair) {
+            if (!sourceCopies->pool)
+                sourceCopies->pool = std::make_unique<ThreadPool>();
+            sourceCopies->results.push_back(sourceCopies->pool->submit([store(store), srcPath, info(std::move(*info))]() {
+                store->addTempRoot(info.path);
+                if (store->isValidPath(info.path)) return;
+                auto source = sinkToSource([&](Sink & sink) {
+                    dumpPath(srcPath, sink);
+                });
+                store->addToStore(info, *source, NoRepair, NoCheckSigs);
+            }));
+            sourceCopies->pending.insert(dstPath);
+        }
+
+        sourceCopies->srcToStore.insert_or_assign(path, std::move(p));
         printMsg(lvlChatty, "copied source '%1%' -> '%2%'", path, dstPath);
     }
 
@@ -1849,24 +2424,47 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
 }
 
 
-Path EvalState::coerceToPath(const Pos & pos, Value & v, PathSet & context)
+void EvalState::waitForSourceCopies()
+{
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<std::future<void>> results;
+
+    {
+        auto sourceCopies(sourceCopies_.lock());
+        if (!sourceCopies->pool) return;
+        pool = std::move(sourceCopies->pool);
+        results = std::move(sourceCopies->results);
+        sourceCopies->pending.clear();
+    }
+
+    pool->process();
+
+    for (auto & result : results)
+        result.get();
+}
+
+
+Path EvalState::coerceToPath(const PosIdx pos, Value & v, PathSet & context)
 {
     string path = coerceToString(pos, v, context, false, false);
     if (path == "" || path[0] != '/')
-        throwEvalError(pos, "string '%1%' doesn't represent an absolute path", path);
+        throwEvalError(positions[pos], "string '%1%' doesn't represent an absolute path", path);
     return path;
 }
 
 
 bool EvalState::eqValues(Value & v1, Value & v2)
 {
-    forceValue(v1);
-    forceValue(v2);
-
     /* !!! Hack to support some old broken code that relies on pointer
        equality tests between sets.  (Specifically, builderDefs calls
        uniqList on a list of sets.)  Will remove this eventually. */
-    if (&v1 == &v2) return true;
+    if (&v1 == &v2) {
+        forceValue(v1);
+        return true;
+    }
+
+    forceValue(v1);
+    forceValue(v2);
 
     // Special case type-compatibility between float and int
     if (v1.type() == nInt && v2.type() == nFloat)
@@ -1886,21 +2484,26 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             return v1.boolean == v2.boolean;
 
         case nString:
-            return strcmp(v1.string.s, v2.string.s) == 0;
+            return v1.string.s == v2.string.s || strcmp(v1.string.s, v2.string.s) == 0;
 
         case nPath:
-            return strcmp(v1.path, v2.path) == 0;
+            return v1.path == v2.path || strcmp(v1.path, v2.path) == 0;
 
         case nNull:
             return true;
 
         case nList:
             if (v1.listSize() != v2.listSize()) return false;
+            /* Lists that share their elements (e.g. copies of the
+               same list) are equal, by the same hack as above. */
+            if (v1.listElems() == v2.listElems()) return true;
             for (size_t n = 0; n < v1.listSize(); ++n)
                 if (!eqValues(*v1.listElems()[n], *v2.listElems()[n])) return false;
             return true;
 
         case nAttrs: {
+            if (v1.attrs == v2.attrs) return true;
+
             /* If both sets denote a derivation (type = "derivation"),
                then compare their outPaths. */
             if (isDerivation(v1) && isDerivation(v2)) {
@@ -1936,6 +2539,109 @@ bool EvalState::eqValues(Value & v1, Value & v2)
     }
 }
 
+
+static inline void combineHash(size_t & h, size_t h2)
+{
+    h ^= h2 + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+}
+
+size_t EvalState::shallowHash(Value & v)
+{
+    size_t h = std::hash<int>()(v.type() == nFloat ? nInt : v.type());
+
+    switch (v.type()) {
+
+        /* Integers and floats are compared as doubles. */
+        case nInt:
+        case nFloat: {
+            double d = v.type() == nInt ? (double) v.integer : v.fpoint;
+            combineHash(h, std::hash<double>()(d == 0 ? 0.0 : d));
+            break;
+        }
+
+        case nBool:
+            combineHash(h, v.boolean);
+            break;
+
+        case nString:
+            combineHash(h, std::hash<std::string_view>()(v.string.s));
+            break;
+
+        case nPath:
+            combineHash(h, std::hash<std::string_view>()(v.path));
+            break;
+
+        case nList:
+            combineHash(h, v.listSize());
+            break;
+
+        case nAttrs:
+            /* Sets with an outPath may be derivations, which are
+               compared by their outPath only. */
+            if (v.attrs->find(sOutPath) != v.attrs->end()) break;
+            combineHash(h, v.attrs->size());
+            for (auto & attr : *v.attrs)
+                combineHash(h, attr.name.hash());
+            break;
+
+        default:
+            break;
+    }
+
+    return h;
+}
+
+std::optional<size_t> EvalState::deepHash(Value & v)
+{
+    size_t budget = 1 << 16;
+    return deepHash(v, 0, budget);
+}
+
+std::optional<size_t> EvalState::deepHash(Value & v, size_t depth, size_t & budget)
+{
+    /* Give up on thunks, on values nested so deeply that they may be
+       cyclic, and once too many values have been visited, which
+       happens for (cyclic or acyclic) values that share their
+       children a lot, like `let x = { a = x; b = x; }; in x`. */
+    if (v.isThunk() || v.isApp() || v.isBlackhole() || depth > 64 || budget == 0)
+        return std::nullopt;
+    budget--;
+
+    size_t h = std::hash<int>()(v.type() == nFloat ? nInt : v.type());
+
+    if (v.type() == nList) {
+        for (size_t n = 0; n < v.listSize(); ++n) {
+            auto h2 = deepHash(*v.listElems()[n], depth + 1, budget);
+            if (!h2) return std::nullopt;
+            combineHash(h, *h2);
+        }
+        return h;
+    }
+
+    if (v.type() == nAttrs) {
+        /* Derivations are compared by their outPath only. */
+        auto type = v.attrs->find(sType);
+        auto outPath = v.attrs->find(sOutPath);
+        if (type != v.attrs->end() && outPath != v.attrs->end()) {
+            if (type->value->isThunk() || type->value->isApp() || type->value->isBlackhole())
+                return std::nullopt;
+            if (type->value->type() == nString && strcmp(type->value->string.s, "derivation") == 0)
+                return deepHash(*outPath->value, depth + 1, budget);
+        }
+        for (auto & attr : *v.attrs) {
+            auto h2 = deepHash(*attr.value, depth + 1, budget);
+            if (!h2) return std::nullopt;
+            combineHash(h, attr.name.hash());
+            combineHash(h, *h2);
+        }
+        return h;
+    }
+
+    /* Functions and external values have no structure to hash, so
+       they only get the hash of their type. */
+    return shallowHash(v);
+}
+
 void EvalState::printStats()
 {
     bool showStats = getEnv("NIX_SHOW_STATS").value_or("0") != "0";
@@ -1960,6 +2666,16 @@ void EvalState::printStats()
             fs.open(outPath, std::fstream::out);
         JSONObject topObj(outPath == "-" ? std::cerr : fs, true);
         topObj.attr("cpuTime",cpuTime);
+        {
+            auto time = topObj.object("time");
+            time.attr("totalMicroseconds", std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - startTime).count());
+            time.attr("parseMicroseconds", parseTime);
+            time.attr("storeMicroseconds", storeTime);
+#if HAVE_BOEHMGC
+            time.attr("gcMicroseconds", gcStats.totalPause);
+#endif
+        }
         {
             auto envs = topObj.object("envs");
             envs.attr("number", nrEnvs);
@@ -1987,6 +2703,20 @@ void EvalState::printStats()
             sets.attr("number", nrAttrsets);
             sets.attr("bytes", bAttrsets);
             sets.attr("elements", nrAttrsInAttrsets);
+            auto index = sets.object("index");
+            index.attr("number", nrSetIndexesBuilt);
+            index.attr("hits", nrSetIndexHits);
+            index.attr("misses", nrSetIndexMisses);
+        }
+        {
+            auto regexes = topObj.object("regexCache");
+            regexes.attr("hits", nrRegexCacheHits);
+            regexes.attr("misses", nrRegexCacheMisses);
+        }
+        {
+            auto fs = topObj.object("fsCache");
+            fs.attr("hits", fsCache->nrHits);
+            fs.attr("misses", fsCache->nrMisses);
         }
         {
             auto sizes = topObj.object("sizes");
@@ -2000,13 +2730,30 @@ void EvalState::printStats()
         topObj.attr("nrThunks", nrThunks);
         topObj.attr("nrAvoided", nrAvoided);
         topObj.attr("nrLookups", nrLookups);
+        topObj.attr("nrWithLookups", nrWithLookups);
+        topObj.attr("nrWithCacheHits", nrWithCacheHits);
         topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
         topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        topObj.attr("nrTailCalls", nrTailCalls);
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
             gc.attr("heapSize", heapSize);
             gc.attr("totalBytes", totalBytes);
+            gcStats.toJSON(gc);
+            auto phases = gc.object("phases");
+            {
+                auto obj = phases.object("evaluation");
+                gcPhaseStats[(size_t) EvalPhase::Evaluation].toJSON(obj);
+            }
+            {
+                auto obj = phases.object("parsing");
+                gcPhaseStats[(size_t) EvalPhase::Parsing].toJSON(obj);
+            }
+            {
+                auto obj = phases.object("store");
+                gcPhaseStats[(size_t) EvalPhase::Store].toJSON(obj);
+            }
         }
 #endif
 
@@ -2016,6 +2763,11 @@ void EvalState::printStats()
                 for (auto & i : primOpCalls)
                     obj.attr(i.first, i.second);
             }
+            {
+                auto obj = topObj.object("primopTimes");
+                for (auto & i : primOpTimes)
+                    obj.attr(i.first, i.second);
+            }
             {
                 auto list = topObj.list("functions");
                 for (auto & i : functionCalls) {
@@ -2024,10 +2776,10 @@ void EvalState::printStats()
                         obj.attr("name", (const string &) i.first->name);
                     else
                         obj.attr("name", nullptr);
-                    if (i.first->pos) {
-                        obj.attr("file", (const string &) i.first->pos.file);
-                        obj.attr("line", i.first->pos.line);
-                        obj.attr("column", i.first->pos.column);
+                    if (auto pos = positions[i.first->pos]) {
+                        obj.attr("file", (const string &) pos.file);
+                        obj.attr("line", pos.line);
+                        obj.attr("column", pos.column);
                     }
                     obj.attr("count", i.second);
                 }
@@ -2036,10 +2788,10 @@ void EvalState::printStats()
                 auto list = topObj.list("attributes");
                 for (auto & i : attrSelects) {
                     auto obj = list.object();
-                    if (i.first) {
-                        obj.attr("file", (const string &) i.first.file);
-                        obj.attr("line", i.first.line);
-                        obj.attr("column", i.first.column);
+                    if (auto pos = positions[i.first]) {
+                        obj.attr("file", (const string &) pos.file);
+                        obj.attr("line", pos.line);
+                        obj.attr("column", pos.column);
                     }
                     obj.attr("count", i.second);
                 }
@@ -5,7 +5,10 @@
 #include "nixexpr.hh"
 #include "symbol-table.hh"
 #include "config.hh"
+#include "sync.hh"
 
+#include <chrono>
+#include <future>
 #include <map>
 #include <optional>
 #include <unordered_map>
@@ -17,11 +20,16 @@ namespace nix {
 
 class Store;
 class EvalState;
+struct EvalProfiler;
 class StorePath;
+struct StorePathWithOutputs;
+class ThreadPool;
+class FSCache;
 enum RepairFlag : bool;
+namespace fetchers { struct Tree; }
 
 
-typedef void (* PrimOpFun) (EvalState & state, const Pos & pos, Value * * args, Value & v);
+typedef void (* PrimOpFun) (EvalState & state, const PosIdx pos, Value * * args, Value & v);
 
 
 struct PrimOp
@@ -39,6 +47,7 @@ struct Env
     Env * up;
     unsigned short prevWith:14; // nr of levels up to next `with' environment
     enum { Plain = 0, HasWithExpr, HasWithAttrs } type:2;
+    uint32_t size; // nr of elements in 'values'
     Value * values[0];
 };
 
@@ -69,10 +78,51 @@ struct RegexCache;
 std::shared_ptr<RegexCache> makeRegexCache();
 
 
+/* The top-level phases of evaluation. Garbage collections are
+   attributed to the phase the collecting thread is in when they
+   happen. */
+enum struct EvalPhase { Evaluation, Parsing, Store };
+
+/* The phase the current thread is in. */
+EvalPhase & currentEvalPhase();
+
+
+/* Adds the wall-clock time spent in its scope to a counter, in
+   microseconds, and puts the current thread in `phase' for the
+   duration. */
+struct PhaseTimer
+{
+    uint64_t & total;
+    const EvalPhase prevPhase = currentEvalPhase();
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    PhaseTimer(uint64_t & total, EvalPhase phase = currentEvalPhase()) : total(total)
+    {
+        currentEvalPhase() = phase;
+    }
+
+    ~PhaseTimer()
+    {
+        total += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        currentEvalPhase() = prevPhase;
+    }
+};
+
+
+/* Threading: an EvalState may be used by several threads that force
+   values at the same time, but nothing in Nix does so yet; there is no
+   parallel evaluation mode. Forcing is thread-safe (see forceValue()),
+   as are the symbol and position tables, the caches guarded by Sync<>
+   and allocValue() and allocEnv(), whose free lists are per thread.
+   Everything else, i.e. the settings-like public members, the
+   statistics counters and the profiler, must only be used while a
+   single thread is using the EvalState. */
 class EvalState
 {
 public:
     SymbolTable symbols;
+    PosTable positions;
 
     const Symbol sWith, sOutPath, sDrvPath, sType, sMeta, sName, sValue,
         sSystem, sOverrides, sOutputs, sOutputName, sIgnoreNulls,
@@ -92,13 +142,64 @@ public:
        mode. */
     std::optional<PathSet> allowedPaths;
 
+    /* Source trees that haven't been copied to the store yet (see
+       the 'lazy-trees' setting), mapping their store paths to the
+       directories that contain them. */
+    std::map<Path, Path> lazyTrees;
+
+    /* The impure inputs of evaluation, recorded if `trackedInputs'
+       is set so that results can be cached until the inputs change
+       (see `nix-env -qa'): the source paths accessed (including the
+       candidates tried by search path lookups), and the environment
+       variables read. `uncacheable' is set if the
+       evaluation used some other impure input, such as a fetch
+       without a hash or a search path entry that is a URL. */
+    struct TrackedInputs
+    {
+        std::set<Path> paths;
+        std::map<std::string, std::string> envVars;
+        std::optional<std::string> uncacheable;
+    };
+
+    std::unique_ptr<TrackedInputs> trackedInputs;
+
+    void markUncacheable(const std::string & reason)
+    {
+        if (trackedInputs && !trackedInputs->uncacheable)
+            trackedInputs->uncacheable = reason;
+    }
+
     Value vEmptySet;
 
+    /* Shared values for the integers 0 to smallIntCount - 1, returned
+       by allocInt(). */
+    static constexpr NixInt smallIntCount = 1024;
+    ValueVector smallInts;
+
     const ref<Store> store;
 
+    /* Cache of the file system metadata of source files. */
+    std::shared_ptr<FSCache> fsCache;
+
 
 private:
-    SrcToStore srcToStore;
+    /* The caches below may be used by several evaluator threads
+       at once, so they are guarded by Sync<>. None of the locks is
+       held while evaluating. */
+
+    struct SourceCopies
+    {
+        SrcToStore srcToStore;
+
+        /* Source paths whose store paths have been computed by
+           copyPathToStore(), but that are still being copied to the
+           store in the background. */
+        std::unique_ptr<ThreadPool> pool;
+        std::vector<std::future<void>> results;
+        StringSet pending;
+    };
+
+    Sync<SourceCopies> sourceCopies_;
 
     /* A cache from path names to parse trees. */
 #if HAVE_BOEHMGC
@@ -106,7 +207,7 @@ private:
 #else
     typedef std::map<Path, Expr *> FileParseCache;
 #endif
-    FileParseCache fileParseCache;
+    Sync<FileParseCache> fileParseCache;
 
     /* A cache from path names to values. */
 #if HAVE_BOEHMGC
@@ -114,18 +215,34 @@ private:
 #else
     typedef std::map<Path, Value> FileEvalCache;
 #endif
-    FileEvalCache fileEvalCache;
+    Sync<FileEvalCache> fileEvalCache;
 
     SearchPath searchPath;
 
     std::map<std::string, std::pair<bool, std::string>> searchPathResolved;
 
     /* Cache used by checkSourcePath(). */
-    std::unordered_map<Path, Path> resolvedPaths;
+    Sync<std::unordered_map<Path, Path>> resolvedPaths;
 
     /* Cache used by prim_match(). */
     std::shared_ptr<RegexCache> regexCache;
 
+    /* Cache used by allocString(). */
+#if HAVE_BOEHMGC
+    typedef std::unordered_map<Symbol, Value *, std::hash<Symbol>, std::equal_to<Symbol>,
+        traceable_allocator<std::pair<const Symbol, Value *> > > SymbolStrings;
+#else
+    typedef std::unordered_map<Symbol, Value *> SymbolStrings;
+#endif
+    Sync<SymbolStrings> symbolStrings;
+
+    /* The function call profiler, if enabled. */
+    std::unique_ptr<EvalProfiler> profiler;
+
+    /* Whether the heap exceeded `eval-memory-limit` after the last
+       garbage collection. */
+    bool memoryLimitExceeded = false;
+
 public:
 
     EvalState(const Strings & _searchPath, ref<Store> store);
@@ -148,6 +265,29 @@ public:
        sources stored in the actual /nix/store. */
     Path toRealPath(const Path & path, const PathSet & context);
 
+    /* Make a tree returned by a fetcher accessible to the evaluator.
+       If the tree hasn't been copied to the store, accesses to its
+       store path are redirected to its actual location until
+       copyLazyTree() is called. */
+    void registerTree(const fetchers::Tree & tree);
+
+    /* If 'path' is inside a lazy tree, return the corresponding path
+       in the tree's actual location. */
+    Path rewriteLazyPath(const Path & path);
+
+    /* Copy a lazy tree to the store, or wait for a source path that
+       is being copied in the background by copyPathToStore(). This
+       must be done before its store path becomes visible outside of
+       the evaluator, e.g. as an input of a derivation. */
+    void copyLazyTree(const StorePath & storePath);
+
+    /* Wait until all source paths that are being copied in the
+       background are in the store. Throws the first error that
+       occurred while copying. Commands that output the result of an
+       evaluation must call this before they finish, since the
+       destructor can only log such errors. */
+    void waitForSourceCopies();
+
     /* Parse a Nix expression from the specified file. */
     Expr * parseExprFromFile(const Path & path);
     Expr * parseExprFromFile(const Path & path, StaticEnv & staticEnv);
@@ -165,9 +305,22 @@ public:
 
     void resetFileCache();
 
+    /* Check the `eval-memory-limit` setting after a garbage
+       collection. This is called from the allocator, where callers
+       may hold references into the file caches, so it only records
+       that the limit is exceeded; reclaimMemory() acts on it. */
+    void checkMemoryLimit();
+
+    /* Called at safe points (when forcing a thunk or calling a
+       function) if the memory limit was exceeded: drop the caches
+       that can be recreated and collect again, and if that doesn't
+       help, throw an error that shows the functions that allocated
+       the most. */
+    void reclaimMemory();
+
     /* Look up a file in the search path. */
     Path findFile(const string & path);
-    Path findFile(SearchPath & searchPath, const string & path, const Pos & pos = noPos);
+    Path findFile(SearchPath & searchPath, const string & path, const PosIdx pos = noPos);
 
     /* If the specified search path element is a URI, download it. */
     std::pair<bool, std::string> resolveSearchPathElem(const SearchPathElem & elem);
@@ -179,44 +332,44 @@ public:
     /* Evaluation the expression, then verify that it has the expected
        type. */
     inline bool evalBool(Env & env, Expr * e);
-    inline bool evalBool(Env & env, Expr * e, const Pos & pos);
+    inline bool evalBool(Env & env, Expr * e, const PosIdx pos);
     inline void evalAttrs(Env & env, Expr * e, Value & v);
 
     /* If `v' is a thunk, enter it and overwrite `v' with the result
        of the evaluation of the thunk.  If `v' is a delayed function
        application, call the function and overwrite `v' with the
        result.  Otherwise, this is a no-op. */
-    inline void forceValue(Value & v, const Pos & pos = noPos);
+    inline void forceValue(Value & v, const PosIdx pos = noPos);
 
     /* Force a value, then recursively force list elements and
        attributes. */
     void forceValueDeep(Value & v);
 
     /* Force `v', and then verify that it has the expected type. */
-    NixInt forceInt(Value & v, const Pos & pos);
-    NixFloat forceFloat(Value & v, const Pos & pos);
-    bool forceBool(Value & v, const Pos & pos);
+    NixInt forceInt(Value & v, const PosIdx pos);
+    NixFloat forceFloat(Value & v, const PosIdx pos);
+    bool forceBool(Value & v, const PosIdx pos);
     inline void forceAttrs(Value & v);
-    inline void forceAttrs(Value & v, const Pos & pos);
+    inline void forceAttrs(Value & v, const PosIdx pos);
     inline void forceList(Value & v);
-    inline void forceList(Value & v, const Pos & pos);
-    void forceFunction(Value & v, const Pos & pos); // either lambda or primop
-    string forceString(Value & v, const Pos & pos = noPos);
-    string forceString(Value & v, PathSet & context, const Pos & pos = noPos);
-    string forceStringNoCtx(Value & v, const Pos & pos = noPos);
+    inline void forceList(Value & v, const PosIdx pos);
+    void forceFunction(Value & v, const PosIdx pos); // either lambda or primop
+    string forceString(Value & v, const PosIdx pos = noPos);
+    string forceString(Value & v, PathSet & context, const PosIdx pos = noPos);
+    string forceStringNoCtx(Value & v, const PosIdx pos = noPos);
 
     /* Return true iff the value `v' denotes a derivation (i.e. a
        set with attribute `type = "derivation"'). */
     bool isDerivation(Value & v);
 
-    std::optional<string> tryAttrsToString(const Pos & pos, Value & v,
+    std::optional<string> tryAttrsToString(const PosIdx pos, Value & v,
         PathSet & context, bool coerceMore = false, bool copyToStore = true);
 
     /* String coercion.  Converts strings, paths and derivations to a
        string.  If `coerceMore' is set, also converts nulls, integers,
        booleans and lists to a string.  If `copyToStore' is set,
        referenced paths are copied to the Nix store as a side effect. */
-    string coerceToString(const Pos & pos, Value & v, PathSet & context,
+    string coerceToString(const PosIdx pos, Value & v, PathSet & context,
         bool coerceMore = false, bool copyToStore = true);
 
     string copyPathToStore(PathSet & context, const Path & path);
@@ -224,7 +377,7 @@ public:
     /* Path coercion.  Converts strings, paths and derivations to a
        path.  The result is guaranteed to be a canonicalised, absolute
        path.  Nothing is copied to the store. */
-    Path coerceToPath(const Pos & pos, Value & v, PathSet & context);
+    Path coerceToPath(const PosIdx pos, Value & v, PathSet & context);
 
 public:
 
@@ -280,10 +433,30 @@ public:
        elements and attributes are compared recursively. */
     bool eqValues(Value & v1, Value & v2);
 
+    /* Hashes of values that are consistent with eqValues(), i.e.
+       equal values have equal hashes. Neither function evaluates
+       anything. shallowHash() only looks at the top level of a value
+       in weak head normal form. deepHash() looks at the entire value,
+       and returns nothing if the value still contains thunks (or is
+       too large or nested too deeply, e.g. because it is cyclic). */
+    size_t shallowHash(Value & v);
+    std::optional<size_t> deepHash(Value & v);
+
+private:
+    /* The implementation of deepHash(), which visits at most
+       `budget' values, since shared values are visited once for
+       every path leading to them. */
+    std::optional<size_t> deepHash(Value & v, size_t depth, size_t & budget);
+
+public:
+
     bool isFunctor(Value & fun);
 
-    void callFunction(Value & fun, Value & arg, Value & v, const Pos & pos);
-    void callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos);
+    void callFunction(Value & fun, Value & arg, Value & v, const PosIdx pos);
+    void callPrimOp(Value & fun, Value & arg, Value & v, const PosIdx pos);
+
+    /* Call a primop with all its arguments. */
+    void callPrimOp(Value & primOp, Value * * args, Value & v, const PosIdx pos);
 
     /* Automatically call a function for which each argument has a
        default value or has a binding in the `args' map. */
@@ -293,6 +466,15 @@ public:
     Value * allocValue();
     Env & allocEnv(size_t size);
 
+    /* Return a value containing the integer `n'. Values for small
+       integers are shared rather than allocated, so the result must
+       not be modified. */
+    Value * allocInt(NixInt n);
+
+    /* Return a value containing the string `s'. Like allocInt(), the
+       value is shared between calls, so it must not be modified. */
+    Value * allocString(const Symbol & s);
+
     Value * allocAttr(Value & vAttrs, const Symbol & name);
     Value * allocAttr(Value & vAttrs, const std::string & name);
 
@@ -301,15 +483,69 @@ public:
     void mkList(Value & v, size_t length);
     void mkAttrs(Value & v, size_t capacity);
     void mkThunk_(Value & v, Expr * expr);
-    void mkPos(Value & v, Pos * pos);
+    void mkPos(Value & v, PosIdx pos);
 
-    void concatLists(Value & v, size_t nrLists, Value * * lists, const Pos & pos);
+    void concatLists(Value & v, size_t nrLists, Value * * lists, const PosIdx pos);
 
     /* Print statistics. */
     void printStats();
 
+    /* Return the number of values, environments and attribute sets
+       allocated so far. */
+    uint64_t nrAllocations() const
+    {
+        return nrValues + nrEnvs + nrAttrsets;
+    }
+
+    /* Return the number of bytes allocated so far for values,
+       environments, lists and attribute sets. */
+    uint64_t bytesAllocated() const
+    {
+        return nrValues * sizeof(Value)
+            + nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *)
+            + nrListElems * sizeof(Value *)
+            + nrAttrsets * sizeof(Bindings) + nrAttrsInAttrsets * sizeof(Attr);
+    }
+
     void realiseContext(const PathSet & context);
 
+    /* Call `f(i)' for every `i' < `n', to evaluate values that will
+       be evaluated again afterwards, in the usual order. If `f(i)'
+       imports from a derivation that must be built first, it is
+       postponed. When all calls have completed or been postponed,
+       the derivations they need are built at once (i.e. concurrently)
+       and the postponed calls are retried. Other errors are ignored,
+       since they will be reported by the evaluation that follows.
+       A nested call doesn't build anything itself; it evaluates all
+       its values and then postpones the enclosing call, so that the
+       outermost call builds everything found below it. This does
+       nothing if `batch-import-from-derivation' is disabled. */
+    void prefetchImports(size_t n, std::function<void(size_t)> f);
+
+    /* If set, used instead of store->buildPaths() to build the
+       derivations that the evaluation imports from, e.g. so that
+       they are built by the pipeline that builds the results of the
+       evaluation. */
+    std::function<void(const std::vector<StorePathWithOutputs> &)> buildImports;
+
+private:
+
+    /* The derivations that failed to build in prefetchImports(), and
+       the error, so that the evaluation that follows reports it
+       rather than building them again. */
+    Sync<std::map<std::string, std::exception_ptr>> failedImports;
+
+    void buildImportPaths(const std::vector<StorePathWithOutputs> & drvs);
+
+public:
+
+    /* Wall-clock time spent since this EvalState was created, and in
+       parsing and store operations, in microseconds. Reported by
+       printStats(). */
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    uint64_t parseTime = 0;
+    uint64_t storeTime = 0;
+
 private:
 
     unsigned long nrEnvs = 0;
@@ -323,25 +559,36 @@ private:
     unsigned long nrListConcats = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
+    unsigned long nrTailCalls = 0;
+    unsigned long nrRegexCacheHits = 0;
+    unsigned long nrRegexCacheMisses = 0;
 
     bool countCalls;
 
     typedef std::map<Symbol, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
+    /* Cumulative time spent in each primop, in microseconds. */
+    typedef std::map<Symbol, uint64_t> PrimOpTimes;
+    PrimOpTimes primOpTimes;
+
     typedef std::map<ExprLambda *, size_t> FunctionCalls;
     FunctionCalls functionCalls;
 
     void incrFunctionCall(ExprLambda * fun);
 
-    typedef std::map<Pos, size_t> AttrSelects;
+    typedef std::map<PosIdx, size_t> AttrSelects;
     AttrSelects attrSelects;
 
     friend struct ExprOpUpdate;
     friend struct ExprOpConcatLists;
     friend struct ExprSelect;
-    friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
-    friend void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v);
+    friend void prim_getAttr(EvalState & state, const PosIdx pos, Value * * args, Value & v);
+    friend void prim_match(EvalState & state, const PosIdx pos, Value * * args, Value & v);
+    friend void prim_split(EvalState & state, const PosIdx pos, Value * * args, Value & v);
+    friend struct RegexCache;
+    friend struct SnapshotWriter;
+    friend struct SnapshotReader;
 };
 
 
@@ -353,8 +600,9 @@ string showType(const Value & v);
    name>. */
 std::pair<string, string> decodeContext(std::string_view s);
 
-/* If `path' refers to a directory, then append "/default.nix". */
-Path resolveExprPath(Path path);
+/* If `path' refers to a directory, then append "/default.nix". Use
+   'fsCache' to look up the file system metadata, if given. */
+Path resolveExprPath(Path path, FSCache * fsCache = nullptr);
 
 struct InvalidPathError : EvalError
 {
@@ -390,6 +638,20 @@ struct EvalSettings : Config
     Setting<bool> pureEval{this, false, "pure-eval",
         "Whether to restrict file system and network access to files specified by cryptographic hash."};
 
+    Setting<bool> batchImportFromDerivation{
+        this, true, "batch-import-from-derivation",
+        R"(
+          If set to `true`, when evaluating a set or list of values
+          (e.g. the packages found by `nix-env -qa` or `nix-build`, or
+          the attributes of a derivation), Nix evaluates the other
+          values first if one needs a derivation to be built for
+          import from derivation, and then builds all such
+          derivations at once, in parallel. Otherwise, evaluation
+          waits for each such build to finish, so they happen one at
+          a time. Note that with this, `builtins.trace` messages may
+          be printed more than once.
+        )"};
+
     Setting<bool> enableImportFromDerivation{
         this, true, "allow-import-from-derivation",
         R"(
@@ -426,8 +688,125 @@ struct EvalSettings : Config
           `flamegraph.pl`.
         )"};
 
+    Setting<Path> profileFile{this, "", "eval-profile-file",
+        R"(
+          If set, the Nix evaluator will profile function calls and write
+          the resulting call tree to the specified file when evaluation
+          finishes. The file is in the "collapsed stack" format that can
+          be turned into a flame graph using `flamegraph.pl`. Each
+          function is identified by its name and position; builtin
+          functions are shown as `primop <name>`.
+        )"};
+
+    Setting<std::string> profileWeight{this, "time", "eval-profile-weight",
+        R"(
+          What the profile written to `eval-profile-file` measures:
+          either `time` (the time in nanoseconds spent in each function,
+          excluding its callees) or `allocations` (the number of values,
+          environments and attribute sets allocated by each function,
+          excluding its callees).
+        )"};
+
     Setting<bool> useEvalCache{this, true, "eval-cache",
-        "Whether to use the flake evaluation cache."};
+        "Whether to use the flake evaluation cache and the `nix-env -qa` query cache."};
+
+    Setting<uint64_t> evalCacheFlushInterval{this, 0, "eval-cache-flush-interval",
+        R"(
+          The number of writes to the flake evaluation cache after which
+          they are committed to disk. Committing makes the cached
+          attributes visible to other Nix processes and preserves them if
+          evaluation is interrupted, at the cost of extra disk writes. If
+          set to 0 (the default), all writes are committed in a single
+          transaction when evaluation finishes.
+        )"};
+
+    Setting<Path> sharedEvalCacheDir{this, "", "shared-eval-cache-dir",
+        R"(
+          A directory containing a flake evaluation cache shared between
+          users or machines, e.g. on a network file system or a volume
+          shared by CI runners. If a flake's evaluation cache doesn't
+          exist locally, it's initialised from the copy in this
+          directory. After evaluation, an updated cache is copied back
+          into the directory so that subsequent evaluations of the same
+          locked flake can use it. Copies are replaced atomically, so
+          concurrent readers are safe.
+        )"};
+
+    Setting<uint64_t> gcInitialHeapSize{this, 0, "gc-initial-heap-size",
+        R"(
+          The initial size in bytes of the garbage-collected heap used
+          by the evaluator. If set to 0 (the default), Nix uses 25% of
+          physical RAM, up to a maximum of 384 MiB, unless the
+          `GC_INITIAL_HEAP_SIZE` environment variable is set.
+        )"};
+
+    Setting<uint64_t> gcMaxHeapSize{this, 0, "gc-max-heap-size",
+        R"(
+          The maximum size in bytes of the garbage-collected heap used
+          by the evaluator. Evaluation fails with an out-of-memory error
+          if the heap would have to grow beyond this. 0 (the default)
+          means no limit.
+        )"};
+
+    Setting<uint64_t> evalMemoryLimit{this, 0, "eval-memory-limit",
+        R"(
+          The maximum amount of memory in bytes that evaluation may use
+          in the garbage-collected heap, as measured after a garbage
+          collection. When the limit is exceeded, the evaluator drops
+          the caches of parsed and evaluated files and collects garbage
+          again. If the heap is still too large, evaluation fails with
+          an error that lists the functions that allocated the most
+          memory. Unlike `gc-max-heap-size`, this counts only memory in
+          use, not free space in the heap. 0 (the default) means no
+          limit. Setting a limit enables the accounting of allocations
+          per function, which makes evaluation slightly slower.
+        )"};
+
+    Setting<unsigned int> gcFreeSpaceDivisor{this, 0, "gc-free-space-divisor",
+        R"(
+          Controls the trade-off between heap growth and collection
+          frequency of the garbage collector: larger values make it
+          collect more often and keep the heap smaller. 0 (the default)
+          uses the garbage collector's built-in value.
+        )"};
+
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        R"(
+          If set to `true`, the garbage collector performs incremental
+          collections, spreading marking work over many short pauses
+          instead of stopping the evaluator for a full collection.
+        )"};
+
+    Setting<bool> parseCache{this, false, "parse-cache",
+        R"(
+          If set to `true`, the Nix evaluator will keep the parse trees of
+          the Nix expression files it reads in a persistent cache in
+          `~/.cache/nix/parse-cache`, and reuse them in subsequent
+          invocations instead of parsing unchanged files again. Cache
+          entries are keyed by the path and contents of the file.
+        )"};
+
+    Setting<bool> sourceCache{this, false, "source-cache",
+        R"(
+          If set to `true`, the Nix evaluator will record the store paths
+          produced by `builtins.path` and `builtins.filterSource` in a
+          persistent cache in `~/.cache/nix/source-cache`, together with
+          the metadata of the files involved. If the same source is added
+          again with an equivalent filter function, and none of its files
+          have changed, the cached store path is used without calling the
+          filter or reading the files. Sources whose filter can't be
+          compared, e.g. because it reads files itself, are not cached.
+        )"};
+
+    Setting<bool> lazyFromJSON{this, false, "lazy-from-json",
+        R"(
+          If set to `true`, `builtins.fromJSON` only parses the top level
+          of a JSON object or array. Nested objects and arrays are parsed
+          when they are first accessed. This saves time and memory when
+          only a small part of a large JSON document is used, but syntax
+          errors in nested values are only reported when those values are
+          accessed.
+        )"};
 };
 
 extern EvalSettings evalSettings;
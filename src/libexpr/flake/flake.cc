@@ -5,6 +5,7 @@
 #include "store-api.hh"
 #include "fetchers.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -46,7 +47,7 @@ static std::tuple<fetchers::Tree, FlakeRef, FlakeRef> fetchOrSubstituteTree(
         } else {
             if (allowLookup) {
                 resolvedRef = originalRef.resolve(state.store);
-                auto fetchedResolved = lookupInFlakeCache(flakeCache, originalRef);
+                auto fetchedResolved = lookupInFlakeCache(flakeCache, resolvedRef);
                 if (!fetchedResolved) fetchedResolved.emplace(resolvedRef.fetchTree(state.store));
                 flakeCache.push_back({resolvedRef, *fetchedResolved});
                 fetched.emplace(*fetchedResolved);
@@ -63,15 +64,14 @@ static std::tuple<fetchers::Tree, FlakeRef, FlakeRef> fetchOrSubstituteTree(
     debug("got tree '%s' from '%s'",
         state.store->printStorePath(tree.storePath), lockedRef);
 
-    if (state.allowedPaths)
-        state.allowedPaths->insert(tree.actualPath);
+    state.registerTree(tree);
 
     assert(!originalRef.input.getNarHash() || tree.storePath == originalRef.input.computeStorePath(*state.store));
 
     return {std::move(tree), resolvedRef, lockedRef};
 }
 
-static void forceTrivialValue(EvalState & state, Value & value, const Pos & pos)
+static void forceTrivialValue(EvalState & state, Value & value, const PosIdx pos)
 {
     if (value.isThunk() && value.isTrivial())
         state.forceValue(value, pos);
@@ -79,19 +79,19 @@ static void forceTrivialValue(EvalState & state, Value & value, const Pos & pos)
 
 
 static void expectType(EvalState & state, ValueType type,
-    Value & value, const Pos & pos)
+    Value & value, const PosIdx pos)
 {
     forceTrivialValue(state, value, pos);
     if (value.type() != type)
         throw Error("expected %s but got %s at %s",
-            showType(type), showType(value.type()), pos);
+            showType(type), showType(value.type()), state.positions[pos]);
 }
 
 static std::map<FlakeId, FlakeInput> parseFlakeInputs(
-    EvalState & state, Value * value, const Pos & pos);
+    EvalState & state, Value * value, const PosIdx pos);
 
 static FlakeInput parseFlakeInput(EvalState & state,
-    const std::string & inputName, Value * value, const Pos & pos)
+    const std::string & inputName, Value * value, const PosIdx pos)
 {
     expectType(state, nAttrs, *value, pos);
 
@@ -108,16 +108,16 @@ static FlakeInput parseFlakeInput(EvalState & state,
     for (nix::Attr attr : *(value->attrs)) {
         try {
             if (attr.name == sUrl) {
-                expectType(state, nString, *attr.value, *attr.pos);
+                expectType(state, nString, *attr.value, attr.pos);
                 url = attr.value->string.s;
                 attrs.emplace("url", *url);
             } else if (attr.name == sFlake) {
-                expectType(state, nBool, *attr.value, *attr.pos);
+                expectType(state, nBool, *attr.value, attr.pos);
                 input.isFlake = attr.value->boolean;
             } else if (attr.name == sInputs) {
-                input.overrides = parseFlakeInputs(state, attr.value, *attr.pos);
+                input.overrides = parseFlakeInputs(state, attr.value, attr.pos);
             } else if (attr.name == sFollows) {
-                expectType(state, nString, *attr.value, *attr.pos);
+                expectType(state, nString, *attr.value, attr.pos);
                 input.follows = parseInputPath(attr.value->string.s);
             } else {
                 switch (attr.value->type()) {
@@ -136,7 +136,7 @@ static FlakeInput parseFlakeInput(EvalState & state,
                 }
             }
         } catch (Error & e) {
-            e.addTrace(*attr.pos, hintfmt("in flake attribute '%s'", attr.name));
+            e.addTrace(state.positions[attr.pos], hintfmt("in flake attribute '%s'", attr.name));
             throw;
         }
     }
@@ -145,13 +145,13 @@ static FlakeInput parseFlakeInput(EvalState & state,
         try {
             input.ref = FlakeRef::fromAttrs(attrs);
         } catch (Error & e) {
-            e.addTrace(pos, hintfmt("in flake input"));
+            e.addTrace(state.positions[pos], hintfmt("in flake input"));
             throw;
         }
     else {
         attrs.erase("url");
         if (!attrs.empty())
-            throw Error("unexpected flake input attribute '%s', at %s", attrs.begin()->first, pos);
+            throw Error("unexpected flake input attribute '%s', at %s", attrs.begin()->first, state.positions[pos]);
         if (url)
             input.ref = parseFlakeRef(*url, {}, true);
     }
@@ -163,7 +163,7 @@ static FlakeInput parseFlakeInput(EvalState & state,
 }
 
 static std::map<FlakeId, FlakeInput> parseFlakeInputs(
-    EvalState & state, Value * value, const Pos & pos)
+    EvalState & state, Value * value, const PosIdx pos)
 {
     std::map<FlakeId, FlakeInput> inputs;
 
@@ -174,7 +174,7 @@ static std::map<FlakeId, FlakeInput> parseFlakeInputs(
             parseFlakeInput(state,
                 inputAttr.name,
                 inputAttr.value,
-                *inputAttr.pos));
+                inputAttr.pos));
     }
 
     return inputs;
@@ -195,6 +195,13 @@ static Flake getFlake(
         throw Error("'flake.nix' file of flake '%s' escapes from '%s'",
             lockedRef, state.store->printStorePath(sourceInfo.storePath));
 
+    /* Evaluate 'flake.nix' under the store path of a lazy tree, see
+       EvalState::evalFile(). */
+    auto flakeFileToEval = flakeFile;
+    auto storePathS = state.store->printStorePath(sourceInfo.storePath);
+    if (state.lazyTrees.count(storePathS))
+        flakeFileToEval = storePathS + flakeFile.substr(sourceInfo.actualPath.size());
+
     Flake flake {
         .originalRef = originalRef,
         .resolvedRef = resolvedRef,
@@ -206,24 +213,24 @@ static Flake getFlake(
         throw Error("source tree referenced by '%s' does not contain a '%s/flake.nix' file", lockedRef, lockedRef.subdir);
 
     Value vInfo;
-    state.evalFile(flakeFile, vInfo, true); // FIXME: symlink attack
+    state.evalFile(flakeFileToEval, vInfo, true); // FIXME: symlink attack
 
-    expectType(state, nAttrs, vInfo, Pos(foFile, state.symbols.create(flakeFile), 0, 0));
+    expectType(state, nAttrs, vInfo, noPos);
 
     if (auto description = vInfo.attrs->get(state.sDescription)) {
-        expectType(state, nString, *description->value, *description->pos);
+        expectType(state, nString, *description->value, description->pos);
         flake.description = description->value->string.s;
     }
 
     auto sInputs = state.symbols.create("inputs");
 
     if (auto inputs = vInfo.attrs->get(sInputs))
-        flake.inputs = parseFlakeInputs(state, inputs->value, *inputs->pos);
+        flake.inputs = parseFlakeInputs(state, inputs->value, inputs->pos);
 
     auto sOutputs = state.symbols.create("outputs");
 
     if (auto outputs = vInfo.attrs->get(sOutputs)) {
-        expectType(state, nFunction, *outputs->value, *outputs->pos);
+        expectType(state, nFunction, *outputs->value, outputs->pos);
 
         if (outputs->value->isLambda() && outputs->value->lambda.fun->matchAttrs) {
             for (auto & formal : outputs->value->lambda.fun->formals->formals) {
@@ -240,16 +247,16 @@ static Flake getFlake(
     auto sNixConfig = state.symbols.create("nixConfig");
 
     if (auto nixConfig = vInfo.attrs->get(sNixConfig)) {
-        expectType(state, nAttrs, *nixConfig->value, *nixConfig->pos);
+        expectType(state, nAttrs, *nixConfig->value, nixConfig->pos);
 
         for (auto & setting : *nixConfig->value->attrs) {
-            forceTrivialValue(state, *setting.value, *setting.pos);
+            forceTrivialValue(state, *setting.value, setting.pos);
             if (setting.value->type() == nString)
-                flake.config.settings.insert({setting.name, state.forceStringNoCtx(*setting.value, *setting.pos)});
+                flake.config.settings.insert({setting.name, state.forceStringNoCtx(*setting.value, setting.pos)});
             else if (setting.value->type() == nInt)
-                flake.config.settings.insert({setting.name, state.forceInt(*setting.value, *setting.pos)});
+                flake.config.settings.insert({setting.name, state.forceInt(*setting.value, setting.pos)});
             else if (setting.value->type() == nBool)
-                flake.config.settings.insert({setting.name, state.forceBool(*setting.value, *setting.pos)});
+                flake.config.settings.insert({setting.name, state.forceBool(*setting.value, setting.pos)});
             else if (setting.value->type() == nList) {
                 std::vector<std::string> ss;
                 for (unsigned int n = 0; n < setting.value->listSize(); ++n) {
@@ -257,7 +264,7 @@ static Flake getFlake(
                     if (elem->type() != nString)
                         throw TypeError("list element in flake configuration setting '%s' is %s while a string is expected",
                             setting.name, showType(*setting.value));
-                    ss.push_back(state.forceStringNoCtx(*elem, *setting.pos));
+                    ss.push_back(state.forceStringNoCtx(*elem, setting.pos));
                 }
                 flake.config.settings.insert({setting.name, ss});
             }
@@ -273,7 +280,7 @@ static Flake getFlake(
             attr.name != sOutputs &&
             attr.name != sNixConfig)
             throw Error("flake '%s' has an unsupported attribute '%s', at %s",
-                lockedRef, attr.name, *attr.pos);
+                lockedRef, attr.name, state.positions[attr.pos]);
     }
 
     return flake;
@@ -324,6 +331,80 @@ LockedFlake lockFlake(
             std::shared_ptr<const Node> oldNode)>
             computeLocks;
 
+        /* Fetch the inputs of a flake that aren't locked yet in
+           parallel, adding them to the flake cache where
+           computeLocks() will find them. This only fetches the
+           source trees; evaluating them is left to computeLocks(),
+           since the evaluator isn't thread-safe. */
+        auto prefetchInputs = [&](
+            const FlakeInputs & flakeInputs,
+            const InputPath & inputPathPrefix,
+            std::shared_ptr<const Node> oldNode)
+        {
+            std::vector<FlakeRef> refs;
+
+            for (auto & [id, input2] : flakeInputs) {
+                auto inputPath(inputPathPrefix);
+                inputPath.push_back(id);
+
+                auto i = overrides.find(inputPath);
+                bool hasOverride = i != overrides.end();
+                auto & input = hasOverride ? i->second : input2;
+
+                if (input.follows || !input.ref) continue;
+
+                if (!lockFlags.allowMutable && !input.ref->input.isImmutable()) continue;
+
+                if (oldNode && !hasOverride && !lockFlags.inputUpdates.count(inputPath))
+                    if (auto oldLock = get(oldNode->inputs, id))
+                        if (auto oldLock2 = std::get_if<0>(&*oldLock))
+                            if ((*oldLock2)->originalRef == *input.ref) continue;
+
+                if (lookupInFlakeCache(flakeCache, *input.ref)) continue;
+
+                /* Resolve indirect inputs here, so that they can be
+                   fetched along with the others. Registry lookups
+                   are cheap once the registries have been loaded. */
+                auto ref = *input.ref;
+                if (!ref.input.isDirect()) {
+                    if (!lockFlags.useRegistries) continue;
+                    try {
+                        ref = ref.resolve(state.store);
+                    } catch (Error & e) {
+                        debug("resolving flake input '%s' failed: %s", ref, e.msg());
+                        continue;
+                    }
+                    if (lookupInFlakeCache(flakeCache, ref)) continue;
+                }
+
+                if (std::find(refs.begin(), refs.end(), ref) != refs.end()) continue;
+
+                refs.push_back(std::move(ref));
+            }
+
+            if (refs.size() < 2) return;
+
+            debug("fetching %d flake inputs of '%s' in parallel", refs.size(), printInputPath(inputPathPrefix));
+
+            ThreadPool pool(std::min((size_t) std::max(1U, settings.flakeFetchJobs.get()), refs.size()));
+
+            std::vector<std::future<FetchedFlake>> fetched;
+            for (auto & ref : refs)
+                fetched.push_back(pool.submit([&]() { return ref.fetchTree(state.store); }));
+
+            pool.process();
+
+            /* Add the results in a deterministic order. */
+            for (size_t n = 0; n < refs.size(); ++n)
+                try {
+                    flakeCache.push_back({refs[n], fetched[n].get()});
+                } catch (Error & e) {
+                    /* computeLocks() will try again and report the
+                       error properly. */
+                    debug("prefetching flake input '%s' failed: %s", refs[n], e.msg());
+                }
+        };
+
         computeLocks = [&](
             const FlakeInputs & flakeInputs,
             std::shared_ptr<Node> node,
@@ -344,6 +425,9 @@ LockedFlake lockFlake(
                 }
             }
 
+            if (settings.flakeFetchJobs > 1)
+                prefetchInputs(flakeInputs, inputPathPrefix, oldNode);
+
             /* Go over the flake inputs, resolve/fetch them if
                necessary (i.e. if they're new or the flakeref changed
                from what's in the lock file). */
@@ -622,12 +706,12 @@ void callFlake(EvalState & state,
     state.callFunction(*vTmp2, *vRootSubdir, vRes, noPos);
 }
 
-static void prim_getFlake(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_getFlake(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     auto flakeRefS = state.forceStringNoCtx(*args[0], pos);
     auto flakeRef = parseFlakeRef(flakeRefS, {}, true);
     if (evalSettings.pureEval && !flakeRef.input.isImmutable())
-        throw Error("cannot call 'getFlake' on mutable flake reference '%s', at %s (use --impure to override)", flakeRefS, pos);
+        throw Error("cannot call 'getFlake' on mutable flake reference '%s', at %s (use --impure to override)", flakeRefS, state.positions[pos]);
 
     callFlake(state,
         lockFlake(state, flakeRef,
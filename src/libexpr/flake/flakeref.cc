@@ -5,6 +5,8 @@
 #include "fetchers.hh"
 #include "registry.hh"
 
+#include <cstring>
+
 namespace nix {
 
 #if 0
@@ -66,46 +68,74 @@ std::optional<FlakeRef> maybeParseFlakeRef(
     }
 }
 
+/* Whether 's' is the path of a path-like flake reference: an
+   optional leading and trailing slash around one or more non-empty
+   components of [0-9a-zA-Z-._~!$&'"()*+,;=], separated by slashes. */
+static bool isValidFlakePath(std::string_view s)
+{
+    auto isFnChar = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || (c && strchr("-._~!$&'\"()*+,;=", c));
+    };
+
+    size_t pos = 0;
+    if (pos < s.size() && s[pos] == '/') pos++;
+    if (pos == s.size()) return false;
+
+    while (pos < s.size()) {
+        auto start = pos;
+        while (pos < s.size() && isFnChar(s[pos])) pos++;
+        if (pos == start) return false;
+        if (pos == s.size()) break;
+        if (s[pos] != '/') return false;
+        pos++;
+    }
+
+    return true;
+}
+
 std::pair<FlakeRef, std::string> parseFlakeRefWithFragment(
     const std::string & url, const std::optional<Path> & baseDir, bool allowMissing)
 {
     using namespace fetchers;
 
-    static std::string fnRegex = "[0-9a-zA-Z-._~!$&'\"()*+,;=]+";
-
-    static std::regex pathUrlRegex(
-        "(/?" + fnRegex + "(?:/" + fnRegex + ")*/?)"
-        + "(?:\\?(" + queryRegex + "))?"
-        + "(?:#(" + queryRegex + "))?",
-        std::regex::ECMAScript);
-
-    static std::regex flakeRegex(
-        "((" + flakeIdRegexS + ")(?:/(?:" + refAndOrRevRegex + "))?)"
-        + "(?:#(" + queryRegex + "))?",
-        std::regex::ECMAScript);
-
-    std::smatch match;
+    /* Split off the fragment. Neither the flake ID, path or query
+       syntax allows a '#'. */
+    std::string_view urlS(url);
+    auto hash = urlS.find('#');
+    auto beforeFragment = urlS.substr(0, hash);
+    auto fragmentS = hash == urlS.npos ? std::string_view() : urlS.substr(hash + 1);
+    bool validFragment = isValidQuery(fragmentS);
 
     /* Check if 'url' is a flake ID. This is an abbreviated syntax for
        'flake:<flake-id>?ref=<ref>&rev=<rev>'. */
 
-    if (std::regex_match(url, match, flakeRegex)) {
+    auto slash = beforeFragment.find('/');
+
+    if (validFragment
+        && isValidFlakeId(beforeFragment.substr(0, slash))
+        && (slash == beforeFragment.npos || isValidRef(beforeFragment.substr(slash + 1))))
+    {
         auto parsedURL = ParsedURL{
             .url = url,
-            .base = "flake:" + std::string(match[1]),
+            .base = "flake:" + std::string(beforeFragment),
             .scheme = "flake",
             .authority = "",
-            .path = match[1],
+            .path = std::string(beforeFragment),
         };
 
         return std::make_pair(
             FlakeRef(Input::fromURL(parsedURL), ""),
-            percentDecode(std::string(match[6])));
+            percentDecode(fragmentS));
     }
 
-    else if (std::regex_match(url, match, pathUrlRegex)) {
-        std::string path = match[1];
-        std::string fragment = percentDecode(std::string(match[3]));
+    auto question = beforeFragment.find('?');
+    auto pathS = beforeFragment.substr(0, question);
+    auto queryS = question == beforeFragment.npos ? std::string_view() : beforeFragment.substr(question + 1);
+
+    if (validFragment && isValidFlakePath(pathS) && isValidQuery(queryS)) {
+        std::string path(pathS);
+        std::string fragment = percentDecode(fragmentS);
 
         if (baseDir) {
             /* Check if 'url' is a path (either absolute or relative
@@ -133,7 +163,7 @@ std::pair<FlakeRef, std::string> parseFlakeRefWithFragment(
                         .scheme = "git+file",
                         .authority = "",
                         .path = flakeRoot,
-                        .query = decodeQuery(match[2]),
+                        .query = decodeQuery(std::string(queryS)),
                     };
 
                     if (subdir != "") {
@@ -157,7 +187,7 @@ std::pair<FlakeRef, std::string> parseFlakeRefWithFragment(
         } else {
             if (!hasPrefix(path, "/"))
                 throw BadURL("flake reference '%s' is not an absolute path", url);
-            auto query = decodeQuery(match[2]);
+            auto query = decodeQuery(std::string(queryS));
             path = canonPath(path + "/" + get(query, "dir").value_or(""));
         }
 
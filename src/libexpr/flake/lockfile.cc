@@ -235,7 +235,7 @@ InputPath parseInputPath(std::string_view s)
     InputPath path;
 
     for (auto & elem : tokenizeString<std::vector<std::string>>(s, "/")) {
-        if (!std::regex_match(elem, flakeIdRegex))
+        if (!isValidFlakeId(elem))
             throw UsageError("invalid flake input path element '%s'", elem);
         path.push_back(elem);
     }
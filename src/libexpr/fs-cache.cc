@@ -0,0 +1,176 @@
+#include "fs-cache.hh"
+
+#include <algorithm>
+
+namespace nix {
+
+FSCache::FSCache(const Path & storeDir)
+    : storeDir(storeDir)
+{
+}
+
+bool FSCache::inStore(const Path & path) const
+{
+    return isDirOrInDir(path, storeDir);
+}
+
+const FSCache::StatResult & FSCache::lookup(const Path & path)
+{
+    auto i = stats.find(path);
+    if (i != stats.end()) {
+        nrHits++;
+        return i->second;
+    }
+
+    StatResult res;
+
+    /* If we have the listing of the parent directory, a missing
+       entry doesn't exist. */
+    auto j = path == "/" ? dirs.end() : dirs.find(dirOf(path));
+    if (j != dirs.end()) {
+        auto name = baseNameOf(path);
+        auto k = std::lower_bound(j->second.begin(), j->second.end(), name,
+            [](const DirEntry & e, std::string_view name) { return e.name < name; });
+        if (k == j->second.end() || k->name != name) {
+            nrHits++;
+            res.error = ENOENT;
+            return stats.insert_or_assign(path, res).first->second;
+        }
+    }
+
+    nrMisses++;
+    checkInterrupt();
+    res.error = ::lstat(path.c_str(), &res.st) ? errno : 0;
+
+    /* Don't cache the non-existence of a store path, which may still
+       be created. */
+    if (res.error && inStore(path)) {
+        uncachedStat = res;
+        return uncachedStat;
+    }
+
+    return stats.insert_or_assign(path, res).first->second;
+}
+
+const struct stat & FSCache::lstat(const Path & path)
+{
+    auto & res = lookup(path);
+    if (res.error) {
+        errno = res.error;
+        throw SysError("getting status of '%1%'", path);
+    }
+    return res.st;
+}
+
+bool FSCache::pathExists(const Path & path)
+{
+    auto & res = lookup(path);
+    if (!res.error) return true;
+    if (res.error != ENOENT && res.error != ENOTDIR) {
+        errno = res.error;
+        throw SysError("getting status of %1%", path);
+    }
+    return false;
+}
+
+const Path & FSCache::readLink(const Path & path)
+{
+    auto i = links.find(path);
+    if (i != links.end()) {
+        nrHits++;
+        return i->second;
+    }
+    nrMisses++;
+    return links.emplace(path, nix::readLink(path)).first->second;
+}
+
+const DirEntries & FSCache::readDirectory(const Path & path)
+{
+    auto i = dirs.find(path);
+    if (i != dirs.end()) {
+        nrHits++;
+        return i->second;
+    }
+
+    nrMisses++;
+    auto entries = nix::readDirectory(path);
+    std::sort(entries.begin(), entries.end(),
+        [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+
+    for (auto & entry : entries) {
+        if (entry.type != DT_UNKNOWN) continue;
+        auto & st = lstat(path + "/" + entry.name);
+        entry.type =
+            S_ISDIR(st.st_mode) ? DT_DIR :
+            S_ISLNK(st.st_mode) ? DT_LNK :
+            S_ISREG(st.st_mode) ? DT_REG :
+            DT_UNKNOWN;
+    }
+
+    /* The store directory gains entries during an evaluation. */
+    if (path == storeDir) {
+        uncachedDir = std::move(entries);
+        return uncachedDir;
+    }
+
+    return dirs.emplace(path, std::move(entries)).first->second;
+}
+
+Path FSCache::canonPath(const Path & path)
+{
+    /* This is canonPath() in util.cc, using the cache to look up
+       symlinks. */
+    assert(path != "");
+
+    std::string s;
+
+    if (path[0] != '/')
+        throw Error("not an absolute path: '%1%'", path);
+
+    std::string::const_iterator i = path.begin(), end = path.end();
+    std::string temp;
+
+    unsigned int followCount = 0, maxFollow = 1024;
+
+    while (1) {
+
+        while (i != end && *i == '/') i++;
+        if (i == end) break;
+
+        if (*i == '.' && (i + 1 == end || i[1] == '/'))
+            i++;
+
+        else if (*i == '.' && i + 1 < end && i[1] == '.' &&
+            (i + 2 == end || i[2] == '/'))
+        {
+            if (!s.empty()) s.erase(s.rfind('/'));
+            i += 2;
+        }
+
+        else {
+            s += '/';
+            while (i != end && *i != '/') s += *i++;
+
+            if (S_ISLNK(lstat(s).st_mode)) {
+                if (++followCount >= maxFollow)
+                    throw Error("infinite symlink recursion in path '%1%'", path);
+                temp = absPath(readLink(s), dirOf(s))
+                    + std::string(i, end);
+                i = temp.begin();
+                end = temp.end();
+                s = "";
+            }
+        }
+    }
+
+    return s.empty() ? "/" : s;
+}
+
+void FSCache::clear()
+{
+    stats.clear();
+    links.clear();
+    dirs.clear();
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "util.hh"
+
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+namespace nix {
+
+/* A cache of the file system metadata that the evaluator looks at:
+   the results of lstat(), the targets of symlinks and the contents of
+   directories. It lives as long as the EvalState, on the assumption
+   that source files don't change during an evaluation, and saves
+   repeated system calls for the same paths (e.g. by pathExists, the
+   resolution of imports and search paths, and the canonicalisation of
+   paths in restricted mode), which is expensive on network file
+   systems. A directory listing also answers the lstat() of any entry
+   missing from it, without a system call.
+
+   Paths in the Nix store may appear during an evaluation (e.g. by
+   import-from-derivation), so the non-existence of a path in the
+   store is not cached, and neither is the listing of the store
+   directory itself. */
+class FSCache
+{
+public:
+
+    FSCache(const Path & storeDir);
+
+    /* Like lstat() in util.hh. */
+    const struct stat & lstat(const Path & path);
+
+    /* Like pathExists() in util.hh. */
+    bool pathExists(const Path & path);
+
+    /* Like readLink() in util.hh. */
+    const Path & readLink(const Path & path);
+
+    /* Like readDirectory() in util.hh, except that the entries are
+       sorted by name and their type is never DT_UNKNOWN if the
+       entry is a regular file, directory or symlink. */
+    const DirEntries & readDirectory(const Path & path);
+
+    /* Like canonPath(path, true) in util.hh. */
+    Path canonPath(const Path & path);
+
+    void clear();
+
+    /* The number of lookups answered from the cache, and the number
+       that required a system call. */
+    uint64_t nrHits = 0, nrMisses = 0;
+
+private:
+
+    struct StatResult
+    {
+        struct stat st;
+        /* The errno of lstat(), or 0 if it succeeded. */
+        int error;
+    };
+
+    Path storeDir;
+
+    std::unordered_map<Path, StatResult> stats;
+
+    std::unordered_map<Path, Path> links;
+
+    std::unordered_map<Path, DirEntries> dirs;
+
+    /* The last result that wasn't cached, which the returned
+       reference points to until the next lookup. */
+    StatResult uncachedStat;
+    DirEntries uncachedDir;
+
+    const StatResult & lookup(const Path & path);
+
+    bool inStore(const Path & path) const;
+};
+
+}
@@ -1,5 +1,9 @@
 #include "function-trace.hh"
 #include "logging.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <fstream>
 
 namespace nix {
 
@@ -15,4 +19,113 @@ FunctionCallTrace::~FunctionCallTrace() {
     printMsg(lvlInfo, "function-trace exited %1% at %2%", pos, ns.count());
 }
 
+
+EvalProfiler::EvalProfiler(EvalState & state)
+    : state(state)
+{
+    nodes.emplace_back("<root>", 0);
+}
+
+
+size_t EvalProfiler::getChild(const void * key, std::function<std::string()> name)
+{
+    auto i = nodes[current].children.find(key);
+    if (i != nodes[current].children.end()) return i->second;
+    auto n = nodes.size();
+    /* Frames are separated by semicolons in the output format. */
+    nodes.emplace_back(replaceStrings(name(), ";", ","), current);
+    nodes[current].children.emplace(key, n);
+    return n;
+}
+
+
+void EvalProfiler::write(const Path & path, const std::string & weight)
+{
+    bool byTime = weight == "time";
+    if (!byTime && weight != "allocations")
+        throw UsageError("unknown profile weight '%s'; must be 'time' or 'allocations'", weight);
+
+    std::ofstream out(path);
+    if (!out) throw SysError("opening '%s'", path);
+
+    std::function<void(size_t, const std::string &)> recurse;
+    recurse = [&](size_t n, const std::string & stack) {
+        auto & node = nodes[n];
+        uint64_t self = byTime ? node.time : node.allocations;
+        for (auto & child : node.children) {
+            auto & c = nodes[child.second];
+            self -= std::min(self, byTime ? c.time : c.allocations);
+            recurse(child.second, stack + ";" + c.name);
+        }
+        if (n && self)
+            out << std::string(stack, 1) << " " << self << "\n";
+    };
+    recurse(0, "");
+
+    if (!out) throw SysError("writing '%s'", path);
+}
+
+
+std::vector<std::pair<std::string, uint64_t>> EvalProfiler::topAllocations(size_t n)
+{
+    /* The functions on the current call path haven't added their
+       allocations to their nodes yet. */
+    std::set<size_t> active;
+    for (auto i = current; i; i = nodes[i].parent)
+        active.insert(i);
+
+    auto bytes = [&, now = state.bytesAllocated()](size_t i) {
+        return nodes[i].bytes + (active.count(i) ? now - nodes[i].bytesAtEntry : 0);
+    };
+
+    std::map<std::string, uint64_t> selfBytes;
+    for (size_t i = 1; i < nodes.size(); ++i) {
+        uint64_t self = bytes(i);
+        for (auto & child : nodes[i].children)
+            self -= std::min(self, bytes(child.second));
+        if (self) selfBytes[nodes[i].name] += self;
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> res(selfBytes.begin(), selfBytes.end());
+    std::sort(res.begin(), res.end(), [](auto & a, auto & b) { return a.second > b.second; });
+    if (res.size() > n) res.resize(n);
+    return res;
+}
+
+
+ProfiledCall::ProfiledCall(EvalProfiler & profiler, const ExprLambda & lambda)
+    : profiler(profiler)
+{
+    enter(profiler.getChild(&lambda, [&]() { return lambda.showNamePos(profiler.state); }));
+}
+
+
+ProfiledCall::ProfiledCall(EvalProfiler & profiler, const PrimOp & primOp)
+    : profiler(profiler)
+{
+    enter(profiler.getChild(&primOp, [&]() { return "primop " + (std::string) primOp.name; }));
+}
+
+
+void ProfiledCall::enter(size_t node)
+{
+    this->node = node;
+    profiler.current = node;
+    allocationsAtStart = profiler.state.nrAllocations();
+    profiler.nodes[node].bytesAtEntry = profiler.state.bytesAllocated();
+    start = std::chrono::steady_clock::now();
+}
+
+
+ProfiledCall::~ProfiledCall()
+{
+    auto & n = profiler.nodes[node];
+    n.calls++;
+    n.time += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    n.allocations += profiler.state.nrAllocations() - allocationsAtStart;
+    n.bytes += profiler.state.bytesAllocated() - n.bytesAtEntry;
+    profiler.current = n.parent;
+}
+
 }
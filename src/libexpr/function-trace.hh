@@ -3,13 +3,77 @@
 #include "eval.hh"
 
 #include <chrono>
+#include <unordered_map>
 
 namespace nix {
 
 struct FunctionCallTrace
 {
-    const Pos & pos;
+    const Pos pos;
     FunctionCallTrace(const Pos & pos);
     ~FunctionCallTrace();
 };
+
+/* An aggregating profiler for function calls, enabled by the
+   `eval-profile-file` and `eval-memory-limit` settings. It maintains
+   a call tree in which each node records the number of calls, the
+   time spent and the number of allocations and bytes allocated in a
+   function (including its callees), and writes it out in the
+   "collapsed stack" format used by flamegraph.pl. */
+struct EvalProfiler
+{
+    struct Node
+    {
+        std::string name;
+        size_t parent;
+        uint64_t calls = 0;
+        uint64_t time = 0; // nanoseconds
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        /* The value of EvalState::bytesAllocated() when the function
+           was entered, if it is currently being executed. */
+        uint64_t bytesAtEntry = 0;
+        std::unordered_map<const void *, size_t> children;
+        Node(std::string name, size_t parent) : name(std::move(name)), parent(parent) { }
+    };
+
+    EvalState & state;
+
+    /* The call tree. nodes[0] is the root. */
+    std::vector<Node> nodes;
+
+    /* The node of the function currently being executed. */
+    size_t current = 0;
+
+    EvalProfiler(EvalState & state);
+
+    /* Write the call tree to 'path'. 'weight' is either "time" or
+       "allocations". */
+    void write(const Path & path, const std::string & weight);
+
+    size_t getChild(const void * key, std::function<std::string()> name);
+
+    /* Return the 'n' functions that allocated the most bytes
+       themselves (excluding their callees), summed over all their
+       call sites and including the calls that are still in
+       progress. */
+    std::vector<std::pair<std::string, uint64_t>> topAllocations(size_t n);
+};
+
+/* Records a call in the profiler for as long as it's in scope. */
+struct ProfiledCall
+{
+    EvalProfiler & profiler;
+    size_t node;
+    std::chrono::steady_clock::time_point start;
+    uint64_t allocationsAtStart;
+
+    ProfiledCall(EvalProfiler & profiler, const ExprLambda & lambda);
+    ProfiledCall(EvalProfiler & profiler, const PrimOp & primOp);
+    ~ProfiledCall();
+
+private:
+    void enter(size_t node);
+};
+
 }
@@ -61,7 +61,7 @@ string DrvInfo::querySystem() const
 {
     if (system == "" && attrs) {
         auto i = attrs->find(state->sSystem);
-        system = i == attrs->end() ? "unknown" : state->forceStringNoCtx(*i->value, *i->pos);
+        system = i == attrs->end() ? "unknown" : state->forceStringNoCtx(*i->value, i->pos);
     }
     return system;
 }
@@ -72,7 +72,7 @@ string DrvInfo::queryDrvPath() const
     if (drvPath == "" && attrs) {
         Bindings::iterator i = attrs->find(state->sDrvPath);
         PathSet context;
-        drvPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
+        drvPath = i != attrs->end() ? state->coerceToPath(i->pos, *i->value, context) : "";
     }
     return drvPath;
 }
@@ -84,7 +84,7 @@ string DrvInfo::queryOutPath() const
         Bindings::iterator i = attrs->find(state->sOutPath);
         PathSet context;
         if (i != attrs->end())
-            outPath = state->coerceToPath(*i->pos, *i->value, context);
+            outPath = state->coerceToPath(i->pos, *i->value, context);
     }
     if (!outPath)
         throw UnimplementedError("CA derivations are not yet supported");
@@ -98,12 +98,12 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
         /* Get the ‘outputs’ list. */
         Bindings::iterator i;
         if (attrs && (i = attrs->find(state->sOutputs)) != attrs->end()) {
-            state->forceList(*i->value, *i->pos);
+            state->forceList(*i->value, i->pos);
 
             /* For each output... */
             for (unsigned int j = 0; j < i->value->listSize(); ++j) {
                 /* Evaluate the corresponding set. */
-                string name = state->forceStringNoCtx(*i->value->listElems()[j], *i->pos);
+                string name = state->forceStringNoCtx(*i->value->listElems()[j], i->pos);
                 Bindings::iterator out = attrs->find(state->symbols.create(name));
                 if (out == attrs->end()) continue; // FIXME: throw error?
                 state->forceAttrs(*out->value);
@@ -112,7 +112,7 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
                 Bindings::iterator outPath = out->value->attrs->find(state->sOutPath);
                 if (outPath == out->value->attrs->end()) continue; // FIXME: throw error?
                 PathSet context;
-                outputs[name] = state->coerceToPath(*outPath->pos, *outPath->value, context);
+                outputs[name] = state->coerceToPath(outPath->pos, *outPath->value, context);
             }
         } else
             outputs["out"] = queryOutPath();
@@ -153,7 +153,7 @@ Bindings * DrvInfo::getMeta()
     if (!attrs) return 0;
     Bindings::iterator a = attrs->find(state->sMeta);
     if (a == attrs->end()) return 0;
-    state->forceAttrs(*a->value, *a->pos);
+    state->forceAttrs(*a->value, a->pos);
     meta = a->value->attrs;
     return meta;
 }
@@ -320,6 +320,17 @@ static string addToPath(const string & s1, const string & s2)
 static std::regex attrRegex("[A-Za-z_][A-Za-z0-9-_+]*");
 
 
+/* Evaluate what getDerivation() evaluates for `v'. */
+static void prefetchDerivation(EvalState & state, Value & v)
+{
+    state.forceValue(v);
+    if (!state.isDerivation(v)) return;
+    auto i = v.attrs->find(state.sName);
+    if (i != v.attrs->end())
+        state.forceValue(*i->value);
+}
+
+
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
     DrvInfos & drvs, Done & done,
@@ -342,7 +353,18 @@ static void getDerivations(EvalState & state, Value & vIn,
            there are names clashes between derivations, the derivation
            bound to the attribute with the "lower" name should take
            precedence). */
-        for (auto & i : v.attrs->lexicographicOrder()) {
+        auto attrs = v.attrs->lexicographicOrder();
+
+        /* Evaluate the attributes up to their names first, so that
+           the builds they import from happen in parallel. */
+        state.prefetchImports(attrs.size(), [&](size_t n) {
+            auto i = attrs[n];
+            if (!std::regex_match(std::string(i->name), attrRegex)) return;
+            if (combineChannels) return;
+            prefetchDerivation(state, *i->value);
+        });
+
+        for (auto & i : attrs) {
             debug("evaluating attribute '%1%'", i->name);
             if (!std::regex_match(std::string(i->name), attrRegex))
                 continue;
@@ -355,7 +377,7 @@ static void getDerivations(EvalState & state, Value & vIn,
                    `recurseForDerivations = true' attribute. */
                 if (i->value->type() == nAttrs) {
                     Bindings::iterator j = i->value->attrs->find(state.sRecurseForDerivations);
-                    if (j != i->value->attrs->end() && state.forceBool(*j->value, *j->pos))
+                    if (j != i->value->attrs->end() && state.forceBool(*j->value, j->pos))
                         getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
                 }
             }
@@ -363,6 +385,9 @@ static void getDerivations(EvalState & state, Value & vIn,
     }
 
     else if (v.type() == nList) {
+        state.prefetchImports(v.listSize(), [&](size_t n) {
+            prefetchDerivation(state, *v.listElems()[n]);
+        });
         for (unsigned int n = 0; n < v.listSize(); ++n) {
             string pathPrefix2 = addToPath(pathPrefix, (format("%1%") % n).str());
             if (getDerivation(state, *v.listElems()[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
@@ -374,6 +399,17 @@ static void getDerivations(EvalState & state, Value & vIn,
 }
 
 
+void prefetchDrvPaths(EvalState & state, DrvInfos & drvs)
+{
+    std::vector<DrvInfo *> todo;
+    for (auto & drv : drvs)
+        todo.push_back(&drv);
+    state.prefetchImports(todo.size(), [&](size_t n) {
+        todo[n]->queryDrvPath();
+    });
+}
+
+
 void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
 {
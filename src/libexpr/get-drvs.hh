@@ -85,5 +85,10 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs,
     bool ignoreAssertionFailures);
 
+/* Evaluate the derivation paths of `drvs' with
+   EvalState::prefetchImports(), so that the derivations they import
+   from are built at once. */
+void prefetchDrvPaths(EvalState & state, DrvInfos & drvs);
+
 
 }
@@ -1,5 +1,6 @@
 #include "json-to-value.hh"
 
+#include <cstring>
 #include <variant>
 #include <nlohmann/json.hpp>
 
@@ -157,12 +158,155 @@ public:
     }
 };
 
-void parseJSON(EvalState & state, const string & s_, Value & v)
+static void parseJSONStrict(EvalState & state, std::string_view s, Value & v)
 {
     JSONSax parser(state, v);
-    bool res = json::sax_parse(s_, &parser);
+    bool res = json::sax_parse(s.begin(), s.end(), &parser);
     if (!res)
         throw JSONParseError("Invalid JSON Value");
 }
 
+static size_t skipWhitespace(std::string_view s, size_t pos)
+{
+    while (pos < s.size() && s[pos] && strchr(" \t\n\r", s[pos])) pos++;
+    return pos;
+}
+
+/* Return the position just after the string literal starting at
+   `pos'. */
+static size_t skipString(std::string_view s, size_t pos)
+{
+    for (pos++; pos < s.size(); pos++) {
+        if (s[pos] == '\\') pos++;
+        else if (s[pos] == '"') return pos + 1;
+    }
+    throw JSONParseError("unterminated string in JSON value");
+}
+
+/* Return the position just after the JSON value starting at `pos',
+   without parsing it. Only the nesting of objects, arrays and strings
+   is checked here; the rest is checked when the value is parsed. */
+static size_t skipValue(std::string_view s, size_t pos)
+{
+    size_t depth = 0;
+    do {
+        if (pos >= s.size())
+            throw JSONParseError("unexpected end of JSON value");
+        char c = s[pos];
+        if (c == '"')
+            pos = skipString(s, pos);
+        else if (c == '{' || c == '[') {
+            depth++;
+            pos++;
+        } else if (c == '}' || c == ']') {
+            if (!depth) throw JSONParseError("unexpected '%c' in JSON value", c);
+            depth--;
+            pos++;
+        } else if (depth)
+            pos++;
+        else {
+            while (pos < s.size() && s[pos] && !strchr(",}] \t\n\r", s[pos])) pos++;
+            return pos;
+        }
+    } while (depth);
+    return pos;
+}
+
+static void parseJSONLazy(EvalState & state, std::string_view s, Value & v)
+{
+    size_t pos = skipWhitespace(s, 0);
+    if (pos == s.size() || (s[pos] != '{' && s[pos] != '[')) {
+        parseJSONStrict(state, s, v);
+        return;
+    }
+
+    bool isObject = s[pos] == '{';
+    char close = isObject ? '}' : ']';
+
+    Value * fromJSON = nullptr;
+
+    auto parseElem = [&](std::string_view e) {
+        if (e.empty())
+            throw JSONParseError("expected a value in JSON value");
+        auto v2 = state.allocValue();
+        if (e[0] == '{' || e[0] == '[') {
+            if (!fromJSON) fromJSON = &state.getBuiltin("fromJSON");
+            auto vText = state.allocValue();
+            mkString(*vText, e);
+            mkApp(*v2, *fromJSON, *vText);
+        } else
+            parseJSONStrict(state, e, *v2);
+        return v2;
+    };
+
+    auto expect = [&](char c) {
+        if (pos >= s.size() || s[pos] != c)
+            throw JSONParseError("expected '%c' in JSON value", c);
+        pos = skipWhitespace(s, pos + 1);
+    };
+
+    ValueMap attrs;
+    ValueVector elems;
+
+    pos = skipWhitespace(s, pos + 1);
+    if (pos < s.size() && s[pos] == close)
+        pos++;
+    else
+        while (true) {
+            Symbol name;
+            if (isObject) {
+                if (pos >= s.size() || s[pos] != '"')
+                    throw JSONParseError("expected a string in JSON value");
+                auto end = skipString(s, pos);
+                auto key = s.substr(pos, end - pos);
+                if (key.find('\\') == std::string_view::npos)
+                    name = state.symbols.create(key.substr(1, key.size() - 2));
+                else
+                    try {
+                        name = state.symbols.create(json::parse(key).get<std::string>());
+                    } catch (json::exception & e) {
+                        throw JSONParseError(e.what());
+                    }
+                pos = skipWhitespace(s, end);
+                expect(':');
+            }
+
+            auto end = skipValue(s, pos);
+            auto elem = parseElem(s.substr(pos, end - pos));
+            if (isObject)
+                attrs.insert_or_assign(name, elem);
+            else
+                elems.push_back(elem);
+            pos = skipWhitespace(s, end);
+
+            if (pos < s.size() && s[pos] == ',') {
+                pos = skipWhitespace(s, pos + 1);
+                continue;
+            }
+            expect(close);
+            break;
+        }
+
+    if (skipWhitespace(s, pos) != s.size())
+        throw JSONParseError("unexpected trailing characters after JSON value");
+
+    if (isObject) {
+        state.mkAttrs(v, attrs.size());
+        for (auto & i : attrs)
+            v.attrs->push_back(Attr(i.first, i.second));
+    } else {
+        state.mkList(v, elems.size());
+        for (size_t n = 0; n < elems.size(); ++n)
+            v.listElems()[n] = elems[n];
+    }
+}
+
+void parseJSON(EvalState & state, std::string_view s, Value & v, bool lazy)
+{
+    if (lazy)
+        parseJSONLazy(state, s, v);
+    else
+        parseJSONStrict(state, s, v);
+}
+
 }
@@ -8,6 +8,10 @@ namespace nix {
 
 MakeError(JSONParseError, EvalError);
 
-void parseJSON(EvalState & state, const string & s, Value & v);
+/* Parse a JSON document into a Nix value. If `lazy' is set, nested
+   objects and arrays are not parsed, but become applications of
+   `builtins.fromJSON' to their text, which are evaluated on first
+   access. */
+void parseJSON(EvalState & state, std::string_view s, Value & v, bool lazy = false);
 
 }
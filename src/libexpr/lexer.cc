@@ -0,0 +1,544 @@
+#include "lexer.hh"
+
+#include <boost/lexical_cast.hpp>
+
+#include <cstring>
+
+namespace nix {
+
+
+/* Character classes used by the token rules. */
+enum : uint8_t {
+    cSpace = 1 << 0,   /* [ \t\r\n] */
+    cDigit = 1 << 1,   /* [0-9] */
+    cAlpha = 1 << 2,   /* [a-zA-Z] */
+    cIdStart = 1 << 3, /* [a-zA-Z_] */
+    cId = 1 << 4,      /* [a-zA-Z0-9_'-] */
+    cPath = 1 << 5,    /* [a-zA-Z0-9._+-] */
+    cScheme = 1 << 6,  /* [a-zA-Z0-9+.-] */
+    cUri = 1 << 7,     /* [a-zA-Z0-9%/?:@&=+$,_.!~*'-] */
+};
+
+struct CharClasses
+{
+    uint8_t classes[256];
+
+    constexpr void add(const char * chars, uint8_t c)
+    {
+        for (; *chars; ++chars)
+            classes[(unsigned char) *chars] |= c;
+    }
+
+    constexpr CharClasses() : classes{}
+    {
+        const char * digits = "0123456789";
+        const char * letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        add(" \t\r\n", cSpace);
+        add(digits, cDigit | cId | cPath | cScheme | cUri);
+        add(letters, cAlpha | cIdStart | cId | cPath | cScheme | cUri);
+        add("_", cIdStart | cId);
+        add("'-", cId);
+        add("._+-", cPath);
+        add("+.-", cScheme);
+        add("%/?:@&=+$,_.!~*'-", cUri);
+    }
+};
+
+static constexpr CharClasses charClasses;
+
+static inline bool is(char c, uint8_t cls)
+{
+    return charClasses.classes[(unsigned char) c] & cls;
+}
+
+
+/* The rules below follow the longest-match semantics of the flex
+   scanner that this lexer replaced: each returns the length of the
+   longest match at 's', or 0 if there is none. */
+
+/* (\/[a-zA-Z0-9._+-]+)+\/? */
+static size_t matchPathSegments(const char * s)
+{
+    auto q = s;
+    while (*q == '/' && is(q[1], cPath)) {
+        q += 2;
+        while (is(*q, cPath)) q++;
+    }
+    if (q == s) return 0;
+    if (*q == '/') q++;
+    return q - s;
+}
+
+/* [a-zA-Z0-9._+-]*(\/[a-zA-Z0-9._+-]+)+\/? */
+static size_t matchPath(const char * s)
+{
+    auto q = s;
+    while (is(*q, cPath)) q++;
+    auto n = matchPathSegments(q);
+    return n ? q - s + n : 0;
+}
+
+/* ~(\/[a-zA-Z0-9._+-]+)+\/? */
+static size_t matchHPath(const char * s)
+{
+    auto n = matchPathSegments(s + 1);
+    return n ? n + 1 : 0;
+}
+
+/* <[a-zA-Z0-9._+-]+(\/[a-zA-Z0-9._+-]+)*> */
+static size_t matchSPath(const char * s)
+{
+    auto q = s + 1;
+    if (!is(*q, cPath)) return 0;
+    while (true) {
+        while (is(*q, cPath)) q++;
+        if (*q != '/' || !is(q[1], cPath)) break;
+        q++;
+    }
+    return *q == '>' ? q + 1 - s : 0;
+}
+
+/* [a-zA-Z][a-zA-Z0-9+.-]*:[a-zA-Z0-9%/?:@&=+$,_.!~*'-]+ */
+static size_t matchUri(const char * s)
+{
+    auto q = s + 1;
+    while (is(*q, cScheme)) q++;
+    if (*q != ':' || !is(q[1], cUri)) return 0;
+    q += 2;
+    while (is(*q, cUri)) q++;
+    return q - s;
+}
+
+/* (([1-9][0-9]*\.[0-9]*)|(0?\.[0-9]+))([Ee][+-]?[0-9]+)? */
+static size_t matchFloat(const char * s)
+{
+    auto q = s;
+    if (*q >= '1' && *q <= '9') {
+        while (is(*q, cDigit)) q++;
+        if (*q != '.') return 0;
+        q++;
+        while (is(*q, cDigit)) q++;
+    } else {
+        if (*q == '0') q++;
+        if (*q != '.' || !is(q[1], cDigit)) return 0;
+        q += 2;
+        while (is(*q, cDigit)) q++;
+    }
+    if (*q == 'e' || *q == 'E') {
+        auto r = q + 1;
+        if (*r == '+' || *r == '-') r++;
+        if (is(*r, cDigit)) {
+            while (is(*r, cDigit)) r++;
+            q = r;
+        }
+    }
+    return q - s;
+}
+
+static int keywordOrId(std::string_view s)
+{
+    switch (s.size()) {
+    case 2:
+        if (s == "if") return IF;
+        if (s == "in") return IN;
+        if (s == "or") return OR_KW;
+        break;
+    case 3:
+        if (s == "let") return LET;
+        if (s == "rec") return REC;
+        break;
+    case 4:
+        if (s == "then") return THEN;
+        if (s == "else") return ELSE;
+        if (s == "with") return WITH;
+        break;
+    case 6:
+        if (s == "assert") return ASSERT;
+        break;
+    case 7:
+        if (s == "inherit") return INHERIT;
+        break;
+    }
+    return ID;
+}
+
+
+static Expr * unescapeStr(SymbolTable & symbols, const char * s, size_t length)
+{
+    std::string t;
+    t.reserve(length);
+    auto end = s + length;
+    while (s != end) {
+        char c = *s++;
+        if (c == '\\') {
+            assert(s != end);
+            c = *s++;
+            if (c == 'n') t += '\n';
+            else if (c == 'r') t += '\r';
+            else if (c == 't') t += '\t';
+            else t += c;
+        }
+        else if (c == '\r') {
+            /* Normalise CR and CR/LF into LF. */
+            t += '\n';
+            if (s != end && *s == '\n') s++; /* cr/lf */
+        }
+        else t += c;
+    }
+    return new ExprString(symbols.create(t));
+}
+
+
+Lexer::Lexer(const char * text)
+    : p(text)
+    , states{sInitial}
+{
+    loc.first_line = loc.last_line = 1;
+    loc.first_column = loc.last_column = 1;
+}
+
+
+void Lexer::advance(size_t len)
+{
+    loc.first_line = loc.last_line;
+    loc.first_column = loc.last_column;
+
+    auto end = p + len;
+    while (p != end) {
+        switch (*p++) {
+        case '\r':
+            if (p != end && *p == '\n') /* cr/lf */
+                p++;
+            /* fall through */
+        case '\n':
+            ++loc.last_line;
+            loc.last_column = 1;
+            break;
+        default:
+            ++loc.last_column;
+        }
+    }
+}
+
+
+int Lexer::lex(YYSTYPE * lval, YYLTYPE * loc, ParseData & data)
+{
+    int token;
+    switch (states.back()) {
+    case sString:
+        token = lexString(lval, data);
+        break;
+    case sIndString:
+        token = lexIndString(lval, data);
+        break;
+    default:
+        token = lexExpr(lval);
+    }
+    *loc = this->loc;
+    return token;
+}
+
+
+int Lexer::lexExpr(YYSTYPE * lval)
+{
+    /* Skip whitespace and comments. */
+    while (true) {
+        if (is(*p, cSpace)) {
+            auto q = p + 1;
+            while (is(*q, cSpace)) q++;
+            advance(q - p);
+        }
+
+        else if (*p == '#')
+            advance(strcspn(p, "\r\n"));
+
+        else if (*p == '/' && p[1] == '*') {
+            /* An unterminated comment isn't a comment. */
+            auto q = p + 2;
+            while ((q = strchr(q, '*')) && q[1] != '/') q++;
+            if (!q) break;
+            advance(q + 2 - p);
+        }
+
+        else break;
+    }
+
+    if (!*p) return 0;
+
+    /* Find the longest match among the token rules, preferring the
+       first rule in case of a tie (i.e. keywords over identifiers). */
+    auto start = p;
+    char c = *p;
+    size_t len = 0;
+    int token = 0;
+
+    auto match = [&](size_t n, int t) {
+        if (n > len) {
+            len = n;
+            token = t;
+        }
+    };
+
+    switch (c) {
+    case '.': if (p[1] == '.' && p[2] == '.') match(3, ELLIPSIS); break;
+    case '=': if (p[1] == '=') match(2, EQ); break;
+    case '!': if (p[1] == '=') match(2, NEQ); break;
+    case '<': if (p[1] == '=') match(2, LEQ); break;
+    case '>': if (p[1] == '=') match(2, GEQ); break;
+    case '&': if (p[1] == '&') match(2, AND); break;
+    case '|': if (p[1] == '|') match(2, OR); break;
+    case '-': if (p[1] == '>') match(2, IMPL); break;
+    case '/': if (p[1] == '/') match(2, UPDATE); break;
+    case '+': if (p[1] == '+') match(2, CONCAT); break;
+    }
+
+    if (is(c, cIdStart)) {
+        auto q = p + 1;
+        while (is(*q, cId)) q++;
+        match(q - p, keywordOrId({p, (size_t) (q - p)}));
+    }
+
+    else if (is(c, cDigit)) {
+        auto q = p + 1;
+        while (is(*q, cDigit)) q++;
+        match(q - p, INT);
+    }
+
+    if (is(c, cDigit) || c == '.')
+        match(matchFloat(p), FLOAT);
+
+    switch (c) {
+    case '$': if (p[1] == '{') match(2, DOLLAR_CURLY); break;
+    case '}': match(1, '}'); break;
+    case '{': match(1, '{'); break;
+    case '"': match(1, '"'); break;
+    case '\'':
+        if (p[1] == '\'') {
+            /* ''( *\n)? */
+            auto q = p + 2;
+            while (*q == ' ') q++;
+            match(*q == '\n' ? q + 1 - p : 2, IND_STRING_OPEN);
+        }
+        break;
+    }
+
+    if (is(c, cPath) || c == '/')
+        match(matchPath(p), PATH);
+    else if (c == '~')
+        match(matchHPath(p), HPATH);
+    else if (c == '<')
+        match(matchSPath(p), SPATH);
+
+    if (is(c, cAlpha))
+        match(matchUri(p), URI);
+
+    /* Any other character is returned as is. Don't return a negative
+       number, as this will cause Bison to stop parsing without an
+       error. */
+    match(1, (unsigned char) c);
+
+    advance(len);
+
+    switch (token) {
+
+    case ID:
+        lval->id = {start, len};
+        break;
+
+    case INT:
+        try {
+            lval->n = boost::lexical_cast<int64_t>(std::string(start, len));
+        } catch (const boost::bad_lexical_cast &) {
+            throw ParseError("invalid integer '%1%'", std::string(start, len));
+        }
+        break;
+
+    case FLOAT: {
+        std::string s(start, len);
+        errno = 0;
+        lval->nf = strtod(s.c_str(), 0);
+        if (errno != 0)
+            throw ParseError("invalid float '%1%'", s);
+        break;
+    }
+
+    case DOLLAR_CURLY:
+    case '{':
+        states.push_back(sExpr);
+        break;
+
+    case '}':
+        /* State sInitial only exists at the bottom of the stack and
+           is used as a marker. sExpr replaces it everywhere else. */
+        if (states.back() != sInitial)
+            states.pop_back();
+        break;
+
+    case '"':
+        states.push_back(sString);
+        break;
+
+    case IND_STRING_OPEN:
+        states.push_back(sIndString);
+        break;
+
+    case PATH:
+    case HPATH:
+        if (start[len - 1] == '/')
+            throw ParseError("path '%s' has a trailing slash", std::string(start, len));
+        lval->path = {start, len};
+        break;
+
+    case SPATH:
+        lval->path = {start, len};
+        break;
+
+    case URI:
+        lval->uri = {start, len};
+        break;
+    }
+
+    return token;
+}
+
+
+int Lexer::lexString(YYSTYPE * lval, ParseData & data)
+{
+    if (!*p) return 0;
+
+    /* The contents of a string consist of any character other than
+       '$', '"' and '\', '\' followed by any character, and '$'
+       followed by anything but '{', so that '$' followed by '${'
+       doesn't start an antiquotation. A '$' just before the closing
+       '"' is part of the contents as well. We only need to unescape
+       the contents if they contain a '\' or a CR. */
+    auto q = p;
+    bool unescape = false;
+    while (true) {
+        q += strcspn(q, "$\"\\\r");
+        if (*q == '\r') {
+            unescape = true;
+            q++;
+        }
+        else if (*q == '\\' && q[1]) {
+            unescape = true;
+            q += 2;
+        }
+        else if (*q == '$') {
+            if (q[1] == '"') {
+                q++;
+                break;
+            }
+            if (q[1] == '\\') {
+                if (!q[2]) break;
+                unescape = true;
+                q += 3;
+            }
+            else if (q[1] && q[1] != '{') {
+                unescape |= q[1] == '\r';
+                q += 2;
+            }
+            else break;
+        }
+        else break;
+    }
+
+    if (q != p) {
+        auto start = p;
+        size_t len = q - p;
+        advance(len);
+        lval->e = unescape
+            ? unescapeStr(data.symbols, start, len)
+            : new ExprString(data.symbols.create({start, len}));
+        return STR;
+    }
+
+    if (*p == '$' && p[1] == '{') {
+        advance(2);
+        states.push_back(sExpr);
+        return DOLLAR_CURLY;
+    }
+
+    if (*p == '"') {
+        advance(1);
+        states.pop_back();
+        return '"';
+    }
+
+    /* This can only occur when we reach the end of the text (i.e. a
+       trailing '$', '\' or '$\'). This is technically invalid, but
+       we leave the problem to the parser who fails with exact
+       location. */
+    advance(*p == '$' && p[1] == '\\' ? 2 : 1);
+    lval->e = nullptr;
+    return STR;
+}
+
+
+int Lexer::lexIndString(YYSTYPE * lval, ParseData & data)
+{
+    if (!*p) return 0;
+
+    /* The contents of an indented string consist of any character
+       other than '$' and ''', '$' followed by anything but '{' and
+       ''', and ''' followed by anything but ''' and '$'. Everything
+       else is a special sequence handled below. */
+    auto q = p;
+    while (true) {
+        q += strcspn(q, "$'");
+        if (*q == '$' && q[1] && q[1] != '{' && q[1] != '\'')
+            q += 2;
+        else if (*q == '\'' && q[1] && q[1] != '\'' && q[1] != '$')
+            q += 2;
+        else break;
+    }
+
+    if (q != p) {
+        auto start = p;
+        size_t len = q - p;
+        advance(len);
+        lval->e = new ExprIndStr({start, len});
+        return IND_STR;
+    }
+
+    if (*p == '$') {
+        if (p[1] == '{') {
+            advance(2);
+            states.push_back(sExpr);
+            return DOLLAR_CURLY;
+        }
+        advance(1);
+        lval->e = new ExprIndStr("$");
+        return IND_STR;
+    }
+
+    /* *p == '\'' */
+    if (p[1] == '\'') {
+        if (p[2] == '$') {
+            advance(3);
+            lval->e = new ExprIndStr("$");
+            return IND_STR;
+        }
+        if (p[2] == '\'') {
+            advance(3);
+            lval->e = new ExprIndStr("''");
+            return IND_STR;
+        }
+        if (p[2] == '\\' && p[3]) {
+            auto start = p;
+            advance(4);
+            lval->e = unescapeStr(data.symbols, start + 2, 2);
+            return IND_STR;
+        }
+        advance(2);
+        states.pop_back();
+        return IND_STRING_CLOSE;
+    }
+
+    advance(1);
+    lval->e = new ExprIndStr("'");
+    return IND_STR;
+}
+
+
+}
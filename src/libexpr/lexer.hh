@@ -0,0 +1,55 @@
+#pragma once
+
+#include "parser-tab.hh"
+
+#include <vector>
+
+namespace nix {
+
+/* The lexer of the Nix expression language, used by the Bison parser
+   in parser.y. It scans a NUL-terminated source text in place: the
+   values of ID, PATH, HPATH, SPATH and URI tokens and the fragments of
+   indented strings (ExprIndStr) point into the text, so the text must
+   outlive the parse. Like the parser, it tracks a stack of states,
+   since the meaning of characters depends on whether we're in an
+   expression, a string or an indented string. */
+class Lexer
+{
+public:
+
+    Lexer(const char * text);
+
+    /* Return the next token, or 0 at the end of the text. The
+       location of the token is stored in 'loc'. */
+    int lex(YYSTYPE * lval, YYLTYPE * loc, ParseData & data);
+
+private:
+
+    enum State {
+        /* The bottom of the stack. Behaves like sExpr, except that a
+           '}' doesn't pop it. */
+        sInitial,
+        sExpr,
+        sString,
+        sIndString,
+    };
+
+    /* The current position. The end of the text is marked by a NUL
+       character, so it's always safe to look at the next character
+       if the current one isn't NUL. */
+    const char * p;
+
+    std::vector<State> states;
+
+    /* The location of the last token, comment or run of whitespace. */
+    YYLTYPE loc;
+
+    /* Move past the next 'len' characters, updating 'loc'. */
+    void advance(size_t len);
+
+    int lexExpr(YYSTYPE * lval);
+    int lexString(YYSTYPE * lval, ParseData & data);
+    int lexIndString(YYSTYPE * lval, ParseData & data);
+};
+
+}
@@ -1,6 +1,7 @@
 #include "nixexpr.hh"
 #include "derivations.hh"
 #include "util.hh"
+#include "eval.hh"
 
 #include <cstdlib>
 
@@ -175,6 +176,11 @@ void ExprOpNot::show(std::ostream & str) const
     str << "(! " << *e << ")";
 }
 
+void ExprApp::show(std::ostream & str) const
+{
+    str << "(" << *e1 << "  " << *e2 << ")";
+}
+
 void ExprConcatStrings::show(std::ostream & str) const
 {
     bool first = true;
@@ -232,33 +238,104 @@ string showAttrPath(const AttrPath & attrPath)
 }
 
 
-Pos noPos;
+PosIdx noPos;
+
+
+/* Position tables. */
+
+const PosTable::Origin & PosTable::addOrigin(FileOrigin origin, const Symbol & file, std::string_view contents)
+{
+    /* Lines end in LF, CR/LF or CR, as in the lexer. */
+    std::vector<uint32_t> lines;
+    for (size_t i = 0; i < contents.size(); ++i) {
+        auto c = contents[i];
+        if (c == '\r' && i + 1 < contents.size() && contents[i + 1] == '\n') ++i;
+        if (c == '\n' || c == '\r') lines.push_back(i + 1);
+    }
+    return addOrigin(origin, file,
+        std::min(contents.size(), (size_t) std::numeric_limits<uint32_t>::max() - 1),
+        std::move(lines));
+}
+
+const PosTable::Origin & PosTable::addOrigin(FileOrigin origin, const Symbol & file, uint32_t size, std::vector<uint32_t> && lines)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto & o = origins.emplace_back(origin, file, size, std::move(lines));
+    /* If we've run out of indices, this and all later sources don't
+       get any positions. */
+    if ((uint64_t) nextStart + size + 1 <= std::numeric_limits<uint32_t>::max()) {
+        o.start = nextStart;
+        nextStart += size + 1;
+    } else
+        nextStart = std::numeric_limits<uint32_t>::max();
+    return o;
+}
+
+PosIdx PosTable::add(const Origin & origin, uint32_t line, uint32_t column) const
+{
+    if (!line || !column) return noPos;
+    auto & lines = origin.lines_;
+    uint32_t lineStart =
+        line == 1 ? 0
+        : line - 2 < lines.size() ? lines[line - 2]
+        : origin.size_;
+    return add(origin, std::min((uint64_t) lineStart + column - 1, (uint64_t) origin.size_));
+}
+
+PosIdx PosTable::add(const Origin & origin, uint32_t offset) const
+{
+    if (!origin.start) return noPos;
+    return PosIdx(origin.start + std::min(offset, origin.size_));
+}
+
+std::pair<const PosTable::Origin *, uint32_t> PosTable::lookup(PosIdx p) const
+{
+    if (!p) return {nullptr, 0};
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto i = std::upper_bound(origins.begin(), origins.end(), p.id,
+        [](uint32_t id, const Origin & o) { return !o.start || id < o.start; });
+    if (i == origins.begin()) return {nullptr, 0};
+    --i;
+    auto offset = p.id - i->start;
+    if (offset > i->size_) return {nullptr, 0};
+    return {&*i, offset};
+}
+
+Pos PosTable::operator [] (PosIdx p) const
+{
+    auto [origin, offset] = lookup(p);
+    if (!origin) return Pos();
+    auto & lines = origin->lines_;
+    auto i = std::upper_bound(lines.begin(), lines.end(), offset);
+    uint32_t lineStart = i == lines.begin() ? 0 : *(i - 1);
+    return Pos(origin->origin, origin->file, i - lines.begin() + 1, offset - lineStart + 1);
+}
 
 
 /* Computing levels/displacements for variables. */
 
-void Expr::bindVars(const StaticEnv & env)
+void Expr::bindVars(const EvalState & es, const StaticEnv & env)
 {
     abort();
 }
 
-void ExprInt::bindVars(const StaticEnv & env)
+void ExprInt::bindVars(const EvalState & es, const StaticEnv & env)
 {
 }
 
-void ExprFloat::bindVars(const StaticEnv & env)
+void ExprFloat::bindVars(const EvalState & es, const StaticEnv & env)
 {
 }
 
-void ExprString::bindVars(const StaticEnv & env)
+void ExprString::bindVars(const EvalState & es, const StaticEnv & env)
 {
 }
 
-void ExprPath::bindVars(const StaticEnv & env)
+void ExprPath::bindVars(const EvalState & es, const StaticEnv & env)
 {
 }
 
-void ExprVar::bindVars(const StaticEnv & env)
+void ExprVar::bindVars(const EvalState & es, const StaticEnv & env)
 {
     /* Check whether the variable appears in the environment.  If so,
        set its level and displacement. */
@@ -285,30 +362,30 @@ void ExprVar::bindVars(const StaticEnv & env)
     if (withLevel == -1)
         throw UndefinedVarError({
             .msg = hintfmt("undefined variable '%1%'", name),
-            .errPos = pos
+            .errPos = es.positions[pos]
         });
     fromWith = true;
     this->level = withLevel;
 }
 
-void ExprSelect::bindVars(const StaticEnv & env)
+void ExprSelect::bindVars(const EvalState & es, const StaticEnv & env)
 {
-    e->bindVars(env);
-    if (def) def->bindVars(env);
+    e->bindVars(es, env);
+    if (def) def->bindVars(es, env);
     for (auto & i : attrPath)
         if (!i.symbol.set())
-            i.expr->bindVars(env);
+            i.expr->bindVars(es, env);
 }
 
-void ExprOpHasAttr::bindVars(const StaticEnv & env)
+void ExprOpHasAttr::bindVars(const EvalState & es, const StaticEnv & env)
 {
-    e->bindVars(env);
+    e->bindVars(es, env);
     for (auto & i : attrPath)
         if (!i.symbol.set())
-            i.expr->bindVars(env);
+            i.expr->bindVars(es, env);
 }
 
-void ExprAttrs::bindVars(const StaticEnv & env)
+void ExprAttrs::bindVars(const EvalState & es, const StaticEnv & env)
 {
     const StaticEnv * dynamicEnv = &env;
     StaticEnv newEnv(false, &env);
@@ -321,26 +398,26 @@ void ExprAttrs::bindVars(const StaticEnv & env)
             newEnv.vars[i.first] = i.second.displ = displ++;
 
         for (auto & i : attrs)
-            i.second.e->bindVars(i.second.inherited ? env : newEnv);
+            i.second.e->bindVars(es, i.second.inherited ? env : newEnv);
     }
 
     else
         for (auto & i : attrs)
-            i.second.e->bindVars(env);
+            i.second.e->bindVars(es, env);
 
     for (auto & i : dynamicAttrs) {
-        i.nameExpr->bindVars(*dynamicEnv);
-        i.valueExpr->bindVars(*dynamicEnv);
+        i.nameExpr->bindVars(es, *dynamicEnv);
+        i.valueExpr->bindVars(es, *dynamicEnv);
     }
 }
 
-void ExprList::bindVars(const StaticEnv & env)
+void ExprList::bindVars(const EvalState & es, const StaticEnv & env)
 {
     for (auto & i : elems)
-        i->bindVars(env);
+        i->bindVars(es, env);
 }
 
-void ExprLambda::bindVars(const StaticEnv & env)
+void ExprLambda::bindVars(const EvalState & es, const StaticEnv & env)
 {
     StaticEnv newEnv(false, &env);
 
@@ -353,13 +430,13 @@ void ExprLambda::bindVars(const StaticEnv & env)
             newEnv.vars[i.name] = displ++;
 
         for (auto & i : formals->formals)
-            if (i.def) i.def->bindVars(newEnv);
+            if (i.def) i.def->bindVars(es, newEnv);
     }
 
-    body->bindVars(newEnv);
+    body->bindVars(es, newEnv);
 }
 
-void ExprLet::bindVars(const StaticEnv & env)
+void ExprLet::bindVars(const EvalState & es, const StaticEnv & env)
 {
     StaticEnv newEnv(false, &env);
 
@@ -368,12 +445,12 @@ void ExprLet::bindVars(const StaticEnv & env)
         newEnv.vars[i.first] = i.second.displ = displ++;
 
     for (auto & i : attrs->attrs)
-        i.second.e->bindVars(i.second.inherited ? env : newEnv);
+        i.second.e->bindVars(es, i.second.inherited ? env : newEnv);
 
-    body->bindVars(newEnv);
+    body->bindVars(es, newEnv);
 }
 
-void ExprWith::bindVars(const StaticEnv & env)
+void ExprWith::bindVars(const EvalState & es, const StaticEnv & env)
 {
     /* Does this `with' have an enclosing `with'?  If so, record its
        level so that `lookupVar' can look up variables in the previous
@@ -387,36 +464,42 @@ void ExprWith::bindVars(const StaticEnv & env)
             break;
         }
 
-    attrs->bindVars(env);
+    attrs->bindVars(es, env);
     StaticEnv newEnv(true, &env);
-    body->bindVars(newEnv);
+    body->bindVars(es, newEnv);
+}
+
+void ExprIf::bindVars(const EvalState & es, const StaticEnv & env)
+{
+    cond->bindVars(es, env);
+    then->bindVars(es, env);
+    else_->bindVars(es, env);
 }
 
-void ExprIf::bindVars(const StaticEnv & env)
+void ExprAssert::bindVars(const EvalState & es, const StaticEnv & env)
 {
-    cond->bindVars(env);
-    then->bindVars(env);
-    else_->bindVars(env);
+    cond->bindVars(es, env);
+    body->bindVars(es, env);
 }
 
-void ExprAssert::bindVars(const StaticEnv & env)
+void ExprOpNot::bindVars(const EvalState & es, const StaticEnv & env)
 {
-    cond->bindVars(env);
-    body->bindVars(env);
+    e->bindVars(es, env);
 }
 
-void ExprOpNot::bindVars(const StaticEnv & env)
+void ExprApp::bindVars(const EvalState & es, const StaticEnv & env)
 {
-    e->bindVars(env);
+    e1->bindVars(es, env);
+    e2->bindVars(es, env);
 }
 
-void ExprConcatStrings::bindVars(const StaticEnv & env)
+void ExprConcatStrings::bindVars(const EvalState & es, const StaticEnv & env)
 {
-    for (auto & i : *es)
-        i->bindVars(env);
+    for (auto & i : *this->es)
+        i->bindVars(es, env);
 }
 
-void ExprPos::bindVars(const StaticEnv & env)
+void ExprPos::bindVars(const EvalState & es, const StaticEnv & env)
 {
 }
 
@@ -435,9 +518,9 @@ void ExprLambda::setName(Symbol & name)
 }
 
 
-string ExprLambda::showNamePos() const
+string ExprLambda::showNamePos(const EvalState & state) const
 {
-    return (format("%1% at %2%") % (name.set() ? "'" + (string) name + "'" : "anonymous function") % pos).str();
+    return (format("%1% at %2%") % (name.set() ? "'" + (string) name + "'" : "anonymous function") % state.positions[pos]).str();
 }
 
 
@@ -447,7 +530,8 @@ string ExprLambda::showNamePos() const
 size_t SymbolTable::totalSize() const
 {
     size_t n = 0;
-    for (auto & i : symbols)
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    for (auto & i : store)
         n += i.size();
     return n;
 }
@@ -5,6 +5,8 @@
 #include "error.hh"
 
 #include <map>
+#include <deque>
+#include <shared_mutex>
 
 
 namespace nix {
@@ -48,11 +50,130 @@ struct Pos
     }
 };
 
-extern Pos noPos;
-
 std::ostream & operator << (std::ostream & str, const Pos & pos);
 
 
+/* A compact reference to a position in a parsed source. Parse trees
+   and attribute sets store these rather than Pos objects, since most
+   positions are never looked at; a PosIdx is resolved into a Pos by
+   the PosTable of the EvalState that created it (EvalState::positions)
+   only when needed, e.g. to report an error. The default value means
+   "no position". */
+class PosIdx
+{
+    friend class PosTable;
+
+    uint32_t id = 0;
+
+    explicit PosIdx(uint32_t id) : id(id) { }
+
+public:
+    PosIdx() { }
+
+    explicit operator bool() const
+    {
+        return id != 0;
+    }
+
+    bool operator < (const PosIdx other) const
+    {
+        return id < other.id;
+    }
+
+    bool operator == (const PosIdx other) const
+    {
+        return id == other.id;
+    }
+
+    bool operator != (const PosIdx other) const
+    {
+        return id != other.id;
+    }
+};
+
+extern PosIdx noPos;
+
+
+/* The positions of the sources (files, strings or standard input)
+   parsed by an EvalState. Each source is assigned a range of indices,
+   one for every byte of its contents plus one for its end, so a PosIdx
+   is just an offset in that range. It's translated into a line and
+   column using the source's line table, which records where each line
+   starts. */
+class PosTable
+{
+public:
+
+    class Origin
+    {
+        friend PosTable;
+
+        /* The first index of this source's range, or 0 if the table
+           has run out of indices. */
+        uint32_t start;
+        uint32_t size_;
+
+        /* The offsets of the starts of the second and subsequent
+           lines. */
+        std::vector<uint32_t> lines_;
+
+    public:
+
+        const FileOrigin origin;
+        const Symbol file;
+
+        Origin(FileOrigin origin, const Symbol & file, uint32_t size, std::vector<uint32_t> && lines)
+            : start(0), size_(size), lines_(std::move(lines)), origin(origin), file(file)
+        { }
+
+        uint32_t size() const
+        {
+            return size_;
+        }
+
+        const std::vector<uint32_t> & lines() const
+        {
+            return lines_;
+        }
+    };
+
+    /* Register a source with the given contents. */
+    const Origin & addOrigin(FileOrigin origin, const Symbol & file, std::string_view contents);
+
+    /* Register a source of 'size' bytes whose line table is already
+       known, e.g. because it was read from the parse cache. 'lines'
+       must be sorted and not exceed 'size'. */
+    const Origin & addOrigin(FileOrigin origin, const Symbol & file, uint32_t size, std::vector<uint32_t> && lines);
+
+    /* Return the index of a (1-based) line and column in 'origin'. */
+    PosIdx add(const Origin & origin, uint32_t line, uint32_t column) const;
+
+    /* Return the index of a byte offset in 'origin'. */
+    PosIdx add(const Origin & origin, uint32_t offset) const;
+
+    /* Return the source that 'p' refers to and the offset of 'p' in
+       it, or a null pointer if 'p' is not a position in this
+       table. */
+    std::pair<const Origin *, uint32_t> lookup(PosIdx p) const;
+
+    /* Resolve 'p' into a Pos (an empty Pos for 'noPos'). */
+    Pos operator [] (PosIdx p) const;
+
+private:
+
+    /* Guards 'origins' and 'nextStart', since sources may be parsed
+       by several evaluator threads. Origins are immutable once added,
+       so they can be used without it. */
+    mutable std::shared_mutex mutex;
+
+    /* Sorted by 'start'. A deque, so that references to its elements
+       remain valid. */
+    std::deque<Origin> origins;
+
+    uint32_t nextStart = 1;
+};
+
+
 struct Env;
 struct Value;
 class EvalState;
@@ -79,7 +200,7 @@ struct Expr
 {
     virtual ~Expr() { };
     virtual void show(std::ostream & str) const;
-    virtual void bindVars(const StaticEnv & env);
+    virtual void bindVars(const EvalState & es, const StaticEnv & env);
     virtual void eval(EvalState & state, Env & env, Value & v);
     virtual Value * maybeThunk(EvalState & state, Env & env);
     virtual void setName(Symbol & name);
@@ -90,7 +211,7 @@ std::ostream & operator << (std::ostream & str, const Expr & e);
 #define COMMON_METHODS \
     void show(std::ostream & str) const; \
     void eval(EvalState & state, Env & env, Value & v); \
-    void bindVars(const StaticEnv & env);
+    void bindVars(const EvalState & es, const StaticEnv & env);
 
 struct ExprInt : Expr
 {
@@ -119,11 +240,12 @@ struct ExprString : Expr
     Value * maybeThunk(EvalState & state, Env & env);
 };
 
-/* Temporary class used during parsing of indented strings. */
+/* Temporary class used during parsing of indented strings. It
+   points into the source text. */
 struct ExprIndStr : Expr
 {
-    string s;
-    ExprIndStr(const string & s) : s(s) { };
+    std::string_view s;
+    ExprIndStr(std::string_view s) : s(s) { };
 };
 
 struct ExprPath : Expr
@@ -137,7 +259,7 @@ struct ExprPath : Expr
 
 struct ExprVar : Expr
 {
-    Pos pos;
+    PosIdx pos;
     Symbol name;
 
     /* Whether the variable comes from an environment (e.g. a rec, let
@@ -153,19 +275,26 @@ struct ExprVar : Expr
     unsigned int level;
     unsigned int displ;
 
+    /* Inline cache for variables that come from a "with": the
+       index of the attribute in the "with" set where the variable
+       was last found. Repeated evaluation of the same variable
+       usually happens under the same (or a similarly shaped) set, so
+       checking this position first avoids the binary search. */
+    mutable uint32_t withCacheIndex = 0;
+
     ExprVar(const Symbol & name) : name(name) { };
-    ExprVar(const Pos & pos, const Symbol & name) : pos(pos), name(name) { };
+    ExprVar(const PosIdx pos, const Symbol & name) : pos(pos), name(name) { };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
 };
 
 struct ExprSelect : Expr
 {
-    Pos pos;
+    PosIdx pos;
     Expr * e, * def;
     AttrPath attrPath;
-    ExprSelect(const Pos & pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(attrPath) { };
-    ExprSelect(const Pos & pos, Expr * e, const Symbol & name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
+    ExprSelect(const PosIdx pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(attrPath) { };
+    ExprSelect(const PosIdx pos, Expr * e, const Symbol & name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
     COMMON_METHODS
 };
 
@@ -183,9 +312,9 @@ struct ExprAttrs : Expr
     struct AttrDef {
         bool inherited;
         Expr * e;
-        Pos pos;
-        unsigned int displ; // displacement
-        AttrDef(Expr * e, const Pos & pos, bool inherited=false)
+        PosIdx pos;
+        unsigned int displ = 0; // displacement
+        AttrDef(Expr * e, const PosIdx pos, bool inherited=false)
             : inherited(inherited), e(e), pos(pos) { };
         AttrDef() { };
     };
@@ -193,8 +322,8 @@ struct ExprAttrs : Expr
     AttrDefs attrs;
     struct DynamicAttrDef {
         Expr * nameExpr, * valueExpr;
-        Pos pos;
-        DynamicAttrDef(Expr * nameExpr, Expr * valueExpr, const Pos & pos)
+        PosIdx pos;
+        DynamicAttrDef(Expr * nameExpr, Expr * valueExpr, const PosIdx pos)
             : nameExpr(nameExpr), valueExpr(valueExpr), pos(pos) { };
     };
     typedef std::vector<DynamicAttrDef> DynamicAttrDefs;
@@ -212,10 +341,10 @@ struct ExprList : Expr
 
 struct Formal
 {
-    Pos pos;
+    PosIdx pos;
     Symbol name;
     Expr * def;
-    Formal(const Pos & pos, const Symbol & name, Expr * def) : pos(pos), name(name), def(def) { };
+    Formal(const PosIdx pos, const Symbol & name, Expr * def) : pos(pos), name(name), def(def) { };
 };
 
 struct Formals
@@ -228,23 +357,23 @@ struct Formals
 
 struct ExprLambda : Expr
 {
-    Pos pos;
+    PosIdx pos;
     Symbol name;
     Symbol arg;
     bool matchAttrs;
     Formals * formals;
     Expr * body;
-    ExprLambda(const Pos & pos, const Symbol & arg, bool matchAttrs, Formals * formals, Expr * body)
+
+    /* The result of builtins.functionArgs for this function, computed
+       on first use. Attribute sets are immutable, so it can be shared
+       by all calls. */
+    Bindings * formalsAttrs = nullptr;
+
+    ExprLambda(const PosIdx pos, const Symbol & arg, bool matchAttrs, Formals * formals, Expr * body)
         : pos(pos), arg(arg), matchAttrs(matchAttrs), formals(formals), body(body)
-    {
-        if (!arg.empty() && formals && formals->argNames.find(arg) != formals->argNames.end())
-            throw ParseError({
-                .msg = hintfmt("duplicate formal function argument '%1%'", arg),
-                .errPos = pos
-            });
-    };
+    { };
     void setName(Symbol & name);
-    string showNamePos() const;
+    string showNamePos(const EvalState & state) const;
     COMMON_METHODS
 };
 
@@ -258,26 +387,26 @@ struct ExprLet : Expr
 
 struct ExprWith : Expr
 {
-    Pos pos;
+    PosIdx pos;
     Expr * attrs, * body;
     size_t prevWith;
-    ExprWith(const Pos & pos, Expr * attrs, Expr * body) : pos(pos), attrs(attrs), body(body) { };
+    ExprWith(const PosIdx pos, Expr * attrs, Expr * body) : pos(pos), attrs(attrs), body(body) { };
     COMMON_METHODS
 };
 
 struct ExprIf : Expr
 {
-    Pos pos;
+    PosIdx pos;
     Expr * cond, * then, * else_;
-    ExprIf(const Pos & pos, Expr * cond, Expr * then, Expr * else_) : pos(pos), cond(cond), then(then), else_(else_) { };
+    ExprIf(const PosIdx pos, Expr * cond, Expr * then, Expr * else_) : pos(pos), cond(cond), then(then), else_(else_) { };
     COMMON_METHODS
 };
 
 struct ExprAssert : Expr
 {
-    Pos pos;
+    PosIdx pos;
     Expr * cond, * body;
-    ExprAssert(const Pos & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
+    ExprAssert(const PosIdx pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
     COMMON_METHODS
 };
 
@@ -291,22 +420,36 @@ struct ExprOpNot : Expr
 #define MakeBinOp(name, s) \
     struct name : Expr \
     { \
-        Pos pos; \
+        PosIdx pos; \
         Expr * e1, * e2; \
         name(Expr * e1, Expr * e2) : e1(e1), e2(e2) { }; \
-        name(const Pos & pos, Expr * e1, Expr * e2) : pos(pos), e1(e1), e2(e2) { }; \
+        name(const PosIdx pos, Expr * e1, Expr * e2) : pos(pos), e1(e1), e2(e2) { }; \
         void show(std::ostream & str) const \
         { \
             str << "(" << *e1 << " " s " " << *e2 << ")";   \
         } \
-        void bindVars(const StaticEnv & env) \
+        void bindVars(const EvalState & es, const StaticEnv & env) \
         { \
-            e1->bindVars(env); e2->bindVars(env); \
+            e1->bindVars(es, env); e2->bindVars(es, env); \
         } \
         void eval(EvalState & state, Env & env, Value & v); \
     };
 
-MakeBinOp(ExprApp, "")
+struct ExprApp : Expr
+{
+    PosIdx pos;
+    Expr * e1, * e2;
+    ExprApp(Expr * e1, Expr * e2) : e1(e1), e2(e2) { };
+    ExprApp(const PosIdx pos, Expr * e1, Expr * e2) : pos(pos), e1(e1), e2(e2) { };
+    COMMON_METHODS
+
+    /* Evaluate the function to which `e2' is to be applied into
+       `vFun'. If the application turns out to be a saturated primop
+       call, the whole application is evaluated into `v' instead, and
+       false is returned. */
+    bool evalFunction(EvalState & state, Env & env, Value & vFun, Value & v);
+};
+
 MakeBinOp(ExprOpEq, "==")
 MakeBinOp(ExprOpNEq, "!=")
 MakeBinOp(ExprOpAnd, "&&")
@@ -317,18 +460,18 @@ MakeBinOp(ExprOpConcatLists, "++")
 
 struct ExprConcatStrings : Expr
 {
-    Pos pos;
+    PosIdx pos;
     bool forceString;
     vector<Expr *> * es;
-    ExprConcatStrings(const Pos & pos, bool forceString, vector<Expr *> * es)
+    ExprConcatStrings(const PosIdx pos, bool forceString, vector<Expr *> * es)
         : pos(pos), forceString(forceString), es(es) { };
     COMMON_METHODS
 };
 
 struct ExprPos : Expr
 {
-    Pos pos;
-    ExprPos(const Pos & pos) : pos(pos) { };
+    PosIdx pos;
+    ExprPos(const PosIdx pos) : pos(pos) { };
     COMMON_METHODS
 };
 
@@ -0,0 +1,609 @@
+#include "parse-cache.hh"
+#include "globals.hh"
+#include "hash.hh"
+#include "serialise.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace nix {
+
+
+/* Bump this whenever the serialisation format or the parser changes
+   in a way that affects the produced parse trees. */
+static const std::string parseCacheMagic = "nix-parse-cache-3";
+
+
+enum : uint64_t {
+    tagNull = 0,
+    tagRef,
+    tagInt,
+    tagFloat,
+    tagString,
+    tagPath,
+    tagVar,
+    tagSelect,
+    tagOpHasAttr,
+    tagAttrs,
+    tagList,
+    tagLambda,
+    tagLet,
+    tagWith,
+    tagIf,
+    tagAssert,
+    tagOpNot,
+    tagApp,
+    tagOpEq,
+    tagOpNEq,
+    tagOpAnd,
+    tagOpOr,
+    tagOpImpl,
+    tagOpUpdate,
+    tagOpConcatLists,
+    tagConcatStrings,
+    tagPos,
+};
+
+
+void ExprWriter::writeSymbol(const Symbol & sym)
+{
+    if (!sym.set()) {
+        sink << 0;
+        return;
+    }
+    auto i = symbols.find(sym);
+    if (i != symbols.end()) {
+        sink << i->second;
+        return;
+    }
+    auto id = symbols.size() + 1;
+    symbols.emplace(sym, id);
+    sink << id << (const string &) sym;
+}
+
+
+void ExprWriter::writePos(const PosIdx pos)
+{
+    auto [origin, offset] = positions.lookup(pos);
+    if (!origin) {
+        sink << 0;
+        return;
+    }
+    auto i = origins.find(origin);
+    if (i != origins.end())
+        sink << i->second;
+    else {
+        auto id = origins.size() + 1;
+        origins.emplace(origin, id);
+        sink << id << (uint64_t) origin->origin;
+        writeSymbol(origin->file);
+        auto & lines = origin->lines();
+        sink << origin->size()
+             << std::string((const char *) lines.data(), lines.size() * sizeof(uint32_t));
+    }
+    sink << offset;
+}
+
+
+void ExprWriter::writeAttrPath(const AttrPath & attrPath)
+{
+    sink << attrPath.size();
+    for (auto & i : attrPath) {
+        if (i.symbol.set()) {
+            sink << 1;
+            writeSymbol(i.symbol);
+        } else {
+            sink << 0;
+            writeExpr(i.expr);
+        }
+    }
+}
+
+
+template<class T>
+bool ExprWriter::writeBinOp(Expr * e, uint64_t tag)
+{
+    auto e2 = dynamic_cast<T *>(e);
+    if (!e2) return false;
+    sink << tag;
+    writePos(e2->pos);
+    writeExpr(e2->e1);
+    writeExpr(e2->e2);
+    return true;
+}
+
+
+void ExprWriter::writeExpr(Expr * e)
+{
+    if (!e) {
+        sink << tagNull;
+        return;
+    }
+
+    auto i = exprs.find(e);
+    if (i != exprs.end()) {
+        sink << tagRef << i->second;
+        return;
+    }
+
+    if (auto e2 = dynamic_cast<ExprInt *>(e))
+        sink << tagInt << (uint64_t) e2->n;
+
+    else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+        uint64_t n;
+        static_assert(sizeof(n) == sizeof(e2->nf));
+        memcpy(&n, &e2->nf, sizeof(n));
+        sink << tagFloat << n;
+    }
+
+    else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+        sink << tagString;
+        writeSymbol(e2->s);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprPath *>(e))
+        sink << tagPath << e2->s;
+
+    else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+        sink << tagVar;
+        writePos(e2->pos);
+        writeSymbol(e2->name);
+        if (bound)
+            sink << e2->fromWith << e2->level << (e2->fromWith ? 0 : e2->displ);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+        sink << tagSelect;
+        writePos(e2->pos);
+        writeExpr(e2->e);
+        writeExpr(e2->def);
+        writeAttrPath(e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        sink << tagOpHasAttr;
+        writeExpr(e2->e);
+        writeAttrPath(e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+        sink << tagAttrs << e2->recursive << e2->attrs.size();
+        for (auto & i : e2->attrs) {
+            writeSymbol(i.first);
+            sink << i.second.inherited;
+            writeExpr(i.second.e);
+            writePos(i.second.pos);
+            if (bound) sink << i.second.displ;
+        }
+        sink << e2->dynamicAttrs.size();
+        for (auto & i : e2->dynamicAttrs) {
+            writeExpr(i.nameExpr);
+            writeExpr(i.valueExpr);
+            writePos(i.pos);
+        }
+    }
+
+    else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+        sink << tagList << e2->elems.size();
+        for (auto & i : e2->elems)
+            writeExpr(i);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+        sink << tagLambda;
+        writePos(e2->pos);
+        writeSymbol(e2->name);
+        writeSymbol(e2->arg);
+        sink << e2->matchAttrs << (e2->formals != nullptr);
+        if (e2->formals) {
+            sink << e2->formals->formals.size();
+            for (auto & i : e2->formals->formals) {
+                writePos(i.pos);
+                writeSymbol(i.name);
+                writeExpr(i.def);
+            }
+            sink << e2->formals->ellipsis;
+        }
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+        sink << tagLet;
+        writeExpr(e2->attrs);
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+        sink << tagWith;
+        writePos(e2->pos);
+        writeExpr(e2->attrs);
+        writeExpr(e2->body);
+        if (bound) sink << e2->prevWith;
+    }
+
+    else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+        sink << tagIf;
+        writePos(e2->pos);
+        writeExpr(e2->cond);
+        writeExpr(e2->then);
+        writeExpr(e2->else_);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+        sink << tagAssert;
+        writePos(e2->pos);
+        writeExpr(e2->cond);
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+        sink << tagOpNot;
+        writeExpr(e2->e);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        sink << tagConcatStrings;
+        writePos(e2->pos);
+        sink << e2->forceString << e2->es->size();
+        for (auto & i : *e2->es)
+            writeExpr(i);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+        sink << tagPos;
+        writePos(e2->pos);
+    }
+
+    else if (!writeBinOp<ExprApp>(e, tagApp)
+        && !writeBinOp<ExprOpEq>(e, tagOpEq)
+        && !writeBinOp<ExprOpNEq>(e, tagOpNEq)
+        && !writeBinOp<ExprOpAnd>(e, tagOpAnd)
+        && !writeBinOp<ExprOpOr>(e, tagOpOr)
+        && !writeBinOp<ExprOpImpl>(e, tagOpImpl)
+        && !writeBinOp<ExprOpUpdate>(e, tagOpUpdate)
+        && !writeBinOp<ExprOpConcatLists>(e, tagOpConcatLists))
+        throw Error("cannot serialise expression '%s'", *e);
+
+    /* Note: expressions are numbered in post-order, which the
+       reader also uses. */
+    exprs.emplace(e, exprs.size() + 1);
+}
+
+
+ExprReader::ExprReader(const std::string & data, SymbolTable & symbolTable, PosTable & positions, bool bound)
+    : source(data), symbolTable(symbolTable), positions(positions), bound(bound)
+{ }
+
+
+uint64_t ExprReader::readNum()
+{
+    return nix::readNum<uint64_t>(source);
+}
+
+
+bool ExprReader::readBool()
+{
+    return readNum() != 0;
+}
+
+
+Symbol ExprReader::readSymbol()
+{
+    auto id = readNum();
+    if (id == 0) return Symbol();
+    if (id == symbols.size() + 1) {
+        symbols.push_back(symbolTable.create(readString(source)));
+        return symbols.back();
+    }
+    if (id > symbols.size())
+        throw Error("invalid symbol reference in parse cache");
+    return symbols[id - 1];
+}
+
+
+PosIdx ExprReader::readPos()
+{
+    auto id = readNum();
+    if (id == 0) return noPos;
+    if (id == origins.size() + 1) {
+        auto origin = readNum();
+        auto file = readSymbol();
+        auto size = readNum();
+        auto s = readString(source);
+        if (origin > foString
+            || size > std::numeric_limits<uint32_t>::max()
+            || s.size() % sizeof(uint32_t))
+            throw Error("invalid source in parse cache");
+        std::vector<uint32_t> lines(s.size() / sizeof(uint32_t));
+        memcpy(lines.data(), s.data(), s.size());
+        if (!std::is_sorted(lines.begin(), lines.end())
+            || (!lines.empty() && lines.back() > size))
+            throw Error("invalid line table in parse cache");
+        origins.push_back(&positions.addOrigin((FileOrigin) origin, file, size, std::move(lines)));
+    } else if (id > origins.size())
+        throw Error("invalid position reference in parse cache");
+    auto offset = readNum();
+    if (offset > origins[id - 1]->size())
+        throw Error("invalid position in parse cache");
+    return positions.add(*origins[id - 1], offset);
+}
+
+
+AttrPath ExprReader::readAttrPath()
+{
+    AttrPath attrPath;
+    auto n = readNum();
+    for (uint64_t i = 0; i < n; ++i) {
+        if (readBool())
+            attrPath.push_back(AttrName(readSymbol()));
+        else
+            attrPath.push_back(AttrName(readExpr()));
+    }
+    return attrPath;
+}
+
+
+template<class T>
+Expr * ExprReader::readBinOp()
+{
+    auto pos = readPos();
+    auto e1 = readExpr();
+    auto e2 = readExpr();
+    return new T(pos, e1, e2);
+}
+
+
+Expr * ExprReader::readExpr()
+{
+    auto tag = readNum();
+
+    if (tag == tagNull) return nullptr;
+
+    if (tag == tagRef) {
+        auto id = readNum();
+        if (id == 0 || id > exprs.size())
+            throw Error("invalid expression reference in parse cache");
+        return exprs[id - 1];
+    }
+
+    Expr * e;
+
+    switch (tag) {
+
+    case tagInt:
+        e = new ExprInt((NixInt) readNum());
+        break;
+
+    case tagFloat: {
+        auto n = readNum();
+        NixFloat nf;
+        memcpy(&nf, &n, sizeof(nf));
+        e = new ExprFloat(nf);
+        break;
+    }
+
+    case tagString:
+        e = new ExprString(readSymbol());
+        break;
+
+    case tagPath:
+        e = new ExprPath(readString(source));
+        break;
+
+    case tagVar: {
+        auto pos = readPos();
+        auto e2 = new ExprVar(pos, readSymbol());
+        if (bound) {
+            e2->fromWith = readBool();
+            e2->level = readNum();
+            e2->displ = readNum();
+        }
+        e = e2;
+        break;
+    }
+
+    case tagSelect: {
+        auto pos = readPos();
+        auto e2 = readExpr();
+        auto def = readExpr();
+        e = new ExprSelect(pos, e2, readAttrPath(), def);
+        break;
+    }
+
+    case tagOpHasAttr: {
+        auto e2 = readExpr();
+        e = new ExprOpHasAttr(e2, readAttrPath());
+        break;
+    }
+
+    case tagAttrs: {
+        auto e2 = new ExprAttrs;
+        e2->recursive = readBool();
+        auto n = readNum();
+        for (uint64_t i = 0; i < n; ++i) {
+            auto name = readSymbol();
+            auto inherited = readBool();
+            auto value = readExpr();
+            auto pos = readPos();
+            auto & def = e2->attrs.emplace(name, ExprAttrs::AttrDef(value, pos, inherited)).first->second;
+            if (bound) def.displ = readNum();
+        }
+        n = readNum();
+        for (uint64_t i = 0; i < n; ++i) {
+            auto nameExpr = readExpr();
+            auto valueExpr = readExpr();
+            auto pos = readPos();
+            e2->dynamicAttrs.emplace_back(nameExpr, valueExpr, pos);
+        }
+        e = e2;
+        break;
+    }
+
+    case tagList: {
+        auto e2 = new ExprList;
+        auto n = readNum();
+        for (uint64_t i = 0; i < n; ++i)
+            e2->elems.push_back(readExpr());
+        e = e2;
+        break;
+    }
+
+    case tagLambda: {
+        auto pos = readPos();
+        auto name = readSymbol();
+        auto arg = readSymbol();
+        auto matchAttrs = readBool();
+        Formals * formals = nullptr;
+        if (readBool()) {
+            formals = new Formals;
+            auto n = readNum();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto pos = readPos();
+                auto name = readSymbol();
+                auto def = readExpr();
+                formals->formals.emplace_back(pos, name, def);
+                formals->argNames.insert(name);
+            }
+            formals->ellipsis = readBool();
+        }
+        auto e2 = new ExprLambda(pos, arg, matchAttrs, formals, readExpr());
+        if (name.set()) e2->setName(name);
+        e = e2;
+        break;
+    }
+
+    case tagLet: {
+        auto attrs = dynamic_cast<ExprAttrs *>(readExpr());
+        if (!attrs) throw Error("invalid 'let' expression in parse cache");
+        e = new ExprLet(attrs, readExpr());
+        break;
+    }
+
+    case tagWith: {
+        auto pos = readPos();
+        auto attrs = readExpr();
+        auto e2 = new ExprWith(pos, attrs, readExpr());
+        if (bound) e2->prevWith = readNum();
+        e = e2;
+        break;
+    }
+
+    case tagIf: {
+        auto pos = readPos();
+        auto cond = readExpr();
+        auto then = readExpr();
+        e = new ExprIf(pos, cond, then, readExpr());
+        break;
+    }
+
+    case tagAssert: {
+        auto pos = readPos();
+        auto cond = readExpr();
+        e = new ExprAssert(pos, cond, readExpr());
+        break;
+    }
+
+    case tagOpNot:
+        e = new ExprOpNot(readExpr());
+        break;
+
+    case tagApp: e = readBinOp<ExprApp>(); break;
+    case tagOpEq: e = readBinOp<ExprOpEq>(); break;
+    case tagOpNEq: e = readBinOp<ExprOpNEq>(); break;
+    case tagOpAnd: e = readBinOp<ExprOpAnd>(); break;
+    case tagOpOr: e = readBinOp<ExprOpOr>(); break;
+    case tagOpImpl: e = readBinOp<ExprOpImpl>(); break;
+    case tagOpUpdate: e = readBinOp<ExprOpUpdate>(); break;
+    case tagOpConcatLists: e = readBinOp<ExprOpConcatLists>(); break;
+
+    case tagConcatStrings: {
+        auto pos = readPos();
+        auto forceString = readBool();
+        auto es = new std::vector<Expr *>;
+        auto n = readNum();
+        for (uint64_t i = 0; i < n; ++i)
+            es->push_back(readExpr());
+        e = new ExprConcatStrings(pos, forceString, es);
+        break;
+    }
+
+    case tagPos:
+        e = new ExprPos(readPos());
+        break;
+
+    default:
+        throw Error("invalid expression type %d in parse cache", tag);
+    }
+
+    exprs.push_back(e);
+    return e;
+}
+
+
+std::string serialiseExpr(const PosTable & positions, Expr * e)
+{
+    ExprWriter writer(positions);
+    writer.sink << parseCacheMagic;
+    writer.writeExpr(e);
+    return std::move(*writer.sink.s);
+}
+
+
+Expr * deserialiseExpr(const std::string & data, SymbolTable & symbols, PosTable & positions)
+{
+    ExprReader reader(data, symbols, positions);
+    if (readString(reader.source) != parseCacheMagic)
+        throw Error("parse cache entry has an unsupported format");
+    auto e = reader.readExpr();
+    if (!e) throw Error("parse cache entry is empty");
+    return e;
+}
+
+
+Path getParseCachePath(const Path & path, std::string_view contents)
+{
+    /* The parse tree depends on the file's location (relative paths
+       are resolved at parse time), on $HOME (for `~/...' paths) and
+       on the "no-url-literals" feature. */
+    auto key = hashString(htSHA256,
+        parseCacheMagic + '\0' + path + '\0' + getHome() + '\0'
+        + (settings.isExperimentalFeatureEnabled("no-url-literals") ? "1" : "0") + '\0'
+        + std::string(contents));
+    return getCacheDir() + "/nix/parse-cache/" + key.to_string(Base32, false);
+}
+
+
+Expr * lookupParseCache(const Path & cachePath, SymbolTable & symbols, PosTable & positions)
+{
+    try {
+        if (!pathExists(cachePath)) return nullptr;
+        return deserialiseExpr(readFile(cachePath), symbols, positions);
+    } catch (Error & e) {
+        debug("ignoring parse cache entry '%s': %s", cachePath, e.msg());
+        return nullptr;
+    }
+}
+
+
+void storeParseCache(const Path & cachePath, const PosTable & positions, Expr * e)
+{
+    try {
+        auto data = serialiseExpr(positions, e);
+        createDirs(dirOf(cachePath));
+        /* Write to a temporary file and rename it into place, so
+           that concurrent readers never see a partial entry. */
+        auto tmpPath = fmt("%s.tmp-%d", cachePath, getpid());
+        writeFile(tmpPath, data);
+        if (rename(tmpPath.c_str(), cachePath.c_str()) == -1) {
+            deletePath(tmpPath);
+            throw SysError("renaming '%s' to '%s'", tmpPath, cachePath);
+        }
+    } catch (Error & e) {
+        debug("cannot write parse cache entry '%s': %s", cachePath, e.msg());
+    }
+}
+
+
+}
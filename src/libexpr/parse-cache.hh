@@ -0,0 +1,94 @@
+#pragma once
+
+#include "nixexpr.hh"
+#include "serialise.hh"
+
+namespace nix {
+
+/* A persistent cache of parse trees, used by
+   EvalState::parseExprFromFile() when the `parse-cache` setting is
+   enabled. Entries are keyed by the file's path and contents, so a
+   cached tree is only used if the file hasn't changed. The cached
+   trees are stored before variable binding (bindVars()), since that
+   depends on the static environment in which the file is parsed. */
+
+/* Serialise a parse tree to a byte string. Its positions are
+   resolved using 'positions'. */
+std::string serialiseExpr(const PosTable & positions, Expr * e);
+
+/* Reconstruct a parse tree previously serialised by
+   serialiseExpr(), interning its symbols in 'symbols' and its
+   positions in 'positions'. Throws an Error if the data is corrupt or
+   was written by an incompatible version. */
+Expr * deserialiseExpr(const std::string & data, SymbolTable & symbols, PosTable & positions);
+
+/* The incremental writer and reader behind serialiseExpr() and
+   deserialiseExpr(), for callers that write parse trees as part of a
+   larger stream (e.g. EvalState snapshots). Symbols and expressions
+   are written once and then referred to by their (1-based) index, so
+   sharing is preserved across all the trees written by the same
+   writer. The same goes for the sources that positions refer to,
+   which are written together with their line tables, so that reading
+   a position doesn't require the source. If 'bound' is set, the
+   results of bindVars() are included as well, so the trees read back
+   can be evaluated directly; the reader must then be constructed with
+   'bound' set too. */
+struct ExprWriter
+{
+    StringSink sink;
+    const PosTable & positions;
+    bool bound;
+
+    std::map<Symbol, uint64_t> symbols;
+    std::map<const PosTable::Origin *, uint64_t> origins;
+    std::map<Expr *, uint64_t> exprs;
+
+    ExprWriter(const PosTable & positions, bool bound = false)
+        : positions(positions), bound(bound) { }
+
+    void writeSymbol(const Symbol & sym);
+    void writePos(const PosIdx pos);
+    void writeExpr(Expr * e);
+
+private:
+    void writeAttrPath(const AttrPath & attrPath);
+    template<class T> bool writeBinOp(Expr * e, uint64_t tag);
+};
+
+struct ExprReader
+{
+    StringSource source;
+    SymbolTable & symbolTable;
+    PosTable & positions;
+    bool bound;
+
+    std::vector<Symbol> symbols;
+    std::vector<const PosTable::Origin *> origins;
+    std::vector<Expr *> exprs;
+
+    ExprReader(const std::string & data, SymbolTable & symbolTable, PosTable & positions, bool bound = false);
+
+    uint64_t readNum();
+    bool readBool();
+    Symbol readSymbol();
+    PosIdx readPos();
+    Expr * readExpr();
+
+private:
+    AttrPath readAttrPath();
+    template<class T> Expr * readBinOp();
+};
+
+/* Return the cache file used for a file with the given path and
+   contents. */
+Path getParseCachePath(const Path & path, std::string_view contents);
+
+/* Look up a parse tree in the cache. Returns nothing if there is no
+   usable cache entry. */
+Expr * lookupParseCache(const Path & cachePath, SymbolTable & symbols, PosTable & positions);
+
+/* Store a parse tree in the cache. Errors are ignored, since the
+   cache is only an optimisation. */
+void storeParseCache(const Path & cachePath, const PosTable & positions, Expr * e);
+
+}
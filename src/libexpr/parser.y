@@ -4,9 +4,9 @@
 %define parse.error verbose
 %defines
 /* %no-lines */
-%parse-param { void * scanner }
+%parse-param { nix::Lexer * scanner }
 %parse-param { nix::ParseData * data }
-%lex-param { void * scanner }
+%lex-param { nix::Lexer * scanner }
 %lex-param { nix::ParseData * data }
 %expect 1
 %expect-rr 1
@@ -24,14 +24,24 @@
 
 namespace nix {
 
+    class Lexer;
+
+    /* The value of an ID, PATH, HPATH, SPATH or URI token, which
+       points into the source text. */
+    struct StringToken
+    {
+        const char * p;
+        size_t l;
+        operator std::string_view() const { return {p, l}; }
+    };
+
     struct ParseData
     {
         EvalState & state;
         SymbolTable & symbols;
         Expr * result;
         Path basePath;
-        Symbol file;
-        FileOrigin origin;
+        const PosTable::Origin * origin;
         std::optional<ErrorInfo> error;
         Symbol sLetBody;
         ParseData(EvalState & state)
@@ -43,9 +53,6 @@ namespace nix {
 
 }
 
-#define YY_DECL int yylex \
-    (YYSTYPE * yylval_param, YYLTYPE * yylloc_param, yyscan_t yyscanner, nix::ParseData * data)
-
 #endif
 
 }
@@ -53,36 +60,40 @@ namespace nix {
 %{
 
 #include "parser-tab.hh"
-#include "lexer-tab.hh"
-
-YY_DECL;
+#include "lexer.hh"
 
 using namespace nix;
 
 
+static int yylex(YYSTYPE * lval, YYLTYPE * loc, Lexer * scanner, ParseData * data)
+{
+    return scanner->lex(lval, loc, *data);
+}
+
+
 namespace nix {
 
 
-static void dupAttr(const AttrPath & attrPath, const Pos & pos, const Pos & prevPos)
+static void dupAttr(const EvalState & state, const AttrPath & attrPath, const PosIdx pos, const PosIdx prevPos)
 {
     throw ParseError({
          .msg = hintfmt("attribute '%1%' already defined at %2%",
-             showAttrPath(attrPath), prevPos),
-         .errPos = pos
+             showAttrPath(attrPath), state.positions[prevPos]),
+         .errPos = state.positions[pos]
     });
 }
 
-static void dupAttr(Symbol attr, const Pos & pos, const Pos & prevPos)
+static void dupAttr(const EvalState & state, Symbol attr, const PosIdx pos, const PosIdx prevPos)
 {
     throw ParseError({
-        .msg = hintfmt("attribute '%1%' already defined at %2%", attr, prevPos),
-        .errPos = pos
+        .msg = hintfmt("attribute '%1%' already defined at %2%", attr, state.positions[prevPos]),
+        .errPos = state.positions[pos]
     });
 }
 
 
-static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
-    Expr * e, const Pos & pos)
+static void addAttr(const EvalState & state, ExprAttrs * attrs, AttrPath & attrPath,
+    Expr * e, const PosIdx pos)
 {
     AttrPath::iterator i;
     // All attrpaths have at least one attr
@@ -95,10 +106,10 @@ static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
             if (j != attrs->attrs.end()) {
                 if (!j->second.inherited) {
                     ExprAttrs * attrs2 = dynamic_cast<ExprAttrs *>(j->second.e);
-                    if (!attrs2) dupAttr(attrPath, pos, j->second.pos);
+                    if (!attrs2) dupAttr(state, attrPath, pos, j->second.pos);
                     attrs = attrs2;
                 } else
-                    dupAttr(attrPath, pos, j->second.pos);
+                    dupAttr(state, attrPath, pos, j->second.pos);
             } else {
                 ExprAttrs * nested = new ExprAttrs;
                 attrs->attrs[i->symbol] = ExprAttrs::AttrDef(nested, pos);
@@ -125,11 +136,11 @@ static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
                 for (auto & ad : ae->attrs) {
                     auto j2 = jAttrs->attrs.find(ad.first);
                     if (j2 != jAttrs->attrs.end()) // Attr already defined in iAttrs, error.
-                        dupAttr(ad.first, j2->second.pos, ad.second.pos);
+                        dupAttr(state, ad.first, j2->second.pos, ad.second.pos);
                     jAttrs->attrs[ad.first] = ad.second;
                 }
             } else {
-                dupAttr(attrPath, pos, j->second.pos);
+                dupAttr(state, attrPath, pos, j->second.pos);
             }
         } else {
             // This attr path is not defined. Let's create it.
@@ -142,19 +153,31 @@ static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
 }
 
 
-static void addFormal(const Pos & pos, Formals * formals, const Formal & formal)
+static void addFormal(const EvalState & state, const PosIdx pos, Formals * formals, const Formal & formal)
 {
     if (!formals->argNames.insert(formal.name).second)
         throw ParseError({
             .msg = hintfmt("duplicate formal function argument '%1%'",
                 formal.name),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     formals->formals.push_front(formal);
 }
 
 
-static Expr * stripIndentation(const Pos & pos, SymbolTable & symbols, vector<Expr *> & es)
+static Expr * makeLambda(const EvalState & state, const PosIdx pos,
+    const Symbol & arg, Formals * formals, Expr * body)
+{
+    if (!arg.empty() && formals->argNames.count(arg))
+        throw ParseError({
+            .msg = hintfmt("duplicate formal function argument '%1%'", arg),
+            .errPos = state.positions[pos]
+        });
+    return new ExprLambda(pos, arg, true, formals, body);
+}
+
+
+static Expr * stripIndentation(const PosIdx pos, SymbolTable & symbols, vector<Expr *> & es)
 {
     if (es.empty()) return new ExprString(symbols.create(""));
 
@@ -244,9 +267,9 @@ static Expr * stripIndentation(const Pos & pos, SymbolTable & symbols, vector<Ex
 }
 
 
-static inline Pos makeCurPos(const YYLTYPE & loc, ParseData * data)
+static inline PosIdx makeCurPos(const YYLTYPE & loc, ParseData * data)
 {
-    return Pos(data->origin, data->file, loc.first_line, loc.first_column);
+    return data->state.positions.add(*data->origin, loc.first_line, loc.first_column);
 }
 
 #define CUR_POS makeCurPos(*yylocp, data)
@@ -255,11 +278,11 @@ static inline Pos makeCurPos(const YYLTYPE & loc, ParseData * data)
 }
 
 
-void yyerror(YYLTYPE * loc, yyscan_t scanner, ParseData * data, const char * error)
+void yyerror(YYLTYPE * loc, Lexer * scanner, ParseData * data, const char * error)
 {
     data->error = {
         .msg = hintfmt(error),
-        .errPos = makeCurPos(*loc, data)
+        .errPos = data->state.positions[makeCurPos(*loc, data)]
     };
 }
 
@@ -275,9 +298,9 @@ void yyerror(YYLTYPE * loc, yyscan_t scanner, ParseData * data, const char * err
   nix::Formal * formal;
   nix::NixInt n;
   nix::NixFloat nf;
-  const char * id; // !!! -> Symbol
-  char * path;
-  char * uri;
+  nix::StringToken id; // !!! -> Symbol
+  nix::StringToken path;
+  nix::StringToken uri;
   std::vector<nix::AttrName> * attrNames;
   std::vector<nix::Expr *> * string_parts;
 }
@@ -326,11 +349,11 @@ expr_function
   : ID ':' expr_function
     { $$ = new ExprLambda(CUR_POS, data->symbols.create($1), false, 0, $3); }
   | '{' formals '}' ':' expr_function
-    { $$ = new ExprLambda(CUR_POS, data->symbols.create(""), true, $2, $5); }
+    { $$ = makeLambda(data->state, CUR_POS, data->symbols.create(""), $2, $5); }
   | '{' formals '}' '@' ID ':' expr_function
-    { $$ = new ExprLambda(CUR_POS, data->symbols.create($5), true, $2, $7); }
+    { $$ = makeLambda(data->state, CUR_POS, data->symbols.create($5), $2, $7); }
   | ID '@' '{' formals '}' ':' expr_function
-    { $$ = new ExprLambda(CUR_POS, data->symbols.create($1), true, $4, $7); }
+    { $$ = makeLambda(data->state, CUR_POS, data->symbols.create($1), $4, $7); }
   | ASSERT expr ';' expr_function
     { $$ = new ExprAssert(CUR_POS, $2, $4); }
   | WITH expr ';' expr_function
@@ -339,7 +362,7 @@ expr_function
     { if (!$2->dynamicAttrs.empty())
         throw ParseError({
             .msg = hintfmt("dynamic attributes not allowed in let"),
-            .errPos = CUR_POS
+            .errPos = data->state.positions[CUR_POS]
         });
       $$ = new ExprLet($2, $4);
     }
@@ -394,7 +417,7 @@ expr_select
 
 expr_simple
   : ID {
-      if (strcmp($1, "__curPos") == 0)
+      if (std::string_view($1) == "__curPos")
           $$ = new ExprPos(CUR_POS);
       else
           $$ = new ExprVar(CUR_POS, data->symbols.create($1));
@@ -405,10 +428,10 @@ expr_simple
   | IND_STRING_OPEN ind_string_parts IND_STRING_CLOSE {
       $$ = stripIndentation(CUR_POS, data->symbols, *$2);
   }
-  | PATH { $$ = new ExprPath(absPath($1, data->basePath)); }
-  | HPATH { $$ = new ExprPath(getHome() + string{$1 + 1}); }
+  | PATH { $$ = new ExprPath(absPath(string($1), data->basePath)); }
+  | HPATH { $$ = new ExprPath(getHome() + string($1.p + 1, $1.l - 1)); }
   | SPATH {
-      string path($1 + 1, strlen($1) - 2);
+      string path($1.p + 1, $1.l - 2);
       $$ = new ExprApp(CUR_POS,
           new ExprApp(new ExprVar(data->symbols.create("__findFile")),
               new ExprVar(data->symbols.create("__nixPath"))),
@@ -419,7 +442,7 @@ expr_simple
       if (noURLLiterals)
           throw ParseError({
               .msg = hintfmt("URL literals are disabled"),
-              .errPos = CUR_POS
+              .errPos = data->state.positions[CUR_POS]
           });
       $$ = new ExprString(data->symbols.create($1));
   }
@@ -459,13 +482,13 @@ ind_string_parts
   ;
 
 binds
-  : binds attrpath '=' expr ';' { $$ = $1; addAttr($$, *$2, $4, makeCurPos(@2, data)); }
+  : binds attrpath '=' expr ';' { $$ = $1; addAttr(data->state, $$, *$2, $4, makeCurPos(@2, data)); }
   | binds INHERIT attrs ';'
     { $$ = $1;
       for (auto & i : *$3) {
           if ($$->attrs.find(i.symbol) != $$->attrs.end())
-              dupAttr(i.symbol, makeCurPos(@3, data), $$->attrs[i.symbol].pos);
-          Pos pos = makeCurPos(@3, data);
+              dupAttr(data->state, i.symbol, makeCurPos(@3, data), $$->attrs[i.symbol].pos);
+          auto pos = makeCurPos(@3, data);
           $$->attrs[i.symbol] = ExprAttrs::AttrDef(new ExprVar(CUR_POS, i.symbol), pos, true);
       }
     }
@@ -474,7 +497,7 @@ binds
       /* !!! Should ensure sharing of the expression in $4. */
       for (auto & i : *$6) {
           if ($$->attrs.find(i.symbol) != $$->attrs.end())
-              dupAttr(i.symbol, makeCurPos(@6, data), $$->attrs[i.symbol].pos);
+              dupAttr(data->state, i.symbol, makeCurPos(@6, data), $$->attrs[i.symbol].pos);
           $$->attrs[i.symbol] = ExprAttrs::AttrDef(new ExprSelect(CUR_POS, $4, i.symbol), makeCurPos(@6, data));
       }
     }
@@ -492,7 +515,7 @@ attrs
       } else
           throw ParseError({
               .msg = hintfmt("dynamic attributes not allowed in inherit"),
-              .errPos = makeCurPos(@2, data)
+              .errPos = data->state.positions[makeCurPos(@2, data)]
           });
     }
   | { $$ = new AttrPath; }
@@ -523,7 +546,7 @@ attrpath
 
 attr
   : ID { $$ = $1; }
-  | OR_KW { $$ = "or"; }
+  | OR_KW { $$ = {"or", 2}; }
   ;
 
 string_attr
@@ -538,9 +561,9 @@ expr_list
 
 formals
   : formal ',' formals
-    { $$ = $3; addFormal(CUR_POS, $$, *$1); }
+    { $$ = $3; addFormal(data->state, CUR_POS, $$, *$1); }
   | formal
-    { $$ = new Formals; addFormal(CUR_POS, $$, *$1); $$->ellipsis = false; }
+    { $$ = new Formals; addFormal(data->state, CUR_POS, $$, *$1); $$->ellipsis = false; }
   |
     { $$ = new Formals; $$->ellipsis = false; }
   | ELLIPSIS
@@ -564,6 +587,8 @@ formal
 #include "filetransfer.hh"
 #include "fetchers.hh"
 #include "store-api.hh"
+#include "parse-cache.hh"
+#include "fs-cache.hh"
 
 
 namespace nix {
@@ -572,36 +597,36 @@ namespace nix {
 Expr * EvalState::parse(const char * text, FileOrigin origin,
     const Path & path, const Path & basePath, StaticEnv & staticEnv)
 {
-    yyscan_t scanner;
+    PhaseTimer timer(parseTime, EvalPhase::Parsing);
+
     ParseData data(*this);
-    data.origin = origin;
+    Symbol file;
     switch (origin) {
         case foFile:
-            data.file = data.symbols.create(path);
+            file = data.symbols.create(path);
             break;
         case foStdin:
         case foString:
-            data.file = data.symbols.create(text);
+            file = data.symbols.create(text);
             break;
         default:
             assert(false);
     }
+    data.origin = &positions.addOrigin(origin, file, text);
     data.basePath = basePath;
 
-    yylex_init(&scanner);
-    yy_scan_string(text, scanner);
-    int res = yyparse(scanner, &data);
-    yylex_destroy(scanner);
+    Lexer lexer(text);
+    int res = yyparse(&lexer, &data);
 
     if (res) throw ParseError(data.error.value());
 
-    data.result->bindVars(staticEnv);
+    data.result->bindVars(*this, staticEnv);
 
     return data.result;
 }
 
 
-Path resolveExprPath(Path path)
+Path resolveExprPath(Path path, FSCache * fsCache)
 {
     assert(path[0] == '/');
 
@@ -614,9 +639,9 @@ Path resolveExprPath(Path path)
         // Basic cycle/depth limit to avoid infinite loops.
         if (++followCount >= maxFollow)
             throw Error("too many symbolic links encountered while traversing the path '%s'", path);
-        st = lstat(path);
+        st = fsCache ? fsCache->lstat(path) : lstat(path);
         if (!S_ISLNK(st.st_mode)) break;
-        path = absPath(readLink(path), dirOf(path));
+        path = absPath(fsCache ? fsCache->readLink(path) : readLink(path), dirOf(path));
     }
 
     /* If `path' refers to a directory, append `/default.nix'. */
@@ -635,7 +660,21 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), foFile, path, dirOf(path), staticEnv);
+    auto contents = readFile(rewriteLazyPath(path));
+
+    if (!evalSettings.parseCache)
+        return parse(contents.c_str(), foFile, path, dirOf(path), staticEnv);
+
+    auto cachePath = getParseCachePath(path, contents);
+
+    if (auto e = lookupParseCache(cachePath, symbols, positions)) {
+        e->bindVars(*this, staticEnv);
+        return e;
+    }
+
+    auto e = parse(contents.c_str(), foFile, path, dirOf(path), staticEnv);
+    storeParseCache(cachePath, positions, e);
+    return e;
 }
 
 
@@ -680,7 +719,7 @@ Path EvalState::findFile(const string & path)
 }
 
 
-Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos & pos)
+Path EvalState::findFile(SearchPath & searchPath, const string & path, const PosIdx pos)
 {
     for (auto & i : searchPath) {
         std::string suffix;
@@ -693,10 +732,19 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
                 continue;
             suffix = path.size() == s ? "" : "/" + string(path, s);
         }
+        /* Search path entries that are URLs aren't locked, so the
+           result can change at any time. */
+        if (isUri(i.second))
+            markUncacheable(fmt("the search path entry '%s'", i.second));
+        else if (trackedInputs)
+            trackedInputs->paths.insert(absPath(i.second));
         auto r = resolveSearchPathElem(i);
         if (!r.first) continue;
         Path res = r.second + suffix;
-        if (pathExists(res)) return canonPath(res);
+        /* The lookup depends on the absence of the candidates tried
+           before this one, so record them all. */
+        if (trackedInputs) trackedInputs->paths.insert(res);
+        if (fsCache->pathExists(res)) return canonPath(res);
     }
 
     if (hasPrefix(path, "nix/"))
@@ -707,7 +755,7 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
             ? "cannot look up '<%s>' in pure evaluation mode (use '--impure' to override)"
             : "file '%s' was not found in the Nix search path (add it using $NIX_PATH or -I)",
             path),
-        .errPos = pos
+        .errPos = positions[pos]
     });
 }
 
@@ -2,23 +2,32 @@
 #include "derivations.hh"
 #include "eval-inline.hh"
 #include "eval.hh"
+#include "finally.hh"
+#include "fs-cache.hh"
 #include "globals.hh"
 #include "json-to-value.hh"
 #include "names.hh"
+#include "source-cache.hh"
 #include "store-api.hh"
 #include "util.hh"
 #include "json.hh"
 #include "value-to-json.hh"
 #include "value-to-xml.hh"
+#include "value-traversal.hh"
 #include "primops.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <bitset>
 #include <cstring>
+#include <list>
 #include <regex>
+#include <unordered_set>
 #include <dlfcn.h>
 
 
@@ -33,13 +42,34 @@ namespace nix {
 InvalidPathError::InvalidPathError(const Path & path) :
     EvalError("path '%s' is not valid", path), path(path) {}
 
+/* Thrown by realiseContext() to postpone an evaluation in
+   prefetchImports(). This is not an Error, so that it isn't caught
+   by the error handling of the evaluation it interrupts. */
+struct ImportPending { };
+
+/* The derivations needed by calls postponed by the outermost active
+   prefetchImports() of this thread, if any, and its EvalState. This
+   is per thread, so that IFD in other evaluator threads isn't
+   postponed on behalf of a prefetchImports() it isn't part of. */
+static thread_local struct
+{
+    const EvalState * state = nullptr;
+    std::vector<StorePathWithOutputs> * drvs = nullptr;
+} pendingImports;
+
+
 void EvalState::realiseContext(const PathSet & context)
 {
+    PhaseTimer timer(storeTime, EvalPhase::Store);
+
     std::vector<StorePathWithOutputs> drvs;
 
     for (auto & i : context) {
         auto [ctxS, outputName] = decodeContext(i);
         auto ctx = store->parseStorePath(ctxS);
+        /* Lazy trees can be read without copying them. */
+        if (lazyTrees.count(ctxS)) continue;
+        copyLazyTree(ctx);
         if (!store->isValidPath(ctx))
             throw InvalidPathError(store->printStorePath(ctx));
         if (!outputName.empty() && ctx.isDerivation()) {
@@ -53,12 +83,28 @@ void EvalState::realiseContext(const PathSet & context)
         throw EvalError("attempted to realize '%1%' during evaluation but 'allow-import-from-derivation' is false",
             store->printStorePath(drvs.begin()->path));
 
+    {
+        auto failedImports_(failedImports.lock());
+        for (auto & drv : drvs) {
+            auto i = failedImports_->find(store->printStorePath(drv.path));
+            if (i != failedImports_->end())
+                std::rethrow_exception(i->second);
+        }
+    }
+
     /* For performance, prefetch all substitute info. */
     StorePathSet willBuild, willSubstitute, unknown;
     uint64_t downloadSize, narSize;
     store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
 
-    store->buildPaths(drvs);
+    /* Let prefetchImports() build this together with the imports of
+       the other values it's evaluating. */
+    if (pendingImports.state == this && (!willBuild.empty() || !willSubstitute.empty())) {
+        pendingImports.drvs->insert(pendingImports.drvs->end(), drvs.begin(), drvs.end());
+        throw ImportPending();
+    }
+
+    buildImportPaths(drvs);
 
     /* Add the output of this derivations to the allowed
        paths. */
@@ -75,6 +121,86 @@ void EvalState::realiseContext(const PathSet & context)
     }
 }
 
+void EvalState::buildImportPaths(const std::vector<StorePathWithOutputs> & drvs)
+{
+    if (buildImports)
+        buildImports(drvs);
+    else
+        store->buildPaths(drvs);
+}
+
+
+void EvalState::prefetchImports(size_t n, std::function<void(size_t)> f)
+{
+    if (!evalSettings.batchImportFromDerivation || !evalSettings.enableImportFromDerivation)
+        return;
+
+    if (pendingImports.state == this) {
+        bool postponed = false;
+        for (size_t i = 0; i < n; ++i) {
+            try {
+                f(i);
+            } catch (ImportPending &) {
+                postponed = true;
+            } catch (Error &) {
+            }
+        }
+        if (postponed) throw ImportPending();
+        return;
+    }
+
+    std::vector<StorePathWithOutputs> pending;
+    auto outer = pendingImports;
+    pendingImports = {this, &pending};
+    Finally popPending([&]() { pendingImports = outer; });
+
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < n; ++i)
+        todo.push_back(i);
+
+    while (!todo.empty()) {
+        std::vector<size_t> postponed;
+
+        for (auto i : todo) {
+            try {
+                f(i);
+            } catch (ImportPending &) {
+                postponed.push_back(i);
+            } catch (Error &) {
+            }
+        }
+
+        if (postponed.empty()) break;
+
+        assert(!pending.empty());
+        auto drvs = std::move(pending);
+        pending.clear();
+
+        debug("building %d derivations needed by %d postponed evaluations", drvs.size(), postponed.size());
+
+        /* Errors are left to the evaluation that follows. Remember
+           which derivations failed, so that it reports the error
+           instead of building them again. */
+        try {
+            PhaseTimer timer(storeTime, EvalPhase::Store);
+            buildImportPaths(drvs);
+        } catch (Error &) {
+            auto error = std::current_exception();
+            StorePathSet willBuild, willSubstitute, unknown;
+            uint64_t downloadSize, narSize;
+            store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
+            auto failedImports_(failedImports.lock());
+            for (auto & drv : drvs)
+                if (willBuild.count(drv.path))
+                    failedImports_->insert_or_assign(store->printStorePath(drv.path), error);
+            break;
+        }
+
+        todo = std::move(postponed);
+    }
+}
+
+
 /* Add and attribute to the given attribute map from the output name to
    the output path, or a placeholder.
 
@@ -106,7 +232,7 @@ static void mkOutputString(EvalState & state, Value & v,
 
 /* Load and evaluate an expression from path specified by the
    argument. */
-static void import(EvalState & state, const Pos & pos, Value & vPath, Value * vScope, Value & v)
+static void import(EvalState & state, const PosIdx pos, Value & vPath, Value * vScope, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, vPath, context);
@@ -116,10 +242,10 @@ static void import(EvalState & state, const Pos & pos, Value & vPath, Value * vS
     } catch (InvalidPathError & e) {
         throw EvalError({
             .msg = hintfmt("cannot import '%1%', since path '%2%' is not valid", path, e.path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     } catch (Error & e) {
-        e.addTrace(pos, "while importing '%s'", path);
+        e.addTrace(state.positions[pos], "while importing '%s'", path);
         throw e;
     }
 
@@ -193,7 +319,7 @@ static void import(EvalState & state, const Pos & pos, Value & vPath, Value * vS
             }
 
             printTalkative("evaluating file '%1%'", realPath);
-            Expr * e = state.parseExprFromFile(resolveExprPath(realPath), staticEnv);
+            Expr * e = state.parseExprFromFile(resolveExprPath(realPath, state.fsCache.get()), staticEnv);
 
             e->eval(state, *env, v);
         }
@@ -203,7 +329,7 @@ static void import(EvalState & state, const Pos & pos, Value & vPath, Value * vS
 static RegisterPrimOp primop_scopedImport(RegisterPrimOp::Info {
     .name = "scopedImport",
     .arity = 2,
-    .fun = [](EvalState & state, const Pos & pos, Value * * args, Value & v)
+    .fun = [](EvalState & state, const PosIdx pos, Value * * args, Value & v)
     {
         import(state, pos, *args[1], args[0], v);
     }
@@ -265,7 +391,7 @@ static RegisterPrimOp primop_import({
       (The function argument doesn’t have to be called `x` in `foo.nix`;
       any name would work.)
     )",
-    .fun = [](EvalState & state, const Pos & pos, Value * * args, Value & v)
+    .fun = [](EvalState & state, const PosIdx pos, Value * * args, Value & v)
     {
         import(state, pos, *args[0], nullptr, v);
     }
@@ -276,7 +402,7 @@ static RegisterPrimOp primop_import({
 extern "C" typedef void (*ValueInitializer)(EvalState & state, Value & v);
 
 /* Load a ValueInitializer from a DSO and return whatever it initializes */
-void prim_importNative(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_importNative(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, *args[0], context);
@@ -288,7 +414,7 @@ void prim_importNative(EvalState & state, const Pos & pos, Value * * args, Value
             .msg = hintfmt(
                 "cannot import '%1%', since path '%2%' is not valid",
                 path, e.path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     }
 
@@ -318,15 +444,16 @@ void prim_importNative(EvalState & state, const Pos & pos, Value * * args, Value
 
 
 /* Execute a program and parse its output */
-void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_exec(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    state.markUncacheable("builtins.exec");
     state.forceList(*args[0], pos);
     auto elems = args[0]->listElems();
     auto count = args[0]->listSize();
     if (count == 0) {
         throw EvalError({
             .msg = hintfmt("at least one argument to 'exec' required"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     }
     PathSet context;
@@ -341,29 +468,29 @@ void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
         throw EvalError({
             .msg = hintfmt("cannot execute '%1%', since path '%2%' is not valid",
                 program, e.path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     }
 
     auto output = runProgram(program, true, commandArgs);
     Expr * parsed;
     try {
-        parsed = state.parseExprFromString(output, pos.file);
+        parsed = state.parseExprFromString(output, state.positions[pos].file);
     } catch (Error & e) {
-        e.addTrace(pos, "While parsing the output from '%1%'", program);
+        e.addTrace(state.positions[pos], "While parsing the output from '%1%'", program);
         throw;
     }
     try {
         state.eval(parsed, v);
     } catch (Error & e) {
-        e.addTrace(pos, "While evaluating the output from '%1%'", program);
+        e.addTrace(state.positions[pos], "While evaluating the output from '%1%'", program);
         throw;
     }
 }
 
 
 /* Return a string representing the type of the expression. */
-static void prim_typeOf(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_typeOf(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     string t;
@@ -397,7 +524,7 @@ static RegisterPrimOp primop_typeOf({
 });
 
 /* Determine whether the argument is the null value. */
-static void prim_isNull(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isNull(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nNull);
@@ -417,7 +544,7 @@ static RegisterPrimOp primop_isNull({
 });
 
 /* Determine whether the argument is a function. */
-static void prim_isFunction(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isFunction(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nFunction);
@@ -433,7 +560,7 @@ static RegisterPrimOp primop_isFunction({
 });
 
 /* Determine whether the argument is an integer. */
-static void prim_isInt(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isInt(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nInt);
@@ -449,7 +576,7 @@ static RegisterPrimOp primop_isInt({
 });
 
 /* Determine whether the argument is a float. */
-static void prim_isFloat(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isFloat(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nFloat);
@@ -465,7 +592,7 @@ static RegisterPrimOp primop_isFloat({
 });
 
 /* Determine whether the argument is a string. */
-static void prim_isString(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isString(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nString);
@@ -481,7 +608,7 @@ static RegisterPrimOp primop_isString({
 });
 
 /* Determine whether the argument is a Boolean. */
-static void prim_isBool(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isBool(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nBool);
@@ -497,7 +624,7 @@ static RegisterPrimOp primop_isBool({
 });
 
 /* Determine whether the argument is a path. */
-static void prim_isPath(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isPath(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nPath);
@@ -545,7 +672,7 @@ typedef list<Value *> ValueList;
 #endif
 
 
-static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_genericClosure(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
 
@@ -555,7 +682,7 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     if (startSet == args[0]->attrs->end())
         throw EvalError({
             .msg = hintfmt("attribute 'startSet' required"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     state.forceList(*startSet->value, pos);
 
@@ -569,7 +696,7 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     if (op == args[0]->attrs->end())
         throw EvalError({
             .msg = hintfmt("attribute 'operator' required"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     state.forceValue(*op->value, pos);
 
@@ -580,6 +707,39 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
     set<Value *, CompareValues> doneKeys;
+
+    /* Fast path: as long as all keys are integers or all keys are
+       strings, use a hash set rather than `doneKeys'. When a key of
+       another type appears, move the keys seen so far into
+       `doneKeys' and continue with that, so that comparisons between
+       keys of different types behave as before. */
+    std::optional<ValueType> fastKeyType;
+    std::unordered_set<NixInt> doneInts;
+    std::unordered_set<std::string_view> doneStrings;
+    std::vector<Value *> fastKeys;
+    bool genericKeys = false;
+
+    auto insertKey = [&](Value * key) {
+        if (!genericKeys && !fastKeyType && (key->type() == nInt || key->type() == nString))
+            fastKeyType = key->type();
+        if (fastKeyType && key->type() == *fastKeyType) {
+            bool added = *fastKeyType == nInt
+                ? doneInts.insert(key->integer).second
+                : doneStrings.insert(key->string.s).second;
+            if (added) fastKeys.push_back(key);
+            return added;
+        }
+        if (fastKeyType) {
+            doneKeys.insert(fastKeys.begin(), fastKeys.end());
+            fastKeys.clear();
+            doneInts.clear();
+            doneStrings.clear();
+            fastKeyType.reset();
+        }
+        genericKeys = true;
+        return doneKeys.insert(key).second;
+    };
+
     while (!workSet.empty()) {
         Value * e = *(workSet.begin());
         workSet.pop_front();
@@ -591,11 +751,11 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
         if (key == e->attrs->end())
             throw EvalError({
                 .msg = hintfmt("attribute 'key' required"),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         state.forceValue(*key->value, pos);
 
-        if (!doneKeys.insert(key->value).second) continue;
+        if (!insertKey(key->value)) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -629,7 +789,7 @@ static RegisterPrimOp primop_abort({
     .doc = R"(
       Abort Nix expression evaluation and print the error message *s*.
     )",
-    .fun = [](EvalState & state, const Pos & pos, Value * * args, Value & v)
+    .fun = [](EvalState & state, const PosIdx pos, Value * * args, Value & v)
     {
         PathSet context;
         string s = state.coerceToString(pos, *args[0], context);
@@ -647,7 +807,7 @@ static RegisterPrimOp primop_throw({
       derivations, a derivation that throws an error is silently skipped
       (which is not the case for `abort`).
     )",
-    .fun = [](EvalState & state, const Pos & pos, Value * * args, Value & v)
+    .fun = [](EvalState & state, const PosIdx pos, Value * * args, Value & v)
     {
       PathSet context;
       string s = state.coerceToString(pos, *args[0], context);
@@ -655,7 +815,7 @@ static RegisterPrimOp primop_throw({
     }
 });
 
-static void prim_addErrorContext(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_addErrorContext(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     try {
         state.forceValue(*args[1], pos);
@@ -675,7 +835,7 @@ static RegisterPrimOp primop_addErrorContext(RegisterPrimOp::Info {
 
 /* Try evaluating the argument. Success => {success=true; value=something;},
  * else => {success=false; value=false;} */
-static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_tryEval(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.mkAttrs(v, 2);
     try {
@@ -711,10 +871,12 @@ static RegisterPrimOp primop_tryEval({
 });
 
 /* Return an environment variable.  Use with care. */
-static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_getEnv(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
-    mkString(v, evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name).value_or(""));
+    auto value = evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name).value_or("");
+    if (state.trackedInputs) state.trackedInputs->envVars.insert_or_assign(name, value);
+    mkString(v, value);
 }
 
 static RegisterPrimOp primop_getEnv({
@@ -735,7 +897,7 @@ static RegisterPrimOp primop_getEnv({
 });
 
 /* Evaluate the first argument, then return the second argument. */
-static void prim_seq(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_seq(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
@@ -754,7 +916,7 @@ static RegisterPrimOp primop_seq({
 
 /* Evaluate the first argument deeply (i.e. recursing into lists and
    attrsets), then return the second argument. */
-static void prim_deepSeq(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_deepSeq(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValueDeep(*args[0]);
     state.forceValue(*args[1], pos);
@@ -774,7 +936,7 @@ static RegisterPrimOp primop_deepSeq({
 
 /* Evaluate the first expression and print it on standard error.  Then
    return the second expression.  Useful for debugging. */
-static void prim_trace(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_trace(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     if (args[0]->type() == nString)
@@ -809,7 +971,7 @@ static RegisterPrimOp primop_trace({
    derivation; `drvPath' containing the path of the Nix expression;
    and `type' set to `derivation' to indicate that this is a
    derivation. */
-static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_derivationStrict(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
 
@@ -818,14 +980,14 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     if (attr == args[0]->attrs->end())
         throw EvalError({
             .msg = hintfmt("required attribute 'name' missing"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     string drvName;
-    Pos & posDrvName(*attr->pos);
+    auto posDrvName = attr->pos;
     try {
         drvName = state.forceStringNoCtx(*attr->value, pos);
     } catch (Error & e) {
-        e.addTrace(posDrvName, "while evaluating the derivation attribute 'name'");
+        e.addTrace(state.positions[posDrvName], "while evaluating the derivation attribute 'name'");
         throw;
     }
 
@@ -856,7 +1018,33 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     StringSet outputs;
     outputs.insert("out");
 
-    for (auto & i : args[0]->attrs->lexicographicOrder()) {
+    auto attrs = args[0]->attrs->lexicographicOrder();
+
+    /* Evaluate the attributes, and the output paths of the
+       derivations they refer to, before processing them, so that the
+       builds they import from happen in parallel. */
+    state.prefetchImports(attrs.size(), [&](size_t n) {
+        state.forceValue(*attrs[n]->value);
+    });
+
+    std::vector<Value *> deps;
+    for (auto & i : attrs) {
+        if (i->value->isList())
+            for (size_t n = 0; n < i->value->listSize(); ++n)
+                deps.push_back(i->value->listElems()[n]);
+        else
+            deps.push_back(i->value);
+    }
+
+    state.prefetchImports(deps.size(), [&](size_t n) {
+        auto & v = *deps[n];
+        state.forceValue(v);
+        if (v.type() == nAttrs)
+            if (auto j = v.attrs->find(state.sOutPath); j != v.attrs->end())
+                state.forceValue(*j->value);
+    });
+
+    for (auto & i : attrs) {
         if (i->name == state.sIgnoreNulls) continue;
         const string & key = i->name;
         vomit("processing attribute '%1%'", key);
@@ -867,7 +1055,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
             else
                 throw EvalError({
                     .msg = hintfmt("invalid value '%s' for 'outputHashMode' attribute", s),
-                    .errPos = posDrvName
+                    .errPos = state.positions[posDrvName]
                 });
         };
 
@@ -877,7 +1065,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
                 if (outputs.find(j) != outputs.end())
                     throw EvalError({
                         .msg = hintfmt("duplicate derivation output '%1%'", j),
-                        .errPos = posDrvName
+                        .errPos = state.positions[posDrvName]
                     });
                 /* !!! Check whether j is a valid attribute
                    name. */
@@ -887,14 +1075,14 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
                 if (j == "drv")
                     throw EvalError({
                         .msg = hintfmt("invalid derivation output name 'drv'" ),
-                        .errPos = posDrvName
+                        .errPos = state.positions[posDrvName]
                     });
                 outputs.insert(j);
             }
             if (outputs.empty())
                 throw EvalError({
                     .msg = hintfmt("derivation cannot have an empty set of outputs"),
-                    .errPos = posDrvName
+                    .errPos = state.positions[posDrvName]
                 });
         };
 
@@ -965,7 +1153,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
             }
 
         } catch (Error & e) {
-            e.addTrace(posDrvName,
+            e.addTrace(state.positions[posDrvName],
                 "while evaluating the attribute '%1%' of the derivation '%2%'",
                 key, drvName);
             throw;
@@ -992,7 +1180,9 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
         if (path.at(0) == '=') {
             /* !!! This doesn't work if readOnlyMode is set. */
             StorePathSet refs;
-            state.store->computeFSClosure(state.store->parseStorePath(std::string_view(path).substr(1)), refs);
+            auto storePath = state.store->parseStorePath(std::string_view(path).substr(1));
+            state.copyLazyTree(storePath);
+            state.store->computeFSClosure(storePath, refs);
             for (auto & j : refs) {
                 drv.inputSrcs.insert(j);
                 if (j.isDerivation())
@@ -1007,28 +1197,31 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
         }
 
         /* Otherwise it's a source file. */
-        else
-            drv.inputSrcs.insert(state.store->parseStorePath(path));
+        else {
+            auto storePath = state.store->parseStorePath(path);
+            state.copyLazyTree(storePath);
+            drv.inputSrcs.insert(std::move(storePath));
+        }
     }
 
     /* Do we have all required attributes? */
     if (drv.builder == "")
         throw EvalError({
             .msg = hintfmt("required attribute 'builder' missing"),
-            .errPos = posDrvName
+            .errPos = state.positions[posDrvName]
         });
 
     if (drv.platform == "")
         throw EvalError({
             .msg = hintfmt("required attribute 'system' missing"),
-            .errPos = posDrvName
+            .errPos = state.positions[posDrvName]
         });
 
     /* Check whether the derivation name is valid. */
     if (isDerivation(drvName))
         throw EvalError({
             .msg = hintfmt("derivation names are not allowed to end in '%s'", drvExtension),
-            .errPos = posDrvName
+            .errPos = state.positions[posDrvName]
         });
 
     if (outputHash) {
@@ -1039,7 +1232,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
         if (outputs.size() != 1 || *(outputs.begin()) != "out")
             throw Error({
                 .msg = hintfmt("multiple outputs are not supported in fixed-output derivations"),
-                .errPos = posDrvName
+                .errPos = state.positions[posDrvName]
             });
 
         std::optional<HashType> ht = parseHashTypeOpt(outputHashAlgo);
@@ -1121,11 +1314,24 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     }
 
     /* Write the resulting term into the Nix store directory. */
-    auto drvPath = writeDerivation(*state.store, drv, state.repair);
+    auto drvPath = [&]() {
+        PhaseTimer timer(state.storeTime, EvalPhase::Store);
+        return writeDerivation(*state.store, drv, state.repair);
+    }();
     auto drvPathS = state.store->printStorePath(drvPath);
 
     printMsg(lvlChatty, "instantiated '%1%' -> '%2%'", drvName, drvPathS);
 
+    if (settings.prefetchSubstitutes && !settings.readOnlyMode
+        && drv.type() == DerivationType::InputAddressed)
+    {
+        StorePathSet outputPaths;
+        for (auto & i : drv.outputsAndOptPaths(*state.store))
+            if (i.second.second)
+                outputPaths.insert(*i.second.second);
+        state.store->prefetchSubstitutes(outputPaths);
+    }
+
     /* Optimisation, but required in read-only mode! because in that
        case we don't actually write store derivations, so we can't
        read them later.
@@ -1157,7 +1363,7 @@ static RegisterPrimOp primop_derivationStrict(RegisterPrimOp::Info {
    time, any occurence of this string in an derivation attribute will
    be replaced with the concrete path in the Nix store of the output
    ‘out’. */
-static void prim_placeholder(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_placeholder(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     mkString(v, hashPlaceholder(state.forceStringNoCtx(*args[0], pos)));
 }
@@ -1180,7 +1386,7 @@ static RegisterPrimOp primop_placeholder({
 
 
 /* Convert the argument to a path.  !!! obsolete? */
-static void prim_toPath(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_toPath(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, *args[0], context);
@@ -1205,13 +1411,16 @@ static RegisterPrimOp primop_toPath({
    /nix/store/newhash-oldhash-oldname.  In the past, `toPath' had
    special case behaviour for store paths, but that created weird
    corner cases. */
-static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_storePath(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     if (evalSettings.pureEval)
         throw EvalError("builtins.storePath' is not allowed in pure evaluation mode");
 
     PathSet context;
-    Path path = state.checkSourcePath(state.coerceToPath(pos, *args[0], context));
+    Path path = state.coerceToPath(pos, *args[0], context);
+    if (state.store->isInStore(path))
+        state.copyLazyTree(state.store->toStorePath(path).first);
+    path = state.checkSourcePath(path);
     /* Resolve symlinks in ‘path’, unless ‘path’ itself is a symlink
        directly in the store.  The latter condition is necessary so
        e.g. nix-push does the right thing. */
@@ -1219,7 +1428,7 @@ static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, V
     if (!state.store->isInStore(path))
         throw EvalError({
             .msg = hintfmt("path '%1%' is not in the Nix store", path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     auto path2 = state.store->toStorePath(path).first;
     if (!settings.readOnlyMode)
@@ -1246,7 +1455,7 @@ static RegisterPrimOp primop_storePath({
     .fun = prim_storePath,
 });
 
-static void prim_pathExists(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_pathExists(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, *args[0], context);
@@ -1257,12 +1466,12 @@ static void prim_pathExists(EvalState & state, const Pos & pos, Value * * args,
             .msg = hintfmt(
                 "cannot check the existence of '%1%', since path '%2%' is not valid",
                 path, e.path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     }
 
     try {
-        mkBool(v, pathExists(state.checkSourcePath(path)));
+        mkBool(v, state.fsCache->pathExists(state.checkSourcePath(path)));
     } catch (SysError & e) {
         /* Don't give away info from errors while canonicalising
            ‘path’ in restricted mode. */
@@ -1284,7 +1493,7 @@ static RegisterPrimOp primop_pathExists({
 
 /* Return the base name of the given string, i.e., everything
    following the last slash. */
-static void prim_baseNameOf(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_baseNameOf(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     mkString(v, baseNameOf(state.coerceToString(pos, *args[0], context, false, false)), context);
@@ -1304,7 +1513,7 @@ static RegisterPrimOp primop_baseNameOf({
 /* Return the directory of the given path, i.e., everything before the
    last slash.  Return either a path or a string depending on the type
    of the argument. */
-static void prim_dirOf(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_dirOf(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     Path dir = dirOf(state.coerceToString(pos, *args[0], context, false, false));
@@ -1323,7 +1532,7 @@ static RegisterPrimOp primop_dirOf({
 });
 
 /* Return the contents of a file as a string. */
-static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_readFile(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, *args[0], context);
@@ -1332,10 +1541,34 @@ static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Va
     } catch (InvalidPathError & e) {
         throw EvalError({
             .msg = hintfmt("cannot read '%1%', since path '%2%' is not valid", path, e.path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     }
-    string s = readFile(state.checkSourcePath(state.toRealPath(path, context)));
+    auto realPath = state.checkSourcePath(state.toRealPath(path, context));
+
+    /* Map regular files into memory, so that their contents are copied
+       only once, into the resulting string. Other files (which may
+       not have a meaningful size) are read the normal way. */
+    AutoCloseFD fd = open(realPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening file '%1%'", realPath);
+    struct stat st;
+    if (fstat(fd.get(), &st))
+        throw SysError("statting file '%1%'", realPath);
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (data == MAP_FAILED)
+            throw SysError("mapping file '%1%'", realPath);
+        Finally unmap([&]() { munmap(data, st.st_size); });
+        std::string_view s((const char *) data, st.st_size);
+        if (s.find((char) 0) != std::string_view::npos)
+            throw Error("the contents of the file '%1%' cannot be represented as a Nix string", path);
+        mkString(v, s);
+        return;
+    }
+
+    string s = readFile(fd.get());
     if (s.find((char) 0) != string::npos)
         throw Error("the contents of the file '%1%' cannot be represented as a Nix string", path);
     mkString(v, s.c_str());
@@ -1352,7 +1585,7 @@ static RegisterPrimOp primop_readFile({
 
 /* Find a file in the Nix search path. Used to implement <x> paths,
    which are desugared to 'findFile __nixPath "x"'. */
-static void prim_findFile(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_findFile(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
 
@@ -1371,7 +1604,7 @@ static void prim_findFile(EvalState & state, const Pos & pos, Value * * args, Va
         if (i == v2.attrs->end())
             throw EvalError({
                 .msg = hintfmt("attribute 'path' missing"),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
 
         PathSet context;
@@ -1382,7 +1615,7 @@ static void prim_findFile(EvalState & state, const Pos & pos, Value * * args, Va
         } catch (InvalidPathError & e) {
             throw EvalError({
                 .msg = hintfmt("cannot find '%1%', since path '%2%' is not valid", path, e.path),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         }
 
@@ -1401,14 +1634,14 @@ static RegisterPrimOp primop_findFile(RegisterPrimOp::Info {
 });
 
 /* Return the cryptographic hash of a file in base-16. */
-static void prim_hashFile(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_hashFile(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string type = state.forceStringNoCtx(*args[0], pos);
     std::optional<HashType> ht = parseHashType(type);
     if (!ht)
       throw Error({
           .msg = hintfmt("unknown hash type '%1%'", type),
-          .errPos = pos
+          .errPos = state.positions[pos]
       });
 
     PathSet context; // discarded
@@ -1423,13 +1656,13 @@ static RegisterPrimOp primop_hashFile({
     .doc = R"(
       Return a base-16 representation of the cryptographic hash of the
       file at path *p*. The hash algorithm specified by *type* must be one
-      of `"md5"`, `"sha1"`, `"sha256"` or `"sha512"`.
+      of `"md5"`, `"sha1"`, `"sha256"`, `"sha512"` or `"blake3"`.
     )",
     .fun = prim_hashFile,
 });
 
 /* Read a directory (without . or ..) */
-static void prim_readDir(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_readDir(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet ctx;
     Path path = state.coerceToPath(pos, *args[0], ctx);
@@ -1438,17 +1671,15 @@ static void prim_readDir(EvalState & state, const Pos & pos, Value * * args, Val
     } catch (InvalidPathError & e) {
         throw EvalError({
             .msg = hintfmt("cannot read '%1%', since path '%2%' is not valid", path, e.path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     }
 
-    DirEntries entries = readDirectory(state.checkSourcePath(path));
+    auto & entries = state.fsCache->readDirectory(state.checkSourcePath(path));
     state.mkAttrs(v, entries.size());
 
     for (auto & ent : entries) {
         Value * ent_val = state.allocAttr(v, state.symbols.create(ent.name));
-        if (ent.type == DT_UNKNOWN)
-            ent.type = getFileType(path + "/" + ent.name);
         ent_val->mkString(
             ent.type == DT_REG ? "regular" :
             ent.type == DT_DIR ? "directory" :
@@ -1487,12 +1718,12 @@ static RegisterPrimOp primop_readDir({
 /* Convert the argument (which can be any Nix expression) to an XML
    representation returned in a string.  Not all Nix expressions can
    be sensibly or completely represented (e.g., functions). */
-static void prim_toXML(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_toXML(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
-    std::ostringstream out;
+    StringSink sink;
     PathSet context;
-    printValueAsXML(state, true, false, *args[0], out, context);
-    mkString(v, out.str(), context);
+    printValueAsXML(state, true, false, *args[0], sink, context);
+    mkString(v, *sink.s, context);
 }
 
 static RegisterPrimOp primop_toXML({
@@ -1595,12 +1826,12 @@ static RegisterPrimOp primop_toXML({
 /* Convert the argument (which can be any Nix expression) to a JSON
    string.  Not all Nix expressions can be sensibly or completely
    represented (e.g., functions). */
-static void prim_toJSON(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_toJSON(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
-    std::ostringstream out;
+    StringSink sink;
     PathSet context;
-    printValueAsJSON(state, true, *args[0], out, context);
-    mkString(v, out.str(), context);
+    printValueAsJSON(state, true, *args[0], sink, context);
+    mkString(v, *sink.s, context);
 }
 
 static RegisterPrimOp primop_toJSON({
@@ -1618,13 +1849,19 @@ static RegisterPrimOp primop_toJSON({
 });
 
 /* Parse a JSON string to a value. */
-static void prim_fromJSON(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_fromJSON(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
-    string s = state.forceStringNoCtx(*args[0], pos);
+    /* Use the string in place rather than copying it, since JSON
+       documents can be large. forceStringNoCtx() is only called to
+       produce the appropriate error. */
+    state.forceValue(*args[0], pos);
+    if (args[0]->type() != nString || args[0]->string.context)
+        state.forceStringNoCtx(*args[0], pos);
+    std::string_view s = args[0]->string.s;
     try {
-        parseJSON(state, s, v);
+        parseJSON(state, s, v, evalSettings.lazyFromJSON);
     } catch (JSONParseError &e) {
-        e.addTrace(pos, "while decoding a JSON string");
+        e.addTrace(state.positions[pos], "while decoding a JSON string");
         throw e;
     }
 }
@@ -1646,7 +1883,7 @@ static RegisterPrimOp primop_fromJSON({
 
 /* Store a string in the Nix store as a source file that can be used
    as an input by derivations. */
-static void prim_toFile(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_toFile(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     string name = state.forceStringNoCtx(*args[0], pos);
@@ -1661,9 +1898,12 @@ static void prim_toFile(EvalState & state, const Pos & pos, Value * * args, Valu
                     "in 'toFile': the file named '%1%' must not contain a reference "
                     "to a derivation but contains (%2%)",
                     name, path),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
-        refs.insert(state.store->parseStorePath(path));
+        auto storePath = state.store->parseStorePath(path);
+        if (!settings.readOnlyMode)
+            state.copyLazyTree(storePath);
+        refs.insert(std::move(storePath));
     }
 
     auto storePath = state.store->printStorePath(settings.readOnlyMode
@@ -1755,19 +1995,22 @@ static RegisterPrimOp primop_toFile({
     .fun = prim_toFile,
 });
 
-static void addPath(EvalState & state, const Pos & pos, const string & name, const Path & path_,
+static void addPath(EvalState & state, const PosIdx pos, const string & name, const Path & path_,
     Value * filterFun, FileIngestionMethod method, const std::optional<Hash> expectedHash, Value & v)
 {
     const auto path = evalSettings.pureEval && expectedHash ?
-        path_ :
+        state.rewriteLazyPath(path_) :
         state.checkSourcePath(path_);
-    PathFilter filter = filterFun ? ([&](const Path & path) {
-        auto st = lstat(path);
+    const auto virtualPath = canonPath(path_);
+    const bool lazy = state.rewriteLazyPath(virtualPath) != virtualPath;
+    PathFilter filter = filterFun ? ([&](const Path & p) {
+        auto st = lstat(p);
 
         /* Call the filter function.  The first argument is the path,
-           the second is a string indicating the type of the file. */
+           the second is a string indicating the type of the file. In
+           a lazy tree, that's the path under the tree's store path. */
         Value arg1;
-        mkString(arg1, path);
+        mkString(arg1, lazy && hasPrefix(p, path) ? virtualPath + p.substr(path.size()) : p);
 
         Value fun2;
         state.callFunction(*filterFun, arg1, fun2, noPos);
@@ -1789,7 +2032,20 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
     if (expectedHash)
         expectedStorePath = state.store->makeFixedOutputPath(method, *expectedHash, name);
     Path dstPath;
-    if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
+    if (!expectedHash && evalSettings.sourceCache && !state.repair) {
+        SourceCache cache(state, path, name, method, filterFun);
+        auto storePath = cache.lookup();
+        if (!storePath) {
+            auto recordingFilter = cache.record(filter);
+            if (settings.readOnlyMode)
+                storePath = state.store->computeStorePathForPath(name, path, method, htSHA256, recordingFilter).first;
+            else {
+                storePath = state.store->addToStore(name, path, method, htSHA256, recordingFilter, state.repair);
+                cache.store(*storePath);
+            }
+        }
+        dstPath = state.store->printStorePath(*storePath);
+    } else if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
         dstPath = state.store->printStorePath(settings.readOnlyMode
             ? state.store->computeStorePathForPath(name, path, method, htSHA256, filter).first
             : state.store->addToStore(name, path, method, htSHA256, filter, state.repair));
@@ -1802,14 +2058,14 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
 }
 
 
-static void prim_filterSource(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_filterSource(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, *args[1], context);
     if (!context.empty())
         throw EvalError({
             .msg = hintfmt("string '%1%' cannot refer to other paths", path),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     state.forceValue(*args[0], pos);
@@ -1818,7 +2074,7 @@ static void prim_filterSource(EvalState & state, const Pos & pos, Value * * args
             .msg = hintfmt(
                 "first argument in call to 'filterSource' is not a function but %1%",
                 showType(*args[0])),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     addPath(state, pos, std::string(baseNameOf(path)), path, args[0], FileIngestionMethod::Recursive, std::nullopt, v);
@@ -1866,7 +2122,7 @@ static RegisterPrimOp primop_filterSource({
     .fun = prim_filterSource,
 });
 
-static void prim_path(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_path(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
     Path path;
@@ -1879,31 +2135,31 @@ static void prim_path(EvalState & state, const Pos & pos, Value * * args, Value
         const string & n(attr.name);
         if (n == "path") {
             PathSet context;
-            path = state.coerceToPath(*attr.pos, *attr.value, context);
+            path = state.coerceToPath(attr.pos, *attr.value, context);
             if (!context.empty())
                 throw EvalError({
                     .msg = hintfmt("string '%1%' cannot refer to other paths", path),
-                    .errPos = *attr.pos
+                    .errPos = state.positions[attr.pos]
                 });
         } else if (attr.name == state.sName)
-            name = state.forceStringNoCtx(*attr.value, *attr.pos);
+            name = state.forceStringNoCtx(*attr.value, attr.pos);
         else if (n == "filter") {
             state.forceValue(*attr.value, pos);
             filterFun = attr.value;
         } else if (n == "recursive")
-            method = FileIngestionMethod { state.forceBool(*attr.value, *attr.pos) };
+            method = FileIngestionMethod { state.forceBool(*attr.value, attr.pos) };
         else if (n == "sha256")
-            expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, *attr.pos), htSHA256);
+            expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, attr.pos), htSHA256);
         else
             throw EvalError({
                 .msg = hintfmt("unsupported argument '%1%' to 'addPath'", attr.name),
-                .errPos = *attr.pos
+                .errPos = state.positions[attr.pos]
             });
     }
     if (path.empty())
         throw EvalError({
             .msg = hintfmt("'path' required"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     if (name.empty())
         name = baseNameOf(path);
@@ -1954,7 +2210,7 @@ static RegisterPrimOp primop_path({
 
 /* Return the names of the attributes in a set as a sorted list of
    strings. */
-static void prim_attrNames(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_attrNames(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
 
@@ -1962,7 +2218,7 @@ static void prim_attrNames(EvalState & state, const Pos & pos, Value * * args, V
 
     size_t n = 0;
     for (auto & i : *args[0]->attrs)
-        mkString(*(v.listElems()[n++] = state.allocValue()), i.name);
+        v.listElems()[n++] = state.allocString(i.name);
 
     std::sort(v.listElems(), v.listElems() + n,
               [](Value * v1, Value * v2) { return strcmp(v1->string.s, v2->string.s) < 0; });
@@ -1981,7 +2237,7 @@ static RegisterPrimOp primop_attrNames({
 
 /* Return the values of the attributes in a set as a list, in the same
    order as attrNames. */
-static void prim_attrValues(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_attrValues(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
 
@@ -2009,7 +2265,7 @@ static RegisterPrimOp primop_attrValues({
 });
 
 /* Dynamic version of the `.' operator. */
-void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_getAttr(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
@@ -2018,10 +2274,10 @@ void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
     if (i == args[1]->attrs->end())
         throw EvalError({
             .msg = hintfmt("attribute '%1%' missing", attr),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     // !!! add to stack trace?
-    if (state.countCalls && i->pos) state.attrSelects[*i->pos]++;
+    if (state.countCalls && i->pos) state.attrSelects[i->pos]++;
     state.forceValue(*i->value, pos);
     v = *i->value;
 }
@@ -2039,7 +2295,7 @@ static RegisterPrimOp primop_getAttr({
 });
 
 /* Return position information of the specified attribute. */
-static void prim_unsafeGetAttrPos(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_unsafeGetAttrPos(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
@@ -2057,7 +2313,7 @@ static RegisterPrimOp primop_unsafeGetAttrPos(RegisterPrimOp::Info {
 });
 
 /* Dynamic version of the `?' operator. */
-static void prim_hasAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_hasAttr(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
@@ -2076,7 +2332,7 @@ static RegisterPrimOp primop_hasAttr({
 });
 
 /* Determine whether the argument is a set. */
-static void prim_isAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isAttrs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nAttrs);
@@ -2091,26 +2347,35 @@ static RegisterPrimOp primop_isAttrs({
     .fun = prim_isAttrs,
 });
 
-static void prim_removeAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_removeAttrs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
     state.forceList(*args[1], pos);
 
-    /* Get the attribute names to be removed. */
-    std::set<Symbol> names;
+    /* Get the attribute names to be removed, in the same order as
+       the attributes. */
+    std::vector<Symbol> names;
+    names.reserve(args[1]->listSize());
     for (unsigned int i = 0; i < args[1]->listSize(); ++i) {
         state.forceStringNoCtx(*args[1]->listElems()[i], pos);
-        names.insert(state.symbols.create(args[1]->listElems()[i]->string.s));
+        names.push_back(state.symbols.create(args[1]->listElems()[i]->string.s));
     }
-
-    /* Copy all attributes not in that set.  Note that we don't need
-       to sort v.attrs because it's a subset of an already sorted
-       vector. */
-    state.mkAttrs(v, args[0]->attrs->size());
-    for (auto & i : *args[0]->attrs) {
-        if (names.find(i.name) == names.end())
-            v.attrs->push_back(i);
+    std::sort(names.begin(), names.end());
+
+    /* Copy all attributes not in that list by merging the two sorted
+       sequences, copying the attributes between removed ones without
+       comparing them.  Note that we don't need to sort v.attrs
+       because it's a subset of an already sorted vector. */
+    auto & attrs = *args[0]->attrs;
+    state.mkAttrs(v, attrs.size());
+    auto p = attrs.begin();
+    for (auto & name : names) {
+        auto q = Bindings::gallop(p, attrs.end(), name);
+        while (p != q) v.attrs->push_back(*p++);
+        if (p == attrs.end()) break;
+        if (p->name == name) ++p;
     }
+    while (p != attrs.end()) v.attrs->push_back(*p++);
 }
 
 static RegisterPrimOp primop_removeAttrs({
@@ -2134,13 +2399,14 @@ static RegisterPrimOp primop_removeAttrs({
    "nameN"; value = valueN;}] is transformed to {name1 = value1;
    ... nameN = valueN;}.  In case of duplicate occurences of the same
    name, the first takes precedence. */
-static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_listToAttrs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
 
     state.mkAttrs(v, args[0]->listSize());
 
-    std::set<Symbol> seen;
+    /* The first occurrence of a name wins. */
+    PointerSet seen;
 
     for (unsigned int i = 0; i < args[0]->listSize(); ++i) {
         Value & v2(*args[0]->listElems()[i]);
@@ -2150,23 +2416,25 @@ static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args,
         if (j == v2.attrs->end())
             throw TypeError({
                 .msg = hintfmt("'name' attribute missing in a call to 'listToAttrs'"),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         string name = state.forceStringNoCtx(*j->value, pos);
 
         Symbol sym = state.symbols.create(name);
-        if (seen.insert(sym).second) {
-            Bindings::iterator j2 = v2.attrs->find(state.symbols.create(state.sValue));
+        if (seen.insert(&(const std::string &) sym)) {
+            Bindings::iterator j2 = v2.attrs->find(state.sValue);
             if (j2 == v2.attrs->end())
                 throw TypeError({
                     .msg = hintfmt("'value' attribute missing in a call to 'listToAttrs'"),
-                    .errPos = pos
+                    .errPos = state.positions[pos]
                 });
             v.attrs->push_back(Attr(sym, j2->value, j2->pos));
         }
     }
 
-    v.attrs->sort();
+    /* Lists generated from sets are usually in order already. */
+    if (!std::is_sorted(v.attrs->begin(), v.attrs->end()))
+        v.attrs->sort();
 }
 
 static RegisterPrimOp primop_listToAttrs({
@@ -2194,17 +2462,31 @@ static RegisterPrimOp primop_listToAttrs({
     .fun = prim_listToAttrs,
 });
 
-static void prim_intersectAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_intersectAttrs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
     state.forceAttrs(*args[1], pos);
 
-    state.mkAttrs(v, std::min(args[0]->attrs->size(), args[1]->attrs->size()));
-
-    for (auto & i : *args[0]->attrs) {
-        Bindings::iterator j = args[1]->attrs->find(i.name);
-        if (j != args[1]->attrs->end())
-            v.attrs->push_back(*j);
+    auto & left = *args[0]->attrs;
+    auto & right = *args[1]->attrs;
+
+    state.mkAttrs(v, std::min(left.size(), right.size()));
+    if (left.empty() || right.empty()) return;
+
+    /* Walk the smaller set and search the larger one. Both are
+       sorted, so each (galloping) search can start where the previous
+       one ended, and the result comes out sorted. This is cheap for
+       the typical `intersectAttrs (functionArgs f) pkgs`. */
+    bool leftSmaller = left.size() <= right.size();
+    auto & small = leftSmaller ? left : right;
+    auto & large = leftSmaller ? right : left;
+
+    auto j = large.begin();
+    for (auto & i : small) {
+        j = Bindings::gallop(j, large.end(), i.name);
+        if (j == large.end()) break;
+        if (j->name == i.name)
+            v.attrs->push_back(leftSmaller ? *j : i);
     }
 }
 
@@ -2218,7 +2500,66 @@ static RegisterPrimOp primop_intersectAttrs({
     .fun = prim_intersectAttrs,
 });
 
-static void prim_catAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_recursiveUpdate(EvalState & state, const PosIdx pos, Value * * args, Value & v)
+{
+    state.forceValue(*args[0], pos);
+    state.forceValue(*args[1], pos);
+
+    if (args[0]->type() != nAttrs || args[1]->type() != nAttrs) {
+        v = *args[1];
+        return;
+    }
+
+    auto & left = *args[0]->attrs;
+    auto & right = *args[1]->attrs;
+
+    if (left.empty()) { v = *args[1]; return; }
+    if (right.empty()) { v = *args[0]; return; }
+
+    /* Merge the sorted sets. Attributes that occur in both are merged
+       lazily by a call to this primop, like lib.recursiveUpdate. */
+    Value * vSelf = nullptr;
+    state.mkAttrs(v, left.size() + right.size());
+    auto i = left.begin(), j = right.begin();
+    while (i != left.end() || j != right.end()) {
+        if (j == right.end() || (i != left.end() && i->name < j->name))
+            v.attrs->push_back(*i++);
+        else if (i == left.end() || j->name < i->name)
+            v.attrs->push_back(*j++);
+        else {
+            if (!vSelf) vSelf = &state.getBuiltin("recursiveUpdate");
+            auto vFun = state.allocValue();
+            vFun->mkPrimOpApp(vSelf, i->value);
+            auto vMerged = state.allocValue();
+            mkApp(*vMerged, *vFun, *j->value);
+            v.attrs->push_back(Attr(j->name, vMerged, j->pos));
+            ++i; ++j;
+        }
+    }
+}
+
+static RegisterPrimOp primop_recursiveUpdate({
+    .name = "__recursiveUpdate",
+    .args = {"lhs", "rhs"},
+    .doc = R"(
+      If *lhs* and *rhs* are both sets, return a set containing the
+      attributes of both, where attributes that occur in both sets
+      are merged recursively in the same way. Otherwise, return *rhs*.
+      For example,
+
+      ```nix
+      builtins.recursiveUpdate
+        { foo = { bar = 1; baz = 2; }; }
+        { foo = { bar = 3; }; qux = 4; }
+      ```
+
+      evaluates to `{ foo = { bar = 3; baz = 2; }; qux = 4; }`. This
+      is equivalent to `lib.recursiveUpdate` in Nixpkgs.
+    )",
+    .fun = prim_recursiveUpdate,
+});
+
+static void prim_catAttrs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     Symbol attrName = state.symbols.create(state.forceStringNoCtx(*args[0], pos));
     state.forceList(*args[1], pos);
@@ -2256,7 +2597,7 @@ static RegisterPrimOp primop_catAttrs({
     .fun = prim_catAttrs,
 });
 
-static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_functionArgs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     if (args[0]->isPrimOpApp() || args[0]->isPrimOp()) {
@@ -2266,7 +2607,7 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
     if (!args[0]->isLambda())
         throw TypeError({
             .msg = hintfmt("'functionArgs' requires a function"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     if (!args[0]->lambda.fun->matchAttrs) {
@@ -2274,14 +2615,20 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
         return;
     }
 
-    state.mkAttrs(v, args[0]->lambda.fun->formals->formals.size());
-    for (auto & i : args[0]->lambda.fun->formals->formals) {
-        // !!! should optimise booleans (allocate only once)
-        Value * value = state.allocValue();
-        v.attrs->push_back(Attr(i.name, value, &i.pos));
-        mkBool(*value, i.def);
+    auto fun = args[0]->lambda.fun;
+    if (!fun->formalsAttrs) {
+        Value vAttrs;
+        state.mkAttrs(vAttrs, fun->formals->formals.size());
+        Value * vTrue = nullptr, * vFalse = nullptr;
+        for (auto & i : fun->formals->formals) {
+            auto & value = i.def ? vTrue : vFalse;
+            if (!value) mkBool(*(value = state.allocValue()), i.def);
+            vAttrs.attrs->push_back(Attr(i.name, value, i.pos));
+        }
+        vAttrs.attrs->sort();
+        fun->formalsAttrs = vAttrs.attrs;
     }
-    v.attrs->sort();
+    v.mkAttrs(fun->formalsAttrs);
 }
 
 static RegisterPrimOp primop_functionArgs({
@@ -2302,17 +2649,18 @@ static RegisterPrimOp primop_functionArgs({
 });
 
 /*  */
-static void prim_mapAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_mapAttrs(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[1], pos);
 
     state.mkAttrs(v, args[1]->attrs->size());
 
+    /* The attribute names are shared string values, so each
+       attribute only needs the application of `f' to its name and
+       the application of that to its value. */
     for (auto & i : *args[1]->attrs) {
-        Value * vName = state.allocValue();
         Value * vFun2 = state.allocValue();
-        mkString(*vName, i.name);
-        mkApp(*vFun2, *args[0], *vName);
+        mkApp(*vFun2, *args[0], *state.allocString(i.name));
         mkApp(*state.allocAttr(v, i.name), *vFun2, *i.value);
     }
 }
@@ -2339,7 +2687,7 @@ static RegisterPrimOp primop_mapAttrs({
 
 
 /* Determine whether the argument is a list. */
-static void prim_isList(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_isList(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     mkBool(v, args[0]->type() == nList);
@@ -2354,20 +2702,20 @@ static RegisterPrimOp primop_isList({
     .fun = prim_isList,
 });
 
-static void elemAt(EvalState & state, const Pos & pos, Value & list, int n, Value & v)
+static void elemAt(EvalState & state, const PosIdx pos, Value & list, int n, Value & v)
 {
     state.forceList(list, pos);
     if (n < 0 || (unsigned int) n >= list.listSize())
         throw Error({
             .msg = hintfmt("list index %1% is out of bounds", n),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
     state.forceValue(*list.listElems()[n], pos);
     v = *list.listElems()[n];
 }
 
 /* Return the n-1'th element of a list. */
-static void prim_elemAt(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_elemAt(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     elemAt(state, pos, *args[0], state.forceInt(*args[1], pos), v);
 }
@@ -2383,7 +2731,7 @@ static RegisterPrimOp primop_elemAt({
 });
 
 /* Return the first element of a list. */
-static void prim_head(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_head(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     elemAt(state, pos, *args[0], 0, v);
 }
@@ -2402,13 +2750,13 @@ static RegisterPrimOp primop_head({
 /* Return a list consisting of everything but the first element of
    a list.  Warning: this function takes O(n) time, so you probably
    don't want to use it!  */
-static void prim_tail(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_tail(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
     if (args[0]->listSize() == 0)
         throw Error({
             .msg = hintfmt("'tail' called on an empty list"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     state.mkList(v, args[0]->listSize() - 1);
@@ -2433,7 +2781,7 @@ static RegisterPrimOp primop_tail({
 });
 
 /* Apply a function to every element of a list. */
-static void prim_map(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_map(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[1], pos);
 
@@ -2463,7 +2811,7 @@ static RegisterPrimOp primop_map({
 /* Filter a list using a predicate; that is, return a list containing
    every element from the list for which the predicate function
    returns true. */
-static void prim_filter(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_filter(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
@@ -2501,7 +2849,7 @@ static RegisterPrimOp primop_filter({
 });
 
 /* Return true if a list contains a given element. */
-static void prim_elem(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_elem(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     bool res = false;
     state.forceList(*args[1], pos);
@@ -2523,8 +2871,104 @@ static RegisterPrimOp primop_elem({
     .fun = prim_elem,
 });
 
+/* A set of values (in weak head normal form) under the equality of
+   eqValues(). Values that have been forced entirely are looked up by
+   their deep hash, and compared only with values that have the same
+   deep hash or that still contain thunks. Since a thunk may evaluate to
+   anything, other values are looked up by their shallow hash. */
+class ValueSet
+{
+    EvalState & state;
+
+    std::unordered_multimap<size_t, Value *> byDeepHash;
+
+    /* The values that have a deep hash and those that don't, by
+       their shallow hash. */
+    std::unordered_multimap<size_t, Value *> complete, partial;
+
+    bool contains(std::unordered_multimap<size_t, Value *> & values, size_t hash, Value & v)
+    {
+        auto range = values.equal_range(hash);
+        for (auto i = range.first; i != range.second; ++i)
+            if (state.eqValues(v, *i->second)) return true;
+        return false;
+    }
+
+public:
+
+    ValueSet(EvalState & state) : state(state) { }
+
+    /* Add a value, unless it is equal to a value already in the
+       set. Return whether it was added. */
+    bool insert(Value * v)
+    {
+        auto shallow = state.shallowHash(*v);
+        auto deep = state.deepHash(*v);
+
+        if (contains(partial, shallow, *v)) return false;
+
+        if (deep) {
+            if (contains(byDeepHash, *deep, *v)) return false;
+            byDeepHash.emplace(*deep, v);
+            complete.emplace(shallow, v);
+        } else {
+            if (contains(complete, shallow, *v)) return false;
+            partial.emplace(shallow, v);
+        }
+
+        return true;
+    }
+};
+
+/* Remove duplicate elements from a list, keeping the first
+   occurrence. Strings, which are by far the most common elements, are
+   looked up in a hash set of their contents; other values in a
+   ValueSet. */
+static void prim_unique(EvalState & state, const PosIdx pos, Value * * args, Value & v)
+{
+    state.forceList(*args[0], pos);
+
+    auto len = args[0]->listSize();
+    std::vector<Value *> res;
+    res.reserve(len);
+    std::unordered_set<std::string_view> strings;
+    ValueSet others(state);
+
+    for (unsigned int n = 0; n < len; ++n) {
+        auto elem = args[0]->listElems()[n];
+        state.forceValue(*elem, pos);
+        if (elem->type() == nString) {
+            if (!strings.insert(elem->string.s).second) continue;
+        } else {
+            if (!others.insert(elem)) continue;
+        }
+        res.push_back(elem);
+    }
+
+    if (res.size() == len) {
+        v = *args[0];
+        return;
+    }
+
+    state.mkList(v, res.size());
+    for (size_t n = 0; n < res.size(); ++n)
+        v.listElems()[n] = res[n];
+}
+
+static RegisterPrimOp primop_unique({
+    .name = "__unique",
+    .args = {"list"},
+    .doc = R"(
+      Return *list* without duplicate elements, keeping the first
+      occurrence of each element. For example, `builtins.unique [ 3 2
+      3 4 ]` evaluates to `[ 3 2 4 ]`. This is equivalent to
+      `lib.unique` in Nixpkgs.
+    )",
+    .fun = prim_unique,
+});
+
 /* Concatenate a list of lists. */
-static void prim_concatLists(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_concatLists(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
     state.concatLists(v, args[0]->listSize(), args[0]->listElems(), pos);
@@ -2540,7 +2984,7 @@ static RegisterPrimOp primop_concatLists({
 });
 
 /* Return the length of a list.  This is an O(1) time operation. */
-static void prim_length(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_length(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
     mkInt(v, args[0]->listSize());
@@ -2557,7 +3001,7 @@ static RegisterPrimOp primop_length({
 
 /* Reduce a list by applying a binary operator, from left to
    right. The operator is applied strictly. */
-static void prim_foldlStrict(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_foldlStrict(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
     state.forceList(*args[2], pos);
@@ -2591,7 +3035,7 @@ static RegisterPrimOp primop_foldlStrict({
     .fun = prim_foldlStrict,
 });
 
-static void anyOrAll(bool any, EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void anyOrAll(bool any, EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
@@ -2610,7 +3054,7 @@ static void anyOrAll(bool any, EvalState & state, const Pos & pos, Value * * arg
 }
 
 
-static void prim_any(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_any(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     anyOrAll(true, state, pos, args, v);
 }
@@ -2625,7 +3069,7 @@ static RegisterPrimOp primop_any({
     .fun = prim_any,
 });
 
-static void prim_all(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_all(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     anyOrAll(false, state, pos, args, v);
 }
@@ -2640,23 +3084,20 @@ static RegisterPrimOp primop_all({
     .fun = prim_all,
 });
 
-static void prim_genList(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_genList(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     auto len = state.forceInt(*args[1], pos);
 
     if (len < 0)
         throw EvalError({
             .msg = hintfmt("cannot create list of size %1%", len),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     state.mkList(v, len);
 
-    for (unsigned int n = 0; n < (unsigned int) len; ++n) {
-        Value * arg = state.allocValue();
-        mkInt(*arg, n);
-        mkApp(*(v.listElems()[n] = state.allocValue()), *args[0], *arg);
-    }
+    for (unsigned int n = 0; n < (unsigned int) len; ++n)
+        mkApp(*(v.listElems()[n] = state.allocValue()), *args[0], *state.allocInt(n));
 }
 
 static RegisterPrimOp primop_genList({
@@ -2675,10 +3116,55 @@ static RegisterPrimOp primop_genList({
     .fun = prim_genList,
 });
 
-static void prim_lessThan(EvalState & state, const Pos & pos, Value * * args, Value & v);
+static void prim_lessThan(EvalState & state, const PosIdx pos, Value * * args, Value & v);
 
 
-static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value & v)
+/* Recognise comparators of the form `a: b: a < b' and `a: b: b < a'
+   (or equivalently `a > b'), where `<' is the builtin lessThan, so
+   that sort can compare the elements without calling the
+   comparator. Returns 1 for ascending order, -1 for descending
+   order, and 0 if the comparator is not recognised. */
+static int recogniseLessThan(Value & fun)
+{
+    if (fun.isPrimOp())
+        return fun.primOp->fun == prim_lessThan ? 1 : 0;
+
+    if (!fun.isLambda()) return 0;
+    auto outer = fun.lambda.fun;
+    if (outer->matchAttrs) return 0;
+    auto inner = dynamic_cast<ExprLambda *>(outer->body);
+    if (!inner || inner->matchAttrs) return 0;
+
+    auto app2 = dynamic_cast<ExprApp *>(inner->body);
+    if (!app2) return 0;
+    auto app1 = dynamic_cast<ExprApp *>(app2->e1);
+    if (!app1) return 0;
+    auto op = dynamic_cast<ExprVar *>(app1->e1);
+    auto x = dynamic_cast<ExprVar *>(app1->e2);
+    auto y = dynamic_cast<ExprVar *>(app2->e2);
+    if (!op || !x || !y || op->fromWith || x->fromWith || y->fromWith)
+        return 0;
+
+    /* The operator must resolve to lessThan in the closure of the
+       comparator (i.e. it hasn't been shadowed by a `let'). Level 0
+       is the inner argument, level 1 the outer one. */
+    if (!(op->name == "__lessThan") || op->level < 2) return 0;
+    Env * env = fun.lambda.env;
+    for (auto l = op->level - 2; l; --l) env = env->up;
+    auto vOp = env->values[op->displ];
+    if (!vOp || !vOp->isPrimOp() || vOp->primOp->fun != prim_lessThan)
+        return 0;
+
+    auto isArg = [](ExprVar * var, unsigned int level) {
+        return var->level == level && var->displ == 0;
+    };
+    if (isArg(x, 1) && isArg(y, 0)) return 1;
+    if (isArg(x, 0) && isArg(y, 1)) return -1;
+    return 0;
+}
+
+
+static void prim_sort(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
@@ -2691,11 +3177,13 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
     }
 
 
+    /* Optimization: if the comparator is lessThan or a lambda
+       wrapping it, bypass callFunction. */
+    auto order = recogniseLessThan(*args[0]);
+
     auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        if (args[0]->isPrimOp() && args[0]->primOp->fun == prim_lessThan)
-            return CompareValues()(a, b);
+        if (order == 1) return CompareValues()(a, b);
+        if (order == -1) return CompareValues()(b, a);
 
         Value vTmp1, vTmp2;
         state.callFunction(*args[0], *a, vTmp1, pos);
@@ -2730,7 +3218,7 @@ static RegisterPrimOp primop_sort({
     .fun = prim_sort,
 });
 
-static void prim_partition(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_partition(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
@@ -2790,7 +3278,7 @@ static RegisterPrimOp primop_partition({
     .fun = prim_partition,
 });
 
-static void prim_concatMap(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_concatMap(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
@@ -2832,7 +3320,7 @@ static RegisterPrimOp primop_concatMap({
  *************************************************************/
 
 
-static void prim_add(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_add(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
@@ -2851,7 +3339,7 @@ static RegisterPrimOp primop_add({
     .fun = prim_add,
 });
 
-static void prim_sub(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_sub(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
@@ -2870,7 +3358,7 @@ static RegisterPrimOp primop_sub({
     .fun = prim_sub,
 });
 
-static void prim_mul(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_mul(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
@@ -2889,7 +3377,7 @@ static RegisterPrimOp primop_mul({
     .fun = prim_mul,
 });
 
-static void prim_div(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_div(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
@@ -2898,7 +3386,7 @@ static void prim_div(EvalState & state, const Pos & pos, Value * * args, Value &
     if (f2 == 0)
         throw EvalError({
             .msg = hintfmt("division by zero"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     if (args[0]->type() == nFloat || args[1]->type() == nFloat) {
@@ -2910,7 +3398,7 @@ static void prim_div(EvalState & state, const Pos & pos, Value * * args, Value &
         if (i1 == std::numeric_limits<NixInt>::min() && i2 == -1)
             throw EvalError({
                 .msg = hintfmt("overflow in integer division"),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
 
         mkInt(v, i1 / i2);
@@ -2926,7 +3414,7 @@ static RegisterPrimOp primop_div({
     .fun = prim_div,
 });
 
-static void prim_bitAnd(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_bitAnd(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     mkInt(v, state.forceInt(*args[0], pos) & state.forceInt(*args[1], pos));
 }
@@ -2940,7 +3428,7 @@ static RegisterPrimOp primop_bitAnd({
     .fun = prim_bitAnd,
 });
 
-static void prim_bitOr(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_bitOr(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     mkInt(v, state.forceInt(*args[0], pos) | state.forceInt(*args[1], pos));
 }
@@ -2954,7 +3442,7 @@ static RegisterPrimOp primop_bitOr({
     .fun = prim_bitOr,
 });
 
-static void prim_bitXor(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_bitXor(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     mkInt(v, state.forceInt(*args[0], pos) ^ state.forceInt(*args[1], pos));
 }
@@ -2968,7 +3456,7 @@ static RegisterPrimOp primop_bitXor({
     .fun = prim_bitXor,
 });
 
-static void prim_lessThan(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_lessThan(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
@@ -2996,7 +3484,7 @@ static RegisterPrimOp primop_lessThan({
 /* Convert the argument to a string.  Paths are *not* copied to the
    store, so `toString /foo/bar' yields `"/foo/bar"', not
    `"/nix/store/whatever..."'. */
-static void prim_toString(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_toString(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     string s = state.coerceToString(pos, *args[0], context, true, false);
@@ -3031,7 +3519,7 @@ static RegisterPrimOp primop_toString({
    at character position `min(start, stringLength str)' inclusive and
    ending at `min(start + len, stringLength str)'.  `start' must be
    non-negative. */
-static void prim_substring(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_substring(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     int start = state.forceInt(*args[0], pos);
     int len = state.forceInt(*args[1], pos);
@@ -3041,7 +3529,7 @@ static void prim_substring(EvalState & state, const Pos & pos, Value * * args, V
     if (start < 0)
         throw EvalError({
             .msg = hintfmt("negative start position in 'substring'"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     mkString(v, (unsigned int) start >= s.size() ? "" : string(s, start, len), context);
@@ -3067,7 +3555,7 @@ static RegisterPrimOp primop_substring({
     .fun = prim_substring,
 });
 
-static void prim_stringLength(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_stringLength(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
     string s = state.coerceToString(pos, *args[0], context);
@@ -3085,14 +3573,14 @@ static RegisterPrimOp primop_stringLength({
 });
 
 /* Return the cryptographic hash of a string in base-16. */
-static void prim_hashString(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_hashString(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string type = state.forceStringNoCtx(*args[0], pos);
     std::optional<HashType> ht = parseHashType(type);
     if (!ht)
         throw Error({
             .msg = hintfmt("unknown hash type '%1%'", type),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
     PathSet context; // discarded
@@ -3107,14 +3595,35 @@ static RegisterPrimOp primop_hashString({
     .doc = R"(
       Return a base-16 representation of the cryptographic hash of string
       *s*. The hash algorithm specified by *type* must be one of `"md5"`,
-      `"sha1"`, `"sha256"` or `"sha512"`.
+      `"sha1"`, `"sha256"`, `"sha512"` or `"blake3"`.
     )",
     .fun = prim_hashString,
 });
 
+/* Compiled regular expressions used by `match' and `split', since
+   compiling a std::regex is expensive and the same few patterns tend
+   to be used over and over. */
 struct RegexCache
 {
-    std::unordered_map<std::string, std::regex> cache;
+    /* The elements of an unordered_map don't move, so the regexes
+       can be used after the lock is released. */
+    Sync<std::unordered_map<std::string, std::regex>> cache_;
+
+    const std::regex & get(EvalState & state, const std::string & re)
+    {
+        {
+            auto cache(cache_.lock());
+            auto regex = cache->find(re);
+            if (regex != cache->end()) {
+                state.nrRegexCacheHits++;
+                return regex->second;
+            }
+        }
+        std::regex regex(re, std::regex::extended);
+        auto cache(cache_.lock());
+        state.nrRegexCacheMisses++;
+        return cache->emplace(re, std::move(regex)).first->second;
+    }
 };
 
 std::shared_ptr<RegexCache> makeRegexCache()
@@ -3122,21 +3631,19 @@ std::shared_ptr<RegexCache> makeRegexCache()
     return std::make_shared<RegexCache>();
 }
 
-void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_match(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
     try {
 
-        auto regex = state.regexCache->cache.find(re);
-        if (regex == state.regexCache->cache.end())
-            regex = state.regexCache->cache.emplace(re, std::regex(re, std::regex::extended)).first;
+        auto & regex = state.regexCache->get(state, re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
         std::smatch match;
-        if (!std::regex_match(str, match, regex->second)) {
+        if (!std::regex_match(str, match, regex)) {
             mkNull(v);
             return;
         }
@@ -3156,12 +3663,12 @@ void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
             // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
             throw EvalError({
                 .msg = hintfmt("memory limit exceeded by regular expression '%s'", re),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         } else {
             throw EvalError({
                 .msg = hintfmt("invalid regular expression '%s'", re),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         }
     }
@@ -3205,13 +3712,13 @@ static RegisterPrimOp primop_match({
 
 /* Split a string with a regular expression, and return a list of the
    non-matching parts interleaved by the lists of the matching groups. */
-static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_split(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto & regex = state.regexCache->get(state, re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
@@ -3264,12 +3771,12 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
             // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
             throw EvalError({
                 .msg = hintfmt("memory limit exceeded by regular expression '%s'", re),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         } else {
             throw EvalError({
                 .msg = hintfmt("invalid regular expression '%s'", re),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
         }
     }
@@ -3312,22 +3819,66 @@ static RegisterPrimOp primop_split({
     .fun = prim_split,
 });
 
-static void prim_concatStringsSep(EvalState & state, const Pos & pos, Value * * args, Value & v)
+/* Collects the contexts of many strings. Strings often share the
+   same context strings, so the pointers are gathered first and only
+   the distinct ones are inserted into a PathSet by finish(). */
+struct ContextCollector
+{
+    std::vector<const char *> paths;
+
+    void add(const Value & v)
+    {
+        if (v.string.context)
+            for (auto p = v.string.context; *p; ++p)
+                paths.push_back(*p);
+    }
+
+    void finish(PathSet & context)
+    {
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        for (auto p : paths)
+            context.insert(p);
+    }
+};
+
+static void prim_concatStringsSep(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     PathSet context;
 
     auto sep = state.forceString(*args[0], context, pos);
     state.forceList(*args[1], pos);
 
-    string res;
-    res.reserve((args[1]->listSize() + 32) * sep.size());
-    bool first = true;
+    auto len = args[1]->listSize();
 
-    for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
-        if (first) first = false; else res += sep;
-        res += state.coerceToString(pos, *args[1]->listElems()[n], context);
+    /* Evaluate the elements first, so that the result can be
+       allocated with its exact size. Strings are used in place;
+       other values are coerced. */
+    std::vector<std::string_view> parts;
+    parts.reserve(len);
+    std::list<string> coerced;
+    ContextCollector contexts;
+    size_t size = len ? sep.size() * (len - 1) : 0;
+
+    for (unsigned int n = 0; n < len; ++n) {
+        auto & elem = *args[1]->listElems()[n];
+        state.forceValue(elem, pos);
+        if (elem.type() == nString) {
+            parts.emplace_back(elem.string.s);
+            contexts.add(elem);
+        } else
+            parts.emplace_back(coerced.emplace_back(state.coerceToString(pos, elem, context)));
+        size += parts.back().size();
+    }
+
+    string res;
+    res.reserve(size);
+    for (size_t n = 0; n < parts.size(); ++n) {
+        if (n) res += sep;
+        res += parts[n];
     }
 
+    contexts.finish(context);
     mkString(v, res, context);
 }
 
@@ -3342,61 +3893,118 @@ static RegisterPrimOp primop_concatStringsSep({
     .fun = prim_concatStringsSep,
 });
 
-static void prim_replaceStrings(EvalState & state, const Pos & pos, Value * * args, Value & v)
+/* A trie of the 'from' strings of replaceStrings(). At each position,
+   replaceStrings() uses the first 'from' string (in list order) that
+   occurs there, rather than the longest, so the trie is walked from
+   each position to find all the strings that occur there, and the one
+   with the lowest index is used. Positions whose character doesn't
+   start any string are skipped without walking the trie. */
+struct ReplaceTrie
+{
+    static constexpr uint32_t noMatch = std::numeric_limits<uint32_t>::max();
+
+    /* The lowest index of a string ending at each node. Node 0 is the
+       root. */
+    std::vector<uint32_t> match{noMatch};
+
+    /* The edges, keyed by node and character. */
+    std::unordered_map<uint64_t, uint32_t> edges;
+
+    std::bitset<256> firstChars;
+
+    /* The index of the empty string, which occurs everywhere. */
+    uint32_t empty = noMatch;
+
+    static uint64_t key(uint32_t node, char c)
+    {
+        return ((uint64_t) node << 8) | (unsigned char) c;
+    }
+
+    void add(std::string_view s, uint32_t index)
+    {
+        if (s.empty()) {
+            empty = std::min(empty, index);
+            return;
+        }
+        firstChars.set((unsigned char) s[0]);
+        uint32_t node = 0;
+        for (auto c : s) {
+            auto [i, inserted] = edges.emplace(key(node, c), match.size());
+            if (inserted) match.push_back(noMatch);
+            node = i->second;
+        }
+        match[node] = std::min(match[node], index);
+    }
+
+    /* Return the index and length of the string to replace at the
+       start of 's', if any. */
+    std::pair<uint32_t, size_t> find(std::string_view s) const
+    {
+        std::pair<uint32_t, size_t> best{empty, 0};
+        if (s.empty() || !firstChars.test((unsigned char) s[0])) return best;
+        uint32_t node = 0;
+        for (size_t n = 0; n < s.size(); ++n) {
+            auto i = edges.find(key(node, s[n]));
+            if (i == edges.end()) break;
+            node = i->second;
+            if (match[node] < best.first)
+                best = {match[node], n + 1};
+        }
+        return best;
+    }
+};
+
+static void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
     state.forceList(*args[1], pos);
     if (args[0]->listSize() != args[1]->listSize())
         throw EvalError({
             .msg = hintfmt("'from' and 'to' arguments to 'replaceStrings' have different lengths"),
-            .errPos = pos
+            .errPos = state.positions[pos]
         });
 
-    vector<string> from;
-    from.reserve(args[0]->listSize());
+    ReplaceTrie trie;
     for (unsigned int n = 0; n < args[0]->listSize(); ++n)
-        from.push_back(state.forceString(*args[0]->listElems()[n], pos));
+        trie.add(state.forceString(*args[0]->listElems()[n], pos), n);
 
-    vector<std::pair<string, PathSet>> to;
-    to.reserve(args[1]->listSize());
-    for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
-        PathSet ctx;
-        auto s = state.forceString(*args[1]->listElems()[n], ctx, pos);
-        to.push_back(std::make_pair(std::move(s), std::move(ctx)));
-    }
+    /* The context of a replacement is only added if it's used. */
+    std::vector<Value *> to(args[1]->listElems(), args[1]->listElems() + args[1]->listSize());
+    for (auto vTo : to)
+        state.forceString(*vTo, pos);
+    std::vector<bool> used(to.size(), false);
+    ContextCollector contexts;
 
     PathSet context;
     auto s = state.forceString(*args[2], context, pos);
 
     string res;
+    res.reserve(s.size());
+
     // Loops one past last character to handle the case where 'from' contains an empty string.
     for (size_t p = 0; p <= s.size(); ) {
-        bool found = false;
-        auto i = from.begin();
-        auto j = to.begin();
-        for (; i != from.end(); ++i, ++j)
-            if (s.compare(p, i->size(), *i) == 0) {
-                found = true;
-                res += j->first;
-                if (i->empty()) {
-                    if (p < s.size())
-                        res += s[p];
-                    p++;
-                } else {
-                    p += i->size();
-                }
-                for (auto& path : j->second)
-                    context.insert(path);
-                j->second.clear();
-                break;
+        auto [index, len] = trie.find(std::string_view(s).substr(p));
+        if (index != ReplaceTrie::noMatch) {
+            auto & vTo = *to[index];
+            if (!used[index]) {
+                contexts.add(vTo);
+                used[index] = true;
             }
-        if (!found) {
+            res += vTo.string.s;
+            if (len == 0) {
+                if (p < s.size())
+                    res += s[p];
+                p++;
+            } else
+                p += len;
+        } else {
             if (p < s.size())
                 res += s[p];
             p++;
         }
     }
 
+    contexts.finish(context);
     mkString(v, res, context);
 }
 
@@ -3416,13 +4024,82 @@ static RegisterPrimOp primop_replaceStrings({
     .fun = prim_replaceStrings,
 });
 
+static void prim_splitString(EvalState & state, const PosIdx pos, Value * * args, Value & v)
+{
+    auto sep = state.forceStringNoCtx(*args[0], pos);
+    PathSet context;
+    auto s = state.forceString(*args[1], context, pos);
+
+    /* Like lib.splitString, which uses builtins.split with the
+       escaped separator, an empty separator splits the string into
+       characters, with an empty string at each end. */
+    std::vector<std::string_view> parts;
+    std::string_view rest(s);
+    if (sep.empty()) {
+        parts.push_back("");
+        for (size_t n = 0; n < rest.size(); ++n)
+            parts.push_back(rest.substr(n, 1));
+        parts.push_back("");
+    } else
+        while (true) {
+            auto p = rest.find(sep);
+            parts.push_back(rest.substr(0, p));
+            if (p == rest.npos) break;
+            rest = rest.substr(p + sep.size());
+        }
+
+    state.mkList(v, parts.size());
+    for (size_t n = 0; n < parts.size(); ++n)
+        mkString(*(v.listElems()[n] = state.allocValue()), parts[n], context);
+}
+
+static RegisterPrimOp primop_splitString({
+    .name = "__splitString",
+    .args = {"sep", "s"},
+    .doc = R"(
+      Split the string *s* at each occurrence of the string *sep*,
+      returning the list of the parts, e.g. `builtins.splitString "/"
+      "/usr/local/bin"` evaluates to `[ "" "usr" "local" "bin" ]`. Each
+      part has the context of *s*. This is equivalent to
+      `lib.splitString` in Nixpkgs.
+    )",
+    .fun = prim_splitString,
+});
+
+static void prim_escapeShellArg(EvalState & state, const PosIdx pos, Value * * args, Value & v)
+{
+    PathSet context;
+    auto s = state.coerceToString(pos, *args[0], context, true, false);
+
+    string res;
+    res.reserve(s.size() + 2);
+    res += '\'';
+    for (auto c : s)
+        if (c == '\'') res += "'\\''"; else res += c;
+    res += '\'';
+
+    mkString(v, res, context);
+}
+
+static RegisterPrimOp primop_escapeShellArg({
+    .name = "__escapeShellArg",
+    .args = {"arg"},
+    .doc = R"(
+      Convert *arg* to a string like `toString`, and quote it so that
+      a POSIX shell treats it as a single word, e.g.
+      `builtins.escapeShellArg "it's"` evaluates to `"'it'\\''s'"`.
+      This is equivalent to `lib.escapeShellArg` in Nixpkgs.
+    )",
+    .fun = prim_escapeShellArg,
+});
+
 
 /*************************************************************
  * Versions
  *************************************************************/
 
 
-static void prim_parseDrvName(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_parseDrvName(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
     DrvName parsed(name);
@@ -3446,7 +4123,7 @@ static RegisterPrimOp primop_parseDrvName({
     .fun = prim_parseDrvName,
 });
 
-static void prim_compareVersions(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_compareVersions(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string version1 = state.forceStringNoCtx(*args[0], pos);
     string version2 = state.forceStringNoCtx(*args[1], pos);
@@ -3466,7 +4143,7 @@ static RegisterPrimOp primop_compareVersions({
     .fun = prim_compareVersions,
 });
 
-static void prim_splitVersion(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_splitVersion(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     string version = state.forceStringNoCtx(*args[0], pos);
     auto iter = version.cbegin();
@@ -3599,12 +4276,15 @@ void EvalState::createBaseEnv()
                 });
 
     /* Add a wrapper around the derivation primop that computes the
-       `drvPath' and `outPath' attributes lazily. */
+       `drvPath' and `outPath' attributes lazily. The wrapper itself
+       is also parsed lazily, since many evaluations (and all commands
+       that don't evaluate anything) never use it. */
     sDerivationNix = symbols.create("//builtin/derivation.nix");
-    eval(parse(
-        #include "primops/derivation.nix.gen.hh"
-        , foFile, sDerivationNix, "/", staticBaseEnv), v);
-    addConstant("derivation", v);
+    addPrimOp("derivation", 0, [](EvalState & state, const PosIdx pos, Value * * args, Value & v) {
+        state.eval(state.parse(
+            #include "primops/derivation.nix.gen.hh"
+            , foFile, state.sDerivationNix, "/", state.staticBaseEnv), v);
+    });
 
     /* Now that we've added all primops, sort the `builtins' set,
        because attribute lookups expect it to be sorted. */
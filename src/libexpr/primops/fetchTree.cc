@@ -74,7 +74,7 @@ void addURI(EvalState &state, fetchers::Attrs &attrs, Symbol name, std::string v
 
 static void fetchTree(
     EvalState &state,
-    const Pos &pos,
+    const PosIdx pos,
     Value **args,
     Value &v,
     const std::optional<std::string> type,
@@ -97,7 +97,7 @@ static void fetchTree(
                     state,
                     attrs,
                     attr.name,
-                    state.coerceToString(*attr.pos, *attr.value, context, false, false)
+                    state.coerceToString(attr.pos, *attr.value, context, false, false)
                 );
             else if (attr.value->type() == nString)
                 addURI(state, attrs, attr.name, attr.value->string.s);
@@ -116,7 +116,7 @@ static void fetchTree(
         if (!attrs.count("type"))
             throw Error({
                 .msg = hintfmt("attribute 'type' is missing in call to 'fetchTree'"),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
 
         input = fetchers::Input::fromAttrs(std::move(attrs));
@@ -137,17 +137,19 @@ static void fetchTree(
         input = lookupInRegistries(state.store, input).first;
 
     if (evalSettings.pureEval && !input.isImmutable())
-        throw Error("in pure evaluation mode, 'fetchTree' requires an immutable input, at %s", pos);
+        throw Error("in pure evaluation mode, 'fetchTree' requires an immutable input, at %s", state.positions[pos]);
+
+    if (!input.isImmutable())
+        state.markUncacheable(fmt("fetching mutable input '%s'", input.to_string()));
 
     auto [tree, input2] = input.fetch(state.store);
 
-    if (state.allowedPaths)
-        state.allowedPaths->insert(tree.actualPath);
+    state.registerTree(tree);
 
     emitTreeAttrs(state, tree, input2, v, emptyRevFallback);
 }
 
-static void prim_fetchTree(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_fetchTree(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     settings.requireExperimentalFeature("flakes");
     fetchTree(state, pos, args, v, std::nullopt);
@@ -156,7 +158,7 @@ static void prim_fetchTree(EvalState & state, const Pos & pos, Value * * args, V
 // FIXME: document
 static RegisterPrimOp primop_fetchTree("fetchTree", 1, prim_fetchTree);
 
-static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
+static void fetch(EvalState & state, const PosIdx pos, Value * * args, Value & v,
     const string & who, bool unpack, std::string name)
 {
     std::optional<std::string> url;
@@ -171,22 +173,22 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
         for (auto & attr : *args[0]->attrs) {
             string n(attr.name);
             if (n == "url")
-                url = state.forceStringNoCtx(*attr.value, *attr.pos);
+                url = state.forceStringNoCtx(*attr.value, attr.pos);
             else if (n == "sha256")
-                expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, *attr.pos), htSHA256);
+                expectedHash = newHashAllowEmpty(state.forceStringNoCtx(*attr.value, attr.pos), htSHA256);
             else if (n == "name")
-                name = state.forceStringNoCtx(*attr.value, *attr.pos);
+                name = state.forceStringNoCtx(*attr.value, attr.pos);
             else
                 throw EvalError({
                     .msg = hintfmt("unsupported argument '%s' to '%s'", attr.name, who),
-                    .errPos = *attr.pos
+                    .errPos = state.positions[attr.pos]
                 });
             }
 
         if (!url)
             throw EvalError({
                 .msg = hintfmt("'url' argument required"),
-                .errPos = pos
+                .errPos = state.positions[pos]
             });
     } else
         url = state.forceStringNoCtx(*args[0], pos);
@@ -201,6 +203,9 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     if (evalSettings.pureEval && !expectedHash)
         throw Error("in pure evaluation mode, '%s' requires a 'sha256' argument", who);
 
+    if (!expectedHash)
+        state.markUncacheable(fmt("'%s' without a hash", who));
+
     auto storePath =
         unpack
         ? fetchers::downloadTarball(state.store, *url, name, (bool) expectedHash).first.storePath
@@ -223,7 +228,7 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     mkString(v, path, PathSet({path}));
 }
 
-static void prim_fetchurl(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_fetchurl(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     fetch(state, pos, args, v, "fetchurl", false, "");
 }
@@ -239,7 +244,7 @@ static RegisterPrimOp primop_fetchurl({
     .fun = prim_fetchurl,
 });
 
-static void prim_fetchTarball(EvalState & state, const Pos & pos, Value * * args, Value & v)
+static void prim_fetchTarball(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     fetch(state, pos, args, v, "fetchTarball", true, "source");
 }
@@ -290,7 +295,7 @@ static RegisterPrimOp primop_fetchTarball({
     .fun = prim_fetchTarball,
 });
 
-static void prim_fetchGit(EvalState &state, const Pos &pos, Value **args, Value &v)
+static void prim_fetchGit(EvalState &state, const PosIdx pos, Value **args, Value &v)
 {
     fetchTree(state, pos, args, v, "git", true);
 }
@@ -1,91 +1,675 @@
 #include "primops.hh"
 #include "eval-inline.hh"
 
-#include "../../cpptoml/cpptoml.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
 
 namespace nix {
 
-static void prim_fromTOML(EvalState & state, const Pos & pos, Value * * args, Value & v)
+/* A parser for TOML (https://toml.io/en/v1.0.0) that produces Nix
+   values as it goes. Scalars and inline arrays become Nix values
+   immediately, and strings without escape sequences are copied
+   straight from the input. Only the tables are kept in an
+   intermediate form until the end of the document, since TOML allows
+   adding keys to a table long after it was first mentioned (e.g. by
+   `[a.b]` after `[a]` and `[c]`). Dates and times are not supported,
+   since Nix has no type for them. */
+class TOMLParser
 {
-    using namespace cpptoml;
+    struct Table;
 
-    auto toml = state.forceStringNoCtx(*args[0], pos);
+    struct Entry
+    {
+        Symbol name;
 
-    std::istringstream tomlStream(toml);
+        enum { tValue, tTable, tArray } type;
 
-    std::function<void(Value &, std::shared_ptr<base>)> visit;
+        /* The value of a key, including inline tables. */
+        Value * value;
 
-    visit = [&](Value & v, std::shared_ptr<base> t) {
+        /* A table, or the index in 'arrays' of an array of tables. */
+        Table * table;
+        size_t array;
+    };
 
-        if (auto t2 = t->as_table()) {
+    struct Table
+    {
+        /* How the table was defined, which determines whether it may
+           be defined again or extended later on. */
+        enum Kind {
+            /* By a header like `[a]` or `[[a]]`. */
+            kHeader,
+            /* Only as a prefix of a header, like `a` in `[a.b]`. */
+            kImplicit,
+            /* By a dotted key, like `a` in `a.b = 1`. */
+            kDotted,
+            /* As an inline table `{ ... }`. */
+            kInline,
+        } kind;
 
-            size_t size = 0;
-            for (auto & i : *t2) { (void) i; size++; }
+        size_t depth;
 
-            state.mkAttrs(v, size);
+#if HAVE_BOEHMGC
+        std::vector<Entry, traceable_allocator<Entry>> entries;
+#else
+        std::vector<Entry> entries;
+#endif
 
-            for (auto & i : *t2) {
-                auto & v2 = *state.allocAttr(v, state.symbols.create(i.first));
+        /* An index of 'entries' in large tables, which are otherwise
+           searched linearly. */
+        std::unique_ptr<std::unordered_map<Symbol, size_t>> index;
 
-                if (auto i2 = i.second->as_table_array()) {
-                    size_t size2 = i2->get().size();
-                    state.mkList(v2, size2);
-                    for (size_t j = 0; j < size2; ++j)
-                        visit(*(v2.listElems()[j] = state.allocValue()), i2->get()[j]);
-                }
-                else
-                    visit(v2, i.second);
-            }
+        Table(Kind kind, size_t depth) : kind(kind), depth(depth) { }
+    };
+
+    static constexpr size_t indexThreshold = 16;
+
+    /* The limit on the nesting of tables and arrays, to fail cleanly
+       rather than overflowing the stack. */
+    static constexpr size_t maxDepth = 1024;
+
+    EvalState & state;
+    const PosIdx pos;
+
+    const char * const text, * const end;
+    const char * p;
+
+    std::deque<Table> tables;
+    std::vector<std::vector<Table *>> arrays;
+
+    Table & root;
+
+    /* The table that key/value pairs are added to, i.e. the one named
+       by the last header. */
+    Table * current;
+
+    /* Scratch space for keys, strings with escape sequences, numbers
+       and the elements of arrays being parsed. */
+    std::vector<Symbol> keys;
+    std::string buf;
+    ValueVector elems;
+
+public:
+
+    TOMLParser(EvalState & state, const PosIdx pos, std::string_view s)
+        : state(state), pos(pos), text(s.data()), end(s.data() + s.size()), p(text)
+        , root(tables.emplace_back(Table::kHeader, 0)), current(&root)
+    { }
+
+    void parse(Value & v);
+
+private:
+
+    [[noreturn]] void error(std::string_view msg)
+    {
+        auto line = 1 + std::count(text, p, '\n');
+        throw EvalError({
+            .msg = hintfmt("while parsing a TOML string: line %d: %s", line, msg),
+            .errPos = state.positions[pos]
+        });
+    }
+
+    bool at(char c) const { return p < end && *p == c; }
+
+    bool at(std::string_view s) const
+    {
+        return (size_t) (end - p) >= s.size() && memcmp(p, s.data(), s.size()) == 0;
+    }
 
-            v.attrs->sort();
+    void expect(char c, const char * what)
+    {
+        if (!at(c)) error(fmt("expected %s", what));
+        p++;
+    }
+
+    void skipSpace()
+    {
+        while (at(' ') || at('\t')) p++;
+    }
+
+    bool atNewline() const
+    {
+        return at('\n') || at("\r\n");
+    }
+
+    /* Skip whitespace, comments and newlines, as allowed in arrays. */
+    void skipSpaceAndComments()
+    {
+        while (true) {
+            skipSpace();
+            if (at('#')) skipComment();
+            if (at('\n')) p++;
+            else if (at("\r\n")) p += 2;
+            else break;
         }
+    }
+
+    void skipComment()
+    {
+        for (p++; p < end && *p != '\n'; p++)
+            if (*p == '\r' && !at("\r\n"))
+                error("control character in a comment");
+    }
+
+    void expectEndOfLine()
+    {
+        skipSpace();
+        if (at('#')) skipComment();
+        if (at('\n')) p++;
+        else if (at("\r\n")) p += 2;
+        else if (p != end) error("expected a newline");
+    }
+
+    static bool isBareKeyChar(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigit(c) || c == '_' || c == '-';
+    }
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
 
-        else if (auto t2 = t->as_array()) {
-            size_t size = t2->get().size();
+    static bool isHexDigit(char c) { return isxdigit((unsigned char) c); }
 
-            state.mkList(v, size);
+    void parseKey();
+    std::string_view parseBasicString(bool multiLine);
+    std::string_view parseLiteralString(bool multiLine);
+    void parseEscape(bool multiLine);
+    Value * parseValue(size_t depth);
+    Value * parseNumber();
+    void parseKeyValue(Table & table);
 
-            for (size_t i = 0; i < size; ++i)
-                visit(*(v.listElems()[i] = state.allocValue()), t2->get()[i]);
+    Entry * find(Table & table, Symbol name);
+    void add(Table & table, const Entry & entry);
+    Table & addTable(Table & table, Symbol name, Table::Kind kind);
+    Table & dottedTable(Table & table, Symbol name);
+    Table & implicitTable(Table & table, Symbol name);
+    void openTable();
+    void openArrayOfTables();
+
+    void toValue(Table & table, Value & v);
+};
+
+void TOMLParser::parse(Value & v)
+{
+    while (true) {
+        skipSpace();
+        if (p == end) break;
+        if (at('[')) {
+            if (at("[[")) {
+                p += 2;
+                parseKey();
+                if (!at("]]")) error("expected ']]'");
+                p += 2;
+                openArrayOfTables();
+            } else {
+                p++;
+                parseKey();
+                expect(']', "']'");
+                openTable();
+            }
         }
+        else if (!at('#') && !atNewline())
+            parseKeyValue(*current);
+        expectEndOfLine();
+    }
 
-        // Handle cases like 'a = [[{ a = true }]]', which IMHO should be
-        // parsed as a array containing an array containing a table,
-        // but instead are parsed as an array containing a table array
-        // containing a table.
-        else if (auto t2 = t->as_table_array()) {
-            size_t size = t2->get().size();
+    toValue(root, v);
+}
+
+/* Parse a possibly dotted key into 'keys'. */
+void TOMLParser::parseKey()
+{
+    keys.clear();
+    while (true) {
+        skipSpace();
+        if (keys.size() >= maxDepth)
+            error("key has too many components");
+        if (at('"'))
+            p++, keys.push_back(state.symbols.create(parseBasicString(false)));
+        else if (at('\''))
+            p++, keys.push_back(state.symbols.create(parseLiteralString(false)));
+        else {
+            auto start = p;
+            while (p < end && isBareKeyChar(*p)) p++;
+            if (p == start) error("expected a key");
+            keys.push_back(state.symbols.create(std::string_view(start, p - start)));
+        }
+        skipSpace();
+        if (!at('.')) break;
+        p++;
+    }
+}
+
+/* Parse a string after its opening quote(s). The result points into
+   the input unless the string contains escape sequences, in which
+   case it points to 'buf'. */
+std::string_view TOMLParser::parseBasicString(bool multiLine)
+{
+    if (multiLine) {
+        if (at('\n')) p++;
+        else if (at("\r\n")) p += 2;
+    }
+
+    bool copied = false;
+    buf.clear();
+    auto start = p;
+
+    while (true) {
+        if (p == end) error("unterminated string");
+        char c = *p;
+        if (c == '"') {
+            size_t quotes = 1;
+            if (multiLine) {
+                while (p + quotes < end && p[quotes] == '"') quotes++;
+                if (quotes < 3) { p += quotes; continue; }
+                if (quotes > 5) error("too many quotes at the end of a string");
+            }
+            /* Up to two quotes before the closing ones belong to the
+               string. */
+            auto contentEnd = p + quotes - (multiLine ? 3 : 1);
+            p += quotes;
+            if (!copied) return std::string_view(start, contentEnd - start);
+            buf.append(start, contentEnd);
+            return buf;
+        }
+        else if (c == '\\') {
+            buf.append(start, p);
+            copied = true;
+            p++;
+            parseEscape(multiLine);
+            start = p;
+        }
+        else if ((unsigned char) c < 0x20 || c == 0x7f) {
+            if (c == '\t' || (multiLine && atNewline()))
+                p += c == '\r' ? 2 : 1;
+            else
+                error(c == '\n' || c == '\r' ? "unterminated string" : "control character in a string");
+        }
+        else
+            p++;
+    }
+}
 
-            state.mkList(v, size);
+/* Parse an escape sequence after the backslash, appending the result
+   to 'buf'. */
+void TOMLParser::parseEscape(bool multiLine)
+{
+    if (p == end) error("unterminated string");
 
-            for (size_t j = 0; j < size; ++j)
-                visit(*(v.listElems()[j] = state.allocValue()), t2->get()[j]);
+    char c = *p++;
+    switch (c) {
+        case 'b': buf += '\b'; return;
+        case 't': buf += '\t'; return;
+        case 'n': buf += '\n'; return;
+        case 'f': buf += '\f'; return;
+        case 'r': buf += '\r'; return;
+        case '"': buf += '"'; return;
+        case '\\': buf += '\\'; return;
+        case 'u':
+        case 'U': {
+            size_t len = c == 'u' ? 4 : 8;
+            uint32_t code = 0;
+            for (size_t n = 0; n < len; ++n, ++p) {
+                if (p == end || !isxdigit((unsigned char) *p))
+                    error("invalid Unicode escape sequence");
+                code = code * 16 + (isdigit((unsigned char) *p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+            }
+            if (code > 0x10ffff || (code >= 0xd800 && code < 0xe000))
+                error("invalid Unicode escape sequence");
+            if (code < 0x80)
+                buf += (char) code;
+            else if (code < 0x800) {
+                buf += (char) (0xc0 | (code >> 6));
+                buf += (char) (0x80 | (code & 0x3f));
+            } else if (code < 0x10000) {
+                buf += (char) (0xe0 | (code >> 12));
+                buf += (char) (0x80 | ((code >> 6) & 0x3f));
+                buf += (char) (0x80 | (code & 0x3f));
+            } else {
+                buf += (char) (0xf0 | (code >> 18));
+                buf += (char) (0x80 | ((code >> 12) & 0x3f));
+                buf += (char) (0x80 | ((code >> 6) & 0x3f));
+                buf += (char) (0x80 | (code & 0x3f));
+            }
+            return;
         }
+        default:
+            /* A backslash at the end of a line in a multi-line string
+               removes the newline and any whitespace that follows. */
+            if (multiLine) {
+                p--;
+                skipSpace();
+                if (atNewline()) {
+                    while (at(' ') || at('\t') || at('\n') || at("\r\n"))
+                        p += at('\r') ? 2 : 1;
+                    return;
+                }
+            }
+            error("invalid escape sequence");
+    }
+}
+
+/* Parse a literal string after its opening quote(s). It is always
+   copied straight from the input, since it has no escape sequences. */
+std::string_view TOMLParser::parseLiteralString(bool multiLine)
+{
+    if (multiLine) {
+        if (at('\n')) p++;
+        else if (at("\r\n")) p += 2;
+    }
+
+    auto start = p;
 
-        else if (t->is_value()) {
-            if (auto val = t->as<int64_t>())
-                mkInt(v, val->get());
-            else if (auto val = t->as<NixFloat>())
-                mkFloat(v, val->get());
-            else if (auto val = t->as<bool>())
-                mkBool(v, val->get());
-            else if (auto val = t->as<std::string>())
-                mkString(v, val->get());
+    while (true) {
+        if (p == end) error("unterminated string");
+        char c = *p;
+        if (c == '\'') {
+            size_t quotes = 1;
+            if (multiLine) {
+                while (p + quotes < end && p[quotes] == '\'') quotes++;
+                if (quotes < 3) { p += quotes; continue; }
+                if (quotes > 5) error("too many quotes at the end of a string");
+            }
+            auto contentEnd = p + quotes - (multiLine ? 3 : 1);
+            p += quotes;
+            return std::string_view(start, contentEnd - start);
+        }
+        else if ((unsigned char) c < 0x20 || c == 0x7f) {
+            if (c == '\t' || (multiLine && atNewline()))
+                p += c == '\r' ? 2 : 1;
             else
-                throw EvalError("unsupported value type in TOML");
+                error(c == '\n' || c == '\r' ? "unterminated string" : "control character in a string");
         }
+        else
+            p++;
+    }
+}
 
-        else abort();
+Value * TOMLParser::parseValue(size_t depth)
+{
+    if (depth >= maxDepth) error("value is nested too deeply");
+
+    if (at('"') || at('\'')) {
+        bool basic = at('"');
+        bool multiLine = at(basic ? "\"\"\"" : "'''");
+        p += multiLine ? 3 : 1;
+        auto s = basic ? parseBasicString(multiLine) : parseLiteralString(multiLine);
+        auto v = state.allocValue();
+        mkString(*v, s);
+        return v;
+    }
+
+    if (at('[')) {
+        p++;
+        /* The elements of nested arrays are kept on the same stack. */
+        auto start = elems.size();
+        while (true) {
+            skipSpaceAndComments();
+            if (at(']')) break;
+            elems.push_back(parseValue(depth + 1));
+            skipSpaceAndComments();
+            if (!at(',')) break;
+            p++;
+        }
+        expect(']', "',' or ']'");
+        auto v = state.allocValue();
+        state.mkList(*v, elems.size() - start);
+        std::copy(elems.begin() + start, elems.end(), v->listElems());
+        elems.resize(start);
+        return v;
+    }
+
+    if (at('{')) {
+        p++;
+        auto & table = tables.emplace_back(Table::kInline, depth + 1);
+        skipSpace();
+        if (!at('}'))
+            while (true) {
+                parseKeyValue(table);
+                skipSpace();
+                if (!at(',')) break;
+                p++;
+            }
+        expect('}', "',' or '}'");
+        auto v = state.allocValue();
+        toValue(table, *v);
+        return v;
+    }
+
+    for (auto b : {false, true}) {
+        std::string_view s = b ? "true" : "false";
+        if (at(s)) {
+            p += s.size();
+            auto v = state.allocValue();
+            v->mkBool(b);
+            return v;
+        }
+    }
+
+    return parseNumber();
+}
+
+Value * TOMLParser::parseNumber()
+{
+    auto v = state.allocValue();
+
+    buf.clear();
+    if (at('+') || at('-')) buf += *p++;
+
+    for (auto s : {"inf", "nan"})
+        if (at(s)) {
+            p += 3;
+            auto n = s[0] == 'i' ? std::numeric_limits<NixFloat>::infinity() : std::numeric_limits<NixFloat>::quiet_NaN();
+            v->mkFloat(buf == "-" ? -n : n);
+            return v;
+        }
+
+    /* Copy the digits to 'buf', checking that underscores only occur
+       between digits. */
+    auto digits = [&](bool (* isDigit)(char)) {
+        if (p == end || !isDigit(*p))
+            error("expected a value");
+        while (true) {
+            buf += *p++;
+            if (at('_')) {
+                p++;
+                if (p == end || !isDigit(*p))
+                    error("'_' must be between two digits");
+            } else if (p == end || !isDigit(*p))
+                break;
+        }
     };
 
-    try {
-        visit(v, parser(tomlStream).parse());
-    } catch (std::runtime_error & e) {
-        throw EvalError({
-            .msg = hintfmt("while parsing a TOML string: %s", e.what()),
-            .errPos = pos
-        });
+    if (buf.empty() && (at("0x") || at("0o") || at("0b"))) {
+        int base = p[1] == 'x' ? 16 : p[1] == 'o' ? 8 : 2;
+        p += 2;
+        digits(base == 16 ? isHexDigit : isDigit);
+        if (base < 10)
+            for (auto c : buf)
+                if (c - '0' >= base) error("invalid digit in an integer");
+        errno = 0;
+        auto n = strtoull(buf.c_str(), nullptr, base);
+        if (errno == ERANGE || n > (unsigned long long) std::numeric_limits<NixInt>::max())
+            error("integer is out of range");
+        v->mkInt(n);
+        return v;
+    }
+
+    auto run = std::find_if_not(p, end, isDigit) - p;
+    if (buf.empty() && ((run == 4 && p[4] == '-') || (run == 2 && p[2] == ':')))
+        error("dates and times are not supported");
+
+    auto intStart = buf.size();
+    digits(isDigit);
+    if (buf[intStart] == '0' && buf.size() > intStart + 1)
+        error("leading zeros are not allowed");
+
+    bool isFloat = false;
+    if (at('.')) {
+        buf += *p++;
+        digits(isDigit);
+        isFloat = true;
     }
+    if (at('e') || at('E')) {
+        buf += *p++;
+        if (at('+') || at('-')) buf += *p++;
+        digits(isDigit);
+        isFloat = true;
+    }
+
+    if (isFloat)
+        v->mkFloat(strtod(buf.c_str(), nullptr));
+    else {
+        errno = 0;
+        auto n = strtoll(buf.c_str(), nullptr, 10);
+        if (errno == ERANGE) error("integer is out of range");
+        v->mkInt(n);
+    }
+    return v;
+}
+
+void TOMLParser::parseKeyValue(Table & table)
+{
+    parseKey();
+    skipSpace();
+    expect('=', "'='");
+    skipSpace();
+
+    auto t = &table;
+    for (size_t n = 0; n + 1 < keys.size(); ++n)
+        t = &dottedTable(*t, keys[n]);
+
+    auto name = keys.back();
+    if (find(*t, name))
+        error(fmt("duplicate key '%s'", name));
+
+    /* Note that parsing an inline table clobbers 'keys'. */
+    auto v = parseValue(t->depth + 1);
+    add(*t, Entry{name, Entry::tValue, v, nullptr, 0});
+}
+
+TOMLParser::Entry * TOMLParser::find(Table & table, Symbol name)
+{
+    if (table.index) {
+        auto i = table.index->find(name);
+        return i == table.index->end() ? nullptr : &table.entries[i->second];
+    }
+    for (auto & e : table.entries)
+        if (e.name == name) return &e;
+    return nullptr;
+}
+
+void TOMLParser::add(Table & table, const Entry & entry)
+{
+    table.entries.push_back(entry);
+    if (table.index)
+        table.index->emplace(entry.name, table.entries.size() - 1);
+    else if (table.entries.size() >= indexThreshold) {
+        table.index = std::make_unique<std::unordered_map<Symbol, size_t>>();
+        for (size_t n = 0; n < table.entries.size(); ++n)
+            table.index->emplace(table.entries[n].name, n);
+    }
+}
+
+TOMLParser::Table & TOMLParser::addTable(Table & table, Symbol name, Table::Kind kind)
+{
+    if (table.depth + 1 >= maxDepth) error("table is nested too deeply");
+    auto & t = tables.emplace_back(kind, table.depth + 1);
+    add(table, Entry{name, Entry::tTable, nullptr, &t, 0});
+    return t;
+}
+
+/* Return the table named by a component of a dotted key, which may
+   only extend tables defined by other dotted keys. */
+TOMLParser::Table & TOMLParser::dottedTable(Table & table, Symbol name)
+{
+    auto e = find(table, name);
+    if (!e) return addTable(table, name, Table::kDotted);
+    if (e->type != Entry::tTable || e->table->kind == Table::kHeader)
+        error(fmt("cannot add keys to '%s' using a dotted key", name));
+    return *e->table;
+}
+
+/* Return the table named by a component of a header other than the
+   last one. For an array of tables, this is its last table. */
+TOMLParser::Table & TOMLParser::implicitTable(Table & table, Symbol name)
+{
+    auto e = find(table, name);
+    if (!e) return addTable(table, name, Table::kImplicit);
+    if (e->type == Entry::tTable) return *e->table;
+    if (e->type == Entry::tArray) return *arrays[e->array].back();
+    error(fmt("key '%s' is not a table", name));
+}
+
+void TOMLParser::openTable()
+{
+    auto t = &root;
+    for (size_t n = 0; n + 1 < keys.size(); ++n)
+        t = &implicitTable(*t, keys[n]);
+
+    auto name = keys.back();
+    auto e = find(*t, name);
+    if (!e)
+        current = &addTable(*t, name, Table::kHeader);
+    else if (e->type == Entry::tTable && e->table->kind == Table::kImplicit) {
+        e->table->kind = Table::kHeader;
+        current = e->table;
+    } else
+        error(fmt("table '%s' is defined more than once", name));
+}
+
+void TOMLParser::openArrayOfTables()
+{
+    auto t = &root;
+    for (size_t n = 0; n + 1 < keys.size(); ++n)
+        t = &implicitTable(*t, keys[n]);
+
+    auto name = keys.back();
+    auto e = find(*t, name);
+    if (!e) {
+        arrays.emplace_back();
+        add(*t, Entry{name, Entry::tArray, nullptr, nullptr, arrays.size() - 1});
+        e = &t->entries.back();
+    } else if (e->type != Entry::tArray)
+        error(fmt("key '%s' is not an array of tables", name));
+
+    if (t->depth + 1 >= maxDepth) error("table is nested too deeply");
+    current = &tables.emplace_back(Table::kHeader, t->depth + 1);
+    arrays[e->array].push_back(current);
+}
+
+void TOMLParser::toValue(Table & table, Value & v)
+{
+    state.mkAttrs(v, table.entries.size());
+
+    for (auto & e : table.entries) {
+        auto v2 = e.value;
+        if (e.type == Entry::tTable)
+            toValue(*e.table, *(v2 = state.allocValue()));
+        else if (e.type == Entry::tArray) {
+            auto & array = arrays[e.array];
+            state.mkList(*(v2 = state.allocValue()), array.size());
+            for (size_t n = 0; n < array.size(); ++n)
+                toValue(*array[n], *(v2->listElems()[n] = state.allocValue()));
+        }
+        v.attrs->push_back(Attr(e.name, v2));
+    }
+
+    v.attrs->sort();
+
+    /* The entries are no longer needed, e.g. for a converted inline
+       table. */
+    table.entries = {};
+    table.index.reset();
+}
+
+static void prim_fromTOML(EvalState & state, const PosIdx pos, Value * * args, Value & v)
+{
+    auto toml = state.forceStringNoCtx(*args[0], pos);
+
+    TOMLParser(state, pos, toml).parse(v);
 }
 
 static RegisterPrimOp primop_fromTOML("fromTOML", 1, prim_fromTOML);
@@ -0,0 +1,469 @@
+#include "source-cache.hh"
+#include "parse-cache.hh"
+#include "eval-inline.hh"
+#include "store-api.hh"
+#include "finally.hh"
+
+namespace nix {
+
+
+/* Bump this whenever the format of cache entries or the hashing of
+   functions changes. */
+static const std::string sourceCacheMagic = "nix-source-cache-1";
+
+
+namespace {
+
+/* A variable that a function refers to but doesn't bind, found
+   'up' environments above the function's closure. If it's only used
+   to select an attribute path (e.g. `lib.hasSuffix'), only that
+   attribute is relevant. */
+struct FreeVar
+{
+    ExprVar * var;
+    unsigned int up;
+    std::vector<Symbol> attrPath;
+};
+
+/* Find the free variables of 'e', which is evaluated 'depth'
+   environments below the closure of the function being hashed.
+   Returns false if 'e' uses constructs whose meaning depends on more
+   than its variables, like `with'. */
+bool findFreeVars(Expr * e, unsigned int depth, std::vector<FreeVar> & vars);
+
+bool findFreeVars(const AttrPath & attrPath, unsigned int depth, std::vector<FreeVar> & vars)
+{
+    for (auto & i : attrPath)
+        if (!i.symbol.set() && !findFreeVars(i.expr, depth, vars)) return false;
+    return true;
+}
+
+template<class T>
+std::optional<bool> findFreeVarsBinOp(Expr * e, unsigned int depth, std::vector<FreeVar> & vars)
+{
+    auto e2 = dynamic_cast<T *>(e);
+    if (!e2) return {};
+    return findFreeVars(e2->e1, depth, vars) && findFreeVars(e2->e2, depth, vars);
+}
+
+bool findFreeVars(Expr * e, unsigned int depth, std::vector<FreeVar> & vars)
+{
+    if (!e) return true;
+
+    if (dynamic_cast<ExprInt *>(e) || dynamic_cast<ExprFloat *>(e)
+        || dynamic_cast<ExprString *>(e) || dynamic_cast<ExprPath *>(e)
+        || dynamic_cast<ExprPos *>(e))
+        return true;
+
+    if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+        if (e2->fromWith) return false;
+        if (e2->level >= depth)
+            vars.push_back({e2, e2->level - depth, {}});
+        return true;
+    }
+
+    if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+        auto var = dynamic_cast<ExprVar *>(e2->e);
+        if (var && !var->fromWith && var->level >= depth
+            && std::all_of(e2->attrPath.begin(), e2->attrPath.end(),
+                [](const AttrName & i) { return i.symbol.set(); }))
+        {
+            FreeVar fv{var, var->level - depth, {}};
+            for (auto & i : e2->attrPath)
+                fv.attrPath.push_back(i.symbol);
+            vars.push_back(std::move(fv));
+        } else if (!findFreeVars(e2->e, depth, vars) || !findFreeVars(e2->attrPath, depth, vars))
+            return false;
+        return findFreeVars(e2->def, depth, vars);
+    }
+
+    if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e))
+        return findFreeVars(e2->e, depth, vars) && findFreeVars(e2->attrPath, depth, vars);
+
+    if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+        /* See ExprAttrs::bindVars(). */
+        auto inner = e2->recursive ? depth + 1 : depth;
+        for (auto & i : e2->attrs)
+            if (!findFreeVars(i.second.e, i.second.inherited ? depth : inner, vars)) return false;
+        for (auto & i : e2->dynamicAttrs)
+            if (!findFreeVars(i.nameExpr, inner, vars) || !findFreeVars(i.valueExpr, inner, vars)) return false;
+        return true;
+    }
+
+    if (auto e2 = dynamic_cast<ExprList *>(e)) {
+        for (auto & i : e2->elems)
+            if (!findFreeVars(i, depth, vars)) return false;
+        return true;
+    }
+
+    if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+        if (e2->formals)
+            for (auto & i : e2->formals->formals)
+                if (!findFreeVars(i.def, depth + 1, vars)) return false;
+        return findFreeVars(e2->body, depth + 1, vars);
+    }
+
+    if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+        for (auto & i : e2->attrs->attrs)
+            if (!findFreeVars(i.second.e, i.second.inherited ? depth : depth + 1, vars)) return false;
+        return findFreeVars(e2->body, depth + 1, vars);
+    }
+
+    if (auto e2 = dynamic_cast<ExprIf *>(e))
+        return findFreeVars(e2->cond, depth, vars)
+            && findFreeVars(e2->then, depth, vars)
+            && findFreeVars(e2->else_, depth, vars);
+
+    if (auto e2 = dynamic_cast<ExprAssert *>(e))
+        return findFreeVars(e2->cond, depth, vars) && findFreeVars(e2->body, depth, vars);
+
+    if (auto e2 = dynamic_cast<ExprOpNot *>(e))
+        return findFreeVars(e2->e, depth, vars);
+
+    if (auto e2 = dynamic_cast<ExprApp *>(e))
+        return findFreeVars(e2->e1, depth, vars) && findFreeVars(e2->e2, depth, vars);
+
+    if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        for (auto & i : *e2->es)
+            if (!findFreeVars(i, depth, vars)) return false;
+        return true;
+    }
+
+    for (auto res : {
+        findFreeVarsBinOp<ExprOpEq>(e, depth, vars),
+        findFreeVarsBinOp<ExprOpNEq>(e, depth, vars),
+        findFreeVarsBinOp<ExprOpAnd>(e, depth, vars),
+        findFreeVarsBinOp<ExprOpOr>(e, depth, vars),
+        findFreeVarsBinOp<ExprOpImpl>(e, depth, vars),
+        findFreeVarsBinOp<ExprOpUpdate>(e, depth, vars),
+        findFreeVarsBinOp<ExprOpConcatLists>(e, depth, vars)})
+        if (res) return *res;
+
+    /* `with' and anything unknown. */
+    return false;
+}
+
+
+/* Primops whose result depends on more than their arguments. */
+static const std::set<std::string> impurePrimOps = {
+    "import", "scopedImport", "readFile", "readDir", "pathExists",
+    "hashFile", "getEnv", "findFile", "filterSource", "path",
+    "storePath", "fetchurl", "fetchTarball", "fetchGit",
+    "fetchMercurial", "fetchTree", "getFlake", "unsafeGetAttrPos",
+    "exec", "importNative",
+};
+
+
+struct FunctionHasher
+{
+    EvalState & state;
+    HashSink sink{htSHA256};
+
+    /* The number of values that may still be hashed. Functions
+       referring to large values (like all of Nixpkgs) are not worth
+       hashing. */
+    size_t budget = 1 << 16;
+
+    /* The values currently being hashed. A reference to one of them
+       (e.g. from a recursive function to itself) is written as its
+       index, so cyclic values are hashed unambiguously. */
+    std::vector<const Value *> active;
+
+    FunctionHasher(EvalState & state) : state(state) { }
+
+    bool hashValue(Value & v);
+    bool hashLambda(Value & v);
+};
+
+
+bool FunctionHasher::hashValue(Value & v)
+{
+    if (!budget) return false;
+    budget--;
+
+    try {
+        state.forceValue(v);
+    } catch (Error &) {
+        return false;
+    }
+
+    auto i = std::find(active.begin(), active.end(), &v);
+    if (i != active.end()) {
+        sink << "ref" << (uint64_t) (i - active.begin());
+        return true;
+    }
+
+    active.push_back(&v);
+    Finally popActive([&]() { active.pop_back(); });
+
+    switch (v.type()) {
+
+    case nInt:
+        sink << "int" << (uint64_t) v.integer;
+        return true;
+
+    case nFloat: {
+        uint64_t n;
+        static_assert(sizeof(n) == sizeof(v.fpoint));
+        memcpy(&n, &v.fpoint, sizeof(n));
+        sink << "float" << n;
+        return true;
+    }
+
+    case nBool:
+        sink << "bool" << v.boolean;
+        return true;
+
+    case nNull:
+        sink << "null";
+        return true;
+
+    case nString:
+        sink << "string" << v.string.s;
+        if (v.string.context)
+            for (auto p = v.string.context; *p; ++p)
+                sink << *p;
+        sink << "";
+        return true;
+
+    case nPath:
+        sink << "path" << v.path;
+        return true;
+
+    case nAttrs:
+        sink << "attrs" << v.attrs->size();
+        for (auto & i : v.attrs->lexicographicOrder()) {
+            sink << (const std::string &) i->name;
+            if (!hashValue(*i->value)) return false;
+        }
+        return true;
+
+    case nList:
+        sink << "list" << v.listSize();
+        for (size_t n = 0; n < v.listSize(); ++n)
+            if (!hashValue(*v.listElems()[n])) return false;
+        return true;
+
+    case nFunction:
+        if (v.isLambda())
+            return hashLambda(v);
+        if (v.isPrimOp()) {
+            auto & name = (const std::string &) v.primOp->name;
+            if (impurePrimOps.count(name)) return false;
+            sink << "primop" << name;
+            return true;
+        }
+        if (v.isPrimOpApp()) {
+            sink << "primop-app";
+            return hashValue(*v.primOpApp.left) && hashValue(*v.primOpApp.right);
+        }
+        return false;
+
+    default:
+        return false;
+    }
+}
+
+
+bool FunctionHasher::hashLambda(Value & v)
+{
+    auto fun = v.lambda.fun;
+
+    std::vector<FreeVar> vars;
+    if (!findFreeVars(fun, 0, vars)) return false;
+
+    /* The serialised parse tree includes positions, so editing the
+       file that defines the function also changes its hash. */
+    sink << "lambda" << serialiseExpr(state.positions, fun) << vars.size();
+
+    for (auto & fv : vars) {
+        auto env = v.lambda.env;
+        for (auto n = fv.up; n; --n) env = env->up;
+        auto value = env->values[fv.var->displ];
+
+        sink << (const std::string &) fv.var->name << fv.up << fv.var->displ << fv.attrPath.size();
+
+        /* Select the attribute path as ExprSelect::eval() would,
+           writing a marker if it doesn't exist. */
+        for (auto & name : fv.attrPath) {
+            sink << (const std::string &) name;
+            if (!budget) return false;
+            budget--;
+            try {
+                state.forceValue(*value);
+            } catch (Error &) {
+                return false;
+            }
+            if (value->type() != nAttrs) return false;
+            auto j = value->attrs->find(name);
+            if (j == value->attrs->end()) {
+                value = nullptr;
+                break;
+            }
+            value = j->value;
+        }
+
+        if (!value)
+            sink << "missing";
+        else if (!hashValue(*value))
+            return false;
+    }
+
+    return true;
+}
+
+}
+
+
+std::optional<Hash> hashFunction(EvalState & state, Value & v)
+{
+    FunctionHasher hasher(state);
+    if (!hasher.hashValue(v)) return {};
+    return hasher.sink.finish().first;
+}
+
+
+SourceCache::SourceCache(EvalState & state, const Path & path, std::string_view name,
+    FileIngestionMethod method, Value * filter)
+    : state(state)
+    , path(path)
+    , startTime(time(0))
+{
+    std::string filterHash = "none";
+    if (filter) {
+        auto h = hashFunction(state, *filter);
+        if (!h) {
+            debug("not caching '%s' because its filter can't be hashed", path);
+            return;
+        }
+        filterHash = h->to_string(Base32, false);
+    }
+
+    auto key = hashString(htSHA256,
+        sourceCacheMagic + '\0' + state.store->getUri() + '\0' + path + '\0'
+        + std::string(name) + '\0'
+        + (method == FileIngestionMethod::Recursive ? "r" : "f") + '\0'
+        + filterHash);
+    cachePath = getCacheDir() + "/nix/source-cache/" + key.to_string(Base32, false);
+}
+
+
+std::optional<StorePath> SourceCache::lookup()
+{
+    if (!cachePath) return {};
+
+    try {
+        if (!pathExists(*cachePath)) return {};
+
+        auto data = readFile(*cachePath);
+        StringSource source(data);
+
+        if (readString(source) != sourceCacheMagic)
+            throw Error("unsupported cache entry");
+
+        auto storePath = state.store->parseStorePath(readString(source));
+
+        auto count = readNum<uint64_t>(source);
+        for (uint64_t n = 0; n < count; ++n) {
+            auto name = readString(source);
+            auto included = readNum<uint64_t>(source);
+            auto mode = readNum<uint64_t>(source);
+            auto ino = readNum<uint64_t>(source);
+            auto size = readNum<uint64_t>(source);
+            auto mtime = readNum<uint64_t>(source);
+            auto ctime = readNum<uint64_t>(source);
+
+            /* The filter's decision only depends on the path and the
+               file type. Files that are included must not have
+               changed at all. Since adding or removing a file
+               changes the directory's modification time, this also
+               detects new files. */
+            auto p = name.empty() ? path : path + "/" + name;
+            struct stat st;
+            if (lstat(p.c_str(), &st) == -1
+                || (st.st_mode & S_IFMT) != (mode & S_IFMT)
+                || (included
+                    && (st.st_mode != mode
+                        || (uint64_t) st.st_ino != ino
+                        || (uint64_t) st.st_size != size
+                        || (uint64_t) st.st_mtime != mtime
+                        || (uint64_t) st.st_ctime != ctime)))
+            {
+                debug("source cache entry for '%s' is stale because '%s' has changed", path, p);
+                return {};
+            }
+        }
+
+        state.store->addTempRoot(storePath);
+        if (!state.store->isValidPath(storePath)) {
+            debug("ignoring source cache entry for '%s' because '%s' has disappeared",
+                path, state.store->printStorePath(storePath));
+            return {};
+        }
+
+        debug("using source cache entry for '%s'", path);
+        return storePath;
+    } catch (Error & e) {
+        debug("ignoring source cache entry '%s': %s", *cachePath, e.msg());
+        return {};
+    }
+}
+
+
+void SourceCache::addFile(const Path & p, bool included)
+{
+    File file;
+    file.name = p == path ? "" : p.substr(path.size() + 1);
+    file.included = included;
+    if (lstat(p.c_str(), &file.st) == -1
+        /* A file that was changed in the current second could be
+           changed again without changing its timestamps. */
+        || file.st.st_mtime >= startTime
+        || file.st.st_ctime >= startTime)
+        cacheable = false;
+    files.push_back(std::move(file));
+}
+
+
+PathFilter SourceCache::record(PathFilter & filter)
+{
+    if (!cachePath) return filter;
+
+    /* The filter isn't called on the top-level path. */
+    addFile(path, true);
+
+    return [this, &filter](const Path & p) {
+        auto included = filter(p);
+        if (hasPrefix(p, path + "/"))
+            addFile(p, included);
+        else
+            cacheable = false;
+        return included;
+    };
+}
+
+
+void SourceCache::store(const StorePath & storePath)
+{
+    if (!cachePath || !cacheable) return;
+
+    try {
+        StringSink sink;
+        sink << sourceCacheMagic << state.store->printStorePath(storePath) << files.size();
+        for (auto & file : files)
+            sink << file.name << file.included << file.st.st_mode << file.st.st_ino
+                 << file.st.st_size << file.st.st_mtime << file.st.st_ctime;
+
+        createDirs(dirOf(*cachePath));
+        auto tmpPath = fmt("%s.tmp-%d", *cachePath, getpid());
+        writeFile(tmpPath, *sink.s);
+        if (rename(tmpPath.c_str(), cachePath->c_str()) == -1) {
+            deletePath(tmpPath);
+            throw SysError("renaming '%s' to '%s'", tmpPath, *cachePath);
+        }
+    } catch (Error & e) {
+        debug("cannot write source cache entry '%s': %s", *cachePath, e.msg());
+    }
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "eval.hh"
+#include "content-address.hh"
+
+namespace nix {
+
+/* Return a hash that is only equal for two functions if they return
+   the same result for the same arguments. It covers the function's
+   code and the values of the variables it refers to. Returns nothing
+   if the function's behaviour can't be captured this way, e.g.
+   because it may read files or the environment, or because it refers
+   to too many values. The referenced values are forced, so this may
+   evaluate parts of the function's closure. */
+std::optional<Hash> hashFunction(EvalState & state, Value & v);
+
+
+/* A persistent cache of the store paths produced by `builtins.path`
+   and `builtins.filterSource`, used by addPath() when the
+   `source-cache` setting is enabled. An entry is keyed by the source
+   path, the name and ingestion method, and the hash of the filter
+   function (see hashFunction()), and records the metadata of every
+   file that the filter was called on. The entry is used if none of
+   those files has changed, without calling the filter or reading the
+   files. */
+class SourceCache
+{
+public:
+
+    /* Prepare the cache entry for adding 'path' to the store with
+       the given name, method and filter ('filter' may be null). If
+       the filter can't be hashed, the cache is not used. */
+    SourceCache(EvalState & state, const Path & path, std::string_view name,
+        FileIngestionMethod method, Value * filter);
+
+    /* Return the cached store path, if there is an entry for the
+       source, none of its files have changed and the store path is
+       still valid. */
+    std::optional<StorePath> lookup();
+
+    /* Return a filter that calls 'filter' and records the metadata
+       of the files it is called on. */
+    PathFilter record(PathFilter & filter);
+
+    /* Write the entry, if the files recorded by the filter returned
+       by record() can be cached. Errors are ignored, since the cache
+       is only an optimisation. */
+    void store(const StorePath & storePath);
+
+private:
+
+    struct File
+    {
+        std::string name;
+        bool included;
+        struct stat st;
+    };
+
+    EvalState & state;
+    Path path;
+    std::optional<Path> cachePath;
+    std::vector<File> files;
+    time_t startTime;
+    bool cacheable = true;
+
+    void addFile(const Path & p, bool included);
+};
+
+}
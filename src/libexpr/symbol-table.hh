@@ -1,7 +1,10 @@
 #pragma once
 
+#include <deque>
 #include <map>
-#include <unordered_set>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 
 #include "types.hh"
 
@@ -11,7 +14,12 @@ namespace nix {
    up identifiers and attributes efficiently.  SymbolTable::create()
    converts a string into a symbol.  Symbols have the property that
    they can be compared efficiently (using a pointer equality test),
-   because the symbol table stores only one copy of each string. */
+   because the symbol table stores only one copy of each string.
+
+   The symbol table may be shared between threads (e.g. by evaluator
+   threads forcing independent thunks), so all access to the
+   underlying set is synchronised. Symbols themselves are immutable
+   once created and can be used freely without locking. */
 
 class Symbol
 {
@@ -64,36 +72,76 @@ public:
         return s->empty();
     }
 
+    /* Hash the identity of the symbol (not its contents).  This is
+       cheap since equal symbols are the same pointer. */
+    size_t hash() const
+    {
+        return std::hash<const string *>()(s);
+    }
+
     friend std::ostream & operator << (std::ostream & str, const Symbol & sym);
 };
 
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
-    Symbols symbols;
+    /* The interned strings. A deque never moves its elements, so
+       pointers into it (i.e. Symbols) stay valid as the table grows,
+       and most identifiers fit in std::string's inline buffer so they
+       don't need a separate heap allocation. */
+    typedef std::deque<string> Store;
+
+    /* Index from string contents to the interned copy. The keys point
+       into 'store', so lookups by std::string_view don't need to
+       allocate. */
+    typedef std::unordered_map<std::string_view, const string *> Index;
+
+    Store store;
+    Index index;
+
+    /* Lookups of existing symbols, which are by far the most common
+       operation, only take a shared lock so they can proceed
+       concurrently. */
+    mutable std::shared_mutex mutex;
 
 public:
     Symbol create(std::string_view s)
     {
-        // FIXME: avoid allocation if 's' already exists in the symbol table.
-        std::pair<Symbols::iterator, bool> res = symbols.emplace(std::string(s));
-        return Symbol(&*res.first);
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto i = index.find(s);
+            if (i != index.end()) return Symbol(i->second);
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto i = index.find(s);
+        if (i != index.end()) return Symbol(i->second);
+        auto & s2 = store.emplace_back(s);
+        index.emplace(s2, &s2);
+        return Symbol(&s2);
     }
 
     size_t size() const
     {
-        return symbols.size();
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return store.size();
     }
 
     size_t totalSize() const;
 
     template<typename T>
-    void dump(T callback)
+    void dump(T callback) const
     {
-        for (auto & s : symbols)
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (auto & s : store)
             callback(s);
     }
 };
 
 }
+
+template<>
+struct std::hash<nix::Symbol>
+{
+    size_t operator () (const nix::Symbol & s) const { return s.hash(); }
+};
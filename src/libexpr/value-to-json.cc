@@ -2,7 +2,10 @@
 #include "json.hh"
 #include "eval-inline.hh"
 #include "util.hh"
+#include "serialise.hh"
+#include "value-traversal.hh"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iomanip>
 
@@ -12,78 +15,110 @@ namespace nix {
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, JSONPlaceholder & out, PathSet & context)
 {
-    checkInterrupt();
-
-    if (strict) state.forceValue(v);
-
-    switch (v.type()) {
-
-        case nInt:
-            out.write(v.integer);
-            break;
+    /* The list or object being written for a value. */
+    struct Node
+    {
+        std::unique_ptr<JSONList> list;
+        std::unique_ptr<JSONObject> object;
+    };
+
+    ValueTraversal<Node> traversal;
+
+    /* Write 'v' to 'out'. Lists and sets are opened, and their
+       elements are then written by the traversal. */
+    auto print = [&](Value * v, JSONPlaceholder & out) {
+        for (size_t depth = 0; ; ++depth) {
+            checkInterrupt();
+
+            if (strict) state.forceValue(*v);
+
+            switch (v->type()) {
+
+                case nInt:
+                    out.write(v->integer);
+                    break;
+
+                case nBool:
+                    out.write(v->boolean);
+                    break;
+
+                case nString:
+                    copyContext(*v, context);
+                    out.write(v->string.s);
+                    break;
+
+                case nPath:
+                    out.write(state.copyPathToStore(context, v->path));
+                    break;
+
+                case nNull:
+                    out.write(nullptr);
+                    break;
+
+                case nAttrs: {
+                    auto maybeString = state.tryAttrsToString(noPos, *v, context, false, false);
+                    if (maybeString) {
+                        out.write(*maybeString);
+                        break;
+                    }
+                    auto i = v->attrs->find(state.sOutPath);
+                    if (i != v->attrs->end()) {
+                        ValueTraversal<Node>::checkDepth(depth);
+                        v = i->value;
+                        continue;
+                    }
+                    std::vector<const Attr *> attrs;
+                    attrs.reserve(v->attrs->size());
+                    for (auto & j : *v->attrs)
+                        attrs.push_back(&j);
+                    std::sort(attrs.begin(), attrs.end(), [](const Attr * a, const Attr * b) {
+                        return std::string_view(a->name) < std::string_view(b->name);
+                    });
+                    traversal.push({nullptr, std::unique_ptr<JSONObject>(new JSONObject(out.object()))});
+                    for (auto j : attrs)
+                        traversal.addChild(j->value, j);
+                    break;
+                }
 
-        case nBool:
-            out.write(v.boolean);
-            break;
+                case nList:
+                    traversal.push({std::unique_ptr<JSONList>(new JSONList(out.list())), nullptr});
+                    for (unsigned int n = 0; n < v->listSize(); ++n)
+                        traversal.addChild(v->listElems()[n]);
+                    break;
 
-        case nString:
-            copyContext(v, context);
-            out.write(v.string.s);
-            break;
+                case nExternal:
+                    v->external->printValueAsJSON(state, strict, out, context);
+                    break;
 
-        case nPath:
-            out.write(state.copyPathToStore(context, v.path));
-            break;
+                case nFloat:
+                    out.write(v->fpoint);
+                    break;
 
-        case nNull:
-            out.write(nullptr);
-            break;
+                case nThunk:
+                    throw TypeError("cannot convert %1% to JSON", showType(*v));
 
-        case nAttrs: {
-            auto maybeString = state.tryAttrsToString(noPos, v, context, false, false);
-            if (maybeString) {
-                out.write(*maybeString);
-                break;
+                case nFunction:
+                    throw TypeError("cannot convert %1% to JSON", showType(*v));
             }
-            auto i = v.attrs->find(state.sOutPath);
-            if (i == v.attrs->end()) {
-                auto obj(out.object());
-                StringSet names;
-                for (auto & j : *v.attrs)
-                    names.insert(j.name);
-                for (auto & j : names) {
-                    Attr & a(*v.attrs->find(state.symbols.create(j)));
-                    auto placeholder(obj.placeholder(j));
-                    printValueAsJSON(state, strict, *a.value, placeholder, context);
-                }
-            } else
-                printValueAsJSON(state, strict, *i->value, out, context);
-            break;
-        }
 
-        case nList: {
-            auto list(out.list());
-            for (unsigned int n = 0; n < v.listSize(); ++n) {
-                auto placeholder(list.placeholder());
-                printValueAsJSON(state, strict, *v.listElems()[n], placeholder, context);
-            }
-            break;
+            return;
         }
-
-        case nExternal:
-            v.external->printValueAsJSON(state, strict, out, context);
-            break;
-
-        case nFloat:
-            out.write(v.fpoint);
-            break;
-
-        case nThunk:
-            throw TypeError("cannot convert %1% to JSON", showType(v));
-
-        case nFunction:
-            throw TypeError("cannot convert %1% to JSON", showType(v));
-    }
+    };
+
+    traversal.run(v,
+        [&](const ValueTraversal<Node>::Child & child) {
+            auto parent = traversal.parent();
+            if (!parent)
+                print(child.value, out);
+            else if (parent->list) {
+                auto placeholder(parent->list->placeholder());
+                print(child.value, placeholder);
+            } else {
+                auto placeholder(parent->object->placeholder(child.attr->name));
+                print(child.value, placeholder);
+            }
+        },
+        [](Node &) { });
 }
 
 void printValueAsJSON(EvalState & state, bool strict,
@@ -93,6 +128,16 @@ void printValueAsJSON(EvalState & state, bool strict,
     printValueAsJSON(state, strict, v, out, context);
 }
 
+void printValueAsJSON(EvalState & state, bool strict,
+    Value & v, Sink & sink, PathSet & context)
+{
+    SinkStreamBuf buf(sink);
+    std::ostream str(&buf);
+    str.exceptions(std::ios::badbit);
+    printValueAsJSON(state, strict, v, str, context);
+    str.flush();
+}
+
 void ExternalValueBase::printValueAsJSON(EvalState & state, bool strict,
     JSONPlaceholder & out, PathSet & context) const
 {
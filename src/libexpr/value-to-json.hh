@@ -8,6 +8,7 @@
 
 namespace nix {
 
+struct Sink;
 class JSONPlaceholder;
 
 void printValueAsJSON(EvalState & state, bool strict,
@@ -16,4 +17,9 @@ void printValueAsJSON(EvalState & state, bool strict,
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, std::ostream & str, PathSet & context);
 
+/* Write the JSON representation of `v' to `sink', without keeping it
+   in memory. */
+void printValueAsJSON(EvalState & state, bool strict,
+    Value & v, Sink & sink, PathSet & context);
+
 }
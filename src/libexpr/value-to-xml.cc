@@ -2,7 +2,10 @@
 #include "xml-writer.hh"
 #include "eval-inline.hh"
 #include "util.hh"
+#include "serialise.hh"
+#include "value-traversal.hh"
 
+#include <algorithm>
 #include <cstdlib>
 
 
@@ -17,10 +20,6 @@ static XMLAttrs singletonAttrs(const string & name, const string & value)
 }
 
 
-static void printValueAsXML(EvalState & state, bool strict, bool location,
-    Value & v, XMLWriter & doc, PathSet & context, PathSet & drvsSeen);
-
-
 static void posToXML(XMLAttrs & xmlAttrs, const Pos & pos)
 {
     xmlAttrs["path"] = pos.file;
@@ -29,136 +28,161 @@ static void posToXML(XMLAttrs & xmlAttrs, const Pos & pos)
 }
 
 
-static void showAttrs(EvalState & state, bool strict, bool location,
-    Bindings & attrs, XMLWriter & doc, PathSet & context, PathSet & drvsSeen)
-{
-    StringSet names;
-
-    for (auto & i : attrs)
-        names.insert(i.name);
-
-    for (auto & i : names) {
-        Attr & a(*attrs.find(state.symbols.create(i)));
-
-        XMLAttrs xmlAttrs;
-        xmlAttrs["name"] = i;
-        if (location && a.pos != &noPos) posToXML(xmlAttrs, *a.pos);
-
-        XMLOpenElement _(doc, "attr", xmlAttrs);
-        printValueAsXML(state, strict, location,
-            *a.value, doc, context, drvsSeen);
-    }
-}
-
-
 static void printValueAsXML(EvalState & state, bool strict, bool location,
     Value & v, XMLWriter & doc, PathSet & context, PathSet & drvsSeen)
 {
-    checkInterrupt();
+    /* The number of elements to close once the children of a value
+       have been written: the element of the value itself, and the
+       <attr> element around it if it's an attribute. */
+    struct Node
+    {
+        size_t openElements;
+    };
+
+    ValueTraversal<Node> traversal;
+
+    /* Add the attributes of a set to the traversal, sorted by name. */
+    auto showAttrs = [&](Bindings & attrs) {
+        std::vector<const Attr *> sorted;
+        sorted.reserve(attrs.size());
+        for (auto & i : attrs)
+            sorted.push_back(&i);
+        std::sort(sorted.begin(), sorted.end(), [](const Attr * a, const Attr * b) {
+            return std::string_view(a->name) < std::string_view(b->name);
+        });
+        for (auto i : sorted)
+            traversal.addChild(i->value, i);
+    };
+
+    auto enter = [&](const ValueTraversal<Node>::Child & child) {
+        checkInterrupt();
+
+        size_t openElements = 0;
+
+        if (child.attr) {
+            XMLAttrs xmlAttrs;
+            xmlAttrs["name"] = child.attr->name;
+            if (location && child.attr->pos) posToXML(xmlAttrs, state.positions[child.attr->pos]);
+            doc.openElement("attr", xmlAttrs);
+            openElements++;
+        }
 
-    if (strict) state.forceValue(v);
+        auto & v(*child.value);
 
-    switch (v.type()) {
+        if (strict) state.forceValue(v);
 
-        case nInt:
-            doc.writeEmptyElement("int", singletonAttrs("value", (format("%1%") % v.integer).str()));
-            break;
+        switch (v.type()) {
 
-        case nBool:
-            doc.writeEmptyElement("bool", singletonAttrs("value", v.boolean ? "true" : "false"));
-            break;
+            case nInt:
+                doc.writeEmptyElement("int", singletonAttrs("value", (format("%1%") % v.integer).str()));
+                break;
 
-        case nString:
-            /* !!! show the context? */
-            copyContext(v, context);
-            doc.writeEmptyElement("string", singletonAttrs("value", v.string.s));
-            break;
+            case nBool:
+                doc.writeEmptyElement("bool", singletonAttrs("value", v.boolean ? "true" : "false"));
+                break;
 
-        case nPath:
-            doc.writeEmptyElement("path", singletonAttrs("value", v.path));
-            break;
+            case nString:
+                /* !!! show the context? */
+                copyContext(v, context);
+                doc.writeEmptyElement("string", singletonAttrs("value", v.string.s));
+                break;
 
-        case nNull:
-            doc.writeEmptyElement("null");
-            break;
+            case nPath:
+                doc.writeEmptyElement("path", singletonAttrs("value", v.path));
+                break;
 
-        case nAttrs:
-            if (state.isDerivation(v)) {
-                XMLAttrs xmlAttrs;
+            case nNull:
+                doc.writeEmptyElement("null");
+                break;
 
-                Bindings::iterator a = v.attrs->find(state.symbols.create("derivation"));
+            case nAttrs:
+                if (state.isDerivation(v)) {
+                    XMLAttrs xmlAttrs;
+
+                    Path drvPath;
+                    auto a = v.attrs->find(state.sDrvPath);
+                    if (a != v.attrs->end()) {
+                        if (strict) state.forceValue(*a->value);
+                        if (a->value->type() == nString)
+                            xmlAttrs["drvPath"] = drvPath = a->value->string.s;
+                    }
+
+                    a = v.attrs->find(state.sOutPath);
+                    if (a != v.attrs->end()) {
+                        if (strict) state.forceValue(*a->value);
+                        if (a->value->type() == nString)
+                            xmlAttrs["outPath"] = a->value->string.s;
+                    }
+
+                    doc.openElement("derivation", xmlAttrs);
+                    openElements++;
+
+                    if (drvPath != "" && drvsSeen.insert(drvPath).second) {
+                        traversal.push({openElements});
+                        showAttrs(*v.attrs);
+                        return;
+                    }
 
-                Path drvPath;
-                a = v.attrs->find(state.sDrvPath);
-                if (a != v.attrs->end()) {
-                    if (strict) state.forceValue(*a->value);
-                    if (a->value->type() == nString)
-                        xmlAttrs["drvPath"] = drvPath = a->value->string.s;
+                    doc.writeEmptyElement("repeated");
                 }
 
-                a = v.attrs->find(state.sOutPath);
-                if (a != v.attrs->end()) {
-                    if (strict) state.forceValue(*a->value);
-                    if (a->value->type() == nString)
-                        xmlAttrs["outPath"] = a->value->string.s;
+                else {
+                    doc.openElement("attrs");
+                    traversal.push({++openElements});
+                    showAttrs(*v.attrs);
+                    return;
                 }
 
-                XMLOpenElement _(doc, "derivation", xmlAttrs);
+                break;
 
-                if (drvPath != "" && drvsSeen.insert(drvPath).second)
-                    showAttrs(state, strict, location, *v.attrs, doc, context, drvsSeen);
-                else
-                    doc.writeEmptyElement("repeated");
-            }
+            case nList:
+                doc.openElement("list");
+                traversal.push({++openElements});
+                for (unsigned int n = 0; n < v.listSize(); ++n)
+                    traversal.addChild(v.listElems()[n]);
+                return;
+
+            case nFunction: {
+                if (!v.isLambda()) {
+                    // FIXME: Serialize primops and primopapps
+                    doc.writeEmptyElement("unevaluated");
+                    break;
+                }
+                XMLAttrs xmlAttrs;
+                if (location) posToXML(xmlAttrs, state.positions[v.lambda.fun->pos]);
+                XMLOpenElement _(doc, "function", xmlAttrs);
+
+                if (v.lambda.fun->matchAttrs) {
+                    XMLAttrs attrs;
+                    if (!v.lambda.fun->arg.empty()) attrs["name"] = v.lambda.fun->arg;
+                    if (v.lambda.fun->formals->ellipsis) attrs["ellipsis"] = "1";
+                    XMLOpenElement _(doc, "attrspat", attrs);
+                    for (auto & i : v.lambda.fun->formals->formals)
+                        doc.writeEmptyElement("attr", singletonAttrs("name", i.name));
+                } else
+                    doc.writeEmptyElement("varpat", singletonAttrs("name", v.lambda.fun->arg));
 
-            else {
-                XMLOpenElement _(doc, "attrs");
-                showAttrs(state, strict, location, *v.attrs, doc, context, drvsSeen);
+                break;
             }
 
-            break;
+            case nExternal:
+                v.external->printValueAsXML(state, strict, location, doc, context, drvsSeen);
+                break;
 
-        case nList: {
-            XMLOpenElement _(doc, "list");
-            for (unsigned int n = 0; n < v.listSize(); ++n)
-                printValueAsXML(state, strict, location, *v.listElems()[n], doc, context, drvsSeen);
-            break;
-        }
+            case nFloat:
+                doc.writeEmptyElement("float", singletonAttrs("value", (format("%1%") % v.fpoint).str()));
+                break;
 
-        case nFunction: {
-            if (!v.isLambda()) {
-                // FIXME: Serialize primops and primopapps
+            case nThunk:
                 doc.writeEmptyElement("unevaluated");
-                break;
-            }
-            XMLAttrs xmlAttrs;
-            if (location) posToXML(xmlAttrs, v.lambda.fun->pos);
-            XMLOpenElement _(doc, "function", xmlAttrs);
-
-            if (v.lambda.fun->matchAttrs) {
-                XMLAttrs attrs;
-                if (!v.lambda.fun->arg.empty()) attrs["name"] = v.lambda.fun->arg;
-                if (v.lambda.fun->formals->ellipsis) attrs["ellipsis"] = "1";
-                XMLOpenElement _(doc, "attrspat", attrs);
-                for (auto & i : v.lambda.fun->formals->formals)
-                    doc.writeEmptyElement("attr", singletonAttrs("name", i.name));
-            } else
-                doc.writeEmptyElement("varpat", singletonAttrs("name", v.lambda.fun->arg));
-
-            break;
         }
 
-        case nExternal:
-            v.external->printValueAsXML(state, strict, location, doc, context, drvsSeen);
-            break;
+        while (openElements--) doc.closeElement();
+    };
 
-        case nFloat:
-            doc.writeEmptyElement("float", singletonAttrs("value", (format("%1%") % v.fpoint).str()));
-            break;
-
-        case nThunk:
-            doc.writeEmptyElement("unevaluated");
-    }
+    traversal.run(v, enter, [&](Node & node) {
+        while (node.openElements--) doc.closeElement();
+    });
 }
 
 
@@ -179,4 +203,15 @@ void printValueAsXML(EvalState & state, bool strict, bool location,
 }
 
 
+void printValueAsXML(EvalState & state, bool strict, bool location,
+    Value & v, Sink & sink, PathSet & context)
+{
+    SinkStreamBuf buf(sink);
+    std::ostream str(&buf);
+    str.exceptions(std::ios::badbit);
+    printValueAsXML(state, strict, location, v, str, context);
+    str.flush();
+}
+
+
 }
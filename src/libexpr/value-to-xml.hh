@@ -8,7 +8,13 @@
 
 namespace nix {
 
+struct Sink;
 void printValueAsXML(EvalState & state, bool strict, bool location,
     Value & v, std::ostream & out, PathSet & context);
+
+/* Write the XML representation of `v' to `sink', without keeping it
+   in memory. */
+void printValueAsXML(EvalState & state, bool strict, bool location,
+    Value & v, Sink & sink, PathSet & context);
     
 }
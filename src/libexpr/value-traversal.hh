@@ -0,0 +1,159 @@
+#pragma once
+
+#include "eval.hh"
+
+#include <vector>
+
+namespace nix {
+
+/* A set of pointers, implemented as an open-addressing hash table.
+   Unlike std::set or std::unordered_set, it doesn't allocate memory
+   for every element, which matters when visiting millions of
+   values. */
+class PointerSet
+{
+    std::vector<const void *> table;
+    size_t count = 0;
+
+    static size_t hash(const void * p)
+    {
+        uint64_t h = (uintptr_t) p;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    void grow()
+    {
+        std::vector<const void *> old(std::max<size_t>(64, table.size() * 2), nullptr);
+        std::swap(old, table);
+        count = 0;
+        for (auto p : old)
+            if (p) insert(p);
+    }
+
+public:
+
+    /* Add 'p', and return whether it wasn't already in the set. */
+    bool insert(const void * p)
+    {
+        if ((count + 1) * 2 > table.size()) grow();
+        auto mask = table.size() - 1;
+        for (auto i = hash(p) & mask; ; i = (i + 1) & mask) {
+            if (table[i] == p) return false;
+            if (!table[i]) {
+                table[i] = p;
+                count++;
+                return true;
+            }
+        }
+    }
+};
+
+/* A depth-first traversal of a value and the values it contains,
+   using an explicit stack rather than recursion, so that deeply
+   nested values don't overflow the native stack. It is used by
+   forceValueDeep() and the conversions to JSON and XML.
+
+   The traversal calls enter() for the root value. To descend into
+   the children of a value, enter() calls push() with the state that
+   the traversal needs for that value (a 'Node', e.g. the JSON object
+   being written), followed by addChild() for every child. The
+   traversal then calls enter() for every child in order, and leave()
+   once all children have been visited. */
+template<typename Node>
+class ValueTraversal
+{
+public:
+
+    struct Child
+    {
+        Value * value;
+        /* The attribute, if this is the child of a set. */
+        const Attr * attr;
+    };
+
+    /* The maximum depth of the stack, to fail cleanly on infinitely
+       nested values like `let f = x: { y = f x; }; in f 1`. */
+    static constexpr size_t maxDepth = 1 << 20;
+
+private:
+
+    struct Frame
+    {
+        Node node;
+        /* The indices in 'children' of the children of this value,
+           and of the next one to visit. */
+        size_t start, end, next;
+    };
+
+    std::vector<Frame> frames;
+
+    /* The children of all values on the stack. Since a value's
+       children are added before its first child is visited, the
+       children of the innermost value are always at the end. */
+    std::vector<Child> children;
+
+public:
+
+    ~ValueTraversal()
+    {
+        /* Destroy the nodes from the innermost outwards, as recursion
+           would have. */
+        while (!frames.empty()) frames.pop_back();
+    }
+
+    static void checkDepth(size_t depth)
+    {
+        if (depth >= maxDepth)
+            throw EvalError("value is nested more than %d levels deep (possible infinite recursion)", maxDepth);
+    }
+
+    void push(Node && node)
+    {
+        checkDepth(frames.size());
+        frames.push_back(Frame{std::move(node), children.size(), children.size(), children.size()});
+    }
+
+    void addChild(Value * value, const Attr * attr = nullptr)
+    {
+        children.push_back({value, attr});
+        frames.back().end++;
+    }
+
+    /* The node of the innermost value being visited, i.e. the parent
+       of the value being entered. */
+    Node * parent()
+    {
+        return frames.empty() ? nullptr : &frames.back().node;
+    }
+
+    /* The children being visited, from the innermost to the
+       outermost, e.g. to describe where an error occurred. */
+    template<typename F>
+    void forEachActiveChild(F f)
+    {
+        for (auto i = frames.rbegin(); i != frames.rend(); ++i)
+            if (i->next != i->start) f(children[i->next - 1]);
+    }
+
+    template<typename Enter, typename Leave>
+    void run(Value & root, Enter enter, Leave leave)
+    {
+        enter(Child{&root, nullptr});
+        while (!frames.empty()) {
+            auto & frame = frames.back();
+            if (frame.next == frame.end) {
+                leave(frame.node);
+                children.resize(frame.start);
+                frames.pop_back();
+                continue;
+            }
+            /* Note that enter() may invalidate 'frame'. */
+            enter(Child(children[frame.next++]));
+        }
+    }
+};
+
+}
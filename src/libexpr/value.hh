@@ -177,6 +177,9 @@ public:
             ExprLambda * fun;
         } lambda;
         PrimOp * primOp;
+        struct {
+            const void * owner;
+        } blackhole;
         struct {
             Value * left, * right;
         } primOpApp;
@@ -292,6 +295,40 @@ public:
         // Value will be overridden anyways
     }
 
+    /* Thread-safe forcing (see EvalState::forceValue()). A thunk or
+       application is claimed by atomically turning it into a black
+       hole, which then records the thread forcing it, and its result
+       is published by finishValue(), which stores the type after the
+       payload. */
+    inline InternalType loadType() const
+    {
+        return __atomic_load_n(&internalType, __ATOMIC_ACQUIRE);
+    }
+
+    inline bool claim(InternalType expected)
+    {
+        return __atomic_compare_exchange_n(&internalType, &expected, tBlackhole,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+
+    /* Only valid after a successful claim(), once the thunk or
+       application has been read. */
+    inline void setBlackholeOwner(const void * owner)
+    {
+        __atomic_store_n(&blackhole.owner, owner, __ATOMIC_RELAXED);
+    }
+
+    inline const void * blackholeOwner() const
+    {
+        return __atomic_load_n(&blackhole.owner, __ATOMIC_RELAXED);
+    }
+
+    inline void finishValue(const Value & v)
+    {
+        app = v.app; // copies the whole payload, cf. clearValue()
+        __atomic_store_n(&internalType, v.internalType, __ATOMIC_RELEASE);
+    }
+
     inline void mkPrimOp(PrimOp * p)
     {
         clearValue();
@@ -21,10 +21,24 @@ create table if not exists Cache (
 
 struct CacheImpl : Cache
 {
+    struct Entry
+    {
+        Attrs infoAttrs;
+        StorePath storePath;
+        bool immutable;
+        time_t timestamp;
+    };
+
     struct State
     {
         SQLite db;
         SQLiteStmt add, lookup;
+
+        /* Entries that this process has added or looked up, keyed
+           by store URI and input attributes. Their store paths are
+           known to be valid and have a temporary root, so they don't
+           need to be checked again. */
+        std::map<std::pair<std::string, std::string>, Entry> entries;
     };
 
     Sync<State> _state;
@@ -38,6 +52,9 @@ struct CacheImpl : Cache
 
         state->db = SQLite(dbPath);
         state->db.isCache();
+        /* Allow concurrent readers while another process updates the
+           cache. */
+        state->db.exec("pragma main.journal_mode = wal");
         state->db.exec(schema);
 
         state->add.create(state->db,
@@ -54,12 +71,21 @@ struct CacheImpl : Cache
         const StorePath & storePath,
         bool immutable) override
     {
-        _state.lock()->add.use()
-            (attrsToJSON(inAttrs).dump())
+        auto state(_state.lock());
+
+        auto inAttrsJSON = attrsToJSON(inAttrs).dump();
+        auto now = time(0);
+
+        state->add.use()
+            (inAttrsJSON)
             (attrsToJSON(infoAttrs).dump())
             (store->printStorePath(storePath))
             (immutable)
-            (time(0)).exec();
+            (now).exec();
+
+        state->entries.insert_or_assign(
+            std::make_pair(store->getUri(), std::move(inAttrsJSON)),
+            Entry { infoAttrs, storePath, immutable, now });
     }
 
     std::optional<std::pair<Attrs, StorePath>> lookup(
@@ -81,33 +107,47 @@ struct CacheImpl : Cache
     {
         auto state(_state.lock());
 
-        auto inAttrsJSON = attrsToJSON(inAttrs).dump();
-
-        auto stmt(state->lookup.use()(inAttrsJSON));
-        if (!stmt.next()) {
-            debug("did not find cache entry for '%s'", inAttrsJSON);
-            return {};
-        }
-
-        auto infoJSON = stmt.getStr(0);
-        auto storePath = store->parseStorePath(stmt.getStr(1));
-        auto immutable = stmt.getInt(2) != 0;
-        auto timestamp = stmt.getInt(3);
-
-        store->addTempRoot(storePath);
-        if (!store->isValidPath(storePath)) {
-            // FIXME: we could try to substitute 'storePath'.
-            debug("ignoring disappeared cache entry '%s'", inAttrsJSON);
-            return {};
+        auto key = std::make_pair(store->getUri(), attrsToJSON(inAttrs).dump());
+        auto & inAttrsJSON = key.second;
+
+        auto i = state->entries.find(key);
+
+        if (i == state->entries.end()) {
+            auto stmt(state->lookup.use()(inAttrsJSON));
+            if (!stmt.next()) {
+                debug("did not find cache entry for '%s'", inAttrsJSON);
+                return {};
+            }
+
+            auto infoJSON = stmt.getStr(0);
+            auto storePath = store->parseStorePath(stmt.getStr(1));
+            auto immutable = stmt.getInt(2) != 0;
+            auto timestamp = stmt.getInt(3);
+
+            store->addTempRoot(storePath);
+            if (!store->isValidPath(storePath)) {
+                // FIXME: we could try to substitute 'storePath'.
+                debug("ignoring disappeared cache entry '%s'", inAttrsJSON);
+                return {};
+            }
+
+            debug("using cache entry '%s' -> '%s', '%s'",
+                inAttrsJSON, infoJSON, store->printStorePath(storePath));
+
+            i = state->entries.emplace(key, Entry {
+                jsonToAttrs(nlohmann::json::parse(infoJSON)),
+                std::move(storePath),
+                immutable,
+                (time_t) timestamp
+            }).first;
         }
 
-        debug("using cache entry '%s' -> '%s', '%s'",
-            inAttrsJSON, infoJSON, store->printStorePath(storePath));
+        auto & entry = i->second;
 
         return Result {
-            .expired = !immutable && (settings.tarballTtl.get() == 0 || timestamp + settings.tarballTtl < time(0)),
-            .infoAttrs = jsonToAttrs(nlohmann::json::parse(infoJSON)),
-            .storePath = std::move(storePath)
+            .expired = !entry.immutable && (settings.tarballTtl.get() == 0 || entry.timestamp + settings.tarballTtl < time(0)),
+            .infoAttrs = entry.infoAttrs,
+            .storePath = entry.storePath
         };
     }
 };
@@ -144,7 +144,12 @@ std::pair<Tree, Input> Input::fetch(ref<Store> store) const
     if (tree.actualPath == "")
         tree.actualPath = store->toRealPath(tree.storePath);
 
-    auto narHash = store->queryPathInfo(tree.storePath)->narHash;
+    /* Trees that weren't copied to the store (see 'lazy-trees')
+       come with their NAR hash. */
+    auto narHash =
+        input.getNarHash() && tree.actualPath != store->toRealPath(tree.storePath)
+        ? *input.getNarHash()
+        : store->queryPathInfo(tree.storePath)->narHash;
     input.attrs.insert_or_assign("narHash", narHash.to_string(SRI, true));
 
     if (auto prevNarHash = getNarHash()) {
@@ -12,6 +12,10 @@ namespace nix { class Store; }
 
 namespace nix::fetchers {
 
+/* A source tree fetched by a fetcher. Its contents can be read from
+   'actualPath', which is normally the location of 'storePath' but
+   can be a directory outside of the store if the tree hasn't been
+   copied yet (see the 'lazy-trees' setting). */
 struct Tree
 {
     Path actualPath;
@@ -152,4 +156,19 @@ std::pair<Tree, time_t> downloadTarball(
     bool immutable,
     const Headers & headers = {});
 
+/* Copy a local source tree to the store, like Store::addToStore().
+   The fingerprint of the tree (the names, sizes and timestamps of
+   its files) is recorded in the fetcher cache, so if the tree hasn't
+   changed since the last call, the copy and the hashing of its
+   contents are skipped. */
+StorePath addSourceTreeToStore(
+    ref<Store> store,
+    std::string_view name,
+    const Path & path,
+    PathFilter & filter = defaultPathFilter);
+
+/* Copy a tree to the store if it isn't there yet, and check that it
+   still has the expected store path. */
+void ensureTreeInStore(ref<Store> store, const Tree & tree);
+
 }
@@ -267,7 +267,7 @@ struct GitInputScheme : InputScheme
                     return files.count(file);
                 };
 
-                auto storePath = store->addToStore("source", actualUrl, FileIngestionMethod::Recursive, htSHA256, filter);
+                auto storePath = addSourceTreeToStore(store, "source", actualUrl, filter);
 
                 // FIXME: maybe we should use the timestamp of the last
                 // modified dirty file?
@@ -311,7 +311,9 @@ struct GitInputScheme : InputScheme
                 }
             }
 
-            Path cacheDir = getCacheDir() + "/nix/gitv3/" + hashString(htSHA256, actualUrl).to_string(Base32, false);
+            /* Shallow clones are kept separately, so that a shallow
+               fetch doesn't turn a full clone into a shallow one. */
+            Path cacheDir = getCacheDir() + (shallow ? "/nix/gitv3-shallow/" : "/nix/gitv3/") + hashString(htSHA256, actualUrl).to_string(Base32, false);
             repoDir = cacheDir;
 
             if (!pathExists(cacheDir)) {
@@ -364,7 +366,37 @@ struct GitInputScheme : InputScheme
                         : ref->compare(0, 5, "refs/") == 0
                             ? *ref
                             : "refs/heads/" + *ref;
-                    runProgram("git", true, { "-C", repoDir, "fetch", "--quiet", "--force", "--", actualUrl, fmt("%s:%s", fetchRef, fetchRef) });
+                    Strings args = { "-C", repoDir, "fetch", "--quiet", "--force" };
+                    bool fullFetch = !shallow;
+                    if (shallow && input.getRev() && !allRefs) {
+                        /* Only fetch the commit we need, by asking
+                           for it directly rather than for the tip of
+                           the ref. Servers refuse this for commits
+                           that aren't the tip of a ref unless
+                           uploadpack.allowReachableSHA1InWant (or
+                           protocol v2) is enabled; then fall back to
+                           fetching the whole ref. */
+                        auto revArgs = args;
+                        revArgs.insert(revArgs.end(), { "--depth=1", "--", actualUrl, input.getRev()->gitRev() });
+                        try {
+                            runProgram("git", true, revArgs);
+                        } catch (ExecError & e) {
+                            warn("could not fetch revision '%s' of Git repository '%s' directly; fetching '%s' instead",
+                                input.getRev()->gitRev(), actualUrl, fetchRef);
+                            fullFetch = true;
+                        }
+                    }
+                    if (fullFetch || !input.getRev() || allRefs) {
+                        if (!fullFetch)
+                            /* Only fetch the tip of the ref. */
+                            args.push_back("--depth=1");
+                        else if (pathExists(repoDir + "/shallow"))
+                            /* Deepen a repository made shallow by an
+                               earlier fetch. */
+                            args.push_back("--unshallow");
+                        args.insert(args.end(), { "--", actualUrl, fmt("%s:%s", fetchRef, fetchRef) });
+                        runProgram("git", true, args);
+                    }
                 } catch (Error & e) {
                     if (!pathExists(localRefFile)) throw;
                     warn("could not update local clone of Git repository '%s'; continuing with the most recent version", actualUrl);
@@ -397,10 +429,6 @@ struct GitInputScheme : InputScheme
         if (auto res = getCache()->lookup(store, getImmutableAttrs()))
             return makeResult(res->first, std::move(res->second));
 
-        Path tmpDir = createTempDir();
-        AutoDelete delTmpDir(tmpDir, true);
-        PathFilter filter = defaultPathFilter;
-
         RunOptions checkCommitOpts(
             "git",
             { "-C", repoDir, "cat-file", "commit", input.getRev()->gitRev() }
@@ -423,7 +451,13 @@ struct GitInputScheme : InputScheme
             );
         }
 
+        std::optional<StorePath> storePath;
+        time_t lastModified;
+
         if (submodules) {
+            Path tmpDir = createTempDir();
+            AutoDelete delTmpDir(tmpDir, true);
+
             Path tmpGitDir = createTempDir();
             AutoDelete delTmpGitDir(tmpGitDir, true);
 
@@ -438,26 +472,31 @@ struct GitInputScheme : InputScheme
             runProgram("git", true, { "-C", tmpDir, "remote", "add", "origin", actualUrl });
             runProgram("git", true, { "-C", tmpDir, "submodule", "--quiet", "update", "--init", "--recursive" });
 
-            filter = isNotDotGitDirectory;
+            PathFilter filter = isNotDotGitDirectory;
+            storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
+
+            lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "log", "-1", "--format=%ct", "--no-show-signature", input.getRev()->gitRev() }));
         } else {
-            // FIXME: should pipe this, or find some better way to extract a
-            // revision.
-            auto source = sinkToSource([&](Sink & sink) {
-                RunOptions gitOptions("git", { "-C", repoDir, "archive", input.getRev()->gitRev() });
-                gitOptions.standardOut = &sink;
-                runProgram2(gitOptions);
+            /* Convert the output of 'git archive' directly to a NAR,
+               rather than unpacking it into a temporary directory
+               first. 'git archive' sets the modification time of
+               every file to the commit time, so this also gives us
+               'lastModified'. */
+            auto nar = sinkToSource([&](Sink & sink) {
+                auto tarball = sinkToSource([&](Sink & sink) {
+                    RunOptions gitOptions("git", { "-C", repoDir, "archive", "--prefix=source/", input.getRev()->gitRev() });
+                    gitOptions.standardOut = &sink;
+                    runProgram2(gitOptions);
+                });
+                lastModified = tarballToNar(*tarball, sink);
             });
 
-            unpackTarfile(*source, tmpDir);
+            storePath = store->addToStoreFromDump(*nar, name, FileIngestionMethod::Recursive, htSHA256, NoRepair);
         }
 
-        auto storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
-
-        auto lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "log", "-1", "--format=%ct", "--no-show-signature", input.getRev()->gitRev() }));
-
         Attrs infoAttrs({
             {"rev", input.getRev()->gitRev()},
-            {"lastModified", lastModified},
+            {"lastModified", (uint64_t) lastModified},
         });
 
         if (!shallow)
@@ -469,17 +508,17 @@ struct GitInputScheme : InputScheme
                 store,
                 mutableAttrs,
                 infoAttrs,
-                storePath,
+                *storePath,
                 false);
 
         getCache()->add(
             store,
             getImmutableAttrs(),
             infoAttrs,
-            storePath,
+            *storePath,
             true);
 
-        return makeResult(infoAttrs, std::move(storePath));
+        return makeResult(infoAttrs, std::move(*storePath));
     }
 };
 
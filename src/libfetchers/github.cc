@@ -18,8 +18,13 @@ struct DownloadUrl
 };
 
 // A github or gitlab host
-const static std::string hostRegexS = "[a-zA-Z0-9.]*"; // FIXME: check
-std::regex hostRegex(hostRegexS, std::regex::ECMAScript);
+static bool isValidHost(std::string_view s) // FIXME: check
+{
+    for (auto c : s)
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.'))
+            return false;
+    return true;
+}
 
 struct GitArchiveInputScheme : InputScheme
 {
@@ -39,9 +44,9 @@ struct GitArchiveInputScheme : InputScheme
 
         auto size = path.size();
         if (size == 3) {
-            if (std::regex_match(path[2], revRegex))
+            if (isValidRev(path[2]))
                 rev = Hash::parseAny(path[2], htSHA1);
-            else if (std::regex_match(path[2], refRegex))
+            else if (isValidRef(path[2]))
                 ref = path[2];
             else
                 throw BadURL("in URL '%s', '%s' is not a commit hash or branch/tag name", url.url, path[2]);
@@ -54,7 +59,7 @@ struct GitArchiveInputScheme : InputScheme
                 }
             }
 
-            if (std::regex_match(rs, refRegex)) {
+            if (isValidRef(rs)) {
                 ref = rs;
             } else {
                 throw BadURL("in URL '%s', '%s' is not a branch/tag name", url.url, rs);
@@ -69,14 +74,14 @@ struct GitArchiveInputScheme : InputScheme
                 rev = Hash::parseAny(value, htSHA1);
             }
             else if (name == "ref") {
-                if (!std::regex_match(value, refRegex))
+                if (!isValidRef(value))
                     throw BadURL("URL '%s' contains an invalid branch/tag name", url.url);
                 if (ref)
                     throw BadURL("URL '%s' contains multiple branch/tag names", url.url);
                 ref = value;
             }
             else if (name == "host") {
-                if (!std::regex_match(value, hostRegex))
+                if (!isValidHost(value))
                     throw BadURL("URL '%s' contains an invalid instance host", url.url);
                 host_url = value;
             }
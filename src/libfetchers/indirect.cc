@@ -3,8 +3,6 @@
 
 namespace nix::fetchers {
 
-std::regex flakeRegex("[a-zA-Z][a-zA-Z0-9_-]*", std::regex::ECMAScript);
-
 struct IndirectInputScheme : InputScheme
 {
     std::optional<Input> inputFromURL(const ParsedURL & url) override
@@ -18,24 +16,24 @@ struct IndirectInputScheme : InputScheme
 
         if (path.size() == 1) {
         } else if (path.size() == 2) {
-            if (std::regex_match(path[1], revRegex))
+            if (isValidRev(path[1]))
                 rev = Hash::parseAny(path[1], htSHA1);
-            else if (std::regex_match(path[1], refRegex))
+            else if (isValidRef(path[1]))
                 ref = path[1];
             else
                 throw BadURL("in flake URL '%s', '%s' is not a commit hash or branch/tag name", url.url, path[1]);
         } else if (path.size() == 3) {
-            if (!std::regex_match(path[1], refRegex))
+            if (!isValidRef(path[1]))
                 throw BadURL("in flake URL '%s', '%s' is not a branch/tag name", url.url, path[1]);
             ref = path[1];
-            if (!std::regex_match(path[2], revRegex))
+            if (!isValidRev(path[2]))
                 throw BadURL("in flake URL '%s', '%s' is not a commit hash", url.url, path[2]);
             rev = Hash::parseAny(path[2], htSHA1);
         } else
             throw BadURL("GitHub URL '%s' is invalid", url.url);
 
         std::string id = path[0];
-        if (!std::regex_match(id, flakeRegex))
+        if (!isValidFlakeId(id))
             throw BadURL("'%s' is not a valid flake ID", id);
 
         // FIXME: forbid query params?
@@ -59,7 +57,7 @@ struct IndirectInputScheme : InputScheme
                 throw Error("unsupported indirect input attribute '%s'", name);
 
         auto id = getStrAttr(attrs, "id");
-        if (!std::regex_match(id, flakeRegex))
+        if (!isValidFlakeId(id))
             throw BadURL("'%s' is not a valid flake ID", id);
 
         Input input;
@@ -1,5 +1,6 @@
 #include "fetchers.hh"
 #include "store-api.hh"
+#include "globals.hh"
 
 namespace nix::fetchers {
 
@@ -91,9 +92,21 @@ struct PathInputScheme : InputScheme
         if (storePath)
             store->addTempRoot(*storePath);
 
-        if (!storePath || storePath->name() != "source" || !store->isValidPath(*storePath))
+        if (!storePath || storePath->name() != "source" || !store->isValidPath(*storePath)) {
+            if (settings.lazyTrees) {
+                /* Don't copy the tree yet; the evaluator will read it
+                   from 'path' until it's needed in the store. */
+                auto [storePath, narHash] = store->computeStorePathForPath("source", path);
+                if (!store->isValidPath(storePath)) {
+                    auto input2(input);
+                    input2.attrs.insert_or_assign("narHash", narHash.to_string(SRI, true));
+                    return {Tree(Path(path), std::move(storePath)), input2};
+                }
+            }
+
             // FIXME: try to substitute storePath.
-            storePath = store->addToStore("source", path);
+            storePath = addSourceTreeToStore(store, "source", path);
+        }
 
         return {
             Tree(store->toRealPath(*storePath), std::move(*storePath)),
@@ -0,0 +1,101 @@
+#include "fetchers.hh"
+#include "cache.hh"
+#include "store-api.hh"
+
+namespace nix::fetchers {
+
+/* Compute a fingerprint of the tree at 'path' from the metadata of
+   its files (as selected by 'filter'), without reading their
+   contents. Returns nothing if a file was modified so recently that
+   a subsequent change might not be visible in its metadata. */
+static std::optional<Hash> fingerprintSourceTree(const Path & path, PathFilter & filter)
+{
+    HashSink sink(htSHA256);
+    time_t now = time(0);
+    bool racy = false;
+
+    std::function<void(const Path &, const std::string &)> walk;
+    walk = [&](const Path & path, const std::string & relPath) {
+        checkInterrupt();
+
+        auto st = lstat(path);
+
+        sink << relPath << (uint64_t) st.st_mode;
+
+        if (S_ISDIR(st.st_mode)) {
+            /* The directory's own timestamps don't matter, only
+               those of the files it contains. */
+            std::vector<std::string> names;
+            for (auto & entry : readDirectory(path))
+                names.push_back(entry.name);
+            std::sort(names.begin(), names.end());
+            for (auto & name : names) {
+                auto child = path + "/" + name;
+                if (filter(child))
+                    walk(child, relPath + "/" + name);
+            }
+            sink << "";
+        } else {
+            if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1)
+                racy = true;
+            sink << (uint64_t) st.st_size
+                 << (uint64_t) st.st_ino
+                 << (uint64_t) st.st_mtime
+                 << (uint64_t) st.st_ctime;
+            if (S_ISLNK(st.st_mode))
+                sink << readLink(path);
+        }
+    };
+
+    walk(path, "");
+
+    if (racy) return std::nullopt;
+
+    return sink.finish().first;
+}
+
+StorePath addSourceTreeToStore(
+    ref<Store> store,
+    std::string_view name,
+    const Path & path,
+    PathFilter & filter)
+{
+    auto fingerprint = fingerprintSourceTree(path, filter);
+
+    std::optional<Attrs> inAttrs;
+    if (fingerprint) {
+        inAttrs = Attrs({
+            {"type", "source-tree"},
+            {"name", std::string(name)},
+            {"path", path},
+            {"fingerprint", fingerprint->to_string(Base32, false)},
+        });
+        if (auto res = getCache()->lookup(store, *inAttrs)) {
+            debug("source tree '%s' is unchanged", path);
+            return std::move(res->second);
+        }
+    } else
+        debug("not caching source tree '%s' because it was modified very recently", path);
+
+    auto storePath = store->addToStore(std::string(name), path, FileIngestionMethod::Recursive, htSHA256, filter);
+
+    if (inAttrs)
+        getCache()->add(store, *inAttrs, {}, storePath, true);
+
+    return storePath;
+}
+
+void ensureTreeInStore(ref<Store> store, const Tree & tree)
+{
+    if (store->isValidPath(tree.storePath)) return;
+
+    debug("copying lazy tree '%s' to '%s'", tree.actualPath, store->printStorePath(tree.storePath));
+
+    auto storePath = addSourceTreeToStore(store, tree.storePath.name(), tree.actualPath);
+
+    if (storePath != tree.storePath)
+        throw Error("source tree '%s' changed during evaluation; it was expected to have store path '%s' but has '%s'",
+            tree.actualPath, store->printStorePath(tree.storePath), store->printStorePath(storePath));
+}
+
+}
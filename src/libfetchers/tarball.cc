@@ -9,6 +9,68 @@
 
 namespace nix::fetchers {
 
+/* Start a detached 'nix' process that downloads 'url' again, bypassing
+   'tarball-ttl', to update the cache entry for next time. The
+   settings we override are passed on its standard input rather than
+   on its command line, which other users can read. Secret settings
+   aren't passed at all; the refresh uses those from the
+   configuration files. */
+static void refreshInBackground(const std::string & type, const std::string & url, const std::string & name)
+{
+    debug("refreshing '%s' in the background", url);
+
+    auto program = settings.nixBinDir + "/nix";
+
+    Strings args = { "__refresh_download", type, url, name };
+
+    std::map<std::string, Config::SettingInfo> overridden;
+    globalConfig.getSettings(overridden, true);
+    overridden.erase(settings.accessTokens.name);
+
+    Pipe toChild;
+    toChild.create();
+
+    ProcessOptions options;
+    options.dieWithParent = false;
+    options.allowVfork = false;
+
+    Pid pid(startProcess([&]() {
+        if (setsid() == -1)
+            throw SysError("creating a new session");
+
+        /* Fork again, so that the refresh isn't our child and we
+           don't leave a zombie behind. */
+        if (fork() != 0) _exit(0);
+
+        toChild.writeSide = -1;
+        if (dup2(toChild.readSide.get(), STDIN_FILENO) == -1)
+            throw SysError("redirecting standard input");
+
+        AutoCloseFD fdNull = open("/dev/null", O_RDWR);
+        if (!fdNull) throw SysError("opening /dev/null");
+        for (int fd = 1; fd <= 2; ++fd)
+            if (dup2(fdNull.get(), fd) == -1)
+                throw SysError("redirecting standard file descriptors");
+
+        execv(program.c_str(), stringsToCharPtrs(args).data());
+
+        throw SysError("executing '%s'", program);
+    }, options));
+
+    pid.wait();
+    toChild.readSide = -1;
+
+    try {
+        FdSink sink(toChild.writeSide.get());
+        sink << overridden.size();
+        for (auto & [name, info] : overridden)
+            sink << name << info.value;
+        sink.flush();
+    } catch (Error & e) {
+        debug("cannot pass settings to the refresh of '%s': %s", url, e.what());
+    }
+}
+
 DownloadFileResult downloadFile(
     ref<Store> store,
     const std::string & url,
@@ -38,6 +100,11 @@ DownloadFileResult downloadFile(
     if (cached && !cached->expired)
         return useCached();
 
+    if (cached && settings.tarballRefreshInBackground && headers.empty()) {
+        refreshInBackground("file", url, name);
+        return useCached();
+    }
+
     FileTransferRequest request(url);
     request.headers = headers;
     if (cached)
@@ -124,35 +191,72 @@ std::pair<Tree, time_t> downloadTarball(
 
     auto cached = getCache()->lookupExpired(store, inAttrs);
 
-    if (cached && !cached->expired)
+    if (cached && (!cached->expired || (settings.tarballRefreshInBackground && headers.empty()))) {
+        if (cached->expired)
+            refreshInBackground("tarball", url, name);
         return {
             Tree(store->toRealPath(cached->storePath), std::move(cached->storePath)),
             getIntAttr(cached->infoAttrs, "lastModified")
         };
+    }
 
-    auto res = downloadFile(store, url, name, immutable, headers);
+    /* Stream the tarball straight into the store as a NAR, rather
+       than storing it and unpacking it to a temporary directory. */
+    FileTransferRequest request(url);
+    request.headers = headers;
+    if (cached)
+        request.expectedETag = getStrAttr(cached->infoAttrs, "etag");
 
+    std::optional<FileTransferResult> res;
     std::optional<StorePath> unpackedStorePath;
     time_t lastModified;
 
-    if (cached && res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
+    auto useCached = [&]() {
         unpackedStorePath = std::move(cached->storePath);
         lastModified = getIntAttr(cached->infoAttrs, "lastModified");
-    } else {
-        Path tmpDir = createTempDir();
-        AutoDelete autoDelete(tmpDir, true);
-        unpackTarfile(store->toRealPath(res.storePath), tmpDir);
-        auto members = readDirectory(tmpDir);
-        if (members.size() != 1)
-            throw nix::Error("tarball '%s' contains an unexpected number of top-level files", url);
-        auto topDir = tmpDir + "/" + members.begin()->name;
-        lastModified = lstat(topDir).st_mtime;
-        unpackedStorePath = store->addToStore(name, topDir, FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, NoRepair);
+    };
+
+    try {
+        auto source = sinkToSource([&](Sink & sink) {
+            res = getFileTransfer()->download(std::move(request), sink);
+        });
+
+        /* Read ahead to find out whether the server told us that our
+           cached copy is still current. */
+        std::string head(65536, 0);
+        size_t n = 0;
+        try {
+            n = source->read(head.data(), head.size());
+        } catch (EndOfFile &) { }
+        head.resize(n);
+
+        if (head.empty() && res && res->cached) {
+            assert(cached);
+            useCached();
+        } else {
+            StringSource headSource(head);
+            ChainSource tarball(headSource, *source);
+            auto nar = sinkToSource([&](Sink & sink) {
+                try {
+                    lastModified = tarballToNar(tarball, sink);
+                } catch (Error & e) {
+                    e.addTrace({}, "while unpacking '%s'", url);
+                    throw;
+                }
+            });
+            unpackedStorePath = store->addToStoreFromDump(*nar, name, FileIngestionMethod::Recursive, htSHA256, NoRepair);
+        }
+    } catch (FileTransferError & e) {
+        if (cached) {
+            warn("%s; using cached version", e.msg());
+            useCached();
+        } else
+            throw;
     }
 
     Attrs infoAttrs({
         {"lastModified", uint64_t(lastModified)},
-        {"etag", res.etag},
+        {"etag", res ? res->etag : getStrAttr(cached->infoAttrs, "etag")},
     });
 
     getCache()->add(
@@ -81,7 +81,9 @@ MixCommonArgs::MixCommonArgs(const string & programName)
 
 void MixCommonArgs::initialFlagsProcessed()
 {
+    startupPhase("initial flags");
     initPlugins();
+    startupPhase("plugins");
     pluginsInited();
 }
 
@@ -6,6 +6,7 @@
 
 #include <atomic>
 #include <map>
+#include <mutex>
 #include <thread>
 #include <iostream>
 
@@ -69,12 +70,28 @@ private:
 
         uint64_t corruptedPaths = 0, untrustedPaths = 0;
 
+        /* For computing the rate at which paths are copied. */
+        uint64_t copiedBytes = 0;
+        std::chrono::steady_clock::time_point copiedAt;
+        double copyRate = 0;
+
         bool active = true;
         bool haveUpdate = true;
     };
 
     Sync<State> state_;
 
+    /* Held while writing to the terminal. This allows the update
+       thread to write the status line without holding the state
+       lock, so that a slow terminal doesn't block threads that are
+       only updating activities. Lock order: state_, then
+       outputLock. */
+    std::mutex outputLock;
+
+    /* Whether the status line may be drawn (i.e. state_->active, but
+       readable while holding only outputLock). */
+    std::atomic<bool> drawStatus{true};
+
     std::thread updateThread;
 
     std::condition_variable quitCV, updateCV;
@@ -89,13 +106,27 @@ public:
         , isTTY(isTTY)
     {
         state_.lock()->active = isTTY;
+        drawStatus = isTTY;
         updateThread = std::thread([&]() {
-            auto state(state_.lock());
-            while (state->active) {
-                if (!state->haveUpdate)
-                    state.wait(updateCV);
-                draw(*state);
-                state.wait_for(quitCV, std::chrono::milliseconds(50));
+            while (true) {
+                std::string line;
+                {
+                    auto state(state_.lock());
+                    if (!state->active) break;
+                    if (!state->haveUpdate)
+                        state.wait(updateCV);
+                    if (!state->active) break;
+                    line = render(*state);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(outputLock);
+                    if (drawStatus) writeToStderr(line);
+                }
+                {
+                    auto state(state_.lock());
+                    if (!state->active) break;
+                    state.wait_for(quitCV, std::chrono::milliseconds(50));
+                }
             }
         });
     }
@@ -111,7 +142,11 @@ public:
         auto state(state_.lock());
         if (!state->active) return;
         state->active = false;
-        writeToStderr("\r\e[K");
+        {
+            std::lock_guard<std::mutex> lock(outputLock);
+            drawStatus = false;
+            writeToStderr("\r\e[K");
+        }
         updateCV.notify_one();
         quitCV.notify_one();
     }
@@ -139,6 +174,7 @@ public:
     void log(State & state, Verbosity lvl, const std::string & s)
     {
         if (state.active) {
+            std::lock_guard<std::mutex> lock(outputLock);
             writeToStderr("\r\e[K" + filterANSIEscapes(s, !isTTY) + ANSI_NORMAL "\n");
             draw(state);
         } else {
@@ -324,10 +360,16 @@ public:
         updateCV.notify_one();
     }
 
+    /* Draw the status line. The caller must hold outputLock. */
     void draw(State & state)
     {
-        state.haveUpdate = false;
         if (!state.active) return;
+        writeToStderr(render(state));
+    }
+
+    std::string render(State & state)
+    {
+        state.haveUpdate = false;
 
         std::string line;
 
@@ -362,7 +404,33 @@ public:
         auto width = getWindowSize().second;
         if (width <= 0) width = std::numeric_limits<decltype(width)>::max();
 
-        writeToStderr("\r" + filterANSIEscapes(line, false, width) + ANSI_NORMAL + "\e[K");
+        return "\r" + filterANSIEscapes(line, false, width) + ANSI_NORMAL + "\e[K";
+    }
+
+    /* Return the number of bytes copied per second, measured over
+       intervals of at least a second. */
+    double getCopyRate(State & state)
+    {
+        auto & act = state.activitiesByType[actCopyPath];
+        uint64_t done = act.done;
+        for (auto & j : act.its)
+            done += j.second->done;
+
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration<double>(now - state.copiedAt).count();
+
+        if (done < state.copiedBytes) {
+            state.copiedBytes = done;
+            state.copiedAt = now;
+            state.copyRate = 0;
+        } else if (elapsed >= 1) {
+            if (state.copiedAt != std::chrono::steady_clock::time_point())
+                state.copyRate = (done - state.copiedBytes) / elapsed;
+            state.copiedBytes = done;
+            state.copiedAt = now;
+        }
+
+        return state.copyRate;
     }
 
     std::string getStatus(State & state)
@@ -425,7 +493,11 @@ public:
         if (!s1.empty() || !s2.empty()) {
             if (!res.empty()) res += ", ";
             if (s1.empty()) res += "0 copied"; else res += s1;
-            if (!s2.empty()) { res += " ("; res += s2; res += ')'; }
+            if (!s2.empty()) {
+                res += " ("; res += s2;
+                if (auto rate = getCopyRate(state)) res += fmt(" at %.1f MiB/s", rate / MiB);
+                res += ')';
+            }
         }
 
         showActivity(actFileTransfer, "%s MiB DL", "%.1f", MiB);
@@ -459,6 +531,7 @@ public:
     {
         auto state(state_.lock());
         if (state->active) {
+            std::lock_guard<std::mutex> lock(outputLock);
             std::cerr << "\r\e[K";
             Logger::writeToStdout(s);
             draw(*state);
@@ -471,6 +544,7 @@ public:
     {
         auto state(state_.lock());
         if (!state->active || !isatty(STDIN_FILENO)) return {};
+        std::lock_guard<std::mutex> lock(outputLock);
         std::cerr << fmt("\r\e[K%s ", msg);
         auto s = trim(readLine(STDIN_FILENO));
         if (s.size() != 1) return {};
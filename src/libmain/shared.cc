@@ -131,8 +131,12 @@ void initNix()
     if (sodium_init() == -1)
         throw Error("could not initialise libsodium");
 
+    startupPhase("libraries");
+
     loadConfFile();
 
+    startupPhase("configuration files");
+
     startSignalHandlerThread();
 
     /* Reset SIGCHLD to its default. */
@@ -176,6 +180,8 @@ void initNix()
     if (hasPrefix(getEnv("TMPDIR").value_or("/tmp"), "/var/folders/"))
         unsetenv("TMPDIR");
 #endif
+
+    startupPhase("process setup");
 }
 
 
@@ -282,6 +288,8 @@ void parseCmdLine(const string & programName, const Strings & args,
     std::function<bool(Strings::iterator & arg, const Strings::iterator & end)> parseArg)
 {
     LegacyArgs(programName, parseArg).parseCmdline(args);
+    startupPhase("command line");
+    printStartupPhases();
 }
 
 
@@ -0,0 +1,225 @@
+/* Benchmarks for store operations. Run with `make bench', or run the
+   libstore-bench program directly to select benchmarks by name:
+
+     libstore-bench [--paths N] [--large-size MIB] [--store URI] [NAME...]
+
+   For every store, the benchmarks first add N (by default 10000)
+   small synthetic paths that reference each other, and then measure
+   the other operations on them. Each benchmark runs once and reports
+   the time per operation (e.g. per path). By default, a local store
+   and an uncompressed `file://' binary cache in a temporary directory
+   are measured; --store measures another store instead, e.g. a daemon
+   with `unix:///path/to/socket'. Note that this adds the synthetic
+   paths to that store. The `register-valid-paths' and `gc' benchmarks
+   only apply to local stores, and `gc' deletes all synthetic paths. */
+
+#include "local-store.hh"
+#include "archive.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iostream>
+
+using namespace nix;
+
+static std::set<std::string> selected;
+
+static bool wanted(const std::string & name)
+{
+    return selected.empty() || selected.count(name);
+}
+
+/* Run `fun' once if the benchmark is selected, and print the time per
+   operation, where `fun' returns the number of operations. */
+template<typename F>
+static void measure(const std::string & storeName, const std::string & name, F fun)
+{
+    using namespace std::chrono;
+
+    if (!wanted(name)) return;
+
+    auto start = steady_clock::now();
+    size_t ops = fun();
+    auto total = duration_cast<nanoseconds>(steady_clock::now() - start);
+
+    std::cout << fmt("%-10s %-22s %10d ops %14d ns/op\n",
+        storeName, name, ops, total.count() / std::max<size_t>(ops, 1));
+}
+
+/* The references of synthetic path `n': a few earlier paths, so that
+   the paths form a DAG with closures of varying size. */
+static std::set<size_t> referencesOf(size_t n)
+{
+    std::set<size_t> res;
+    for (auto d : {1, 7, 61})
+        if (n >= (size_t) d) res.insert(n - d);
+    if (n) res.insert(n / 2);
+    return res;
+}
+
+static void benchStore(const std::string & storeName, const std::string & uri,
+    size_t nrPaths, uint64_t largeSize, const Path & tmpDir)
+{
+    auto store = openStore(uri);
+    auto localStore = store.dynamic_pointer_cast<LocalStore>();
+
+    /* Keep the temporary roots of the paths we add separate, so that
+       the gc benchmark can drop them and delete the paths. */
+    std::optional<LocalStore::TempRootsScope> tempRoots;
+    if (localStore) tempRoots.emplace(*localStore);
+
+    StorePaths paths;
+
+    auto addPaths = [&]() {
+        for (size_t n = 0; n < nrPaths; ++n) {
+            StorePathSet references;
+            std::string text = fmt("synthetic path %d\n", n);
+            for (auto i : referencesOf(n)) {
+                references.insert(paths[i]);
+                text += store->printStorePath(paths[i]) + "\n";
+            }
+            paths.push_back(store->addTextToStore(fmt("bench-%d", n), text, references));
+        }
+        return nrPaths;
+    };
+
+    /* The other benchmarks need the synthetic paths, so always add
+       them. */
+    if (wanted("add-small"))
+        measure(storeName, "add-small", addPaths);
+    else
+        addPaths();
+
+    StorePathSet allPaths(paths.begin(), paths.end());
+    std::optional<StorePath> largePath;
+
+    measure(storeName, "add-large", [&]() {
+        /* Pseudo-random contents, so that compression doesn't help. */
+        Path file = tmpDir + "/large";
+        {
+            AutoCloseFD fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (!fd) throw SysError("creating '%s'", file);
+            FdSink sink(fd.get());
+            uint64_t x = 88172645463325252ULL;
+            std::string buf(1 << 16, 0);
+            for (uint64_t done = 0; done < largeSize; done += buf.size()) {
+                for (size_t i = 0; i + 8 <= buf.size(); i += 8) {
+                    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                    memcpy(buf.data() + i, &x, 8);
+                }
+                sink(buf.substr(0, std::min<uint64_t>(buf.size(), largeSize - done)));
+            }
+        }
+        largePath = store->addToStore("bench-large", file);
+        deletePath(file);
+        return (size_t) 1;
+    });
+
+    /* Use a fresh connection to the store for the query benchmarks,
+       so that they aren't answered from the path info cache. */
+    auto store2 = openStore(uri);
+
+    measure(storeName, "query-path-info", [&]() {
+        for (auto & path : paths)
+            store2->queryPathInfo(path);
+        return nrPaths;
+    });
+
+    measure(storeName, "query-valid-paths", [&]() {
+        openStore(uri)->queryValidPaths(allPaths);
+        return nrPaths;
+    });
+
+    if (!paths.empty())
+        measure(storeName, "closure", [&]() {
+            StorePathSet closure;
+            openStore(uri)->computeFSClosure(paths.back(), closure);
+            return closure.size();
+        });
+
+    measure(storeName, "nar-from-path", [&]() {
+        NullSink sink;
+        for (auto & path : paths)
+            store2->narFromPath(path, sink);
+        return nrPaths;
+    });
+
+    measure(storeName, "copy-paths", [&]() {
+        auto dstDir = tmpDir + "/copy";
+        auto dstStore = openStore("file://" + dstDir + "?compression=none");
+        copyPaths(store, dstStore, allPaths, NoRepair, NoCheckSigs);
+        deletePath(dstDir);
+        return nrPaths;
+    });
+
+    if (!localStore) return;
+
+    StorePathSet registeredPaths;
+
+    measure(storeName, "register-valid-paths", [&]() {
+        ValidPathInfos infos;
+        for (size_t n = 0; n < nrPaths; ++n) {
+            auto text = fmt("registered path %d\n", n);
+            auto path = localStore->computeStorePathForText(fmt("bench-registered-%d", n), text, {});
+            auto realPath = localStore->toRealPath(localStore->printStorePath(path));
+            writeFile(realPath, text);
+            auto hash = hashPath(htSHA256, realPath);
+            ValidPathInfo info(path, hash.first);
+            info.narSize = hash.second;
+            info.ca = TextHash { hashString(htSHA256, text) };
+            infos.insert_or_assign(path, std::move(info));
+            registeredPaths.insert(path);
+        }
+        localStore->registerValidPaths(infos);
+        return nrPaths;
+    });
+
+    /* Only delete the paths added above, since the store may be one
+       that is in use. */
+    tempRoots.reset();
+
+    measure(storeName, "gc", [&]() {
+        GCOptions options;
+        options.action = GCOptions::gcDeleteSpecific;
+        options.pathsToDelete = allPaths;
+        options.pathsToDelete.insert(registeredPaths.begin(), registeredPaths.end());
+        if (largePath) options.pathsToDelete.insert(*largePath);
+        GCResults results;
+        localStore->collectGarbage(options, results);
+        return results.paths.size();
+    });
+}
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        size_t nrPaths = 10000;
+        uint64_t largeSize = 64 << 20;
+        std::vector<std::string> stores;
+
+        for (int n = 1; n < argc; ++n) {
+            std::string arg = argv[n];
+            if (arg == "--paths" && n + 1 < argc)
+                nrPaths = string2IntWithUnitPrefix<size_t>(argv[++n]);
+            else if (arg == "--large-size" && n + 1 < argc)
+                largeSize = string2IntWithUnitPrefix<uint64_t>(argv[++n]) << 20;
+            else if (arg == "--store" && n + 1 < argc)
+                stores.push_back(argv[++n]);
+            else
+                selected.insert(arg);
+        }
+
+        AutoDelete tmpDir(createTempDir("", "nix-bench"));
+
+        if (stores.empty()) {
+            benchStore("local", "local?root=" + (Path) tmpDir + "/local", nrPaths, largeSize, tmpDir);
+            benchStore("file", "file://" + (Path) tmpDir + "/cache?compression=none", nrPaths, largeSize, tmpDir);
+        } else
+            for (auto & uri : stores)
+                benchStore(uri, uri, nrPaths, largeSize, tmpDir);
+    });
+}
@@ -0,0 +1,15 @@
+bench: libstore-bench_RUN
+
+programs += libstore-bench
+
+libstore-bench_DIR := $(d)
+
+libstore-bench_INSTALL_DIR :=
+
+libstore-bench_SOURCES := $(wildcard $(d)/*.cc)
+
+libstore-bench_CXXFLAGS += -I src/libutil -I src/libstore -I src/libmain
+
+libstore-bench_LIBS = libmain libstore libutil
+
+libstore-bench_LDFLAGS := -pthread $(SODIUM_LIBS) $(BOOST_LDFLAGS) -lboost_context
@@ -1,6 +1,7 @@
 #include "archive.hh"
 #include "binary-cache-store.hh"
 #include "compression.hh"
+#include "chunking.hh"
 #include "derivations.hh"
 #include "fs-accessor.hh"
 #include "globals.hh"
@@ -8,11 +9,13 @@
 #include "sync.hh"
 #include "remote-fs-accessor.hh"
 #include "nar-info-disk-cache.hh"
+#include "nar-cache.hh"
 #include "nar-accessor.hh"
 #include "json.hh"
 #include "thread-pool.hh"
 #include "callback.hh"
 
+#include <algorithm>
 #include <chrono>
 #include <future>
 #include <regex>
@@ -105,6 +108,11 @@ std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
     return std::string(storePath.hashPart()) + ".narinfo";
 }
 
+std::string BinaryCacheStore::deltasFileFor(const StorePath & storePath)
+{
+    return std::string(storePath.hashPart()) + ".deltas";
+}
+
 void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 {
     auto narInfoFile = narInfoFileFor(narInfo->path);
@@ -113,13 +121,73 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 
     std::string hashPart(narInfo->path.hashPart());
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    upsertPathInfoCache(hashPart, PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), hashPart, std::shared_ptr<NarInfo>(narInfo));
+
+    {
+        auto index(index_.lock());
+        if (index->hashParts)
+            index->hashParts->insert(hashPart);
+    }
+
+    /* The Bloom filter lacks the new path, so invalidate it. This
+       must happen after the .narinfo is written and be checked
+       against the current generation rather than the one we fetched
+       earlier: writeIndex() relists the cache after publishing a
+       filter, so it either sees our .narinfo or its generation is
+       visible to us here. */
+    {
+        auto bloomFilter(bloomFilter_.lock());
+        auto generation = getFile(bloomFilterGenerationFile);
+        if (generation && !generation->empty())
+            upsertFile(bloomFilterGenerationFile, "", "text/plain");
+        bloomFilter->filter.reset();
+        bloomFilter->generation.clear();
+    }
+}
+
+void BinaryCacheStore::fetchBloomFilter(BloomFilterState & bloomFilter)
+{
+    /* Don't refetch the filter for every query when negative lookups
+       aren't cached (e.g. with --refresh). */
+    auto now = time(0);
+    if (bloomFilter.fetched && now - bloomFilter.fetched < std::max(settings.ttlNegativeNarInfoCache.get(), 60U))
+        return;
+    bloomFilter.fetched = now;
+
+    try {
+        auto generation = getFile(bloomFilterGenerationFile);
+        if (!generation || generation->empty()) {
+            bloomFilter.filter.reset();
+            bloomFilter.generation.clear();
+            return;
+        }
+        if (bloomFilter.filter && *generation == bloomFilter.generation)
+            return;
+        bloomFilter.filter.reset();
+        bloomFilter.generation.clear();
+        /* The filter may be replaced while we fetch it, so check that
+           it matches the generation. */
+        auto data = getFile(bloomFilterFile);
+        if (!data || hashString(htSHA256, *data).to_string(Base32, false) != *generation)
+            return;
+        bloomFilter.filter = BloomFilter::parse(*data);
+        bloomFilter.generation = *generation;
+    } catch (Error & e) {
+        debug("cannot fetch Bloom filter of binary cache '%s': %s", getUri(), e.what());
+        bloomFilter.filter.reset();
+        bloomFilter.generation.clear();
+    }
+}
+
+bool BinaryCacheStore::mayHavePath(std::string_view hashPart)
+{
+    if (!useIndex) return true;
+    auto bloomFilter(bloomFilter_.lock());
+    fetchBloomFilter(*bloomFilter);
+    return !bloomFilter->filter || bloomFilter->filter->mayContain(hashPart);
 }
 
 AutoCloseFD openFile(const Path & path)
@@ -141,6 +209,10 @@ struct FileSource : FdSource
     }
 };
 
+/* The first line of the chunk lists used when `chunk-nars' is
+   enabled. */
+static const std::string chunkListMagic = "nix-chunk-list-1";
+
 ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
     std::function<ValidPathInfo(HashResult)> mkInfo)
@@ -153,17 +225,29 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     /* Read the NAR simultaneously into a CompressionSink+FileSink (to
        write the compressed NAR to disk), into a HashSink (to get the
-       NAR hash), and into a NarAccessor (to get the NAR listing). */
+       NAR hash), and into a NarAccessor (to get the NAR listing and,
+       if enabled, the file hashes, in the same pass). */
     HashSink fileHashSink { htSHA256 };
     std::shared_ptr<FSAccessor> narAccessor;
     HashSink narHashSink { htSHA256 };
     {
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
-    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed);
-    TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
+    auto compressionSink = makeCompressionSink(chunkNars ? "none" : compression.get(), teeSinkCompressed,
+        parallelCompression, compressionLevel, compressionLongDistance);
+    /* When chunking, upload the chunks as we go, and write the list
+       of chunks instead of the NAR to the temporary file. */
+    std::string chunkList = fmt("%s\ncompression %s\n", chunkListMagic, compression);
+    ChunkingSink chunkingSink([&](std::string_view chunk) { chunkList += addChunk(chunk); });
+    TeeSink teeSinkUncompressed {
+        chunkNars ? (Sink &) chunkingSink : (Sink &) *compressionSink,
+        narHashSink };
     TeeSource teeSource { narSource, teeSinkUncompressed };
-    narAccessor = makeNarAccessor(teeSource);
+    narAccessor = makeNarAccessor(teeSource, writeFileHashes);
+    if (chunkNars) {
+        chunkingSink.finish();
+        (*compressionSink)(chunkList);
+    }
     compressionSink->finish();
     fileSink.flush();
     }
@@ -172,14 +256,16 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     auto info = mkInfo(narHashSink.finish());
     auto narInfo = make_ref<NarInfo>(info);
-    narInfo->compression = compression;
+    narInfo->compression = chunkNars ? "chunked" : compression.get();
     auto [fileHash, fileSize] = fileHashSink.finish();
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
     narInfo->url = "nar/" + narInfo->fileHash->to_string(Base32, false) + ".nar"
-        + (compression == "xz" ? ".xz" :
+        + (chunkNars ? ".chunks" :
+           compression == "xz" ? ".xz" :
            compression == "bzip2" ? ".bz2" :
            compression == "br" ? ".br" :
+           compression == "zstd" ? ".zst" :
            "");
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
@@ -201,7 +287,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
-    if (writeNARListing) {
+    if (writeNARListing || writeFileHashes) {
         std::ostringstream jsonOut;
 
         {
@@ -210,7 +296,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
             {
                 auto res = jsonRoot.placeholder("root");
-                listNar(res, ref<FSAccessor>(narAccessor), "", true);
+                listNar(res, ref<FSAccessor>(narAccessor), "", true, writeFileHashes);
             }
         }
 
@@ -234,6 +320,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
                 nlohmann::json json;
                 json["archive"] = target;
                 json["member"] = member;
+                json["path"] = printStorePath(info.path);
 
                 // FIXME: or should we overwrite? The previous link may point
                 // to a GC'ed file, so overwriting might be useful...
@@ -330,30 +417,538 @@ StorePath BinaryCacheStore::addToStoreFromDump(Source & dump, const string & nam
     })->path;
 }
 
+void BinaryCacheStore::loadIndex(IndexState & index)
+{
+    if (index.loaded) return;
+
+    if (diskCache) {
+        if (auto cached = diskCache->lookupIndex(getUri())) {
+            if (*cached)
+                index.hashParts = std::make_shared<StringSet>(**cached);
+            index.loaded = true;
+            return;
+        }
+    }
+
+    try {
+        if (auto data = getFile(indexFile)) {
+            index.hashParts = std::make_shared<StringSet>(
+                tokenizeString<StringSet>(*decompress("xz", *data), "\n"));
+            debug("binary cache '%s' has an index of %d paths", getUri(), index.hashParts->size());
+        }
+    } catch (Error & e) {
+        /* Don't record a failure to fetch the index, so that we try
+           again next time. */
+        debug("cannot fetch index of binary cache '%s': %s", getUri(), e.what());
+        index.loaded = true;
+        return;
+    }
+
+    /* Give the disk cache its own copy, since we add to ours. */
+    if (diskCache)
+        diskCache->upsertIndex(getUri(),
+            index.hashParts ? std::make_shared<const StringSet>(*index.hashParts) : nullptr);
+
+    index.loaded = true;
+}
+
+StorePathSet BinaryCacheStore::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
+{
+    /* Fetching the index is only worthwhile if it saves us from
+       fetching many .narinfo files. */
+    StorePathSet res, rest = paths;
+
+    if (useIndex && paths.size() > 1) {
+        auto index(index_.lock());
+        loadIndex(*index);
+        if (index->hashParts)
+            for (auto & path : paths)
+                if (index->hashParts->count(std::string(path.hashPart()))) {
+                    res.insert(path);
+                    rest.erase(path);
+                }
+    }
+
+    /* The index may be older than some paths, so look up the ones it
+       doesn't have individually. */
+    if (!rest.empty())
+        for (auto & path : Store::queryValidPaths(rest, maybeSubstitute))
+            res.insert(path);
+
+    return res;
+}
+
+void BinaryCacheStore::writeIndex()
+{
+    auto listHashParts = [&]() {
+        auto hashParts = std::make_shared<StringSet>();
+        for (auto & path : queryAllValidPaths())
+            hashParts->insert(std::string(path.hashPart()));
+        return hashParts;
+    };
+
+    auto hashParts = listHashParts();
+
+    /* Rebuild the Bloom filter, which also resizes it. Paths added
+       while we do so invalidate the filter only once its generation
+       is published, so list the cache again afterwards and retry if
+       we missed any. */
+    bool wantBloomFilter = bloomFilterCapacity || fileExists(bloomFilterFile);
+    while (wantBloomFilter) {
+        auto filter = BloomFilter::forCapacity(std::max((uint64_t) bloomFilterCapacity, (uint64_t) hashParts->size()));
+        for (auto & hashPart : *hashParts)
+            filter.insert(hashPart);
+        auto data = filter.serialise();
+        auto generation = hashString(htSHA256, data).to_string(Base32, false);
+        upsertFile(bloomFilterFile, std::move(data), "application/octet-stream");
+        upsertFile(bloomFilterGenerationFile, std::string(generation), "text/plain");
+
+        auto hashParts2 = listHashParts();
+        bool complete = std::includes(hashParts->begin(), hashParts->end(), hashParts2->begin(), hashParts2->end());
+        hashParts = hashParts2;
+        if (complete) {
+            auto bloomFilter(bloomFilter_.lock());
+            bloomFilter->filter = std::move(filter);
+            bloomFilter->generation = generation;
+            bloomFilter->fetched = time(0);
+            break;
+        }
+    }
+
+    upsertFile(indexFile,
+        std::string(*compress("xz", concatStringsSep("\n", *hashParts) + "\n")),
+        "application/x-xz");
+
+    if (diskCache)
+        diskCache->upsertIndex(getUri(), std::make_shared<const StringSet>(*hashParts));
+
+    {
+        auto index(index_.lock());
+        index->hashParts = hashParts;
+        index->loaded = true;
+    }
+}
+
 bool BinaryCacheStore::isValidPathUncached(const StorePath & storePath)
 {
     // FIXME: this only checks whether a .narinfo with a matching hash
     // part exists. So ‘f4kb...-foo’ matches ‘f4kb...-bar’, even
     // though they shouldn't. Not easily fixed.
+    if (!mayHavePath(storePath.hashPart())) return false;
     return fileExists(narInfoFileFor(storePath));
 }
 
+std::string BinaryCacheStore::addChunk(std::string_view chunk)
+{
+    auto hash = hashString(htSHA256, chunk).to_string(Base32, false);
+    auto key = "chunks/" + hash;
+
+    if (!fileExists(key)) {
+        StringSink compressed;
+        auto compressionSink = makeCompressionSink(compression, compressed,
+            parallelCompression, compressionLevel, compressionLongDistance);
+        (*compressionSink)(chunk);
+        compressionSink->finish();
+        upsertFile(key, std::move(*compressed.s), "application/x-nix-nar-chunk");
+        stats.narWriteChunks++;
+    } else
+        stats.narWriteChunksAverted++;
+
+    return fmt("%s %d\n", hash, chunk.size());
+}
+
+BinaryCacheStore::ChunkList BinaryCacheStore::readChunkList(const NarInfo & info)
+{
+    auto chunkList = getFile(info.url);
+    if (!chunkList)
+        throw SubstituteGone("file '%s' does not exist in binary cache '%s'", info.url, getUri());
+
+    auto lines = tokenizeString<std::vector<std::string>>(*chunkList, "\n");
+    if (lines.size() < 2 || lines[0] != chunkListMagic || !hasPrefix(lines[1], "compression "))
+        throw Error("chunk list '%s' in binary cache '%s' is corrupt", info.url, getUri());
+
+    ChunkList list;
+    list.compression = lines[1].substr(12);
+
+    uint64_t offset = 0;
+    for (size_t n = 2; n < lines.size(); ++n) {
+        auto fields = tokenizeString<std::vector<std::string>>(lines[n], " ");
+        auto size = fields.size() == 2 ? string2Int<uint64_t>(fields[1]) : std::nullopt;
+        if (!size)
+            throw Error("chunk list '%s' in binary cache '%s' is corrupt", info.url, getUri());
+        list.chunks.push_back({fields[0], offset, *size});
+        offset += *size;
+    }
+
+    return list;
+}
+
+std::pair<size_t, size_t> BinaryCacheStore::ChunkList::overlapping(uint64_t offset, uint64_t length) const
+{
+    size_t begin = std::upper_bound(chunks.begin(), chunks.end(), offset,
+        [](uint64_t offset, const ChunkList::Chunk & chunk) {
+            return offset < chunk.offset + chunk.size;
+        }) - chunks.begin();
+    size_t end = begin;
+    while (end < chunks.size() && chunks[end].offset < offset + length) end++;
+    return {begin, end};
+}
+
+void BinaryCacheStore::fetchChunks(const ChunkList & list, size_t begin, size_t end,
+    std::function<void(const ChunkList::Chunk &, std::string_view)> f)
+{
+    std::vector<size_t> indices;
+    for (size_t n = begin; n < end; ++n)
+        indices.push_back(n);
+    fetchChunks(list, indices, f);
+}
+
+void BinaryCacheStore::fetchChunks(const ChunkList & list, const std::vector<size_t> & indices,
+    std::function<void(const ChunkList::Chunk &, std::string_view)> f)
+{
+    const size_t window = 8;
+    for (size_t start = 0; start < indices.size(); start += window) {
+        size_t stop = std::min(start + window, indices.size());
+
+        std::vector<std::shared_ptr<std::string>> data(stop - start);
+
+        ThreadPool pool(window);
+        for (size_t n = start; n < stop; ++n)
+            pool.enqueue([&, n]() {
+                auto & chunk = list.chunks[indices[n]];
+                auto compressed = getFile("chunks/" + chunk.hash);
+                if (!compressed)
+                    throw SubstituteGone("chunk '%s' does not exist in binary cache '%s'", chunk.hash, getUri());
+                auto & d = data[n - start];
+                d = decompress(list.compression, *compressed);
+                if (d->size() != chunk.size
+                    || hashString(htSHA256, *d).to_string(Base32, false) != chunk.hash)
+                    throw Error("chunk '%s' in binary cache '%s' is corrupt", chunk.hash, getUri());
+            });
+        pool.process();
+
+        for (size_t n = start; n < stop; ++n) {
+            f(list.chunks[indices[n]], *data[n - start]);
+            data[n - start].reset();
+        }
+    }
+}
+
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    auto list = readChunkList(info);
+    fetchChunks(list, 0, list.chunks.size(), [&](const ChunkList::Chunk &, std::string_view data) {
+        sink(data);
+    });
+}
+
+bool BinaryCacheStore::narFromLinks(const NarInfo & info, Sink & sink)
+{
+    /* The NAR is written as a sequence of segments: NAR framing
+       (generated from the listing), file contents taken from the
+       `.links' directory, and file contents taken from the chunks. */
+    struct Segment
+    {
+        std::string data;
+        std::optional<Path> linkPath;
+        bool remote = false;
+        uint64_t offset = 0, size = 0;
+    };
+
+    std::vector<Segment> segments;
+    ChunkList list;
+    size_t filesReused = 0, filesFetched = 0;
+    uint64_t bytesReused = 0;
+
+    try {
+        auto listing = getFile(std::string(info.path.hashPart()) + ".ls");
+        if (!listing) return false;
+
+        auto json = nlohmann::json::parse(*listing);
+        if (json.value("version", 0) != 1 || !json.contains("root")) return false;
+
+        /* Note: this is where LocalStore keeps its links, unless it's
+           a chroot store. Reused files are verified by the NAR hash
+           check when the path is added to the store. */
+        auto linksDir = settings.nixStore + "/.links";
+
+        std::string pending;
+        LambdaSink framing([&](std::string_view data) { pending.append(data); });
+
+        auto flush = [&]() {
+            if (pending.empty()) return;
+            segments.push_back({.data = std::move(pending)});
+            pending.clear();
+        };
+
+        std::function<void(const nlohmann::json &)> serialise;
+
+        serialise = [&](const nlohmann::json & node) {
+            auto type = node.at("type").get<std::string>();
+
+            framing << "(";
+
+            if (type == "regular") {
+                framing << "type" << "regular";
+                bool executable = node.value("executable", false);
+                if (executable)
+                    framing << "executable" << "";
+                uint64_t size = node.at("size");
+                framing << "contents" << size;
+                if (size) {
+                    if (!node.contains("narHash"))
+                        throw Error("NAR listing doesn't have file hashes");
+                    auto linkPath = linksDir + "/" +
+                        Hash::parseAny(node["narHash"].get<std::string>(), htSHA256).to_string(Base32, false);
+                    struct stat st;
+                    flush();
+                    if (stat(linkPath.c_str(), &st) == 0
+                        && S_ISREG(st.st_mode)
+                        && (uint64_t) st.st_size == size
+                        && (bool) (st.st_mode & S_IXUSR) == executable)
+                    {
+                        segments.push_back({.linkPath = linkPath, .size = size});
+                        filesReused++;
+                        bytesReused += size;
+                    } else {
+                        segments.push_back({.remote = true, .offset = node.at("narOffset").get<uint64_t>(), .size = size});
+                        filesFetched++;
+                    }
+                    writePadding(size, framing);
+                }
+            }
+
+            else if (type == "directory") {
+                framing << "type" << "directory";
+                /* JSON objects are sorted by key, like NAR entries. */
+                for (auto & [name, child] : node.at("entries").items()) {
+                    framing << "entry" << "(" << "name" << name << "node";
+                    serialise(child);
+                    framing << ")";
+                }
+            }
+
+            else if (type == "symlink")
+                framing << "type" << "symlink" << "target" << node.at("target").get<std::string>();
+
+            else
+                throw Error("NAR listing has a file of unsupported type '%s'", type);
+
+            framing << ")";
+        };
+
+        framing << narVersionMagic1;
+        serialise(json["root"]);
+        flush();
+
+        if (!filesReused) return false;
+
+        list = readChunkList(info);
+    } catch (Error & e) {
+        debug("not reusing local files for '%s': %s", printStorePath(info.path), e.msg());
+        return false;
+    }
+
+    printMsg(lvlTalkative, "reusing %d files (%d bytes) of '%s' from the local store, fetching %d",
+        filesReused, bytesReused, printStorePath(info.path), filesFetched);
+
+    /* Fetch the chunks that contain the files that aren't available
+       locally. */
+    std::vector<size_t> needed;
+    for (auto & segment : segments)
+        if (segment.remote) {
+            auto [begin, end] = list.overlapping(segment.offset, segment.size);
+            for (auto n = begin; n < end; ++n)
+                if (needed.empty() || needed.back() < n)
+                    needed.push_back(n);
+        }
+
+    size_t next = 0;
+    uint64_t done = 0;
+
+    /* Write the segments up to the next one that needs to be fetched. */
+    auto writeLocal = [&]() {
+        for (; next < segments.size() && !segments[next].remote; ++next) {
+            auto & segment = segments[next];
+            if (segment.linkPath)
+                readFile(*segment.linkPath, sink);
+            else
+                sink(segment.data);
+        }
+    };
+
+    writeLocal();
+
+    fetchChunks(list, needed, [&](const ChunkList::Chunk & chunk, std::string_view data) {
+        while (next < segments.size()) {
+            auto & segment = segments[next];
+            auto start = segment.offset + done;
+            if (start >= chunk.offset + chunk.size) return;
+            assert(start >= chunk.offset);
+            auto end = std::min(segment.offset + segment.size, chunk.offset + chunk.size);
+            sink(data.substr(start - chunk.offset, end - start));
+            done += end - start;
+            if (done < segment.size) return;
+            next++;
+            done = 0;
+            writeLocal();
+        }
+    });
+
+    if (next != segments.size())
+        throw Error("NAR of '%s' in binary cache '%s' is truncated", printStorePath(info.path), getUri());
+
+    return true;
+}
+
+void BinaryCacheStore::addDelta(const StorePath & base, const StorePath & target)
+{
+    if (base == target)
+        throw Error("cannot add a delta of '%s' against itself", printStorePath(target));
+
+    auto baseInfo = queryPathInfo(base);
+    queryPathInfo(target);
+
+    StringSink baseNar;
+    narFromPath(base, baseNar);
+
+    StringSink delta;
+    {
+        LengthSink narSize;
+        auto compressor = makeDeltaCompressionSink(*baseNar.s, delta, compressionLevel);
+        TeeSink tee { *compressor, narSize };
+        narFromPath(target, tee);
+        compressor->finish();
+
+        printInfo("delta of '%s' against '%s' is %d bytes (%.1f%% of the NAR)",
+            printStorePath(target), printStorePath(base), delta.s->size(),
+            narSize.length ? delta.s->size() * 100.0 / narSize.length : 0.0);
+    }
+
+    auto url = fmt("deltas/%s-%s.nar.zst", target.hashPart(), base.hashPart());
+    auto size = delta.s->size();
+    upsertFile(url, std::move(*delta.s), "application/x-nix-nar-delta");
+
+    /* Replace any previous delta against the same base. */
+    auto deltasFile = deltasFileFor(target);
+    std::string deltas;
+    if (auto old = getFile(deltasFile))
+        for (auto & line : tokenizeString<Strings>(*old, "\n"))
+            if (!hasPrefix(line, printStorePath(base) + " "))
+                deltas += line + "\n";
+    deltas += fmt("%s %s %s %d\n", printStorePath(base), baseInfo->narHash.to_string(Base32, true), url, size);
+    upsertFile(deltasFile, std::move(deltas), "text/plain");
+}
+
+bool BinaryCacheStore::narFromDelta(const NarInfo & info, Sink & sink)
+{
+    /* The base paths are read directly from the Nix store, so they
+       must be printed the same way. */
+    if (storeDir != settings.nixStore) return false;
+
+    struct Delta
+    {
+        StorePath base;
+        Hash baseNarHash;
+        std::string url;
+        uint64_t size;
+    };
+
+    std::vector<Delta> candidates;
+
+    try {
+        auto data = getFile(deltasFileFor(info.path));
+        if (!data) return false;
+
+        for (auto & line : tokenizeString<Strings>(*data, "\n")) {
+            auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+            if (fields.size() != 4) continue;
+            auto base = parseStorePath(fields[0]);
+            auto size = string2Int<uint64_t>(fields[3]);
+            if (!size || !pathExists(printStorePath(base))) continue;
+            candidates.push_back({base, Hash::parseAnyPrefixed(fields[1]), fields[2], *size});
+        }
+    } catch (Error & e) {
+        warn("cannot read the deltas of '%s' in binary cache '%s': %s",
+            printStorePath(info.path), getUri(), e.msg());
+        return false;
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+        [](const Delta & a, const Delta & b) { return a.size < b.size; });
+
+    for (auto & delta : candidates) {
+        /* Skip bases that have been modified in the local store, since
+           applying the delta would produce garbage. */
+        StringSink baseNar;
+        {
+            HashSink hashSink(delta.baseNarHash.type);
+            TeeSink tee { baseNar, hashSink };
+            try {
+                dumpPath(printStorePath(delta.base), tee);
+            } catch (SysError & e) {
+                continue;
+            }
+            if (hashSink.finish().first != delta.baseNarHash) continue;
+        }
+
+        auto deltaData = getFile(delta.url);
+        if (!deltaData) continue;
+
+        debug("reconstructing '%s' from '%s' using a delta of %d bytes",
+            printStorePath(info.path), printStorePath(delta.base), deltaData->size());
+
+        auto decompressor = makeDeltaDecompressionSink(*baseNar.s, sink);
+        (*decompressor)(*deltaData);
+        decompressor->finish();
+        return true;
+    }
+
+    return false;
+}
+
 void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
 {
     auto info = queryPathInfo(storePath).cast<const NarInfo>();
 
+    auto narCache = getNarCache();
+
+    if (narCache && narCache->get(info->narHash, info->narSize, sink))
+        return;
+
+    /* Add the NAR to the NAR cache while passing it on. */
+    std::unique_ptr<NarCache::Writer> cacheWriter;
+    if (narCache) cacheWriter = narCache->add(info->narHash);
+
     LengthSink narSize;
-    TeeSink tee { sink, narSize };
+    LambdaSink tee([&](std::string_view data) {
+        sink(data);
+        narSize(data);
+        if (cacheWriter) (*cacheWriter)(data);
+    });
 
-    auto decompressor = makeDecompressionSink(info->compression, tee);
+    if (settings.substituteDeltas && narFromDelta(*info, tee)) {
+        /* Reconstructed from a local path and a delta. */
+    }
 
-    try {
-        getFile(info->url, *decompressor);
-    } catch (NoSuchBinaryCacheFile & e) {
-        throw SubstituteGone(e.info());
+    else if (info->compression == "chunked") {
+        if (!settings.substituteFromLinks || !narFromLinks(*info, tee))
+            narFromChunks(*info, tee);
+    }
+
+    else {
+        auto decompressor = makeDecompressionSink(info->compression, tee, true);
+
+        try {
+            getFile(info->url, *decompressor);
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(e.info());
+        }
+
+        decompressor->finish();
     }
 
-    decompressor->finish();
+    if (cacheWriter) cacheWriter->commit();
 
     stats.narRead++;
     //stats.narReadCompressedBytes += nar->size(); // FIXME
@@ -369,6 +964,13 @@ void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
         fmt("querying info about '%s' on '%s'", storePathS, uri), Logger::Fields{storePathS, uri});
     PushActivity pact(act->id);
 
+    try {
+        if (!mayHavePath(storePath.hashPart()))
+            return callback(nullptr);
+    } catch (...) {
+        return callback.rethrow();
+    }
+
     auto narInfoFile = narInfoFileFor(storePath);
 
     auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
@@ -447,20 +1049,34 @@ StorePath BinaryCacheStore::addTextToStore(const string & name, const string & s
 
 std::optional<const Realisation> BinaryCacheStore::queryRealisation(const DrvOutput & id)
 {
+    if (diskCache) {
+        auto [outcome, realisation] = diskCache->lookupRealisation(getUri(), id);
+        if (outcome == NarInfoDiskCache::oValid)
+            return *realisation;
+        if (outcome == NarInfoDiskCache::oInvalid)
+            return std::nullopt;
+    }
+
     auto outputInfoFilePath = realisationsPrefix + "/" + id.to_string() + ".doi";
     auto rawOutputInfo = getFile(outputInfoFilePath);
 
-    if (rawOutputInfo) {
-        return {Realisation::fromJSON(
-            nlohmann::json::parse(*rawOutputInfo), outputInfoFilePath)};
-    } else {
-        return std::nullopt;
-    }
+    std::optional<const Realisation> realisation;
+    if (rawOutputInfo)
+        realisation.emplace(Realisation::fromJSON(
+            nlohmann::json::parse(*rawOutputInfo), outputInfoFilePath));
+
+    if (diskCache)
+        diskCache->upsertRealisation(getUri(), id,
+            realisation ? std::make_shared<const Realisation>(*realisation) : nullptr);
+
+    return realisation;
 }
 
 void BinaryCacheStore::registerDrvOutput(const Realisation& info) {
     auto filePath = realisationsPrefix + "/" + info.id.to_string() + ".doi";
     upsertFile(filePath, info.toJSON().dump(), "application/json");
+    if (diskCache)
+        diskCache->upsertRealisation(getUri(), info.id, std::make_shared<const Realisation>(info));
 }
 
 ref<FSAccessor> BinaryCacheStore::getFSAccessor()
@@ -468,6 +1084,37 @@ ref<FSAccessor> BinaryCacheStore::getFSAccessor()
     return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache);
 }
 
+std::shared_ptr<FSAccessor> BinaryCacheStore::getChunkedNarAccessor(const StorePath & storePath)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+    if (info->compression != "chunked") return nullptr;
+
+    auto listing = getFile(std::string(storePath.hashPart()) + ".ls");
+    if (!listing) return nullptr;
+
+    auto list = std::make_shared<ChunkList>(readChunkList(*info));
+    auto self = std::dynamic_pointer_cast<BinaryCacheStore>(shared_from_this());
+
+    return makeLazyNarAccessor(*listing,
+        [self, list, path(printStorePath(storePath))](uint64_t offset, uint64_t length) {
+            auto [begin, end] = list->overlapping(offset, length);
+
+            std::string res;
+            res.reserve(length);
+
+            self->fetchChunks(*list, begin, end, [&](const ChunkList::Chunk & chunk, std::string_view data) {
+                auto from = std::max(offset, chunk.offset) - chunk.offset;
+                auto to = std::min(offset + length, chunk.offset + chunk.size) - chunk.offset;
+                res.append(data.substr(from, to - from));
+            });
+
+            if (res.size() != length)
+                throw Error("NAR of '%s' in binary cache '%s' is truncated", path, self->getUri());
+
+            return res;
+        });
+}
+
 void BinaryCacheStore::addSignatures(const StorePath & storePath, const StringSet & sigs)
 {
     /* Note: this is inherently racy since there is no locking on
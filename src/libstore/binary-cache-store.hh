@@ -4,6 +4,7 @@
 #include "store-api.hh"
 
 #include "pool.hh"
+#include "bloom-filter.hh"
 
 #include <atomic>
 
@@ -15,13 +16,25 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
 {
     using StoreConfig::StoreConfig;
 
-    const Setting<std::string> compression{(StoreConfig*) this, "xz", "compression", "NAR compression method ('xz', 'bzip2', or 'none')"};
+    const Setting<std::string> compression{(StoreConfig*) this, "xz", "compression", "NAR compression method ('xz', 'bzip2', 'br', 'zstd', or 'none')"};
     const Setting<bool> writeNARListing{(StoreConfig*) this, false, "write-nar-listing", "whether to write a JSON file listing the files in each NAR"};
+    const Setting<bool> writeFileHashes{(StoreConfig*) this, false, "write-file-hashes",
+        "whether to include the hash of every file in the NAR listing (implies 'write-nar-listing'), so that clients can reuse files they already have when substituting chunked NARs"};
     const Setting<bool> writeDebugInfo{(StoreConfig*) this, false, "index-debug-info", "whether to index DWARF debug info files by build ID"};
     const Setting<Path> secretKeyFile{(StoreConfig*) this, "", "secret-key", "path to secret key used to sign the binary cache"};
     const Setting<Path> localNarCache{(StoreConfig*) this, "", "local-nar-cache", "path to a local cache of NARs"};
     const Setting<bool> parallelCompression{(StoreConfig*) this, false, "parallel-compression",
-        "enable multi-threading compression, available for xz only currently"};
+        "enable multi-threading compression, available for xz and zstd only currently; the NARs can then also be decompressed on multiple threads"};
+    const Setting<bool> chunkNars{(StoreConfig*) this, false, "chunk-nars",
+        "whether to split NARs into content-defined chunks that are stored (and deduplicated) individually under 'chunks/'"};
+    const Setting<std::optional<int>> compressionLevel{(StoreConfig*) this, {}, "compression-level",
+        "NAR compression level (empty for the default), available for zstd only currently"};
+    const Setting<bool> compressionLongDistance{(StoreConfig*) this, false, "compression-long-distance",
+        "enable long-distance matching for NAR compression, available for zstd only currently"};
+    const Setting<bool> useIndex{(StoreConfig*) this, true, "use-index",
+        "whether to answer path queries from the cache's index and Bloom filter of valid paths, if it has them (paths missing from the index are still looked up individually)"};
+    const Setting<uint64_t> bloomFilterCapacity{(StoreConfig*) this, 0, "bloom-filter-capacity",
+        "if non-zero, make 'nix store write-index' create a Bloom filter of the valid paths in the cache, sized for at least this many paths (an existing filter is always rebuilt)"};
 };
 
 class BinaryCacheStore : public virtual BinaryCacheStoreConfig, public virtual Store
@@ -36,6 +49,22 @@ protected:
     // The prefix under which realisation infos will be stored
     const std::string realisationsPrefix = "/realisations";
 
+    /* The file listing the hash parts of all valid paths in the
+       cache, one per line, compressed with xz. */
+    const std::string indexFile = "nix-cache-index.xz";
+
+    /* A Bloom filter of the hash parts of all valid paths in the
+       cache, which lets clients skip fetching the .narinfo of paths
+       that are definitely missing. It is only written by
+       writeIndex(), since concurrent writers updating a shared
+       filter would lose each other's paths. */
+    const std::string bloomFilterFile = "nix-cache-bloom";
+
+    /* The SHA-256 hash of the Bloom filter, if it is up to date, or
+       empty. Adding a path to the cache empties it, so that the filter
+       isn't used until writeIndex() rebuilds it. */
+    const std::string bloomFilterGenerationFile = "nix-cache-bloom-generation";
+
     BinaryCacheStore(const Params & params);
 
 public:
@@ -71,10 +100,98 @@ private:
 
     std::string narMagic;
 
+    struct IndexState
+    {
+        bool loaded = false;
+        /* Null if the cache doesn't have an index. */
+        std::shared_ptr<StringSet> hashParts;
+    };
+
+    Sync<IndexState> index_;
+
+    /* Load the cache's index, if it has one and we haven't done so
+       yet. */
+    void loadIndex(IndexState & index);
+
+    struct BloomFilterState
+    {
+        /* When we last tried to fetch the filter. */
+        time_t fetched = 0;
+        /* The contents of the generation file of 'filter'. */
+        std::string generation;
+        /* Empty if the cache doesn't have an up-to-date filter. */
+        std::optional<BloomFilter> filter;
+    };
+
+    Sync<BloomFilterState> bloomFilter_;
+
+    /* Fetch the cache's Bloom filter if it has changed, unless we
+       checked recently. */
+    void fetchBloomFilter(BloomFilterState & bloomFilter);
+
+    /* Return false if the cache definitely doesn't have a path with
+       the given hash part. */
+    bool mayHavePath(std::string_view hashPart);
+
     std::string narInfoFileFor(const StorePath & storePath);
 
+    /* The file listing the deltas from which the NAR of 'storePath'
+       can be reconstructed, one per line, as '<base path> <base NAR
+       hash> <URL> <size>'. */
+    std::string deltasFileFor(const StorePath & storePath);
+
     void writeNarInfo(ref<NarInfo> narInfo);
 
+    /* Upload a NAR chunk unless it already exists. Returns its line
+       in the chunk list. */
+    std::string addChunk(std::string_view chunk);
+
+    struct ChunkList
+    {
+        std::string compression;
+
+        struct Chunk
+        {
+            std::string hash;
+            /* The position of the chunk in the NAR. */
+            uint64_t offset, size;
+        };
+
+        std::vector<Chunk> chunks;
+
+        /* Return the range of chunks that overlap the bytes
+           [offset, offset + length) of the NAR. */
+        std::pair<size_t, size_t> overlapping(uint64_t offset, uint64_t length) const;
+    };
+
+    ChunkList readChunkList(const NarInfo & info);
+
+    /* Fetch the chunks 'begin' to 'end' (exclusive) of a chunked NAR,
+       a few at a time in parallel, and pass them to 'f' in order
+       after verifying them. */
+    void fetchChunks(const ChunkList & list, size_t begin, size_t end,
+        std::function<void(const ChunkList::Chunk &, std::string_view)> f);
+
+    /* Likewise, for the chunks with the given (ascending) indices. */
+    void fetchChunks(const ChunkList & list, const std::vector<size_t> & indices,
+        std::function<void(const ChunkList::Chunk &, std::string_view)> f);
+
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
+    /* Write the NAR of a chunked path, taking the contents of files
+       that exist in the local store's `.links' directory from there,
+       and fetching only the chunks that contain the other files (see
+       the `substitute-from-links' setting). This requires a NAR
+       listing with file hashes. Returns false, without writing
+       anything, if that's not available or no files can be reused. */
+    bool narFromLinks(const NarInfo & info, Sink & sink);
+
+    /* Write the NAR of a path by applying the smallest of its deltas
+       whose base path exists in the local Nix store (see the
+       `substitute-deltas' setting). Returns false, without writing
+       anything, if there is no such delta. */
+    bool narFromDelta(const NarInfo & info, Sink & sink);
+
     ref<const ValidPathInfo> addToStoreCommon(
         Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
         std::function<ValidPathInfo(HashResult)> mkInfo);
@@ -83,6 +200,21 @@ public:
 
     bool isValidPathUncached(const StorePath & path) override;
 
+    StorePathSet queryValidPaths(const StorePathSet & paths,
+        SubstituteFlag maybeSubstitute = NoSubstitute) override;
+
+    /* Write the cache's index from the set of valid paths in the
+       cache. The index is not updated when paths are added later, so
+       this should be repeated after adding paths; until then,
+       queryValidPaths() looks them up individually. */
+    void writeIndex();
+
+    /* Compute a delta that reconstructs the NAR of 'target' from the
+       NAR of 'base', both of which must be in the cache, and publish
+       it so that clients that have 'base' can download the delta
+       instead of the full NAR of 'target'. */
+    void addDelta(const StorePath & base, const StorePath & target);
+
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
@@ -110,6 +242,12 @@ public:
 
     ref<FSAccessor> getFSAccessor() override;
 
+    /* Return an accessor for the NAR of 'storePath' that only
+       fetches the chunks containing the files that are read. Returns
+       null if the NAR isn't chunked or if the cache doesn't have a
+       listing of it (see 'write-nar-listing'). */
+    std::shared_ptr<FSAccessor> getChunkedNarAccessor(const StorePath & storePath);
+
     void addSignatures(const StorePath & storePath, const StringSet & sigs) override;
 
     std::shared_ptr<std::string> getBuildLog(const StorePath & path) override;
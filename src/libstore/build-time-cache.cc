@@ -0,0 +1,222 @@
+#include "build-time-cache.hh"
+#include "names.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+#include "store-api.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists BuildTimes (
+    name     text primary key not null,
+    millis   integer not null
+);
+
+create table if not exists BuildMemory (
+    name     text primary key not null,
+    bytes    integer not null
+);
+
+-- Times are in microseconds, except for the start and stop times
+-- (seconds since the epoch). Unknown measurements are null.
+create table if not exists BuildHistory (
+    id               integer primary key autoincrement not null,
+    drvPath          text not null,
+    status           integer not null,
+    startTime        integer not null,
+    stopTime         integer not null,
+    cpuUser          integer,
+    cpuSystem        integer,
+    peakMemory       integer,
+    ioRead           integer,
+    ioWritten        integer,
+    lockTime         integer,
+    setupTime        integer,
+    scanTime         integer,
+    registrationTime integer
+);
+
+)sql";
+
+struct BuildTimeCache
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertTime, queryTime, insertMemory, queryMemory, insertHistory;
+    };
+
+    Sync<State> _state;
+
+    BuildTimeCache()
+    {
+        auto state(_state.lock());
+
+        /* Root (e.g. the daemon) keeps the build times with the rest
+           of the state of the store rather than in its home
+           directory. */
+        Path dbPath = getuid() == 0
+            ? settings.nixStateDir + "/build-times-v1.sqlite"
+            : getCacheDir() + "/nix/build-times-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertTime.create(state->db,
+            "insert or replace into BuildTimes(name, millis) values (?, ?)");
+
+        state->queryTime.create(state->db,
+            "select millis from BuildTimes where name = ?");
+
+        state->insertMemory.create(state->db,
+            "insert or replace into BuildMemory(name, bytes) values (?, ?)");
+
+        state->queryMemory.create(state->db,
+            "select bytes from BuildMemory where name = ?");
+
+        state->insertHistory.create(state->db,
+            "insert into BuildHistory(drvPath, status, startTime, stopTime, cpuUser, cpuSystem, peakMemory, "
+            "ioRead, ioWritten, lockTime, setupTime, scanTime, registrationTime) "
+            "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    }
+};
+
+/* Return the cache, or nullptr if it can't be opened. */
+static BuildTimeCache * getCache()
+{
+    static std::unique_ptr<BuildTimeCache> cache = []() -> std::unique_ptr<BuildTimeCache> {
+        try {
+            return std::make_unique<BuildTimeCache>();
+        } catch (Error & e) {
+            debug("cannot open the build time cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+
+    return cache.get();
+}
+
+/* Build times are stored as fixed-point numbers (milliseconds) in
+   SQLite's integer binding, since SQLiteStmt has no binding for
+   doubles. */
+
+std::optional<double> lookupBuildTime(std::string_view drvName)
+{
+    auto cache = getCache();
+    if (!cache) return {};
+
+    auto name = DrvName(drvName).name;
+
+    try {
+        return retrySQLite<std::optional<double>>([&]() -> std::optional<double> {
+            auto state(cache->_state.lock());
+            auto query(state->queryTime.use()(name));
+            if (!query.next()) return {};
+            return query.getInt(0) / 1000.0;
+        });
+    } catch (Error & e) {
+        debug("cannot look up '%s' in the build time cache: %s", name, e.what());
+        return {};
+    }
+}
+
+void recordBuildTime(std::string_view drvName, double seconds)
+{
+    auto cache = getCache();
+    if (!cache) return;
+
+    auto name = DrvName(drvName).name;
+
+    /* Keep a moving average, so that a single unusually fast or slow
+       build doesn't dominate the estimate. */
+    auto previous = lookupBuildTime(drvName);
+    if (previous) seconds = (*previous + seconds) / 2;
+
+    try {
+        retrySQLite<void>([&]() {
+            auto state(cache->_state.lock());
+            state->insertTime.use()(name)((int64_t) (seconds * 1000)).exec();
+        });
+    } catch (Error & e) {
+        debug("cannot write '%s' to the build time cache: %s", name, e.what());
+    }
+}
+
+std::optional<uint64_t> lookupBuildMemory(std::string_view drvName)
+{
+    auto cache = getCache();
+    if (!cache) return {};
+
+    auto name = DrvName(drvName).name;
+
+    try {
+        return retrySQLite<std::optional<uint64_t>>([&]() -> std::optional<uint64_t> {
+            auto state(cache->_state.lock());
+            auto query(state->queryMemory.use()(name));
+            if (!query.next()) return {};
+            return query.getInt(0);
+        });
+    } catch (Error & e) {
+        debug("cannot look up '%s' in the build time cache: %s", name, e.what());
+        return {};
+    }
+}
+
+void recordBuildMemory(std::string_view drvName, uint64_t bytes)
+{
+    auto cache = getCache();
+    if (!cache) return;
+
+    auto name = DrvName(drvName).name;
+
+    /* Follow increases right away, since underestimating is what
+       causes builds to run out of memory, but decreases only
+       gradually. */
+    auto previous = lookupBuildMemory(drvName);
+    if (previous && *previous > bytes) bytes = (*previous + bytes) / 2;
+
+    try {
+        retrySQLite<void>([&]() {
+            auto state(cache->_state.lock());
+            state->insertMemory.use()(name)((int64_t) bytes).exec();
+        });
+    } catch (Error & e) {
+        debug("cannot write '%s' to the build time cache: %s", name, e.what());
+    }
+}
+
+void recordBuildHistory(std::string_view drvPath, const BuildResult & result)
+{
+    auto cache = getCache();
+    if (!cache) return;
+
+    auto metrics = result.getMetrics();
+
+    try {
+        retrySQLite<void>([&]() {
+            auto state(cache->_state.lock());
+            auto query(state->insertHistory.use()
+                (drvPath)
+                (result.status)
+                (result.startTime)
+                (result.stopTime));
+            for (auto name : {"cpuUser", "cpuSystem", "peakMemory", "ioRead", "ioWritten",
+                     "lockTime", "setupTime", "scanTime", "registrationTime"})
+            {
+                auto i = metrics.find(name);
+                query(i != metrics.end() ? i->second : 0, i != metrics.end());
+            }
+            query.exec();
+        });
+    } catch (Error & e) {
+        debug("cannot write '%s' to the build history: %s", drvPath, e.what());
+    }
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+struct BuildResult;
+
+/* A persistent record of how long builds took and how much memory
+   they used, keyed by the name of the derivation without its version
+   (e.g. `gcc'), so that estimates carry over to new versions of a
+   package. It is used by the build scheduler to start builds on the
+   critical path first, and to start builds only when there is enough
+   memory for them. Errors accessing the cache are ignored, since it
+   is only a heuristic. */
+
+/* Return the estimated duration in seconds of building a derivation
+   with the given name, or nothing if it has never been built. */
+std::optional<double> lookupBuildTime(std::string_view drvName);
+
+/* Record that building a derivation with the given name took
+   `seconds' seconds. */
+void recordBuildTime(std::string_view drvName, double seconds);
+
+/* Return the estimated peak memory use in bytes of building a
+   derivation with the given name, or nothing if it is unknown. */
+std::optional<uint64_t> lookupBuildMemory(std::string_view drvName);
+
+/* Record that building a derivation with the given name used at most
+   `bytes' bytes of memory. */
+void recordBuildMemory(std::string_view drvName, uint64_t bytes);
+
+/* Append the result of a build of `drvPath' to the build history (see
+   `record-build-history'). */
+void recordBuildHistory(std::string_view drvPath, const BuildResult & result);
+
+}
@@ -2,7 +2,6 @@
 #include "hook-instance.hh"
 #include "worker.hh"
 #include "builtins.hh"
-#include "builtins/buildenv.hh"
 #include "references.hh"
 #include "finally.hh"
 #include "util.hh"
@@ -13,9 +12,12 @@
 #include "worker-protocol.hh"
 #include "topo-sort.hh"
 #include "callback.hh"
+#include "build-time-cache.hh"
+#include "thread-pool.hh"
 
 #include <regex>
 #include <queue>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -44,8 +46,12 @@
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/syscall.h>
+#include "cgroup.hh"
 #if HAVE_SECCOMP
 #include <seccomp.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
 #endif
 #define pivot_root(new_root, put_old) (syscall(SYS_pivot_root, new_root, put_old))
 #endif
@@ -155,6 +161,7 @@ DerivationGoal::~DerivationGoal()
     /* Careful: we should never ever throw an exception from a
        destructor. */
     try { killChild(); } catch (...) { ignoreException(); }
+    try { stopLockWaiter(); } catch (...) { ignoreException(); }
     try { stopDaemon(); } catch (...) { ignoreException(); }
     try { deleteTmpDir(false); } catch (...) { ignoreException(); }
     try { closeLogFile(); } catch (...) { ignoreException(); }
@@ -171,10 +178,20 @@ string DerivationGoal::key()
 }
 
 
+double DerivationGoal::estimatedDuration()
+{
+    /* Derivations that have never been built count as taking one
+       second, so that the length of a chain still matters. */
+    if (!estimatedDuration_)
+        estimatedDuration_ = lookupBuildTime(Derivation::nameFromPath(drvPath)).value_or(1);
+    return *estimatedDuration_;
+}
+
+
 inline bool DerivationGoal::needsHashRewrite()
 {
 #if __linux__
-    return !useChroot;
+    return !build->useChroot;
 #else
     /* Darwin requires hash rewriting even when sandboxing is enabled. */
     return true;
@@ -203,10 +220,244 @@ void DerivationGoal::killChild()
         assert(pid == -1);
     }
 
+    else if (build && build->inProcessStatus)
+        worker.childTerminated(this);
+
+    releaseBuilderResources();
+
     hook.reset();
 }
 
 
+void DerivationGoal::releaseBuilderResources()
+{
+    worker.releaseCPUs(cpus);
+    cpus.clear();
+
+    worker.buildFinished(this);
+
+#if __linux__
+    if (build && build->cgroup) {
+        try {
+            destroyCgroup(*build->cgroup);
+        } catch (...) {
+            ignoreException();
+        }
+        build->cgroup.reset();
+    }
+#endif
+}
+
+void DerivationGoal::runBuiltinInProcess()
+{
+    /* The builtin reports errors through a pipe, so that they end up
+       in the build log like those of a builder process. */
+    builderOut.create();
+    build->inProcessStatus = 0;
+
+    try {
+        BasicDerivation drv2(*drv);
+        for (auto & e : drv2.env)
+            e.second = rewriteStrings(e.second, build->inputRewrites);
+
+        BuiltinBuilderContext ctx{drv2};
+
+        /* The builtin runs as the user of the Nix process, so it may
+           only write to the scratch outputs. Refuse derivations whose
+           environment points the outputs elsewhere, since the builtin
+           would otherwise disagree with a sandboxed builder. */
+        for (auto & [outputName, scratchPath] : build->scratchOutputs) {
+            auto path = worker.store.printStorePath(scratchPath);
+            if (get(drv2.env, outputName).value_or("") != path)
+                throw Error("the environment variable '%s' of derivation '%s' is not its output path, "
+                    "refusing to run the builtin builder in process",
+                    outputName, worker.store.printStorePath(drvPath));
+            ctx.outputs.insert_or_assign(outputName, path);
+        }
+
+        /* Without a sandbox, the builtin may only read the closure of
+           the inputs of the derivation. Symlinks are resolved, so that
+           an input can't point anywhere else. */
+        ctx.checkInput = [&](const Path & path) {
+            auto realPath = canonPath(path, true);
+            if (!worker.store.isInStore(realPath)
+                || !isAllowed(worker.store.toStorePath(realPath).first))
+                throw Error("builtin builder may not read '%s', which is not an input", path);
+        };
+
+        RegisterBuiltinBuilder::builtinBuilders->at(std::string(drv->builder, 8)).fun(ctx);
+    } catch (std::exception & e) {
+        writeFull(builderOut.writeSide.get(), e.what() + std::string("\n"));
+        build->inProcessStatus = 1 << 8;
+    }
+
+    builderOut.writeSide = -1;
+    worker.childStarted(shared_from_this(), {builderOut.readSide.get()}, true, true);
+}
+
+
+static std::chrono::microseconds elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
+
+
+/* Wait until another process has released the locks on all of
+   `lockFiles' (or on any of them, if `any' is set), copying what it
+   writes to `logFile' to `out' in the meantime. This runs in a child
+   process, which signals the parent by closing `out'. The last lock
+   acquired is then held until the parent kills us (or goes away,
+   which closes `parent'), so that a released lock is handed to only
+   one of the goals waiting for it rather than waking all of them. We
+   hold at most one lock at a time, so that a waiter doesn't keep
+   other goals from locks it isn't about to use. */
+static void waitForLocks(const Paths & lockFiles, bool any, const Path & logFile, int out, int parent)
+{
+    /* We were forked without exec, so we have inherited all the
+       parent's file descriptors, including those of the locks held by
+       its other goals. flock() locks belong to the open file, so our
+       copies would keep those locked after the parent releases them. */
+    closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, out, parent});
+
+    /* Shared with the lock threads, which are never joined and may
+       outlive this function, so they must not refer to our stack. */
+    struct Shared
+    {
+        Sync<bool> done{false};
+        std::condition_variable wakeup;
+    };
+    auto shared = std::make_shared<Shared>();
+
+    /* Returns whether this was the first lock to be acquired. Only
+       that one is kept, and it's deliberately leaked, so it is
+       released when this process exits. */
+    auto acquire = [](Shared & shared, const Path & path) {
+        auto fd = openLockFile(path, true);
+        lockFile(fd.get(), ltWrite, true);
+        {
+            auto done(shared.done.lock());
+            if (*done) return false;
+            *done = true;
+        }
+        fd.release();
+        shared.wakeup.notify_one();
+        return true;
+    };
+
+    if (any)
+        for (auto & path : lockFiles)
+            std::thread([shared, acquire, path]() {
+                acquire(*shared, path);
+            }).detach();
+    else
+        std::thread([shared, acquire, lockFiles]() {
+            /* Wait for the locks in turn, releasing each one before
+               waiting for the next, and keep only the last. */
+            auto last = std::prev(lockFiles.end());
+            for (auto i = lockFiles.begin(); i != last; ++i) {
+                auto fd = openLockFile(*i, true);
+                lockFile(fd.get(), ltWrite, true);
+            }
+            acquire(*shared, *last);
+        }).detach();
+
+    /* Only relay the log once the other build starts writing to it,
+       so that we don't show the log of an earlier build. */
+    struct stat st;
+    std::optional<time_t> initialMTime;
+    if (logFile != "" && stat(logFile.c_str(), &st) == 0)
+        initialMTime = st.st_mtime;
+
+    off_t pos = 0;
+    std::vector<char> buf(65536);
+
+    while (true) {
+        bool finished = *shared->done.lock();
+
+        if (logFile != "" && stat(logFile.c_str(), &st) == 0
+            && (!initialMTime || st.st_mtime != *initialMTime))
+        {
+            initialMTime.reset();
+            if (st.st_size < pos) pos = 0;
+            AutoCloseFD fd = open(logFile.c_str(), O_RDONLY | O_CLOEXEC);
+            while (fd) {
+                auto n = pread(fd.get(), buf.data(), buf.size(), pos);
+                if (n <= 0) break;
+                writeFull(out, {buf.data(), (size_t) n}, false);
+                pos += n;
+            }
+        }
+
+        if (finished) break;
+
+        /* Check for new log output regularly. */
+        auto done(shared->done.lock());
+        if (logFile == "")
+            while (!*done) done.wait(shared->wakeup);
+        else
+            done.wait_for(shared->wakeup, std::chrono::milliseconds(100), [&]() { return *done; });
+    }
+
+    close(out);
+
+    /* Hold on to the locks until the parent is done with us. */
+    char c;
+    while (read(parent, &c, 1) == -1 && errno == EINTR) ;
+}
+
+
+bool DerivationGoal::startLockWaiter(const Paths & lockFiles, bool any)
+{
+    if (lockFiles.empty()) return false;
+
+    /* The log can only be followed if it's not compressed. */
+    Path logFile;
+    if (!any && settings.keepLog && !settings.compressLog)
+        if (auto localStore = dynamic_cast<LocalStore *>(&worker.store)) {
+            auto baseName = std::string(baseNameOf(worker.store.printStorePath(drvPath)));
+            logFile = fmt("%s/%s/%s/%s", localStore->logDir, LocalFSStore::drvsLogDir,
+                string(baseName, 0, 2), string(baseName, 2));
+        }
+
+    try {
+        Pipe pipe, parent;
+        pipe.create();
+        parent.create();
+
+        ProcessOptions options;
+        options.allowVfork = false;
+        lockWaiter = startProcess([&]() {
+            pipe.readSide = -1;
+            parent.writeSide = -1;
+            waitForLocks(lockFiles, any, logFile, pipe.writeSide.release(), parent.readSide.get());
+            _exit(0);
+        }, options);
+
+        pipe.writeSide = -1;
+        parent.readSide = -1;
+        lockWaiterOut = std::move(pipe.readSide);
+        lockWaiterParent = std::move(parent.writeSide);
+    } catch (SysError & e) {
+        logError(e.info());
+        return false;
+    }
+
+    worker.childStarted(shared_from_this(), {lockWaiterOut.get()}, false, false);
+    return true;
+}
+
+
+void DerivationGoal::stopLockWaiter()
+{
+    if (lockWaiter == -1) return;
+    worker.childTerminated(this, false);
+    lockWaiter.kill();
+    lockWaiterOut = -1;
+    lockWaiterParent = -1;
+    currentLockWaiterLine.clear();
+}
+
+
 void DerivationGoal::timedOut(Error && ex)
 {
     killChild();
@@ -459,7 +710,8 @@ void DerivationGoal::repairClosure()
                     outputsToDrv.insert_or_assign(*j.second, i);
         }
 
-    /* Check each path (slow!). */
+    /* Check each path (slow!), hashing them in parallel. */
+    worker.checkPathContents(outputClosure);
     for (auto & i : outputClosure) {
         if (worker.pathContentsGood(i)) continue;
         printError(
@@ -529,7 +781,7 @@ void DerivationGoal::inputsRealised()
             Derivation drvResolved { *std::move(attempt) };
 
             auto pathResolved = writeDerivation(worker.store, drvResolved);
-            resolvedDrv = drvResolved;
+            resolvedDrv = std::make_unique<BasicDerivation>(drvResolved);
 
             auto msg = fmt("Resolved derivation: '%s' -> '%s'",
                 worker.store.printStorePath(drvPath),
@@ -615,6 +867,8 @@ void DerivationGoal::tryToBuild()
        crashes.  If we can't acquire the lock, then continue; hopefully some
        other goal can start a build, and if not, the main loop will sleep a few
        seconds and then retry this goal. */
+    stopLockWaiter();
+
     PathSet lockFiles;
     /* FIXME: Should lock something like the drv itself so we don't build same
        CA drv concurrently */
@@ -630,15 +884,25 @@ void DerivationGoal::tryToBuild()
             if (i.second.second)
                 lockFiles.insert(worker.store.Store::toRealPath(*i.second.second));
 
+    if (!lockWaitStart) lockWaitStart = std::chrono::steady_clock::now();
+
     if (!outputLocks.lockPaths(lockFiles, "", false)) {
         if (!actLock)
             actLock = std::make_unique<Activity>(*logger, lvlWarn, actBuildWaiting,
                 fmt("waiting for lock on %s", yellowtxt(showPaths(lockFiles))));
-        worker.waitForAWhile(shared_from_this());
+        /* Retry as soon as the other build finishes, rather than
+           polling. */
+        Paths lockFiles2;
+        for (auto & path : lockFiles)
+            lockFiles2.push_back(path + ".lock");
+        if (!startLockWaiter(lockFiles2, false))
+            worker.waitForAWhile(shared_from_this());
         return;
     }
 
     actLock.reset();
+    result.lockTime = elapsedSince(*lockWaitStart);
+    lockWaitStart.reset();
 
     /* Now check again whether the outputs are valid.  This is because
        another process may have started building in parallel.  After
@@ -672,6 +936,12 @@ void DerivationGoal::tryToBuild()
         deletePath(worker.store.Store::toRealPath(storePath));
     }
 
+    /* We're going to build, so allocate the state needed for that. */
+    if (!build) {
+        build = std::make_unique<BuildState>();
+        worker.buildStatesCreated++;
+    }
+
     /* Don't do a remote build if the derivation has the attribute
        `preferLocalBuild' set.  Also, check and repair modes are only
        supported for local builds. */
@@ -709,6 +979,8 @@ void DerivationGoal::tryToBuild()
 }
 
 void DerivationGoal::tryLocalBuild() {
+    stopLockWaiter();
+
     /* Make sure that we are allowed to start a build. */
     if (!dynamic_cast<LocalStore *>(&worker.store)) {
         throw Error(
@@ -723,9 +995,48 @@ void DerivationGoal::tryLocalBuild() {
         return;
     }
 
+    /* Wait for another build to finish if there isn't enough memory
+       for this one. */
+    uint64_t expectedMemory = settings.buildMemoryHeadroom
+        ? lookupBuildMemory(Derivation::nameFromPath(drvPath)).value_or(0)
+        : 0;
+    if (!worker.haveMemoryFor(expectedMemory)) {
+        if (!actLock)
+            actLock = std::make_unique<Activity>(*logger, lvlWarn, actBuildWaiting,
+                fmt("waiting for memory to build '%s'", yellowtxt(worker.store.printStorePath(drvPath))));
+        worker.waitForBuildSlot(shared_from_this());
+        outputLocks.unlock();
+        return;
+    }
+
+    /* Wait for a slot if builds are limited across processes. */
+    if (settings.buildSlots) {
+        if (!buildSlot) buildSlot = std::make_unique<BuildSlot>();
+
+        if (!buildSlot->acquire()) {
+            if (!actLock)
+                actLock = std::make_unique<Activity>(*logger, lvlWarn, actBuildWaiting,
+                    fmt("waiting for a build slot to build '%s'", yellowtxt(worker.store.printStorePath(drvPath))));
+            if (!startLockWaiter(buildSlot->getLockFilesToWaitFor(), true))
+                worker.waitForAWhile(shared_from_this());
+            return;
+        }
+    }
+
+    /* Cheap builtin builders don't need a builder process, and hence
+       no build user or sandbox. That doesn't work with a diverted
+       store, since the builtins access the logical store paths,
+       which only exist inside the sandbox. */
+    auto localStore = dynamic_cast<LocalStore *>(&worker.store);
+    bool diverted = localStore && localStore->storeDir != localStore->realStoreDir;
+    if (drv->isBuiltin() && settings.builtinsInProcess && !diverted) {
+        auto i = RegisterBuiltinBuilder::builtinBuilders->find(std::string(drv->builder, 8));
+        build->inProcess = i != RegisterBuiltinBuilder::builtinBuilders->end() && i->second.inProcess;
+    }
+
     /* If `build-users-group' is not empty, then we have to build as
        one of the members of that group. */
-    if (settings.buildUsersGroup != "" && getuid() == 0) {
+    if (settings.buildUsersGroup != "" && getuid() == 0 && !build->inProcess) {
 #if defined(__linux__) || defined(__APPLE__)
         if (!buildUser) buildUser = std::make_unique<UserLock>();
 
@@ -737,7 +1048,8 @@ void DerivationGoal::tryLocalBuild() {
             if (!actLock)
                 actLock = std::make_unique<Activity>(*logger, lvlWarn, actBuildWaiting,
                     fmt("waiting for UID to build '%s'", yellowtxt(worker.store.printStorePath(drvPath))));
-            worker.waitForAWhile(shared_from_this());
+            if (!startLockWaiter(buildUser->getLockFilesToWaitFor(), true))
+                worker.waitForAWhile(shared_from_this());
             return;
         }
 #else
@@ -752,11 +1064,28 @@ void DerivationGoal::tryLocalBuild() {
     try {
 
         /* Okay, we have to build. */
+        cpus = worker.allocateCPUs();
+
+        /* Give the CPUs back if we fail to start the builder for any
+           reason, not just a BuildError. */
+        bool builderStarted = false;
+        Finally releaseCPUs([&]() {
+            if (builderStarted) return;
+            worker.releaseCPUs(cpus);
+            cpus.clear();
+        });
+
+        auto setupStart = std::chrono::steady_clock::now();
         startBuilder();
+        builderStarted = true;
+        result.setupTime = elapsedSince(setupStart);
+        worker.buildStarted(this, build->cgroup, expectedMemory);
 
     } catch (BuildError & e) {
         outputLocks.unlock();
+        releaseBuilderResources();
         buildUser.reset();
+        buildSlot.reset();
         worker.permanentFailure = true;
         done(BuildResult::InputRejected, e);
         return;
@@ -833,15 +1162,22 @@ void DerivationGoal::buildDone()
     /* Release the build user at the end of this function. We don't do
        it right away because we don't want another build grabbing this
        uid and then messing around with our output. */
-    Finally releaseBuildUser([&]() { buildUser.reset(); });
+    Finally releaseBuildUser([&]() {
+        releaseBuilderResources();
+        buildUser.reset();
+        buildSlot.reset();
+    });
 
-    sandboxMountNamespace = -1;
+    build->sandboxMountNamespace = -1;
 
     /* Since we got an EOF on the logger pipe, the builder is presumed
        to have terminated.  In fact, the builder could also have
        simply have closed its end of the pipe, so just to be sure,
        kill it. */
-    int status = hook ? hook->pid.kill() : pid.kill();
+    int status =
+        hook ? hook->pid.kill() :
+        build->inProcessStatus ? *build->inProcessStatus :
+        pid.kill();
 
     debug("builder process for '%s' finished", worker.store.printStorePath(drvPath));
 
@@ -851,6 +1187,28 @@ void DerivationGoal::buildDone()
     /* So the child is gone now. */
     worker.childTerminated(this);
 
+#if __linux__
+    if (build->cgroup) {
+        auto stats = getCgroupStats(*build->cgroup);
+        result.cpuUser = stats.cpuUser;
+        result.cpuSystem = stats.cpuSystem;
+        result.peakMemory = stats.memoryPeak;
+        result.ioRead = stats.ioRead;
+        result.ioWritten = stats.ioWritten;
+
+        if (stats.cpuUser && stats.cpuSystem)
+            printMsg(lvlTalkative, "builder for '%s' used %.2f s of user and %.2f s of system CPU time",
+                worker.store.printStorePath(drvPath),
+                stats.cpuUser->count() / 1e6, stats.cpuSystem->count() / 1e6);
+
+        if (stats.memoryPeak) {
+            printMsg(lvlTalkative, "builder for '%s' used at most %.1f MiB of memory",
+                worker.store.printStorePath(drvPath), *stats.memoryPeak / (1024.0 * 1024.0));
+            recordBuildMemory(Derivation::nameFromPath(drvPath), *stats.memoryPeak);
+        }
+    }
+#endif
+
     /* Close the read side of the logger pipe. */
     if (hook) {
         hook->builderOut.readSide = -1;
@@ -883,6 +1241,8 @@ void DerivationGoal::buildDone()
                of knowing whether the build actually got an ENOSPC.
                So instead, check if the disk is (nearly) full now.  If
                so, we don't mark this build as a permanent failure. */
+            bool tmpfsFull = false;
+
 #if HAVE_STATVFS
             if (auto localStore = dynamic_cast<LocalStore *>(&worker.store)) {
                 uint64_t required = 8ULL * 1024 * 1024; // FIXME: make configurable
@@ -890,23 +1250,45 @@ void DerivationGoal::buildDone()
                 if (statvfs(localStore->realStoreDir.c_str(), &st) == 0 &&
                     (uint64_t) st.f_bavail * st.f_bsize < required)
                     diskFull = true;
-                if (statvfs(tmpDir.c_str(), &st) == 0 &&
-                    (uint64_t) st.f_bavail * st.f_bsize < required)
-                    diskFull = true;
+                if (statvfs(build->tmpDir.c_str(), &st) == 0) {
+                    /* A tmpfs build directory is small, so consider
+                       it full if the build could have used up the
+                       remaining space in a single write. */
+                    uint64_t available = (uint64_t) st.f_bavail * st.f_bsize;
+#if __linux__
+                    if (build->tmpDirIsTmpfs)
+                        tmpfsFull = available < std::min(required, settings.buildDirTmpfsSize / 8);
+                    else
+#endif
+                    if (available < required)
+                        diskFull = true;
+                }
             }
 #endif
 
             deleteTmpDir(false);
 
+            /* Retry the build with a build directory on disk if its
+               tmpfs was too small. */
+            if (tmpfsFull) {
+                printInfo("build directory of '%s' is full; retrying on disk",
+                    worker.store.printStorePath(drvPath));
+                tmpfsTooSmall = true;
+                outputLocks.unlock();
+                state = &DerivationGoal::tryToBuild;
+                worker.wakeUp(shared_from_this());
+                return;
+            }
+
             /* Move paths out of the chroot for easier debugging of
                build failures. */
-            if (useChroot && buildMode == bmNormal)
+            if (build->useChroot && buildMode == bmNormal)
                 for (auto & [_, status] : initialOutputs) {
                     if (!status.known) continue;
                     if (buildMode != bmCheck && status.known->isValid()) continue;
                     auto p = worker.store.printStorePath(status.known->path);
-                    if (pathExists(chrootRootDir + p))
-                        rename((chrootRootDir + p).c_str(), p.c_str());
+                    if (pathExists(build->chrootRootDir + p))
+                        rename((build->chrootRootDir + p).c_str(), p.c_str());
                 }
 
             auto msg = fmt("builder for '%s' %s",
@@ -932,7 +1314,13 @@ void DerivationGoal::buildDone()
 
         /* Compute the FS closure of the outputs and register them as
            being valid. */
+        auto registrationStart = std::chrono::steady_clock::now();
         registerOutputs();
+        result.registrationTime = elapsedSince(registrationStart);
+
+        if (settings.scheduleCriticalPath)
+            recordBuildTime(Derivation::nameFromPath(drvPath),
+                result.stopTime - result.startTime);
 
         if (settings.postBuildHook != "") {
             Activity act(*logger, lvlInfo, actPostBuildHook,
@@ -993,11 +1381,11 @@ void DerivationGoal::buildDone()
         }
 
         /* Delete unused redirected outputs (when doing hash rewriting). */
-        for (auto & i : redirectedOutputs)
+        for (auto & i : build->redirectedOutputs)
             deletePath(worker.store.Store::toRealPath(i.second));
 
         /* Delete the chroot (if we were using one). */
-        autoDelChroot.reset(); /* this runs the destructor */
+        build->autoDelChroot.reset(); /* this runs the destructor */
 
         deleteTmpDir(true);
 
@@ -1052,16 +1440,20 @@ void DerivationGoal::resolvedFinished() {
     if (realWantedOutputs.empty())
         realWantedOutputs = resolvedDrv->outputNames();
 
+    std::set<DrvOutput> resolvedOutputs;
     for (auto & wantedOutput : realWantedOutputs) {
         assert(initialOutputs.count(wantedOutput) != 0);
         assert(resolvedHashes.count(wantedOutput) != 0);
-        auto realisation = worker.store.queryRealisation(
-                DrvOutput{resolvedHashes.at(wantedOutput), wantedOutput}
-        );
+        resolvedOutputs.insert(DrvOutput{resolvedHashes.at(wantedOutput), wantedOutput});
+    }
+    auto realisations = worker.store.queryRealisations(resolvedOutputs);
+
+    for (auto & wantedOutput : realWantedOutputs) {
+        auto realisation = realisations.find(DrvOutput{resolvedHashes.at(wantedOutput), wantedOutput});
         // We've just built it, but maybe the build failed, in which case the
         // realisation won't be there
-        if (realisation) {
-            auto newRealisation = *realisation;
+        if (realisation != realisations.end()) {
+            auto newRealisation = realisation->second;
             newRealisation.id = DrvOutput{initialOutputs.at(wantedOutput).outputHash, wantedOutput};
             worker.store.registerDrvOutput(newRealisation);
         } else {
@@ -1073,7 +1465,7 @@ void DerivationGoal::resolvedFinished() {
 
     // This is potentially a bit fishy in terms of error reporting. Not sure
     // how to do it in a cleaner way
-    amDone(nrFailed == 0 ? ecSuccess : ecFailed, ex);
+    amDone(nrFailed == 0 ? ecSuccess : ecFailed, ex ? std::optional<Error>(*ex) : std::nullopt);
 }
 
 HookReply DerivationGoal::tryBuildHook()
@@ -1192,22 +1584,20 @@ int childEntry(void * arg)
 
 StorePathSet DerivationGoal::exportReferences(const StorePathSet & storePaths)
 {
-    StorePathSet paths;
-
-    for (auto & storePath : storePaths) {
+    for (auto & storePath : storePaths)
         if (!inputPaths.count(storePath))
             throw BuildError("cannot export references of path '%s' because it is not in the input closure of the derivation", worker.store.printStorePath(storePath));
 
-        worker.store.computeFSClosure({storePath}, paths);
-    }
+    StorePathSet paths;
+    worker.store.computeFSClosure(storePaths, paths);
 
     /* If there are derivations in the graph, then include their
        outputs as well.  This is useful if you want to do things
        like passing all build-time dependencies of some path to a
        derivation that builds a NixOS DVD image. */
-    auto paths2 = paths;
+    StorePathSet outputs;
 
-    for (auto & j : paths2) {
+    for (auto & j : paths) {
         if (j.isDerivation()) {
             Derivation drv = worker.store.derivationFromPath(j);
             for (auto & k : drv.outputsAndOptPaths(worker.store)) {
@@ -1217,11 +1607,13 @@ StorePathSet DerivationGoal::exportReferences(const StorePathSet & storePaths)
                        derivation itself. That doesn't seem right to me, so I
                        won't try to implemented this for CA derivations. */
                     throw UnimplementedError("exportReferences on CA derivations is not yet implemented");
-                worker.store.computeFSClosure(*k.second.second, paths);
+                outputs.insert(*k.second.second);
             }
         }
     }
 
+    worker.store.computeFSClosure(outputs, paths);
+
     return paths;
 }
 
@@ -1259,6 +1651,11 @@ void linkOrCopy(const Path & from, const Path & to)
 }
 
 
+#if __linux__ && HAVE_SECCOMP
+static void precompileSeccompFilter();
+#endif
+
+
 void DerivationGoal::startBuilder()
 {
     /* Right platform? */
@@ -1273,8 +1670,18 @@ void DerivationGoal::startBuilder()
     if (drv->isBuiltin())
         preloadNSS();
 
+#if __linux__
+    /* Run the build in its own cgroup, so that we can measure its
+       resource use and reliably kill all its processes. */
+    if (settings.useCgroups && !build->inProcess) {
+        build->cgroup = createChildCgroup("nix-build-" + std::string(drvPath.hashPart()));
+        if (!build->cgroup)
+            throw Error("cannot use cgroups for builds, since cgroup v2 is not available");
+    }
+#endif
+
 #if __APPLE__
-    additionalSandboxProfile = parsedDrv->getStringAttr("__sandboxProfile").value_or("");
+    build->additionalSandboxProfile = parsedDrv->getStringAttr("__sandboxProfile").value_or("");
 #endif
 
     /* Are we doing a chroot build? */
@@ -1285,23 +1692,27 @@ void DerivationGoal::startBuilder()
                 throw Error("derivation '%s' has '__noChroot' set, "
                     "but that's not allowed when 'sandbox' is 'true'", worker.store.printStorePath(drvPath));
 #if __APPLE__
-            if (additionalSandboxProfile != "")
+            if (build->additionalSandboxProfile != "")
                 throw Error("derivation '%s' specifies a sandbox profile, "
                     "but this is only allowed when 'sandbox' is 'relaxed'", worker.store.printStorePath(drvPath));
 #endif
-            useChroot = true;
+            build->useChroot = true;
         }
         else if (settings.sandboxMode == smDisabled)
-            useChroot = false;
+            build->useChroot = false;
         else if (settings.sandboxMode == smRelaxed)
-            useChroot = !(derivationIsImpure(derivationType)) && !noChroot;
+            build->useChroot = !(derivationIsImpure(derivationType)) && !noChroot;
     }
 
+    /* A builtin running in the Nix process checks its inputs itself. */
+    if (build->inProcess)
+        build->useChroot = false;
+
     if (auto localStoreP = dynamic_cast<LocalStore *>(&worker.store)) {
         auto & localStore = *localStoreP;
         if (localStore.storeDir != localStore.realStoreDir) {
             #if __linux__
-                useChroot = true;
+                build->useChroot = true;
             #else
                 throw Error("building using a diverted store is not supported on this platform");
             #endif
@@ -1310,9 +1721,28 @@ void DerivationGoal::startBuilder()
 
     /* Create a temporary directory where the build will take
        place. */
-    tmpDir = createTempDir("", "nix-build-" + std::string(drvPath.name()), false, false, 0700);
+    build->tmpDir = createTempDir("", "nix-build-" + std::string(drvPath.name()), false, false, 0700);
+
+#if __linux__
+    /* Small builds are much faster in a tmpfs, since creating and
+       deleting the build directory and the files in it doesn't touch
+       the disk. */
+    if (settings.buildDirTmpfsSize
+        && !tmpfsTooSmall
+        && !settings.keepFailed
+        && getuid() == 0
+        && !build->inProcess
+        && parsedDrv->getBoolAttr("preferLocalBuild"))
+    {
+        if (mount("tmpfs", build->tmpDir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV,
+                fmt("size=%d,mode=0700", settings.buildDirTmpfsSize.get()).c_str()) == 0)
+            build->tmpDirIsTmpfs = true;
+        else
+            debug("cannot mount a tmpfs on '%s': %s", build->tmpDir, strerror(errno));
+    }
+#endif
 
-    chownToBuilder(tmpDir);
+    chownToBuilder(build->tmpDir);
 
     for (auto & [outputName, status] : initialOutputs) {
         /* Set scratch path we'll actually use during the build.
@@ -1342,15 +1772,15 @@ void DerivationGoal::startBuilder()
             :   /* If we are repairing or the path is totally valid, we'll need
                    to use a temporary path */
                 makeFallbackPath(status.known->path);
-        scratchOutputs.insert_or_assign(outputName, scratchPath);
+        build->scratchOutputs.insert_or_assign(outputName, scratchPath);
 
         /* A non-removed corrupted path needs to be stored here, too */
         if (buildMode == bmRepair && !status.known->isValid())
-            redirectedBadOutputs.insert(status.known->path);
+            build->redirectedBadOutputs.insert(status.known->path);
 
         /* Substitute output placeholders with the scratch output paths.
            We'll use during the build. */
-        inputRewrites[hashPlaceholder(outputName)] = worker.store.printStorePath(scratchPath);
+        build->inputRewrites[hashPlaceholder(outputName)] = worker.store.printStorePath(scratchPath);
 
         /* Additional tasks if we know the final path a priori. */
         if (!status.known) continue;
@@ -1367,10 +1797,10 @@ void DerivationGoal::startBuilder()
         {
             std::string h1 { fixedFinalPath.hashPart() };
             std::string h2 { scratchPath.hashPart() };
-            inputRewrites[h1] = h2;
+            build->inputRewrites[h1] = h2;
         }
 
-        redirectedOutputs.insert_or_assign(std::move(fixedFinalPath), std::move(scratchPath));
+        build->redirectedOutputs.insert_or_assign(std::move(fixedFinalPath), std::move(scratchPath));
     }
 
     /* Construct the environment passed to the builder. */
@@ -1403,17 +1833,17 @@ void DerivationGoal::startBuilder()
             auto storePath = worker.store.toStorePath(storePathS).first;
 
             /* Write closure info to <fileName>. */
-            writeFile(tmpDir + "/" + fileName,
+            writeFile(build->tmpDir + "/" + fileName,
                 worker.store.makeValidityRegistration(
                     exportReferences({storePath}), false, false));
         }
     }
 
-    if (useChroot) {
+    if (build->useChroot) {
 
         /* Allow a user-configurable set of directories from the
            host file system. */
-        dirsInChroot.clear();
+        build->dirsInChroot.clear();
 
         for (auto i : settings.sandboxPaths.get()) {
             if (i.empty()) continue;
@@ -1424,15 +1854,15 @@ void DerivationGoal::startBuilder()
             }
             size_t p = i.find('=');
             if (p == string::npos)
-                dirsInChroot[i] = {i, optional};
+                build->dirsInChroot[i] = {i, optional};
             else
-                dirsInChroot[string(i, 0, p)] = {string(i, p + 1), optional};
+                build->dirsInChroot[string(i, 0, p)] = {string(i, p + 1), optional};
         }
-        dirsInChroot[tmpDirInSandbox] = tmpDir;
+        build->dirsInChroot[build->tmpDirInSandbox] = build->tmpDir;
 
         /* Add the closure of store paths to the chroot. */
         StorePathSet closure;
-        for (auto & i : dirsInChroot)
+        for (auto & i : build->dirsInChroot)
             try {
                 if (worker.store.isInStore(i.second.source))
                     worker.store.computeFSClosure(worker.store.toStorePath(i.second.source).first, closure);
@@ -1443,7 +1873,7 @@ void DerivationGoal::startBuilder()
             }
         for (auto & i : closure) {
             auto p = worker.store.printStorePath(i);
-            dirsInChroot.insert_or_assign(p, p);
+            build->dirsInChroot.insert_or_assign(p, p);
         }
 
         PathSet allowedPaths = settings.allowedImpureHostPrefixes;
@@ -1469,7 +1899,7 @@ void DerivationGoal::startBuilder()
                 throw Error("derivation '%s' requested impure path '%s', but it was not in allowed-impure-host-deps",
                     worker.store.printStorePath(drvPath), i);
 
-            dirsInChroot[i] = i;
+            build->dirsInChroot[i] = i;
         }
 
 #if __linux__
@@ -1477,42 +1907,42 @@ void DerivationGoal::startBuilder()
            environment using bind-mounts.  We put it in the Nix store
            to ensure that we can create hard-links to non-directory
            inputs in the fake Nix store in the chroot (see below). */
-        chrootRootDir = worker.store.Store::toRealPath(drvPath) + ".chroot";
-        deletePath(chrootRootDir);
+        build->chrootRootDir = worker.store.Store::toRealPath(drvPath) + ".chroot";
+        deletePath(build->chrootRootDir);
 
         /* Clean up the chroot directory automatically. */
-        autoDelChroot = std::make_shared<AutoDelete>(chrootRootDir);
+        build->autoDelChroot = std::make_shared<AutoDelete>(build->chrootRootDir);
 
-        printMsg(lvlChatty, format("setting up chroot environment in '%1%'") % chrootRootDir);
+        printMsg(lvlChatty, format("setting up chroot environment in '%1%'") % build->chrootRootDir);
 
-        if (mkdir(chrootRootDir.c_str(), 0750) == -1)
-            throw SysError("cannot create '%1%'", chrootRootDir);
+        if (mkdir(build->chrootRootDir.c_str(), 0750) == -1)
+            throw SysError("cannot create '%1%'", build->chrootRootDir);
 
-        if (buildUser && chown(chrootRootDir.c_str(), 0, buildUser->getGID()) == -1)
-            throw SysError("cannot change ownership of '%1%'", chrootRootDir);
+        if (buildUser && chown(build->chrootRootDir.c_str(), 0, buildUser->getGID()) == -1)
+            throw SysError("cannot change ownership of '%1%'", build->chrootRootDir);
 
         /* Create a writable /tmp in the chroot.  Many builders need
            this.  (Of course they should really respect $TMPDIR
            instead.) */
-        Path chrootTmpDir = chrootRootDir + "/tmp";
+        Path chrootTmpDir = build->chrootRootDir + "/tmp";
         createDirs(chrootTmpDir);
         chmod_(chrootTmpDir, 01777);
 
         /* Create a /etc/passwd with entries for the build user and the
            nobody account.  The latter is kind of a hack to support
            Samba-in-QEMU. */
-        createDirs(chrootRootDir + "/etc");
+        createDirs(build->chrootRootDir + "/etc");
 
         /* Declare the build user's group so that programs get a consistent
            view of the system (e.g., "id -gn"). */
-        writeFile(chrootRootDir + "/etc/group",
+        writeFile(build->chrootRootDir + "/etc/group",
             fmt("root:x:0:\n"
                 "nixbld:!:%1%:\n"
                 "nogroup:x:65534:\n", sandboxGid()));
 
         /* Create /etc/hosts with localhost entry. */
         if (!(derivationIsImpure(derivationType)))
-            writeFile(chrootRootDir + "/etc/hosts", "127.0.0.1 localhost\n::1 localhost\n");
+            writeFile(build->chrootRootDir + "/etc/hosts", "127.0.0.1 localhost\n::1 localhost\n");
 
         /* Make the closure of the inputs available in the chroot,
            rather than the whole Nix store.  This prevents any access
@@ -1521,21 +1951,32 @@ void DerivationGoal::startBuilder()
            can be bind-mounted).  !!! As an extra security
            precaution, make the fake Nix store only writable by the
            build user. */
-        Path chrootStoreDir = chrootRootDir + worker.store.storeDir;
+        Path chrootStoreDir = build->chrootRootDir + worker.store.storeDir;
         createDirs(chrootStoreDir);
         chmod_(chrootStoreDir, 01775);
 
         if (buildUser && chown(chrootStoreDir.c_str(), 0, buildUser->getGID()) == -1)
             throw SysError("cannot change ownership of '%1%'", chrootStoreDir);
 
-        for (auto & i : inputPaths) {
-            auto p = worker.store.printStorePath(i);
-            Path r = worker.store.toRealPath(p);
-            if (S_ISDIR(lstat(r).st_mode))
-                dirsInChroot.insert_or_assign(p, r);
-            else
-                linkOrCopy(r, chrootRootDir + p);
-        }
+        /* The overlay exposes the outputs from the host store if they
+           already exist there, so it can't be used when rebuilding
+           them. */
+        build->useOverlayStore = settings.sandboxOverlayStore;
+        for (auto & i : drv->outputsAndOptPaths(worker.store))
+            if (i.second.second && pathExists(worker.store.toRealPath(*i.second.second)))
+                build->useOverlayStore = false;
+
+        if (build->useOverlayStore)
+            createDirs(build->chrootRootDir + "/overlay-work");
+        else
+            for (auto & i : inputPaths) {
+                auto p = worker.store.printStorePath(i);
+                Path r = worker.store.toRealPath(p);
+                if (S_ISDIR(lstat(r).st_mode))
+                    build->dirsInChroot.insert_or_assign(p, r);
+                else
+                    linkOrCopy(r, build->chrootRootDir + p);
+            }
 
         /* If we're repairing, checking or rebuilding part of a
            multiple-outputs derivation, it's possible that we're
@@ -1549,7 +1990,7 @@ void DerivationGoal::startBuilder()
                is already in the sandbox, so we don't need to worry about
                removing it.  */
             if (i.second.second)
-                dirsInChroot.erase(worker.store.printStorePath(*i.second.second));
+                build->dirsInChroot.erase(worker.store.printStorePath(*i.second.second));
         }
 
 #elif __APPLE__
@@ -1563,10 +2004,10 @@ void DerivationGoal::startBuilder()
     if (needsHashRewrite() && pathExists(homeDir))
         throw Error("home directory '%1%' exists; please remove it to assure purity of builds without sandboxing", homeDir);
 
-    if (useChroot && settings.preBuildHook != "" && dynamic_cast<Derivation *>(drv.get())) {
+    if (build->useChroot && settings.preBuildHook != "" && dynamic_cast<Derivation *>(drv.get())) {
         printMsg(lvlChatty, format("executing pre-build hook '%1%'")
             % settings.preBuildHook);
-        auto args = useChroot ? Strings({worker.store.printStorePath(drvPath), chrootRootDir}) :
+        auto args = build->useChroot ? Strings({worker.store.printStorePath(drvPath), build->chrootRootDir}) :
             Strings({ worker.store.printStorePath(drvPath) });
         enum BuildHookState {
             stBegin,
@@ -1591,9 +2032,9 @@ void DerivationGoal::startBuilder()
                 } else {
                     auto p = line.find('=');
                     if (p == string::npos)
-                        dirsInChroot[line] = line;
+                        build->dirsInChroot[line] = line;
                     else
-                        dirsInChroot[string(line, 0, p)] = string(line, p + 1);
+                        build->dirsInChroot[string(line, 0, p)] = string(line, p + 1);
                 }
             }
         }
@@ -1610,6 +2051,11 @@ void DerivationGoal::startBuilder()
     /* Create the log file. */
     Path logFile = openLogFile();
 
+    if (build->inProcess) {
+        runBuiltinInProcess();
+        return;
+    }
+
     /* Create a pipe to get the output of the builder. */
     //builderOut.create();
 
@@ -1636,8 +2082,8 @@ void DerivationGoal::startBuilder()
     #if 0
     // Mount the pt in the sandbox so that the "tty" command works.
     // FIXME: this doesn't work with the new devpts in the sandbox.
-    if (useChroot)
-        dirsInChroot[slaveName] = {slaveName, false};
+    if (build->useChroot)
+        build->dirsInChroot[slaveName] = {slaveName, false};
     #endif
 
     if (unlockpt(builderOut.readSide.get()))
@@ -1659,11 +2105,15 @@ void DerivationGoal::startBuilder()
 
     result.startTime = time(0);
 
+#if __linux__ && HAVE_SECCOMP
+    if (settings.filterSyscalls) precompileSeccompFilter();
+#endif
+
     /* Fork a child to build the package. */
     ProcessOptions options;
 
 #if __linux__
-    if (useChroot) {
+    if (build->useChroot) {
         /* Set up private namespaces for the build:
 
            - The PID namespace causes the build to start as PID 1.
@@ -1699,9 +2149,9 @@ void DerivationGoal::startBuilder()
         */
 
         if (!(derivationIsImpure(derivationType)))
-            privateNetwork = true;
+            build->privateNetwork = true;
 
-        userNamespaceSync.create();
+        build->userNamespaceSync.create();
 
         options.allowVfork = false;
 
@@ -1710,7 +2160,7 @@ void DerivationGoal::startBuilder()
             pathExists(maxUserNamespaces)
             && trim(readFile(maxUserNamespaces)) != "0";
 
-        usingUserNamespace = userNamespacesEnabled;
+        build->usingUserNamespace = userNamespacesEnabled;
 
         Pid helper = startProcess([&]() {
 
@@ -1731,9 +2181,9 @@ void DerivationGoal::startBuilder()
             if (stack == MAP_FAILED) throw SysError("allocating stack");
 
             int flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_PARENT | SIGCHLD;
-            if (privateNetwork)
+            if (build->privateNetwork)
                 flags |= CLONE_NEWNET;
-            if (usingUserNamespace)
+            if (build->usingUserNamespace)
                 flags |= CLONE_NEWUSER;
 
             pid_t child = clone(childEntry, stack + stackSize, flags, this);
@@ -1743,12 +2193,12 @@ void DerivationGoal::startBuilder()
                 flags &= ~CLONE_NEWPID;
                 child = clone(childEntry, stack + stackSize, flags, this);
             }
-            if (usingUserNamespace && child == -1 && (errno == EPERM || errno == EINVAL)) {
+            if (build->usingUserNamespace && child == -1 && (errno == EPERM || errno == EINVAL)) {
                 /* Some distros patch Linux to not allow unprivileged
                  * user namespaces. If we get EPERM or EINVAL, try
                  * without CLONE_NEWUSER and see if that works.
                  */
-                usingUserNamespace = false;
+                build->usingUserNamespace = false;
                 flags &= ~CLONE_NEWUSER;
                 child = clone(childEntry, stack + stackSize, flags, this);
             }
@@ -1760,32 +2210,37 @@ void DerivationGoal::startBuilder()
             if (child == -1) throw SysError("cloning builder process");
 
             writeFull(builderOut.writeSide.get(),
-                fmt("%d %d\n", usingUserNamespace, child));
+                fmt("%d %d\n", build->usingUserNamespace, child));
             _exit(0);
         }, options);
 
         int res = helper.wait();
         if (res != 0 && settings.sandboxFallback) {
-            useChroot = false;
+            build->useChroot = false;
             initTmpDir();
             goto fallback;
         } else if (res != 0)
             throw Error("unable to start build process");
 
-        userNamespaceSync.readSide = -1;
+        build->userNamespaceSync.readSide = -1;
 
         /* Close the write side to prevent runChild() from hanging
            reading from this. */
         Finally cleanup([&]() {
-            userNamespaceSync.writeSide = -1;
+            build->userNamespaceSync.writeSide = -1;
         });
 
         auto ss = tokenizeString<std::vector<std::string>>(readLine(builderOut.readSide.get()));
         assert(ss.size() == 2);
-        usingUserNamespace = ss[0] == "1";
+        build->usingUserNamespace = ss[0] == "1";
         pid = string2Int<pid_t>(ss[1]).value();
 
-        if (usingUserNamespace) {
+        /* Move the builder into its cgroup before it starts doing
+           anything. */
+        if (build->cgroup)
+            writeFile(*build->cgroup + "/cgroup.procs", std::to_string(pid));
+
+        if (build->usingUserNamespace) {
             /* Set the UID/GID mapping of the builder's user namespace
                such that the sandbox user maps to the build user, or to
                the calling user (if build users are disabled). */
@@ -1807,7 +2262,7 @@ void DerivationGoal::startBuilder()
 
         /* Now that we now the sandbox uid, we can write
            /etc/passwd. */
-        writeFile(chrootRootDir + "/etc/passwd", fmt(
+        writeFile(build->chrootRootDir + "/etc/passwd", fmt(
                 "root:x:0:0:Nix build user:%3%:/noshell\n"
                 "nixbld:x:%1%:%2%:Nix build user:%3%:/noshell\n"
                 "nobody:x:65534:65534:Nobody:/:/noshell\n",
@@ -1815,19 +2270,22 @@ void DerivationGoal::startBuilder()
 
         /* Save the mount namespace of the child. We have to do this
            *before* the child does a chroot. */
-        sandboxMountNamespace = open(fmt("/proc/%d/ns/mnt", (pid_t) pid).c_str(), O_RDONLY);
-        if (sandboxMountNamespace.get() == -1)
+        build->sandboxMountNamespace = open(fmt("/proc/%d/ns/mnt", (pid_t) pid).c_str(), O_RDONLY);
+        if (build->sandboxMountNamespace.get() == -1)
             throw SysError("getting sandbox mount namespace");
 
         /* Signal the builder that we've updated its user namespace. */
-        writeFull(userNamespaceSync.writeSide.get(), "1");
+        writeFull(build->userNamespaceSync.writeSide.get(), "1");
 
     } else
 #endif
     {
     fallback:
-        options.allowVfork = !buildUser && !drv->isBuiltin();
+        options.allowVfork = !buildUser && !drv->isBuiltin() && !build->cgroup;
         pid = startProcess([&]() {
+#if __linux__
+            if (build->cgroup) joinCgroup(*build->cgroup);
+#endif
             runChild();
         }, options);
     }
@@ -1866,9 +2324,9 @@ void DerivationGoal::initTmpDir() {
     /* In a sandbox, for determinism, always use the same temporary
        directory. */
 #if __linux__
-    tmpDirInSandbox = useChroot ? settings.sandboxBuildDir : tmpDir;
+    build->tmpDirInSandbox = build->useChroot ? settings.sandboxBuildDir : build->tmpDir;
 #else
-    tmpDirInSandbox = tmpDir;
+    build->tmpDirInSandbox = build->tmpDir;
 #endif
 
     /* In non-structured mode, add all bindings specified in the
@@ -1883,14 +2341,14 @@ void DerivationGoal::initTmpDir() {
         StringSet passAsFile = tokenizeString<StringSet>(get(drv->env, "passAsFile").value_or(""));
         for (auto & i : drv->env) {
             if (passAsFile.find(i.first) == passAsFile.end()) {
-                env[i.first] = i.second;
+                build->env[i.first] = i.second;
             } else {
                 auto hash = hashString(htSHA256, i.first);
                 string fn = ".attr-" + hash.to_string(Base32, false);
-                Path p = tmpDir + "/" + fn;
-                writeFile(p, rewriteStrings(i.second, inputRewrites));
+                Path p = build->tmpDir + "/" + fn;
+                writeFile(p, rewriteStrings(i.second, build->inputRewrites));
                 chownToBuilder(p);
-                env[i.first + "Path"] = tmpDirInSandbox + "/" + fn;
+                build->env[i.first + "Path"] = build->tmpDirInSandbox + "/" + fn;
             }
         }
 
@@ -1898,27 +2356,27 @@ void DerivationGoal::initTmpDir() {
 
     /* For convenience, set an environment pointing to the top build
        directory. */
-    env["NIX_BUILD_TOP"] = tmpDirInSandbox;
+    build->env["NIX_BUILD_TOP"] = build->tmpDirInSandbox;
 
     /* Also set TMPDIR and variants to point to this directory. */
-    env["TMPDIR"] = env["TEMPDIR"] = env["TMP"] = env["TEMP"] = tmpDirInSandbox;
+    build->env["TMPDIR"] = build->env["TEMPDIR"] = build->env["TMP"] = build->env["TEMP"] = build->tmpDirInSandbox;
 
     /* Explicitly set PWD to prevent problems with chroot builds.  In
        particular, dietlibc cannot figure out the cwd because the
        inode of the current directory doesn't appear in .. (because
        getdents returns the inode of the mount point). */
-    env["PWD"] = tmpDirInSandbox;
+    build->env["PWD"] = build->tmpDirInSandbox;
 }
 
 
 void DerivationGoal::initEnv()
 {
-    env.clear();
+    build->env.clear();
 
     /* Most shells initialise PATH to some default (/bin:/usr/bin:...) when
        PATH is not set.  We don't want this, so we fill it in with some dummy
        value. */
-    env["PATH"] = "/path-not-set";
+    build->env["PATH"] = "/path-not-set";
 
     /* Set HOME to a non-existing path to prevent certain programs from using
        /etc/passwd (or NIS, or whatever) to locate the home directory (for
@@ -1926,16 +2384,22 @@ void DerivationGoal::initEnv()
        if HOME is not set, but they will just assume that the settings file
        they are looking for does not exist if HOME is set but points to some
        non-existing path. */
-    env["HOME"] = homeDir;
+    build->env["HOME"] = homeDir;
 
     /* Tell the builder where the Nix store is.  Usually they
        shouldn't care, but this is useful for purity checking (e.g.,
        the compiler or linker might only want to accept paths to files
        in the store or in the build directory). */
-    env["NIX_STORE"] = worker.store.storeDir;
+    build->env["NIX_STORE"] = worker.store.storeDir;
 
     /* The maximum number of cores to utilize for parallel building. */
-    env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
+    build->env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
+
+    /* Pass the jobserver shared by all local builds, if any. The
+       file descriptors are kept open in the builder by runChild(). */
+    if (auto jobserver = worker.getJobserver())
+        build->env["MAKEFLAGS"] = fmt("-j --jobserver-auth=%d,%d",
+            jobserver->readSide.get(), jobserver->writeSide.get());
 
     initTmpDir();
 
@@ -1943,7 +2407,7 @@ void DerivationGoal::initEnv()
        derivation, tell the builder, so that for instance `fetchurl'
        can skip checking the output.  On older Nixes, this environment
        variable won't be set, so `fetchurl' will do the check. */
-    if (derivationIsFixed(derivationType)) env["NIX_OUTPUT_CHECKED"] = "1";
+    if (derivationIsFixed(derivationType)) build->env["NIX_OUTPUT_CHECKED"] = "1";
 
     /* *Only* if this is a fixed-output derivation, propagate the
        values of the environment variables specified in the
@@ -1956,16 +2420,16 @@ void DerivationGoal::initEnv()
        already know the cryptographic hash of the output). */
     if (derivationIsImpure(derivationType)) {
         for (auto & i : parsedDrv->getStringsAttr("impureEnvVars").value_or(Strings()))
-            env[i] = getEnv(i).value_or("");
+            build->env[i] = getEnv(i).value_or("");
     }
 
     /* Currently structured log messages piggyback on stderr, but we
        may change that in the future. So tell the builder which file
        descriptor to use for that. */
-    env["NIX_LOG_FD"] = "2";
+    build->env["NIX_LOG_FD"] = "2";
 
     /* Trigger colored output in various tools. */
-    env["TERM"] = "xterm-256color";
+    build->env["TERM"] = "xterm-256color";
 }
 
 
@@ -1977,20 +2441,27 @@ void DerivationGoal::writeStructuredAttrs()
     auto structuredAttrs = parsedDrv->getStructuredAttrs();
     if (!structuredAttrs) return;
 
-    auto json = *structuredAttrs;
+    if (!structuredAttrs->is_object() && !structuredAttrs->is_null())
+        throw BuildError("the structured attributes of '%s' are not an object", worker.store.printStorePath(drvPath));
+
+    /* The attributes that are added to (or replace) the structured
+       attributes. Rather than copying the structured attributes,
+       which can be large, these are merged in while writing the
+       files below. */
+    std::map<std::string, nlohmann::json> extraAttrs;
 
     /* Add an "outputs" object containing the output paths. */
     nlohmann::json outputs;
     for (auto & i : drv->outputs) {
         /* The placeholder must have a rewrite, so we use it to cover both the
            cases where we know or don't know the output path ahead of time. */
-        outputs[i.first] = rewriteStrings(hashPlaceholder(i.first), inputRewrites);
+        outputs[i.first] = rewriteStrings(hashPlaceholder(i.first), build->inputRewrites);
     }
-    json["outputs"] = outputs;
+    extraAttrs.insert_or_assign("outputs", std::move(outputs));
 
     /* Handle exportReferencesGraph. */
-    auto e = json.find("exportReferencesGraph");
-    if (e != json.end() && e->is_object()) {
+    auto e = structuredAttrs->find("exportReferencesGraph");
+    if (e != structuredAttrs->end() && e->is_object()) {
         for (auto i = e->begin(); i != e->end(); ++i) {
             std::ostringstream str;
             {
@@ -2001,12 +2472,38 @@ void DerivationGoal::writeStructuredAttrs()
                 worker.store.pathInfoToJSON(jsonRoot,
                     exportReferences(storePaths), false, true);
             }
-            json[i.key()] = nlohmann::json::parse(str.str()); // urgh
+            extraAttrs.insert_or_assign(i.key(), nlohmann::json::parse(str.str())); // urgh
         }
     }
 
-    writeFile(tmpDir + "/.attrs.json", rewriteStrings(json.dump(), inputRewrites));
-    chownToBuilder(tmpDir + "/.attrs.json");
+    /* Call 'f' for every attribute, in the order of the keys. */
+    auto forEachAttr = [&](auto f) {
+        auto i = structuredAttrs->is_object() ? structuredAttrs->begin() : structuredAttrs->end();
+        auto j = extraAttrs.begin();
+        while (i != structuredAttrs->end() || j != extraAttrs.end()) {
+            if (j == extraAttrs.end() || (i != structuredAttrs->end() && i.key() < j->first)) {
+                f(i.key(), i.value());
+                ++i;
+            } else {
+                if (i != structuredAttrs->end() && i.key() == j->first) ++i;
+                f(j->first, j->second);
+                ++j;
+            }
+        }
+    };
+
+    /* This produces the same output as nlohmann::json::dump(). */
+    std::string json = "{";
+    forEachAttr([&](const std::string & name, const nlohmann::json & value) {
+        if (json.size() > 1) json += ',';
+        json += nlohmann::json(name).dump();
+        json += ':';
+        json += value.dump();
+    });
+    json += '}';
+
+    writeFile(build->tmpDir + "/.attrs.json", rewriteStrings(json, build->inputRewrites));
+    chownToBuilder(build->tmpDir + "/.attrs.json");
 
     /* As a convenience to bash scripts, write a shell file that
        maps all attributes that are representable in bash -
@@ -2016,7 +2513,7 @@ void DerivationGoal::writeStructuredAttrs()
 
     auto handleSimpleType = [](const nlohmann::json & value) -> std::optional<std::string> {
         if (value.is_string())
-            return shellEscape(value);
+            return shellEscape(value.get_ref<const std::string &>());
 
         if (value.is_number()) {
             auto f = value.get<float>();
@@ -2035,47 +2532,58 @@ void DerivationGoal::writeStructuredAttrs()
 
     std::string jsonSh;
 
-    for (auto i = json.begin(); i != json.end(); ++i) {
-
-        if (!std::regex_match(i.key(), shVarName)) continue;
+    forEachAttr([&](const std::string & name, const nlohmann::json & value) {
 
-        auto & value = i.value();
+        if (!std::regex_match(name, shVarName)) return;
 
         auto s = handleSimpleType(value);
-        if (s)
-            jsonSh += fmt("declare %s=%s\n", i.key(), *s);
+        if (s) {
+            jsonSh += "declare ";
+            jsonSh += name;
+            jsonSh += '=';
+            jsonSh += *s;
+            jsonSh += '\n';
+        }
 
         else if (value.is_array()) {
             std::string s2;
-            bool good = true;
 
             for (auto i = value.begin(); i != value.end(); ++i) {
                 auto s3 = handleSimpleType(i.value());
-                if (!s3) { good = false; break; }
+                if (!s3) return;
                 s2 += *s3; s2 += ' ';
             }
 
-            if (good)
-                jsonSh += fmt("declare -a %s=(%s)\n", i.key(), s2);
+            jsonSh += "declare -a ";
+            jsonSh += name;
+            jsonSh += "=(";
+            jsonSh += s2;
+            jsonSh += ")\n";
         }
 
         else if (value.is_object()) {
             std::string s2;
-            bool good = true;
 
             for (auto i = value.begin(); i != value.end(); ++i) {
                 auto s3 = handleSimpleType(i.value());
-                if (!s3) { good = false; break; }
-                s2 += fmt("[%s]=%s ", shellEscape(i.key()), *s3);
+                if (!s3) return;
+                s2 += '[';
+                s2 += shellEscape(i.key());
+                s2 += "]=";
+                s2 += *s3;
+                s2 += ' ';
             }
 
-            if (good)
-                jsonSh += fmt("declare -A %s=(%s)\n", i.key(), s2);
+            jsonSh += "declare -A ";
+            jsonSh += name;
+            jsonSh += "=(";
+            jsonSh += s2;
+            jsonSh += ")\n";
         }
-    }
+    });
 
-    writeFile(tmpDir + "/.attrs.sh", rewriteStrings(jsonSh, inputRewrites));
-    chownToBuilder(tmpDir + "/.attrs.sh");
+    writeFile(build->tmpDir + "/.attrs.sh", rewriteStrings(jsonSh, build->inputRewrites));
+    chownToBuilder(build->tmpDir + "/.attrs.sh");
 }
 
 struct RestrictedStoreConfig : virtual LocalFSStoreConfig
@@ -2112,7 +2620,7 @@ struct RestrictedStore : public virtual RestrictedStoreConfig, public virtual Lo
     {
         StorePathSet paths;
         for (auto & p : goal.inputPaths) paths.insert(p);
-        for (auto & p : goal.addedPaths) paths.insert(p);
+        for (auto & p : goal.build->addedPaths) paths.insert(p);
         return paths;
     }
 
@@ -2283,17 +2791,17 @@ void DerivationGoal::startDaemon()
         ref<LocalStore>(std::dynamic_pointer_cast<LocalStore>(worker.store.shared_from_this())),
         *this);
 
-    addedPaths.clear();
+    build->addedPaths.clear();
 
     auto socketName = ".nix-socket";
-    Path socketPath = tmpDir + "/" + socketName;
-    env["NIX_REMOTE"] = "unix://" + tmpDirInSandbox + "/" + socketName;
+    Path socketPath = build->tmpDir + "/" + socketName;
+    build->env["NIX_REMOTE"] = "unix://" + build->tmpDirInSandbox + "/" + socketName;
 
-    daemonSocket = createUnixDomainSocket(socketPath, 0600);
+    build->daemonSocket = createUnixDomainSocket(socketPath, 0600);
 
     chownToBuilder(socketPath);
 
-    daemonThread = std::thread([this, store]() {
+    build->daemonThread = std::thread([this, store]() {
 
         while (true) {
 
@@ -2301,7 +2809,7 @@ void DerivationGoal::startDaemon()
             struct sockaddr_un remoteAddr;
             socklen_t remoteAddrLen = sizeof(remoteAddr);
 
-            AutoCloseFD remote = accept(daemonSocket.get(),
+            AutoCloseFD remote = accept(build->daemonSocket.get(),
                 (struct sockaddr *) &remoteAddr, &remoteAddrLen);
             if (!remote) {
                 if (errno == EINTR) continue;
@@ -2326,7 +2834,7 @@ void DerivationGoal::startDaemon()
                 }
             });
 
-            daemonWorkerThreads.push_back(std::move(workerThread));
+            build->daemonWorkerThreads.push_back(std::move(workerThread));
         }
 
         debug("daemon shutting down");
@@ -2336,19 +2844,21 @@ void DerivationGoal::startDaemon()
 
 void DerivationGoal::stopDaemon()
 {
-    if (daemonSocket && shutdown(daemonSocket.get(), SHUT_RDWR) == -1)
+    if (!build) return;
+
+    if (build->daemonSocket && shutdown(build->daemonSocket.get(), SHUT_RDWR) == -1)
         throw SysError("shutting down daemon socket");
 
-    if (daemonThread.joinable())
-        daemonThread.join();
+    if (build->daemonThread.joinable())
+        build->daemonThread.join();
 
     // FIXME: should prune worker threads more quickly.
     // FIXME: shutdown the client socket to speed up worker termination.
-    for (auto & thread : daemonWorkerThreads)
+    for (auto & thread : build->daemonWorkerThreads)
         thread.join();
-    daemonWorkerThreads.clear();
+    build->daemonWorkerThreads.clear();
 
-    daemonSocket = -1;
+    build->daemonSocket = -1;
 }
 
 
@@ -2356,18 +2866,18 @@ void DerivationGoal::addDependency(const StorePath & path)
 {
     if (isAllowed(path)) return;
 
-    addedPaths.insert(path);
+    build->addedPaths.insert(path);
 
     /* If we're doing a sandbox build, then we have to make the path
        appear in the sandbox. */
-    if (useChroot) {
+    if (build->useChroot) {
 
         debug("materialising '%s' in the sandbox", worker.store.printStorePath(path));
 
         #if __linux__
 
             Path source = worker.store.Store::toRealPath(path);
-            Path target = chrootRootDir + worker.store.printStorePath(path);
+            Path target = build->chrootRootDir + worker.store.printStorePath(path);
             debug("bind-mounting %s -> %s", target, source);
 
             if (pathExists(target))
@@ -2383,7 +2893,7 @@ void DerivationGoal::addDependency(const StorePath & path)
                    child process.*/
                 Pid child(startProcess([&]() {
 
-                    if (setns(sandboxMountNamespace.get(), 0) == -1)
+                    if (setns(build->sandboxMountNamespace.get(), 0) == -1)
                         throw SysError("entering sandbox mount namespace");
 
                     createDirs(target);
@@ -2418,11 +2928,10 @@ void DerivationGoal::chownToBuilder(const Path & path)
 }
 
 
-void setupSeccomp()
+#if __linux__ && HAVE_SECCOMP
+/* Return the seccomp filter for builders as a BPF program. */
+static std::string compileSeccompFilter()
 {
-#if __linux__
-    if (!settings.filterSyscalls) return;
-#if HAVE_SECCOMP
     scmp_filter_ctx ctx;
 
     if (!(ctx = seccomp_init(SCMP_ACT_ALLOW)))
@@ -2467,10 +2976,48 @@ void setupSeccomp()
         seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOTSUP), SCMP_SYS(fsetxattr), 0) != 0)
         throw SysError("unable to add seccomp rule");
 
-    if (seccomp_attr_set(ctx, SCMP_FLTATR_CTL_NNP, settings.allowNewPrivileges ? 0 : 1) != 0)
-        throw SysError("unable to set 'no new privileges' seccomp attribute");
+    Pipe pipe;
+    pipe.create();
+    if (seccomp_export_bpf(ctx, pipe.writeSide.get()) != 0)
+        throw SysError("unable to export seccomp BPF program");
+    pipe.writeSide = -1;
+
+    return drainFD(pipe.readSide.get());
+}
+
+/* Compiling the filter with libseccomp takes a significant part of
+   the sandbox setup time for trivial builds, so it's done only once
+   per process, before forking the builder. */
+static std::once_flag seccompFilterCompiled;
+static std::string seccompFilter;
+
+static void precompileSeccompFilter()
+{
+    std::call_once(seccompFilterCompiled, []() {
+        try {
+            seccompFilter = compileSeccompFilter();
+        } catch (...) {
+            /* The builder will retry and report the error. */
+        }
+    });
+}
+#endif
+
+
+void setupSeccomp()
+{
+#if __linux__
+    if (!settings.filterSyscalls) return;
+#if HAVE_SECCOMP
+    auto filter = seccompFilter.empty() ? compileSeccompFilter() : seccompFilter;
+
+    if (!settings.allowNewPrivileges && prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
+        throw SysError("unable to set 'no new privileges'");
 
-    if (seccomp_load(ctx) != 0)
+    struct sock_fprog prog;
+    prog.len = filter.size() / sizeof(struct sock_filter);
+    prog.filter = (struct sock_filter *) filter.data();
+    if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == -1)
         throw SysError("unable to load seccomp BPF program");
 #else
     throw Error(
@@ -2490,6 +3037,8 @@ void DerivationGoal::runChild()
 
         commonChildInit(builderOut);
 
+        setAffinity(cpus);
+
         try {
             setupSeccomp();
         } catch (...) {
@@ -2507,16 +3056,16 @@ void DerivationGoal::runChild()
         } catch (SysError &) { }
 
 #if __linux__
-        if (useChroot) {
+        if (build->useChroot) {
 
-            userNamespaceSync.writeSide = -1;
+            build->userNamespaceSync.writeSide = -1;
 
-            if (drainFD(userNamespaceSync.readSide.get()) != "1")
+            if (drainFD(build->userNamespaceSync.readSide.get()) != "1")
                 throw Error("user namespace initialisation failed");
 
-            userNamespaceSync.readSide = -1;
+            build->userNamespaceSync.readSide = -1;
 
-            if (privateNetwork) {
+            if (build->privateNetwork) {
 
                 /* Initialise the loopback interface. */
                 AutoCloseFD fd(socket(PF_INET, SOCK_DGRAM, IPPROTO_IP));
@@ -2550,8 +3099,8 @@ void DerivationGoal::runChild()
 
             /* Bind-mount chroot directory to itself, to treat it as a
                different filesystem from /, as needed for pivot_root. */
-            if (mount(chrootRootDir.c_str(), chrootRootDir.c_str(), 0, MS_BIND, 0) == -1)
-                throw SysError("unable to bind mount '%1%'", chrootRootDir);
+            if (mount(build->chrootRootDir.c_str(), build->chrootRootDir.c_str(), 0, MS_BIND, 0) == -1)
+                throw SysError("unable to bind mount '%1%'", build->chrootRootDir);
 
             /* Bind-mount the sandbox's Nix store onto itself so that
                we can mark it as a "shared" subtree, allowing bind
@@ -2561,10 +3110,23 @@ void DerivationGoal::runChild()
 
                Marking chrootRootDir as MS_SHARED causes pivot_root()
                to fail with EINVAL. Don't know why. */
-            Path chrootStoreDir = chrootRootDir + worker.store.storeDir;
-
-            if (mount(chrootStoreDir.c_str(), chrootStoreDir.c_str(), 0, MS_BIND, 0) == -1)
-                throw SysError("unable to bind mount the Nix store", chrootStoreDir);
+            Path chrootStoreDir = build->chrootRootDir + worker.store.storeDir;
+
+            if (build->useOverlayStore) {
+                /* Expose the entire host store read-only, with
+                   chrootStoreDir as the upper layer receiving the
+                   outputs. */
+                auto localStore = dynamic_cast<LocalFSStore *>(&worker.store);
+                assert(localStore);
+                auto options = fmt("lowerdir=%s,upperdir=%s,workdir=%s",
+                    localStore->getRealStoreDir(),
+                    chrootStoreDir, build->chrootRootDir + "/overlay-work");
+                if (mount("overlay", chrootStoreDir.c_str(), "overlay", 0, options.c_str()) == -1)
+                    throw SysError("unable to mount an overlay of the Nix store on '%s'", chrootStoreDir);
+            } else {
+                if (mount(chrootStoreDir.c_str(), chrootStoreDir.c_str(), 0, MS_BIND, 0) == -1)
+                    throw SysError("unable to bind mount the Nix store", chrootStoreDir);
+            }
 
             if (mount(0, chrootStoreDir.c_str(), 0, MS_SHARED, 0) == -1)
                 throw SysError("unable to make '%s' shared", chrootStoreDir);
@@ -2572,9 +3134,9 @@ void DerivationGoal::runChild()
             /* Set up a nearly empty /dev, unless the user asked to
                bind-mount the host /dev. */
             Strings ss;
-            if (dirsInChroot.find("/dev") == dirsInChroot.end()) {
-                createDirs(chrootRootDir + "/dev/shm");
-                createDirs(chrootRootDir + "/dev/pts");
+            if (build->dirsInChroot.find("/dev") == build->dirsInChroot.end()) {
+                createDirs(build->chrootRootDir + "/dev/shm");
+                createDirs(build->chrootRootDir + "/dev/pts");
                 ss.push_back("/dev/full");
                 if (worker.store.systemFeatures.get().count("kvm") && pathExists("/dev/kvm"))
                     ss.push_back("/dev/kvm");
@@ -2583,10 +3145,10 @@ void DerivationGoal::runChild()
                 ss.push_back("/dev/tty");
                 ss.push_back("/dev/urandom");
                 ss.push_back("/dev/zero");
-                createSymlink("/proc/self/fd", chrootRootDir + "/dev/fd");
-                createSymlink("/proc/self/fd/0", chrootRootDir + "/dev/stdin");
-                createSymlink("/proc/self/fd/1", chrootRootDir + "/dev/stdout");
-                createSymlink("/proc/self/fd/2", chrootRootDir + "/dev/stderr");
+                createSymlink("/proc/self/fd", build->chrootRootDir + "/dev/fd");
+                createSymlink("/proc/self/fd/0", build->chrootRootDir + "/dev/stdin");
+                createSymlink("/proc/self/fd/1", build->chrootRootDir + "/dev/stdout");
+                createSymlink("/proc/self/fd/2", build->chrootRootDir + "/dev/stderr");
             }
 
             /* Fixed-output derivations typically need to access the
@@ -2599,7 +3161,7 @@ void DerivationGoal::runChild()
                 // services. Don’t use it for anything else that may
                 // be configured for this system. This limits the
                 // potential impurities introduced in fixed-outputs.
-                writeFile(chrootRootDir + "/etc/nsswitch.conf", "hosts: files dns\nservices: files\n");
+                writeFile(build->chrootRootDir + "/etc/nsswitch.conf", "hosts: files dns\nservices: files\n");
 
                 ss.push_back("/etc/services");
                 ss.push_back("/etc/hosts");
@@ -2607,7 +3169,7 @@ void DerivationGoal::runChild()
                     ss.push_back("/var/run/nscd/socket");
             }
 
-            for (auto & i : ss) dirsInChroot.emplace(i, i);
+            for (auto & i : ss) build->dirsInChroot.emplace(i, i);
 
             /* Bind-mount all the directories from the "host"
                filesystem that we want in the chroot
@@ -2631,19 +3193,19 @@ void DerivationGoal::runChild()
                     throw SysError("bind mount from '%1%' to '%2%' failed", source, target);
             };
 
-            for (auto & i : dirsInChroot) {
+            for (auto & i : build->dirsInChroot) {
                 if (i.second.source == "/proc") continue; // backwards compatibility
-                doBind(i.second.source, chrootRootDir + i.first, i.second.optional);
+                doBind(i.second.source, build->chrootRootDir + i.first, i.second.optional);
             }
 
             /* Bind a new instance of procfs on /proc. */
-            createDirs(chrootRootDir + "/proc");
-            if (mount("none", (chrootRootDir + "/proc").c_str(), "proc", 0, 0) == -1)
+            createDirs(build->chrootRootDir + "/proc");
+            if (mount("none", (build->chrootRootDir + "/proc").c_str(), "proc", 0, 0) == -1)
                 throw SysError("mounting /proc");
 
             /* Mount a new tmpfs on /dev/shm to ensure that whatever
                the builder puts in /dev/shm is cleaned up automatically. */
-            if (pathExists("/dev/shm") && mount("none", (chrootRootDir + "/dev/shm").c_str(), "tmpfs", 0,
+            if (pathExists("/dev/shm") && mount("none", (build->chrootRootDir + "/dev/shm").c_str(), "tmpfs", 0,
                     fmt("size=%s", settings.sandboxShmSize).c_str()) == -1)
                 throw SysError("mounting /dev/shm");
 
@@ -2652,21 +3214,21 @@ void DerivationGoal::runChild()
                CONFIG_DEVPTS_MULTIPLE_INSTANCES=y (which is the case
                if /dev/ptx/ptmx exists). */
             if (pathExists("/dev/pts/ptmx") &&
-                !pathExists(chrootRootDir + "/dev/ptmx")
-                && !dirsInChroot.count("/dev/pts"))
+                !pathExists(build->chrootRootDir + "/dev/ptmx")
+                && !build->dirsInChroot.count("/dev/pts"))
             {
-                if (mount("none", (chrootRootDir + "/dev/pts").c_str(), "devpts", 0, "newinstance,mode=0620") == 0)
+                if (mount("none", (build->chrootRootDir + "/dev/pts").c_str(), "devpts", 0, "newinstance,mode=0620") == 0)
                 {
-                    createSymlink("/dev/pts/ptmx", chrootRootDir + "/dev/ptmx");
+                    createSymlink("/dev/pts/ptmx", build->chrootRootDir + "/dev/ptmx");
 
                     /* Make sure /dev/pts/ptmx is world-writable.  With some
                        Linux versions, it is created with permissions 0.  */
-                    chmod_(chrootRootDir + "/dev/pts/ptmx", 0666);
+                    chmod_(build->chrootRootDir + "/dev/pts/ptmx", 0666);
                 } else {
                     if (errno != EINVAL)
                         throw SysError("mounting /dev/pts");
-                    doBind("/dev/pts", chrootRootDir + "/dev/pts");
-                    doBind("/dev/ptmx", chrootRootDir + "/dev/ptmx");
+                    doBind("/dev/pts", build->chrootRootDir + "/dev/pts");
+                    doBind("/dev/ptmx", build->chrootRootDir + "/dev/ptmx");
                 }
             }
 
@@ -2684,17 +3246,17 @@ void DerivationGoal::runChild()
                 throw SysError("unsharing mount namespace");
 
             /* Do the chroot(). */
-            if (chdir(chrootRootDir.c_str()) == -1)
-                throw SysError("cannot change directory to '%1%'", chrootRootDir);
+            if (chdir(build->chrootRootDir.c_str()) == -1)
+                throw SysError("cannot change directory to '%1%'", build->chrootRootDir);
 
             if (mkdir("real-root", 0) == -1)
                 throw SysError("cannot create real-root directory");
 
             if (pivot_root(".", "real-root") == -1)
-                throw SysError("cannot pivot old root directory onto '%1%'", (chrootRootDir + "/real-root"));
+                throw SysError("cannot pivot old root directory onto '%1%'", (build->chrootRootDir + "/real-root"));
 
             if (chroot(".") == -1)
-                throw SysError("cannot change root directory to '%1%'", chrootRootDir);
+                throw SysError("cannot change root directory to '%1%'", build->chrootRootDir);
 
             if (umount2("real-root", MNT_DETACH) == -1)
                 throw SysError("cannot unmount real root filesystem");
@@ -2714,11 +3276,20 @@ void DerivationGoal::runChild()
         }
 #endif
 
-        if (chdir(tmpDirInSandbox.c_str()) == -1)
-            throw SysError("changing into '%1%'", tmpDir);
-
-        /* Close all other file descriptors. */
-        closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+        if (chdir(build->tmpDirInSandbox.c_str()) == -1)
+            throw SysError("changing into '%1%'", build->tmpDir);
+
+        /* Close all other file descriptors, except for the
+           jobserver. */
+        std::set<int> keepFDs{STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+        if (auto jobserver = worker.getJobserver()) {
+            for (int fd : {jobserver->readSide.get(), jobserver->writeSide.get()}) {
+                if (fcntl(fd, F_SETFD, 0) == -1)
+                    throw SysError("clearing close-on-exec flag");
+                keepFDs.insert(fd);
+            }
+        }
+        closeMostFDs(keepFDs);
 
 #if __linux__
         /* Change the personality to 32-bit if we're doing an
@@ -2753,8 +3324,8 @@ void DerivationGoal::runChild()
 
         /* Fill in the environment. */
         Strings envStrs;
-        for (auto & i : env)
-            envStrs.push_back(rewriteStrings(i.first + "=" + i.second, inputRewrites));
+        for (auto & i : build->env)
+            envStrs.push_back(rewriteStrings(i.first + "=" + i.second, build->inputRewrites));
 
         /* If we are running in `build-users' mode, then switch to the
            user we allocated above.  Make sure that we drop all root
@@ -2794,7 +3365,7 @@ void DerivationGoal::runChild()
             /* This has to appear before import statements. */
             std::string sandboxProfile = "(version 1)\n";
 
-            if (useChroot) {
+            if (build->useChroot) {
 
                 /* Lots and lots and lots of file functions freak out if they can't stat their full ancestry */
                 PathSet ancestry;
@@ -2802,7 +3373,7 @@ void DerivationGoal::runChild()
                 /* We build the ancestry before adding all inputPaths to the store because we know they'll
                    all have the same parents (the store), and there might be lots of inputs. This isn't
                    particularly efficient... I doubt it'll be a bottleneck in practice */
-                for (auto & i : dirsInChroot) {
+                for (auto & i : build->dirsInChroot) {
                     Path cur = i.first;
                     while (cur.compare("/") != 0) {
                         cur = dirOf(cur);
@@ -2821,7 +3392,7 @@ void DerivationGoal::runChild()
                 /* Add all our input paths to the chroot */
                 for (auto & i : inputPaths) {
                     auto p = worker.store.printStorePath(i);
-                    dirsInChroot[p] = p;
+                    build->dirsInChroot[p] = p;
                 }
 
                 /* Violations will go to the syslog if you set this. Unfortunately the destination does not appear to be configurable */
@@ -2838,7 +3409,7 @@ void DerivationGoal::runChild()
 
                 /* Add the output paths we'll use at build-time to the chroot */
                 sandboxProfile += "(allow file-read* file-write* process-exec\n";
-                for (auto & [_, path] : scratchOutputs)
+                for (auto & [_, path] : build->scratchOutputs)
                     sandboxProfile += fmt("\t(subpath \"%s\")\n", worker.store.printStorePath(path));
 
                 sandboxProfile += ")\n";
@@ -2848,7 +3419,7 @@ void DerivationGoal::runChild()
                    without file-write* allowed, access() incorrectly returns EPERM
                  */
                 sandboxProfile += "(allow file-read* file-write* process-exec\n";
-                for (auto & i : dirsInChroot) {
+                for (auto & i : build->dirsInChroot) {
                     if (i.first != i.second.source)
                         throw Error(
                             "can't map '%1%' to '%2%': mismatched impure paths not supported on Darwin",
@@ -2875,14 +3446,14 @@ void DerivationGoal::runChild()
                 }
                 sandboxProfile += ")\n";
 
-                sandboxProfile += additionalSandboxProfile;
+                sandboxProfile += build->additionalSandboxProfile;
             } else
                 sandboxProfile += "(import \"sandbox-minimal.sb\")\n";
 
             debug("Generated sandbox profile:");
             debug(sandboxProfile);
 
-            Path sandboxFile = tmpDir + "/.sandbox.sb";
+            Path sandboxFile = build->tmpDir + "/.sandbox.sb";
 
             writeFile(sandboxFile, sandboxProfile);
 
@@ -2922,7 +3493,7 @@ void DerivationGoal::runChild()
 #endif
 
         for (auto & i : drv->args)
-            args.push_back(rewriteStrings(i, inputRewrites));
+            args.push_back(rewriteStrings(i, build->inputRewrites));
 
         /* Indicate that we managed to set up the build environment. */
         writeFull(STDERR_FILENO, string("\2\n"));
@@ -2934,16 +3505,15 @@ void DerivationGoal::runChild()
 
                 BasicDerivation & drv2(*drv);
                 for (auto & e : drv2.env)
-                    e.second = rewriteStrings(e.second, inputRewrites);
-
-                if (drv->builder == "builtin:fetchurl")
-                    builtinFetchurl(drv2, netrcData);
-                else if (drv->builder == "builtin:buildenv")
-                    builtinBuildenv(drv2);
-                else if (drv->builder == "builtin:unpack-channel")
-                    builtinUnpackChannel(drv2);
-                else
+                    e.second = rewriteStrings(e.second, build->inputRewrites);
+
+                auto i = RegisterBuiltinBuilder::builtinBuilders->find(std::string(drv->builder, 8));
+                if (i == RegisterBuiltinBuilder::builtinBuilders->end())
                     throw Error("unsupported builtin function '%1%'", string(drv->builder, 8));
+                BuiltinBuilderContext ctx{drv2, netrcData};
+                for (auto & [outputName, scratchPath] : build->scratchOutputs)
+                    ctx.outputs.insert_or_assign(outputName, worker.store.printStorePath(scratchPath));
+                i->second.fun(ctx);
                 _exit(0);
             } catch (std::exception & e) {
                 writeFull(STDERR_FILENO, e.what() + std::string("\n"));
@@ -3026,14 +3596,14 @@ void DerivationGoal::registerOutputs()
        Nix calls. */
     StorePathSet referenceablePaths;
     for (auto & p : inputPaths) referenceablePaths.insert(p);
-    for (auto & i : scratchOutputs) referenceablePaths.insert(i.second);
-    for (auto & p : addedPaths) referenceablePaths.insert(p);
+    for (auto & i : build->scratchOutputs) referenceablePaths.insert(i.second);
+    for (auto & p : build->addedPaths) referenceablePaths.insert(p);
 
     /* FIXME `needsHashRewrite` should probably be removed and we get to the
        real reason why we aren't using the chroot dir */
     auto toRealPathChroot = [&](const Path & p) -> Path {
-        return useChroot && !needsHashRewrite()
-            ? chrootRootDir + p
+        return build->useChroot && !needsHashRewrite()
+            ? build->chrootRootDir + p
             : worker.store.toRealPath(p);
     };
 
@@ -3047,8 +3617,9 @@ void DerivationGoal::registerOutputs()
     struct PerhapsNeedToRegister { StorePathSet refs; };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
+    std::vector<std::pair<std::string, Path>> outputsToScan;
     for (auto & [outputName, _] : drv->outputs) {
-        auto actualPath = toRealPathChroot(worker.store.printStorePath(scratchOutputs.at(outputName)));
+        auto actualPath = toRealPathChroot(worker.store.printStorePath(build->scratchOutputs.at(outputName)));
 
         outputsToSort.insert(outputName);
 
@@ -3091,17 +3662,37 @@ void DerivationGoal::registerOutputs()
            something like that. */
         canonicalisePathMetaData(actualPath, buildUser ? buildUser->getUID() : -1, inodesSeen);
 
-        debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+        outputStats.insert_or_assign(outputName, std::move(st));
+        outputsToScan.emplace_back(outputName, actualPath);
+    }
 
-        /* Pass blank Sink as we are not ready to hash data at this stage. */
-        NullSink blank;
-        auto references = worker.store.parseStorePathSet(
-            scanForReferences(blank, actualPath, worker.store.printStorePathSet(referenceablePaths)));
+    /* Scan the outputs for references in parallel. This also computes
+       their NAR hashes, which can be used directly if the outputs
+       don't need to be rewritten. */
+    std::map<std::string, HashResult> outputNarHashes;
+    {
+        auto scanStart = std::chrono::steady_clock::now();
+        auto candidates = worker.store.printStorePathSet(referenceablePaths);
+        std::vector<std::optional<std::pair<PathSet, HashResult>>> scanned(outputsToScan.size());
+
+        ThreadPool pool;
+        for (size_t n = 0; n < outputsToScan.size(); ++n)
+            pool.enqueue([&, n]() {
+                auto & [outputName, actualPath] = outputsToScan[n];
+                debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+                scanned[n] = scanForReferences(actualPath, candidates);
+            });
+        pool.process();
 
-        outputReferencesIfUnregistered.insert_or_assign(
-            outputName,
-            PerhapsNeedToRegister { .refs = references });
-        outputStats.insert_or_assign(outputName, std::move(st));
+        for (size_t n = 0; n < outputsToScan.size(); ++n) {
+            auto & outputName = outputsToScan[n].first;
+            outputReferencesIfUnregistered.insert_or_assign(
+                outputName,
+                PerhapsNeedToRegister { .refs = worker.store.parseStorePathSet(scanned[n]->first) });
+            outputNarHashes.insert_or_assign(outputName, scanned[n]->second);
+        }
+
+        result.scanTime = elapsedSince(scanStart);
     }
 
     auto sortedOutputNames = topoSort(outputsToSort,
@@ -3115,7 +3706,7 @@ void DerivationGoal::registerOutputs()
                     StringSet referencedOutputs;
                     /* FIXME build inverted map up front so no quadratic waste here */
                     for (auto & r : refs.refs)
-                        for (auto & [o, p] : scratchOutputs)
+                        for (auto & [o, p] : build->scratchOutputs)
                             if (r == p)
                                 referencedOutputs.insert(o);
                     return referencedOutputs;
@@ -3133,7 +3724,7 @@ void DerivationGoal::registerOutputs()
 
     for (auto & outputName : sortedOutputNames) {
         auto output = drv->outputs.at(outputName);
-        auto & scratchPath = scratchOutputs.at(outputName);
+        auto & scratchPath = build->scratchOutputs.at(outputName);
         auto actualPath = toRealPathChroot(worker.store.printStorePath(scratchPath));
 
         auto finish = [&](StorePath finalStorePath) {
@@ -3143,7 +3734,7 @@ void DerivationGoal::registerOutputs()
                use. This is why the topological sort is essential to do first
                before this for loop. */
             if (scratchPath != finalStorePath)
-                outputRewrites[std::string { scratchPath.hashPart() }] = std::string { finalStorePath.hashPart() };
+                build->outputRewrites[std::string { scratchPath.hashPart() }] = std::string { finalStorePath.hashPart() };
         };
 
         std::optional<StorePathSet> referencesOpt = std::visit(overloaded {
@@ -3162,14 +3753,15 @@ void DerivationGoal::registerOutputs()
 
         auto rewriteOutput = [&]() {
             /* Apply hash rewriting if necessary. */
-            if (!outputRewrites.empty()) {
+            if (!build->outputRewrites.empty()) {
                 warn("rewriting hashes in '%1%'; cross fingers", actualPath);
 
                 /* FIXME: this is in-memory. */
                 StringSink sink;
-                dumpPath(actualPath, sink);
+                RewritingSink rsink(build->outputRewrites, sink);
+                dumpPath(actualPath, rsink);
+                rsink.flush();
                 deletePath(actualPath);
-                sink.s = make_ref<std::string>(rewriteStrings(*sink.s, outputRewrites));
                 StringSource source(*sink.s);
                 restorePath(actualPath, source);
 
@@ -3193,10 +3785,10 @@ void DerivationGoal::registerOutputs()
                 auto origHash = std::string { r.hashPart() };
                 if (r == scratchPath)
                     res.first = true;
-                else if (outputRewrites.count(origHash) == 0)
+                else if (build->outputRewrites.count(origHash) == 0)
                     res.second.insert(r);
                 else {
-                    std::string newRef = outputRewrites.at(origHash);
+                    std::string newRef = build->outputRewrites.at(origHash);
                     newRef += '-';
                     newRef += name;
                     res.second.insert(StorePath { newRef });
@@ -3275,11 +3867,14 @@ void DerivationGoal::registerOutputs()
                 /* Preemptively add rewrite rule for final hash, as that is
                    what the NAR hash will use rather than normalized-self references */
                 if (scratchPath != requiredFinalPath)
-                    outputRewrites.insert_or_assign(
+                    build->outputRewrites.insert_or_assign(
                         std::string { scratchPath.hashPart() },
                         std::string { requiredFinalPath.hashPart() });
+                bool unchanged = build->outputRewrites.empty();
                 rewriteOutput();
-                auto narHashAndSize = hashPath(htSHA256, actualPath);
+                auto narHashAndSize = unchanged
+                    ? outputNarHashes.at(outputName)
+                    : hashPath(htSHA256, actualPath);
                 ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
                 newInfo0.narSize = narHashAndSize.second;
                 auto refs = rewriteRefs();
@@ -3380,7 +3975,7 @@ void DerivationGoal::registerOutputs()
                     handleDiffHook(
                         buildUser ? buildUser->getUID() : getuid(),
                         buildUser ? buildUser->getGID() : getgid(),
-                        finalDestPath, dst, worker.store.printStorePath(drvPath), tmpDir);
+                        finalDestPath, dst, worker.store.printStorePath(drvPath), build->tmpDir);
 
                     throw NotDeterministic("derivation '%s' may not be deterministic: output '%s' differs from '%s'",
                         worker.store.printStorePath(drvPath), worker.store.toRealPath(finalDestPath), dst);
@@ -3435,9 +4030,9 @@ void DerivationGoal::registerOutputs()
 
     /* Compare the result with the previous round, and report which
        path is different, if any.*/
-    if (curRound > 1 && prevInfos != infos) {
-        assert(prevInfos.size() == infos.size());
-        for (auto i = prevInfos.begin(), j = infos.begin(); i != prevInfos.end(); ++i, ++j)
+    if (curRound > 1 && build->prevInfos != infos) {
+        assert(build->prevInfos.size() == infos.size());
+        for (auto i = build->prevInfos.begin(), j = infos.begin(); i != build->prevInfos.end(); ++i, ++j)
             if (!(*i == *j)) {
                 result.isNonDeterministic = true;
                 Path prev = worker.store.printStorePath(i->second.path) + checkSuffix;
@@ -3452,7 +4047,7 @@ void DerivationGoal::registerOutputs()
                     buildUser ? buildUser->getUID() : getuid(),
                     buildUser ? buildUser->getGID() : getgid(),
                     prev, worker.store.printStorePath(i->second.path),
-                    worker.store.printStorePath(drvPath), tmpDir);
+                    worker.store.printStorePath(drvPath), build->tmpDir);
 
                 if (settings.enforceDeterminism)
                     throw NotDeterministic(hint);
@@ -3476,7 +4071,7 @@ void DerivationGoal::registerOutputs()
     }
 
     if (curRound < nrRounds) {
-        prevInfos = std::move(infos);
+        build->prevInfos = std::move(infos);
         return;
     }
 
@@ -3503,6 +4098,28 @@ void DerivationGoal::registerOutputs()
             infos2.insert_or_assign(newInfo.path, newInfo);
         }
         localStore.registerValidPaths(infos2);
+
+        /* Record where the references occur, so that `nix
+           why-depends' doesn't have to scan the outputs. */
+        if (settings.indexReferencePositions)
+            for (auto & [_, info] : infos2) {
+                try {
+                    std::map<std::string, StorePath> byHash;
+                    for (auto & ref : info.references)
+                        byHash.emplace(std::string(ref.hashPart()), ref);
+                    StringSet hashes;
+                    for (auto & [hash, _] : byHash)
+                        hashes.insert(hash);
+                    std::map<StorePath, std::vector<ReferencePosition>> positions;
+                    for (auto & [hash, poss] : scanForReferencePositions(
+                             localStore.toRealPath(worker.store.printStorePath(info.path)), hashes))
+                        positions.insert_or_assign(byHash.at(hash), std::move(poss));
+                    localStore.addReferencePositions(info.path, positions);
+                } catch (Error & e) {
+                    warn("cannot index the references of '%s': %s",
+                        worker.store.printStorePath(info.path), e.msg());
+                }
+            }
     }
 
     /* In case of a fixed-output derivation hash mismatch, throw an
@@ -3708,16 +4325,22 @@ Path DerivationGoal::openLogFile()
     Path dir = fmt("%s/%s/%s/", logDir, LocalFSStore::drvsLogDir, string(baseName, 0, 2));
     createDirs(dir);
 
+    std::string method = settings.logCompression;
+    if (settings.compressLog && method != "bzip2" && method != "zstd")
+        throw Error("unsupported build log compression method '%s'", method);
+
     Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+        !settings.compressLog ? "" : method == "zstd" ? ".zst" : ".bz2");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
 
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
+    /* Compress on a separate thread, so that chatty builds don't
+       slow down the worker. */
     if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+        logSink = std::shared_ptr<CompressionSink>(makeBackgroundSink(makeCompressionSink(method, *logFileSink)));
     else
         logSink = logFileSink;
 
@@ -3737,16 +4360,23 @@ void DerivationGoal::closeLogFile()
 
 void DerivationGoal::deleteTmpDir(bool force)
 {
-    if (tmpDir != "") {
+    if (build && build->tmpDir != "") {
         /* Don't keep temporary directories for builtins because they
            might have privileged stuff (like a copy of netrc). */
         if (settings.keepFailed && !force && !drv->isBuiltin()) {
-            printError("note: keeping build directory '%s'", tmpDir);
-            chmod(tmpDir.c_str(), 0755);
+            printError("note: keeping build directory '%s'", build->tmpDir);
+            chmod(build->tmpDir.c_str(), 0755);
         }
-        else
-            deletePath(tmpDir);
-        tmpDir = "";
+        else {
+#if __linux__
+            /* Unmounting a tmpfs frees its contents at once. */
+            if (build->tmpDirIsTmpfs && umount2(build->tmpDir.c_str(), MNT_DETACH) == -1)
+                throw SysError("unmounting '%s'", build->tmpDir);
+#endif
+            deletePath(build->tmpDir);
+        }
+        build->tmpDirIsTmpfs = false;
+        build->tmpDir = "";
     }
 }
 
@@ -3788,6 +4418,17 @@ void DerivationGoal::handleChildOutput(int fd, const string & data)
             } else
                 currentHookLine += c;
     }
+
+    /* Show the log of the build we're waiting for as if it were our
+       own. */
+    if (fd == lockWaiterOut.get() && actLock) {
+        for (auto c : data)
+            if (c == '\n') {
+                actLock->result(resBuildLogLine, currentLockWaiterLine);
+                currentLockWaiterLine.clear();
+            } else
+                currentLockWaiterLine += c;
+    }
 }
 
 
@@ -3843,7 +4484,17 @@ OutputPathMap DerivationGoal::queryDerivationOutputMap()
 void DerivationGoal::checkPathValidity()
 {
     bool checkHash = buildMode == bmRepair;
-    for (auto & i : queryPartialDerivationOutputMap()) {
+    auto outputMap = queryPartialDerivationOutputMap();
+
+    std::map<DrvOutput, Realisation> realisations;
+    if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
+        std::set<DrvOutput> outputIds;
+        for (auto & i : outputMap)
+            outputIds.insert(DrvOutput{initialOutputs.at(i.first).outputHash, i.first});
+        realisations = worker.store.queryRealisations(outputIds);
+    }
+
+    for (auto & i : outputMap) {
         InitialOutput & info = initialOutputs.at(i.first);
         info.wanted = wantOutput(i.first, wantedOutputs);
         if (i.second) {
@@ -3858,10 +4509,10 @@ void DerivationGoal::checkPathValidity()
             };
         }
         if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
-            if (auto real = worker.store.queryRealisation(
-                    DrvOutput{initialOutputs.at(i.first).outputHash, i.first})) {
+            auto real = realisations.find(DrvOutput{info.outputHash, i.first});
+            if (real != realisations.end()) {
                 info.known = {
-                    .path = real->outPath,
+                    .path = real->second.outPath,
                     .status = PathStatus::Valid,
                 };
             }
@@ -3900,6 +4551,22 @@ void DerivationGoal::done(BuildResult::Status status, std::optional<Error> ex)
     mcExpectedBuilds.reset();
     mcRunningBuilds.reset();
 
+    if (result.timesBuilt) {
+        auto drvPathS = worker.store.printStorePath(drvPath);
+
+        if (act) {
+            Logger::Fields fields{drvPathS};
+            for (auto & [name, value] : result.getMetrics()) {
+                fields.emplace_back(name);
+                fields.emplace_back(value);
+            }
+            logger->result(act->id, resBuildMetrics, fields);
+        }
+
+        if (settings.recordBuildHistory)
+            recordBuildHistory(drvPathS, result);
+    }
+
     if (result.success()) {
         if (status == BuildResult::Built)
             worker.doneBuilds++;
@@ -50,7 +50,7 @@ struct DerivationGoal : public Goal
     StorePath drvPath;
 
     /* The path of the corresponding resolved derivation */
-    std::optional<BasicDerivation> resolvedDrv;
+    std::unique_ptr<BasicDerivation> resolvedDrv;
 
     /* The specific outputs that we need to build.  Empty means all of
        them. */
@@ -63,6 +63,13 @@ struct DerivationGoal : public Goal
        inputs. */
     bool retrySubstitution;
 
+    /* Whether the build ran out of space in a tmpfs build directory
+       (see `build-dir-tmpfs-size') and must use one on disk. */
+    bool tmpfsTooSmall = false;
+
+    /* When the goal started waiting for the locks on its outputs. */
+    std::optional<std::chrono::steady_clock::time_point> lockWaitStart;
+
     /* The derivation stored at drvPath. */
     std::unique_ptr<BasicDerivation> drv;
 
@@ -82,14 +89,15 @@ struct DerivationGoal : public Goal
     /* User selected for running the builder. */
     std::unique_ptr<UserLock> buildUser;
 
-    /* The process ID of the builder. */
-    Pid pid;
+    /* Machine-wide build slot held by this build, if `build-slots'
+       is set. */
+    std::unique_ptr<BuildSlot> buildSlot;
 
-    /* The temporary directory. */
-    Path tmpDir;
+    /* The CPUs the builder is restricted to, if any. */
+    std::vector<int> cpus;
 
-    /* The path of the temporary directory in the sandbox. */
-    Path tmpDirInSandbox;
+    /* The process ID of the builder. */
+    Pid pid;
 
     /* File descriptor for the log file. */
     AutoCloseFD fdLogFile;
@@ -109,34 +117,12 @@ struct DerivationGoal : public Goal
     /* Pipe for the builder's standard output/error. */
     Pipe builderOut;
 
-    /* Pipe for synchronising updates to the builder namespaces. */
-    Pipe userNamespaceSync;
-
-    /* The mount namespace of the builder, used to add additional
-       paths to the sandbox as a result of recursive Nix calls. */
-    AutoCloseFD sandboxMountNamespace;
-
-    /* On Linux, whether we're doing the build in its own user
-       namespace. */
-    bool usingUserNamespace = true;
-
     /* The build hook. */
     std::unique_ptr<HookInstance> hook;
 
-    /* Whether we're currently doing a chroot build. */
-    bool useChroot = false;
-
-    Path chrootRootDir;
-
-    /* RAII object to delete the chroot directory. */
-    std::shared_ptr<AutoDelete> autoDelChroot;
-
     /* The sort of derivation we are building. */
     DerivationType derivationType;
 
-    /* Whether to run the build in a private network namespace. */
-    bool privateNetwork = false;
-
     typedef void (DerivationGoal::*GoalState)();
     GoalState state;
 
@@ -149,35 +135,116 @@ struct DerivationGoal : public Goal
         { }
     };
     typedef map<Path, ChrootPath> DirsInChroot; // maps target path to source path
-    DirsInChroot dirsInChroot;
 
     typedef map<string, string> Environment;
-    Environment env;
 
 #if __APPLE__
     typedef string SandboxProfile;
-    SandboxProfile additionalSandboxProfile;
 #endif
 
-    /* Hash rewriting. */
-    StringMap inputRewrites, outputRewrites;
     typedef map<StorePath, StorePath> RedirectedOutputs;
-    RedirectedOutputs redirectedOutputs;
 
-    /* The outputs paths used during the build.
+    /* The state of an actual build, which is only allocated when the
+       goal gets to build (in tryToBuild()), rather than for every
+       goal of a possibly large plan. */
+    struct BuildState
+    {
+        /* The temporary directory. */
+        Path tmpDir;
 
-       - Input-addressed derivations or fixed content-addressed outputs are
-         sometimes built when some of their outputs already exist, and can not
-         be hidden via sandboxing. We use temporary locations instead and
-         rewrite after the build. Otherwise the regular predetermined paths are
-         put here.
+        /* Whether a tmpfs is mounted on the temporary directory. */
+        bool tmpDirIsTmpfs = false;
 
-       - Floating content-addressed derivations do not know their final build
-         output paths until the outputs are hashed, so random locations are
-         used, and then renamed. The randomness helps guard against hidden
-         self-references.
-     */
-    OutputPathMap scratchOutputs;
+        /* The path of the temporary directory in the sandbox. */
+        Path tmpDirInSandbox;
+
+        /* Pipe for synchronising updates to the builder namespaces. */
+        Pipe userNamespaceSync;
+
+        /* The mount namespace of the builder, used to add additional
+           paths to the sandbox as a result of recursive Nix calls. */
+        AutoCloseFD sandboxMountNamespace;
+
+        /* On Linux, whether we're doing the build in its own user
+           namespace. */
+        bool usingUserNamespace = true;
+
+        /* Whether we're currently doing a chroot build. */
+        bool useChroot = false;
+
+        Path chrootRootDir;
+
+        /* Whether the sandbox's Nix store is an overlay of the host store,
+           rather than a directory with a bind mount per input. */
+        bool useOverlayStore = false;
+
+        /* RAII object to delete the chroot directory. */
+        std::shared_ptr<AutoDelete> autoDelChroot;
+
+        /* Whether to run the build in a private network namespace. */
+        bool privateNetwork = false;
+
+        /* The cgroup of the builder, if `use-cgroups' is enabled. */
+        std::optional<Path> cgroup;
+
+        /* Whether the builder is a builtin that runs in the Nix
+           process (see `builtins-in-process'), and if so, its exit
+           status once it has run. */
+        bool inProcess = false;
+        std::optional<int> inProcessStatus;
+
+        DirsInChroot dirsInChroot;
+
+        Environment env;
+
+#if __APPLE__
+        SandboxProfile additionalSandboxProfile;
+#endif
+
+        /* Hash rewriting. */
+        StringMap inputRewrites, outputRewrites;
+        RedirectedOutputs redirectedOutputs;
+
+        /* The outputs paths used during the build.
+
+           - Input-addressed derivations or fixed content-addressed outputs are
+             sometimes built when some of their outputs already exist, and can not
+             be hidden via sandboxing. We use temporary locations instead and
+             rewrite after the build. Otherwise the regular predetermined paths are
+             put here.
+
+           - Floating content-addressed derivations do not know their final build
+             output paths until the outputs are hashed, so random locations are
+             used, and then renamed. The randomness helps guard against hidden
+             self-references.
+         */
+        OutputPathMap scratchOutputs;
+
+        /* If we're repairing without a chroot, there may be outputs that
+           are valid but corrupt.  So we redirect these outputs to
+           temporary paths. */
+        StorePathSet redirectedBadOutputs;
+
+        /* Path registration info from the previous round, if we're
+           building multiple times. Since this contains the hash, it
+           allows us to compare whether two rounds produced the same
+           result. */
+        std::map<Path, ValidPathInfo> prevInfos;
+
+        /* The recursive Nix daemon socket. */
+        AutoCloseFD daemonSocket;
+
+        /* The daemon main thread. */
+        std::thread daemonThread;
+
+        /* The daemon worker threads. */
+        std::vector<std::thread> daemonWorkerThreads;
+
+        /* Paths that were added via recursive Nix calls. */
+        StorePathSet addedPaths;
+    };
+
+    std::unique_ptr<BuildState> build;
 
     /* The final output paths of the build.
 
@@ -191,26 +258,18 @@ struct DerivationGoal : public Goal
 
     BuildMode buildMode;
 
-    /* If we're repairing without a chroot, there may be outputs that
-       are valid but corrupt.  So we redirect these outputs to
-       temporary paths. */
-    StorePathSet redirectedBadOutputs;
-
     BuildResult result;
 
+    /* Cached result of estimatedDuration(). */
+    std::optional<double> estimatedDuration_;
+
     /* The current round, if we're building multiple times. */
     size_t curRound = 1;
 
     size_t nrRounds;
 
-    /* Path registration info from the previous round, if we're
-       building multiple times. Since this contains the hash, it
-       allows us to compare whether two rounds produced the same
-       result. */
-    std::map<Path, ValidPathInfo> prevInfos;
-
-    uid_t sandboxUid() { return usingUserNamespace ? 1000 : buildUser->getUID(); }
-    gid_t sandboxGid() { return usingUserNamespace ?  100 : buildUser->getGID(); }
+    uid_t sandboxUid() { return build->usingUserNamespace ? 1000 : buildUser->getUID(); }
+    gid_t sandboxGid() { return build->usingUserNamespace ?  100 : buildUser->getGID(); }
 
     const static Path homeDir;
 
@@ -221,30 +280,27 @@ struct DerivationGoal : public Goal
     /* Activity that denotes waiting for a lock. */
     std::unique_ptr<Activity> actLock;
 
+    /* A process that closes `lockWaiterOut' when locks held by other
+       processes are released, and then holds them until it is
+       killed or `lockWaiterParent' is closed. When waiting for the
+       output locks held by another build of this derivation, it also
+       relays the log of that build. */
+    Pid lockWaiter;
+    AutoCloseFD lockWaiterOut, lockWaiterParent;
+    std::string currentLockWaiterLine;
+
     std::map<ActivityId, Activity> builderActivities;
 
     /* The remote machine on which we're building. */
     std::string machineName;
 
-    /* The recursive Nix daemon socket. */
-    AutoCloseFD daemonSocket;
-
-    /* The daemon main thread. */
-    std::thread daemonThread;
-
-    /* The daemon worker threads. */
-    std::vector<std::thread> daemonWorkerThreads;
-
-    /* Paths that were added via recursive Nix calls. */
-    StorePathSet addedPaths;
-
     /* Recursive Nix calls are only allowed to build or realize paths
        in the original input closure or added via a recursive Nix call
        (so e.g. you can't do 'nix-store -r /nix/store/<bla>' where
        /nix/store/<bla> is some arbitrary path in a binary cache). */
     bool isAllowed(const StorePath & path)
     {
-        return inputPaths.count(path) || addedPaths.count(path);
+        return inputPaths.count(path) || build->addedPaths.count(path);
     }
 
     friend struct RestrictedStore;
@@ -264,6 +320,8 @@ struct DerivationGoal : public Goal
 
     string key() override;
 
+    double estimatedDuration() override;
+
     void work() override;
 
     /* Add wanted outputs to an already existing derivation goal. */
@@ -349,6 +407,20 @@ struct DerivationGoal : public Goal
     /* Forcibly kill the child process, if any. */
     void killChild();
 
+    /* Release the CPUs and the cgroup of the builder, killing any
+       processes left in the cgroup. */
+    void releaseBuilderResources();
+
+    /* Run a builtin builder in the Nix process rather than in a
+       builder process. */
+    void runBuiltinInProcess();
+
+    /* Start or stop the lock waiter process, which waits for all or
+       (if `any' is set) any of `lockFiles'. startLockWaiter() returns
+       false if it couldn't be started. */
+    bool startLockWaiter(const Paths & lockFiles, bool any);
+    void stopLockWaiter();
+
     /* Create alternative path calculated from but distinct from the
        input, so we can avoid overwriting outputs (or other store paths)
        that already exist. */
@@ -26,7 +26,7 @@ void Store::buildPaths(const std::vector<StorePathWithOutputs> & drvPaths, Build
             if (ex)
                 logError(i->ex->info());
             else
-                ex = i->ex;
+                ex = *i->ex;
         }
         if (i->exitCode != Goal::ecSuccess) {
             if (auto i2 = dynamic_cast<DerivationGoal *>(i.get())) failed.insert(i2->drvPath);
@@ -86,23 +86,55 @@ void Store::ensurePath(const StorePath & path)
 
 void LocalStore::repairPath(const StorePath & path)
 {
+    repairPaths({path});
+}
+
+
+void LocalStore::repairPaths(const StorePathSet & paths)
+{
+    if (paths.empty()) return;
+
+    /* Substitute all paths in a single worker, so that they are
+       fetched concurrently. */
     Worker worker(*this);
-    GoalPtr goal = worker.makeSubstitutionGoal(path, Repair);
-    Goals goals = {goal};
+    std::map<StorePath, GoalPtr> substitutionGoals;
+    Goals goals;
+    for (auto & path : paths) {
+        auto goal = worker.makeSubstitutionGoal(path, Repair);
+        substitutionGoals.insert_or_assign(path, goal);
+        goals.insert(goal);
+    }
 
     worker.run(goals);
 
-    if (goal->exitCode != Goal::ecSuccess) {
-        /* Since substituting the path didn't work, if we have a valid
-           deriver, then rebuild the deriver. */
+    /* Since substituting some paths didn't work, rebuild the valid
+       derivers of those paths, again concurrently. */
+    std::vector<std::pair<StorePath, GoalPtr>> derivationGoals;
+    StorePathSet failed;
+    goals.clear();
+    for (auto & [path, goal] : substitutionGoals) {
+        if (goal->exitCode == Goal::ecSuccess) continue;
         auto info = queryPathInfo(path);
         if (info->deriver && isValidPath(*info->deriver)) {
-            goals.clear();
-            goals.insert(worker.makeDerivationGoal(*info->deriver, StringSet(), bmRepair));
-            worker.run(goals);
+            auto goal2 = worker.makeDerivationGoal(*info->deriver, StringSet(), bmRepair);
+            derivationGoals.emplace_back(path, goal2);
+            goals.insert(goal2);
         } else
-            throw Error(worker.exitStatus(), "cannot repair path '%s'", printStorePath(path));
+            failed.insert(path);
     }
+
+    if (!goals.empty()) {
+        worker.run(goals);
+        for (auto & [path, goal] : derivationGoals)
+            if (goal->exitCode != Goal::ecSuccess)
+                failed.insert(path);
+    }
+
+    if (failed.size() == 1)
+        throw Error(worker.exitStatus(), "cannot repair path '%s'", printStorePath(*failed.begin()));
+    else if (!failed.empty())
+        throw Error(worker.exitStatus(), "cannot repair %d paths, including '%s'",
+            failed.size(), printStorePath(*failed.begin()));
 }
 
 }
@@ -11,6 +11,21 @@ bool CompareGoalPtrs::operator() (const GoalPtr & a, const GoalPtr & b) const {
 }
 
 
+Goal::Goal(Worker & worker) : worker(worker)
+{
+    nrFailed = nrNoSubstituters = nrIncompleteClosure = 0;
+    exitCode = ecBusy;
+    worker.maxLiveGoals = std::max(worker.maxLiveGoals, ++worker.liveGoals);
+}
+
+
+Goal::~Goal()
+{
+    worker.liveGoals--;
+    trace("goal destroyed");
+}
+
+
 void addToWeakGoals(WeakGoals & goals, GoalPtr p)
 {
     // FIXME: necessary?
@@ -69,7 +84,7 @@ void Goal::amDone(ExitCode result, std::optional<Error> ex)
         if (!waiters.empty())
             logError(ex->info());
         else
-            this->ex = std::move(*ex);
+            this->ex = std::make_unique<Error>(std::move(*ex));
     }
 
     for (auto & i : waiters) {
@@ -55,19 +55,13 @@ struct Goal : public std::enable_shared_from_this<Goal>
     /* Whether the goal is finished. */
     ExitCode exitCode;
 
-    /* Exception containing an error message, if any. */
-    std::optional<Error> ex;
+    /* Exception containing an error message, if any. (Not an
+       std::optional, since an Error is big and rarely needed.) */
+    std::unique_ptr<Error> ex;
 
-    Goal(Worker & worker) : worker(worker)
-    {
-        nrFailed = nrNoSubstituters = nrIncompleteClosure = 0;
-        exitCode = ecBusy;
-    }
+    Goal(Worker & worker);
 
-    virtual ~Goal()
-    {
-        trace("goal destroyed");
-    }
+    virtual ~Goal();
 
     virtual void work() = 0;
 
@@ -99,6 +93,14 @@ struct Goal : public std::enable_shared_from_this<Goal>
 
     virtual string key() = 0;
 
+    /* An estimate of how long this goal will take to do its own work
+       (not counting its waitees), used to prioritise goals that are
+       on the critical path. */
+    virtual double estimatedDuration()
+    {
+        return 0;
+    }
+
     void amDone(ExitCode result, std::optional<Error> ex = {});
 };
 
@@ -2,9 +2,29 @@
 #include "substitution-goal.hh"
 #include "nar-info.hh"
 #include "finally.hh"
+#include "callback.hh"
 
 namespace nix {
 
+/* Running estimates of each substituter's speed, shared by all
+   workers in this process. */
+struct SubstituterStats
+{
+    /* Moving average of the time (in seconds) to answer a path info
+       query. */
+    std::optional<double> latency;
+    /* Moving average of the rate (in NAR bytes per second) at which
+       paths are copied from it. */
+    std::optional<double> throughput;
+};
+
+static Sync<std::map<std::string, SubstituterStats>> substituterStats;
+
+static void updateAverage(std::optional<double> & average, double x)
+{
+    average = average ? 0.7 * *average + 0.3 * x : x;
+}
+
 SubstitutionGoal::SubstitutionGoal(const StorePath & storePath, Worker & worker, RepairFlag repair, std::optional<ContentAddress> ca)
     : Goal(worker)
     , storePath(storePath)
@@ -55,10 +75,109 @@ void SubstitutionGoal::init()
 
     subs = settings.useSubstitutes ? getDefaultSubstituters() : std::list<ref<Store>>();
 
+    if (settings.raceSubstituters && subs.size() > 1)
+        rankSubstituters();
+
     tryNext();
 }
 
 
+void SubstitutionGoal::rankSubstituters()
+{
+    /* Send the queries concurrently. The results end up in each
+       substituter's path info cache, so tryNext() doesn't query
+       them again. Once one substituter has answered that it has the
+       path, the others get as long again to answer; the ones that
+       don't are ranked last, like those that don't have the path, so
+       that a slow substituter doesn't hold up the build. */
+    struct Answers
+    {
+        size_t pending = 0;
+        std::optional<std::chrono::steady_clock::time_point> deadline;
+        std::map<Store *, ref<const ValidPathInfo>> infos;
+    };
+
+    /* Shared with the callbacks, which may run after we've stopped
+       waiting. */
+    auto answers = std::make_shared<std::pair<Sync<Answers>, std::condition_variable>>();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (auto & sub : subs) {
+        std::optional<StorePath> path;
+        if (ca)
+            path = sub->makeFixedOutputPathFromCA(storePath.name(), *ca);
+        else if (sub->storeDir == worker.store.storeDir)
+            path = storePath;
+        else
+            continue;
+
+        answers->first.lock()->pending++;
+
+        sub->queryPathInfo(*path,
+            {[answers, start, store(&*sub), uri(sub->getUri())](std::future<ref<const ValidPathInfo>> fut) {
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::duration<double> elapsed = now - start;
+                /* Ignore answers that came from a cache. */
+                if (elapsed.count() > 0.001)
+                    updateAverage((*substituterStats.lock())[uri].latency, elapsed.count());
+                std::optional<ref<const ValidPathInfo>> info;
+                try {
+                    info = fut.get();
+                } catch (...) {
+                }
+                auto state(answers->first.lock());
+                state->pending--;
+                if (info) {
+                    state->infos.insert_or_assign(store, *info);
+                    if (!state->deadline)
+                        state->deadline = now + (now - start);
+                }
+                answers->second.notify_all();
+            }});
+    }
+
+    {
+        auto state(answers->first.lock());
+        while (state->pending) {
+            if (state->deadline) {
+                if (std::chrono::steady_clock::now() >= *state->deadline) break;
+                state.wait_until(answers->second, *state->deadline);
+            } else
+                state.wait(answers->second);
+        }
+    }
+
+    /* The expected time to fetch the path from each substituter that
+       has it. Substituters that don't have it, that failed (which
+       tryNext() will report) or that didn't answer in time go last.
+       Substituters whose throughput we don't know yet are assumed to
+       be fast, so that they get a chance to be measured. */
+    std::map<Store *, double> cost;
+
+    for (auto & [store, info] : answers->first.lock()->infos) {
+        auto stats = (*substituterStats.lock())[store->getUri()];
+        cost[store] = stats.latency.value_or(0)
+            + (stats.throughput ? info->narSize / *stats.throughput : 0);
+    }
+
+    /* Note: list::sort() is stable, so ties are broken by
+       priority. */
+    subs.sort([&](const ref<Store> & a, const ref<Store> & b) {
+        auto i = cost.find(&*a);
+        auto j = cost.find(&*b);
+        if (i == cost.end()) return false;
+        if (j == cost.end()) return true;
+        return i->second < j->second;
+    });
+
+    Strings uris;
+    for (auto & sub : subs)
+        uris.push_back(sub->getUri());
+    debug("substituters for '%s' ranked as: %s", worker.store.printStorePath(storePath), concatStringsSep(" ", uris));
+}
+
+
 void SubstitutionGoal::tryNext()
 {
     trace("trying next substituter");
@@ -210,9 +329,16 @@ void SubstitutionGoal::tryToRun()
             Activity act(*logger, actSubstitute, Logger::Fields{worker.store.printStorePath(storePath), sub->getUri()});
             PushActivity pact(act.id);
 
+            auto start = std::chrono::steady_clock::now();
+
             copyStorePath(ref<Store>(sub), ref<Store>(worker.store.shared_from_this()),
                 subPath ? *subPath : storePath, repair, sub->isTrusted ? NoCheckSigs : CheckSigs);
 
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (info->narSize && elapsed.count() > 0)
+                updateAverage((*substituterStats.lock())[sub->getUri()].throughput,
+                    info->narSize / elapsed.count());
+
             promise.set_value();
         } catch (...) {
             promise.set_exception(std::current_exception());
@@ -69,6 +69,9 @@ struct SubstitutionGoal : public Goal
 
     /* The states. */
     void init();
+    /* Query all substituters at once and order them by how quickly
+       they are expected to deliver the path. */
+    void rankSubstituters();
     void tryNext();
     void gotInfo();
     void referencesValid();
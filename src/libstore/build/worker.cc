@@ -3,9 +3,20 @@
 #include "substitution-goal.hh"
 #include "derivation-goal.hh"
 #include "hook-instance.hh"
+#include "json.hh"
+#include "thread-pool.hh"
+
+#include <array>
+#include <unordered_set>
 
 #include <poll.h>
 
+#if __linux__
+#include "cgroup.hh"
+
+#include <sys/epoll.h>
+#endif
+
 namespace nix {
 
 Worker::Worker(Store & store)
@@ -21,6 +32,12 @@ Worker::Worker(Store & store)
     timedOut = false;
     hashMismatch = false;
     checkMismatch = false;
+
+#if __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (!epollFd)
+        throw SysError("creating epoll instance");
+#endif
 }
 
 
@@ -48,6 +65,7 @@ std::shared_ptr<DerivationGoal> Worker::makeDerivationGoalCommon(
     if (!goal) {
         goal = mkDrvGoal();
         goal_weak = goal;
+        derivationGoalsCreated++;
         wakeUp(goal);
     } else {
         goal->addWantedOutputs(wantedOutputs);
@@ -81,32 +99,29 @@ std::shared_ptr<SubstitutionGoal> Worker::makeSubstitutionGoal(const StorePath &
     if (!goal) {
         goal = std::make_shared<SubstitutionGoal>(path, *this, repair, ca);
         goal_weak = goal;
+        substitutionGoalsCreated++;
         wakeUp(goal);
     }
     return goal;
 }
 
 template<typename G>
-static void removeGoal(std::shared_ptr<G> goal, std::map<StorePath, std::weak_ptr<G>> & goalMap)
+static void removeGoal(std::shared_ptr<G> goal, const StorePath & path, std::map<StorePath, std::weak_ptr<G>> & goalMap)
 {
-    /* !!! inefficient */
-    for (auto i = goalMap.begin();
-         i != goalMap.end(); )
-        if (i->second.lock() == goal) {
-            auto j = i; ++j;
-            goalMap.erase(i);
-            i = j;
-        }
-        else ++i;
+    /* A goal is only registered under its own path, so there is no
+       need to scan the whole map. */
+    auto i = goalMap.find(path);
+    if (i != goalMap.end() && i->second.lock() == goal)
+        goalMap.erase(i);
 }
 
 
 void Worker::removeGoal(GoalPtr goal)
 {
     if (auto drvGoal = std::dynamic_pointer_cast<DerivationGoal>(goal))
-        nix::removeGoal(drvGoal, derivationGoals);
+        nix::removeGoal(drvGoal, drvGoal->drvPath, derivationGoals);
     else if (auto subGoal = std::dynamic_pointer_cast<SubstitutionGoal>(goal))
-        nix::removeGoal(subGoal, substitutionGoals);
+        nix::removeGoal(subGoal, subGoal->storePath, substitutionGoals);
     else
         assert(false);
     if (topGoals.find(goal) != topGoals.end()) {
@@ -140,6 +155,113 @@ unsigned Worker::getNrLocalBuilds()
 }
 
 
+Pipe * Worker::getJobserver()
+{
+    if (!settings.buildJobserver) return nullptr;
+
+    if (!jobserver) {
+        jobserver = std::make_unique<Pipe>();
+        jobserver->create();
+
+        /* Every builder implicitly holds one job slot, so the pipe
+           contains one token less than the number of cores. */
+        unsigned int cores = settings.buildCores ? settings.buildCores : std::max(1U, std::thread::hardware_concurrency());
+        if (cores > 1)
+            writeFull(jobserver->writeSide.get(), std::string(cores - 1, '+'));
+    }
+
+    return jobserver.get();
+}
+
+
+std::vector<int> Worker::allocateCPUs()
+{
+    if (!settings.buildCPUAffinity || !settings.buildCores) return {};
+
+    if (!cpuAllocator)
+        cpuAllocator = std::make_unique<CPUAllocator>(getCPUsByNode());
+
+    /* With a jobserver, builds share the job slots of `cores' CPUs
+       dynamically, so they also share those CPUs. */
+    if (settings.buildJobserver) {
+        if (jobserverCPUs.empty())
+            jobserverCPUs = cpuAllocator->allocate(settings.buildCores);
+        return jobserverCPUs;
+    }
+
+    auto cpus = cpuAllocator->allocate(settings.buildCores);
+    if (cpus.empty())
+        debug("not enough free CPUs to restrict the builder to %d of them", settings.buildCores);
+    return cpus;
+}
+
+
+void Worker::releaseCPUs(const std::vector<int> & cpus)
+{
+    if (cpus.empty() || cpus == jobserverCPUs) return;
+    cpuAllocator->release(cpus);
+}
+
+
+void Worker::buildStarted(const Goal * goal, const std::optional<Path> & cgroup, uint64_t expectedMemory)
+{
+    localBuilds.insert_or_assign(goal, RunningBuild{cgroup, expectedMemory});
+}
+
+
+void Worker::buildFinished(const Goal * goal)
+{
+    localBuilds.erase(goal);
+}
+
+
+/* Return the amount of memory that is available for new processes
+   without swapping, according to the kernel. */
+static std::optional<uint64_t> getAvailableMemory()
+{
+#if __linux__
+    try {
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/meminfo"), "\n")) {
+            auto fields = tokenizeString<std::vector<std::string>>(line);
+            if (fields.size() == 3 && fields[0] == "MemAvailable:" && fields[2] == "kB")
+                if (auto kb = string2Int<uint64_t>(fields[1]))
+                    return *kb * 1024;
+        }
+    } catch (SysError & e) {
+        debug("cannot determine the available memory: %s", e.msg());
+    }
+#endif
+    return {};
+}
+
+
+bool Worker::haveMemoryFor(uint64_t memory)
+{
+    if (!settings.buildMemoryHeadroom || localBuilds.empty()) return true;
+
+    auto available = getAvailableMemory();
+    if (!available) return true;
+
+    /* The running builds will presumably grow to the size they had
+       last time, so subtract the memory they haven't allocated
+       yet. */
+    uint64_t reserved = settings.buildMemoryHeadroom;
+    for (auto & [goal, build] : localBuilds) {
+        uint64_t current = 0;
+#if __linux__
+        if (build.cgroup)
+            current = getCgroupStats(*build.cgroup).memoryCurrent.value_or(0);
+#endif
+        if (build.expectedMemory > current)
+            reserved += build.expectedMemory - current;
+    }
+
+    debug("%d bytes of memory available, %d reserved, %d needed", *available, reserved, memory);
+
+    return reserved + memory <= *available;
+}
+
+
 void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     bool inBuildSlot, bool respectTimeouts)
 {
@@ -152,6 +274,14 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     child.respectTimeouts = respectTimeouts;
     children.emplace_back(child);
     if (inBuildSlot) nrLocalBuilds++;
+
+#if __linux__
+    for (auto fd : fds) {
+        struct epoll_event event = { .events = EPOLLIN, .data = { .fd = fd } };
+        if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1)
+            throw SysError("adding file descriptor to epoll instance");
+    }
+#endif
 }
 
 
@@ -164,8 +294,20 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
     if (i->inBuildSlot) {
         assert(nrLocalBuilds > 0);
         nrLocalBuilds--;
+
+        /* A builder that was killed may not have returned its tokens
+           to the jobserver.  So when nothing is running anymore,
+           start over with a fresh pipe. */
+        if (nrLocalBuilds == 0) jobserver.reset();
     }
 
+#if __linux__
+    /* The file descriptors may already have been closed, in which
+       case the kernel has removed them already. */
+    for (auto fd : i->fds)
+        epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+#endif
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -242,7 +384,23 @@ void Worker::run(const Goals & _topGoals)
                 if (goal) awake2.insert(goal);
             }
             awake.clear();
-            for (auto & goal : awake2) {
+
+            /* Goals compete for build slots in the order in which
+               they run, so run the ones on the longest chain of
+               dependent builds first. */
+            std::vector<GoalPtr> order(awake2.begin(), awake2.end());
+            if (settings.scheduleCriticalPath && order.size() > 1) {
+                std::map<Goal *, double> memo;
+                std::vector<std::pair<double, GoalPtr>> keyed;
+                for (auto & goal : order)
+                    keyed.emplace_back(criticalPath(goal.get(), memo), goal);
+                std::stable_sort(keyed.begin(), keyed.end(),
+                    [](auto & a, auto & b) { return a.first > b.first; });
+                for (size_t n = 0; n < order.size(); ++n)
+                    order[n] = keyed[n].second;
+            }
+
+            for (auto & goal : order) {
                 checkInterrupt();
                 goal->work();
                 if (topGoals.empty()) break; // stuff may have been cancelled
@@ -277,8 +435,55 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || awake.empty());
     assert(!settings.keepGoing || wantingToBuild.empty());
     assert(!settings.keepGoing || children.empty());
+
+    printStats();
+}
+
+
+void Worker::printStats()
+{
+    if (getEnv("NIX_SHOW_BUILD_STATS").value_or("0") == "0") return;
+
+    JSONObject topObj(std::cerr, true);
+    {
+        auto goals = topObj.object("goals");
+        goals.attr("derivations", derivationGoalsCreated);
+        goals.attr("substitutions", substitutionGoalsCreated);
+        goals.attr("builds", buildStatesCreated);
+        goals.attr("maxLive", maxLiveGoals);
+    }
+    {
+        /* Only the goal objects themselves; derivations, maps and
+           strings owned by them come on top of this. */
+        auto bytes = topObj.object("bytes");
+        bytes.attr("derivationGoal", sizeof(DerivationGoal));
+        bytes.attr("substitutionGoal", sizeof(SubstitutionGoal));
+        bytes.attr("buildState", sizeof(DerivationGoal::BuildState));
+        bytes.attr("goals",
+            derivationGoalsCreated * sizeof(DerivationGoal)
+            + substitutionGoalsCreated * sizeof(SubstitutionGoal)
+            + buildStatesCreated * sizeof(DerivationGoal::BuildState));
+    }
+    std::cerr << "\n";
+}
+
+double Worker::criticalPath(Goal * goal, std::map<Goal *, double> & memo)
+{
+    auto i = memo.find(goal);
+    if (i != memo.end()) return i->second;
+
+    /* Guard against cycles, which shouldn't happen. */
+    memo[goal] = 0;
+
+    double longest = 0;
+    for (auto & i : goal->waiters)
+        if (auto waiter = i.lock())
+            longest = std::max(longest, criticalPath(waiter.get(), memo));
+
+    return memo[goal] = goal->estimatedDuration() + longest;
 }
 
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -325,17 +530,26 @@ void Worker::waitForInput()
     if (useTimeout)
         vomit("sleeping %d seconds", timeout);
 
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
+    std::unordered_set<int> readyFds;
+
+#if __linux__
+    std::array<struct epoll_event, 64> events;
+    int nrEvents = epoll_wait(epollFd.get(), events.data(), events.size(),
+        useTimeout ? timeout * 1000 : -1);
+    if (nrEvents == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
+    }
+    for (int n = 0; n < nrEvents; ++n)
+        readyFds.insert(events[n].data.fd);
+#else
     std::vector<struct pollfd> pollStatus;
-    std::map <int, int> fdToPollStatus;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
+    for (auto & i : children)
+        for (auto & j : i.fds)
             pollStatus.push_back((struct pollfd) { .fd = j, .events = POLLIN });
-            fdToPollStatus[j] = pollStatus.size() - 1;
-        }
-    }
 
     if (poll(pollStatus.data(), pollStatus.size(),
             useTimeout ? timeout * 1000 : -1) == -1) {
@@ -343,10 +557,13 @@ void Worker::waitForInput()
         throw SysError("waiting for input");
     }
 
+    for (auto & i : pollStatus)
+        if (i.revents) readyFds.insert(i.fd);
+#endif
+
     auto after = steady_time_point::clock::now();
 
-    /* Process all available file descriptors. FIXME: this is
-       O(children * fds). */
+    /* Process all available file descriptors. */
     decltype(children)::iterator i;
     for (auto j = children.begin(); j != children.end(); j = i) {
         i = std::next(j);
@@ -359,12 +576,15 @@ void Worker::waitForInput()
         set<int> fds2(j->fds);
         std::vector<unsigned char> buffer(4096);
         for (auto & k : fds2) {
-            if (pollStatus.at(fdToPollStatus.at(k)).revents) {
+            if (readyFds.count(k)) {
                 ssize_t rd = ::read(k, buffer.data(), buffer.size());
                 // FIXME: is there a cleaner way to handle pt close
                 // than EIO? Is this even standard?
                 if (rd == 0 || (rd == -1 && errno == EIO)) {
                     debug("%1%: got EOF", goal->getName());
+#if __linux__
+                    epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, k, nullptr);
+#endif
                     goal->handleEOF(k);
                     j->fds.erase(k);
                 } else if (rd == -1) {
@@ -440,10 +660,8 @@ unsigned int Worker::exitStatus()
 }
 
 
-bool Worker::pathContentsGood(const StorePath & path)
+static bool checkContents(Store & store, const StorePath & path)
 {
-    auto i = pathContentsGoodCache.find(path);
-    if (i != pathContentsGoodCache.end()) return i->second;
     printInfo("checking path '%s'...", store.printStorePath(path));
     auto info = store.queryPathInfo(path);
     bool res;
@@ -454,13 +672,41 @@ bool Worker::pathContentsGood(const StorePath & path)
         Hash nullHash(htSHA256);
         res = info->narHash == nullHash || info->narHash == current.first;
     }
-    pathContentsGoodCache.insert_or_assign(path, res);
     if (!res)
         printError("path '%s' is corrupted or missing!", store.printStorePath(path));
     return res;
 }
 
 
+bool Worker::pathContentsGood(const StorePath & path)
+{
+    auto i = pathContentsGoodCache.find(path);
+    if (i != pathContentsGoodCache.end()) return i->second;
+    bool res = checkContents(store, path);
+    pathContentsGoodCache.insert_or_assign(path, res);
+    return res;
+}
+
+
+void Worker::checkPathContents(const StorePathSet & paths)
+{
+    Sync<std::map<StorePath, bool>> results;
+
+    ThreadPool pool;
+    for (auto & path : paths) {
+        if (pathContentsGoodCache.count(path)) continue;
+        pool.enqueue([&, path]() {
+            bool res = checkContents(store, path);
+            results.lock()->insert_or_assign(path, res);
+        });
+    }
+    pool.process();
+
+    for (auto & [path, res] : *results.lock())
+        pathContentsGoodCache.insert_or_assign(path, res);
+}
+
+
 void Worker::markContentsGood(const StorePath & path)
 {
     pathContentsGoodCache.insert_or_assign(path, true);
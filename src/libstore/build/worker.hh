@@ -4,6 +4,7 @@
 #include "lock.hh"
 #include "store-api.hh"
 #include "goal.hh"
+#include "affinity.hh"
 
 #include <future>
 #include <thread>
@@ -65,6 +66,13 @@ private:
     /* Child processes currently running. */
     std::list<Child> children;
 
+#if __linux__
+    /* An epoll instance containing the file descriptors of all
+       children, so that waitForInput() doesn't need to build a poll
+       set on every iteration. */
+    AutoCloseFD epollFd;
+#endif
+
     /* Number of build slots occupied.  This includes local builds and
        substitutions but not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
@@ -86,6 +94,31 @@ private:
     /* Cache for pathContentsGood(). */
     std::map<StorePath, bool> pathContentsGoodCache;
 
+    /* The GNU Make jobserver shared by all local builds, if
+       `build-jobserver' is enabled.  Created on demand. */
+    std::unique_ptr<Pipe> jobserver;
+
+    /* The CPUs available to local builds, if `build-cpu-affinity' is
+       enabled.  Created on demand. */
+    std::unique_ptr<CPUAllocator> cpuAllocator;
+
+    /* The CPUs shared by all local builds when the jobserver is
+       used. */
+    std::vector<int> jobserverCPUs;
+
+    struct RunningBuild
+    {
+        /* The cgroup of the builder, if `use-cgroups' is enabled. */
+        std::optional<Path> cgroup;
+
+        /* The peak memory use recorded for the previous build of the
+           derivation. */
+        uint64_t expectedMemory;
+    };
+
+    /* The running local builds, for haveMemoryFor(). */
+    std::map<const Goal *, RunningBuild> localBuilds;
+
 public:
 
     const Activity act;
@@ -123,6 +156,14 @@ public:
     uint64_t expectedNarSize = 0;
     uint64_t doneNarSize = 0;
 
+    /* Statistics about the goals, printed at the end of run() if
+       NIX_SHOW_BUILD_STATS is set. */
+    uint64_t derivationGoalsCreated = 0;
+    uint64_t substitutionGoalsCreated = 0;
+    uint64_t buildStatesCreated = 0;
+    uint64_t liveGoals = 0;
+    uint64_t maxLiveGoals = 0;
+
     /* Whether to ask the build hook if it can build a derivation. If
        it answers with "decline-permanently", we don't try again. */
     bool tryBuildHook = true;
@@ -151,6 +192,15 @@ public:
     /* Remove a dead goal. */
     void removeGoal(GoalPtr goal);
 
+private:
+
+    /* Return the estimated time from starting `goal' until everything
+       that depends on it can finish, i.e. the length of the longest
+       chain of goals waiting for it. */
+    double criticalPath(Goal * goal, std::map<Goal *, double> & memo);
+
+public:
+
     /* Wake up a goal (i.e., there is something for it to do). */
     void wakeUp(GoalPtr goal);
 
@@ -159,6 +209,28 @@ public:
        hook). */
     unsigned int getNrLocalBuilds();
 
+    /* Return the jobserver pipe to be passed to builders, or null if
+       `build-jobserver' is disabled. */
+    Pipe * getJobserver();
+
+    /* Return the CPUs that a local builder should be restricted to,
+       or an empty set if it shouldn't be. They must be returned with
+       releaseCPUs() when the builder has finished. */
+    std::vector<int> allocateCPUs();
+
+    void releaseCPUs(const std::vector<int> & cpus);
+
+    /* Register a running local build, which is expected to use up to
+       'expectedMemory' bytes of memory. */
+    void buildStarted(const Goal * goal, const std::optional<Path> & cgroup, uint64_t expectedMemory);
+
+    void buildFinished(const Goal * goal);
+
+    /* Return whether a local build that is expected to use up to
+       'memory' bytes may start now, according to
+       `build-memory-headroom'. */
+    bool haveMemoryFor(uint64_t memory);
+
     /* Registers a running child process.  `inBuildSlot' means that
        the process counts towards the jobs limit. */
     void childStarted(GoalPtr goal, const set<int> & fds,
@@ -192,10 +264,18 @@ public:
 
     unsigned int exitStatus();
 
+    /* Print the goal statistics in JSON format, if
+       NIX_SHOW_BUILD_STATS is set. */
+    void printStats();
+
     /* Check whether the given valid path exists and has the right
        contents. */
     bool pathContentsGood(const StorePath & path);
 
+    /* Check the contents of the given paths in parallel, so that
+       subsequent calls to pathContentsGood() don't have to. */
+    void checkPathContents(const StorePathSet & paths);
+
     void markContentsGood(const StorePath & path);
 
     void updateProgress()
@@ -0,0 +1,27 @@
+#include "builtins.hh"
+
+namespace nix {
+
+std::string BuiltinBuilderContext::getAttr(const std::string & name) const
+{
+    auto i = drv.env.find(name);
+    if (i == drv.env.end()) throw Error("attribute '%s' missing", name);
+    return i->second;
+}
+
+Path BuiltinBuilderContext::getOutput(const std::string & name) const
+{
+    auto i = outputs.find(name);
+    if (i == outputs.end()) throw Error("builtin builder requires an output named '%s'", name);
+    return i->second;
+}
+
+RegisterBuiltinBuilder::BuiltinBuilders * RegisterBuiltinBuilder::builtinBuilders;
+
+RegisterBuiltinBuilder::RegisterBuiltinBuilder(const std::string & name, BuiltinBuilder && fun, bool inProcess)
+{
+    if (!builtinBuilders) builtinBuilders = new BuiltinBuilders;
+    builtinBuilders->insert_or_assign(name, Info{std::move(fun), inProcess});
+}
+
+}
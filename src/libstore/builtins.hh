@@ -2,9 +2,61 @@
 
 #include "derivations.hh"
 
+#include <functional>
+
 namespace nix {
 
-// TODO: make pluggable.
+/* The arguments of a builtin builder, i.e. the function that builds
+   a derivation whose builder is `builtin:<name>'. */
+struct BuiltinBuilderContext
+{
+    /* The derivation, with its environment rewritten like that of an
+       external builder. */
+    const BasicDerivation & drv;
+
+    /* The contents of the netrc file, for builtin:fetchurl. */
+    std::string netrcData;
+
+    /* Check that the builder may read 'path'. Builders that run in
+       the Nix process must call this for every path they read, since
+       there is no sandbox to enforce it. */
+    std::function<void(const Path & path)> checkInput = [](const Path &) { };
+
+    /* The paths of the outputs, which builders that run in the Nix
+       process must write to instead of taking them from the
+       environment of the derivation. */
+    std::map<std::string, Path> outputs;
+
+    /* Return the value of the derivation attribute 'name', throwing
+       an error if it doesn't exist. */
+    std::string getAttr(const std::string & name) const;
+
+    /* Return the path of the output 'name', throwing an error if the
+       derivation has no such output. */
+    Path getOutput(const std::string & name) const;
+};
+
+typedef std::function<void(const BuiltinBuilderContext & ctx)> BuiltinBuilder;
+
+struct RegisterBuiltinBuilder
+{
+    struct Info
+    {
+        BuiltinBuilder fun;
+
+        /* Whether the builder is cheap and only reads paths that it
+           has passed to checkInput(), so that it can run in the Nix
+           process rather than in a sandboxed builder process (see
+           `builtins-in-process'). */
+        bool inProcess = false;
+    };
+
+    typedef std::map<std::string, Info> BuiltinBuilders;
+    static BuiltinBuilders * builtinBuilders;
+
+    RegisterBuiltinBuilder(const std::string & name, BuiltinBuilder && fun, bool inProcess = false);
+};
+
 void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData);
 void builtinUnpackChannel(const BasicDerivation & drv);
 
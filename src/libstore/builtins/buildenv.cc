@@ -1,4 +1,6 @@
 #include "buildenv.hh"
+#include "builtins.hh"
+#include "thread-pool.hh"
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -7,44 +9,109 @@
 
 namespace nix {
 
+/* The profile is built in three steps: the top-level directories of
+   the packages are read in parallel; they are merged in memory, in
+   priority order, so that the result is deterministic; and finally
+   the resulting tree is written out, with the entries of each
+   directory created by one thread pool task. As before, the merge
+   only reads a subdirectory of a package if another package has a
+   file with the same name, so most of each package is never read. */
+
+/* A file in a package. */
+struct SrcNode
+{
+    enum { tRegular, tDirectory, tDangling } type = tRegular;
+    std::string name;
+    /* Whether the contents of this directory have been read. */
+    bool scanned = false;
+    /* The contents of a directory, sorted by name. */
+    std::vector<SrcNode> children;
+};
+
+struct ScannedPackage
+{
+    bool isDirectory = true;
+    SrcNode root;
+    std::vector<Path> propagated;
+};
+
+/* A file in the profile: either a symlink to 'target' (if 'src' is
+   set), or a directory. */
+struct DstNode
+{
+    SrcNode * src = nullptr;
+    Path target;
+    int priority = 0;
+    std::map<std::string, DstNode> children;
+};
+
 struct State
 {
-    std::map<Path, int> priorities;
+    DstNode root;
     unsigned long symlinks = 0;
 };
 
-/* For each activated package, create symlinks */
-static void createLinks(State & state, const Path & srcDir, const Path & dstDir, int priority)
+/* Read the entries of a directory, but not their contents. */
+static void scanDirectory(const Path & srcDir, SrcNode & dir)
 {
-    DirEntries srcFiles;
+    if (dir.scanned) return;
+    dir.scanned = true;
 
-    try {
-        srcFiles = readDirectory(srcDir);
-    } catch (SysError & e) {
-        if (e.errNo == ENOTDIR) {
-            warn("not including '%s' in the user environment because it's not a directory", srcDir);
-            return;
-        }
-        throw;
-    }
-
-    for (const auto & ent : srcFiles) {
+    for (auto & ent : readDirectory(srcDir)) {
         if (ent.name[0] == '.')
             /* not matched by glob */
             continue;
         auto srcFile = srcDir + "/" + ent.name;
-        auto dstFile = dstDir + "/" + ent.name;
+
+        SrcNode node;
+        node.name = ent.name;
 
         struct stat srcSt;
-        try {
-            if (stat(srcFile.c_str(), &srcSt) == -1)
+        if (stat(srcFile.c_str(), &srcSt) == -1) {
+            if (errno != ENOENT && errno != ENOTDIR)
                 throw SysError("getting status of '%1%'", srcFile);
-        } catch (SysError & e) {
-            if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
-                warn("skipping dangling symlink '%s'", dstFile);
-                continue;
-            }
-            throw;
+            node.type = SrcNode::tDangling;
+        } else if (S_ISDIR(srcSt.st_mode))
+            node.type = SrcNode::tDirectory;
+
+        dir.children.push_back(std::move(node));
+    }
+
+    std::sort(dir.children.begin(), dir.children.end(),
+        [](const SrcNode & a, const SrcNode & b) { return a.name < b.name; });
+}
+
+static void scanPackage(const Path & pkgDir, ScannedPackage & pkg)
+{
+    try {
+        scanDirectory(pkgDir, pkg.root);
+    } catch (SysError & e) {
+        if (e.errNo != ENOTDIR) throw;
+        pkg.isDirectory = false;
+    }
+
+    try {
+        for (const auto & p : tokenizeString<std::vector<string>>(
+                readFile(pkgDir + "/nix-support/propagated-user-env-packages"), " \n"))
+            pkg.propagated.push_back(p);
+    } catch (SysError & e) {
+        if (e.errNo != ENOENT && e.errNo != ENOTDIR) throw;
+    }
+}
+
+/* For each activated package, create symlinks */
+static void createLinks(State & state, SrcNode & srcDir_, const Path & srcDir,
+    DstNode & dstDir_, const Path & dstDir, int priority)
+{
+    scanDirectory(srcDir, srcDir_);
+
+    for (auto & src : srcDir_.children) {
+        auto srcFile = srcDir + "/" + src.name;
+        auto dstFile = dstDir + "/" + src.name;
+
+        if (src.type == SrcNode::tDangling) {
+            warn("skipping dangling symlink '%s'", dstFile);
+            continue;
         }
 
         /* The files below are special-cased to that they don't show up
@@ -60,76 +127,98 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
             hasSuffix(srcFile, "/log"))
             continue;
 
-        else if (S_ISDIR(srcSt.st_mode)) {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISDIR(dstSt.st_mode)) {
-                    createLinks(state, srcFile, dstFile, priority);
+        auto dst = dstDir_.children.find(src.name);
+
+        if (src.type == SrcNode::tDirectory) {
+            if (dst != dstDir_.children.end()) {
+                if (!dst->second.src) {
+                    createLinks(state, src, srcFile, dst->second, dstFile, priority);
                     continue;
-                } else if (S_ISLNK(dstSt.st_mode)) {
-                    auto target = canonPath(dstFile, true);
-                    if (!S_ISDIR(lstat(target).st_mode))
+                } else {
+                    auto target = canonPath(dst->second.target, true);
+                    if (dst->second.src->type != SrcNode::tDirectory)
                         throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError("unlinking '%1%'", dstFile);
-                    if (mkdir(dstFile.c_str(), 0755) == -1)
-                        throw SysError("creating directory '%1%'", dstFile);
-                    createLinks(state, target, dstFile, state.priorities[dstFile]);
-                    createLinks(state, srcFile, dstFile, priority);
+                    auto prev = std::exchange(dst->second, DstNode());
+                    createLinks(state, *prev.src, target, dst->second, dstFile, prev.priority);
+                    createLinks(state, src, srcFile, dst->second, dstFile, priority);
                     continue;
                 }
-            } else if (errno != ENOENT)
-                throw SysError("getting status of '%1%'", dstFile);
+            }
         }
 
         else {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISLNK(dstSt.st_mode)) {
-                    auto prevPriority = state.priorities[dstFile];
+            if (dst != dstDir_.children.end()) {
+                if (dst->second.src) {
+                    auto prevPriority = dst->second.priority;
                     if (prevPriority == priority)
                         throw Error(
                                 "packages '%1%' and '%2%' have the same priority %3%; "
                                 "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
                                 "to change the priority of one of the conflicting packages"
                                 " (0 being the highest priority)",
-                                srcFile, readLink(dstFile), priority);
+                                srcFile, dst->second.target, priority);
                     if (prevPriority < priority)
                         continue;
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError("unlinking '%1%'", dstFile);
-                } else if (S_ISDIR(dstSt.st_mode))
+                } else
                     throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
-            } else if (errno != ENOENT)
-                throw SysError("getting status of '%1%'", dstFile);
+            }
         }
 
-        createSymlink(srcFile, dstFile);
-        state.priorities[dstFile] = priority;
+        auto & link(dstDir_.children[src.name]);
+        link = DstNode();
+        link.src = &src;
+        link.target = srcFile;
+        link.priority = priority;
         state.symlinks++;
     }
 }
 
+static void writeTree(ThreadPool & pool, const DstNode & dir, const Path & dirPath)
+{
+    for (auto & i : dir.children) {
+        auto & node(i.second);
+        auto path = dirPath + "/" + i.first;
+        if (node.src)
+            createSymlink(node.target, path);
+        else {
+            if (mkdir(path.c_str(), 0755) == -1)
+                throw SysError("creating directory '%1%'", path);
+            pool.enqueue([&pool, &node, path]() { writeTree(pool, node, path); });
+        }
+    }
+}
+
 void buildProfile(const Path & out, Packages && pkgs)
 {
     State state;
 
+    std::map<Path, ScannedPackage> scanned;
     std::set<Path> done, postponed;
 
+    /* Read the packages in 'pkgDirs' that haven't been read yet. */
+    auto scanPackages = [&](const std::vector<Path> & pkgDirs) {
+        ThreadPool pool;
+        for (auto & pkgDir : pkgDirs) {
+            if (done.count(pkgDir)) continue;
+            auto i = scanned.try_emplace(pkgDir);
+            if (i.second)
+                pool.enqueue([&path(i.first->first), &pkg(i.first->second)]() { scanPackage(path, pkg); });
+        }
+        pool.process();
+    };
+
     auto addPkg = [&](const Path & pkgDir, int priority) {
         if (!done.insert(pkgDir).second) return;
-        createLinks(state, pkgDir, out, priority);
-
-        try {
-            for (const auto & p : tokenizeString<std::vector<string>>(
-                    readFile(pkgDir + "/nix-support/propagated-user-env-packages"), " \n"))
-                if (!done.count(p))
-                    postponed.insert(p);
-        } catch (SysError & e) {
-            if (e.errNo != ENOENT && e.errNo != ENOTDIR) throw;
-        }
+        auto & pkg(scanned.at(pkgDir));
+
+        if (!pkg.isDirectory)
+            warn("not including '%s' in the user environment because it's not a directory", pkgDir);
+        else
+            createLinks(state, pkg.root, pkgDir, state.root, out, priority);
+
+        for (const auto & p : pkg.propagated)
+            if (!done.count(p))
+                postponed.insert(p);
     };
 
     /* Symlink to the packages that have been installed explicitly by the
@@ -139,6 +228,11 @@ void buildProfile(const Path & out, Packages && pkgs)
     std::sort(pkgs.begin(), pkgs.end(), [](const Package & a, const Package & b) {
         return a.priority < b.priority || (a.priority == b.priority && a.path < b.path);
     });
+    std::vector<Path> active;
+    for (const auto & pkg : pkgs)
+        if (pkg.active)
+            active.push_back(pkg.path);
+    scanPackages(active);
     for (const auto & pkg : pkgs)
         if (pkg.active)
             addPkg(pkg.path, pkg.priority);
@@ -152,10 +246,15 @@ void buildProfile(const Path & out, Packages && pkgs)
     while (!postponed.empty()) {
         std::set<Path> pkgDirs;
         postponed.swap(pkgDirs);
+        scanPackages({pkgDirs.begin(), pkgDirs.end()});
         for (const auto & pkgDir : pkgDirs)
             addPkg(pkgDir, priorityCounter++);
     }
 
+    ThreadPool pool;
+    writeTree(pool, state.root, out);
+    pool.process();
+
     debug("created %d symlinks in user environment", state.symlinks);
 }
 
@@ -190,4 +289,8 @@ void builtinBuildenv(const BasicDerivation & drv)
     createSymlink(getAttr("manifest"), out + "/manifest.nix");
 }
 
+static RegisterBuiltinBuilder registerBuildenv("buildenv", [](const BuiltinBuilderContext & ctx) {
+    builtinBuildenv(ctx.drv);
+});
+
 }
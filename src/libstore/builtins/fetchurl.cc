@@ -3,9 +3,91 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "compression.hh"
+#include "callback.hh"
+
+#include <condition_variable>
 
 namespace nix {
 
+/* The maximum number of URLs to probe at the same time. */
+static const size_t maxProbes = 8;
+
+/* Probe the given URLs with HEAD requests, keeping up to 'maxProbes'
+   of them in flight, until one of them responds successfully. Return
+   the URLs that responded in the order in which they did, followed
+   by the ones whose probe failed or didn't finish, in their original
+   order (some servers don't support HEAD requests). URLs that don't
+   have the file are omitted. */
+static std::vector<std::string> probeUrls(const std::vector<std::string> & urls)
+{
+    struct State
+    {
+        std::vector<size_t> responded;
+        std::set<size_t> missing;
+        size_t finished = 0;
+        std::condition_variable wakeup;
+    };
+
+    auto _state = std::make_shared<Sync<State>>();
+
+    {
+        /* Use a separate FileTransfer, so that destroying it cancels
+           the probes that are still in flight. */
+        auto prober = makeFileTransfer();
+
+        size_t started = 0;
+
+        while (true) {
+            checkInterrupt();
+
+            {
+                auto state(_state->lock());
+                if (!state->responded.empty() || state->finished == urls.size()) break;
+                if (started == urls.size() || started - state->finished >= maxProbes) {
+                    state.wait(state->wakeup);
+                    continue;
+                }
+            }
+
+            FileTransferRequest request(urls[started]);
+            request.head = true;
+            request.verifyTLS = false;
+            request.tries = 1;
+
+            prober->enqueueFileTransfer(request,
+                {[_state, n(started), url(urls[started])](std::future<FileTransferResult> fut) {
+                    auto state(_state->lock());
+                    try {
+                        fut.get();
+                        state->responded.push_back(n);
+                    } catch (FileTransferError & e) {
+                        debug("probing '%s' failed: %s", url, e.what());
+                        if (e.error == FileTransfer::NotFound)
+                            state->missing.insert(n);
+                    } catch (...) {
+                        ignoreException();
+                    }
+                    state->finished++;
+                    state->wakeup.notify_one();
+                }});
+
+            started++;
+        }
+    }
+
+    auto state(_state->lock());
+
+    std::vector<std::string> res;
+    for (auto n : state->responded)
+        res.push_back(urls[n]);
+    for (size_t n = 0; n < urls.size(); ++n)
+        if (!state->missing.count(n)
+            && std::find(state->responded.begin(), state->responded.end(), n) == state->responded.end())
+            res.push_back(urls[n]);
+
+    return res;
+}
+
 void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
 {
     /* Make the host's netrc data available. Too bad curl requires
@@ -58,21 +140,41 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
         }
     };
 
-    /* Try the hashed mirrors first. */
+    /* Try the hashed mirrors and the specified URL. */
+    std::vector<std::string> urls;
+
     if (getAttr("outputHashMode") == "flat")
-        for (auto hashedMirror : settings.hashedMirrors.get())
-            try {
-                if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
-                std::optional<HashType> ht = parseHashTypeOpt(getAttr("outputHashAlgo"));
-                Hash h = newHashAllowEmpty(getAttr("outputHash"), ht);
-                fetch(hashedMirror + printHashType(h.type) + "/" + h.to_string(Base16, false));
-                return;
-            } catch (Error & e) {
-                debug(e.what());
-            }
+        for (auto hashedMirror : settings.hashedMirrors.get()) {
+            if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
+            std::optional<HashType> ht = parseHashTypeOpt(getAttr("outputHashAlgo"));
+            Hash h = newHashAllowEmpty(getAttr("outputHash"), ht);
+            urls.push_back(hashedMirror + printHashType(h.type) + "/" + h.to_string(Base16, false));
+        }
 
-    /* Otherwise try the specified URL. */
-    fetch(mainUrl);
+    urls.push_back(mainUrl);
+
+    /* Rather than waiting for every dead mirror to time out, probe
+       all URLs in parallel and download from the first one that
+       responds. */
+    if (urls.size() > 1) {
+        urls = probeUrls(urls);
+        if (urls.empty()) urls.push_back(mainUrl);
+    }
+
+    for (size_t n = 0; n < urls.size(); ++n)
+        try {
+            fetch(urls[n]);
+            return;
+        } catch (Error & e) {
+            if (n + 1 == urls.size()) throw;
+            debug(e.what());
+            /* Remove what a failed download may have left behind. */
+            deletePath(storePath);
+        }
 }
 
+static RegisterBuiltinBuilder registerFetchurl("fetchurl", [](const BuiltinBuilderContext & ctx) {
+    builtinFetchurl(ctx.drv, ctx.netrcData);
+});
+
 }
@@ -0,0 +1,98 @@
+/* Builtin builders for the small derivations that make up much of a
+   system configuration, such as text files and trees of symlinks.
+   They only read their inputs and write to the output paths passed
+   in the context, so they can run in the Nix process without forking
+   a sandboxed builder. */
+
+#include "builtins.hh"
+
+#include <sys/stat.h>
+
+namespace nix {
+
+static void makeExecutable(const Path & path)
+{
+    if (chmod(path.c_str(), 0755) == -1)
+        throw SysError("making '%s' executable", path);
+}
+
+/* builtin:write-file writes the attribute `text' to `$out', or to
+   `$out/<destination>' if `destination' is set, and makes it
+   executable if `executable' is "1". */
+static RegisterBuiltinBuilder registerWriteFile("write-file", [](const BuiltinBuilderContext & ctx) {
+    Path out = ctx.getOutput("out");
+    auto destination = get(ctx.drv.env, "destination").value_or("");
+
+    Path target = out;
+    if (destination != "") {
+        target = canonPath(out + "/" + destination);
+        if (!isInDir(target, out))
+            throw Error("destination '%s' is outside the output", destination);
+        createDirs(dirOf(target));
+    }
+
+    writeFile(target, ctx.getAttr("text"));
+
+    if (get(ctx.drv.env, "executable").value_or("") == "1")
+        makeExecutable(target);
+}, true);
+
+/* builtin:concat writes the concatenation of the files in the
+   space-separated attribute `srcs' to `$out'. */
+static RegisterBuiltinBuilder registerConcat("concat", [](const BuiltinBuilderContext & ctx) {
+    Path out = ctx.getOutput("out");
+
+    AutoCloseFD fd = open(out.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (!fd) throw SysError("creating file '%s'", out);
+
+    FdSink sink(fd.get());
+    for (auto & src : tokenizeString<Strings>(ctx.getAttr("srcs"))) {
+        ctx.checkInput(src);
+        readFile(src, sink);
+    }
+    sink.flush();
+
+    if (get(ctx.drv.env, "executable").value_or("") == "1")
+        makeExecutable(out);
+}, true);
+
+/* Add 'src' to the tree at 'dst': directories are created, and
+   files become symlinks to the corresponding file in 'src'. Symlinks
+   are copied. Existing files take precedence. */
+static void joinTree(const Path & src, const Path & dst)
+{
+    for (auto & entry : readDirectory(src)) {
+        auto srcFile = src + "/" + entry.name;
+        auto dstFile = dst + "/" + entry.name;
+        auto st = lstat(srcFile);
+
+        if (S_ISDIR(st.st_mode)) {
+            struct stat dstSt;
+            if (lstat(dstFile.c_str(), &dstSt) == 0) {
+                if (S_ISDIR(dstSt.st_mode)) joinTree(srcFile, dstFile);
+                continue;
+            }
+            if (mkdir(dstFile.c_str(), 0755) == -1)
+                throw SysError("creating directory '%s'", dstFile);
+            joinTree(srcFile, dstFile);
+        }
+
+        else if (!pathExists(dstFile))
+            createSymlink(S_ISLNK(st.st_mode) ? readLink(srcFile) : srcFile, dstFile);
+    }
+}
+
+/* builtin:symlink-join creates a directory `$out' that contains the
+   union of the directories in the space-separated attribute `paths',
+   like lndir. Earlier paths take precedence. */
+static RegisterBuiltinBuilder registerSymlinkJoin("symlink-join", [](const BuiltinBuilderContext & ctx) {
+    Path out = ctx.getOutput("out");
+    createDirs(out);
+
+    for (auto & path : tokenizeString<Strings>(ctx.getAttr("paths"))) {
+        ctx.checkInput(path);
+        joinTree(path, out);
+    }
+}, true);
+
+}
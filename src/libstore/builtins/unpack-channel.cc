@@ -26,4 +26,8 @@ void builtinUnpackChannel(const BasicDerivation & drv)
         throw SysError("renaming channel directory");
 }
 
+static RegisterBuiltinBuilder registerUnpackChannel("unpack-channel", [](const BuiltinBuilderContext & ctx) {
+    builtinUnpackChannel(ctx.drv);
+});
+
 }
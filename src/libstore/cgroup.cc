@@ -0,0 +1,222 @@
+#if __linux__
+
+#include "cgroup.hh"
+#include "util.hh"
+
+#include <regex>
+#include <thread>
+
+#include <signal.h>
+
+namespace nix {
+
+static const Path cgroupFS = "/sys/fs/cgroup";
+
+std::map<std::string, std::string> getCgroups(const Path & cgroupFile)
+{
+    std::map<std::string, std::string> cgroups;
+
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile(cgroupFile), "\n")) {
+        static std::regex regex("([0-9]+):([^:]*):(.*)");
+        std::smatch match;
+        if (!std::regex_match(line, match, regex))
+            throw Error("invalid line '%s' in '%s'", line, cgroupFile);
+
+        std::string name = hasPrefix(std::string(match[2]), "name=") ? std::string(match[2], 5) : match[2];
+        cgroups.insert_or_assign(name, match[3]);
+    }
+
+    return cgroups;
+}
+
+std::optional<Path> getOwnCgroup()
+{
+    if (!pathExists(cgroupFS + "/cgroup.controllers")) return {};
+
+    auto cgroups = getCgroups("/proc/self/cgroup");
+    auto i = cgroups.find("");
+    if (i == cgroups.end()) return {};
+
+    return canonPath(cgroupFS + "/" + i->second);
+}
+
+/* The leaf cgroup that the Nix processes are moved into, so that
+   their own cgroup only contains the cgroups of the builds. */
+static const std::string supervisorCgroupName = "nix-supervisor";
+
+/* Return the processes in 'cgroup'. Throws unless they all run the
+   same executable as this process (e.g. in a dedicated
+   nix-daemon.service), i.e. unless the cgroup appears to be delegated
+   to Nix. Otherwise it's shared with other programs (e.g. in a user
+   session's scope), which we must not move into a cgroup of ours. */
+static std::vector<std::string> getOwnProcesses(const Path & cgroup)
+{
+    if (cgroup == cgroupFS)
+        throw Error("it is the root cgroup");
+
+    auto self = readLink("/proc/self/exe");
+    auto pids = tokenizeString<std::vector<std::string>>(readFile(cgroup + "/cgroup.procs"));
+    for (auto & pid : pids) {
+        if (pid == std::to_string(getpid())) continue;
+        std::string exe;
+        try {
+            exe = readLink("/proc/" + pid + "/exe");
+        } catch (SysError & e) {
+            /* The process is gone, or a kernel thread. */
+            if (e.errNo == ENOENT) continue;
+            throw;
+        }
+        if (exe != self)
+            throw Error("it contains process %s (%s), which isn't Nix", pid, exe);
+    }
+    return pids;
+}
+
+std::optional<Path> createChildCgroup(const std::string & name)
+{
+    auto parent = getOwnCgroup();
+    if (!parent) return {};
+
+    if (baseNameOf(*parent) == supervisorCgroupName)
+        parent = dirOf(*parent);
+
+    /* Enable the memory controller for the children, so that their
+       memory use can be measured. Cgroup v2 only allows this for a
+       cgroup that doesn't contain processes itself (the "no internal
+       processes" rule), so first move every process in it (i.e. this
+       process, and with a dedicated cgroup like nix-daemon.service,
+       the other daemon processes) into a leaf cgroup. That's only
+       done if all those processes are Nix's. Otherwise, or if it
+       fails, only the CPU statistics that every cgroup has are
+       available. */
+    static bool warned = false;
+    try {
+        if (readFile(*parent + "/cgroup.subtree_control").find("memory") == std::string::npos) {
+            auto supervisor = *parent + "/" + supervisorCgroupName;
+            getOwnProcesses(*parent);
+            createDirs(supervisor);
+
+            /* Repeat until no processes are left, since they may
+               fork in the meantime. */
+            for (unsigned int round = 0; ; ++round) {
+                auto pids = getOwnProcesses(*parent);
+                if (pids.empty()) break;
+                if (round == 1000)
+                    throw Error("cannot move the processes in cgroup '%s'", *parent);
+                for (auto & pid : pids)
+                    try {
+                        writeFile(supervisor + "/cgroup.procs", pid);
+                    } catch (SysError & e) {
+                        if (e.errNo != ESRCH) throw;
+                    }
+            }
+
+            writeFile(*parent + "/cgroup.subtree_control", "+memory");
+        }
+    } catch (Error & e) {
+        if (!warned) {
+            warn("cannot enable memory accounting for builds in cgroup '%s': %s", *parent, e.msg());
+            warned = true;
+        }
+    }
+
+    Path cgroup = *parent + "/" + name;
+
+    if (pathExists(cgroup)) destroyCgroup(cgroup);
+
+    if (mkdir(cgroup.c_str(), 0755) == -1)
+        throw SysError("creating cgroup '%s'", cgroup);
+
+    return cgroup;
+}
+
+void joinCgroup(const Path & cgroup)
+{
+    writeFile(cgroup + "/cgroup.procs", std::to_string(getpid()));
+}
+
+CgroupStats getCgroupStats(const Path & cgroup)
+{
+    CgroupStats stats;
+
+    auto readNumber = [&](const std::string & file) -> std::optional<uint64_t> {
+        auto path = cgroup + "/" + file;
+        if (!pathExists(path)) return {};
+        return string2Int<uint64_t>(trim(readFile(path)));
+    };
+
+    auto cpuStat = cgroup + "/cpu.stat";
+    if (pathExists(cpuStat))
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile(cpuStat), "\n")) {
+            auto fields = tokenizeString<std::vector<std::string>>(line);
+            if (fields.size() != 2) continue;
+            auto value = string2Int<uint64_t>(fields[1]);
+            if (!value) continue;
+            if (fields[0] == "user_usec")
+                stats.cpuUser = std::chrono::microseconds(*value);
+            else if (fields[0] == "system_usec")
+                stats.cpuSystem = std::chrono::microseconds(*value);
+        }
+
+    stats.memoryCurrent = readNumber("memory.current");
+    stats.memoryPeak = readNumber("memory.peak");
+
+    /* io.stat has a line like `8:0 rbytes=... wbytes=... rios=...'
+       for every device. */
+    auto ioStat = cgroup + "/io.stat";
+    if (pathExists(ioStat)) {
+        stats.ioRead = 0;
+        stats.ioWritten = 0;
+        for (auto & field : tokenizeString<std::vector<std::string>>(readFile(ioStat), " \n")) {
+            auto eq = field.find('=');
+            if (eq == field.npos) continue;
+            auto value = string2Int<uint64_t>(field.substr(eq + 1));
+            if (!value) continue;
+            if (field.compare(0, eq, "rbytes") == 0)
+                *stats.ioRead += *value;
+            else if (field.compare(0, eq, "wbytes") == 0)
+                *stats.ioWritten += *value;
+        }
+    }
+
+    return stats;
+}
+
+void destroyCgroup(const Path & cgroup)
+{
+    if (!pathExists(cgroup)) return;
+
+    for (auto & entry : readDirectory(cgroup))
+        if (entry.type == DT_DIR)
+            destroyCgroup(cgroup + "/" + entry.name);
+
+    /* Kill the processes in the cgroup, using cgroup.kill if the
+       kernel has it (Linux 5.14). Otherwise kill them one by one,
+       repeating until no new ones show up. */
+    auto killFile = cgroup + "/cgroup.kill";
+    bool haveKill = pathExists(killFile);
+    if (haveKill) writeFile(killFile, "1");
+
+    for (unsigned int round = 0; ; ++round) {
+        auto pids = tokenizeString<std::vector<std::string>>(readFile(cgroup + "/cgroup.procs"));
+        if (pids.empty()) break;
+
+        if (round == 1000)
+            throw Error("cannot kill the processes in cgroup '%s'", cgroup);
+
+        if (!haveKill)
+            for (auto & s : pids)
+                if (auto pid = string2Int<pid_t>(s))
+                    if (kill(*pid, SIGKILL) == -1 && errno != ESRCH)
+                        throw SysError("killing process %d in cgroup '%s'", *pid, cgroup);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (rmdir(cgroup.c_str()) == -1)
+        throw SysError("deleting cgroup '%s'", cgroup);
+}
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#if __linux__
+
+#include "types.hh"
+
+#include <chrono>
+#include <optional>
+
+namespace nix {
+
+/* Return the cgroups of a process, as listed in a file like
+   /proc/self/cgroup, as a map from hierarchies (the empty string for
+   the unified cgroup v2 hierarchy) to cgroup paths. */
+std::map<std::string, std::string> getCgroups(const Path & cgroupFile);
+
+/* Return the directory of the cgroup v2 cgroup of the current
+   process, e.g. /sys/fs/cgroup/system.slice/nix-daemon.service, or
+   nothing if cgroup v2 is not mounted. */
+std::optional<Path> getOwnCgroup();
+
+/* Create a cgroup named 'name' below the cgroup of the current
+   process, replacing any existing one, and return its directory. To
+   be able to enable the memory controller there, the processes in
+   that cgroup are first moved into a 'nix-supervisor' child cgroup,
+   provided that they are all Nix processes; otherwise only CPU
+   statistics are available. Returns nothing if cgroup v2 is not
+   mounted. */
+std::optional<Path> createChildCgroup(const std::string & name);
+
+/* Move the current process into the given cgroup. */
+void joinCgroup(const Path & cgroup);
+
+struct CgroupStats
+{
+    std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+
+    /* Memory use in bytes. These require the memory controller to be
+       enabled for the cgroup, and the peak use requires Linux 5.19
+       or later. */
+    std::optional<uint64_t> memoryCurrent, memoryPeak;
+
+    /* The bytes read from and written to block devices, if the io
+       controller is enabled for the cgroup. */
+    std::optional<uint64_t> ioRead, ioWritten;
+};
+
+CgroupStats getCgroupStats(const Path & cgroup);
+
+/* Kill all processes in the given cgroup and remove it. */
+void destroyCgroup(const Path & cgroup);
+
+}
+
+#endif
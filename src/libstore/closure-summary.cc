@@ -0,0 +1,167 @@
+#include "closure-summary.hh"
+#include "globals.hh"
+#include "names.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+
+#include <regex>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists ClosureSummaries (
+    store    text not null,
+    path     text not null,
+    narHash  text not null,
+    summary  text not null,
+    primary key (store, path)
+);
+
+)sql";
+
+struct ClosureSummaryCache
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertSummary, querySummary;
+    };
+
+    Sync<State> _state;
+
+    ClosureSummaryCache()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/closure-summaries-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertSummary.create(state->db,
+            "insert or replace into ClosureSummaries(store, path, narHash, summary) values (?, ?, ?, ?)");
+
+        state->querySummary.create(state->db,
+            "select summary from ClosureSummaries where store = ? and path = ? and narHash = ?");
+    }
+};
+
+/* Return the cache, or nullptr if it's disabled or can't be
+   opened. */
+static ClosureSummaryCache * getCache()
+{
+    if (!settings.closureSummaryCache) return nullptr;
+
+    static std::unique_ptr<ClosureSummaryCache> cache = []() -> std::unique_ptr<ClosureSummaryCache> {
+        try {
+            return std::make_unique<ClosureSummaryCache>();
+        } catch (Error & e) {
+            debug("cannot open the closure summary cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+
+    return cache.get();
+}
+
+/* Summaries are stored as lines of the form
+   `<name>\t<version>\t<size>'. Store path names can't contain tabs or
+   newlines. */
+
+static std::string printSummary(const ClosureSummary & summary)
+{
+    std::string s;
+    for (auto & entry : summary.entries)
+        s += fmt("%s\t%s\t%d\n", entry.name, entry.version, entry.narSize);
+    return s;
+}
+
+static ClosureSummary parseSummary(const std::string & s)
+{
+    ClosureSummary summary;
+    for (auto & line : tokenizeString<Strings>(s, "\n")) {
+        auto tab1 = line.find('\t');
+        auto tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+        if (tab2 == std::string::npos)
+            throw Error("invalid closure summary line '%s'", line);
+        auto narSize = string2Int<uint64_t>(line.substr(tab2 + 1));
+        if (!narSize)
+            throw Error("invalid closure summary line '%s'", line);
+        summary.entries.push_back({
+            .name = line.substr(0, tab1),
+            .version = line.substr(tab1 + 1, tab2 - tab1 - 1),
+            .narSize = *narSize,
+        });
+    }
+    return summary;
+}
+
+static ClosureSummary computeClosureSummary(Store & store, const StorePath & path)
+{
+    StorePathSet closure;
+    store.computeFSClosure(path, closure);
+
+    std::map<std::pair<std::string, std::string>, uint64_t> sizes;
+
+    for (auto & p : closure) {
+        /* Strip the output name. Unfortunately this is ambiguous (we
+           can't distinguish between output names like "bin" and
+           version suffixes like "unstable"). */
+        static std::regex regex("(.*)-([a-z]+|lib32|lib64)");
+        std::smatch match;
+        std::string name(p.name());
+        if (std::regex_match(name, match, regex))
+            name = match[1];
+
+        DrvName drvName(name);
+        sizes[{drvName.name, drvName.version}] += store.queryPathInfo(p)->narSize;
+    }
+
+    ClosureSummary summary;
+    summary.entries.reserve(sizes.size());
+    for (auto & [key, narSize] : sizes)
+        summary.entries.push_back({ .name = key.first, .version = key.second, .narSize = narSize });
+    return summary;
+}
+
+ClosureSummary getClosureSummary(Store & store, const StorePath & path)
+{
+    auto cache = getCache();
+    if (!cache) return computeClosureSummary(store, path);
+
+    auto storeUri = store.getUri();
+    auto pathS = store.printStorePath(path);
+    auto narHash = store.queryPathInfo(path)->narHash.to_string(Base32, true);
+
+    try {
+        auto cached = retrySQLite<std::optional<std::string>>([&]() -> std::optional<std::string> {
+            auto state(cache->_state.lock());
+            auto query(state->querySummary.use()(storeUri)(pathS)(narHash));
+            if (!query.next()) return {};
+            return query.getStr(0);
+        });
+        if (cached) return parseSummary(*cached);
+    } catch (Error & e) {
+        debug("cannot look up '%s' in the closure summary cache: %s", pathS, e.what());
+    }
+
+    auto summary = computeClosureSummary(store, path);
+
+    try {
+        retrySQLite<void>([&]() {
+            auto state(cache->_state.lock());
+            state->insertSummary.use()(storeUri)(pathS)(narHash)(printSummary(summary)).exec();
+        });
+    } catch (Error & e) {
+        debug("cannot write '%s' to the closure summary cache: %s", pathS, e.what());
+    }
+
+    return summary;
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "store-api.hh"
+
+namespace nix {
+
+/* A summary of the closure of a store path: for every package name
+   (the name of a store path without its version and output name),
+   the versions that occur in the closure and the total NAR size of
+   the paths of each version. Entries are sorted by name and version,
+   so two summaries can be compared by merging them. */
+struct ClosureSummary
+{
+    struct Entry
+    {
+        std::string name, version;
+        uint64_t narSize = 0;
+    };
+
+    std::vector<Entry> entries;
+};
+
+/* Return the summary of the closure of `path'. Since the closure of
+   a valid store path doesn't change, summaries are kept in a
+   persistent cache in `~/.cache/nix` (see the
+   `closure-summary-cache` setting), keyed by the store and the NAR
+   hash of `path'. */
+ClosureSummary getClosureSummary(Store & store, const StorePath & path);
+
+}
@@ -2,11 +2,17 @@
 #include "monitor-fd.hh"
 #include "worker-protocol.hh"
 #include "store-api.hh"
+#include "local-store.hh"
 #include "finally.hh"
 #include "affinity.hh"
 #include "archive.hh"
 #include "derivations.hh"
 #include "args.hh"
+#include "compression.hh"
+#include "metrics.hh"
+
+#include <iomanip>
+#include <thread>
 
 namespace nix::daemon {
 
@@ -35,21 +41,62 @@ struct TunnelLogger : public Logger
     {
         bool canSendStderr = false;
         std::vector<std::string> pendingMsgs;
+
+        /* Messages waiting to be sent in a single STDERR_BATCH
+           frame. */
+        std::string batch;
+
+        bool stopFlusher = false;
     };
 
     Sync<State> state_;
 
     unsigned int clientVersion;
 
+    /* Clients that understand STDERR_BATCH get their log messages,
+       activities and results in batches, rather than one write (and
+       one wakeup of the client) per message. A batch is sent when it
+       reaches `maxBatchSize', at most `maxLatency' after its first
+       message, or when the operation finishes. */
+    static constexpr size_t maxBatchSize = 64 * 1024;
+    static constexpr std::chrono::milliseconds maxLatency{50};
+
+    /* The thread that sends a batch after `maxLatency'. It is started
+       by the first batched message of an operation and stopped by
+       stopWork(). */
+    std::thread flusher;
+    std::condition_variable wakeup;
+
     TunnelLogger(FdSink & to, unsigned int clientVersion)
         : to(to), clientVersion(clientVersion) { }
 
+    ~TunnelLogger()
+    {
+        joinFlusher();
+    }
+
+    bool batching() const
+    {
+        return GET_PROTOCOL_MINOR(clientVersion) >= 33;
+    }
+
     void enqueueMsg(const std::string & s)
     {
         auto state(state_.lock());
 
         if (state->canSendStderr) {
             assert(state->pendingMsgs.empty());
+            if (batching()) {
+                bool wasEmpty = state->batch.empty();
+                state->batch += s;
+                if (state->batch.size() >= maxBatchSize)
+                    sendBatch(*state);
+                else if (!flusher.joinable())
+                    flusher = std::thread([this]() { runFlusher(); });
+                else if (wasEmpty)
+                    wakeup.notify_one();
+                return;
+            }
             try {
                 to(s);
                 to.flush();
@@ -63,6 +110,65 @@ struct TunnelLogger : public Logger
             state->pendingMsgs.push_back(s);
     }
 
+    void sendBatch(State & state)
+    {
+        if (state.batch.empty()) return;
+        try {
+            to << STDERR_BATCH << state.batch;
+            to.flush();
+            state.batch.clear();
+        } catch (...) {
+            state.canSendStderr = false;
+            state.batch.clear();
+            throw;
+        }
+    }
+
+    void runFlusher()
+    {
+        auto state(state_.lock());
+        while (!state->stopFlusher) {
+            if (state->batch.empty()) {
+                state.wait(wakeup);
+                continue;
+            }
+            /* Give more messages a chance to join the batch. */
+            if (state.wait_for(wakeup, maxLatency, [&]() { return state->stopFlusher; }))
+                break;
+            try {
+                sendBatch(*state);
+            } catch (...) {
+                /* The client is gone, which the main thread will
+                   notice. Note that we can't log here, since that
+                   would need the lock we're holding. */
+            }
+        }
+    }
+
+    void joinFlusher()
+    {
+        std::thread thread;
+        {
+            auto state(state_.lock());
+            state->stopFlusher = true;
+            thread = std::move(flusher);
+        }
+        wakeup.notify_one();
+        if (thread.joinable()) thread.join();
+        state_.lock()->stopFlusher = false;
+    }
+
+    /* Run `fun', which writes directly to the client, after sending
+       any batched messages and without the flusher or other threads
+       writing at the same time. */
+    template<typename F>
+    void withOutput(F fun)
+    {
+        auto state(state_.lock());
+        sendBatch(*state);
+        fun();
+    }
+
     void log(Verbosity lvl, const FormatOrString & fs) override
     {
         if (lvl > verbosity) return;
@@ -103,9 +209,13 @@ struct TunnelLogger : public Logger
        client. */
     void stopWork(const Error * ex = nullptr)
     {
+        state_.lock()->canSendStderr = false;
+
+        joinFlusher();
+
         auto state(state_.lock());
 
-        state->canSendStderr = false;
+        sendBatch(*state);
 
         if (!ex)
             to << STDERR_LAST;
@@ -151,24 +261,31 @@ struct TunnelLogger : public Logger
 
 struct TunnelSink : Sink
 {
+    TunnelLogger & logger;
     Sink & to;
-    TunnelSink(Sink & to) : to(to) { }
+    TunnelSink(TunnelLogger & logger, Sink & to) : logger(logger), to(to) { }
     void operator () (std::string_view data)
     {
-        to << STDERR_WRITE;
-        writeString(data, to);
+        logger.withOutput([&]() {
+            to << STDERR_WRITE;
+            writeString(data, to);
+        });
     }
 };
 
 struct TunnelSource : BufferedSource
 {
+    TunnelLogger & logger;
     Source & from;
     BufferedSink & to;
-    TunnelSource(Source & from, BufferedSink & to) : from(from), to(to) { }
+    TunnelSource(TunnelLogger & logger, Source & from, BufferedSink & to)
+        : logger(logger), from(from), to(to) { }
     size_t readUnbuffered(char * data, size_t len) override
     {
-        to << STDERR_READ << len;
-        to.flush();
+        logger.withOutput([&]() {
+            to << STDERR_READ << len;
+            to.flush();
+        });
         size_t n = readString(data, len, from);
         if (n == 0) throw EndOfFile("unexpected end-of-file");
         return n;
@@ -259,8 +376,17 @@ static void writeValidPathInfo(
     }
 }
 
+/* The compression applied to NARs sent in either direction, as
+   agreed with the client when the connection was opened. */
+struct NarCompression
+{
+    std::string method = "none";
+    std::optional<int> level;
+};
+
 static void performOp(TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, RecursiveFlag recursive, unsigned int clientVersion,
+    const NarCompression & narCompression,
     Source & from, BufferedSink & to, unsigned int op)
 {
     switch (op) {
@@ -473,7 +599,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         auto path = store->parseStorePath(readString(from));
         readInt(from); // obsolete
         logger->startWork();
-        TunnelSink sink(to);
+        TunnelSink sink(*logger, to);
         store->exportPath(path, sink);
         logger->stopWork();
         to << 1;
@@ -482,7 +608,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
 
     case wopImportPaths: {
         logger->startWork();
-        TunnelSource source(from, to);
+        TunnelSource source(*logger, from, to);
         auto paths = store->importPaths(source,
             trusted ? NoCheckSigs : CheckSigs);
         logger->stopWork();
@@ -575,6 +701,13 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         auto res = store->buildDerivation(drvPath, drv, buildMode);
         logger->stopWork();
         to << res.status << res.errorMsg;
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 34) {
+            to << res.timesBuilt << res.isNonDeterministic << res.startTime << res.stopTime;
+            auto metrics = res.getMetrics();
+            to << metrics.size();
+            for (auto & [name, value] : metrics)
+                to << name << value;
+        }
         break;
     }
 
@@ -596,6 +729,15 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddTempRoots: {
+        auto paths = worker_proto::read(*store, from, Phantom<StorePathSet> {});
+        logger->startWork();
+        store->addTempRoots(paths);
+        logger->stopWork();
+        to << 1;
+        break;
+    }
+
     case wopAddIndirectRoot: {
         Path path = absPath(readString(from));
         logger->startWork();
@@ -636,10 +778,12 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         options.action = (GCOptions::GCAction) readInt(from);
         options.pathsToDelete = worker_proto::read(*store, from, Phantom<StorePathSet> {});
         from >> options.ignoreLiveness >> options.maxFreed;
+        /* Formerly an obsolete field, which older clients set to
+           0. */
+        options.incremental = readInt(from);
         // obsolete fields
         readInt(from);
         readInt(from);
-        readInt(from);
 
         GCResults results;
 
@@ -761,6 +905,19 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryPathInfos: {
+        auto paths = worker_proto::read(*store, from, Phantom<StorePathSet> {});
+        logger->startWork();
+        auto infos = store->queryPathInfos(paths);
+        logger->stopWork();
+        to << infos.size();
+        for (auto & [path, info] : infos) {
+            to << store->printStorePath(path);
+            writeValidPathInfo(store, clientVersion, to, info);
+        }
+        break;
+    }
+
     case wopOptimiseStore:
         logger->startWork();
         store->optimiseStore();
@@ -796,7 +953,70 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
         logger->stopWork();
-        dumpPath(store->toRealPath(path), to);
+        if (narCompression.method == "none")
+            dumpPath(store->toRealPath(path), to);
+        else {
+            std::exception_ptr ex;
+            FramedSink framed(to, ex);
+            auto compressor = makeCompressionSink(narCompression.method, framed, false, narCompression.level);
+            dumpPath(store->toRealPath(path), *compressor);
+            compressor->finish();
+        }
+        break;
+    }
+
+    case wopAddMultipleToStore: {
+        bool repair, dontCheckSigs;
+        from >> repair >> dontCheckSigs;
+        if (!trusted && dontCheckSigs)
+            dontCheckSigs = false;
+
+        logger->startWork();
+        {
+            FramedSource framed(from);
+            auto source = makeDecompressionSource(narCompression.method, framed);
+            store->addMultipleToStore(*source, (RepairFlag) repair,
+                dontCheckSigs ? NoCheckSigs : CheckSigs);
+            source->drain();
+        }
+        logger->stopWork();
+        break;
+    }
+
+    case wopPrefetchSubstitutes: {
+        auto paths = worker_proto::read(*store, from, Phantom<StorePathSet> {});
+        logger->startWork();
+        /* The client sends these from a background thread on a
+           connection of its own, so query the substituters right away
+           rather than queueing the paths. That way they have been
+           queried by the time the client closes its store. */
+        auto valid = store->queryValidPaths(paths);
+        StorePathCAMap query;
+        for (auto & path : paths)
+            if (!valid.count(path))
+                query.emplace(path, std::nullopt);
+        SubstitutablePathInfos infos;
+        store->querySubstitutablePathInfos(query, infos);
+        logger->stopWork();
+        to << 1;
+        break;
+    }
+
+    case wopQueryReferencePositions: {
+        auto path = store->parseStorePath(readString(from));
+        logger->startWork();
+        auto positions = store->queryReferencePositions(path);
+        logger->stopWork();
+        to << (positions ? 1 : 0);
+        if (positions) {
+            size_t count = 0;
+            for (auto & [_, poss] : *positions)
+                count += poss.size();
+            to << count;
+            for (auto & [ref, poss] : *positions)
+                for (auto & pos : poss)
+                    to << store->printStorePath(ref) << pos.file << pos.symlink << pos.offset << pos.excerpt;
+        }
         break;
     }
 
@@ -821,9 +1041,11 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         if (GET_PROTOCOL_MINOR(clientVersion) >= 23) {
             logger->startWork();
             {
-                FramedSource source(from);
-                store->addToStore(info, source, (RepairFlag) repair,
+                FramedSource framed(from);
+                auto source = makeDecompressionSource(narCompression.method, framed);
+                store->addToStore(info, *source, (RepairFlag) repair,
                     dontCheckSigs ? NoCheckSigs : CheckSigs);
+                source->drain();
             }
             logger->stopWork();
         }
@@ -831,7 +1053,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         else {
             std::unique_ptr<Source> source;
             if (GET_PROTOCOL_MINOR(clientVersion) >= 21)
-                source = std::make_unique<TunnelSource>(from, to);
+                source = std::make_unique<TunnelSource>(*logger, from, to);
             else {
                 StringSink saved;
                 TeeSource tee { from, saved };
@@ -901,9 +1123,19 @@ void processConnection(
     FdSink & to,
     TrustedFlag trusted,
     RecursiveFlag recursive,
-    std::function<void(Store &)> authHook)
+    std::function<void(Store &)> authHook,
+    ThreadedFlag threaded)
 {
-    auto monitor = !recursive ? std::make_unique<MonitorFdHup>(from.fd) : nullptr;
+    /* MonitorFdHup interrupts the whole process, so it can't be used
+       if other connections are served by the same process. */
+    auto monitor = !recursive && !threaded ? std::make_unique<MonitorFdHup>(from.fd) : nullptr;
+
+    /* Temporary roots are per process, so in threaded mode give this
+       connection its own, to be released when it closes. */
+    std::optional<LocalStore::TempRootsScope> tempRoots;
+    if (threaded)
+        if (auto localStore = store.dynamic_pointer_cast<LocalStore>())
+            tempRoots.emplace(*localStore);
 
     /* Exchange the greeting. */
     unsigned int magic = readInt(from);
@@ -915,17 +1147,43 @@ void processConnection(
     if (clientVersion < 0x10a)
         throw Error("the Nix client version is too old");
 
+    auto & daemonMetrics(metrics::getMetrics());
+    auto connectionId = ++daemonMetrics.connections;
+    daemonMetrics.activeConnections++;
+    Finally decrementConnections([&]() { daemonMetrics.activeConnections--; });
+
+    AutoCloseFD traceFd;
+    if (settings.daemonTraceFile != "") {
+        traceFd = open(settings.daemonTraceFile.get().c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (!traceFd)
+            logError(SysError("opening trace file '%s'", settings.daemonTraceFile).info());
+    }
+
     auto tunnelLogger = new TunnelLogger(to, clientVersion);
     auto prevLogger = nix::logger;
+    Logger * prevThreadLogger = nullptr;
     // FIXME
-    if (!recursive)
+    if (threaded)
+        prevThreadLogger = setThreadLogger(tunnelLogger);
+    else if (!recursive)
         logger = tunnelLogger;
 
     unsigned int opCount = 0;
 
     Finally finally([&]() {
-        _isInterrupted = false;
-        prevLogger->log(lvlDebug, fmt("%d operations", opCount));
+        if (threaded) {
+            setThreadLogger(prevThreadLogger);
+            delete tunnelLogger;
+        } else {
+            /* Stop the monitor first, since it may otherwise still
+               interrupt us after we've reset the flag, e.g. in a
+               pre-forked worker's next connection. */
+            monitor.reset();
+            _isInterrupted = false;
+        }
+        auto & stats(store->getStats());
+        prevLogger->log(lvlDebug, fmt("%d operations; path info cache: %d hits, %d misses, %d flushes",
+                opCount, stats.pathInfoCacheHits, stats.pathInfoCacheMisses, stats.pathInfoCacheFlushes));
     });
 
     if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from)) {
@@ -935,6 +1193,17 @@ void processConnection(
 
     readInt(from); // obsolete reserveSpace
 
+    NarCompression narCompression;
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 31) {
+        narCompression.method = readString(from);
+        /* Sent as a string since levels can be negative. An empty
+           string means the method's default. */
+        if (auto level = string2Int<int>(readString(from)))
+            narCompression.level = *level;
+        if (!isStreamCompressionMethod(narCompression.method))
+            narCompression.method = "none";
+    }
+
     /* Send startup error messages to the client. */
     tunnelLogger->startWork();
 
@@ -945,6 +1214,8 @@ void processConnection(
         authHook(*store);
 
         tunnelLogger->stopWork();
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 31)
+            to << narCompression.method;
         to.flush();
 
         /* Process client requests. */
@@ -960,8 +1231,37 @@ void processConnection(
 
             opCount++;
 
+            auto & opMetrics(daemonMetrics.op(op));
+            opMetrics.inFlight++;
+            auto startTime = std::chrono::steady_clock::now();
+            bool failed = true;
+
+            Finally recordOp([&]() {
+                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - startTime);
+                opMetrics.inFlight--;
+                opMetrics.latency.observe(duration);
+                if (failed) opMetrics.errors++;
+                if (traceFd) {
+                    auto now = time(0);
+                    struct tm tm;
+                    try {
+                        writeFull(traceFd.get(), fmt("%s conn=%d pid=%d op=%s duration=%.6f status=%s\n",
+                                std::put_time(gmtime_r(&now, &tm), "%Y-%m-%dT%H:%M:%SZ"), connectionId, getpid(), metrics::workerOpName(op),
+                                duration.count() / 1e6, failed ? "failed" : "ok"));
+                    } catch (...) {
+                        ignoreException();
+                    }
+                }
+            });
+
             try {
-                performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op);
+                /* Client settings are process-global, so like in recursive
+                   mode they can't be applied in threaded mode. */
+                performOp(tunnelLogger, store, trusted,
+                    recursive || threaded ? Recursive : NotRecursive,
+                    clientVersion, narCompression, from, to, op);
+                failed = false;
             } catch (Error & e) {
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
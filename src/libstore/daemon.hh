@@ -8,6 +8,11 @@ namespace nix::daemon {
 enum TrustedFlag : bool { NotTrusted = false, Trusted = true };
 enum RecursiveFlag : bool { NotRecursive = false, Recursive = true };
 
+/* Whether the connection is served by a thread of a daemon that
+   serves other connections concurrently. Process-global state such as
+   the logger, the settings and the interrupt flag is then left alone. */
+enum ThreadedFlag : bool { NotThreaded = false, Threaded = true };
+
 void processConnection(
     ref<Store> store,
     FdSource & from,
@@ -18,6 +23,7 @@ void processConnection(
        after the protocol has been negotiated. The idea is that this function
        and everything it calls doesn't know about this stuff, and the
        `nix-daemon` handles that instead. */
-    std::function<void(Store &)> authHook);
+    std::function<void(Store &)> authHook,
+    ThreadedFlag threaded = NotThreaded);
 
 }
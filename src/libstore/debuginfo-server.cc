@@ -0,0 +1,207 @@
+#include "debuginfo-server.hh"
+#include "compression.hh"
+#include "fs-accessor.hh"
+#include "nar-accessor.hh"
+#include "finally.hh"
+#include "sync.hh"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <regex>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+
+namespace nix {
+
+std::optional<std::string> getDebugInfoFile(ref<BinaryCacheStore> store, std::string_view buildId)
+{
+    auto link = store->getFile("debuginfo/" + std::string(buildId));
+    if (!link) return std::nullopt;
+
+    auto json = nlohmann::json::parse(*link);
+    std::string member = json.at("member");
+
+    /* Links written by newer versions of Nix record the store path,
+       which allows the file to be read through the store's
+       accessor (e.g. from a chunked NAR). */
+    if (json.contains("path")) {
+        std::string path = json["path"];
+        return store->getFSAccessor()->readFile(path + "/" + member);
+    }
+
+    /* Otherwise, fetch the NAR. The archive is relative to the
+       ‘debuginfo’ directory. */
+    std::string archive = json.at("archive");
+    if (!hasPrefix(archive, "../"))
+        throw Error("debug info link '%s' in binary cache '%s' is invalid", buildId, store->getUri());
+    archive = archive.substr(3);
+
+    auto compression =
+        hasSuffix(archive, ".nar.xz") ? "xz" :
+        hasSuffix(archive, ".nar.bz2") ? "bzip2" :
+        hasSuffix(archive, ".nar.br") ? "br" :
+        hasSuffix(archive, ".nar.zst") ? "zstd" :
+        hasSuffix(archive, ".nar") ? "none" :
+        throw Error("debug info link '%s' in binary cache '%s' refers to unsupported archive '%s'",
+            buildId, store->getUri(), archive);
+
+    auto nar = store->getFile(archive);
+    if (!nar) return std::nullopt;
+
+    return makeNarAccessor(decompress(compression, *nar))->readFile("/" + member);
+}
+
+
+static void serveDebugInfoRequest(ref<BinaryCacheStore> store, const Path & cacheDir, int fd)
+{
+    FdSource from(fd);
+    FdSink to(fd);
+
+    auto readLine = [&]() {
+        std::string line;
+        while (true) {
+            char c;
+            from(&c, 1);
+            if (c == '\n') break;
+            if (line.size() > 8192) throw Error("HTTP request line too long");
+            line += c;
+        }
+        return chomp(line);
+    };
+
+    auto requestLine = tokenizeString<std::vector<std::string>>(readLine(), " ");
+    while (!readLine().empty()) ;
+
+    auto respond = [&](const std::string & status, std::string_view body, bool head) {
+        to(fmt("HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                status, "application/octet-stream", body.size()));
+        if (!head) to(body);
+        to.flush();
+    };
+
+    if (requestLine.size() != 3 || (requestLine[0] != "GET" && requestLine[0] != "HEAD"))
+        return respond("400 Bad Request", "", true);
+
+    bool head = requestLine[0] == "HEAD";
+
+    /* Only debug info files are indexed, not executables or
+       sources. */
+    static std::regex pathRegex("^/buildid/([0-9a-f]{40})/debuginfo$");
+    std::smatch match;
+    if (!std::regex_match(requestLine[1], match, pathRegex))
+        return respond("404 Not Found", "", head);
+    auto buildId = match[1].str();
+
+    auto cacheFile = cacheDir + "/" + buildId + ".debug";
+
+    std::string contents;
+    if (pathExists(cacheFile))
+        contents = readFile(cacheFile);
+    else {
+        auto file = getDebugInfoFile(store, buildId);
+        if (!file) {
+            debug("debug info file '%s' not found", buildId);
+            return respond("404 Not Found", "", head);
+        }
+        contents = std::move(*file);
+
+        try {
+            auto tmp = cacheFile + ".tmp-" + std::to_string(getpid()) + "-" + std::to_string(fd);
+            writeFile(tmp, contents);
+            if (rename(tmp.c_str(), cacheFile.c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", tmp, cacheFile);
+        } catch (SysError & e) {
+            warn("cannot cache debug info file: %s", e.msg());
+        }
+    }
+
+    printMsg(lvlTalkative, "serving debug info file '%s'", buildId);
+
+    respond("200 OK", contents, head);
+}
+
+
+/* The number of requests served at the same time; further
+   connections wait in the listen queue. */
+static constexpr size_t maxConnections = 64;
+
+/* How long a client may take to send its request or read a block of
+   the response. */
+static constexpr time_t requestTimeout = 30;
+
+void serveDebugInfo(ref<BinaryCacheStore> store,
+    const std::string & listenAddress, uint16_t port, const Path & cacheDir)
+{
+    createDirs(cacheDir);
+
+    AutoCloseFD fdSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fdSocket) throw SysError("creating TCP socket");
+
+    int one = 1;
+    setsockopt(fdSocket.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, listenAddress.c_str(), &addr.sin_addr) != 1)
+        throw UsageError("'%s' is not a valid IPv4 address", listenAddress);
+    addr.sin_port = htons(port);
+
+    if (bind(fdSocket.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("binding to %s, TCP port %d", listenAddress, port);
+
+    if (listen(fdSocket.get(), 64) == -1)
+        throw SysError("listening on TCP port %d", port);
+
+    printInfo("serving debug info from '%s' on %s, TCP port %d", store->getUri(), listenAddress, port);
+
+    struct State
+    {
+        Sync<size_t> active{0};
+        std::condition_variable wakeup;
+    };
+
+    auto state = std::make_shared<State>();
+
+    while (true) {
+        checkInterrupt();
+
+        {
+            auto active(state->active.lock());
+            while (*active >= maxConnections)
+                active.wait(state->wakeup);
+        }
+
+        AutoCloseFD remote = accept4(fdSocket.get(), nullptr, nullptr, SOCK_CLOEXEC);
+        if (!remote) {
+            if (errno == EINTR) continue;
+            throw SysError("accepting connection");
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = requestTimeout;
+        timeout.tv_usec = 0;
+        if (setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+            || setsockopt(remote.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+            throw SysError("setting timeout on connection");
+
+        (*state->active.lock())++;
+
+        std::thread([store, cacheDir, state, remote{std::make_shared<AutoCloseFD>(std::move(remote))}]() {
+            Finally release([&]() {
+                (*state->active.lock())--;
+                state->wakeup.notify_one();
+            });
+            try {
+                serveDebugInfoRequest(store, cacheDir, remote->get());
+            } catch (Error & e) {
+                debug("error serving debug info: %s", e.what());
+            }
+        }).detach();
+    }
+}
+
+}
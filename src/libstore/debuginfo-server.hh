@@ -0,0 +1,21 @@
+#pragma once
+
+#include "binary-cache-store.hh"
+
+namespace nix {
+
+/* Return the DWARF debug info file with build ID ‘buildId’ from a
+   binary cache that has an index of debug info files (see
+   ‘index-debug-info’), or nothing if the cache doesn't have it. Only
+   the parts of the NAR containing the file are fetched if the NAR is
+   chunked and has a listing. */
+std::optional<std::string> getDebugInfoFile(ref<BinaryCacheStore> store, std::string_view buildId);
+
+/* Serve the debug info files in ‘store’ using the debuginfod HTTP
+   protocol on TCP port ‘port’ of the IPv4 address ‘listenAddress’.
+   Served files are cached in ‘cacheDir’. This function does not
+   return. */
+[[noreturn]] void serveDebugInfo(ref<BinaryCacheStore> store,
+    const std::string & listenAddress, uint16_t port, const Path & cacheDir);
+
+}
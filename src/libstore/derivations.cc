@@ -1,4 +1,5 @@
 #include "derivations.hh"
+#include "drv-hash-disk-cache.hh"
 #include "store-api.hh"
 #include "globals.hh"
 #include "util.hh"
@@ -74,6 +75,17 @@ bool BasicDerivation::isBuiltin() const
 }
 
 
+/* The derivations that this process has written to each store
+   (identified by its URI). Instantiating the same derivation again,
+   e.g. because it's reachable through several attributes or from
+   several EvalStates, then only requires a validity check rather
+   than sending the derivation to the store again. The temporary root
+   registered by addTextToStore() doesn't necessarily outlive the
+   store object or daemon connection that wrote the path, so it may
+   have been garbage-collected since; hence the path is rooted again
+   and checked before it's trusted. */
+static Sync<std::map<std::string, StorePathSet>> writtenDerivations;
+
 StorePath writeDerivation(Store & store,
     const Derivation & drv, RepairFlag repair, bool readOnly)
 {
@@ -85,74 +97,114 @@ StorePath writeDerivation(Store & store,
        held during a garbage collection). */
     auto suffix = std::string(drv.name) + drvExtension;
     auto contents = drv.unparse(store, false);
-    return readOnly || settings.readOnlyMode
-        ? store.computeStorePathForText(suffix, contents, references)
-        : store.addTextToStore(suffix, contents, references, repair);
-}
-
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
-{
-    char s2[s.size()];
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
-        throw FormatError("expected string '%1%'", s);
-}
+    if (readOnly || settings.readOnlyMode)
+        return store.computeStorePathForText(suffix, contents, references);
 
+    auto uri = store.getUri();
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
-{
-    string res;
-    expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
-            if (c == 'n') res += '\n';
-            else if (c == 'r') res += '\r';
-            else if (c == 't') res += '\t';
-            else res += c;
+    if (!repair) {
+        auto path = store.computeStorePathForText(suffix, contents, references);
+        bool written = false;
+        {
+            auto written_(writtenDerivations.lock());
+            auto i = written_->find(uri);
+            written = i != written_->end() && i->second.count(path);
         }
-        else res += c;
-    return res;
+        if (written) {
+            store.addTempRoot(path);
+            if (store.isValidPath(path))
+                return path;
+        }
+    }
+
+    auto path = store.addTextToStore(suffix, contents, references, repair);
+    (*writtenDerivations.lock())[uri].insert(path);
+    return path;
 }
 
+
 static void validatePath(std::string_view s) {
     if (s.size() == 0 || s[0] != '/')
         throw FormatError("bad path '%1%' in derivation", s);
 }
 
-static Path parsePath(std::istream & str)
+
+/* A cursor over the ATerm representation of a derivation. The
+   parser works directly on the file contents rather than going
+   through an input stream, so that the common case (strings without
+   escape sequences) is a single bulk copy. */
+struct DrvParser
 {
-    auto s = parseString(str);
-    validatePath(s);
-    return s;
-}
+    std::string_view s;
+    size_t pos = 0;
 
+    DrvParser(std::string_view s) : s(s) { }
 
-static bool endOfList(std::istream & str)
-{
-    if (str.peek() == ',') {
-        str.get();
-        return false;
+    /* Read string `s2'. */
+    void expect(std::string_view s2)
+    {
+        if (s.compare(pos, s2.size(), s2) != 0)
+            throw FormatError("expected string '%1%'", s2);
+        pos += s2.size();
     }
-    if (str.peek() == ']') {
-        str.get();
-        return true;
+
+    int peek() const
+    {
+        return pos < s.size() ? (unsigned char) s[pos] : -1;
     }
-    return false;
-}
 
+    /* Read a C-style string. */
+    string parseString()
+    {
+        expect("\"");
+        string res;
+        while (true) {
+            auto end = s.find_first_of("\"\\", pos);
+            if (end == s.npos)
+                throw FormatError("unterminated string in derivation");
+            res.append(s, pos, end - pos);
+            pos = end + 1;
+            if (s[end] == '"') break;
+            if (pos == s.size())
+                throw FormatError("unterminated string in derivation");
+            char c = s[pos++];
+            if (c == 'n') res += '\n';
+            else if (c == 'r') res += '\r';
+            else if (c == 't') res += '\t';
+            else res += c;
+        }
+        return res;
+    }
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
-{
-    StringSet res;
-    while (!endOfList(str))
-        res.insert(arePaths ? parsePath(str) : parseString(str));
-    return res;
-}
+    Path parsePath()
+    {
+        auto s = parseString();
+        validatePath(s);
+        return s;
+    }
+
+    bool endOfList()
+    {
+        if (peek() == ',') {
+            pos++;
+            return false;
+        }
+        if (peek() == ']') {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    StringSet parseStrings(bool arePaths)
+    {
+        StringSet res;
+        while (!endOfList())
+            res.insert(arePaths ? parsePath() : parseString());
+        return res;
+    }
+};
 
 
 static DerivationOutput parseDerivationOutput(const Store & store,
@@ -200,61 +252,63 @@ static DerivationOutput parseDerivationOutput(const Store & store,
     }
 }
 
-static DerivationOutput parseDerivationOutput(const Store & store, std::istringstream & str)
+static DerivationOutput parseDerivationOutput(const Store & store, DrvParser & p)
 {
-    expect(str, ","); const auto pathS = parseString(str);
-    expect(str, ","); const auto hashAlgo = parseString(str);
-    expect(str, ","); const auto hash = parseString(str);
-    expect(str, ")");
+    p.expect(","); const auto pathS = p.parseString();
+    p.expect(","); const auto hashAlgo = p.parseString();
+    p.expect(","); const auto hash = p.parseString();
+    p.expect(")");
 
     return parseDerivationOutput(store, pathS, hashAlgo, hash);
 }
 
 
-Derivation parseDerivation(const Store & store, std::string && s, std::string_view name)
+Derivation parseDerivation(const Store & store, std::string && s, std::string_view name, bool outputsOnly)
 {
     Derivation drv;
     drv.name = name;
 
-    std::istringstream str(std::move(s));
-    expect(str, "Derive([");
+    DrvParser p(s);
+    p.expect("Derive([");
 
     /* Parse the list of outputs. */
-    while (!endOfList(str)) {
-        expect(str, "("); std::string id = parseString(str);
-        auto output = parseDerivationOutput(store, str);
+    while (!p.endOfList()) {
+        p.expect("("); std::string id = p.parseString();
+        auto output = parseDerivationOutput(store, p);
         drv.outputs.emplace(std::move(id), std::move(output));
     }
 
+    if (outputsOnly) return drv;
+
     /* Parse the list of input derivations. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "(");
-        Path drvPath = parsePath(str);
-        expect(str, ",[");
-        drv.inputDrvs.insert_or_assign(store.parseStorePath(drvPath), parseStrings(str, false));
-        expect(str, ")");
+    p.expect(",[");
+    while (!p.endOfList()) {
+        p.expect("(");
+        Path drvPath = p.parsePath();
+        p.expect(",[");
+        drv.inputDrvs.insert_or_assign(store.parseStorePath(drvPath), p.parseStrings(false));
+        p.expect(")");
     }
 
-    expect(str, ",["); drv.inputSrcs = store.parseStorePathSet(parseStrings(str, true));
-    expect(str, ","); drv.platform = parseString(str);
-    expect(str, ","); drv.builder = parseString(str);
+    p.expect(",["); drv.inputSrcs = store.parseStorePathSet(p.parseStrings(true));
+    p.expect(","); drv.platform = p.parseString();
+    p.expect(","); drv.builder = p.parseString();
 
     /* Parse the builder arguments. */
-    expect(str, ",[");
-    while (!endOfList(str))
-        drv.args.push_back(parseString(str));
+    p.expect(",[");
+    while (!p.endOfList())
+        drv.args.push_back(p.parseString());
 
     /* Parse the environment variables. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "("); string name = parseString(str);
-        expect(str, ","); string value = parseString(str);
-        expect(str, ")");
-        drv.env[name] = value;
+    p.expect(",[");
+    while (!p.endOfList()) {
+        p.expect("("); string name = p.parseString();
+        p.expect(","); string value = p.parseString();
+        p.expect(")");
+        drv.env.insert_or_assign(std::move(name), std::move(value));
     }
 
-    expect(str, ")");
+    p.expect(")");
     return drv;
 }
 
@@ -468,12 +522,18 @@ static const DrvHashModulo pathDerivationModulo(Store & store, const StorePath &
             return h->second;
         }
     }
+    auto drvPathS = store.printStorePath(drvPath);
+    if (auto h = lookupDrvHashDiskCache(drvPathS)) {
+        drvHashes.lock()->insert_or_assign(drvPath, *h);
+        return *h;
+    }
     auto h = hashDerivationModulo(
         store,
         store.readInvalidDerivation(drvPath),
         false);
     // Cache it
     drvHashes.lock()->insert_or_assign(drvPath, h);
+    upsertDrvHashDiskCache(drvPathS, h);
     return h;
 }
 
@@ -155,8 +155,11 @@ StorePath writeDerivation(Store & store,
     RepairFlag repair = NoRepair,
     bool readOnly = false);
 
-/* Read a derivation from a file. */
-Derivation parseDerivation(const Store & store, std::string && s, std::string_view name);
+/* Read a derivation from a file. If `outputsOnly' is set, parsing
+   stops after the list of outputs, so only `name' and `outputs' of
+   the result are filled in. */
+Derivation parseDerivation(const Store & store, std::string && s, std::string_view name,
+    bool outputsOnly = false);
 
 // FIXME: remove
 bool isDerivation(const string & fileName);
@@ -0,0 +1,148 @@
+#include "drv-hash-disk-cache.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists DrvHashes (
+    path  text primary key not null,
+    hash  text not null
+);
+
+)sql";
+
+struct DrvHashDiskCache
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertHash, queryHash;
+    };
+
+    Sync<State> _state;
+
+    DrvHashDiskCache()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/drv-hashes-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertHash.create(state->db,
+            "insert or replace into DrvHashes(path, hash) values (?, ?)");
+
+        state->queryHash.create(state->db,
+            "select hash from DrvHashes where path = ?");
+    }
+};
+
+/* Return the cache, or nullptr if it's disabled or can't be
+   opened. */
+static DrvHashDiskCache * getCache()
+{
+    if (!settings.drvHashCache) return nullptr;
+
+    static std::unique_ptr<DrvHashDiskCache> cache = []() -> std::unique_ptr<DrvHashDiskCache> {
+        try {
+            return std::make_unique<DrvHashDiskCache>();
+        } catch (Error & e) {
+            debug("cannot open the derivation hash cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+
+    return cache.get();
+}
+
+/* Entries have the form `regular <hash>', `deferred <hash>' or
+   `fixed <output>=<hash>...'. */
+
+static std::string printDrvHash(const DrvHashModulo & hash)
+{
+    return std::visit(overloaded {
+        [](const Hash & h) {
+            return "regular " + h.to_string(Base16, true);
+        },
+        [](const DeferredHash & h) {
+            return "deferred " + h.hash.to_string(Base16, true);
+        },
+        [](const CaOutputHashes & hs) {
+            std::string s = "fixed";
+            for (auto & [output, h] : hs)
+                s += " " + output + "=" + h.to_string(Base16, true);
+            return s;
+        },
+    }, hash);
+}
+
+static DrvHashModulo parseDrvHash(const std::string & s)
+{
+    auto tokens = tokenizeString<Strings>(s, " ");
+    if (tokens.size() < 1)
+        throw Error("invalid derivation hash '%s'", s);
+    auto kind = tokens.front();
+    tokens.pop_front();
+
+    if (kind == "regular" && tokens.size() == 1)
+        return Hash::parseAnyPrefixed(tokens.front());
+
+    if (kind == "deferred" && tokens.size() == 1)
+        return DeferredHash { Hash::parseAnyPrefixed(tokens.front()) };
+
+    if (kind == "fixed") {
+        CaOutputHashes hashes;
+        for (auto & token : tokens) {
+            auto eq = token.find('=');
+            if (eq == std::string::npos)
+                throw Error("invalid derivation hash '%s'", s);
+            hashes.insert_or_assign(token.substr(0, eq), Hash::parseAnyPrefixed(token.substr(eq + 1)));
+        }
+        return hashes;
+    }
+
+    throw Error("invalid derivation hash '%s'", s);
+}
+
+std::optional<DrvHashModulo> lookupDrvHashDiskCache(const Path & drvPath)
+{
+    auto cache = getCache();
+    if (!cache) return {};
+
+    try {
+        return retrySQLite<std::optional<DrvHashModulo>>([&]() -> std::optional<DrvHashModulo> {
+            auto state(cache->_state.lock());
+            auto query(state->queryHash.use()(drvPath));
+            if (!query.next()) return {};
+            return parseDrvHash(query.getStr(0));
+        });
+    } catch (Error & e) {
+        debug("cannot look up '%s' in the derivation hash cache: %s", drvPath, e.what());
+        return {};
+    }
+}
+
+void upsertDrvHashDiskCache(const Path & drvPath, const DrvHashModulo & hash)
+{
+    auto cache = getCache();
+    if (!cache) return;
+
+    try {
+        retrySQLite<void>([&]() {
+            auto state(cache->_state.lock());
+            state->insertHash.use()(drvPath)(printDrvHash(hash)).exec();
+        });
+    } catch (Error & e) {
+        debug("cannot write '%s' to the derivation hash cache: %s", drvPath, e.what());
+    }
+}
+
+}
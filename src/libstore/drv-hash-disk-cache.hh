@@ -0,0 +1,17 @@
+#pragma once
+
+#include "derivations.hh"
+
+namespace nix {
+
+/* A persistent cache of the results of hashDerivationModulo() for
+   store derivations, keyed by their store path. Since store
+   derivations are content-addressed, an entry never becomes
+   invalid. Errors accessing the cache are ignored, since it is only
+   an optimisation. */
+
+std::optional<DrvHashModulo> lookupDrvHashDiskCache(const Path & drvPath);
+
+void upsertDrvHashDiskCache(const Path & drvPath, const DrvHashModulo & hash);
+
+}
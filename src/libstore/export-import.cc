@@ -2,9 +2,13 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "worker-protocol.hh"
+#include "compression.hh"
 
 #include <algorithm>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 namespace nix {
 
 void Store::exportPaths(const StorePathSet & paths, Sink & sink)
@@ -97,4 +101,141 @@ StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
     return res;
 }
 
+/* A bundle starts with `bundleMagic', followed by the compressed NARs
+   of the paths, the index, and a trailer consisting of the offset and
+   size of the index and `bundleTrailerMagic'. The index contains the
+   compression method and, for each path in topological order, its
+   ValidPathInfo (in worker protocol format) and the offset and size
+   of its compressed NAR. */
+static const std::string bundleMagic = "nix-bundle-1";
+
+static const uint64_t bundleTrailerMagic = 0x314c444e42584e; // "NXBNDL1"
+
+static const size_t bundleTrailerSize = 3 * 8;
+
+void Store::exportBundle(const StorePathSet & paths, Sink & sink, const std::string & compression)
+{
+    auto sorted = topoSortPaths(paths);
+    std::reverse(sorted.begin(), sorted.end());
+
+    LengthSink written;
+    TeeSink out { sink, written };
+
+    out << bundleMagic;
+
+    struct Entry
+    {
+        ref<const ValidPathInfo> info;
+        uint64_t offset, size;
+    };
+
+    std::vector<Entry> entries;
+
+    for (auto & path : sorted) {
+        auto info = queryPathInfo(path);
+        auto offset = written.length;
+
+        HashSink hashSink(htSHA256);
+        {
+            auto compressor = makeCompressionSink(compression, out, true);
+            TeeSink tee { *compressor, hashSink };
+            narFromPath(path, tee);
+            compressor->finish();
+        }
+
+        /* Like exportPath(), refuse to export paths that have
+           changed. */
+        auto hash = hashSink.finish().first;
+        if (hash != info->narHash && info->narHash != Hash(info->narHash.type))
+            throw Error("hash of path '%s' has changed from '%s' to '%s'!",
+                printStorePath(path), info->narHash.to_string(Base32, true), hash.to_string(Base32, true));
+
+        entries.push_back({info, offset, written.length - offset});
+    }
+
+    auto indexOffset = written.length;
+
+    out << compression << entries.size();
+    for (auto & entry : entries) {
+        worker_proto::write(*this, out, *entry.info);
+        out << entry.offset << entry.size;
+    }
+
+    out << indexOffset << written.length - indexOffset << bundleTrailerMagic;
+}
+
+StorePaths Store::importBundle(const Path & bundle, CheckSigsFlag checkSigs)
+{
+    auto fd = std::make_shared<AutoCloseFD>(open(bundle.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!*fd)
+        throw SysError("opening '%s'", bundle);
+
+    struct stat st;
+    if (fstat(fd->get(), &st) == -1)
+        throw SysError("getting status of '%s'", bundle);
+
+    auto readAt = [fd, bundle](uint64_t offset, uint64_t size, Sink & sink) {
+        std::vector<char> buf(std::min(size, (uint64_t) 64 * 1024));
+        for (uint64_t pos = 0; pos < size; ) {
+            checkInterrupt();
+            auto n = pread(fd->get(), buf.data(), std::min(size - pos, (uint64_t) buf.size()), offset + pos);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading '%s'", bundle);
+            }
+            if (n == 0)
+                throw Error("bundle '%s' is truncated", bundle);
+            sink({buf.data(), (size_t) n});
+            pos += n;
+        }
+    };
+
+    if ((uint64_t) st.st_size < bundleTrailerSize)
+        throw Error("'%s' is not a Nix bundle", bundle);
+
+    StringSink trailerData;
+    readAt(st.st_size - bundleTrailerSize, bundleTrailerSize, trailerData);
+    StringSource trailer { *trailerData.s };
+    auto indexOffset = readNum<uint64_t>(trailer);
+    auto indexSize = readNum<uint64_t>(trailer);
+    if (readNum<uint64_t>(trailer) != bundleTrailerMagic)
+        throw Error("'%s' is not a Nix bundle", bundle);
+    if (indexOffset > st.st_size - bundleTrailerSize
+        || indexSize != st.st_size - bundleTrailerSize - indexOffset)
+        throw Error("bundle '%s' is corrupt", bundle);
+
+    StringSink indexData;
+    readAt(indexOffset, indexSize, indexData);
+    StringSource index { *indexData.s };
+
+    auto compression = readString(index);
+    auto count = readNum<uint64_t>(index);
+
+    PathsSource pathsToCopy;
+    StorePaths res;
+
+    for (uint64_t n = 0; n < count; ++n) {
+        auto info = worker_proto::read(*this, index, Phantom<ValidPathInfo> {});
+        info.ultimate = false;
+        auto offset = readNum<uint64_t>(index);
+        auto size = readNum<uint64_t>(index);
+        if (offset > indexOffset || size > indexOffset - offset)
+            throw Error("bundle '%s' is corrupt", bundle);
+
+        res.push_back(info.path);
+
+        pathsToCopy.emplace_back(std::move(info), [readAt, compression, offset, size](Sink & sink) {
+            auto decompressor = makeDecompressionSink(compression, sink);
+            readAt(offset, size, *decompressor);
+            decompressor->finish();
+        });
+    }
+
+    Activity act(*logger, lvlInfo, actCopyPaths, fmt("importing %d paths from '%s'", count, bundle));
+
+    addMultipleToStore(pathsToCopy, act, NoRepair, checkSigs);
+
+    return res;
+}
+
 }
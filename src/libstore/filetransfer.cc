@@ -92,7 +92,7 @@ struct curlFileTransfer : public FileTransfer
             : fileTransfer(fileTransfer)
             , request(request)
             , act(*logger, lvlTalkative, actFileTransfer,
-                fmt(request.data ? "uploading '%s'" : "downloading '%s'", request.uri),
+                fmt(request.isUpload() ? "uploading '%s'" : "downloading '%s'", request.uri),
                 {request.uri}, request.parentAct)
             , callback(std::move(callback))
             , finalSink([this](std::string_view data) {
@@ -160,6 +160,12 @@ struct curlFileTransfer : public FileTransfer
                 result.bodySize += realSize;
 
                 if (!decompressionSink) {
+                    /* A server that ignores the Range header (or the
+                       If-Range condition) sends the whole file, which
+                       we can't splice into the result. */
+                    if (request.range && getHTTPStatus() == 200)
+                        throw FileTransferError(Misc, nullptr,
+                            "server did not honour range request for '%s'", request.uri);
                     decompressionSink = makeDecompressionSink(encoding, finalSink);
                     if (! successfulStatuses.count(getHTTPStatus())) {
                         // In this case we want to construct a TeeSink, to keep
@@ -197,6 +203,7 @@ struct curlFileTransfer : public FileTransfer
                 result.etag = "";
                 result.data = std::make_shared<std::string>();
                 result.bodySize = 0;
+                result.contentLength.reset();
                 statusMsg = trim(match[1]);
                 acceptRanges = false;
                 encoding = "";
@@ -221,6 +228,8 @@ struct curlFileTransfer : public FileTransfer
                         encoding = trim(string(line, i + 1));
                     else if (name == "accept-ranges" && toLower(trim(std::string(line, i + 1))) == "bytes")
                         acceptRanges = true;
+                    else if (name == "content-length")
+                        result.contentLength = string2Int<uint64_t>(trim(std::string(line, i + 1)));
                 }
             }
             return realSize;
@@ -256,6 +265,13 @@ struct curlFileTransfer : public FileTransfer
         size_t readOffset = 0;
         size_t readCallback(char *buffer, size_t size, size_t nitems)
         {
+            if (request.dataStream) {
+                request.dataStream->read(buffer, size * nitems);
+                if (request.dataStream->bad())
+                    return CURL_READFUNC_ABORT;
+                return request.dataStream->gcount();
+            }
+
             if (readOffset == request.data->length())
                 return 0;
             auto count = std::min(size * nitems, request.data->length() - readOffset);
@@ -311,11 +327,18 @@ struct curlFileTransfer : public FileTransfer
             if (request.head)
                 curl_easy_setopt(req, CURLOPT_NOBODY, 1);
 
-            if (request.data) {
+            if (request.isUpload()) {
+                /* Start from the beginning when retrying. */
+                readOffset = 0;
+                if (request.dataStream) {
+                    request.dataStream->clear();
+                    request.dataStream->seekg(0);
+                }
                 curl_easy_setopt(req, CURLOPT_UPLOAD, 1L);
                 curl_easy_setopt(req, CURLOPT_READFUNCTION, readCallbackWrapper);
                 curl_easy_setopt(req, CURLOPT_READDATA, this);
-                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE, (curl_off_t) request.data->length());
+                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE, (curl_off_t)
+                    (request.dataStream ? request.dataSize : request.data->length()));
             }
 
             if (request.verifyTLS) {
@@ -337,7 +360,10 @@ struct curlFileTransfer : public FileTransfer
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
-            if (writtenToSink)
+            if (request.range)
+                curl_easy_setopt(req, CURLOPT_RANGE,
+                    fmt("%d-%d", request.range->first, request.range->second).c_str());
+            else if (writtenToSink)
                 curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, writtenToSink);
 
             result.data = std::make_shared<std::string>();
@@ -375,6 +401,7 @@ struct curlFileTransfer : public FileTransfer
             else if (code == CURLE_OK && successfulStatuses.count(httpStatus))
             {
                 result.cached = httpStatus == 304;
+                result.acceptRanges = acceptRanges && encoding.empty();
 
                 // In 2021, GitHub responds to If-None-Match with 304,
                 // but omits ETag. We just use the If-None-Match etag
@@ -651,7 +678,7 @@ struct curlFileTransfer : public FileTransfer
 
     void enqueueItem(std::shared_ptr<TransferItem> item)
     {
-        if (item->request.data
+        if (item->request.isUpload()
             && !hasPrefix(item->request.uri, "http://")
             && !hasPrefix(item->request.uri, "https://"))
             throw nix::Error("uploading to '%s' is not supported", item->request.uri);
@@ -752,8 +779,81 @@ FileTransferResult FileTransfer::upload(const FileTransferRequest & request)
     return enqueueFileTransfer(request).get();
 }
 
-void FileTransfer::download(FileTransferRequest && request, Sink & sink)
+/* Download a file of the given size as a sequence of range
+   requests, keeping up to 'download-range-connections' of them in
+   flight and writing them to 'sink' in order. */
+static void downloadRanges(FileTransfer & fileTransfer,
+    const FileTransferRequest & request, uint64_t size, const std::string & etag, Sink & sink)
+{
+    uint64_t rangeSize = std::max(fileTransferSettings.downloadRangeSize.get(), (uint64_t) 1);
+
+    debug("downloading '%s' (%d bytes) in ranges of %d bytes", request.uri, size, rangeSize);
+
+    std::queue<std::pair<uint64_t, std::future<FileTransferResult>>> pending;
+    uint64_t offset = 0;
+
+    while (offset < size || !pending.empty()) {
+
+        while (offset < size && pending.size() < fileTransferSettings.downloadRangeConnections) {
+            auto length = std::min(rangeSize, size - offset);
+            FileTransferRequest rangeRequest(request);
+            rangeRequest.range = {offset, offset + length - 1};
+            rangeRequest.dataCallback = {};
+            /* Make sure all ranges come from the same version of
+               the file. (If-Range requires a strong ETag.) */
+            if (etag != "" && !hasPrefix(etag, "W/"))
+                rangeRequest.headers.emplace_back("If-Range", etag);
+            pending.emplace(length, fileTransfer.enqueueFileTransfer(rangeRequest));
+            offset += length;
+        }
+
+        checkInterrupt();
+
+        auto [length, fut] = std::move(pending.front());
+        pending.pop();
+
+        auto result = fut.get();
+        if (result.data->size() != length)
+            throw FileTransferError(FileTransfer::Misc, nullptr,
+                "range request for '%s' returned %d bytes, expected %d",
+                request.uri, result.data->size(), length);
+
+        sink(*result.data);
+    }
+}
+
+FileTransferResult FileTransfer::download(FileTransferRequest && request, Sink & sink)
 {
+    /* Large files can be fetched faster by splitting them into
+       ranges that are downloaded over several connections. Use a
+       HEAD request to find out whether the file is big enough and
+       whether the server supports this. */
+    if (fileTransferSettings.downloadRangeConnections > 1
+        && (hasPrefix(request.uri, "http://") || hasPrefix(request.uri, "https://"))
+        && !request.head
+        && !request.isUpload()
+        && !request.range)
+    {
+        std::optional<FileTransferResult> info;
+        try {
+            FileTransferRequest headRequest(request);
+            headRequest.head = true;
+            headRequest.expectedETag = "";
+            info = download(headRequest);
+        } catch (nix::Error & e) {
+            debug("HEAD request for '%s' failed, not using range requests: %s", request.uri, e.what());
+        }
+
+        if (info
+            && info->acceptRanges
+            && info->contentLength
+            && *info->contentLength > fileTransferSettings.downloadRangeSize)
+        {
+            downloadRanges(*this, request, *info->contentLength, info->etag, sink);
+            return *info;
+        }
+    }
+
     /* Note: we can't call 'sink' via request.dataCallback, because
        that would cause the sink to execute on the fileTransfer
        thread. If 'sink' is a coroutine, this will fail. Also, if the
@@ -765,6 +865,7 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
     struct State {
         bool quit = false;
         std::exception_ptr exc;
+        FileTransferResult result;
         std::string data;
         std::condition_variable avail, request;
     };
@@ -806,7 +907,7 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
             auto state(_state->lock());
             state->quit = true;
             try {
-                fut.get();
+                state->result = fut.get();
             } catch (...) {
                 state->exc = std::current_exception();
             }
@@ -828,7 +929,7 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
 
                 if (state->quit) {
                     if (state->exc) std::rethrow_exception(state->exc);
-                    return;
+                    return std::move(state->result);
                 }
 
                 state.wait(state->avail);
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <future>
+#include <istream>
 
 namespace nix {
 
@@ -44,6 +45,25 @@ struct FileTransferSettings : Config
 
     Setting<unsigned int> tries{this, 5, "download-attempts",
         "How often Nix will attempt to download a file before giving up."};
+
+    Setting<unsigned int> downloadRangeConnections{
+        this, 1, "download-range-connections",
+        R"(
+          The number of concurrent HTTP range requests used to fetch
+          a single large file (such as a NAR from a binary cache). If
+          greater than 1, files larger than `download-range-size` are
+          split into ranges that are downloaded in parallel and
+          reassembled in order. This only takes effect if the server
+          supports range requests. The default is 1, which downloads
+          every file over a single connection.
+        )"};
+
+    Setting<uint64_t> downloadRangeSize{
+        this, 16 * 1024 * 1024, "download-range-size",
+        R"(
+          The size in bytes of each range requested when
+          `download-range-connections` is greater than 1.
+        )"};
 };
 
 extern FileTransferSettings fileTransferSettings;
@@ -60,15 +80,29 @@ struct FileTransferRequest
     ActivityId parentAct;
     bool decompress = true;
     std::shared_ptr<std::string> data;
+    /* Alternatively, a seekable stream containing `dataSize' bytes
+       to upload, which avoids having to hold large uploads in
+       memory. */
+    std::shared_ptr<std::istream> dataStream;
+    uint64_t dataSize = 0;
     std::string mimeType;
     std::function<void(std::string_view data)> dataCallback;
+    /* If set, only fetch the given (inclusive) byte range of the
+       file. The server must respond with the requested range, not
+       the whole file. */
+    std::optional<std::pair<uint64_t, uint64_t>> range;
 
     FileTransferRequest(std::string_view uri)
         : uri(uri), parentAct(getCurActivity()) { }
 
+    bool isUpload() const
+    {
+        return data || dataStream;
+    }
+
     std::string verb()
     {
-        return data ? "upload" : "download";
+        return isUpload() ? "upload" : "download";
     }
 };
 
@@ -79,6 +113,12 @@ struct FileTransferResult
     std::string effectiveUri;
     std::shared_ptr<std::string> data;
     uint64_t bodySize = 0;
+    /* The size of the file as reported by the server's
+       Content-Length header, if any. */
+    std::optional<uint64_t> contentLength;
+    /* Whether the server accepts byte range requests for this file
+       and serves it without a content encoding. */
+    bool acceptRanges = false;
 };
 
 class Store;
@@ -102,8 +142,9 @@ struct FileTransfer
     FileTransferResult upload(const FileTransferRequest & request);
 
     /* Download a file, writing its data to a sink. The sink will be
-       invoked on the thread of the caller. */
-    void download(FileTransferRequest && request, Sink & sink);
+       invoked on the thread of the caller. Returns the result of the
+       transfer, without its data. */
+    FileTransferResult download(FileTransferRequest && request, Sink & sink);
 
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
@@ -0,0 +1,19 @@
+-- Extension of the sql schema that records the state of the last
+-- complete garbage collection, for incremental garbage collection.
+-- Won't be loaded unless an incremental collection is requested.
+
+-- The roots (including temporary roots) at the time of the last
+-- collection. These are store paths rather than ValidPaths ids, so
+-- that roots that were deleted since then are still known.
+create table if not exists GCRoots (
+    path text primary key not null
+);
+
+-- `maxId` is the highest ValidPaths id when the last collection
+-- started; every valid path with an id up to `maxId` was reachable
+-- from `GCRoots`. `keepOutputs` and `keepDerivations` are the
+-- settings it used.
+create table if not exists GCState (
+    name  text primary key not null,
+    value integer not null
+);
@@ -3,12 +3,17 @@
 #include "local-store.hh"
 #include "local-fs-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
+#include "metrics.hh"
+#include "path-index.hh"
 
+#include <atomic>
 #include <functional>
 #include <queue>
 #include <algorithm>
 #include <regex>
 #include <random>
+#include <unordered_set>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,6 +23,12 @@
 #include <unistd.h>
 #include <climits>
 
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
 namespace nix {
 
 
@@ -43,6 +54,7 @@ AutoCloseFD LocalStore::openGCLock(LockType lockType)
 
     if (!lockFile(fdGCLock.get(), lockType, false)) {
         printInfo("waiting for the big garbage collector lock...");
+        metrics::Timer timer(metrics::getMetrics().gcLockWait);
         lockFile(fdGCLock.get(), lockType, true);
     }
 
@@ -113,10 +125,65 @@ Path LocalFSStore::addPermRoot(const StorePath & storePath, const Path & _gcRoot
 
 void LocalStore::addTempRoot(const StorePath & path)
 {
+    addTempRoots(StorePathSet{path});
+}
+
+
+/* The innermost TempRootsScope of the calling thread. */
+static thread_local LocalStore::TempRootsScope * threadTempRoots = nullptr;
+
+
+LocalStore::TempRootsScope::TempRootsScope(LocalStore & store)
+    : store(store)
+    , prev(threadTempRoots)
+{
+    static std::atomic<uint64_t> counter{0};
+    fnTempRoots = fmt("%s/%d-%d", store.tempRootsDir, getpid(), ++counter);
+    threadTempRoots = this;
+}
+
+
+LocalStore::TempRootsScope::~TempRootsScope()
+{
+    threadTempRoots = prev;
+    if (fdTempRoots) {
+        fdTempRoots = -1;
+        unlink(fnTempRoots.c_str());
+    }
+}
+
+
+void LocalStore::addTempRoots(const StorePathSet & paths)
+{
+    for (auto scope = threadTempRoots; scope; scope = scope->prev)
+        if (&scope->store == this) {
+            writeTempRoots(scope->fnTempRoots, scope->fdTempRoots, scope->tempRoots, paths);
+            return;
+        }
+
     auto state(_state.lock());
+    writeTempRoots(fnTempRoots, state->fdTempRoots, state->tempRoots, paths);
+}
+
+
+void LocalStore::writeTempRoots(const Path & fnTempRoots, AutoCloseFD & fdTempRoots,
+    std::unordered_set<std::string> & tempRoots, const StorePathSet & paths)
+{
+    /* Temporary roots last until the file is closed, so paths that we
+       already registered don't need to be written (or locked)
+       again. */
+    std::vector<std::string> newRoots;
+    string s;
+    for (auto & path : paths)
+        if (!tempRoots.count(std::string(path.hashPart()))) {
+            newRoots.emplace_back(path.hashPart());
+            s += printStorePath(path) + '\0';
+        }
+
+    if (newRoots.empty()) return;
 
-    /* Create the temporary roots file for this process. */
-    if (!state->fdTempRoots) {
+    /* Create the temporary roots file. */
+    if (!fdTempRoots) {
 
         while (1) {
             AutoCloseFD fdGCLock = openGCLock(ltRead);
@@ -126,17 +193,17 @@ void LocalStore::addTempRoot(const StorePath & path)
                    processes with the same pid. */
                 unlink(fnTempRoots.c_str());
 
-            state->fdTempRoots = openLockFile(fnTempRoots, true);
+            fdTempRoots = openLockFile(fnTempRoots, true);
 
             fdGCLock = -1;
 
             debug(format("acquiring read lock on '%1%'") % fnTempRoots);
-            lockFile(state->fdTempRoots.get(), ltRead, true);
+            lockFile(fdTempRoots.get(), ltRead, true);
 
             /* Check whether the garbage collector didn't get in our
                way. */
             struct stat st;
-            if (fstat(state->fdTempRoots.get(), &st) == -1)
+            if (fstat(fdTempRoots.get(), &st) == -1)
                 throw SysError("statting '%1%'", fnTempRoots);
             if (st.st_size == 0) break;
 
@@ -150,14 +217,16 @@ void LocalStore::addTempRoot(const StorePath & path)
     /* Upgrade the lock to a write lock.  This will cause us to block
        if the garbage collector is holding our lock. */
     debug(format("acquiring write lock on '%1%'") % fnTempRoots);
-    lockFile(state->fdTempRoots.get(), ltWrite, true);
+    lockFile(fdTempRoots.get(), ltWrite, true);
 
-    string s = printStorePath(path) + '\0';
-    writeFull(state->fdTempRoots.get(), s);
+    writeFull(fdTempRoots.get(), s);
 
     /* Downgrade to a read lock. */
     debug(format("downgrading to read lock on '%1%'") % fnTempRoots);
-    lockFile(state->fdTempRoots.get(), ltRead, true);
+    lockFile(fdTempRoots.get(), ltRead, true);
+
+    for (auto & i : newRoots)
+        tempRoots.insert(std::move(i));
 }
 
 
@@ -176,6 +245,9 @@ void LocalStore::findTempRoots(FDs & fds, Roots & tempRoots, bool censor)
         }
         Path path = tempRootsDir + "/" + i.name;
 
+        /* The file name is the pid of the owning process,
+           optionally followed by `-N' for the files of a
+           TempRootsScope. */
         pid_t pid = std::stoi(i.name);
 
         debug(format("reading temporary root file '%1%'") % path);
@@ -191,8 +263,12 @@ void LocalStore::findTempRoots(FDs & fds, Roots & tempRoots, bool censor)
         //if (*fd == -1) continue;
 
         /* Try to acquire a write lock without blocking.  This can
-           only succeed if the owning process has died.  In that case
-           we don't care about its temporary roots. */
+           only succeed if the owner of the file has closed it, i.e.
+           if the owning process has died or (for the files of a
+           TempRootsScope) the scope has ended.  In that case we don't
+           care about its temporary roots.  This holds for the files
+           of this process as well, since flock() locks on different
+           open files conflict even within a process. */
         if (lockFile(fd->get(), ltWrite, false)) {
             printInfo("removing stale temporary roots file '%1%'", path);
             unlink(path.c_str());
@@ -468,8 +544,36 @@ struct LocalStore::GCState
     uint64_t bytesInvalidated;
     bool moveToTrash = true;
     bool shouldDelete;
+    /* In an incremental collection, the paths that may be garbage.
+       All other valid paths are alive. */
+    std::optional<StorePathSet> candidates;
+    /* The inodes of the deleted hard-linked files. Only the entries
+       in the links directory with these inodes can have become
+       unused. */
+    Sync<std::unordered_set<ino_t>> deletedInodes;
+    /* Whether a previous collection was interrupted before it cleaned
+       up the links directory, so that its deleted inodes are lost
+       and all links must be checked. */
+    bool fullLinksScan = false;
     GCState(const GCOptions & options, GCResults & results)
         : options(options), results(results), bytesInvalidated(0) { }
+
+    /* Delete 'path', recording the inodes of the hard-linked files
+       in it in 'deletedInodes'. Safe to call from several threads. */
+    void deletePath(const Path & path, uint64_t & bytesFreed)
+    {
+        std::unordered_set<ino_t> inodes;
+
+        Finally addInodes([&]() {
+            if (!inodes.empty())
+                deletedInodes.lock()->insert(inodes.begin(), inodes.end());
+        });
+
+        nix::deletePath(path, bytesFreed, [&](const struct stat & st) {
+            if (S_ISREG(st.st_mode) && st.st_nlink > 1)
+                inodes.insert(st.st_ino);
+        });
+    }
 };
 
 
@@ -484,7 +588,7 @@ bool LocalStore::isActiveTempFile(const GCState & state,
 void LocalStore::deleteGarbage(GCState & state, const Path & path)
 {
     uint64_t bytesFreed;
-    deletePath(path, bytesFreed);
+    state.deletePath(path, bytesFreed);
     state.results.bytesFreed += bytesFreed;
 }
 
@@ -557,6 +661,11 @@ bool LocalStore::canReachRoot(GCState & state, StorePathSet & visited, const Sto
 
     if (state.dead.count(path)) return false;
 
+    if (state.candidates && !state.candidates->count(path)) {
+        state.alive.insert(path);
+        return true;
+    }
+
     if (state.roots.count(path)) {
         debug("cannot delete '%1%' because it's a root", printStorePath(path));
         state.alive.insert(path);
@@ -645,40 +754,124 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
 }
 
 
+/* Whether the file at `path' shares some of its data with other
+   files, i.e. whether it is the source (or a copy) of a reflink. */
+static bool hasSharedExtents(const Path & path)
+{
+#if __linux__ && defined(FS_IOC_FIEMAP)
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (!fd) return false;
+
+    constexpr size_t maxExtents = 64;
+    std::vector<uint64_t> buf((sizeof(struct fiemap) + maxExtents * sizeof(struct fiemap_extent)) / sizeof(uint64_t));
+    auto map = (struct fiemap *) buf.data();
+
+    uint64_t start = 0;
+    while (true) {
+        std::fill(buf.begin(), buf.end(), 0);
+        map->fm_start = start;
+        map->fm_length = FIEMAP_MAX_OFFSET - start;
+        map->fm_extent_count = maxExtents;
+        if (ioctl(fd.get(), FS_IOC_FIEMAP, map) == -1 || !map->fm_mapped_extents)
+            return false;
+        for (size_t i = 0; i < map->fm_mapped_extents; ++i) {
+            auto & extent = map->fm_extents[i];
+            if (extent.fe_flags & FIEMAP_EXTENT_SHARED) return true;
+            if (extent.fe_flags & FIEMAP_EXTENT_LAST) return false;
+            start = extent.fe_logical + extent.fe_length;
+        }
+    }
+#else
+    return false;
+#endif
+}
+
+
 /* Unlink all files in /nix/store/.links that have a link count of 1,
    which indicates that there are no other links and so they can be
    safely deleted.  FIXME: race condition with optimisePath(): we
    might see a link count of 1 just before optimisePath() increases
-   the link count. */
-void LocalStore::removeUnusedLinks(const GCState & state)
+   the link count.
+
+   With `optimise-use-reflinks', duplicates are reflinked to the link
+   rather than hard linked, so they don't count towards its link
+   count. A link whose data is still shared is therefore kept: it
+   doesn't take up space of its own, and later duplicates can be
+   reflinked to it. Once all the copies are gone, its data is no
+   longer shared and it is deleted.
+
+   Normally only the links whose inodes were deleted by this
+   collection are checked, which only requires reading the directory
+   rather than statting every link. With `gc-full-links-scan', or
+   if a previous collection didn't get this far, all links are
+   checked in parallel, which also removes links left unused by paths
+   deleted in some other way. */
+void LocalStore::removeUnusedLinks(GCState & state)
 {
+    bool fullScan = settings.gcFullLinksScan || state.fullLinksScan;
+
+    auto deletedInodes(state.deletedInodes.lock());
+    if (!fullScan && deletedInodes->empty()) return;
+
     AutoCloseDir dir(opendir(linksDir.c_str()));
     if (!dir) throw SysError("opening directory '%1%'", linksDir);
 
-    int64_t actualSize = 0, unsharedSize = 0;
+    std::atomic<int64_t> actualSize{0}, unsharedSize{0};
+    std::atomic<uint64_t> bytesFreed{0};
+
+    auto check = [&](const std::vector<string> & names) {
+        for (auto & name : names) {
+            checkInterrupt();
+            Path path = linksDir + "/" + name;
+
+            auto st = lstat(path);
+
+            if (st.st_nlink != 1) {
+                actualSize += st.st_size;
+                unsharedSize += (st.st_nlink - 1) * st.st_size;
+                continue;
+            }
+
+            if (S_ISREG(st.st_mode) && st.st_size && hasSharedExtents(path)) {
+                debug("keeping link '%s', whose data is shared with reflinks", path);
+                continue;
+            }
+
+            printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
+
+            if (unlink(path.c_str()) == -1)
+                throw SysError("deleting '%1%'", path);
+
+            bytesFreed += st.st_size;
+        }
+    };
+
+    ThreadPool pool;
+    std::vector<string> names;
 
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir.get())) {
         checkInterrupt();
         string name = dirent->d_name;
         if (name == "." || name == "..") continue;
-        Path path = linksDir + "/" + name;
-
-        auto st = lstat(path);
-
-        if (st.st_nlink != 1) {
-            actualSize += st.st_size;
-            unsharedSize += (st.st_nlink - 1) * st.st_size;
-            continue;
+        if (!fullScan && !deletedInodes->count(dirent->d_ino)) continue;
+        names.push_back(name);
+        if (fullScan && names.size() == 1024) {
+            pool.enqueue(std::bind(check, std::move(names)));
+            names.clear();
         }
+    }
+    if (errno) throw SysError("reading directory '%1%'", linksDir);
 
-        printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
+    if (fullScan) {
+        pool.enqueue(std::bind(check, std::move(names)));
+        pool.process();
+    } else
+        check(names);
 
-        if (unlink(path.c_str()) == -1)
-            throw SysError("deleting '%1%'", path);
+    state.results.bytesFreed += bytesFreed;
 
-        state.results.bytesFreed += st.st_size;
-    }
+    if (!fullScan) return;
 
     struct stat st;
     if (stat(linksDir.c_str(), &st) == -1)
@@ -690,6 +883,401 @@ void LocalStore::removeUnusedLinks(const GCState & state)
 }
 
 
+/* Return the key by which dead paths are ordered for deletion, as
+   determined by the `gc-delete-order' setting. Paths with lower keys
+   are deleted first. */
+static double gcDeletionKey(uint64_t narSize, std::mt19937 & gen)
+{
+    const std::string & order = settings.gcDeleteOrder.get();
+    if (order == "random")
+        return std::uniform_real_distribution<double>()(gen);
+    else if (order == "size")
+        return -(double) narSize;
+    else
+        throw Error("unknown value '%s' for setting 'gc-delete-order'", order);
+}
+
+
+/* Determine the live paths by marking everything reachable from the
+   roots in an in-memory copy of the reference graph, and then
+   invalidate and remove the dead ones. This is equivalent to calling
+   tryToDelete() on every path in the store, but doesn't need any
+   database queries per path. */
+void LocalStore::collectGarbageGraph(GCState & state)
+{
+    printInfo("loading the reference graph...");
+
+    /* The nodes are identified by their ID in `paths'. */
+    struct Node
+    {
+        std::string deriver;
+        uint64_t narSize;
+        std::vector<uint32_t> refs, referrers;
+        /* Paths that must be kept if this one is alive, because of
+           keep-outputs or keep-derivations. */
+        std::vector<uint32_t> keep;
+    };
+
+    std::vector<Node> nodes;
+    StorePathIndex paths;
+
+    auto findPath = [&](std::string_view path) -> std::optional<uint32_t> {
+        if (!hasPrefix(path, storeDir + "/")) return {};
+        return paths.find(path.substr(storeDir.size() + 1));
+    };
+
+    retrySQLite<void>([&]() {
+        nodes.clear();
+        paths = StorePathIndex();
+
+        auto st(_state.lock());
+
+        std::unordered_map<int64_t, uint32_t> indexOfId;
+
+        {
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select id, path, deriver, narSize from ValidPaths;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto n = paths.add(parseTrustedStorePath(use.getStr(1)));
+                if (n != nodes.size()) continue;
+                nodes.push_back(Node {
+                    .deriver = use.isNull(2) ? "" : use.getStr(2),
+                    .narSize = (uint64_t) use.getInt(3),
+                });
+                indexOfId.emplace(use.getInt(0), n);
+            }
+        }
+
+        {
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select referrer, reference from Refs;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto referrer = indexOfId.find(use.getInt(0));
+                auto reference = indexOfId.find(use.getInt(1));
+                if (referrer == indexOfId.end() || reference == indexOfId.end()
+                    || referrer->second == reference->second) continue;
+                nodes[referrer->second].refs.push_back(reference->second);
+                nodes[reference->second].referrers.push_back(referrer->second);
+            }
+        }
+
+        if (state.gcKeepOutputs || state.gcKeepDerivations) {
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select drv, path from DerivationOutputs;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto drv = indexOfId.find(use.getInt(0));
+                auto output = findPath(use.getStr(1));
+                if (drv == indexOfId.end() || !output) continue;
+                if (state.gcKeepOutputs)
+                    nodes[drv->second].keep.push_back(*output);
+                if (state.gcKeepDerivations
+                    && findPath(nodes[*output].deriver) == drv->second)
+                    nodes[*output].keep.push_back(drv->second);
+            }
+        }
+    });
+
+    /* Mark everything reachable from the roots. */
+    std::vector<bool> alive(nodes.size(), false);
+    std::vector<uint32_t> todo;
+
+    auto markAlive = [&](uint32_t n) {
+        if (alive[n]) return;
+        alive[n] = true;
+        todo.push_back(n);
+    };
+
+    for (auto & root : state.roots) {
+        if (auto n = paths.find(root)) markAlive(*n);
+    }
+
+    while (!todo.empty()) {
+        auto n = todo.back();
+        todo.pop_back();
+        for (auto m : nodes[n].refs) markAlive(m);
+        for (auto m : nodes[n].keep) markAlive(m);
+    }
+
+    for (uint32_t n = 0; n < nodes.size(); ++n)
+        (alive[n] ? state.alive : state.dead).insert(paths[n]);
+
+    if (!state.shouldDelete) return;
+
+    printInfo("deleting garbage...");
+
+    /* Delete the entries in the store that aren't valid paths first,
+       as the other collector does. */
+    {
+        AutoCloseDir dir(opendir(realStoreDir.c_str()));
+        if (!dir) throw SysError("opening directory '%1%'", realStoreDir);
+        struct dirent * dirent;
+        while (errno = 0, dirent = readdir(dir.get())) {
+            checkInterrupt();
+            string name = dirent->d_name;
+            if (name == "." || name == "..") continue;
+            if (!paths.find(name))
+                tryToDelete(state, storeDir + "/" + name);
+        }
+    }
+
+    /* Order the dead paths so that every path comes after its dead
+       referrers, since a path can only be invalidated once nothing
+       refers to it anymore. Within that constraint, delete paths in
+       the order given by `gc-delete-order'. */
+    std::mt19937 gen(1);
+    std::vector<double> key(nodes.size(), 0);
+    std::vector<uint32_t> deadReferrers(nodes.size(), 0);
+    for (uint32_t n = 0; n < nodes.size(); ++n) {
+        if (alive[n]) continue;
+        key[n] = gcDeletionKey(nodes[n].narSize, gen);
+        for (auto m : nodes[n].refs) deadReferrers[m]++;
+    }
+
+    auto cmp = [&](uint32_t a, uint32_t b) { return key[a] > key[b]; };
+    std::priority_queue<uint32_t, std::vector<uint32_t>, decltype(cmp)> ready(cmp);
+    for (uint32_t n = 0; n < nodes.size(); ++n)
+        if (!alive[n] && !deadReferrers[n]) ready.push(n);
+
+    std::vector<uint32_t> order;
+    uint64_t bytes = state.results.bytesFreed + state.bytesInvalidated;
+    while (!ready.empty() && bytes <= state.options.maxFreed) {
+        auto n = ready.top();
+        ready.pop();
+        order.push_back(n);
+        bytes += nodes[n].narSize;
+        for (auto m : nodes[n].refs)
+            if (!--deadReferrers[m]) ready.push(m);
+    }
+
+    if (bytes > state.options.maxFreed)
+        printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+
+    /* Invalidate the paths, in batches to keep the transactions
+       reasonably small. */
+    size_t batchSize = 1024;
+    for (size_t i = 0; i < order.size(); i += batchSize) {
+        checkInterrupt();
+        retrySQLite<void>([&]() {
+            auto st(_state.lock());
+            SQLiteTxn txn(st->db);
+            for (size_t j = i; j < std::min(i + batchSize, order.size()); ++j)
+                invalidatePath(*st, paths[order[j]]);
+            txn.commit();
+        });
+    }
+
+    /* Move the paths out of the store, in parallel. Since the trash
+       is deleted after the GC lock is released, this is all the
+       deletion we need to do while holding the lock. */
+    Sync<uint64_t> bytesFreed(0);
+    ThreadPool pool;
+    for (auto n : order) {
+        auto path = printStorePath(paths[n]);
+        state.results.paths.insert(path);
+        pool.enqueue([&, path, size{nodes[n].narSize}]() {
+            checkInterrupt();
+            Path realPath = realStoreDir + "/" + std::string(baseNameOf(path));
+            struct stat st;
+            if (lstat(realPath.c_str(), &st)) {
+                if (errno == ENOENT) return;
+                throw SysError("getting status of %1%", realPath);
+            }
+            printInfo("deleting '%s'", path);
+            if (state.moveToTrash && S_ISDIR(st.st_mode)) {
+                if (chmod(realPath.c_str(), st.st_mode | S_IWUSR) == -1)
+                    throw SysError("making '%1%' writable", realPath);
+                Path tmp = trashDir + "/" + std::string(baseNameOf(path));
+                if (rename(realPath.c_str(), tmp.c_str()))
+                    throw SysError("unable to rename '%1%' to '%2%'", realPath, tmp);
+            } else {
+                uint64_t freed;
+                state.deletePath(realPath, freed);
+                *bytesFreed.lock() += freed;
+            }
+        });
+    }
+    pool.process();
+
+    state.results.bytesFreed += *bytesFreed.lock();
+}
+
+
+/* Return the paths that may have become garbage since the last
+   complete incremental collection, or nothing if there was none. The
+   last collection left only paths reachable from its roots, and paths
+   can't become unreachable except by removing roots, so only the
+   closures of the removed roots and the paths added since then need
+   to be examined. */
+std::optional<StorePathSet> LocalStore::findIncrementalGCCandidates(GCState & state)
+{
+    static const char schema[] =
+      #include "gc-schema.sql.gen.hh"
+        ;
+
+    StorePathSet oldRoots, newPaths;
+
+    auto found = retrySQLite<bool>([&]() {
+        oldRoots.clear();
+        newPaths.clear();
+
+        auto st(_state.lock());
+        st->db.exec(schema);
+
+        std::map<std::string, int64_t> values;
+        {
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select name, value from GCState;");
+            auto use(stmt.use());
+            while (use.next())
+                values.insert_or_assign(use.getStr(0), use.getInt(1));
+        }
+
+        if (!values.count("maxId")
+            || values["keepOutputs"] != state.gcKeepOutputs
+            || values["keepDerivations"] != state.gcKeepDerivations)
+            return false;
+
+        {
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select path from GCRoots;");
+            auto use(stmt.use());
+            while (use.next())
+                oldRoots.insert(parseTrustedStorePath(use.getStr(0)));
+        }
+
+        {
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select path from ValidPaths where id > ?;");
+            auto use(stmt.use()(values["maxId"]));
+            while (use.next())
+                newPaths.insert(parseTrustedStorePath(use.getStr(0)));
+        }
+
+        return true;
+    });
+
+    if (!found) {
+        printInfo("no previous incremental garbage collection; collecting the whole store");
+        return std::nullopt;
+    }
+
+    StorePathSet removedRoots;
+    for (auto & root : oldRoots)
+        if (!state.roots.count(root)) {
+            /* A root that is no longer valid was deleted outside of
+               the garbage collector, so the paths it kept alive are
+               unknown. */
+            if (!isValidPath(root)) {
+                printInfo("root '%s' was deleted since the last collection; collecting the whole store",
+                    printStorePath(root));
+                return std::nullopt;
+            }
+            removedRoots.insert(root);
+        }
+
+    /* Follow the same edges as the marking phase, i.e. keep-outputs
+       and keep-derivations keep outputs and derivers reachable. */
+    StorePathSet candidates;
+    computeFSClosure(removedRoots, candidates, false, state.gcKeepOutputs, state.gcKeepDerivations);
+
+    printInfo("%d roots removed and %d paths added since the last collection; examining %d paths",
+        removedRoots.size(), newPaths.size(), candidates.size() + newPaths.size());
+
+    for (auto & path : newPaths)
+        candidates.insert(path);
+
+    return candidates;
+}
+
+
+void LocalStore::collectGarbageIncremental(GCState & state)
+{
+    printInfo("deleting garbage...");
+
+    try {
+        /* Delete the entries in the store that aren't valid paths
+           first, as the other collectors do. */
+        {
+            AutoCloseDir dir(opendir(realStoreDir.c_str()));
+            if (!dir) throw SysError("opening directory '%1%'", realStoreDir);
+            struct dirent * dirent;
+            while (errno = 0, dirent = readdir(dir.get())) {
+                checkInterrupt();
+                string name = dirent->d_name;
+                if (name == "." || name == "..") continue;
+                Path path = storeDir + "/" + name;
+                auto storePath = maybeParseStorePath(path);
+                if (!storePath || !isValidPath(*storePath))
+                    tryToDelete(state, path);
+            }
+        }
+
+        for (auto & path : *state.candidates)
+            tryToDelete(state, printStorePath(path));
+
+    } catch (GCLimitReached & e) {
+    }
+}
+
+
+/* Record the roots of a complete collection, so that the next
+   incremental collection can find the roots that were removed. */
+void LocalStore::recordGCState(GCState & state, int64_t maxId)
+{
+    static const char schema[] =
+      #include "gc-schema.sql.gen.hh"
+        ;
+
+    retrySQLite<void>([&]() {
+        auto st(_state.lock());
+        st->db.exec(schema);
+
+        SQLiteTxn txn(st->db);
+
+        st->db.exec("delete from GCRoots;");
+
+        SQLiteStmt addRoot;
+        addRoot.create(st->db, "insert or ignore into GCRoots (path) select path from ValidPaths where path = ?;");
+        for (auto & root : state.roots)
+            addRoot.use()(printStorePath(root)).exec();
+
+        SQLiteStmt setValue;
+        setValue.create(st->db, "insert or replace into GCState (name, value) values (?, ?);");
+        setValue.use()("maxId")(maxId).exec();
+        setValue.use()("keepOutputs")((int64_t) state.gcKeepOutputs).exec();
+        setValue.use()("keepDerivations")((int64_t) state.gcKeepDerivations).exec();
+
+        txn.commit();
+    });
+}
+
+
+/* Delete the contents of the trash directory in parallel. This is
+   done after the GC lock has been released, so it can take as long
+   as it needs. */
+void LocalStore::deleteTrash(GCState & state)
+{
+    if (!pathExists(trashDir)) return;
+
+    Sync<uint64_t> bytesFreed(0);
+    ThreadPool pool;
+    for (auto & entry : readDirectory(trashDir))
+        pool.enqueue([&, path{trashDir + "/" + entry.name}]() {
+            uint64_t freed;
+            state.deletePath(path, freed);
+            *bytesFreed.lock() += freed;
+        });
+    pool.process();
+
+    state.results.bytesFreed += *bytesFreed.lock();
+
+    deleteGarbage(state, trashDir);
+}
+
+
 void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     GCState state(options, results);
@@ -739,7 +1327,33 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        increase, since we hold locks on everything.  So everything
        that is not reachable from `roots' is garbage. */
 
+    /* An incremental collection records its roots for the next one,
+       but only if it deletes all garbage. Paths registered from here
+       on are considered new by the next one. */
+    bool recordState = options.incremental
+        && options.action == GCOptions::gcDeleteDead
+        && options.maxFreed == std::numeric_limits<uint64_t>::max();
+
+    int64_t maxId = 0;
+    if (recordState)
+        maxId = retrySQLite<int64_t>([&]() {
+            auto st(_state.lock());
+            SQLiteStmt stmt;
+            stmt.create(st->db, "select max(id) from ValidPaths;");
+            auto use(stmt.use());
+            return use.next() ? use.getInt(0) : 0;
+        });
+
+    if (options.incremental && options.action == GCOptions::gcDeleteDead && options.maxFreed > 0)
+        state.candidates = findIncrementalGCCandidates(state);
+
+    /* Remember that the links directory needs cleaning up until that
+       is done, since the inodes of the deleted files only live in
+       memory. */
+    Path linksPendingFile = dbDir + "/links-pending";
     if (state.shouldDelete) {
+        state.fullLinksScan = pathExists(linksPendingFile);
+        writeFile(linksPendingFile, "");
         if (pathExists(trashDir)) deleteGarbage(state, trashDir);
         try {
             createDirs(trashDir);
@@ -766,6 +1380,14 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                     printStorePath(i));
         }
 
+    } else if (state.candidates) {
+
+        collectGarbageIncremental(state);
+
+    } else if (options.maxFreed > 0 && settings.gcReferenceGraph) {
+
+        collectGarbageGraph(state);
+
     } else if (options.maxFreed > 0) {
 
         if (state.shouldDelete)
@@ -804,10 +1426,22 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                order in which we delete entries to make the collector
                less biased towards deleting paths that come
                alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
+               matters when using --max-freed etc.  Other orders can
+               be selected using `gc-delete-order'. */
             vector<Path> entries_(entries.begin(), entries.end());
             std::mt19937 gen(1);
-            std::shuffle(entries_.begin(), entries_.end(), gen);
+            if (settings.gcDeleteOrder.get() == "random")
+                std::shuffle(entries_.begin(), entries_.end(), gen);
+            else {
+                std::vector<std::pair<double, Path>> keyed;
+                for (auto & i : entries_) {
+                    auto info = queryPathInfo(parseStorePath(i));
+                    keyed.emplace_back(gcDeletionKey(info->narSize, gen), i);
+                }
+                std::sort(keyed.begin(), keyed.end());
+                entries_.clear();
+                for (auto & i : keyed) entries_.push_back(std::move(i.second));
+            }
 
             for (auto & i : entries_)
                 tryToDelete(state, i);
@@ -828,18 +1462,26 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         return;
     }
 
+    if (recordState)
+        recordGCState(state, maxId);
+
     /* Allow other processes to add to the store from here on. */
     fdGCLock = -1;
     fds.clear();
 
     /* Delete the trash directory. */
     printInfo(format("deleting '%1%'") % trashDir);
-    deleteGarbage(state, trashDir);
+    if (settings.gcReferenceGraph)
+        deleteTrash(state);
+    else
+        deleteGarbage(state, trashDir);
 
     /* Clean up the links directory. */
     if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
         printInfo("deleting unused links...");
         removeUnusedLinks(state);
+        if (unlink(linksPendingFile.c_str()) == -1 && errno != ENOENT)
+            throw SysError("deleting '%1%'", linksPendingFile);
     }
 
     /* While we're at it, vacuum the database. */
@@ -99,6 +99,34 @@ public:
     Setting<bool> keepGoing{this, false, "keep-going",
         "Whether to keep building derivations when another build fails."};
 
+    Setting<bool> prefetchSubstitutes{
+        this, false, "prefetch-substitutes",
+        R"(
+          If set to `true`, Nix starts querying the substituters for the
+          outputs of a derivation in the background as soon as the
+          evaluator has instantiated it, if the output paths are known
+          in advance (i.e. for input-addressed derivations). When the
+          derivation is later built, the results of these queries are
+          already cached, which saves the round trips to the binary
+          caches.
+        )"};
+
+    Setting<bool> pipelinedBuilds{
+        this, false, "pipelined-builds",
+        R"(
+          If set to `true`, commands such as `nix build` that are given
+          several installables start building (or substituting) the
+          derivations of each installable as soon as it has been
+          evaluated, while the remaining installables are evaluated.
+          Otherwise, all installables are evaluated before the first
+          build starts.
+
+          If the evaluation of an installable fails, Nix waits for the
+          builds that are already in progress to finish before
+          reporting the error. Unless `keep-going` is set, a failed
+          build stops the evaluation of the remaining installables.
+        )"};
+
     Setting<bool> tryFallback{
         this, false, "fallback",
         R"(
@@ -128,6 +156,33 @@ public:
         )",
         {"build-max-jobs"}};
 
+    Setting<unsigned int> buildSlots{
+        this, 0, "build-slots",
+        R"(
+          The maximum number of local builds that may run at the same
+          time on this machine, across all Nix processes that use the
+          store (such as the processes serving the connections of the
+          Nix daemon). This complements `max-jobs`, which only limits
+          the builds of a single client. The default, `0`, means that
+          there is no machine-wide limit.
+
+          See also `user-build-slots`.
+        )"};
+
+    Setting<Strings> userBuildSlots{
+        this, {}, "user-build-slots",
+        R"(
+          A whitespace-separated list of entries of the form
+          `user=n`, limiting the number of `build-slots` that the
+          builds of a user may occupy at the same time. The user `*`
+          sets the limit for users that aren't listed. For example,
+          `user-build-slots = *=4 hydra=16` prevents any user except
+          `hydra` from taking more than 4 slots, so that one user
+          starting many builds doesn't starve the others. Users
+          without a limit may use all slots. Each limit must be at least
+          `1`.
+        )"};
+
     Setting<unsigned int> buildCores{
         this, getDefaultCores(), "cores",
         R"(
@@ -142,6 +197,94 @@ public:
         )",
         {"build-cores"}};
 
+    Setting<bool> buildJobserver{
+        this, false, "build-jobserver",
+        R"(
+          If set to `true`, Nix runs a GNU Make jobserver with as many job
+          slots as `cores` and passes it to every local builder through
+          the `MAKEFLAGS` environment variable. Builds that run `make`
+          without an explicit `-j` flag then share the available cores
+          dynamically, rather than each using up to `cores` jobs. Builds
+          that pass `-jN` to `make` disable the jobserver for themselves.
+        )"};
+
+    Setting<bool> buildCPUAffinity{
+        this, false, "build-cpu-affinity",
+        R"(
+          If set to `true`, Nix restricts every local builder to its own
+          set of `cores` CPUs, preferably on a single NUMA node, so that
+          concurrent builds don't compete for the same CPUs and caches
+          and allocate memory close to where they run. If `cores` is 0
+          or fewer CPUs are free than a build needs, the build is not
+          restricted. With `build-jobserver`, all builds share the same
+          set of `cores` CPUs.
+        )"};
+
+    Setting<bool> useCgroups{
+        this, false, "use-cgroups",
+        R"(
+          Whether to run every local build in its own cgroup (Linux with
+          cgroup v2 only). The cgroup is created below the cgroup of the
+          Nix process (e.g. `nix-daemon.service`) and is used to kill all
+          processes of the build when it ends, to report its CPU time and
+          peak memory use, and to remember the latter for
+          `build-memory-headroom`. Measuring memory requires the memory
+          controller to be available to the cgroup; with systemd, set
+          `Delegate=yes` for the Nix daemon. Since cgroup v2 only allows
+          enabling it for cgroups without processes of their own, Nix
+          then moves all processes of its cgroup into a `nix-supervisor`
+          child cgroup. It only does so if the cgroup is dedicated to
+          Nix, i.e. if all its processes run Nix. Otherwise, memory is
+          not measured.
+        )"};
+
+    Setting<uint64_t> buildMemoryHeadroom{
+        this, 0, "build-memory-headroom",
+        R"(
+          If non-zero, a local build is only started if the available
+          memory exceeds this many bytes plus the memory the build used
+          last time and the memory the running builds are expected to
+          allocate yet, as recorded with `use-cgroups`. Otherwise, the
+          build waits for another build to finish, even if fewer than
+          `max-jobs` builds are running. One build can always run.
+        )"};
+
+    Setting<bool> recordBuildHistory{
+        this, false, "record-build-history",
+        R"(
+          If set to `true`, Nix appends a record of every local build to
+          the `BuildHistory` table of `~/.cache/nix/build-times-v1.sqlite`
+          of the user running the build, or of
+          `/nix/var/nix/build-times-v1.sqlite` if that is `root` (e.g.
+          for the Nix daemon). It holds the derivation, the status, the start and
+          stop times, the CPU time, peak memory use and I/O of the
+          builder (with `use-cgroups`), and the time spent by Nix on
+          locking, setting up the build and registering its outputs.
+        )"};
+
+    Setting<bool> builtinsInProcess{
+        this, true, "builtins-in-process",
+        R"(
+          Whether to run the builtin builders that only write files or
+          symlinks (`builtin:write-file`, `builtin:concat` and
+          `builtin:symlink-join`) in the Nix process, rather than in a
+          sandboxed builder process. This avoids the cost of setting up
+          a sandbox for the many small derivations of e.g. a NixOS
+          configuration. These builders can only read the closure of the
+          inputs of the derivation.
+        )"};
+
+    Setting<bool> scheduleCriticalPath{
+        this, true, "schedule-critical-path",
+        R"(
+          If set to `true` (the default), Nix keeps a record of how long
+          builds took (in `~/.cache/nix`, or in `/nix/var/nix` for
+          `root`) and uses it to start the builds
+          with the longest chain of dependent builds first when there
+          are more builds to do than build slots (see `max-jobs`). If
+          set to `false`, builds are started in an arbitrary order.
+        )"};
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode = false;
@@ -211,6 +354,27 @@ public:
           this computer and the remote build host is slow.
         )"};
 
+    Setting<unsigned int> sshMasterPersist{
+        this, 0, "ssh-master-persist",
+        R"(
+          If set to a non-zero value, SSH master connections to remote
+          build machines and SSH stores are shared by all Nix processes of
+          the current user, and stay open for this many seconds after
+          they were last used. This avoids an SSH handshake for every
+          remote build. The control sockets are kept in
+          `~/.cache/nix/ssh`.
+        )"};
+
+    Setting<bool> buildersPreferLocality{
+        this, false, "builders-prefer-locality",
+        R"(
+          If set to `true`, Nix asks every suitable remote build machine
+          which of the inputs of a build it already has, and prefers the
+          machine that needs the fewest bytes to be copied to it. This
+          costs a round trip to each machine per build, but can greatly
+          reduce the time spent copying inputs.
+        )"};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -227,7 +391,11 @@ public:
         "Whether SQLite should use WAL mode."};
 
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
-        "Whether to call `sync()` before registering a path as valid."};
+        R"(
+          Whether to call `sync()` before registering a path as valid.
+          Registrations by concurrent builds and substitutions are
+          committed together, with a single `sync()` per batch.
+        )"};
 
     Setting<bool> useSubstitutes{
         this, true, "substitute",
@@ -290,11 +458,20 @@ public:
         this, true, "compress-build-log",
         R"(
           If set to `true` (the default), build logs written to
-          `/nix/var/log/nix/drvs` will be compressed on the fly using bzip2.
-          Otherwise, they will not be compressed.
+          `/nix/var/log/nix/drvs` will be compressed on the fly using the
+          method given by `build-log-compression`. Otherwise, they will not
+          be compressed.
         )",
         {"build-compress-log"}};
 
+    Setting<std::string> logCompression{
+        this, "bzip2", "build-log-compression",
+        R"(
+          The method used to compress build logs if `compress-build-log` is
+          enabled: either `bzip2` (the default) or `zstd`, which compresses
+          and decompresses much faster.
+        )"};
+
     Setting<unsigned long> maxLogSize{
         this, 0, "max-build-log-size",
         R"(
@@ -310,7 +487,8 @@ public:
     bool printRepeatedBuilds = true;
 
     Setting<unsigned int> pollInterval{this, 5, "build-poll-interval",
-        "How often (in seconds) to poll for locks."};
+        "How often (in seconds) to poll for locks and for build machines, where "
+        "Nix cannot be notified when they become available."};
 
     Setting<bool> gcKeepOutputs{
         this, false, "keep-outputs",
@@ -344,6 +522,49 @@ public:
         )",
         {"gc-keep-derivations"}};
 
+    Setting<bool> gcReferenceGraph{
+        this, false, "gc-reference-graph",
+        R"(
+          If `true`, the garbage collector loads the reference graph of
+          the store into memory and determines which paths are alive in
+          a single pass from the roots, rather than querying the
+          database for every path. Dead paths are then moved to the
+          trash directory while the collector holds its lock, and
+          deleted in parallel after the lock has been released, so that
+          other Nix processes can continue to use the store while the
+          actual deletion happens.
+        )"};
+
+    Setting<std::string> gcDeleteOrder{
+        this, "random", "gc-delete-order",
+        R"(
+          The order in which the garbage collector deletes dead paths.
+          This matters when only part of the garbage is deleted, for
+          instance by auto-GC or `--max-freed`. Possible values are:
+
+            - `random` (default): delete paths in a pseudo-random
+              order.
+
+            - `size`: delete the largest paths first, so that as few
+              paths as possible need to be deleted.
+
+          Paths are never deleted before the dead paths that refer to
+          them, so the order is approximate.
+        )"};
+
+    Setting<bool> gcFullLinksScan{
+        this, false, "gc-full-links-scan",
+        R"(
+          If `true`, the garbage collector checks every file in the
+          `.links` directory of the store and removes the ones that are
+          no longer used. By default, it only checks the files that
+          were linked from the paths it deleted, which is much faster
+          on large stores but misses files that became unused because
+          store paths were deleted by some other means. A collection
+          that was interrupted before it got to the `.links` directory
+          is always followed by a full check.
+        )"};
+
     Setting<bool> autoOptimiseStore{
         this, false, "auto-optimise-store",
         R"(
@@ -354,6 +575,18 @@ public:
           duplicate files.
         )"};
 
+    Setting<bool> optimiseUseReflinks{
+        this, false, "optimise-use-reflinks",
+        R"(
+          If set to `true`, store optimisation replaces duplicate files
+          with copy-on-write clones (reflinks) of a single copy rather
+          than with hard links, on file systems that support this (such
+          as Btrfs and XFS). Unlike hard links, clones don't share
+          inodes, so they are not subject to the file system's link
+          count limit. If the file system doesn't support reflinks, Nix
+          falls back to hard links.
+        )"};
+
     Setting<bool> envKeepDerivations{
         this, false, "keep-env-derivations",
         R"(
@@ -429,6 +662,20 @@ public:
         )",
         {"build-chroot-dirs", "build-sandbox-paths"}};
 
+    Setting<bool> sandboxOverlayStore{
+        this, false, "sandbox-overlay-store",
+        R"(
+          (Linux-specific.) If set to `true`, the Nix store in the sandbox
+          is set up as a single overlay mount of the host store, with the
+          build outputs going to the upper layer, instead of one bind mount
+          per input path. This makes sandbox setup and teardown independent
+          of the size of the input closure, but allows builders to see all
+          paths in the host store instead of just their inputs, so undeclared
+          dependencies are not caught. It requires overlayfs in user
+          namespaces (Linux 5.11 or later), and is not used for repairing
+          or checking builds.
+        )"};
+
     Setting<bool> sandboxFallback{this, true, "sandbox-fallback",
         "Whether to disable sandboxing when the kernel doesn't allow it."};
 
@@ -457,6 +704,18 @@ public:
 
     Setting<Path> sandboxBuildDir{this, "/build", "sandbox-build-dir",
         "The build directory inside the sandbox."};
+
+    Setting<uint64_t> buildDirTmpfsSize{
+        this, 0, "build-dir-tmpfs-size",
+        R"(
+          If non-zero, the build directory of derivations that set
+          `preferLocalBuild = true` (which small builds like the trivial
+          builders in Nixpkgs do) is a tmpfs of at most this many bytes,
+          which is much cheaper to create and delete than a directory on
+          disk. If such a build fails while its tmpfs is full, it is
+          retried with a build directory on disk. This requires root
+          and is not used if `keep-failed` is set.
+        )"};
 #endif
 
     Setting<PathSet> allowedImpureHostPrefixes{this, {}, "allowed-impure-host-deps",
@@ -552,6 +811,16 @@ public:
           `fetchTarball`, and `fetchurl` respect this TTL.
         )"};
 
+    Setting<bool> tarballRefreshInBackground{
+        this, false, "tarball-refresh-in-background",
+        R"(
+          If set to `true`, a stale cached file or tarball (see
+          `tarball-ttl`) is used right away, while Nix checks in a
+          background process whether it's still up to date. Any new
+          version is used the next time the file or tarball is
+          fetched.
+        )"};
+
     Setting<bool> requireSigs{
         this, true, "require-sigs",
         R"(
@@ -621,6 +890,17 @@ public:
         )",
         {"trusted-binary-caches"}};
 
+    Setting<bool> raceSubstituters{
+        this, false, "race-substituters",
+        R"(
+          If set to `true`, Nix queries all substituters for a path
+          concurrently, and fetches the path from the substituter that
+          is expected to be fastest, judging by the latency and
+          throughput it has shown so far. Priorities are then only
+          used to break ties. By default, substituters are tried one at
+          a time in order of priority.
+        )"};
+
     Setting<Strings> trustedUsers{
         this, {"root"}, "trusted-users",
         R"(
@@ -661,6 +941,68 @@ public:
           mismatch if the build isn't reproducible.
         )"};
 
+    Setting<Path> narCache{
+        this, "", "nar-cache",
+        R"(
+          If set, a directory in which NARs downloaded from binary caches
+          are kept, keyed by their hash. Substituting a path whose NAR is
+          in this directory doesn't download it again, e.g. after the path
+          has been garbage-collected, or when it's copied from one binary
+          cache to another. The directory can be shared between machines
+          (e.g. over NFS).
+        )"};
+
+    Setting<bool> substituteFromLinks{
+        this, false, "substitute-from-links",
+        R"(
+          If set to `true`, substituting a path from a binary cache that
+          has chunked NARs (`chunk-nars`) and file hashes in its NAR
+          listings (`write-file-hashes`) takes the contents of files that
+          already exist in the Nix store's `.links` directory (see
+          `auto-optimise-store`) from there, and only downloads the
+          chunks that contain the other files.
+        )"};
+
+    Setting<bool> substituteDeltas{
+        this, false, "substitute-deltas",
+        R"(
+          If set to `true`, substituting a path from a binary cache first
+          checks whether the cache has a delta of the path's NAR against
+          another path that exists in the Nix store (see `nix store
+          add-delta`). If so, only the delta is downloaded, and the NAR
+          is reconstructed from it and the NAR of the other path.
+        )"};
+
+    Setting<uint64_t> narCacheMaxSize{
+        this, 10ULL * 1024 * 1024 * 1024, "nar-cache-max-size",
+        R"(
+          The maximum size in bytes of the NARs in `nar-cache`. When it's
+          exceeded, the least recently used NARs are deleted. 0 means no
+          limit.
+        )"};
+
+    Setting<bool> drvHashCache{
+        this, false, "derivation-hash-cache",
+        R"(
+          Whether to keep the hashes of store derivations that are used to
+          compute output paths (the "hash modulo" of a derivation) in a
+          persistent cache in `~/.cache/nix`. This saves reading and parsing
+          the input derivations of a derivation again in later Nix
+          invocations. Since store derivations never change, cache entries
+          never need to be invalidated.
+        )"};
+
+    Setting<bool> closureSummaryCache{
+        this, true, "closure-summary-cache",
+        R"(
+          Whether to keep summaries of the closures of store paths (the
+          package names, versions and sizes in each closure) in a
+          persistent cache in `~/.cache/nix`. These are used by `nix
+          store diff-closures` and `nix profile diff-closures`, so that
+          the closure of each profile generation only has to be examined
+          once.
+        )"};
+
     /* ?Who we trust to use the daemon in safe ways */
     Setting<Strings> allowedUsers{
         this, {"*"}, "allowed-users",
@@ -673,6 +1015,79 @@ public:
           Note that trusted users are always allowed to connect.
         )"};
 
+    Setting<bool> threadedDaemon{
+        this, false, "threaded-daemon",
+        R"(
+          If set to `true`, the Nix daemon serves client connections from
+          a pool of threads in a single process that shares one store,
+          instead of forking a process for every connection. This makes
+          short-lived connections much cheaper and lets clients share the
+          daemon's path info cache.
+
+          In this mode, settings sent by clients (such as `max-jobs` or
+          `keep-going`) are ignored, since they would affect all clients.
+          Temporary roots registered while serving a connection are
+          released when it closes, as with a forked daemon.
+        )"};
+
+    Setting<unsigned int> daemonPreforkWorkers{
+        this, 0, "daemon-prefork-workers",
+        R"(
+          If set to a non-zero value, the Nix daemon keeps this many
+          worker processes running that wait for client connections,
+          each with the store already open, instead of forking a process
+          after accepting a connection. Each worker serves one
+          connection at a time, and settings sent by a client are
+          restored when its connection closes. This makes connection
+          setup much cheaper for short-lived clients. Temporary roots
+          registered by clients are kept until the worker exits; see
+          `daemon-prefork-connections`. This setting is ignored if
+          `threaded-daemon` is enabled.
+        )"};
+
+    Setting<unsigned int> daemonPreforkConnections{
+        this, 100, "daemon-prefork-connections",
+        R"(
+          The number of connections a pre-forked daemon worker (see
+          `daemon-prefork-workers`) serves before it exits and is
+          replaced by a fresh one. 0 means no limit.
+        )"};
+
+    Setting<Path> metricsSocket{
+        this, "", "metrics-socket",
+        R"(
+          If set, the Nix daemon listens on a Unix domain socket at this
+          path and answers each connection with an HTTP response
+          containing metrics in the Prometheus text format. The metrics
+          include per-operation request counts, latencies and errors,
+          the number of requests in progress, the time spent waiting
+          for path locks and the garbage collector lock, and the number
+          of executions of and time spent in each SQLite statement. For
+          example:
+
+          ```console
+          # curl --unix-socket /nix/var/nix/daemon-metrics http://localhost/metrics
+          ```
+        )"};
+
+    Setting<uint64_t> sqliteSlowQueryThreshold{
+        this, 0, "sqlite-slow-query-threshold",
+        R"(
+          If set to a non-zero value, print a warning showing every
+          SQLite statement (with its arguments) that takes at least this
+          many milliseconds to execute, such as queries on the Nix
+          database. Such statements are also counted in the metrics
+          (see `metrics-socket`).
+        )"};
+
+    Setting<Path> daemonTraceFile{
+        this, "", "daemon-trace-file",
+        R"(
+          If set, the Nix daemon appends a line to this file for every
+          request it processes, giving the time, the connection, the
+          operation, how long it took and whether it failed.
+        )"};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -924,12 +1339,51 @@ public:
     Setting<bool> warnDirty{this, true, "warn-dirty",
         "Whether to warn about dirty Git/Mercurial trees."};
 
+    Setting<bool> lazyTrees{this, false, "lazy-trees",
+        R"(
+          If set to `true`, `path:` inputs are not copied to the Nix
+          store when they're fetched. Their store path and NAR hash
+          are still computed, but the evaluator reads files from the
+          original directory, and the copy is made only when the
+          store path is actually needed, e.g. as an input of a
+          derivation.
+        )"};
+
+    Setting<bool> indexReferencePositions{this, false, "index-reference-positions",
+        R"(
+          If set to `true`, Nix records in the Nix database where each
+          reference of a newly built store path occurs in its
+          contents, i.e. the first file and offset containing the
+          hash part of the reference, and the surrounding
+          bytes. `nix why-depends` uses this to explain the
+          dependencies of a path without reading its contents.
+        )"};
+
     Setting<size_t> narBufferSize{this, 32 * 1024 * 1024, "nar-buffer-size",
         "Maximum size of NARs before spilling them to disk."};
 
     Setting<std::string> flakeRegistry{this, "https://github.com/NixOS/flake-registry/raw/master/flake-registry.json", "flake-registry",
         "Path or URI of the global flake registry."};
 
+    Setting<unsigned int> copyJobs{this, 8, "copy-jobs",
+        R"(
+          The maximum number of store paths whose contents are fetched
+          in parallel when copying paths between stores (e.g. by `nix
+          copy`). Fetching is not held up by the references between
+          paths; only adding paths to the destination store is.
+        )"};
+
+    Setting<uint64_t> copySpoolSize{this, 1ULL << 30, "copy-spool-size",
+        R"(
+          The maximum number of bytes of NARs that are fetched ahead
+          into temporary files (in `TMPDIR`) when copying paths between
+          stores. A NAR larger than this is still fetched, but only
+          when nothing else is.
+        )"};
+
+    Setting<unsigned int> flakeFetchJobs{this, 8, "flake-fetch-jobs",
+        "Maximum number of flake inputs to fetch in parallel when locking a flake."};
+
     Setting<bool> allowSymlinkedStore{
         this, false, "allow-symlinked-store",
         R"(
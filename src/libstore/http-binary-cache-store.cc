@@ -126,7 +126,20 @@ protected:
         const std::string & mimeType) override
     {
         auto req = makeRequest(path);
-        req.data = std::make_shared<string>(StreamToSourceAdapter(istream).drain());
+
+        /* Stream the upload if we can determine its size, since NARs
+           can be much larger than the available memory. */
+        istream->seekg(0, std::ios_base::end);
+        auto size = istream->tellg();
+        istream->seekg(0);
+        if (size >= 0) {
+            req.dataStream = istream;
+            req.dataSize = size;
+        } else {
+            istream->clear();
+            req.data = std::make_shared<string>(StreamToSourceAdapter(istream).drain());
+        }
+
         req.mimeType = mimeType;
         try {
             getFileTransfer()->upload(req);
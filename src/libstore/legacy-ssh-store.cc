@@ -7,6 +7,7 @@
 #include "ssh.hh"
 #include "derivations.hh"
 #include "callback.hh"
+#include "compression.hh"
 
 namespace nix {
 
@@ -18,6 +19,10 @@ struct LegacySSHStoreConfig : virtual StoreConfig
     const Setting<bool> compress{(StoreConfig*) this, false, "compress", "whether to compress the connection"};
     const Setting<Path> remoteProgram{(StoreConfig*) this, "nix-store", "remote-program", "path to the nix-store executable on the remote system"};
     const Setting<std::string> remoteStore{(StoreConfig*) this, "", "remote-store", "URI of the store on the remote system"};
+    const Setting<std::string> narCompression{(StoreConfig*) this, "none", "nar-compression",
+        "compression method (e.g. `zstd`) for NARs sent over the connection, if supported by the remote system"};
+    const Setting<std::optional<int>> narCompressionLevel{(StoreConfig*) this, {}, "nar-compression-level",
+        "compression level for NARs sent over the connection (empty means the method's default)"};
 
     const std::string name() override { return "Legacy SSH Store"; }
 };
@@ -35,6 +40,8 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
         FdSink to;
         FdSource from;
         int remoteVersion;
+        /* The NAR compression method agreed with the remote side. */
+        std::string narCompression = "none";
         bool good = true;
     };
 
@@ -86,6 +93,15 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
             if (GET_PROTOCOL_MAJOR(conn->remoteVersion) != 0x200)
                 throw Error("unsupported 'nix-store --serve' protocol version on '%s'", host);
 
+            if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 6) {
+                conn->to << narCompression.get() << narCompressionLevel.to_string();
+                conn->to.flush();
+                conn->narCompression = readString(conn->from);
+                if (conn->narCompression != narCompression.get())
+                    debug("'%s' does not support NAR compression method '%s', using '%s'",
+                        host, narCompression.get(), conn->narCompression);
+            }
+
         } catch (EndOfFile & e) {
             throw Error("cannot connect to '%1%'", host);
         }
@@ -165,7 +181,15 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
                 << info.sigs
                 << renderContentAddress(info.ca);
             try {
-                copyNAR(source, conn->to);
+                if (conn->narCompression == "none")
+                    copyNAR(source, conn->to);
+                else {
+                    std::exception_ptr ex;
+                    FramedSink framed(conn->to, ex);
+                    auto compressor = makeCompressionSink(conn->narCompression, framed, false, narCompressionLevel);
+                    copyNAR(source, *compressor);
+                    compressor->finish();
+                }
             } catch (...) {
                 conn->good = false;
                 throw;
@@ -205,7 +229,14 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
 
         conn->to << cmdDumpStorePath << printStorePath(path);
         conn->to.flush();
-        copyNAR(conn->from, sink);
+        if (conn->narCompression == "none")
+            copyNAR(conn->from, sink);
+        else {
+            FramedSource framed(conn->from);
+            auto decompressor = makeDecompressionSink(conn->narCompression, sink);
+            framed.drainInto(*decompressor);
+            decompressor->finish();
+        }
     }
 
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override
@@ -259,6 +290,15 @@ public:
         if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 3)
             conn->from >> status.timesBuilt >> status.isNonDeterministic >> status.startTime >> status.stopTime;
 
+        if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 7) {
+            std::map<std::string, uint64_t> metrics;
+            for (auto n = readNum<size_t>(conn->from); n; --n) {
+                auto name = readString(conn->from);
+                metrics.insert_or_assign(name, readNum<uint64_t>(conn->from));
+            }
+            status.setMetrics(metrics);
+        }
+
         return status;
     }
 
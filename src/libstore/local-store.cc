@@ -8,6 +8,10 @@
 #include "references.hh"
 #include "callback.hh"
 #include "topo-sort.hh"
+#include "path-index.hh"
+#include "metadata-snapshot.hh"
+#include "thread-pool.hh"
+#include "parallel-walk.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -59,6 +63,66 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryAllRealisedOutputs;
     SQLiteStmt QueryPathFromHashPart;
     SQLiteStmt QueryValidPaths;
+    SQLiteStmt QueryPathInfoBatch;
+    SQLiteStmt QueryReferencesBatch;
+    SQLiteStmt QueryDataVersion;
+    SQLiteStmt AddRefPosition;
+    SQLiteStmt DeleteRefPositions;
+    SQLiteStmt QueryRefPositions;
+
+    /* Prepare the statements used by queryPathInfosUncached(), which
+       look up `pathInfoBatchSize' paths at once. */
+    void prepareBatch(SQLite & db)
+    {
+        std::string params = "?";
+        for (size_t n = 1; n < pathInfoBatchSize; ++n)
+            params += ", ?";
+        QueryPathInfoBatch.create(db,
+            "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca, path from ValidPaths where path in (" + params + ");");
+        QueryReferencesBatch.create(db,
+            "select referrer, path from Refs join ValidPaths on reference = id where referrer in (" + params + ");");
+    }
+};
+
+struct LocalStore::State::ClosureIndex {
+    /* Whether the index reflects the database. Cleared when paths
+       are invalidated. */
+    bool valid = false;
+
+    /* The value of `pragma data_version' when the index was loaded.
+       This changes when another connection commits a transaction. */
+    int64_t dataVersion = 0;
+
+    /* The paths in the graph, identified by their ID in `paths'. */
+    StorePathIndex paths;
+
+    /* The references and referrers of each path. */
+    std::vector<std::vector<uint32_t>> refs, referrers;
+
+    uint32_t getIndex(const StorePath & path)
+    {
+        auto n = paths.add(path);
+        if (n == refs.size()) {
+            refs.emplace_back();
+            referrers.emplace_back();
+        }
+        return n;
+    }
+
+    void addRef(uint32_t referrer, uint32_t reference)
+    {
+        auto & r = refs[referrer];
+        if (std::find(r.begin(), r.end(), reference) != r.end()) return;
+        r.push_back(reference);
+        referrers[reference].push_back(referrer);
+    }
+};
+
+struct LocalStore::ReadConnection {
+    /* Note: `db' must come first so that the statements are
+       finalised before the connection is closed. */
+    SQLite db;
+    State::Stmts stmts;
 };
 
 int getSchema(Path schemaPath)
@@ -74,32 +138,54 @@ int getSchema(Path schemaPath)
     return curSchema;
 }
 
-void migrateCASchema(SQLite& db, Path schemaPath, AutoCloseFD& lockFd)
+/* Create the tables of an optional extension of the schema, whose
+   version is recorded in `schemaPath'. */
+static void migrateExtraSchema(SQLite & db, Path schemaPath, AutoCloseFD & lockFd,
+    std::string_view name, int version, const char * schema)
 {
-    const int nixCASchemaVersion = 1;
-    int curCASchema = getSchema(schemaPath);
-    if (curCASchema != nixCASchemaVersion) {
-        if (curCASchema > nixCASchemaVersion) {
-            throw Error("current Nix store ca-schema is version %1%, but I only support %2%",
-                 curCASchema, nixCASchemaVersion);
+    int curSchema = getSchema(schemaPath);
+    if (curSchema != version) {
+        if (curSchema > version) {
+            throw Error("current Nix store %1% is version %2%, but I only support %3%",
+                 name, curSchema, version);
         }
 
         if (!lockFile(lockFd.get(), ltWrite, false)) {
-            printInfo("waiting for exclusive access to the Nix store for ca drvs...");
+            printInfo("waiting for exclusive access to the Nix store for %s...", name);
             lockFile(lockFd.get(), ltWrite, true);
         }
 
-        if (curCASchema == 0) {
-            static const char schema[] =
-              #include "ca-specific-schema.sql.gen.hh"
-                ;
+        if (curSchema == 0)
             db.exec(schema);
-        }
-        writeFile(schemaPath, fmt("%d", nixCASchemaVersion));
+        writeFile(schemaPath, fmt("%d", version));
         lockFile(lockFd.get(), ltRead, true);
     }
 }
 
+void migrateCASchema(SQLite& db, Path schemaPath, AutoCloseFD& lockFd)
+{
+    static const char schema[] =
+      #include "ca-specific-schema.sql.gen.hh"
+        ;
+    migrateExtraSchema(db, schemaPath, lockFd, "ca-schema", 1, schema);
+}
+
+static void migrateRefPositionsSchema(SQLite & db, Path schemaPath, AutoCloseFD & lockFd)
+{
+    static const char schema[] =
+      #include "ref-positions-schema.sql.gen.hh"
+        ;
+    migrateExtraSchema(db, schemaPath, lockFd, "ref-positions-schema", 1, schema);
+}
+
+static void migrateValidPathCountSchema(SQLite & db, Path schemaPath, AutoCloseFD & lockFd)
+{
+    static const char schema[] =
+      #include "valid-path-count-schema.sql.gen.hh"
+        ;
+    migrateExtraSchema(db, schemaPath, lockFd, "valid-path-count-schema", 1, schema);
+}
+
 LocalStore::LocalStore(const Params & params)
     : StoreConfig(params)
     , LocalFSStoreConfig(params)
@@ -281,6 +367,15 @@ LocalStore::LocalStore(const Params & params)
         migrateCASchema(state->db, dbDir + "/ca-schema", globalLock);
     }
 
+    /* Look for the positions table even if indexing has been turned
+       off since, so that queries still use the recorded positions. */
+    if (settings.indexReferencePositions)
+        migrateRefPositionsSchema(state->db, dbDir + "/ref-positions-schema", globalLock);
+    auto haveRefPositions = nix::getSchema(dbDir + "/ref-positions-schema") > 0;
+
+    if (metadataSnapshot != "")
+        migrateValidPathCountSchema(state->db, dbDir + "/valid-path-count-schema", globalLock);
+
     /* Prepare SQL statements. */
     state->stmts->RegisterValidPath.create(state->db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
@@ -307,6 +402,16 @@ LocalStore::LocalStore(const Params & params)
     state->stmts->QueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmts->QueryDataVersion.create(state->db, "pragma data_version;");
+    state->stmts->prepareBatch(state->db);
+    if (haveRefPositions) {
+        state->stmts->AddRefPosition.create(state->db,
+            "insert into RefPositions (referrer, reference, file, symlink, offset, excerpt) values (?, (select id from ValidPaths where path = ?), ?, ?, ?, ?);");
+        state->stmts->DeleteRefPositions.create(state->db,
+            "delete from RefPositions where referrer = ?;");
+        state->stmts->QueryRefPositions.create(state->db,
+            "select path, file, symlink, offset, excerpt from RefPositions join ValidPaths on reference = id where referrer = (select id from ValidPaths where path = ?);");
+    }
     if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
         state->stmts->RegisterRealisedOutput.create(state->db,
             R"(
@@ -329,11 +434,94 @@ LocalStore::LocalStore(const Params & params)
                     ;
             )");
     }
+
+    /* WAL mode allows readers to proceed concurrently with each
+       other and with a writer, so use separate connections for
+       read-only queries. */
+    if (settings.useSQLiteWAL && readConnections > 0)
+        readPool = std::make_unique<Pool<ReadConnection>>(
+            readConnections,
+            [this]() {
+                auto conn = make_ref<ReadConnection>();
+                conn->db = SQLite(dbDir + "/db.sqlite", false);
+                conn->db.exec("pragma query_only = 1");
+                conn->stmts.QueryPathInfo.create(conn->db,
+                    "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+                conn->stmts.QueryReferences.create(conn->db,
+                    "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+                conn->stmts.QueryReferrers.create(conn->db,
+                    "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+                conn->stmts.prepareBatch(conn->db);
+                return conn;
+            });
+
+    if (metadataSnapshot != "") {
+        try {
+            auto snapshot = std::make_shared<const MetadataSnapshot>(metadataSnapshot, storeDir);
+
+            /* Check that none of the snapshot's paths have been
+               deleted. (They can't be re-added with the same ID.)
+               The total is kept up to date by triggers, so this only
+               counts the paths added since the snapshot. */
+            auto nrPaths = retrySQLite<uint64_t>([&]() {
+                auto state(_state.lock());
+                SQLiteStmt stmt;
+                stmt.create(state->db,
+                    "select (select count from ValidPathCount) - count(*) from ValidPaths where id > ?;");
+                auto use(stmt.use()((int64_t) snapshot->maxId()));
+                if (!use.next())
+                    throw Error("cannot count the valid paths");
+                return use.getInt(0);
+            });
+
+            if (snapshot->isCurrent(nrPaths))
+                *this->snapshot.lock() = snapshot;
+            else
+                warn("ignoring metadata snapshot '%s' since some of its paths are no longer valid",
+                    snapshot->path);
+        } catch (Error & e) {
+            warn("ignoring metadata snapshot: %s", e.msg());
+        }
+    }
+}
+
+
+template<typename T>
+T LocalStore::retryRead(std::function<T(State::Stmts &)> fun)
+{
+    return retrySQLite<T>([&]() -> T {
+        stats.dbReadQueries++;
+        auto before = std::chrono::steady_clock::now();
+        auto noteWait = [&]() {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - before).count();
+            /* Don't count the uncontended case. */
+            if (us > 10) {
+                stats.dbReadWaits++;
+                stats.dbReadWaitMicroseconds += us;
+            }
+        };
+        if (readPool) {
+            auto conn(readPool->get());
+            noteWait();
+            return fun(conn->stmts);
+        } else {
+            auto state(_state.lock());
+            noteWait();
+            return fun(*state->stmts);
+        }
+    });
 }
 
 
 LocalStore::~LocalStore()
 {
+    if (prefetchThread.joinable()) {
+        _prefetchState.lock()->quit = true;
+        prefetchWakeup.notify_one();
+        prefetchThread.join();
+    }
+
     std::shared_future<void> future;
 
     {
@@ -454,7 +642,10 @@ void LocalStore::makeStoreWritable()
 const time_t mtimeStore = 1; /* 1 second into the epoch */
 
 
-static void canonicaliseTimestampAndPermissions(const Path & path, const struct stat & st)
+/* Canonicalise the file `name' in the directory `dirFd' (which may
+   be AT_FDCWD). `path' is only used in error messages. */
+static void canonicaliseTimestampAndPermissions(int dirFd, const char * name,
+    const Path & path, const struct stat & st)
 {
     if (!S_ISLNK(st.st_mode)) {
 
@@ -465,25 +656,22 @@ static void canonicaliseTimestampAndPermissions(const Path & path, const struct
             mode = (st.st_mode & S_IFMT)
                  | 0444
                  | (st.st_mode & S_IXUSR ? 0111 : 0);
-            if (chmod(path.c_str(), mode) == -1)
+            if (fchmodat(dirFd, name, mode, 0) == -1)
                 throw SysError("changing mode of '%1%' to %2$o", path, mode);
         }
 
     }
 
     if (st.st_mtime != mtimeStore) {
-        struct timeval times[2];
+        struct timespec times[2];
         times[0].tv_sec = st.st_atime;
-        times[0].tv_usec = 0;
+        times[0].tv_nsec = 0;
         times[1].tv_sec = mtimeStore;
-        times[1].tv_usec = 0;
-#if HAVE_LUTIMES
-        if (lutimes(path.c_str(), times) == -1)
-            if (errno != ENOSYS ||
-                (!S_ISLNK(st.st_mode) && utimes(path.c_str(), times) == -1))
-#else
-        if (!S_ISLNK(st.st_mode) && utimes(path.c_str(), times) == -1)
-#endif
+        times[1].tv_nsec = 0;
+        /* Some file systems don't support setting the times of a
+           symlink, which is harmless. */
+        if (utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW) == -1
+            && (!S_ISLNK(st.st_mode) || (errno != ENOTSUP && errno != ENOSYS)))
             throw SysError("changing modification time of '%1%'", path);
     }
 }
@@ -491,12 +679,17 @@ static void canonicaliseTimestampAndPermissions(const Path & path, const struct
 
 void canonicaliseTimestampAndPermissions(const Path & path)
 {
-    canonicaliseTimestampAndPermissions(path, lstat(path));
+    canonicaliseTimestampAndPermissions(AT_FDCWD, path.c_str(), path, lstat(path));
 }
 
 
-static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+/* Canonicalise one file visited by walkDirectoryParallel(). Returns
+   whether to canonicalise the contents of a directory. */
+static bool canonicaliseFile(const WalkEntry & entry, uid_t fromUid, Sync<InodesSeen *> & inodesSeen_)
 {
+    auto & path(entry.path);
+    auto & st(entry.st);
+
     checkInterrupt();
 
 #if __APPLE__
@@ -509,8 +702,6 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
     }
 #endif
 
-    auto st = lstat(path);
-
     /* Really make sure that the path is of a supported type. */
     if (!(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)))
         throw Error("file '%1%' has an unsupported type", path);
@@ -543,51 +734,49 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
        hard-linked into the output (e.g. "ln /etc/shadow $out/foo").
        However, ignore files that we chown'ed ourselves previously to
        ensure that we don't fail on hard links within the same build
-       (i.e. "touch $out/foo; ln $out/foo $out/bar"). */
-    if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
-        if (S_ISDIR(st.st_mode) || !inodesSeen.count(Inode(st.st_dev, st.st_ino)))
-            throw BuildError("invalid ownership on file '%1%'", path);
-        mode_t mode = st.st_mode & ~S_IFMT;
-        assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
-        return;
-    }
+       (i.e. "touch $out/foo; ln $out/foo $out/bar").  Since files
+       are canonicalised concurrently, the inode is recorded before
+       it's changed, so that a hard link that already has the new
+       ownership is always recognised. */
+    {
+        auto inodesSeen(inodesSeen_.lock());
+        if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
+            if (S_ISDIR(st.st_mode) || !(*inodesSeen)->count(Inode(st.st_dev, st.st_ino)))
+                throw BuildError("invalid ownership on file '%1%'", path);
+            mode_t mode = st.st_mode & ~S_IFMT;
+            assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
+            return false;
+        }
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
+        (*inodesSeen)->insert(Inode(st.st_dev, st.st_ino));
+    }
 
-    canonicaliseTimestampAndPermissions(path, st);
+    canonicaliseTimestampAndPermissions(entry.dirFd, entry.name, path, st);
 
-    /* Change ownership to the current uid.  If it's a symlink, use
-       lchown if available, otherwise don't bother.  Wrong ownership
-       of a symlink doesn't matter, since the owning user can't change
-       the symlink and can't delete it because the directory is not
-       writable.  The only exception is top-level paths in the Nix
-       store (since that directory is group-writable for the Nix build
-       users group); we check for this case below. */
+    /* Change ownership to the current uid.  Wrong ownership of a
+       symlink doesn't matter much, since the owning user can't
+       change the symlink and can't delete it because the directory
+       is not writable, but fchownat() can change it anyway. */
     if (st.st_uid != geteuid()) {
-#if HAVE_LCHOWN
-        if (lchown(path.c_str(), geteuid(), getegid()) == -1)
-#else
-        if (!S_ISLNK(st.st_mode) &&
-            chown(path.c_str(), geteuid(), getegid()) == -1)
-#endif
+        if (fchownat(entry.dirFd, entry.name, geteuid(), getegid(), AT_SYMLINK_NOFOLLOW) == -1)
             throw SysError("changing owner of '%1%' to %2%",
                 path, geteuid());
     }
 
-    if (S_ISDIR(st.st_mode)) {
-        DirEntries entries = readDirectory(path);
-        for (auto & i : entries)
-            canonicalisePathMetaData_(path + "/" + i.name, fromUid, inodesSeen);
-    }
+    return true;
 }
 
 
 void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
 {
-    canonicalisePathMetaData_(path, fromUid, inodesSeen);
+    /* Outputs can have hundreds of thousands of files, and the
+       metadata operations are mostly waiting for the file system, so
+       do them on several threads. */
+    Sync<InodesSeen *> inodesSeen_(&inodesSeen);
+    walkDirectoryParallel(path, [&](const WalkEntry & entry) {
+        return canonicaliseFile(entry, fromUid, inodesSeen_);
+    });
 
-    /* On platforms that don't have lchown(), the top-level path can't
-       be a symlink, since we can't change its ownership. */
     auto st = lstat(path);
 
     if (st.st_uid != geteuid()) {
@@ -719,11 +908,8 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.hashPart()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    upsertPathInfoCache(std::string(info.path.hashPart()),
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     return id;
 }
@@ -733,65 +919,160 @@ void LocalStore::queryPathInfoUncached(const StorePath & path,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
     try {
-        callback(retrySQLite<std::shared_ptr<const ValidPathInfo>>([&]() {
-            auto state(_state.lock());
-            return queryPathInfoInternal(*state, path);
+        if (auto snapshot = getSnapshot())
+            if (auto info = snapshot->queryPathInfo(path))
+                return callback(std::move(info));
+
+        callback(retryRead<std::shared_ptr<const ValidPathInfo>>([&](State::Stmts & stmts) {
+            return queryPathInfoInternal(stmts, path);
         }));
 
     } catch (...) { callback.rethrow(); }
 }
 
 
-std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & state, const StorePath & path)
+/* Construct a ValidPathInfo from the current row of a query on
+   ValidPaths. The columns must be in the same order as in
+   QueryPathInfo. */
+static std::shared_ptr<ValidPathInfo> readPathInfoRow(const Store & store,
+    SQLiteStmt & stmt, SQLiteStmt::Use & use, const StorePath & path)
 {
-    /* Get the path info. */
-    auto useQueryPathInfo(state.stmts->QueryPathInfo.use()(printStorePath(path)));
-
-    if (!useQueryPathInfo.next())
-        return std::shared_ptr<ValidPathInfo>();
-
-    auto id = useQueryPathInfo.getInt(0);
+    auto id = use.getInt(0);
 
     auto narHash = Hash::dummy;
     try {
-        narHash = Hash::parseAnyPrefixed(useQueryPathInfo.getStr(1));
+        narHash = Hash::parseAnyPrefixed(use.getStr(1));
     } catch (BadHash & e) {
-        throw Error("invalid-path entry for '%s': %s", printStorePath(path), e.what());
+        throw Error("invalid-path entry for '%s': %s", store.printStorePath(path), e.what());
     }
 
     auto info = std::make_shared<ValidPathInfo>(path, narHash);
 
     info->id = id;
 
-    info->registrationTime = useQueryPathInfo.getInt(2);
+    info->registrationTime = use.getInt(2);
 
-    auto s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 3);
-    if (s) info->deriver = parseStorePath(s);
+    auto s = (const char *) sqlite3_column_text(stmt, 3);
+    if (s) info->deriver = store.parseTrustedStorePath(s);
 
     /* Note that narSize = NULL yields 0. */
-    info->narSize = useQueryPathInfo.getInt(4);
+    info->narSize = use.getInt(4);
 
-    info->ultimate = useQueryPathInfo.getInt(5) == 1;
+    info->ultimate = use.getInt(5) == 1;
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 6);
+    s = (const char *) sqlite3_column_text(stmt, 6);
     if (s) info->sigs = tokenizeString<StringSet>(s, " ");
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 7);
+    s = (const char *) sqlite3_column_text(stmt, 7);
     if (s) info->ca = parseContentAddressOpt(s);
 
+    return info;
+}
+
+
+std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State::Stmts & stmts, const StorePath & path)
+{
+    /* Get the path info. */
+    auto useQueryPathInfo(stmts.QueryPathInfo.use()(printStorePath(path)));
+
+    if (!useQueryPathInfo.next())
+        return std::shared_ptr<ValidPathInfo>();
+
+    auto info = readPathInfoRow(*this, stmts.QueryPathInfo, useQueryPathInfo, path);
+
     /* Get the references. */
-    auto useQueryReferences(state.stmts->QueryReferences.use()(info->id));
+    auto useQueryReferences(stmts.QueryReferences.use()(info->id));
 
     while (useQueryReferences.next())
-        info->references.insert(parseStorePath(useQueryReferences.getStr(0)));
+        info->references.insert(parseTrustedStorePath(useQueryReferences.getStr(0)));
 
     return info;
 }
 
 
+std::map<StorePath, ref<const ValidPathInfo>> LocalStore::queryPathInfosUncached(const StorePathSet & paths)
+{
+    auto snapshot = getSnapshot();
+    if (!snapshot) return queryPathInfosFromDatabase(paths);
+
+    std::map<StorePath, ref<const ValidPathInfo>> res;
+    StorePathSet remaining;
+
+    for (auto & path : paths) {
+        if (auto info = snapshot->queryPathInfo(path))
+            res.insert_or_assign(path, ref<const ValidPathInfo>(info));
+        else
+            remaining.insert(path);
+    }
+
+    if (!remaining.empty())
+        res.merge(queryPathInfosFromDatabase(remaining));
+
+    return res;
+}
+
+
+std::map<StorePath, ref<const ValidPathInfo>> LocalStore::queryPathInfosFromDatabase(const StorePathSet & paths)
+{
+    return retryRead<std::map<StorePath, ref<const ValidPathInfo>>>([&](State::Stmts & stmts) {
+        std::map<StorePath, ref<const ValidPathInfo>> res;
+
+        /* Look up the paths `pathInfoBatchSize' at a time. The
+           statements have a fixed number of parameters, so the last
+           batch is padded by repeating a path. */
+        auto i = paths.begin();
+        while (i != paths.end()) {
+            std::map<std::string, StorePath> batch;
+            for (; i != paths.end() && batch.size() < pathInfoBatchSize; ++i)
+                batch.emplace(printStorePath(*i), *i);
+
+            std::map<uint64_t, std::shared_ptr<ValidPathInfo>> byId;
+
+            {
+                auto use(stmts.QueryPathInfoBatch.use());
+                auto j = batch.begin();
+                for (size_t n = 0; n < pathInfoBatchSize; ++n) {
+                    use(j->first);
+                    if (std::next(j) != batch.end()) ++j;
+                }
+                while (use.next()) {
+                    auto j = batch.find(use.getStr(8));
+                    if (j == batch.end()) continue;
+                    auto info = readPathInfoRow(*this, stmts.QueryPathInfoBatch, use, j->second);
+                    byId.emplace(info->id, info);
+                }
+            }
+
+            if (byId.empty()) continue;
+
+            {
+                auto use(stmts.QueryReferencesBatch.use());
+                auto j = byId.begin();
+                for (size_t n = 0; n < pathInfoBatchSize; ++n) {
+                    use((int64_t) j->first);
+                    if (std::next(j) != byId.end()) ++j;
+                }
+                while (use.next()) {
+                    auto j = byId.find(use.getInt(0));
+                    if (j != byId.end())
+                        j->second->references.insert(parseTrustedStorePath(use.getStr(1)));
+                }
+            }
+
+            for (auto & [id, info] : byId)
+                res.insert_or_assign(info->path, ref<const ValidPathInfo>(info));
+        }
+
+        return res;
+    });
+}
+
+
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
+    dropSnapshot(info.path);
+
     state.stmts->UpdatePathInfo.use()
         (info.narSize, info.narSize != 0)
         (info.narHash.to_string(Base16, true))
@@ -812,17 +1093,19 @@ uint64_t LocalStore::queryValidPathId(State & state, const StorePath & path)
 }
 
 
-bool LocalStore::isValidPath_(State & state, const StorePath & path)
+bool LocalStore::isValidPath_(State::Stmts & stmts, const StorePath & path)
 {
-    return state.stmts->QueryPathInfo.use()(printStorePath(path)).next();
+    return stmts.QueryPathInfo.use()(printStorePath(path)).next();
 }
 
 
 bool LocalStore::isValidPathUncached(const StorePath & path)
 {
-    return retrySQLite<bool>([&]() {
-        auto state(_state.lock());
-        return isValidPath_(*state, path);
+    if (auto snapshot = getSnapshot())
+        if (snapshot->contains(path)) return true;
+
+    return retryRead<bool>([&](State::Stmts & stmts) {
+        return isValidPath_(stmts, path);
     });
 }
 
@@ -830,8 +1113,8 @@ bool LocalStore::isValidPathUncached(const StorePath & path)
 StorePathSet LocalStore::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
     StorePathSet res;
-    for (auto & i : paths)
-        if (isValidPath(i)) res.insert(i);
+    for (auto & i : queryPathInfos(paths))
+        res.insert(i.first);
     return res;
 }
 
@@ -842,26 +1125,192 @@ StorePathSet LocalStore::queryAllValidPaths()
         auto state(_state.lock());
         auto use(state->stmts->QueryValidPaths.use());
         StorePathSet res;
-        while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+        while (use.next()) res.insert(parseTrustedStorePath(use.getStr(0)));
         return res;
     });
 }
 
 
-void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
+LocalStore::State::ClosureIndex & LocalStore::getClosureIndex(State & state)
+{
+    if (!state.closureIndex)
+        state.closureIndex = std::make_unique<State::ClosureIndex>();
+    auto & index(*state.closureIndex);
+
+    int64_t dataVersion;
+    {
+        auto use(state.stmts->QueryDataVersion.use());
+        if (!use.next())
+            throw Error("cannot query the database version");
+        dataVersion = use.getInt(0);
+    }
+
+    if (index.valid && index.dataVersion == dataVersion)
+        return index;
+
+    debug("loading the closure index");
+
+    index = State::ClosureIndex();
+
+    std::unordered_map<int64_t, uint32_t> indexOfId;
+    {
+        SQLiteStmt stmt;
+        stmt.create(state.db, "select id, path from ValidPaths;");
+        auto use(stmt.use());
+        while (use.next())
+            indexOfId.emplace(use.getInt(0),
+                index.getIndex(parseTrustedStorePath(use.getStr(1))));
+    }
+
+    {
+        SQLiteStmt stmt;
+        stmt.create(state.db, "select referrer, reference from Refs;");
+        auto use(stmt.use());
+        while (use.next()) {
+            auto referrer = indexOfId.find(use.getInt(0));
+            auto reference = indexOfId.find(use.getInt(1));
+            if (referrer != indexOfId.end() && reference != indexOfId.end())
+                index.addRef(referrer->second, reference->second);
+        }
+    }
+
+    index.valid = true;
+    index.dataVersion = dataVersion;
+
+    return index;
+}
+
+
+void LocalStore::checkPathInfoCache()
+{
+    if (!checkExternalChanges) return;
+
+    /* Changes made through this LocalStore update the cache
+       directly, so we only have to worry about other processes. Since
+       that's rare, check at most once a second, and let other threads
+       use the cache while one of them is checking. */
+    std::unique_lock<std::mutex> lock(externalChangesLock, std::try_to_lock);
+    if (!lock) return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextExternalChangesCheck) return;
+    nextExternalChangesCheck = now + std::chrono::seconds(1);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        int64_t dataVersion;
+        {
+            auto use(state->stmts->QueryDataVersion.use());
+            if (!use.next())
+                throw Error("cannot query the database version");
+            dataVersion = use.getInt(0);
+        }
+
+        if (state->pathInfoCacheDataVersion && *state->pathInfoCacheDataVersion != dataVersion) {
+            debug("database was modified by another process, flushing the path info cache");
+            clearPathInfoCache();
+            stats.pathInfoCacheFlushes++;
+        }
+
+        state->pathInfoCacheDataVersion = dataVersion;
+    });
+}
+
+
+void LocalStore::computeFSClosure(const StorePathSet & startPaths,
+    StorePathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    if (!flipDirection && !includeOutputs && !includeDerivers)
+        if (auto snapshot = getSnapshot())
+            if (snapshot->computeClosure(startPaths, paths_))
+                return;
+
+    /* The index only covers references, so the other cases go
+       through the generic implementation. */
+    if (!closureIndex || includeOutputs || includeDerivers)
+        return Store::computeFSClosure(startPaths, paths_, flipDirection, includeOutputs, includeDerivers);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        auto & index(getClosureIndex(*state));
+        auto & edges(flipDirection ? index.referrers : index.refs);
+
+        std::vector<bool> seen(index.paths.size(), false);
+        std::vector<uint32_t> todo;
+
+        auto enqueue = [&](uint32_t n) {
+            if (seen[n]) return;
+            seen[n] = true;
+            if (paths_.insert(index.paths[n]).second)
+                todo.push_back(n);
+        };
+
+        for (auto & path : startPaths) {
+            auto n = index.paths.find(path);
+            if (!n)
+                throw InvalidPath("path '%s' is not valid", printStorePath(path));
+            enqueue(*n);
+        }
+
+        while (!todo.empty()) {
+            auto n = todo.back();
+            todo.pop_back();
+            for (auto m : edges[n])
+                enqueue(m);
+        }
+    });
+}
+
+
+void LocalStore::dropSnapshot(const StorePath & path)
+{
+    auto snapshot(this->snapshot.lock());
+    if (*snapshot && (*snapshot)->contains(path)) {
+        debug("no longer using metadata snapshot '%s' since '%s' has changed",
+            (*snapshot)->path, printStorePath(path));
+        *snapshot = nullptr;
+    }
+}
+
+
+void LocalStore::writeMetadataSnapshot(const Path & path)
+{
+    /* Paths registered after this are left out. Since a path's
+       references are registered no later than the path itself, the
+       remaining paths are closed under references. */
+    auto maxId = retrySQLite<uint64_t>([&]() {
+        auto state(_state.lock());
+        SQLiteStmt stmt;
+        stmt.create(state->db, "select max(id) from ValidPaths;");
+        auto use(stmt.use());
+        return use.next() && !use.isNull(0) ? use.getInt(0) : 0;
+    });
+
+    std::vector<ref<const ValidPathInfo>> infos;
+    for (auto & [_, info] : queryPathInfosFromDatabase(queryAllValidPaths()))
+        if (info->id <= maxId)
+            infos.push_back(info);
+
+    MetadataSnapshot::write(*this, infos, maxId, path);
+
+    printInfo("wrote a metadata snapshot of %d paths to '%s'", infos.size(), path);
+}
+
+
+void LocalStore::queryReferrers(State::Stmts & stmts, const StorePath & path, StorePathSet & referrers)
 {
-    auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
+    auto useQueryReferrers(stmts.QueryReferrers.use()(printStorePath(path)));
 
     while (useQueryReferrers.next())
-        referrers.insert(parseStorePath(useQueryReferrers.getStr(0)));
+        referrers.insert(parseTrustedStorePath(useQueryReferrers.getStr(0)));
 }
 
 
 void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
 {
-    return retrySQLite<void>([&]() {
-        auto state(_state.lock());
-        queryReferrers(*state, path, referrers);
+    return retryRead<void>([&](State::Stmts & stmts) {
+        queryReferrers(stmts, path, referrers);
     });
 }
 
@@ -875,13 +1324,70 @@ StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
 
         StorePathSet derivers;
         while (useQueryValidDerivers.next())
-            derivers.insert(parseStorePath(useQueryValidDerivers.getStr(1)));
+            derivers.insert(parseTrustedStorePath(useQueryValidDerivers.getStr(1)));
 
         return derivers;
     });
 }
 
 
+std::optional<std::map<StorePath, std::vector<ReferencePosition>>>
+LocalStore::queryReferencePositions(const StorePath & path)
+{
+    using Positions = std::map<StorePath, std::vector<ReferencePosition>>;
+
+    return retrySQLite<std::optional<Positions>>([&]() -> std::optional<Positions> {
+        auto state(_state.lock());
+
+        if (!state->stmts->QueryRefPositions.stmt) return std::nullopt;
+
+        auto use(state->stmts->QueryRefPositions.use()(printStorePath(path)));
+
+        std::optional<Positions> res;
+        while (use.next()) {
+            if (!res) res.emplace();
+            (*res)[parseTrustedStorePath(use.getStr(0))].push_back({
+                .file = use.getStr(1),
+                .symlink = use.getInt(2) != 0,
+                .offset = (uint64_t) use.getInt(3),
+                .excerpt = use.getStr(4),
+            });
+        }
+
+        return res;
+    });
+}
+
+
+void LocalStore::addReferencePositions(const StorePath & path,
+    const std::map<StorePath, std::vector<ReferencePosition>> & positions)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        if (!state->stmts->AddRefPosition.stmt) return;
+
+        SQLiteTxn txn(state->db);
+
+        auto referrer = queryValidPathId(*state, path);
+        state->stmts->DeleteRefPositions.use()(referrer).exec();
+
+        for (auto & [ref, poss] : positions)
+            for (auto & pos : poss)
+                state->stmts->AddRefPosition.use()
+                    (referrer)
+                    (printStorePath(ref))
+                    (pos.file)
+                    ((int64_t) pos.symlink)
+                    ((int64_t) pos.offset)
+                    (pos.excerpt)
+                    .exec();
+
+        txn.commit();
+    });
+}
+
+
 std::map<std::string, std::optional<StorePath>>
 LocalStore::queryPartialDerivationOutputMap(const StorePath & path_)
 {
@@ -894,7 +1400,7 @@ LocalStore::queryPartialDerivationOutputMap(const StorePath & path_)
         auto use(state->stmts->QueryDerivationOutputs.use()(drvId));
         while (use.next())
             outputs.insert_or_assign(
-                use.getStr(0), parseStorePath(use.getStr(1)));
+                use.getStr(0), parseTrustedStorePath(use.getStr(1)));
 
         return outputs;
     });
@@ -903,13 +1409,16 @@ LocalStore::queryPartialDerivationOutputMap(const StorePath & path_)
         return outputs;
 
     auto drv = readInvalidDerivation(path);
-    auto drvHashes = staticOutputHashes(*this, drv);
-    for (auto& [outputName, hash] : drvHashes) {
-        auto realisation = queryRealisation(DrvOutput{hash, outputName});
-        if (realisation)
-            outputs.insert_or_assign(outputName, realisation->outPath);
+    std::set<DrvOutput> ids;
+    for (auto & [outputName, hash] : staticOutputHashes(*this, drv))
+        ids.insert(DrvOutput{hash, outputName});
+    auto realisations = queryRealisations(ids);
+    for (auto & id : ids) {
+        auto realisation = realisations.find(id);
+        if (realisation != realisations.end())
+            outputs.insert_or_assign(id.outputName, realisation->second.outPath);
         else
-            outputs.insert({outputName, std::nullopt});
+            outputs.insert({id.outputName, std::nullopt});
     }
 
     return outputs;
@@ -930,7 +1439,7 @@ std::optional<StorePath> LocalStore::queryPathFromHashPart(const std::string & h
 
         const char * s = (const char *) sqlite3_column_text(state->stmts->QueryPathFromHashPart, 0);
         if (s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0)
-            return parseStorePath(s);
+            return parseTrustedStorePath(s);
         return {};
     });
 }
@@ -967,11 +1476,64 @@ StorePathSet LocalStore::querySubstitutablePaths(const StorePathSet & paths)
 }
 
 
+void LocalStore::prefetchSubstitutes(const StorePathSet & paths)
+{
+    if (!settings.useSubstitutes || paths.empty()) return;
+
+    {
+        auto state(_prefetchState.lock());
+        state->pending.insert(paths.begin(), paths.end());
+
+        if (!prefetchThread.joinable())
+            prefetchThread = std::thread([this]() {
+                while (true) {
+                    StorePathSet batch;
+                    {
+                        auto state(_prefetchState.lock());
+                        while (state->pending.empty() && !state->quit)
+                            state.wait(prefetchWakeup);
+                        if (state->pending.empty()) return;
+                        std::swap(batch, state->pending);
+                    }
+
+                    /* This fills the path info caches of the
+                       substituters (and the NAR info disk cache), where
+                       substitution goals will find it later. */
+                    try {
+                        auto valid = queryValidPaths(batch);
+                        StorePathCAMap query;
+                        for (auto & path : batch)
+                            if (!valid.count(path))
+                                query.emplace(path, std::nullopt);
+                        debug("prefetching substitute info of %d paths", query.size());
+                        SubstitutablePathInfos infos;
+                        querySubstitutablePathInfos(query, infos);
+                    } catch (std::exception & e) {
+                        debug("prefetching substitute info: %s", e.what());
+                    }
+                }
+            });
+    }
+
+    prefetchWakeup.notify_one();
+}
+
 void LocalStore::querySubstitutablePathInfos(const StorePathCAMap & paths, SubstitutablePathInfos & infos)
 {
     if (!settings.useSubstitutes) return;
+
+    /* Ask the substituters in order of priority, each with a single
+       queryPathInfos() call for the paths that the previous ones
+       don't have, so that binary caches can fetch the .narinfo files
+       in parallel. */
+    StorePathCAMap remaining(paths);
+
     for (auto & sub : getDefaultSubstituters()) {
-        for (auto & path : paths) {
+        if (remaining.empty()) break;
+
+        std::map<StorePath, StorePath> subPaths;
+
+        for (auto & path : remaining) {
             auto subPath(path.first);
 
             // recompute store path so that we can use a different store root
@@ -983,28 +1545,41 @@ void LocalStore::querySubstitutablePathInfos(const StorePathCAMap & paths, Subst
                     debug("replaced path '%s' with '%s' for substituter '%s'", printStorePath(path.first), sub->printStorePath(subPath), sub->getUri());
             } else if (sub->storeDir != storeDir) continue;
 
-            debug("checking substituter '%s' for path '%s'", sub->getUri(), sub->printStorePath(subPath));
-            try {
-                auto info = sub->queryPathInfo(subPath);
-
-                if (sub->storeDir != storeDir && !(info->isContentAddressed(*sub) && info->references.empty()))
-                    continue;
-
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos.insert_or_assign(path.first, SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize});
-            } catch (InvalidPath &) {
-            } catch (SubstituterDisabled &) {
-            } catch (Error & e) {
-                if (settings.tryFallback)
-                    logError(e.info());
-                else
-                    throw;
-            }
+            subPaths.insert_or_assign(subPath, path.first);
+        }
+
+        if (subPaths.empty()) continue;
+
+        debug("checking substituter '%s' for %d paths", sub->getUri(), subPaths.size());
+
+        std::map<StorePath, ref<const ValidPathInfo>> subInfos;
+        try {
+            StorePathSet query;
+            for (auto & i : subPaths) query.insert(i.first);
+            subInfos = sub->queryPathInfos(query);
+        } catch (SubstituterDisabled &) {
+            continue;
+        } catch (Error & e) {
+            if (settings.tryFallback) {
+                logError(e.info());
+                continue;
+            } else
+                throw;
+        }
+
+        for (auto & [subPath, info] : subInfos) {
+            if (sub->storeDir != storeDir && !(info->isContentAddressed(*sub) && info->references.empty()))
+                continue;
+
+            auto & path(subPaths.at(subPath));
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                std::shared_ptr<const ValidPathInfo>(info));
+            infos.insert_or_assign(path, SubstitutablePathInfo{
+                info->deriver,
+                info->references,
+                narInfo ? narInfo->fileSize : 0,
+                info->narSize});
+            remaining.erase(path);
         }
     }
 }
@@ -1016,7 +1591,49 @@ void LocalStore::registerValidPath(const ValidPathInfo & info)
 }
 
 
+struct LocalStore::PendingRegistration
+{
+    const ValidPathInfos & infos;
+    bool done = false;
+    std::exception_ptr ex;
+
+    PendingRegistration(const ValidPathInfos & infos) : infos(infos) { }
+};
+
+
 void LocalStore::registerValidPaths(const ValidPathInfos & infos)
+{
+    auto reg = std::make_shared<PendingRegistration>(infos);
+
+    /* Queue the registration. If another thread is committing, wait
+       until it's done; if it didn't pick up our registration, commit
+       it together with everything that was queued in the meantime. */
+    std::vector<std::shared_ptr<PendingRegistration>> batch;
+    {
+        auto regs(registrations.lock());
+        regs->pending.push_back(reg);
+        while (regs->committing && !reg->done)
+            regs.wait(registrationsDone);
+        if (!reg->done) {
+            std::swap(batch, regs->pending);
+            regs->committing = true;
+        }
+    }
+
+    if (!batch.empty()) {
+        commitRegistrations(batch);
+        auto regs(registrations.lock());
+        for (auto & r : batch)
+            r->done = true;
+        regs->committing = false;
+        registrationsDone.notify_all();
+    }
+
+    if (reg->ex) std::rethrow_exception(reg->ex);
+}
+
+
+void LocalStore::commitRegistrations(const std::vector<std::shared_ptr<PendingRegistration>> & batch)
 {
     /* SQLite will fsync by default, but the new valid paths may not
        be fsync-ed.  So some may want to fsync them before registering
@@ -1024,55 +1641,97 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
        registering operation. */
     if (settings.syncBeforeRegistering) sync();
 
-    return retrySQLite<void>([&]() {
-        auto state(_state.lock());
+    auto commit = [&](const std::vector<std::shared_ptr<PendingRegistration>> & regs) {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
 
-        SQLiteTxn txn(state->db);
-        StorePathSet paths;
+            SQLiteTxn txn(state->db);
 
-        for (auto & [_, i] : infos) {
-            assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
-                updatePathInfo(*state, i);
-            else
-                addValidPath(*state, i, false);
-            paths.insert(i.path);
-        }
+            for (auto & r : regs)
+                registerValidPaths_(*state, r->infos);
 
-        for (auto & [_, i] : infos) {
-            auto referrer = queryValidPathId(*state, i.path);
-            for (auto & j : i.references)
-                state->stmts->AddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
-        }
+            txn.commit();
 
-        /* Check that the derivation outputs are correct.  We can't do
-           this in addValidPath() above, because the references might
-           not be valid yet. */
-        for (auto & [_, i] : infos)
-            if (i.path.isDerivation()) {
-                // FIXME: inefficient; we already loaded the derivation in addValidPath().
-                checkDerivationOutputs(i.path,
-                    readInvalidDerivation(i.path));
+            /* Our own commits don't change the data version seen on
+               this connection, so update the closure index
+               explicitly. */
+            if (state->closureIndex && state->closureIndex->valid) {
+                auto & index(*state->closureIndex);
+                for (auto & r : regs)
+                    for (auto & [_, i] : r->infos) {
+                        auto referrer = index.getIndex(i.path);
+                        for (auto & j : i.references)
+                            index.addRef(referrer, index.getIndex(j));
+                    }
             }
+        });
+    };
 
-        /* Do a topological sort of the paths.  This will throw an
-           error if a cycle is detected and roll back the
-           transaction.  Cycles can only occur when a derivation
-           has multiple outputs. */
-        topoSort(paths,
-            {[&](const StorePath & path) {
-                auto i = infos.find(path);
-                return i == infos.end() ? StorePathSet() : i->second.references;
-            }},
-            {[&](const StorePath & path, const StorePath & parent) {
-                return BuildError(
-                    "cycle detected in the references of '%s' from '%s'",
-                    printStorePath(path),
-                    printStorePath(parent));
-            }});
+    try {
+        commit(batch);
+    } catch (...) {
+        /* One of the registrations failed (e.g. because of a
+           reference cycle), rolling back the whole batch. Commit
+           them one by one so that only the failing ones get an
+           error. */
+        if (batch.size() == 1)
+            batch[0]->ex = std::current_exception();
+        else
+            for (auto & r : batch) {
+                try {
+                    commit({r});
+                } catch (...) {
+                    r->ex = std::current_exception();
+                }
+            }
+    }
+}
 
-        txn.commit();
-    });
+
+void LocalStore::registerValidPaths_(State & state, const ValidPathInfos & infos)
+{
+    StorePathSet paths;
+
+    for (auto & [_, i] : infos) {
+        assert(i.narHash.type == htSHA256);
+        if (isValidPath_(*state.stmts, i.path))
+            updatePathInfo(state, i);
+        else
+            addValidPath(state, i, false);
+        paths.insert(i.path);
+    }
+
+    for (auto & [_, i] : infos) {
+        auto referrer = queryValidPathId(state, i.path);
+        for (auto & j : i.references)
+            state.stmts->AddReference.use()(referrer)(queryValidPathId(state, j)).exec();
+    }
+
+    /* Check that the derivation outputs are correct.  We can't do
+       this in addValidPath() above, because the references might
+       not be valid yet. */
+    for (auto & [_, i] : infos)
+        if (i.path.isDerivation()) {
+            // FIXME: inefficient; we already loaded the derivation in addValidPath().
+            checkDerivationOutputs(i.path,
+                readInvalidDerivation(i.path));
+        }
+
+    /* Do a topological sort of the paths.  This will throw an
+       error if a cycle is detected and roll back the
+       transaction.  Cycles can only occur when a derivation
+       has multiple outputs. */
+    topoSort(paths,
+        {[&](const StorePath & path) {
+            auto i = infos.find(path);
+            return i == infos.end() ? StorePathSet() : i->second.references;
+        }},
+        {[&](const StorePath & path, const StorePath & parent) {
+            return BuildError(
+                "cycle detected in the references of '%s' from '%s'",
+                printStorePath(path),
+                printStorePath(parent));
+        }});
 }
 
 
@@ -1087,10 +1746,13 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.hashPart()));
-    }
+    /* Invalidation usually happens in bulk (during garbage
+       collection), so just reload the closure index on next use. */
+    if (state.closureIndex) state.closureIndex->valid = false;
+
+    pathInfoCache.erase(std::string(path.hashPart()));
+
+    dropSnapshot(path);
 }
 
 const PublicKeys & LocalStore::getPublicKeys()
@@ -1108,66 +1770,165 @@ bool LocalStore::pathInfoIsTrusted(const ValidPathInfo & info)
 
 void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
     RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    PathLocks outputLock;
+
+    if (addToStoreUnregistered(info, source, repair, checkSigs, outputLock))
+        registerValidPath(info);
+
+    outputLock.setDeletion(true);
+}
+
+
+bool LocalStore::addToStoreUnregistered(const ValidPathInfo & info, Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs, PathLocks & outputLock)
 {
     if (checkSigs && pathInfoIsTrusted(info))
         throw Error("cannot add path '%s' because it lacks a valid signature", printStorePath(info.path));
 
     addTempRoot(info.path);
 
-    if (repair || !isValidPath(info.path)) {
+    if (!repair && isValidPath(info.path)) return false;
 
-        PathLocks outputLock;
+    auto realPath = Store::toRealPath(info.path);
 
-        auto realPath = Store::toRealPath(info.path);
+    /* Lock the output path.  But don't lock if we're being called
+       from a build hook (whose parent process already acquired a
+       lock on this path). */
+    if (!locksHeld.count(printStorePath(info.path)))
+        outputLock.lockPaths({realPath});
 
-        /* Lock the output path.  But don't lock if we're being called
-           from a build hook (whose parent process already acquired a
-           lock on this path). */
-        if (!locksHeld.count(printStorePath(info.path)))
-            outputLock.lockPaths({realPath});
+    if (!repair && isValidPath(info.path)) return false;
 
-        if (repair || !isValidPath(info.path)) {
+    deletePath(realPath);
 
-            deletePath(realPath);
+    // text hashing has long been allowed to have non-self-references because it is used for drv files.
+    bool refersToSelf = info.references.count(info.path) > 0;
+    if (info.ca.has_value() && !info.references.empty() && !(std::holds_alternative<TextHash>(*info.ca) && !refersToSelf))
+        settings.requireExperimentalFeature("ca-references");
 
-            // text hashing has long been allowed to have non-self-references because it is used for drv files.
-            bool refersToSelf = info.references.count(info.path) > 0;
-            if (info.ca.has_value() && !info.references.empty() && !(std::holds_alternative<TextHash>(*info.ca) && !refersToSelf))
-                settings.requireExperimentalFeature("ca-references");
+    /* While restoring the path from the NAR, compute the hash
+       of the NAR. */
+    std::unique_ptr<AbstractHashSink> hashSink;
+    if (!info.ca.has_value() || !info.references.count(info.path))
+        hashSink = std::make_unique<HashSink>(htSHA256);
+    else
+        hashSink = std::make_unique<HashModuloSink>(htSHA256, std::string(info.path.hashPart()));
 
-            /* While restoring the path from the NAR, compute the hash
-               of the NAR. */
-            std::unique_ptr<AbstractHashSink> hashSink;
-            if (!info.ca.has_value() || !info.references.count(info.path))
-                hashSink = std::make_unique<HashSink>(htSHA256);
-            else
-                hashSink = std::make_unique<HashModuloSink>(htSHA256, std::string(info.path.hashPart()));
+    /* Hash in a separate thread, in parallel with writing
+       to disk. */
+    BackgroundSink hasher { *hashSink };
 
-            TeeSource wrapperSource { source, *hashSink };
+    TeeSource wrapperSource { source, hasher };
 
-            restorePath(realPath, wrapperSource);
+    restorePath(realPath, wrapperSource);
 
-            auto hashResult = hashSink->finish();
+    hasher.finish();
 
-            if (hashResult.first != info.narHash)
-                throw Error("hash mismatch importing path '%s';\n  specified: %s\n  got:       %s",
-                    printStorePath(info.path), info.narHash.to_string(Base32, true), hashResult.first.to_string(Base32, true));
+    auto hashResult = hashSink->finish();
 
-            if (hashResult.second != info.narSize)
-                throw Error("size mismatch importing path '%s';\n  specified: %s\n  got:       %s",
-                    printStorePath(info.path), info.narSize, hashResult.second);
+    if (hashResult.first != info.narHash)
+        throw Error("hash mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+            printStorePath(info.path), info.narHash.to_string(Base32, true), hashResult.first.to_string(Base32, true));
 
-            autoGC();
+    if (hashResult.second != info.narSize)
+        throw Error("size mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+            printStorePath(info.path), info.narSize, hashResult.second);
 
-            canonicalisePathMetaData(realPath, -1);
+    autoGC();
 
-            optimisePath(realPath); // FIXME: combine with hashPath()
+    canonicalisePathMetaData(realPath, -1);
 
-            registerValidPath(info);
+    optimisePath(realPath); // FIXME: combine with hashPath()
+
+    return true;
+}
+
+
+void LocalStore::addMultipleToStore(PathsSource & pathsToCopy, Activity & act,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    /* Since 'pathsToCopy' is in topological order and the paths of a
+       batch are registered together, the paths within a batch can be
+       extracted in any order. */
+    std::atomic<size_t> nrDone{0};
+    std::atomic<uint64_t> nrRunning{0};
+
+    auto showProgress = [&]() {
+        act.progress(nrDone, pathsToCopy.size(), nrRunning, 0);
+    };
+
+    for (size_t begin = 0; begin < pathsToCopy.size(); begin += maxImportBatchSize) {
+        auto end = std::min(begin + maxImportBatchSize, pathsToCopy.size());
+
+        std::vector<PathLocks> locks(end - begin);
+        Sync<ValidPathInfos> infos_;
+
+        ThreadPool pool(std::max(1U, settings.copyJobs.get()));
+
+        for (size_t n = begin; n < end; ++n)
+            pool.enqueue([&, n]() {
+                checkInterrupt();
+
+                auto & [info, narWriter] = pathsToCopy[n];
+
+                {
+                    MaintainCount<decltype(nrRunning)> mc(nrRunning);
+                    showProgress();
+                    auto source = sinkToSource(narWriter);
+                    if (addToStoreUnregistered(info, *source, repair, checkSigs, locks[n - begin]))
+                        infos_.lock()->insert_or_assign(info.path, info);
+                }
+
+                nrDone++;
+                showProgress();
+            });
+
+        pool.process();
+
+        registerValidPaths(*infos_.lock());
+
+        for (auto & lock : locks)
+            lock.setDeletion(true);
+    }
+}
+
+
+void LocalStore::addMultipleToStore(Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    /* Registering each path in its own transaction (with its own
+       fsync) dominates the cost of importing many small paths. */
+    ValidPathInfos infos;
+    std::list<PathLocks> locks;
+
+    auto flush = [&]() {
+        registerValidPaths(infos);
+        for (auto & lock : locks)
+            lock.setDeletion(true);
+        infos.clear();
+        locks.clear();
+    };
+
+    auto count = readNum<uint64_t>(source);
+
+    for (uint64_t n = 0; n < count; ++n) {
+        auto info = worker_proto::read(*this, source, Phantom<ValidPathInfo> {});
+        info.ultimate = false;
+
+        auto & lock = locks.emplace_back();
+        if (addToStoreUnregistered(info, source, repair, checkSigs, lock)) {
+            auto path = info.path;
+            infos.insert_or_assign(path, std::move(info));
+        } else {
+            ParseSink ether;
+            parseDump(ether, source);
         }
 
-        outputLock.setDeletion(true);
+        if (locks.size() >= maxImportBatchSize) flush();
     }
+
+    flush();
 }
 
 
@@ -1353,8 +2114,8 @@ void LocalStore::invalidatePathChecked(const StorePath & path)
 
         SQLiteTxn txn(state->db);
 
-        if (isValidPath_(*state, path)) {
-            StorePathSet referrers; queryReferrers(*state, path, referrers);
+        if (isValidPath_(*state->stmts, path)) {
+            StorePathSet referrers; queryReferrers(*state->stmts, path, referrers);
             referrers.erase(path); /* ignore self-references */
             if (!referrers.empty())
                 throw PathInUse("cannot delete path '%s' because it is in use by %s",
@@ -1394,15 +2155,32 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     /* Optionally, check the content hashes (slow). */
     if (checkContents) {
 
+        /* The contents are hashed on all cores. Repairs are done
+           afterwards on this thread. */
+        std::atomic<bool> hashErrors{false};
+
         printInfo("checking link hashes...");
 
-        for (auto & link : readDirectory(linksDir)) {
-            printMsg(lvlTalkative, "checking contents of '%s'", link.name);
-            Path linkPath = linksDir + "/" + link.name;
-            string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
-            if (hash != link.name) {
-                printError("link '%s' was modified! expected hash '%s', got '%s'",
-                    linkPath, link.name, hash);
+        {
+            ThreadPool pool;
+            Sync<Paths> corruptLinks;
+
+            for (auto & link : readDirectory(linksDir))
+                pool.enqueue([&, name(link.name)]() {
+                    checkInterrupt();
+                    printMsg(lvlTalkative, "checking contents of '%s'", name);
+                    Path linkPath = linksDir + "/" + name;
+                    string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
+                    if (hash != name) {
+                        printError("link '%s' was modified! expected hash '%s', got '%s'",
+                            linkPath, name, hash);
+                        corruptLinks.lock()->push_back(linkPath);
+                    }
+                });
+
+            pool.process();
+
+            for (auto & linkPath : *corruptLinks.lock()) {
                 if (repair) {
                     if (unlink(linkPath.c_str()) == 0)
                         printInfo("removed link '%s'", linkPath);
@@ -1418,12 +2196,15 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 
         Hash nullHash(htSHA256);
 
-        for (auto & i : validPaths) {
+        ThreadPool pool;
+        Sync<StorePathSet> corruptPaths;
+
+        auto checkPath = [&](std::shared_ptr<ValidPathInfo> info) {
             try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
+                checkInterrupt();
 
                 /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(info->path));
 
                 std::unique_ptr<AbstractHashSink> hashSink;
                 if (!info->ca || !info->references.count(info->path))
@@ -1431,27 +2212,27 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                 else
                     hashSink = std::make_unique<HashModuloSink>(info->narHash.type, std::string(info->path.hashPart()));
 
-                dumpPath(Store::toRealPath(i), *hashSink);
+                dumpPath(Store::toRealPath(info->path), *hashSink);
                 auto current = hashSink->finish();
 
                 if (info->narHash != nullHash && info->narHash != current.first) {
                     printError("path '%s' was modified! expected hash '%s', got '%s'",
-                        printStorePath(i), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true));
-                    if (repair) repairPath(i); else errors = true;
+                        printStorePath(info->path), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true));
+                    corruptPaths.lock()->insert(info->path);
                 } else {
 
                     bool update = false;
 
                     /* Fill in missing hashes. */
                     if (info->narHash == nullHash) {
-                        printInfo("fixing missing hash on '%s'", printStorePath(i));
+                        printInfo("fixing missing hash on '%s'", printStorePath(info->path));
                         info->narHash = current.first;
                         update = true;
                     }
 
                     /* Fill in missing narSize fields (from old stores). */
                     if (info->narSize == 0) {
-                        printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
+                        printInfo("updating size field on '%s' to %s", printStorePath(info->path), current.second);
                         info->narSize = current.second;
                         update = true;
                     }
@@ -1466,6 +2247,23 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
             } catch (Error & e) {
                 /* It's possible that the path got GC'ed, so ignore
                    errors on invalid paths. */
+                if (isValidPath(info->path))
+                    logError(e.info());
+                else
+                    warn(e.msg());
+                hashErrors = true;
+            }
+        };
+
+        for (auto & i : validPaths) {
+            try {
+                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
+                /* Start with the biggest paths, so that the last few
+                   don't keep one thread busy while the others are
+                   idle. */
+                pool.enqueue(std::bind(checkPath, info),
+                    (int) std::min(info->narSize >> 20, (uint64_t) std::numeric_limits<int>::max()));
+            } catch (Error & e) {
                 if (isValidPath(i))
                     logError(e.info());
                 else
@@ -1473,6 +2271,16 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                 errors = true;
             }
         }
+
+        pool.process();
+
+        if (hashErrors) errors = true;
+
+        auto corrupt(*corruptPaths.lock());
+        if (repair)
+            repairPaths(corrupt);
+        else if (!corrupt.empty())
+            errors = true;
     }
 
     return errors;
@@ -1600,7 +2408,7 @@ void LocalStore::addSignatures(const StorePath & storePath, const StringSet & si
 
         SQLiteTxn txn(state->db);
 
-        auto info = std::const_pointer_cast<ValidPathInfo>(queryPathInfoInternal(*state, storePath));
+        auto info = std::const_pointer_cast<ValidPathInfo>(queryPathInfoInternal(*state->stmts, storePath));
 
         info->sigs.insert(sigs.begin(), sigs.end());
 
@@ -1647,9 +2455,24 @@ std::optional<const Realisation> LocalStore::queryRealisation(
             id.outputName));
         if (!use.next())
             return std::nullopt;
-        auto outputPath = parseStorePath(use.getStr(0));
+        auto outputPath = parseTrustedStorePath(use.getStr(0));
         return Ret{
             Realisation{.id = id, .outPath = outputPath}};
     });
 }
+
+std::map<DrvOutput, Realisation> LocalStore::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    typedef std::map<DrvOutput, Realisation> Ret;
+    return retrySQLite<Ret>([&]() {
+        auto state(_state.lock());
+        Ret res;
+        for (auto & id : ids) {
+            auto use(state->stmts->QueryRealisedOutput.use()(id.strHash())(id.outputName));
+            if (use.next())
+                res.insert_or_assign(id, Realisation{.id = id, .outPath = parseTrustedStorePath(use.getStr(0))});
+        }
+        return res;
+    });
+}
 }  // namespace nix
@@ -6,11 +6,13 @@
 #include "store-api.hh"
 #include "local-fs-store.hh"
 #include "sync.hh"
+#include "pool.hh"
 #include "util.hh"
 
 #include <chrono>
 #include <future>
 #include <string>
+#include <thread>
 #include <unordered_set>
 
 
@@ -24,6 +26,9 @@ namespace nix {
 const int nixSchemaVersion = 10;
 
 
+class MetadataSnapshot;
+
+
 struct OptimiseStats
 {
     unsigned long filesLinked = 0;
@@ -39,6 +44,21 @@ struct LocalStoreConfig : virtual LocalFSStoreConfig
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    Setting<unsigned int> readConnections{(StoreConfig*) this, 4, "read-connections",
+        "maximum number of additional database connections used for "
+        "concurrent read-only queries (requires WAL mode; 0 to disable)"};
+
+    Setting<bool> closureIndex{(StoreConfig*) this, false, "closure-index",
+        "whether to answer closure queries from an in-memory copy of the reference graph"};
+
+    Setting<bool> checkExternalChanges{(StoreConfig*) this, false, "check-external-changes",
+        "whether to flush the path info cache when other processes modify the database "
+        "(checked at most once a second)"};
+
+    Setting<Path> metadataSnapshot{(StoreConfig*) this, "", "metadata-snapshot",
+        "path of a snapshot of the database (see 'nix store write-metadata-snapshot') "
+        "that is consulted before the database"};
+
     const std::string name() override { return "Local Store"; }
 };
 
@@ -61,6 +81,9 @@ private:
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
 
+        /* The hash parts of the paths written to `fdTempRoots'. */
+        std::unordered_set<std::string> tempRoots;
+
         /* The last time we checked whether to do an auto-GC, or an
            auto-GC finished. */
         std::chrono::time_point<std::chrono::steady_clock> lastGCCheck;
@@ -77,10 +100,83 @@ private:
         uint64_t availAfterGC = std::numeric_limits<uint64_t>::max();
 
         std::unique_ptr<PublicKeys> publicKeys;
+
+        /* The in-memory reference graph used by computeFSClosure()
+           if `closure-index' is enabled. Loaded on first use. */
+        struct ClosureIndex;
+        std::unique_ptr<ClosureIndex> closureIndex;
+
+        /* The value of `pragma data_version' when the path info cache
+           was last checked by checkPathInfoCache(). */
+        std::optional<int64_t> pathInfoCacheDataVersion;
     };
 
     Sync<State> _state;
 
+    /* The paths queued by prefetchSubstitutes() for the thread that
+       queries the substituters for them. */
+    struct PrefetchState
+    {
+        StorePathSet pending;
+        bool quit = false;
+    };
+
+    Sync<PrefetchState> _prefetchState;
+    std::condition_variable prefetchWakeup;
+    std::thread prefetchThread;
+
+    /* A pool of read-only connections to the database. Queries that
+       don't need to see uncommitted writes (like
+       queryPathInfoUncached()) use these rather than the connection
+       in `_state', so that concurrent readers don't have to wait for
+       each other or for a writer. Null if WAL mode is disabled. */
+    struct ReadConnection;
+    std::unique_ptr<Pool<ReadConnection>> readPool;
+
+    /* The number of paths looked up per query by
+       queryPathInfosUncached(). */
+    static constexpr size_t pathInfoBatchSize = 100;
+
+    /* Run `fun' with the statements of a connection suitable for
+       read-only queries, retrying on SQLITE_BUSY. */
+    template<typename T>
+    T retryRead(std::function<T(State::Stmts &)> fun);
+
+    /* Serialises checkPathInfoCache(), and the time before which it
+       doesn't need to look at the database again. */
+    std::mutex externalChangesLock;
+    std::chrono::time_point<std::chrono::steady_clock> nextExternalChangesCheck;
+
+    /* Calls to registerValidPaths() waiting to be committed. While
+       one thread is committing, the registrations of other threads
+       are queued, and then committed together in a single
+       transaction by the first of them to get its turn. */
+    struct PendingRegistration;
+
+    struct Registrations
+    {
+        std::vector<std::shared_ptr<PendingRegistration>> pending;
+        bool committing = false;
+    };
+
+    Sync<Registrations> registrations;
+    std::condition_variable registrationsDone;
+
+    /* The snapshot consulted before the database, if
+       `metadata-snapshot' is set and none of the snapshot's paths
+       had been deleted when it was opened. Dropped when this process
+       invalidates or modifies one of the snapshot's paths. */
+    Sync<std::shared_ptr<const MetadataSnapshot>> snapshot;
+
+    std::shared_ptr<const MetadataSnapshot> getSnapshot()
+    {
+        return *snapshot.lock();
+    }
+
+    void dropSnapshot(const StorePath & path);
+
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfosFromDatabase(const StorePathSet & paths);
+
 public:
 
     PathSetting realStoreDir_;
@@ -123,10 +219,15 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfosUncached(const StorePathSet & paths) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
 
+    std::optional<std::map<StorePath, std::vector<ReferencePosition>>>
+    queryReferencePositions(const StorePath & path) override;
+
     std::map<std::string, std::optional<StorePath>> queryPartialDerivationOutputMap(const StorePath & path) override;
 
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override;
@@ -136,11 +237,27 @@ public:
     void querySubstitutablePathInfos(const StorePathCAMap & paths,
         SubstitutablePathInfos & infos) override;
 
+    void prefetchSubstitutes(const StorePathSet & paths) override;
+
     bool pathInfoIsTrusted(const ValidPathInfo &) override;
 
     void addToStore(const ValidPathInfo & info, Source & source,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    /* Unlike the default implementations, these register the paths
+       in batches, each in a single database transaction. Every path
+       stays locked until it's registered, so the size of a batch is
+       bounded. */
+    static constexpr size_t maxImportBatchSize = 128;
+
+    /* The NARs are extracted directly into the store on 'copy-jobs'
+       threads, without waiting for the references of a path. */
+    void addMultipleToStore(PathsSource & pathsToCopy, Activity & act,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
+    void addMultipleToStore(Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
     StorePath addToStoreFromDump(Source & dump, const string & name,
         FileIngestionMethod method, HashType hashAlgo, RepairFlag repair) override;
 
@@ -149,6 +266,35 @@ public:
 
     void addTempRoot(const StorePath & path) override;
 
+    void addTempRoots(const StorePathSet & paths) override;
+
+    /* While this object exists, the temporary roots registered by the
+       calling thread are written to a file of their own, which is
+       removed when it is destroyed, rather than lasting until the
+       process exits. This lets a process that serves many clients
+       from one store (the threaded daemon) release the roots of each
+       client when it disconnects. Roots registered by other threads
+       (e.g. thread pools working on behalf of the calling thread)
+       still go to the per-process file. */
+    class TempRootsScope
+    {
+        friend class LocalStore;
+
+        LocalStore & store;
+        Path fnTempRoots;
+        AutoCloseFD fdTempRoots;
+        std::unordered_set<std::string> tempRoots;
+        TempRootsScope * prev;
+
+    public:
+
+        TempRootsScope(LocalStore & store);
+        ~TempRootsScope();
+
+        TempRootsScope(const TempRootsScope &) = delete;
+        TempRootsScope & operator = (const TempRootsScope &) = delete;
+    };
+
     void addIndirectRoot(const Path & path) override;
 
     void syncWithGC() override;
@@ -158,6 +304,11 @@ private:
     typedef std::shared_ptr<AutoCloseFD> FDPtr;
     typedef list<FDPtr> FDs;
 
+    /* Write the paths that are not in `written' to the temporary
+       roots file `fn', creating it if `fd' is not open yet. */
+    void writeTempRoots(const Path & fn, AutoCloseFD & fd,
+        std::unordered_set<std::string> & written, const StorePathSet & paths);
+
     void findTempRoots(FDs & fds, Roots & roots, bool censor);
 
 public:
@@ -187,12 +338,20 @@ public:
 
     void registerValidPaths(const ValidPathInfos & infos);
 
+    /* Record where the references of the valid path `path' occur in
+       its contents, replacing any previously recorded positions. This
+       does nothing unless `index-reference-positions' is enabled. */
+    void addReferencePositions(const StorePath & path,
+        const std::map<StorePath, std::vector<ReferencePosition>> & positions);
+
     unsigned int getProtocol() override;
 
     void vacuumDB();
 
     void repairPath(const StorePath & path) override;
 
+    void repairPaths(const StorePathSet & paths) override;
+
     void addSignatures(const StorePath & storePath, const StringSet & sigs) override;
 
     /* If free disk space in /nix/store if below minFree, delete
@@ -206,10 +365,35 @@ public:
 
     std::optional<const Realisation> queryRealisation(const DrvOutput&) override;
 
+    std::map<DrvOutput, Realisation> queryRealisations(const std::set<DrvOutput> & ids) override;
+
+    using Store::computeFSClosure;
+
+    void checkPathInfoCache() override;
+
+    void computeFSClosure(const StorePathSet & paths,
+        StorePathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
+    /* Write a snapshot of the valid paths in the database to 'path',
+       for use with the `metadata-snapshot' setting. */
+    void writeMetadataSnapshot(const Path & path);
+
 private:
 
     int getSchema();
 
+    /* Return the closure index, (re)loading it from the database if
+       necessary. */
+    State::ClosureIndex & getClosureIndex(State & state);
+
+    /* The part of addToStore() that unpacks and checks the path,
+       with 'outputLock' holding the lock on the path. Returns false
+       (without reading 'source') if the path was already valid.
+       Otherwise the caller must register the path. */
+    bool addToStoreUnregistered(const ValidPathInfo & info, Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs, PathLocks & outputLock);
+
     void openDB(State & state, bool create);
 
     void makeStoreWritable();
@@ -218,6 +402,14 @@ private:
 
     uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
+    /* Commit a batch of registrations queued by registerValidPaths(),
+       setting the exception of each registration that failed. */
+    void commitRegistrations(const std::vector<std::shared_ptr<PendingRegistration>> & batch);
+
+    /* Register the paths in `infos' as part of the current
+       transaction. */
+    void registerValidPaths_(State & state, const ValidPathInfos & infos);
+
     void invalidatePath(State & state, const StorePath & path);
 
     /* Delete a path from the Nix store. */
@@ -226,7 +418,7 @@ private:
     void verifyPath(const Path & path, const StringSet & store,
         PathSet & done, StorePathSet & validPaths, RepairFlag repair, bool & errors);
 
-    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(State & state, const StorePath & path);
+    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(State::Stmts & stmts, const StorePath & path);
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
@@ -256,7 +448,17 @@ private:
 
     void findRuntimeRoots(Roots & roots, bool censor);
 
-    void removeUnusedLinks(const GCState & state);
+    void removeUnusedLinks(GCState & state);
+
+    void collectGarbageGraph(GCState & state);
+
+    std::optional<StorePathSet> findIncrementalGCCandidates(GCState & state);
+
+    void collectGarbageIncremental(GCState & state);
+
+    void recordGCState(GCState & state, int64_t maxId);
+
+    void deleteTrash(GCState & state);
 
     Path createTempDirInStore();
 
@@ -265,12 +467,12 @@ private:
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
+    Strings readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, Sync<InodeHash> & inodeHash);
 
     // Internal versions that are not wrapped in retry_sqlite.
-    bool isValidPath_(State & state, const StorePath & path);
-    void queryReferrers(State & state, const StorePath & path, StorePathSet & referrers);
+    bool isValidPath_(State::Stmts & stmts, const StorePath & path);
+    void queryReferrers(State::Stmts & stmts, const StorePath & path, StorePathSet & referrers);
 
     /* Add signatures to a ValidPathInfo using the secret keys
        specified by the ‘secret-key-files’ option. */
@@ -39,6 +39,7 @@ bool UserLock::findFreeUser() {
 
     /* Find a user account that isn't currently in use for another
        build. */
+    lockFilesToWaitFor.clear();
     for (auto & i : users) {
         debug("trying user '%1%'", i);
 
@@ -80,6 +81,8 @@ bool UserLock::findFreeUser() {
             isEnabled = true;
             return true;
         }
+
+        lockFilesToWaitFor.push_back(fnUserLock);
     }
 
     return false;
@@ -90,4 +93,80 @@ void UserLock::kill()
     killUser(uid);
 }
 
+static thread_local std::optional<std::string> buildSlotUser;
+
+void setBuildSlotUser(const std::string & user)
+{
+    buildSlotUser = user;
+}
+
+BuildSlot::BuildSlot()
+{
+    assert(settings.buildSlots);
+    createDirs(settings.nixStateDir + "/build-slots");
+}
+
+/* Lock one of the first `n' files with the given prefix. If they're
+   all taken, return their names in `taken'. */
+static AutoCloseFD lockSlot(const Path & prefix, unsigned int n, Paths & taken)
+{
+    taken.clear();
+    for (unsigned int i = 0; i < n; ++i) {
+        auto fnSlot = fmt("%s%d", prefix, i);
+        AutoCloseFD fd = open(fnSlot.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (!fd)
+            throw SysError("opening build slot lock '%1%'", fnSlot);
+        if (lockFile(fd.get(), ltWrite, false))
+            return fd;
+        taken.push_back(fnSlot);
+    }
+    return {};
+}
+
+bool BuildSlot::acquire()
+{
+    if (fdSlot) return true;
+
+    auto user = buildSlotUser ? *buildSlotUser : getUserName();
+
+    /* Find the user's quota. */
+    unsigned int quota = settings.buildSlots;
+    std::optional<unsigned int> defaultQuota;
+    bool found = false;
+    for (auto & entry : settings.userBuildSlots.get()) {
+        auto eq = entry.find('=');
+        auto n = eq == std::string::npos ? std::nullopt : string2Int<unsigned int>(entry.substr(eq + 1));
+        if (!n)
+            throw Error("invalid entry '%s' in 'user-build-slots'", entry);
+        /* A quota of 0 would make the user's builds wait forever. */
+        if (*n == 0)
+            throw Error("invalid entry '%s' in 'user-build-slots': the number of slots must be at least 1", entry);
+        auto name = entry.substr(0, eq);
+        if (name == user) {
+            quota = *n;
+            found = true;
+        } else if (name == "*")
+            defaultQuota = *n;
+    }
+    if (!found && defaultQuota)
+        quota = *defaultQuota;
+
+    auto dir = settings.nixStateDir + "/build-slots/";
+
+    if (!fdUserSlot) {
+        fdUserSlot = lockSlot(dir + "user-" + user + "-", std::min(quota, settings.buildSlots.get()), lockFilesToWaitFor);
+        if (!fdUserSlot) return false;
+    }
+
+    fdSlot = lockSlot(dir + "slot-", settings.buildSlots, lockFilesToWaitFor);
+    if (!fdSlot) {
+        /* Builds that are waiting for a slot shouldn't count
+           against the user's quota. */
+        fdUserSlot = -1;
+        return false;
+    }
+
+    return true;
+}
+
 }
@@ -17,6 +17,7 @@ private:
     uid_t uid = 0;
     gid_t gid = 0;
     std::vector<gid_t> supplementaryGIDs;
+    Paths lockFilesToWaitFor;
 
 public:
     UserLock();
@@ -30,8 +31,40 @@ public:
 
     bool findFreeUser();
 
+    /* The lock files of the build users that were in use when
+       findFreeUser() last failed. */
+    Paths getLockFilesToWaitFor() { return lockFilesToWaitFor; }
+
     bool enabled() { return isEnabled; }
 
 };
 
+/* A slot in the machine-wide pool of build slots (see the
+   `build-slots` setting), which is shared by all processes using the
+   store through lock files. A user can only hold as many slots as
+   allowed by `user-build-slots`. */
+class BuildSlot
+{
+private:
+    AutoCloseFD fdUserSlot;
+    AutoCloseFD fdSlot;
+    Paths lockFilesToWaitFor;
+
+public:
+    BuildSlot();
+
+    /* Try to acquire a slot for the current build slot user. Returns
+       false if no slot is available. */
+    bool acquire();
+
+    /* The lock files of the slots that were taken when acquire()
+       last failed. */
+    Paths getLockFilesToWaitFor() { return lockFilesToWaitFor; }
+};
+
+/* Set the user whose builds are accounted to in the current thread,
+   e.g. the user of a daemon connection. Defaults to the user running
+   the process. */
+void setBuildSlotUser(const std::string & user);
+
 }
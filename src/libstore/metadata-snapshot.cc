@@ -0,0 +1,278 @@
+#include "metadata-snapshot.hh"
+#include "store-api.hh"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+/* The file starts with a header, followed by an array of entries
+   sorted by base name, the references of all entries as indices into
+   the array of entries, and a table of NUL-terminated strings, which
+   the other sections refer to by offset. Offset 0 is the empty
+   string. All integers are in host byte order. */
+struct MetadataSnapshot::Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nrPaths;
+    uint64_t maxId;
+    uint32_t nrRefs;
+    uint32_t storeDir;
+    uint64_t entriesOffset;
+    uint64_t refsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+struct MetadataSnapshot::Entry
+{
+    uint64_t id;
+    uint64_t narSize;
+    int64_t registrationTime;
+    uint32_t name;
+    uint32_t narHash;
+    uint32_t deriver;
+    uint32_t sigs;
+    uint32_t ca;
+    uint32_t refs;
+    uint32_t nrRefs;
+    uint32_t flags;
+};
+
+static const char snapshotMagic[8] = { 'N', 'I', 'X', 'S', 'N', 'A', 'P', 0 };
+
+static const uint32_t snapshotVersion = 1;
+
+static const uint32_t flagUltimate = 1;
+
+void MetadataSnapshot::write(const Store & store,
+    const std::vector<ref<const ValidPathInfo>> & infos,
+    uint64_t maxId, const Path & path)
+{
+    auto sorted(infos);
+    std::sort(sorted.begin(), sorted.end(), [](auto & a, auto & b) {
+        return a->path.to_string() < b->path.to_string();
+    });
+
+    std::map<StorePath, uint32_t> indices;
+    for (auto & info : sorted)
+        indices.emplace(info->path, indices.size());
+
+    std::string strings(1, 0);
+    auto addString = [&](std::string_view s) -> uint32_t {
+        if (s.empty()) return 0;
+        if (strings.size() + s.size() + 1 > std::numeric_limits<uint32_t>::max())
+            throw Error("metadata snapshot '%s' would be too large", path);
+        auto offset = strings.size();
+        strings.append(s);
+        strings.push_back(0);
+        return offset;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> refs;
+
+    for (auto & info : sorted) {
+        Entry entry {};
+        entry.id = info->id;
+        entry.narSize = info->narSize;
+        entry.registrationTime = info->registrationTime;
+        entry.name = addString(info->path.to_string());
+        entry.narHash = addString(info->narHash.to_string(Base16, true));
+        if (info->deriver) entry.deriver = addString(info->deriver->to_string());
+        entry.sigs = addString(concatStringsSep(" ", info->sigs));
+        entry.ca = addString(renderContentAddress(info->ca));
+        entry.flags = info->ultimate ? flagUltimate : 0;
+        entry.refs = refs.size();
+        for (auto & ref : info->references) {
+            auto i = indices.find(ref);
+            if (i == indices.end())
+                throw Error("path '%s' refers to '%s', which is not in the metadata snapshot",
+                    store.printStorePath(info->path), store.printStorePath(ref));
+            refs.push_back(i->second);
+        }
+        entry.nrRefs = refs.size() - entry.refs;
+        entries.push_back(entry);
+    }
+
+    Header header {};
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.nrPaths = entries.size();
+    header.maxId = maxId;
+    header.nrRefs = refs.size();
+    header.storeDir = addString(store.storeDir);
+    header.entriesOffset = sizeof(Header);
+    header.refsOffset = header.entriesOffset + entries.size() * sizeof(Entry);
+    header.stringsOffset = header.refsOffset + refs.size() * sizeof(uint32_t);
+    header.stringsSize = strings.size();
+
+    std::string contents;
+    contents.append((const char *) &header, sizeof(header));
+    contents.append((const char *) entries.data(), entries.size() * sizeof(Entry));
+    contents.append((const char *) refs.data(), refs.size() * sizeof(uint32_t));
+    contents.append(strings);
+
+    auto tmp = fmt("%s.tmp-%d", path, getpid());
+    writeFile(tmp, contents);
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmp, path);
+}
+
+MetadataSnapshot::MetadataSnapshot(const Path & path, std::string_view storeDir)
+    : path(path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening metadata snapshot '%s'", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("getting the status of '%s'", path);
+
+    if ((size_t) st.st_size < sizeof(Header))
+        throw Error("metadata snapshot '%s' is corrupt", path);
+
+    auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw SysError("mapping metadata snapshot '%s'", path);
+    data = (const char *) p;
+    dataSize = st.st_size;
+
+    try {
+        header = (const Header *) data;
+
+        if (memcmp(header->magic, snapshotMagic, sizeof(header->magic)) != 0)
+            throw Error("'%s' is not a metadata snapshot", path);
+
+        if (header->version != snapshotVersion)
+            throw Error("metadata snapshot '%s' has unsupported version %d", path, header->version);
+
+        if (header->entriesOffset % alignof(Entry)
+            || header->refsOffset % alignof(uint32_t)
+            || header->entriesOffset + (uint64_t) header->nrPaths * sizeof(Entry) > header->refsOffset
+            || header->refsOffset + (uint64_t) header->nrRefs * sizeof(uint32_t) > header->stringsOffset
+            || header->stringsOffset > dataSize
+            || header->stringsSize == 0
+            || header->stringsSize > dataSize - header->stringsOffset
+            || data[header->stringsOffset + header->stringsSize - 1] != 0)
+            throw Error("metadata snapshot '%s' is corrupt", path);
+
+        entries = (const Entry *) (data + header->entriesOffset);
+        refs = (const uint32_t *) (data + header->refsOffset);
+        strings = data + header->stringsOffset;
+
+        if (string(header->storeDir) != storeDir)
+            throw Error("metadata snapshot '%s' is for store '%s', not '%s'",
+                path, string(header->storeDir), storeDir);
+    } catch (...) {
+        munmap((void *) data, dataSize);
+        throw;
+    }
+}
+
+MetadataSnapshot::~MetadataSnapshot()
+{
+    munmap((void *) data, dataSize);
+}
+
+size_t MetadataSnapshot::size() const
+{
+    return header->nrPaths;
+}
+
+uint64_t MetadataSnapshot::maxId() const
+{
+    return header->maxId;
+}
+
+std::string_view MetadataSnapshot::string(uint32_t offset) const
+{
+    if (offset >= header->stringsSize)
+        throw Error("metadata snapshot '%s' is corrupt", path);
+    return strings + offset;
+}
+
+const MetadataSnapshot::Entry & MetadataSnapshot::entry(uint32_t n) const
+{
+    if (n >= header->nrPaths)
+        throw Error("metadata snapshot '%s' is corrupt", path);
+    return entries[n];
+}
+
+std::optional<uint32_t> MetadataSnapshot::find(std::string_view baseName) const
+{
+    uint32_t lo = 0, hi = header->nrPaths;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        auto cmp = string(entries[mid].name).compare(baseName);
+        if (cmp == 0) return mid;
+        if (cmp < 0) lo = mid + 1; else hi = mid;
+    }
+    return std::nullopt;
+}
+
+std::shared_ptr<ValidPathInfo> MetadataSnapshot::queryPathInfo(const StorePath & path) const
+{
+    auto n = find(path.to_string());
+    if (!n) return nullptr;
+    auto & e(entry(*n));
+
+    auto info = std::make_shared<ValidPathInfo>(path, Hash::parseAnyPrefixed(string(e.narHash)));
+    info->id = e.id;
+    info->narSize = e.narSize;
+    info->registrationTime = e.registrationTime;
+    if (e.deriver) info->deriver = StorePath(string(e.deriver));
+    if (e.sigs) info->sigs = tokenizeString<StringSet>(string(e.sigs), " ");
+    if (e.ca) info->ca = parseContentAddressOpt(string(e.ca));
+    info->ultimate = e.flags & flagUltimate;
+
+    if ((uint64_t) e.refs + e.nrRefs > header->nrRefs)
+        throw Error("metadata snapshot '%s' is corrupt", this->path);
+    for (uint32_t i = 0; i < e.nrRefs; ++i)
+        info->references.insert(StorePath(string(entry(refs[e.refs + i]).name)));
+
+    return info;
+}
+
+bool MetadataSnapshot::computeClosure(const StorePathSet & startPaths, StorePathSet & paths) const
+{
+    std::vector<uint32_t> start;
+
+    for (auto & path : startPaths) {
+        auto n = find(path.to_string());
+        if (!n) return false;
+        start.push_back(*n);
+    }
+
+    std::vector<bool> seen(header->nrPaths, false);
+    std::vector<uint32_t> todo;
+
+    auto enqueue = [&](uint32_t n) {
+        auto & e(entry(n));
+        if (seen[n]) return;
+        seen[n] = true;
+        if (paths.insert(StorePath(string(e.name))).second)
+            todo.push_back(n);
+    };
+
+    for (auto n : start)
+        enqueue(n);
+
+    while (!todo.empty()) {
+        auto & e(entry(todo.back()));
+        todo.pop_back();
+        if ((uint64_t) e.refs + e.nrRefs > header->nrRefs)
+            throw Error("metadata snapshot '%s' is corrupt", path);
+        for (uint32_t i = 0; i < e.nrRefs; ++i)
+            enqueue(refs[e.refs + i]);
+    }
+
+    return true;
+}
+
+}
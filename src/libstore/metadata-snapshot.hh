@@ -0,0 +1,89 @@
+#pragma once
+
+#include "path-info.hh"
+
+namespace nix {
+
+class Store;
+
+/* A read-only snapshot of the valid paths in the Nix database, their
+   path infos and references, in a file that is memory-mapped and
+   queried in place, without parsing or SQLite. The paths are sorted
+   by base name, so a lookup is a binary search. LocalStore consults
+   it before the database (see the `metadata-snapshot' setting),
+   which is useful for a large set of paths that doesn't change, such
+   as the pre-populated store of a CI runner.
+
+   The snapshot records how many paths the database had up to the
+   highest path ID in the snapshot, so that the deletion of any of
+   its paths can be detected when the snapshot is opened (see
+   isCurrent()). Changes to the path infos of its paths, such as
+   added signatures, are not detected. */
+class MetadataSnapshot
+{
+public:
+
+    /* Write a snapshot containing 'infos' to 'path'. 'infos' must be
+       closed under the references relation, and 'maxId' must be the
+       highest ID of the paths in it. */
+    static void write(const Store & store,
+        const std::vector<ref<const ValidPathInfo>> & infos,
+        uint64_t maxId, const Path & path);
+
+    /* Map the snapshot in 'path'. Throws an Error if it's not a
+       valid snapshot for a store with store directory 'storeDir'. */
+    MetadataSnapshot(const Path & path, std::string_view storeDir);
+
+    ~MetadataSnapshot();
+
+    const Path path;
+
+    size_t size() const;
+
+    /* The highest ID of the paths in the snapshot. */
+    uint64_t maxId() const;
+
+    /* Return whether 'nrPaths' (the number of valid paths in the
+       database with an ID not higher than maxId()) is the number of
+       paths in the snapshot, i.e. whether none of them has been
+       deleted since the snapshot was written. */
+    bool isCurrent(uint64_t nrPaths) const
+    {
+        return nrPaths == size();
+    }
+
+    bool contains(const StorePath & path) const
+    {
+        return (bool) find(path.to_string());
+    }
+
+    /* Return the path info of 'path', or null if it's not in the
+       snapshot. */
+    std::shared_ptr<ValidPathInfo> queryPathInfo(const StorePath & path) const;
+
+    /* Add the closure of 'startPaths' to 'paths'. Returns false,
+       without changing 'paths', if some of 'startPaths' are not in
+       the snapshot. */
+    bool computeClosure(const StorePathSet & startPaths, StorePathSet & paths) const;
+
+private:
+
+    struct Header;
+    struct Entry;
+
+    const char * data = nullptr;
+    size_t dataSize = 0;
+
+    const Header * header;
+    const Entry * entries;
+    const uint32_t * refs;
+    const char * strings;
+
+    std::optional<uint32_t> find(std::string_view baseName) const;
+
+    std::string_view string(uint32_t offset) const;
+
+    const Entry & entry(uint32_t n) const;
+};
+
+}
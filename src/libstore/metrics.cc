@@ -0,0 +1,253 @@
+#include "metrics.hh"
+#include "worker-protocol.hh"
+
+#include <cstring>
+
+#include <sys/mman.h>
+
+namespace nix::metrics {
+
+const uint64_t Histogram::bounds[nrBuckets] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 250000, 1000000, 10000000, 60000000
+};
+
+void Histogram::observe(std::chrono::microseconds duration)
+{
+    uint64_t us = duration.count();
+    size_t n = 0;
+    while (n < nrBuckets && us > bounds[n]) n++;
+    buckets[n]++;
+    count++;
+    sumMicros += us;
+}
+
+Timer::~Timer()
+{
+    histogram.observe(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start));
+}
+
+static Metrics localMetrics;
+
+static Metrics * metrics = &localMetrics;
+
+Metrics & getMetrics()
+{
+    return *metrics;
+}
+
+void shareMetrics()
+{
+    if (metrics != &localMetrics) return;
+    void * p = mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw SysError("allocating shared memory for metrics");
+    metrics = new (p) Metrics();
+}
+
+StatementMetrics & statementMetrics(std::string_view sql)
+{
+    auto & m(getMetrics());
+
+    std::string text;
+    for (auto c : sql) {
+        if (isspace(c)) {
+            if (!text.empty() && text.back() != ' ') text += ' ';
+        } else
+            text += c;
+    }
+    while (!text.empty() && text.back() == ' ') text.pop_back();
+    if (text.size() >= sizeof(StatementMetrics::sql))
+        text = text.substr(0, sizeof(StatementMetrics::sql) - 4) + "...";
+
+    uint64_t key = std::hash<std::string>()(text);
+    if (!key) key = 1;
+
+    for (size_t n = 0; n < Metrics::maxStatements; n++) {
+        auto & stmt(m.statements[(key + n) % Metrics::maxStatements]);
+        uint64_t current = 0;
+        if (stmt.key.compare_exchange_strong(current, key)) {
+            memcpy(stmt.sql, text.c_str(), text.size() + 1);
+            stmt.ready = true;
+            return stmt;
+        }
+        if (current == key) return stmt;
+    }
+
+    return m.otherStatements;
+}
+
+std::string_view workerOpName(unsigned int op)
+{
+    switch (op) {
+    case wopIsValidPath: return "IsValidPath";
+    case wopHasSubstitutes: return "HasSubstitutes";
+    case wopQueryPathHash: return "QueryPathHash";
+    case wopQueryReferences: return "QueryReferences";
+    case wopQueryReferrers: return "QueryReferrers";
+    case wopAddToStore: return "AddToStore";
+    case wopAddTextToStore: return "AddTextToStore";
+    case wopBuildPaths: return "BuildPaths";
+    case wopEnsurePath: return "EnsurePath";
+    case wopAddTempRoot: return "AddTempRoot";
+    case wopAddIndirectRoot: return "AddIndirectRoot";
+    case wopSyncWithGC: return "SyncWithGC";
+    case wopFindRoots: return "FindRoots";
+    case wopExportPath: return "ExportPath";
+    case wopQueryDeriver: return "QueryDeriver";
+    case wopSetOptions: return "SetOptions";
+    case wopCollectGarbage: return "CollectGarbage";
+    case wopQuerySubstitutablePathInfo: return "QuerySubstitutablePathInfo";
+    case wopQueryDerivationOutputs: return "QueryDerivationOutputs";
+    case wopQueryAllValidPaths: return "QueryAllValidPaths";
+    case wopQueryFailedPaths: return "QueryFailedPaths";
+    case wopClearFailedPaths: return "ClearFailedPaths";
+    case wopQueryPathInfo: return "QueryPathInfo";
+    case wopImportPaths: return "ImportPaths";
+    case wopQueryDerivationOutputNames: return "QueryDerivationOutputNames";
+    case wopQueryPathFromHashPart: return "QueryPathFromHashPart";
+    case wopQuerySubstitutablePathInfos: return "QuerySubstitutablePathInfos";
+    case wopQueryValidPaths: return "QueryValidPaths";
+    case wopQuerySubstitutablePaths: return "QuerySubstitutablePaths";
+    case wopQueryValidDerivers: return "QueryValidDerivers";
+    case wopOptimiseStore: return "OptimiseStore";
+    case wopVerifyStore: return "VerifyStore";
+    case wopBuildDerivation: return "BuildDerivation";
+    case wopAddSignatures: return "AddSignatures";
+    case wopNarFromPath: return "NarFromPath";
+    case wopAddToStoreNar: return "AddToStoreNar";
+    case wopQueryMissing: return "QueryMissing";
+    case wopQueryDerivationOutputMap: return "QueryDerivationOutputMap";
+    case wopRegisterDrvOutput: return "RegisterDrvOutput";
+    case wopQueryRealisation: return "QueryRealisation";
+    case wopQueryPathInfos: return "QueryPathInfos";
+    case wopAddTempRoots: return "AddTempRoots";
+    case wopAddMultipleToStore: return "AddMultipleToStore";
+    case wopQueryReferencePositions: return "QueryReferencePositions";
+    case wopPrefetchSubstitutes: return "PrefetchSubstitutes";
+    default: return "Unknown";
+    }
+}
+
+static std::string escapeLabel(std::string_view s)
+{
+    std::string res;
+    for (auto c : s) {
+        if (c == '\\' || c == '"') res += '\\';
+        res += c;
+    }
+    return res;
+}
+
+static void renderHistogram(std::string & out, const std::string & name,
+    const std::string & labels, const Histogram & histogram)
+{
+    auto withLabel = [&](const std::string & label) {
+        return labels.empty() ? "{" + label + "}" : "{" + labels + "," + label + "}";
+    };
+    auto withLabels = labels.empty() ? "" : "{" + labels + "}";
+
+    uint64_t cumulative = 0;
+    for (size_t n = 0; n < Histogram::nrBuckets; n++) {
+        cumulative += histogram.buckets[n];
+        out += fmt("%s_bucket%s %d\n", name,
+            withLabel(fmt("le=\"%g\"", histogram.bounds[n] / 1e6)), cumulative);
+    }
+    cumulative += histogram.buckets[Histogram::nrBuckets];
+    out += fmt("%s_bucket%s %d\n", name, withLabel("le=\"+Inf\""), cumulative);
+    out += fmt("%s_sum%s %g\n", name, withLabels, histogram.sumMicros / 1e6);
+    out += fmt("%s_count%s %d\n", name, withLabels, histogram.count);
+}
+
+std::string renderMetrics()
+{
+    auto & m(getMetrics());
+    std::string out;
+
+    out +=
+        "# HELP nix_daemon_connections_total Number of client connections accepted.\n"
+        "# TYPE nix_daemon_connections_total counter\n";
+    out += fmt("nix_daemon_connections_total %d\n", m.connections);
+    out +=
+        "# HELP nix_daemon_connections Number of client connections currently open.\n"
+        "# TYPE nix_daemon_connections gauge\n";
+    out += fmt("nix_daemon_connections %d\n", m.activeConnections);
+
+    out +=
+        "# HELP nix_daemon_op_duration_seconds Time taken to process worker operations.\n"
+        "# TYPE nix_daemon_op_duration_seconds histogram\n";
+    for (size_t op = 0; op < Metrics::maxOps; op++)
+        if (m.ops[op].latency.count)
+            renderHistogram(out, "nix_daemon_op_duration_seconds",
+                fmt("op=\"%s\"", workerOpName(op)), m.ops[op].latency);
+
+    out +=
+        "# HELP nix_daemon_op_errors_total Number of worker operations that failed.\n"
+        "# TYPE nix_daemon_op_errors_total counter\n";
+    for (size_t op = 0; op < Metrics::maxOps; op++)
+        if (m.ops[op].latency.count)
+            out += fmt("nix_daemon_op_errors_total{op=\"%s\"} %d\n", workerOpName(op), m.ops[op].errors);
+
+    out +=
+        "# HELP nix_daemon_ops_in_flight Number of worker operations currently being processed.\n"
+        "# TYPE nix_daemon_ops_in_flight gauge\n";
+    for (size_t op = 0; op < Metrics::maxOps; op++)
+        if (m.ops[op].inFlight || m.ops[op].latency.count)
+            out += fmt("nix_daemon_ops_in_flight{op=\"%s\"} %d\n", workerOpName(op), m.ops[op].inFlight);
+
+    out +=
+        "# HELP nix_store_path_lock_wait_seconds Time spent waiting for path locks held by others.\n"
+        "# TYPE nix_store_path_lock_wait_seconds histogram\n";
+    renderHistogram(out, "nix_store_path_lock_wait_seconds", "", m.pathLockWait);
+
+    out +=
+        "# HELP nix_store_gc_lock_wait_seconds Time spent waiting for the garbage collector lock.\n"
+        "# TYPE nix_store_gc_lock_wait_seconds histogram\n";
+    renderHistogram(out, "nix_store_gc_lock_wait_seconds", "", m.gcLockWait);
+
+    std::vector<std::pair<std::string, const StatementMetrics *>> statements;
+    for (auto & stmt : m.statements)
+        if (stmt.ready && stmt.executions)
+            statements.emplace_back(fmt("sql=\"%s\"", escapeLabel(stmt.sql)), &stmt);
+    if (m.otherStatements.executions)
+        statements.emplace_back("sql=\"other\"", &m.otherStatements);
+
+    out +=
+        "# HELP nix_store_sqlite_statements_total Number of executions of SQLite statements.\n"
+        "# TYPE nix_store_sqlite_statements_total counter\n";
+    for (auto & [labels, stmt] : statements)
+        out += fmt("nix_store_sqlite_statements_total{%s} %d\n", labels, stmt->executions);
+
+    out +=
+        "# HELP nix_store_sqlite_statement_seconds_total Time spent executing SQLite statements.\n"
+        "# TYPE nix_store_sqlite_statement_seconds_total counter\n";
+    for (auto & [labels, stmt] : statements)
+        out += fmt("nix_store_sqlite_statement_seconds_total{%s} %g\n", labels, stmt->micros / 1e6);
+
+    out +=
+        "# HELP nix_store_sqlite_slow_statements_total Number of executions of SQLite statements that exceeded sqlite-slow-query-threshold.\n"
+        "# TYPE nix_store_sqlite_slow_statements_total counter\n";
+    for (auto & [labels, stmt] : statements)
+        out += fmt("nix_store_sqlite_slow_statements_total{%s} %d\n", labels, stmt->slow);
+
+    out +=
+        "# HELP nix_store_sqlite_busy_waits_total Number of SQLite statements that waited for a database lock.\n"
+        "# TYPE nix_store_sqlite_busy_waits_total counter\n";
+    out += fmt("nix_store_sqlite_busy_waits_total %d\n", m.sqliteBusyWaits);
+    out +=
+        "# HELP nix_store_sqlite_busy_wait_seconds_total Time spent by SQLite statements waiting for a database lock.\n"
+        "# TYPE nix_store_sqlite_busy_wait_seconds_total counter\n";
+    out += fmt("nix_store_sqlite_busy_wait_seconds_total %g\n", m.sqliteBusyWaitMicros / 1e6);
+    out +=
+        "# HELP nix_store_sqlite_retries_total Number of SQLite transactions retried because the database was busy.\n"
+        "# TYPE nix_store_sqlite_retries_total counter\n";
+    out += fmt("nix_store_sqlite_retries_total %d\n", m.sqliteRetries);
+    out +=
+        "# HELP nix_store_sqlite_retry_seconds_total Time spent sleeping before retrying SQLite transactions.\n"
+        "# TYPE nix_store_sqlite_retry_seconds_total counter\n";
+    out += fmt("nix_store_sqlite_retry_seconds_total %g\n", m.sqliteRetryMicros / 1e6);
+
+    return out;
+}
+
+}
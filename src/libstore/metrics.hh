@@ -0,0 +1,124 @@
+#pragma once
+
+#include "types.hh"
+
+#include <atomic>
+#include <chrono>
+
+namespace nix::metrics {
+
+/* A histogram of durations with fixed buckets. It consists only of
+   atomics, so that it can be placed in memory shared between the
+   processes of a forking daemon. */
+struct Histogram
+{
+    static constexpr size_t nrBuckets = 13;
+
+    /* The upper bounds of the buckets, in microseconds. The last
+       bucket (+Inf) is implicit. */
+    static const uint64_t bounds[nrBuckets];
+
+    std::atomic<uint64_t> buckets[nrBuckets + 1];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sumMicros;
+
+    void observe(std::chrono::microseconds duration);
+};
+
+/* Record the time between construction and destruction in a
+   histogram. */
+struct Timer
+{
+    Histogram & histogram;
+    std::chrono::steady_clock::time_point start;
+
+    Timer(Histogram & histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now())
+    { }
+
+    ~Timer();
+};
+
+struct OpMetrics
+{
+    Histogram latency;
+    std::atomic<uint64_t> errors;
+    std::atomic<int64_t> inFlight;
+};
+
+/* The executions of a SQLite prepared statement. */
+struct StatementMetrics
+{
+    /* A hash of the statement's text, or 0 if this slot is unused. */
+    std::atomic<uint64_t> key;
+    std::atomic<bool> ready;
+    /* The statement's text, with whitespace normalised and truncated
+       if necessary. Only valid once 'ready' is set. */
+    char sql[192];
+
+    std::atomic<uint64_t> executions;
+    /* The time spent in sqlite3_step(). */
+    std::atomic<uint64_t> micros;
+    /* Executions that took longer than 'sqlite-slow-query-threshold'. */
+    std::atomic<uint64_t> slow;
+};
+
+struct Metrics
+{
+    /* Indexed by worker operation; index 0 collects unknown
+       operations. */
+    static constexpr size_t maxOps = 64;
+    OpMetrics ops[maxOps];
+
+    std::atomic<uint64_t> connections;
+    std::atomic<int64_t> activeConnections;
+
+    /* Time spent waiting for locks that weren't immediately
+       available. */
+    Histogram pathLockWait;
+    Histogram gcLockWait;
+
+    /* Per SQLite statement, in a hash table keyed by the statement's
+       text. Statements that don't fit are counted in
+       'otherStatements'. */
+    static constexpr size_t maxStatements = 128;
+    StatementMetrics statements[maxStatements];
+    StatementMetrics otherStatements;
+
+    /* The number of SQLite statements that had to wait for a database
+       lock, and the total time spent waiting. */
+    std::atomic<uint64_t> sqliteBusyWaits;
+    std::atomic<uint64_t> sqliteBusyWaitMicros;
+
+    /* The number of transactions that were retried because the
+       database was busy (see retrySQLite()), and the total time spent
+       sleeping before retrying. */
+    std::atomic<uint64_t> sqliteRetries;
+    std::atomic<uint64_t> sqliteRetryMicros;
+
+    OpMetrics & op(unsigned int op)
+    {
+        return ops[op < maxOps ? op : 0];
+    }
+};
+
+/* Return the metrics of this process, or those shared with its
+   parent if shareMetrics() was called before forking. */
+Metrics & getMetrics();
+
+/* Move the metrics to shared memory, so that they include the work
+   done by child processes forked afterwards. Must be called before
+   any other threads are started. */
+void shareMetrics();
+
+/* Return the metrics of the SQLite statement 'sql'. */
+StatementMetrics & statementMetrics(std::string_view sql);
+
+/* Return the name of a worker operation (e.g. "QueryPathInfo"), for
+   use in metrics and traces. */
+std::string_view workerOpName(unsigned int op);
+
+/* Render the metrics in the Prometheus text exposition format. */
+std::string renderMetrics();
+
+}
@@ -4,8 +4,9 @@
 #include "local-store.hh"
 #include "store-api.hh"
 #include "thread-pool.hh"
-#include "topo-sort.hh"
+#include "path-index.hh"
 #include "callback.hh"
+#include "nar-info.hh"
 
 namespace nix {
 
@@ -13,6 +14,48 @@ namespace nix {
 void Store::computeFSClosure(const StorePathSet & startPaths,
     StorePathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
+    if (!flipDirection) {
+        /* Walk the closure breadth-first, so that the path infos of
+           each level can be fetched with a single queryPathInfos()
+           call. */
+        StorePathSet frontier;
+        for (auto & path : startPaths)
+            if (paths_.insert(path).second) frontier.insert(path);
+
+        while (!frontier.empty()) {
+            checkInterrupt();
+
+            auto infos = queryPathInfos(frontier);
+
+            StorePathSet next;
+            auto enqueue = [&](const StorePath & path) {
+                if (paths_.insert(path).second) next.insert(path);
+            };
+
+            for (auto & path : frontier) {
+                auto i = infos.find(path);
+                if (i == infos.end())
+                    throw InvalidPath("path '%s' is not valid", printStorePath(path));
+                auto & info = i->second;
+
+                for (auto & ref : info->references)
+                    if (ref != path)
+                        enqueue(ref);
+
+                if (includeOutputs && path.isDerivation())
+                    for (auto & i : queryDerivationOutputs(path))
+                        if (isValidPath(i)) enqueue(i);
+
+                if (includeDerivers && info->deriver && isValidPath(*info->deriver))
+                    enqueue(*info->deriver);
+            }
+
+            frontier = std::move(next);
+        }
+
+        return;
+    }
+
     struct State
     {
         size_t pending;
@@ -42,38 +85,21 @@ void Store::computeFSClosure(const StorePathSet & startPaths,
 
                 auto path = parseStorePath(pathS);
 
-                if (flipDirection) {
+                StorePathSet referrers;
+                queryReferrers(path, referrers);
+                for (auto & ref : referrers)
+                    if (ref != path)
+                        enqueue(printStorePath(ref));
 
-                    StorePathSet referrers;
-                    queryReferrers(path, referrers);
-                    for (auto & ref : referrers)
-                        if (ref != path)
-                            enqueue(printStorePath(ref));
+                if (includeOutputs)
+                    for (auto & i : queryValidDerivers(path))
+                        enqueue(printStorePath(i));
 
-                    if (includeOutputs)
-                        for (auto & i : queryValidDerivers(path))
+                if (includeDerivers && path.isDerivation())
+                    for (auto & i : queryDerivationOutputs(path))
+                        if (isValidPath(i) && queryPathInfo(i)->deriver == path)
                             enqueue(printStorePath(i));
 
-                    if (includeDerivers && path.isDerivation())
-                        for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i) && queryPathInfo(i)->deriver == path)
-                                enqueue(printStorePath(i));
-
-                } else {
-
-                    for (auto & ref : info->references)
-                        if (ref != path)
-                            enqueue(printStorePath(ref));
-
-                    if (includeOutputs && path.isDerivation())
-                        for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i)) enqueue(printStorePath(i));
-
-                    if (includeDerivers && info->deriver && isValidPath(*info->deriver))
-                        enqueue(printStorePath(*info->deriver));
-
-                }
-
                 {
                     auto state(state_.lock());
                     assert(state->pending);
@@ -120,90 +146,55 @@ std::optional<ContentAddress> getDerivationCA(const BasicDerivation & drv)
 }
 
 void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
-    StorePathSet & willBuild_, StorePathSet & willSubstitute_, StorePathSet & unknown_,
-    uint64_t & downloadSize_, uint64_t & narSize_)
+    StorePathSet & willBuild, StorePathSet & willSubstitute, StorePathSet & unknown,
+    uint64_t & downloadSize, uint64_t & narSize)
 {
     Activity act(*logger, lvlDebug, actUnknown, "querying info about missing paths");
 
-    downloadSize_ = narSize_ = 0;
+    downloadSize = narSize = 0;
 
-    ThreadPool pool;
+    /* Walk the dependency graph breadth-first. For each level, first
+       determine (in parallel) which paths and derivation outputs are
+       invalid, then ask the substituters about all of them with a
+       single querySubstitutablePathInfos() call, and finally decide
+       which derivations must be built, which yields the next
+       level. Every path is queried at most once, even if it's an
+       input or output of many derivations. */
 
-    struct State
+    struct Drv
     {
-        std::unordered_set<std::string> done;
-        StorePathSet & unknown, & willSubstitute, & willBuild;
-        uint64_t & downloadSize;
-        uint64_t & narSize;
+        StorePath drvPath;
+        ref<Derivation> drv;
+        bool mustBuild;
+        StorePathCAMap invalidOutputs;
     };
 
-    struct DrvState
+    struct Level
     {
-        size_t left;
-        bool done = false;
-        StorePathSet outPaths;
-        DrvState(size_t left) : left(left) { }
+        std::vector<Drv> drvs;
+        StorePathSet unknown;
     };
 
-    Sync<State> state_(State{{}, unknown_, willSubstitute_, willBuild_, downloadSize_, narSize_});
+    std::unordered_set<std::string> done;
+    std::map<StorePath, std::optional<SubstitutablePathInfo>> queried;
 
-    std::function<void(StorePathWithOutputs)> doPath;
+    std::vector<StorePathWithOutputs> todo(targets);
 
-    auto mustBuildDrv = [&](const StorePath & drvPath, const Derivation & drv) {
-        {
-            auto state(state_.lock());
-            state->willBuild.insert(drvPath);
-        }
+    while (!todo.empty()) {
+        checkInterrupt();
 
-        for (auto & i : drv.inputDrvs)
-            pool.enqueue(std::bind(doPath, StorePathWithOutputs { i.first, i.second }));
-    };
+        Sync<Level> level_;
+        StorePathSet paths;
+        ThreadPool pool;
 
-    auto checkOutput = [&](
-        const Path & drvPathS, ref<Derivation> drv, const Path & outPathS, ref<Sync<DrvState>> drvState_)
-    {
-        if (drvState_->lock()->done) return;
-
-        auto drvPath = parseStorePath(drvPathS);
-        auto outPath = parseStorePath(outPathS);
-
-        SubstitutablePathInfos infos;
-        querySubstitutablePathInfos({{outPath, getDerivationCA(*drv)}}, infos);
-
-        if (infos.empty()) {
-            drvState_->lock()->done = true;
-            mustBuildDrv(drvPath, *drv);
-        } else {
-            {
-                auto drvState(drvState_->lock());
-                if (drvState->done) return;
-                assert(drvState->left);
-                drvState->left--;
-                drvState->outPaths.insert(outPath);
-                if (!drvState->left) {
-                    for (auto & path : drvState->outPaths)
-                        pool.enqueue(std::bind(doPath, StorePathWithOutputs { path } ));
-                }
-            }
-        }
-    };
-
-    doPath = [&](const StorePathWithOutputs & path) {
-
-        {
-            auto state(state_.lock());
-            if (!state->done.insert(path.to_string(*this)).second) return;
-        }
-
-        if (path.path.isDerivation()) {
+        auto doDrv = [&](const StorePathWithOutputs & path) {
             if (!isValidPath(path.path)) {
                 // FIXME: we could try to substitute the derivation.
-                auto state(state_.lock());
-                state->unknown.insert(path.path);
+                level_.lock()->unknown.insert(path.path);
                 return;
             }
 
-            PathSet invalid;
+            StorePathSet invalid;
             /* true for regular derivations, and CA derivations for which we
                have a trust mapping for all wanted outputs. */
             auto knownOutputPaths = true;
@@ -213,72 +204,344 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
                     break;
                 }
                 if (wantOutput(outputName, path.outputs) && !isValidPath(*pathOpt))
-                    invalid.insert(printStorePath(*pathOpt));
+                    invalid.insert(*pathOpt);
             }
             if (knownOutputPaths && invalid.empty()) return;
 
             auto drv = make_ref<Derivation>(derivationFromPath(path.path));
             ParsedDerivation parsedDrv(StorePath(path.path), *drv);
 
-            if (knownOutputPaths && settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
-                auto drvState = make_ref<Sync<DrvState>>(DrvState(invalid.size()));
+            Drv d {
+                .drvPath = path.path,
+                .drv = drv,
+                .mustBuild = !knownOutputPaths || !settings.useSubstitutes || !parsedDrv.substitutesAllowed(),
+            };
+            if (!d.mustBuild) {
+                auto ca = getDerivationCA(*drv);
                 for (auto & output : invalid)
-                    pool.enqueue(std::bind(checkOutput, printStorePath(path.path), drv, output, drvState));
-            } else
-                mustBuildDrv(path.path, *drv);
+                    d.invalidOutputs.emplace(output, ca);
+            }
 
-        } else {
+            level_.lock()->drvs.push_back(std::move(d));
+        };
 
-            if (isValidPath(path.path)) return;
+        for (auto & path : todo) {
+            if (!done.insert(path.to_string(*this)).second) continue;
+            if (path.path.isDerivation())
+                pool.enqueue(std::bind(doDrv, path));
+            else
+                paths.insert(path.path);
+        }
+        todo.clear();
+
+        pool.process();
+
+        auto level(level_.lock());
+
+        unknown.merge(level->unknown);
+
+        StorePathSet unqueried;
+        for (auto & path : paths)
+            if (!queried.count(path))
+                unqueried.insert(path);
+
+        StorePathCAMap candidates;
+        if (!unqueried.empty()) {
+            auto valid = queryValidPaths(unqueried);
+            for (auto & path : unqueried)
+                if (!valid.count(path))
+                    candidates.emplace(path, std::nullopt);
+        }
+        for (auto & drv : level->drvs)
+            for (auto & output : drv.invalidOutputs)
+                if (!queried.count(output.first))
+                    candidates.insert(output);
 
+        if (!candidates.empty()) {
             SubstitutablePathInfos infos;
-            querySubstitutablePathInfos({{path.path, std::nullopt}}, infos);
+            querySubstitutablePathInfos(candidates, infos);
+            for (auto & [path, _] : candidates) {
+                auto i = infos.find(path);
+                queried.insert_or_assign(path,
+                    i == infos.end() ? std::nullopt : std::optional(i->second));
+            }
+        }
 
-            if (infos.empty()) {
-                auto state(state_.lock());
-                state->unknown.insert(path.path);
-                return;
+        auto substitute = [&](const StorePath & path) {
+            auto & info = queried.at(path);
+            if (!info) return false;
+            done.insert(printStorePath(path));
+            if (willSubstitute.insert(path).second) {
+                downloadSize += info->downloadSize;
+                narSize += info->narSize;
+                for (auto & ref : info->references)
+                    todo.push_back(StorePathWithOutputs { ref });
             }
+            return true;
+        };
 
-            auto info = infos.find(path.path);
-            assert(info != infos.end());
+        for (auto & path : paths) {
+            if (!queried.count(path)) continue; // valid
+            if (!substitute(path))
+                unknown.insert(path);
+        }
 
-            {
-                auto state(state_.lock());
-                state->willSubstitute.insert(path.path);
-                state->downloadSize += info->second.downloadSize;
-                state->narSize += info->second.narSize;
+        for (auto & drv : level->drvs) {
+            auto substitutable = !drv.mustBuild;
+            for (auto & output : drv.invalidOutputs)
+                if (!queried.at(output.first)) {
+                    substitutable = false;
+                    break;
+                }
+
+            if (substitutable) {
+                for (auto & output : drv.invalidOutputs)
+                    substitute(output.first);
+            } else {
+                willBuild.insert(drv.drvPath);
+                for (auto & i : drv.drv->inputDrvs)
+                    todo.push_back(StorePathWithOutputs { i.first, i.second });
             }
+        }
+    }
+}
+
+
+StorePaths Store::topoSortPaths(const StorePathSet & paths)
+{
+    return topoSortPaths(paths, queryPathInfos(paths));
+}
 
-            for (auto & ref : info->second.references)
-                pool.enqueue(std::bind(doPath, StorePathWithOutputs { ref }));
+
+StorePaths Store::topoSortPaths(const StorePathSet & paths,
+    const std::map<StorePath, ref<const ValidPathInfo>> & infos)
+{
+    /* This is topoSort(), but using path IDs rather than sets of
+       paths, and an explicit stack rather than recursion, since
+       closures can be both large and deep. */
+    StorePathIndex index;
+    for (auto & path : paths)
+        index.add(path);
+
+    size_t size = index.size();
+
+    std::vector<std::vector<uint32_t>> children(size);
+    for (uint32_t n = 0; n < size; ++n) {
+        auto info = infos.find(index[n]);
+        if (info == infos.end()) continue;
+        for (auto & ref : info->second->references)
+            /* Don't traverse into paths that aren't in our starting
+               set. */
+            if (auto m = index.find(ref); m && *m != n)
+                children[n].push_back(*m);
+    }
+
+    enum { unvisited, visiting, visited };
+    std::vector<uint8_t> status(size, unvisited);
+
+    StorePaths sorted;
+    sorted.reserve(size);
+
+    /* Nodes being visited, and the next child to look at. */
+    std::vector<std::pair<uint32_t, size_t>> stack;
+
+    for (uint32_t root = 0; root < size; ++root) {
+        if (status[root] != unvisited) continue;
+        status[root] = visiting;
+        stack.emplace_back(root, 0);
+
+        while (!stack.empty()) {
+            auto & [n, next] = stack.back();
+            if (next < children[n].size()) {
+                auto m = children[n][next++];
+                if (status[m] == visiting)
+                    throw BuildError(
+                        "cycle detected in the references of '%s' from '%s'",
+                        printStorePath(index[m]),
+                        printStorePath(index[n]));
+                if (status[m] == unvisited) {
+                    status[m] = visiting;
+                    stack.emplace_back(m, 0);
+                }
+            } else {
+                status[n] = visited;
+                sorted.push_back(index[n]);
+                stack.pop_back();
+            }
         }
-    };
+    }
 
-    for (auto & path : targets)
-        pool.enqueue(std::bind(doPath, path));
+    std::reverse(sorted.begin(), sorted.end());
 
-    pool.process();
+    return sorted;
 }
 
 
-StorePaths Store::topoSortPaths(const StorePathSet & paths)
+
+std::map<StorePath, std::pair<uint64_t, uint64_t>> Store::getClosureSizes(const StorePathSet & paths)
 {
-    return topoSort(paths,
-        {[&](const StorePath & path) {
-            StorePathSet references;
-            try {
-                references = queryPathInfo(path)->references;
-            } catch (InvalidPath &) {
+    /* Load the graph of the combined closure, one level at a time. */
+    StorePathIndex index;
+    std::vector<std::vector<uint32_t>> refs;
+    std::vector<uint64_t> narSizes, downloadSizes;
+    std::vector<bool> valid;
+    StorePathSet frontier;
+
+    auto getId = [&](const StorePath & path) {
+        auto n = index.add(path);
+        if (n == refs.size()) {
+            refs.emplace_back();
+            narSizes.push_back(0);
+            downloadSizes.push_back(0);
+            valid.push_back(false);
+            frontier.insert(path);
+        }
+        return n;
+    };
+
+    for (auto & path : paths)
+        getId(path);
+
+    while (!frontier.empty()) {
+        auto infos = queryPathInfos(std::exchange(frontier, {}));
+        for (auto & [path, info] : infos) {
+            auto n = *index.find(path);
+            valid[n] = true;
+            narSizes[n] = info->narSize;
+            if (auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info.get_ptr()))
+                downloadSizes[n] = narInfo->fileSize;
+            for (auto & ref : info->references) {
+                auto m = getId(ref);
+                if (m != n) refs[n].push_back(m);
             }
-            return references;
-        }},
-        {[&](const StorePath & path, const StorePath & parent) {
-            return BuildError(
-                "cycle detected in the references of '%s' from '%s'",
-                printStorePath(path),
-                printStorePath(parent));
-        }});
+        }
+    }
+
+    uint32_t size = refs.size();
+
+    /* Collapse the strongly connected components (i.e. cycles) of
+       the graph using Tarjan's algorithm. This numbers the components
+       in reverse topological order, so every component only refers to
+       components with a lower number. */
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> order(size, none), low(size), comp(size, none);
+    std::vector<uint32_t> members;
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    uint32_t counter = 0, nrComps = 0;
+
+    for (uint32_t root = 0; root < size; ++root) {
+        if (order[root] != none) continue;
+        order[root] = low[root] = counter++;
+        members.push_back(root);
+        stack.emplace_back(root, 0);
+
+        while (!stack.empty()) {
+            auto [n, next] = stack.back();
+            if (next < refs[n].size()) {
+                stack.back().second++;
+                auto m = refs[n][next];
+                if (order[m] == none) {
+                    order[m] = low[m] = counter++;
+                    members.push_back(m);
+                    stack.emplace_back(m, 0);
+                } else if (comp[m] == none)
+                    low[n] = std::min(low[n], order[m]);
+            } else {
+                if (low[n] == order[n]) {
+                    uint32_t m;
+                    do {
+                        m = members.back();
+                        members.pop_back();
+                        comp[m] = nrComps;
+                    } while (m != n);
+                    nrComps++;
+                }
+                stack.pop_back();
+                if (!stack.empty()) {
+                    auto parent = stack.back().first;
+                    low[parent] = std::min(low[parent], low[n]);
+                }
+            }
+        }
+    }
+
+    std::vector<std::vector<uint32_t>> compRefs(nrComps);
+    std::vector<uint64_t> compNarSizes(nrComps, 0), compDownloadSizes(nrComps, 0);
+    for (uint32_t n = 0; n < size; ++n) {
+        compNarSizes[comp[n]] += narSizes[n];
+        compDownloadSizes[comp[n]] += downloadSizes[n];
+        for (auto m : refs[n])
+            if (comp[m] != comp[n])
+                compRefs[comp[n]].push_back(comp[m]);
+    }
+    for (auto & r : compRefs) {
+        std::sort(r.begin(), r.end());
+        r.erase(std::unique(r.begin(), r.end()), r.end());
+    }
+
+    std::vector<bool> wanted(nrComps, false);
+    for (auto & path : paths)
+        wanted[comp[*index.find(path)]] = true;
+
+    /* Compute the closure of every component as a bitset, in
+       topological order, by or-ing the bitsets of its references. To
+       bound memory use, do this for one block of target components at
+       a time: in each pass, a bitset only says which components in the
+       current block are in the closure. Since components only refer to
+       lower-numbered components, those below the block can be
+       skipped. */
+    const size_t maxBitsetMemory = 64 * 1024 * 1024;
+    size_t words = std::max((size_t) 1,
+        std::min(((size_t) nrComps + 63) / 64, maxBitsetMemory / 8 / std::max((size_t) nrComps, (size_t) 1)));
+    size_t blockSize = words * 64;
+
+    std::vector<std::pair<uint64_t, uint64_t>> totals(nrComps, {0, 0});
+    std::vector<uint64_t> bits;
+    std::vector<bool> nonEmpty;
+
+    for (size_t lo = 0; lo < nrComps; lo += blockSize) {
+        checkInterrupt();
+
+        size_t hi = std::min(lo + blockSize, (size_t) nrComps);
+        bits.assign((nrComps - lo) * words, 0);
+        nonEmpty.assign(nrComps - lo, false);
+
+        for (size_t c = lo; c < nrComps; ++c) {
+            auto row = &bits[(c - lo) * words];
+            bool rowNonEmpty = false;
+
+            if (c < hi) {
+                row[(c - lo) / 64] |= (uint64_t) 1 << ((c - lo) % 64);
+                rowNonEmpty = true;
+            }
+
+            for (auto r : compRefs[c]) {
+                if (r < lo || !nonEmpty[r - lo]) continue;
+                auto row2 = &bits[(r - lo) * words];
+                for (size_t w = 0; w < words; ++w)
+                    row[w] |= row2[w];
+                rowNonEmpty = true;
+            }
+
+            nonEmpty[c - lo] = rowNonEmpty;
+
+            if (wanted[c] && rowNonEmpty)
+                for (size_t w = 0; w < words; ++w)
+                    for (auto b = row[w]; b; b &= b - 1) {
+                        auto d = lo + w * 64 + __builtin_ctzll(b);
+                        totals[c].first += compNarSizes[d];
+                        totals[c].second += compDownloadSizes[d];
+                    }
+        }
+    }
+
+    std::map<StorePath, std::pair<uint64_t, uint64_t>> res;
+    for (auto & path : paths) {
+        auto n = *index.find(path);
+        if (valid[n])
+            res.insert_or_assign(path, totals[comp[n]]);
+    }
+    return res;
 }
 
 
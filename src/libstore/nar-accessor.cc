@@ -1,11 +1,15 @@
 #include "nar-accessor.hh"
 #include "archive.hh"
+#include "hash.hh"
 #include "json.hh"
 
 #include <map>
 #include <stack>
 #include <algorithm>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <nlohmann/json.hpp>
 
 namespace nix {
@@ -22,6 +26,10 @@ struct NarMember
 
     std::string target;
 
+    /* If this is a regular file and the NAR was indexed with
+       `fileHashes', the SHA-256 hash of its serialisation as a NAR. */
+    std::optional<Hash> narHash;
+
     /* If this is a directory, all the children of the directory. */
     std::map<std::string, NarMember> children;
 };
@@ -32,6 +40,8 @@ struct NarAccessor : public FSAccessor
 
     GetNarBytes getNarBytes;
 
+    bool fileHashes = false;
+
     NarMember root;
 
     struct NarIndexer : ParseSink, Source
@@ -45,6 +55,11 @@ struct NarAccessor : public FSAccessor
 
         uint64_t pos = 0;
 
+        /* The hash of the regular file being read, if `fileHashes'
+           is set, and the number of bytes of it still to come. */
+        std::unique_ptr<HashSink> fileHash;
+        uint64_t fileLeft = 0;
+
         NarIndexer(NarAccessor & acc, Source & source)
             : acc(acc), source(source)
         { }
@@ -85,10 +100,36 @@ struct NarAccessor : public FSAccessor
             assert(size <= std::numeric_limits<uint64_t>::max());
             parents.top()->size = (uint64_t) size;
             parents.top()->start = pos;
+
+            /* Note: this assumes that `executable' comes before
+               `contents', as it does in every NAR produced by
+               dumpPath(). */
+            if (acc.fileHashes) {
+                fileHash = std::make_unique<HashSink>(htSHA256);
+                *fileHash << narVersionMagic1 << "(" << "type" << "regular";
+                if (parents.top()->isExecutable)
+                    *fileHash << "executable" << "";
+                *fileHash << "contents" << size;
+                fileLeft = size;
+                if (!fileLeft) finishFileHash();
+            }
         }
 
         void receiveContents(std::string_view data) override
-        { }
+        {
+            if (!fileHash) return;
+            (*fileHash)(data);
+            fileLeft -= data.size();
+            if (!fileLeft) finishFileHash();
+        }
+
+        void finishFileHash()
+        {
+            writePadding(parents.top()->size, *fileHash);
+            *fileHash << ")";
+            parents.top()->narHash = fileHash->finish().first;
+            fileHash.reset();
+        }
 
         void createSymlink(const Path & path, const string & target) override
         {
@@ -111,7 +152,8 @@ struct NarAccessor : public FSAccessor
         parseDump(indexer, indexer);
     }
 
-    NarAccessor(Source & source)
+    NarAccessor(Source & source, bool fileHashes = false)
+        : fileHashes(fileHashes)
     {
         NarIndexer indexer(*this, source);
         parseDump(indexer, indexer);
@@ -120,33 +162,147 @@ struct NarAccessor : public FSAccessor
     NarAccessor(const std::string & listing, GetNarBytes getNarBytes)
         : getNarBytes(getNarBytes)
     {
-        using json = nlohmann::json;
-
-        std::function<void(NarMember &, json &)> recurse;
-
-        recurse = [&](NarMember & member, json & v) {
-            std::string type = v["type"];
-
-            if (type == "directory") {
-                member.type = FSAccessor::Type::tDirectory;
-                for (auto i = v["entries"].begin(); i != v["entries"].end(); ++i) {
-                    std::string name = i.key();
-                    recurse(member.children[name], i.value());
-                }
-            } else if (type == "regular") {
-                member.type = FSAccessor::Type::tRegular;
-                member.size = v["size"];
-                member.isExecutable = v.value("executable", false);
-                member.start = v["narOffset"];
-            } else if (type == "symlink") {
-                member.type = FSAccessor::Type::tSymlink;
-                member.target = v.value("target", "");
-            } else return;
+        ListingParser parser(root);
+        if (!nlohmann::json::sax_parse(listing, &parser))
+            throw Error("invalid NAR listing");
+        if (parser.version && *parser.version != 1)
+            throw Error("NAR listing has unsupported version %d", *parser.version);
+    }
+
+    /* A SAX parser that builds the tree of members from a NAR listing
+       directly, without building a JSON document first. Besides the
+       output of listNar(), it accepts a `.ls' file, which has it in
+       its `root' attribute. */
+    struct ListingParser : nlohmann::json_sax<nlohmann::json>
+    {
+        enum Kind { Member, Entries, Skip };
+
+        struct Frame
+        {
+            Kind kind;
+            NarMember * member;
         };
 
-        json v = json::parse(listing);
-        recurse(root, v);
-    }
+        std::vector<Frame> stack;
+
+        /* The member or attribute that the next value belongs to. */
+        NarMember * nextMember;
+        std::string currentKey;
+
+        std::optional<uint64_t> version;
+
+        ListingParser(NarMember & root) : nextMember(&root) { }
+
+        bool inMember(std::string_view k)
+        {
+            return !stack.empty() && stack.back().kind == Member && currentKey == k;
+        }
+
+        bool value()
+        {
+            currentKey.clear();
+            return true;
+        }
+
+        bool null() override { return value(); }
+
+        bool boolean(bool val) override
+        {
+            if (inMember("executable"))
+                stack.back().member->isExecutable = val;
+            return value();
+        }
+
+        bool number_integer(number_integer_t val) override
+        {
+            return val < 0 ? value() : number_unsigned(val);
+        }
+
+        bool number_unsigned(number_unsigned_t val) override
+        {
+            if (inMember("size"))
+                stack.back().member->size = val;
+            else if (inMember("narOffset"))
+                stack.back().member->start = val;
+            else if (stack.size() == 1 && inMember("version"))
+                version = val;
+            return value();
+        }
+
+        bool number_float(number_float_t val, const string_t & s) override { return value(); }
+
+        bool string(string_t & val) override
+        {
+            if (inMember("type")) {
+                auto & member(*stack.back().member);
+                if (val == "directory")
+                    member.type = FSAccessor::Type::tDirectory;
+                else if (val == "regular")
+                    member.type = FSAccessor::Type::tRegular;
+                else if (val == "symlink")
+                    member.type = FSAccessor::Type::tSymlink;
+            } else if (inMember("target"))
+                stack.back().member->target = val;
+            return value();
+        }
+
+#if NLOHMANN_JSON_VERSION_MAJOR >= 3 && NLOHMANN_JSON_VERSION_MINOR >= 8
+        bool binary(binary_t & val) override { return value(); }
+#endif
+
+        bool start_object(std::size_t) override
+        {
+            if (stack.empty())
+                stack.push_back({Member, nextMember});
+            else if (inMember("entries"))
+                stack.push_back({Entries, stack.back().member});
+            else if (stack.size() == 1 && inMember("root"))
+                stack.push_back({Member, stack.back().member});
+            else if (stack.back().kind == Entries)
+                stack.push_back({Member, &stack.back().member->children[currentKey]});
+            else
+                stack.push_back({Skip, nullptr});
+            currentKey.clear();
+            return true;
+        }
+
+        bool key(string_t & val) override
+        {
+            currentKey = val;
+            return true;
+        }
+
+        bool end_object() override
+        {
+            auto frame = stack.back();
+            stack.pop_back();
+            if (frame.kind == Member) {
+                auto & member(*frame.member);
+                if (member.type != FSAccessor::Type::tDirectory)
+                    member.children.clear();
+                if (member.type != FSAccessor::Type::tRegular)
+                    member.size = member.start = 0;
+            }
+            return value();
+        }
+
+        bool start_array(std::size_t) override
+        {
+            stack.push_back({Skip, nullptr});
+            return true;
+        }
+
+        bool end_array() override
+        {
+            stack.pop_back();
+            return value();
+        }
+
+        bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception & e) override
+        {
+            throw Error("invalid NAR listing: %s", e.what());
+        }
+    };
 
     NarMember * find(const Path & path)
     {
@@ -229,9 +385,9 @@ ref<FSAccessor> makeNarAccessor(ref<const std::string> nar)
     return make_ref<NarAccessor>(nar);
 }
 
-ref<FSAccessor> makeNarAccessor(Source & source)
+ref<FSAccessor> makeNarAccessor(Source & source, bool fileHashes)
 {
-    return make_ref<NarAccessor>(source);
+    return make_ref<NarAccessor>(source, fileHashes);
 }
 
 ref<FSAccessor> makeLazyNarAccessor(const std::string & listing,
@@ -240,8 +396,47 @@ ref<FSAccessor> makeLazyNarAccessor(const std::string & listing,
     return make_ref<NarAccessor>(listing, getNarBytes);
 }
 
+ref<FSAccessor> makeNarFileAccessor(const Path & narFile, AutoCloseFD fd)
+{
+    if (!fd) {
+        fd = open(narFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd)
+            throw SysError("opening NAR file '%s'", narFile);
+    }
+
+    auto fd2 = std::make_shared<AutoCloseFD>(std::move(fd));
+
+    /* Build the index by streaming the NAR through the parser, which
+       only records the positions of file contents. */
+    if (lseek(fd2->get(), 0, SEEK_SET) == -1)
+        throw SysError("seeking in '%s'", narFile);
+    FdSource source(fd2->get());
+    auto acc = make_ref<NarAccessor>(source);
+
+    /* Read file contents on demand. pread() doesn't change the file
+       offset, so concurrent reads don't interfere. */
+    acc->getNarBytes = [narFile, fd2](uint64_t offset, uint64_t length) {
+        std::string buf(length, 0);
+        uint64_t done = 0;
+        while (done < length) {
+            checkInterrupt();
+            auto n = pread(fd2->get(), buf.data() + done, length - done, offset + done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading NAR file '%s'", narFile);
+            }
+            if (n == 0)
+                throw EndOfFile("NAR file '%s' is truncated", narFile);
+            done += n;
+        }
+        return buf;
+    };
+
+    return acc;
+}
+
 void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
-    const Path & path, bool recurse)
+    const Path & path, bool recurse, bool fileHashes)
 {
     auto st = accessor->stat(path);
 
@@ -255,6 +450,21 @@ void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
             obj.attr("executable", true);
         if (st.narOffset)
             obj.attr("narOffset", st.narOffset);
+        if (fileHashes) {
+            /* Use the hash computed while indexing the NAR, if any. */
+            auto narAccessor = std::dynamic_pointer_cast<NarAccessor>(accessor.get_ptr());
+            auto member = narAccessor ? narAccessor->find(path) : nullptr;
+            if (member && member->narHash) {
+                obj.attr("narHash", member->narHash->to_string(Base32, true));
+                break;
+            }
+            HashSink hashSink(htSHA256);
+            hashSink << narVersionMagic1 << "(" << "type" << "regular";
+            if (st.isExecutable)
+                hashSink << "executable" << "";
+            hashSink << "contents" << accessor->readFile(path) << ")";
+            obj.attr("narHash", hashSink.finish().first.to_string(Base32, true));
+        }
         break;
     case FSAccessor::Type::tDirectory:
         obj.attr("type", "directory");
@@ -263,7 +473,7 @@ void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
             for (auto & name : accessor->readDirectory(path)) {
                 if (recurse) {
                     auto res3 = res2.placeholder(name);
-                    listNar(res3, accessor, path + "/" + name, true);
+                    listNar(res3, accessor, path + "/" + name, true, fileHashes);
                 } else
                     res2.object(name);
             }
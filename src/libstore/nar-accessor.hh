@@ -3,6 +3,7 @@
 #include <functional>
 
 #include "fs-accessor.hh"
+#include "util.hh"
 
 namespace nix {
 
@@ -12,10 +13,22 @@ struct Source;
    file. */
 ref<FSAccessor> makeNarAccessor(ref<const std::string> nar);
 
-ref<FSAccessor> makeNarAccessor(Source & source);
+/* Return an object that lists the contents of the NAR read from
+   `source'. File contents are not retained, so its readFile() method
+   doesn't work. If `fileHashes' is set, the file hashes included by
+   listNar() are computed while reading the NAR. */
+ref<FSAccessor> makeNarAccessor(Source & source, bool fileHashes = false);
+
+/* Return an object that provides access to the contents of the NAR
+   file `narFile' (or the already opened `fd'). The NAR is parsed once
+   to index it, and the contents of files are read from the file when
+   needed, so the NAR is never held in memory. */
+ref<FSAccessor> makeNarFileAccessor(const Path & narFile, AutoCloseFD fd = AutoCloseFD());
 
 /* Create a NAR accessor from a NAR listing (in the format produced by
-   listNar()). The callback getNarBytes(offset, length) is used by the
+   listNar(), or a `.ls' file of a binary cache, which contains it in
+   its `root' attribute). The listing is parsed incrementally, so no
+   JSON document is built for it. The callback getNarBytes(offset, length) is used by the
    readFile() method of the accessor to get the contents of files
    inside the NAR. */
 typedef std::function<std::string(uint64_t, uint64_t)> GetNarBytes;
@@ -27,8 +40,11 @@ ref<FSAccessor> makeLazyNarAccessor(
 class JSONPlaceholder;
 
 /* Write a JSON representation of the contents of a NAR (except file
-   contents). */
+   contents). If `fileHashes' is set, the listing of each regular file
+   includes the SHA-256 hash of its serialisation as a NAR (i.e. the
+   name of the file in the `.links' directory of a store optimised by
+   `nix-store --optimise'). */
 void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
-    const Path & path, bool recurse);
+    const Path & path, bool recurse, bool fileHashes = false);
 
 }
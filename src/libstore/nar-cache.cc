@@ -0,0 +1,205 @@
+#include "nar-cache.hh"
+#include "globals.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+/* Temporary files older than this are left over from interrupted
+   downloads, and are deleted by evict(). */
+static const time_t staleTempFileAge = 24 * 3600;
+
+NarCache::NarCache(const Path & dir, uint64_t maxSize)
+    : dir(dir)
+    , maxSize(maxSize)
+{
+    createDirs(dir);
+}
+
+Path NarCache::pathFor(const Hash & narHash)
+{
+    return fmt("%s/%s.nar", dir, narHash.to_string(Base32, false));
+}
+
+bool NarCache::get(const Hash & narHash, uint64_t narSize, Sink & sink)
+{
+    auto path = pathFor(narHash);
+
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) return false;
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("getting status of '%s'", path);
+
+    if (narSize && (uint64_t) st.st_size != narSize) {
+        debug("cached NAR '%s' has the wrong size, ignoring it", path);
+        unlink(path.c_str());
+        return false;
+    }
+
+    /* The cache may be shared with other users and machines, so check
+       the contents before passing them on. NARs are added by renaming
+       them into place, so the file can't change after this. */
+    HashSink hashSink(narHash.type);
+    drainFD(fd.get(), hashSink);
+    if (hashSink.finish().first != narHash) {
+        debug("cached NAR '%s' has the wrong hash, ignoring it", path);
+        unlink(path.c_str());
+        return false;
+    }
+    if (lseek(fd.get(), 0, SEEK_SET) == -1)
+        throw SysError("seeking in '%s'", path);
+
+    /* Record the use for evict(). The access time is not reliable,
+       since file systems are often mounted with `noatime'. */
+    futimens(fd.get(), nullptr);
+
+    debug("using cached NAR '%s'", path);
+
+    drainFD(fd.get(), sink);
+
+    return true;
+}
+
+NarCache::Writer::Writer(NarCache & cache, const Hash & narHash)
+    : cache(cache)
+    , narHash(narHash)
+    , hashSink(narHash.type)
+{
+    static std::atomic<unsigned int> counter{0};
+    tmpPath = fmt("%s/.tmp-%d-%d", cache.dir, getpid(), counter++);
+    fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (!fd)
+        debug("cannot create '%s': %s", tmpPath, strerror(errno));
+}
+
+NarCache::Writer::~Writer()
+{
+    if (fd) {
+        fd = -1;
+        unlink(tmpPath.c_str());
+    }
+}
+
+void NarCache::Writer::operator () (std::string_view data)
+{
+    if (!fd) return;
+    hashSink(data);
+    try {
+        writeFull(fd.get(), data, false);
+    } catch (SysError & e) {
+        debug("cannot write '%s': %s", tmpPath, e.msg());
+        fd = -1;
+        unlink(tmpPath.c_str());
+    }
+}
+
+void NarCache::Writer::commit()
+{
+    if (!fd) return;
+
+    try {
+        auto [actualHash, size] = hashSink.finish();
+        if (actualHash != narHash)
+            throw Error("NAR has hash '%s' instead of '%s'",
+                actualHash.to_string(SRI, true), narHash.to_string(SRI, true));
+        if (::close(fd.release()) == -1)
+            throw SysError("writing '%s'", tmpPath);
+        if (rename(tmpPath.c_str(), cache.pathFor(narHash).c_str()) == -1)
+            throw SysError("renaming '%s'", tmpPath);
+        cache.added(size);
+    } catch (Error & e) {
+        unlink(tmpPath.c_str());
+        debug("cannot add NAR to the NAR cache: %s", e.msg());
+    }
+}
+
+std::unique_ptr<NarCache::Writer> NarCache::add(const Hash & narHash)
+{
+    return std::unique_ptr<Writer>(new Writer(*this, narHash));
+}
+
+void NarCache::added(uint64_t size)
+{
+    if (!maxSize) return;
+
+    /* Only scan the directory when the cache may have become too
+       big, rather than after every NAR. Since other processes may
+       add to the cache as well, the scan is what decides which NARs
+       to delete. */
+    auto state(state_.lock());
+    if (state->totalSize) {
+        *state->totalSize += size;
+        if (*state->totalSize <= maxSize) return;
+    }
+    state->totalSize = evict();
+}
+
+uint64_t NarCache::evict()
+{
+    struct Entry
+    {
+        Path path;
+        time_t mtime;
+        uint64_t size;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+    auto now = time(nullptr);
+
+    for (auto & i : readDirectory(dir)) {
+        auto path = dir + "/" + i.name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1) continue;
+        if (hasPrefix(i.name, ".tmp-")) {
+            if (st.st_mtime < now - staleTempFileAge)
+                unlink(path.c_str());
+            continue;
+        }
+        if (!hasSuffix(i.name, ".nar")) continue;
+        entries.push_back({path, st.st_mtime, (uint64_t) st.st_size});
+        totalSize += st.st_size;
+    }
+
+    if (totalSize <= maxSize) return totalSize;
+
+    /* Delete down to 90% of the maximum size, so that NARs are
+       deleted in batches rather than after every download. */
+    auto target = maxSize / 10 * 9;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) {
+        return a.mtime < b.mtime;
+    });
+
+    for (auto & entry : entries) {
+        if (totalSize <= target) break;
+        debug("deleting least recently used NAR '%s'", entry.path);
+        if (unlink(entry.path.c_str()) == -1 && errno != ENOENT)
+            throw SysError("deleting '%s'", entry.path);
+        totalSize -= entry.size;
+    }
+
+    return totalSize;
+}
+
+std::shared_ptr<NarCache> getNarCache()
+{
+    static std::shared_ptr<NarCache> cache = []() -> std::shared_ptr<NarCache> {
+        if (settings.narCache.get().empty()) return nullptr;
+        try {
+            return std::make_shared<NarCache>(settings.narCache, settings.narCacheMaxSize);
+        } catch (Error & e) {
+            warn("not using the NAR cache: %s", e.msg());
+            return nullptr;
+        }
+    }();
+    return cache;
+}
+
+}
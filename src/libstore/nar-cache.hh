@@ -0,0 +1,86 @@
+#pragma once
+
+#include "hash.hh"
+#include "serialise.hh"
+#include "sync.hh"
+
+namespace nix {
+
+/* A directory of NARs, keyed by their hash, that BinaryCacheStore
+   consults before downloading a NAR, and adds the NARs it downloads
+   to (see the `nar-cache' setting). Since the NARs are
+   content-addressed, the cache can be shared between binary caches,
+   users and machines. When the cache grows beyond its maximum size,
+   the least recently used NARs are deleted. */
+class NarCache
+{
+public:
+
+    NarCache(const Path & dir, uint64_t maxSize);
+
+    /* Write the NAR with hash `narHash' to `sink'. Returns false,
+       without writing anything, if the NAR is not in the cache, if
+       `narSize' is non-zero and doesn't match the size of the cached
+       NAR, or if the cached NAR doesn't have hash `narHash' (in which
+       case it is deleted). */
+    bool get(const Hash & narHash, uint64_t narSize, Sink & sink);
+
+    /* A sink that writes a NAR to a temporary file, which commit()
+       adds to the cache if the NAR has the expected hash. Errors
+       writing the file are not propagated, since the cache is only an
+       optimisation; they just cause commit() to do nothing. */
+    struct Writer : Sink
+    {
+        ~Writer();
+
+        void operator () (std::string_view data) override;
+
+        void commit();
+
+    private:
+
+        friend class NarCache;
+
+        NarCache & cache;
+        Hash narHash;
+        HashSink hashSink;
+        Path tmpPath;
+        AutoCloseFD fd;
+
+        Writer(NarCache & cache, const Hash & narHash);
+    };
+
+    std::unique_ptr<Writer> add(const Hash & narHash);
+
+private:
+
+    Path dir;
+    uint64_t maxSize;
+
+    struct State
+    {
+        /* The total size of the NARs in the cache, as of the last
+           scan of the directory plus the NARs added by this process
+           since. Unknown until the first NAR is added. */
+        std::optional<uint64_t> totalSize;
+    };
+
+    Sync<State> state_;
+
+    Path pathFor(const Hash & narHash);
+
+    /* Account for a NAR of `size' bytes having been added, and if the
+       cache may now be bigger than its maximum size, delete the least
+       recently used NARs. */
+    void added(uint64_t size);
+
+    /* Scan the cache, deleting the least recently used NARs until it
+       is within its maximum size, and return its size. */
+    uint64_t evict();
+};
+
+/* Return the NAR cache configured by the `nar-cache' setting, or
+   nullptr if it's not set. */
+std::shared_ptr<NarCache> getNarCache();
+
+}
@@ -2,9 +2,12 @@
 #include "sync.hh"
 #include "sqlite.hh"
 #include "globals.hh"
+#include "lru-cache.hh"
 
 #include <sqlite3.h>
 
+#include <thread>
+
 namespace nix {
 
 static const char * schema = R"sql(
@@ -38,6 +41,24 @@ create table if not exists NARs (
     foreign key (cache) references BinaryCaches(id) on delete cascade
 );
 
+create table if not exists Indexes (
+    cache            integer primary key not null,
+    timestamp        integer not null,
+    present          integer not null,
+    hashParts        text,
+    foreign key (cache) references BinaryCaches(id) on delete cascade
+);
+
+create table if not exists Realisations (
+    cache            integer not null,
+    outputId         text not null,
+    outputPath       text,
+    timestamp        integer not null,
+    present          integer not null,
+    primary key (cache, outputId),
+    foreign key (cache) references BinaryCaches(id) on delete cascade
+);
+
 create table if not exists LastPurge (
     dummy            text primary key,
     value            integer
@@ -58,17 +79,56 @@ public:
         Path storeDir;
         bool wantMassQuery;
         int priority;
+        /* The cache's index and the time it was recorded, if it has
+           been read from the database. */
+        std::optional<std::pair<time_t, std::shared_ptr<const StringSet>>> index;
     };
 
     struct State
     {
         SQLite db;
-        SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, purgeCache;
+        SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, purgeCache,
+            insertIndex, queryIndex, insertRealisation, insertMissingRealisation, queryRealisation;
         std::map<std::string, Cache> caches;
     };
 
     Sync<State> _state;
 
+    /* Lookup results are written to the database in batches by a
+       background thread, so that lookups don't have to wait for
+       SQLite. Entries are keyed by cache ID and hash part. */
+    typedef std::pair<int, std::string> Key;
+
+    struct Entry
+    {
+        time_t timestamp;
+        /* Null if the path is missing from the cache. */
+        std::shared_ptr<const ValidPathInfo> info;
+    };
+
+    struct Pending
+    {
+        /* Entries that haven't been written to the database yet. */
+        std::map<Key, Entry> entries;
+        bool quit = false;
+    };
+
+    Sync<Pending> _pending;
+    std::condition_variable wakeup;
+    std::thread writerThread;
+
+    /* Recent lookup results, which are served without querying the
+       database. */
+    struct KeyHash
+    {
+        size_t operator () (const Key & key) const
+        {
+            return std::hash<std::string>()(key.second) ^ key.first;
+        }
+    };
+
+    SharedLRUCache<Key, Entry, KeyHash> recent{65536};
+
     NarInfoDiskCacheImpl()
     {
         auto state(_state.lock());
@@ -96,7 +156,22 @@ public:
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
         state->queryNAR.create(state->db,
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca, timestamp from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+
+        state->insertIndex.create(state->db,
+            "insert or replace into Indexes(cache, timestamp, present, hashParts) values (?, ?, ?, ?)");
+
+        state->queryIndex.create(state->db,
+            "select timestamp, present, hashParts from Indexes where cache = ?");
+
+        state->insertRealisation.create(state->db,
+            "insert or replace into Realisations(cache, outputId, outputPath, timestamp, present) values (?, ?, ?, ?, 1)");
+
+        state->insertMissingRealisation.create(state->db,
+            "insert or replace into Realisations(cache, outputId, timestamp, present) values (?, ?, ?, 0)");
+
+        state->queryRealisation.create(state->db,
+            "select present, outputPath from Realisations where cache = ? and outputId = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
 
         /* Periodically purge expired entries from the database. */
         retrySQLite<void>([&]() {
@@ -117,11 +192,127 @@ public:
 
                 debug("deleted %d entries from the NAR info disk cache", sqlite3_changes(state->db));
 
+                SQLiteStmt(state->db,
+                    "delete from Realisations where ((present = 0 and timestamp < ?) or (present = 1 and timestamp < ?))")
+                    .use()
+                    (now - std::max(settings.ttlNegativeNarInfoCache.get(), 3600U))
+                    (now - std::max(settings.ttlPositiveNarInfoCache.get(), 30 * 24 * 3600U))
+                    .exec();
+
+                SQLiteStmt(state->db,
+                    "delete from Indexes where timestamp < ?")
+                    .use()
+                    (now - std::max(settings.ttlNegativeNarInfoCache.get(), 3600U))
+                    .exec();
+
                 SQLiteStmt(state->db,
                     "insert or replace into LastPurge(dummy, value) values ('', ?)")
                     .use()(now).exec();
             }
         });
+
+        writerThread = std::thread([this]() { writer(); });
+    }
+
+    ~NarInfoDiskCacheImpl()
+    {
+        _pending.lock()->quit = true;
+        wakeup.notify_one();
+        writerThread.join();
+    }
+
+    void writer()
+    {
+        while (true) {
+            std::map<Key, Entry> entries;
+            bool quit;
+
+            {
+                auto pending(_pending.lock());
+                while (pending->entries.empty() && !pending->quit)
+                    pending.wait(wakeup);
+                /* Wait a bit for more entries, to make the
+                   transaction worthwhile. */
+                pending.wait_for(wakeup, std::chrono::milliseconds(100),
+                    [&]() { return pending->quit; });
+                entries = pending->entries;
+                quit = pending->quit;
+            }
+
+            if (!entries.empty()) {
+                try {
+                    retrySQLite<void>([&]() {
+                        auto state(_state.lock());
+                        SQLiteTxn txn(state->db);
+                        for (auto & [key, entry] : entries)
+                            writeEntry(*state, key, entry);
+                        txn.commit();
+                    });
+                } catch (...) {
+                    ignoreException();
+                }
+
+                /* Forget the written entries, unless they were
+                   updated in the meantime. */
+                auto pending(_pending.lock());
+                for (auto & [key, entry] : entries) {
+                    auto i = pending->entries.find(key);
+                    if (i != pending->entries.end()
+                        && i->second.timestamp == entry.timestamp
+                        && i->second.info == entry.info)
+                        pending->entries.erase(i);
+                }
+            }
+
+            if (quit) break;
+        }
+    }
+
+    void writeEntry(State & state, const Key & key, const Entry & entry)
+    {
+        auto & [cacheId, hashPart] = key;
+        auto & info = entry.info;
+
+        if (info) {
+
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+
+            //assert(hashPart == storePathToHash(info->path));
+
+            state.insertNAR.use()
+                (cacheId)
+                (hashPart)
+                (std::string(info->path.name()))
+                (narInfo ? narInfo->url : "", narInfo != 0)
+                (narInfo ? narInfo->compression : "", narInfo != 0)
+                (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
+                (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                (info->narHash.to_string(Base32, true))
+                (info->narSize)
+                (concatStringsSep(" ", info->shortRefs()))
+                (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
+                (concatStringsSep(" ", info->sigs))
+                (renderContentAddress(info->ca))
+                (entry.timestamp).exec();
+
+        } else {
+            state.insertMissingNAR.use()
+                (cacheId)
+                (hashPart)
+                (entry.timestamp).exec();
+        }
+    }
+
+    /* Look up a lookup result that hasn't been written yet or was
+       used recently. */
+    std::optional<Entry> lookupEntry(const Key & key)
+    {
+        {
+            auto pending(_pending.lock());
+            auto i = pending->entries.find(key);
+            if (i != pending->entries.end()) return i->second;
+        }
+        return recent.get(key);
     }
 
     Cache & getCache(State & state, const std::string & uri)
@@ -131,6 +322,30 @@ public:
         return i->second;
     }
 
+    /* Return the index of the given cache if it hasn't expired. Since
+       the index is used to answer negative lookups, it expires at the
+       same rate as negative NAR info entries. */
+    std::optional<std::shared_ptr<const StringSet>> getIndex(State & state, Cache & cache)
+    {
+        if (!cache.index) {
+            auto queryIndex(state.queryIndex.use()(cache.id));
+            if (!queryIndex.next())
+                cache.index = {0, nullptr};
+            else {
+                std::shared_ptr<StringSet> index;
+                if (queryIndex.getInt(1))
+                    index = std::make_shared<StringSet>(
+                        tokenizeString<StringSet>(queryIndex.getStr(2), "\n"));
+                cache.index = {queryIndex.getInt(0), index};
+            }
+        }
+
+        if (cache.index->first <= time(0) - settings.ttlNegativeNarInfoCache)
+            return std::nullopt;
+
+        return cache.index->second;
+    }
+
     void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority) override
     {
         retrySQLite<void>([&]() {
@@ -170,25 +385,53 @@ public:
     std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) override
     {
+        auto now = time(0);
+
+        auto cacheId = retrySQLite<int>([&]() {
+            auto state(_state.lock());
+            return getCache(*state, uri).id;
+        });
+
+        Key key{cacheId, hashPart};
+
+        if (auto entry = lookupEntry(key)) {
+            if (!entry->info) {
+                if (entry->timestamp > now - settings.ttlNegativeNarInfoCache)
+                    return {oInvalid, 0};
+            } else {
+                if (entry->timestamp > now - settings.ttlPositiveNarInfoCache) {
+                    auto narInfo = std::dynamic_pointer_cast<const NarInfo>(entry->info);
+                    return {oValid, narInfo
+                        ? std::make_shared<NarInfo>(*narInfo)
+                        : std::make_shared<NarInfo>(*entry->info)};
+                }
+            }
+        }
+
         return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
             [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
             auto state(_state.lock());
 
             auto & cache(getCache(*state, uri));
 
-            auto now = time(0);
-
             auto queryNAR(state->queryNAR.use()
                 (cache.id)
                 (hashPart)
                 (now - settings.ttlNegativeNarInfoCache)
                 (now - settings.ttlPositiveNarInfoCache));
 
+            /* Paths missing from the cache's index may have been
+               added after it was written, so they're unknown rather
+               than invalid. */
             if (!queryNAR.next())
                 return {oUnknown, 0};
 
-            if (!queryNAR.getInt(0))
+            auto timestamp = queryNAR.getInt(12);
+
+            if (!queryNAR.getInt(0)) {
+                recent.upsert(key, Entry{timestamp, nullptr});
                 return {oInvalid, 0};
+            }
 
             auto namePart = queryNAR.getStr(1);
             auto narInfo = make_ref<NarInfo>(
@@ -208,6 +451,8 @@ public:
                 narInfo->sigs.insert(sig);
             narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
 
+            recent.upsert(key, Entry{timestamp, std::make_shared<const NarInfo>(*narInfo)});
+
             return {oValid, narInfo};
         });
     }
@@ -215,40 +460,100 @@ public:
     void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) override
+    {
+        auto cacheId = retrySQLite<int>([&]() {
+            auto state(_state.lock());
+            return getCache(*state, uri).id;
+        });
+
+        Key key{cacheId, hashPart};
+        Entry entry{time(0), info};
+
+        recent.upsert(key, entry);
+        _pending.lock()->entries.insert_or_assign(key, entry);
+        wakeup.notify_one();
+    }
+
+    void upsertIndex(const std::string & uri,
+        std::shared_ptr<const StringSet> index) override
     {
         retrySQLite<void>([&]() {
             auto state(_state.lock());
 
             auto & cache(getCache(*state, uri));
 
-            if (info) {
+            auto now = time(0);
+
+            state->insertIndex.use()
+                (cache.id)
+                (now)
+                (index != nullptr)
+                (index ? concatStringsSep("\n", *index) : "", index != nullptr)
+                .exec();
+
+            cache.index = {now, index};
+        });
+    }
+
+    std::optional<std::shared_ptr<const StringSet>> lookupIndex(
+        const std::string & uri) override
+    {
+        return retrySQLite<std::optional<std::shared_ptr<const StringSet>>>([&]() {
+            auto state(_state.lock());
+            return getIndex(*state, getCache(*state, uri));
+        });
+    }
+
+    std::pair<Outcome, std::shared_ptr<const Realisation>> lookupRealisation(
+        const std::string & uri, const DrvOutput & id) override
+    {
+        return retrySQLite<std::pair<Outcome, std::shared_ptr<const Realisation>>>(
+            [&]() -> std::pair<Outcome, std::shared_ptr<const Realisation>> {
+            auto state(_state.lock());
+
+            auto & cache(getCache(*state, uri));
+
+            auto now = time(0);
 
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+            auto queryRealisation(state->queryRealisation.use()
+                (cache.id)
+                (id.to_string())
+                (now - settings.ttlNegativeNarInfoCache)
+                (now - settings.ttlPositiveNarInfoCache));
 
-                //assert(hashPart == storePathToHash(info->path));
+            if (!queryRealisation.next())
+                return {oUnknown, 0};
+
+            if (!queryRealisation.getInt(0))
+                return {oInvalid, 0};
+
+            return {oValid, std::make_shared<const Realisation>(Realisation {
+                .id = id,
+                .outPath = StorePath(queryRealisation.getStr(1)),
+            })};
+        });
+    }
 
-                state->insertNAR.use()
+    void upsertRealisation(
+        const std::string & uri, const DrvOutput & id,
+        std::shared_ptr<const Realisation> realisation) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            auto & cache(getCache(*state, uri));
+
+            if (realisation)
+                state->insertRealisation.use()
                     (cache.id)
-                    (hashPart)
-                    (std::string(info->path.name()))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string(Base32, true))
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
-                    (concatStringsSep(" ", info->sigs))
-                    (renderContentAddress(info->ca))
+                    (id.to_string())
+                    (std::string(realisation->outPath.to_string()))
                     (time(0)).exec();
-
-            } else {
-                state->insertMissingNAR.use()
+            else
+                state->insertMissingRealisation.use()
                     (cache.id)
-                    (hashPart)
+                    (id.to_string())
                     (time(0)).exec();
-            }
         });
     }
 };
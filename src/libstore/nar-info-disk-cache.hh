@@ -2,6 +2,7 @@
 
 #include "ref.hh"
 #include "nar-info.hh"
+#include "realisation.hh"
 
 namespace nix {
 
@@ -29,6 +30,31 @@ public:
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) = 0;
+
+    /* Record the index of a binary cache, i.e. the hash parts of all
+       its valid paths, or a null pointer if the cache has no index.
+       The index is only a positive hint, since paths may have been
+       added to the cache after it was written. */
+    virtual void upsertIndex(const std::string & uri,
+        std::shared_ptr<const StringSet> index) = 0;
+
+    /* Return the recorded index of a binary cache, or nothing if it
+       is unknown or has expired. */
+    virtual std::optional<std::shared_ptr<const StringSet>> lookupIndex(
+        const std::string & uri) = 0;
+
+    /* Look up the realisation of a derivation output in a binary
+       cache. Like NAR info, both realisations and their absence are
+       cached, and expire after the positive and negative NAR info
+       TTL respectively. */
+    virtual std::pair<Outcome, std::shared_ptr<const Realisation>> lookupRealisation(
+        const std::string & uri, const DrvOutput & id) = 0;
+
+    /* Record the realisation of a derivation output, or a null
+       pointer if the binary cache doesn't have one. */
+    virtual void upsertRealisation(
+        const std::string & uri, const DrvOutput & id,
+        std::shared_ptr<const Realisation> realisation) = 0;
 };
 
 /* Return a singleton cache object that can be used concurrently by
@@ -1,7 +1,12 @@
 #include "util.hh"
+#include "finally.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "sqlite.hh"
+#include "thread-pool.hh"
 
+#include <atomic>
+#include <mutex>
 #include <cstdlib>
 #include <cstring>
 #include <sys/types.h>
@@ -9,8 +14,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <regex>
 
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 
 namespace nix {
 
@@ -61,9 +72,53 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+/* Create `dst' as a copy-on-write clone of `src'. Returns false if
+   the file system doesn't support this. */
+static bool reflinkFile(const Path & src, const Path & dst)
 {
-    Strings names;
+#ifdef FICLONE
+    static std::atomic<bool> unsupported{false};
+    if (unsupported) return false;
+
+    AutoCloseFD fdSrc = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdSrc) throw SysError("opening '%1%'", src);
+
+    AutoCloseFD fdDst = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (!fdDst) throw SysError("creating '%1%'", dst);
+
+    if (ioctl(fdDst.get(), FICLONE, fdSrc.get()) == -1) {
+        auto err = errno;
+        fdDst = -1;
+        unlink(dst.c_str());
+        if (err == EOPNOTSUPP || err == EXDEV || err == EINVAL || err == ENOTTY) {
+            printInfo("file system does not support reflinks; using hard links instead");
+            unsupported = true;
+            return false;
+        }
+        errno = err;
+        throw SysError("cannot clone '%1%' to '%2%'", src, dst);
+    }
+
+    fdDst = -1;
+
+    /* Copy the execute bit, which is part of the file's hash, and
+       make the clone read-only with a canonical timestamp. */
+    if (chmod(dst.c_str(), lstat(src).st_mode & 0777) == -1)
+        throw SysError("changing mode of '%1%'", dst);
+    canonicaliseTimestampAndPermissions(dst);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash_)
+{
+    /* Read the directory before taking the lock, so that the other
+       jobs don't wait for the file system. */
+    std::vector<std::pair<ino_t, string>> entries;
 
     AutoCloseDir dir(opendir(path.c_str()));
     if (!dir) throw SysError("opening directory '%1%'", path);
@@ -71,24 +126,30 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
-
-        if (inodeHash.count(dirent->d_ino)) {
-            debug(format("'%1%' is already linked") % dirent->d_name);
-            continue;
-        }
-
         string name = dirent->d_name;
         if (name == "." || name == "..") continue;
-        names.push_back(name);
+        entries.emplace_back(dirent->d_ino, std::move(name));
     }
     if (errno) throw SysError("reading directory '%1%'", path);
 
+    Strings names;
+
+    auto inodeHash(inodeHash_.lock());
+
+    for (auto & [ino, name] : entries) {
+        if (inodeHash->count(ino)) {
+            debug(format("'%1%' is already linked") % name);
+            continue;
+        }
+        names.push_back(std::move(name));
+    }
+
     return names;
 }
 
 
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash)
+    const Path & path, Sync<InodeHash> & inodeHash)
 {
     checkInterrupt();
 
@@ -131,7 +192,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     }
 
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
+    if (st.st_nlink > 1 && inodeHash.lock()->count(st.st_ino)) {
         debug("'%s' is already linked, with %d other file(s)", path, st.st_nlink - 2);
         return;
     }
@@ -155,7 +216,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
+            inodeHash.lock()->insert(st.st_ino);
             return;
         }
 
@@ -208,7 +269,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     Path tempLink = (format("%1%/.tmp-link-%2%-%3%")
         % realStoreDir % getpid() % random()).str();
 
-    if (link(linkPath.c_str(), tempLink.c_str()) == -1) {
+    /* Prefer a copy-on-write clone if requested, since it doesn't
+       count against the file system's link limit. */
+    bool reflinked = settings.optimiseUseReflinks && S_ISREG(st.st_mode)
+        && reflinkFile(linkPath, tempLink);
+
+    if (!reflinked && link(linkPath.c_str(), tempLink.c_str()) == -1) {
         if (errno == EMLINK) {
             /* Too many links to the same file (>= 32000 on most file
                systems).  This is likely to happen with empty files.
@@ -249,22 +315,105 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
     Activity act(*logger, actOptimiseStore);
 
     auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+
+    /* A record of the paths that have already been optimised, so that
+       later runs can skip them. Store paths are immutable, so only
+       the registration time needs to be checked, in case a path was
+       deleted and added again since. */
+    struct Record
+    {
+        SQLite db;
+        SQLiteStmt queryPath, insertPath;
+    };
+
+    Sync<Record> record_;
+
+    {
+        auto record(record_.lock());
+        record->db = SQLite(dbDir + "/optimised.sqlite");
+        record->db.isCache();
+        record->db.exec("create table if not exists OptimisedPaths (path text primary key not null, registrationTime integer not null);");
+        record->queryPath.create(record->db,
+            "select 1 from OptimisedPaths where path = ? and registrationTime = ?;");
+        record->insertPath.create(record->db,
+            "insert or replace into OptimisedPaths(path, registrationTime) values (?, ?);");
+    }
+
+    /* Loading the inode hash requires reading all of .links, so only
+       do it if there is something to optimise. */
+    Sync<InodeHash> inodeHash;
+    std::once_flag inodeHashLoaded;
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    struct State
+    {
+        uint64_t done = 0;
+        OptimiseStats stats;
+    };
+
+    Sync<State> state_;
+
+    auto doPath = [&](const StorePath & path) {
+        checkInterrupt();
+
+        Finally progress([&]() {
+            auto state(state_.lock());
+            state->done++;
+            act.progress(state->done, paths.size());
+        });
+
+        std::shared_ptr<const ValidPathInfo> info;
+        try {
+            info = queryPathInfo(path);
+        } catch (InvalidPath &) {
+            return; /* path was GC'ed, probably */
+        }
+
+        auto pathS = printStorePath(path);
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
+        if (retrySQLite<bool>([&]() {
+            auto record(record_.lock());
+            return record->queryPath.use()(pathS)(info->registrationTime).next();
+        })) {
+            debug("'%s' has already been optimised", pathS);
+            return;
+        }
+
+        std::call_once(inodeHashLoaded, [&]() { *inodeHash.lock() = loadInodeHash(); });
+
+        OptimiseStats stats2;
         {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash);
+            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", pathS));
+            optimisePath_(&act, stats2, realStoreDir + "/" + std::string(path.to_string()), inodeHash);
         }
-        done++;
-        act.progress(done, paths.size());
-    }
+
+        retrySQLite<void>([&]() {
+            auto record(record_.lock());
+            record->insertPath.use()(pathS)(info->registrationTime).exec();
+        });
+
+        auto state(state_.lock());
+        state->stats.filesLinked += stats2.filesLinked;
+        state->stats.bytesFreed += stats2.bytesFreed;
+        state->stats.blocksFreed += stats2.blocksFreed;
+    };
+
+    /* Hashing dominates the cost of optimisation, so process several
+       paths in parallel. */
+    ThreadPool pool;
+
+    addTempRoots(paths);
+
+    for (auto & i : paths)
+        pool.enqueue(std::bind(doPath, i));
+
+    pool.process();
+
+    auto state(state_.lock());
+    stats.filesLinked += state->stats.filesLinked;
+    stats.bytesFreed += state->stats.bytesFreed;
+    stats.blocksFreed += state->stats.blocksFreed;
 }
 
 void LocalStore::optimiseStore()
@@ -281,7 +430,7 @@ void LocalStore::optimiseStore()
 void LocalStore::optimisePath(const Path & path)
 {
     OptimiseStats stats;
-    InodeHash inodeHash;
+    Sync<InodeHash> inodeHash;
 
     if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash);
 }
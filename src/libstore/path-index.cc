@@ -0,0 +1,38 @@
+#include "path-index.hh"
+
+#include <cstring>
+
+namespace nix {
+
+StorePathIndex::Id StorePathIndex::add(const StorePath & path)
+{
+    auto name = path.to_string();
+
+    auto i = ids.find(name);
+    if (i != ids.end()) return i->second;
+
+    /* Base names are much shorter than a block, so little space is
+       wasted at the end of each. */
+    if (blockSize - blockUsed < name.size()) {
+        blocks.push_back(std::make_unique<char[]>(std::max(blockSize, name.size())));
+        blockUsed = 0;
+    }
+    auto p = blocks.back().get() + blockUsed;
+    memcpy(p, name.data(), name.size());
+    blockUsed += name.size();
+
+    Id id = names.size();
+    names.emplace_back(p, name.size());
+    ids.emplace(names.back(), id);
+    return id;
+}
+
+
+std::optional<StorePathIndex::Id> StorePathIndex::find(std::string_view baseName) const
+{
+    auto i = ids.find(baseName);
+    if (i == ids.end()) return {};
+    return i->second;
+}
+
+}
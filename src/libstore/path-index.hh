@@ -0,0 +1,66 @@
+#pragma once
+
+#include "path.hh"
+
+#include <unordered_map>
+
+namespace nix {
+
+/* A table that assigns dense integer IDs to store paths, in order of
+   insertion. Algorithms over large closures or over the whole store
+   can use the IDs to keep per-path state in plain vectors, rather
+   than in a std::set<StorePath> or std::map<StorePath, ...> with a
+   heap allocation and string comparisons per node. The base names
+   are stored back to back in large blocks, so adding a path doesn't
+   allocate a string either. */
+class StorePathIndex
+{
+public:
+
+    typedef uint32_t Id;
+
+    StorePathIndex() { }
+    StorePathIndex(StorePathIndex &&) = default;
+    StorePathIndex & operator = (StorePathIndex &&) = default;
+
+    /* Return the ID of 'path', adding it if it's not in the table
+       yet. */
+    Id add(const StorePath & path);
+
+    /* Return the ID of the path with base name 'baseName', if it is
+       in the table. */
+    std::optional<Id> find(std::string_view baseName) const;
+
+    std::optional<Id> find(const StorePath & path) const
+    {
+        return find(path.to_string());
+    }
+
+    std::string_view baseName(Id id) const
+    {
+        return names[id];
+    }
+
+    StorePath operator [] (Id id) const
+    {
+        return StorePath(names[id]);
+    }
+
+    size_t size() const
+    {
+        return names.size();
+    }
+
+private:
+
+    static constexpr size_t blockSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t blockUsed = blockSize;
+
+    /* The base names, which point into 'blocks'. */
+    std::vector<std::string_view> names;
+    std::unordered_map<std::string_view, Id> ids;
+};
+
+}
@@ -2,18 +2,48 @@
 
 namespace nix {
 
+/* The characters allowed in the hash part and in the name of a store
+   path. Store paths are parsed millions of times (e.g. when reading
+   the references of a closure from the database), so they are checked
+   with a table lookup per character rather than a chain of
+   comparisons, in a loop without early exits that the compiler can
+   vectorise. */
+struct StorePathChars
+{
+    bool hash[256] = {}, name[256] = {};
+
+    StorePathChars()
+    {
+        /* Not base32Chars, which may not be initialised yet. */
+        for (auto c : std::string_view("0123456789abcdfghijklmnpqrsvwxyz"))
+            hash[(unsigned char) c] = true;
+        for (int c = 0; c < 256; ++c)
+            name[c] = (c >= '0' && c <= '9')
+                || (c >= 'a' && c <= 'z')
+                || (c >= 'A' && c <= 'Z')
+                || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    }
+};
+
+static const StorePathChars storePathChars;
+
+static bool allOf(std::string_view s, const bool * table)
+{
+    bool ok = true;
+    for (auto c : s) ok &= table[(unsigned char) c];
+    return ok;
+}
+
 static void checkName(std::string_view path, std::string_view name)
 {
     if (name.empty())
         throw BadStorePath("store path '%s' has an empty name", path);
     if (name.size() > 211)
         throw BadStorePath("store path '%s' has a name longer than 211 characters", path);
-    for (auto c : name)
-        if (!((c >= '0' && c <= '9')
-                || (c >= 'a' && c <= 'z')
-                || (c >= 'A' && c <= 'Z')
-                || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '='))
-            throw BadStorePath("store path '%s' contains illegal character '%s'", path, c);
+    if (!allOf(name, storePathChars.name))
+        for (auto c : name)
+            if (!storePathChars.name[(unsigned char) c])
+                throw BadStorePath("store path '%s' contains illegal character '%s'", path, c);
 }
 
 StorePath::StorePath(std::string_view _baseName)
@@ -21,13 +51,19 @@ StorePath::StorePath(std::string_view _baseName)
 {
     if (baseName.size() < HashLen + 1)
         throw BadStorePath("'%s' is too short to be a valid store path", baseName);
-    for (auto c : hashPart())
-        if (c == 'e' || c == 'o' || c == 'u' || c == 't'
-            || !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')))
-            throw BadStorePath("store path '%s' contains illegal base-32 character '%s'", baseName, c);
+    if (!allOf(hashPart(), storePathChars.hash))
+        for (auto c : hashPart())
+            if (!storePathChars.hash[(unsigned char) c])
+                throw BadStorePath("store path '%s' contains illegal base-32 character '%s'", baseName, c);
     checkName(baseName, name());
 }
 
+StorePath::StorePath(std::string_view baseName, Trusted)
+    : baseName(baseName)
+{
+    assert(baseName.size() > HashLen + 1);
+}
+
 StorePath::StorePath(const Hash & hash, std::string_view _name)
     : baseName((hash.to_string(Base32, false) + "-").append(std::string(_name)))
 {
@@ -41,14 +77,37 @@ bool StorePath::isDerivation() const
 
 StorePath StorePath::dummy("ffffffffffffffffffffffffffffffff-x");
 
+/* Whether 'path' is directly in 'storeDir', i.e. '<storeDir>/<name>'
+   where <name> doesn't contain a slash. */
+static bool isCanonicalStorePath(std::string_view storeDir, std::string_view path)
+{
+    return path.size() > storeDir.size() + 1
+        && path.substr(0, storeDir.size()) == storeDir
+        && path[storeDir.size()] == '/'
+        && path.find('/', storeDir.size() + 1) == path.npos;
+}
+
 StorePath Store::parseStorePath(std::string_view path) const
 {
+    /* Most paths are already canonical, so avoid the allocations of
+       canonPath() for them. */
+    if (isCanonicalStorePath(storeDir, path))
+        return StorePath(path.substr(storeDir.size() + 1));
+
     auto p = canonPath(std::string(path));
     if (dirOf(p) != storeDir)
         throw BadStorePath("path '%s' is not in the Nix store", p);
     return StorePath(baseNameOf(p));
 }
 
+StorePath Store::parseTrustedStorePath(std::string_view path) const
+{
+    if (!isCanonicalStorePath(storeDir, path)
+        || path.size() < storeDir.size() + StorePath::HashLen + 3)
+        throw BadStorePath("path '%s' is not in the Nix store", path);
+    return StorePath(path.substr(storeDir.size() + 1), StorePath::Trusted());
+}
+
 std::optional<StorePath> Store::maybeParseStorePath(std::string_view path) const
 {
     try {
@@ -72,7 +131,13 @@ StorePathSet Store::parseStorePathSet(const PathSet & paths) const
 
 std::string Store::printStorePath(const StorePath & path) const
 {
-    return (storeDir + "/").append(path.to_string());
+    auto baseName = path.to_string();
+    std::string res;
+    res.reserve(storeDir.size() + 1 + baseName.size());
+    res.append(storeDir);
+    res.push_back('/');
+    res.append(baseName);
+    return res;
 }
 
 PathSet Store::printStorePathSet(const StorePathSet & paths) const
@@ -23,6 +23,12 @@ public:
 
     StorePath(const Hash & hash, std::string_view name);
 
+    /* Construct a store path from a base name that is known to be
+       valid, e.g. because it was read from the Nix database, without
+       checking it again. See Store::parseTrustedStorePath(). */
+    struct Trusted { };
+    StorePath(std::string_view baseName, Trusted);
+
     std::string_view to_string() const
     {
         return baseName;
@@ -1,6 +1,7 @@
 #include "pathlocks.hh"
 #include "util.hh"
 #include "sync.hh"
+#include "metrics.hh"
 
 #include <cerrno>
 #include <cstdlib>
@@ -109,6 +110,7 @@ bool PathLocks::lockPaths(const PathSet & paths,
             if (!lockFile(fd.get(), ltWrite, false)) {
                 if (wait) {
                     if (waitMsg != "") printError(waitMsg);
+                    metrics::Timer timer(metrics::getMetrics().pathLockWait);
                     lockFile(fd.get(), ltWrite, true);
                 } else {
                     /* Failed to lock this path; release all other
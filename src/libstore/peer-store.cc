@@ -0,0 +1,412 @@
+#include "peer-store.hh"
+#include "binary-cache-store.hh"
+#include "filetransfer.hh"
+#include "nar-info.hh"
+#include "globals.hh"
+#include "callback.hh"
+#include "finally.hh"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include <thread>
+
+namespace nix {
+
+struct PeerStoreConfig : virtual BinaryCacheStoreConfig
+{
+    using BinaryCacheStoreConfig::BinaryCacheStoreConfig;
+
+    const Setting<unsigned int> discoveryPort{(StoreConfig*) this, defaultPeerDiscoveryPort, "discovery-port",
+        "UDP port on which to send discovery requests"};
+    const Setting<unsigned int> discoveryTimeout{(StoreConfig*) this, 200, "discovery-timeout",
+        "how long to wait for peers to answer a discovery request, in milliseconds"};
+    const Setting<Strings> peers{(StoreConfig*) this, {}, "peers",
+        "URLs of peers to use in addition to the discovered ones (e.g. 'http://host:port')"};
+
+    const std::string name() override { return "Peer Store"; }
+};
+
+class PeerStore : public virtual PeerStoreConfig, public virtual BinaryCacheStore
+{
+    /* The address to which discovery requests are sent. */
+    std::string broadcastAddress;
+
+    Sync<std::vector<std::string>> peers_;
+
+public:
+
+    PeerStore(
+        const std::string & scheme,
+        const std::string & broadcastAddress,
+        const Params & params)
+        : StoreConfig(params)
+        , BinaryCacheStoreConfig(params)
+        , PeerStoreConfig(params)
+        , Store(params)
+        , BinaryCacheStore(params)
+        , broadcastAddress(broadcastAddress.empty() ? "255.255.255.255" : broadcastAddress)
+    {
+        /* Peers are on the local network, so prefer them over
+           upstream caches. */
+        priority.setDefault("10");
+    }
+
+    std::string getUri() override
+    {
+        return "peer://" + (broadcastAddress == "255.255.255.255" ? "" : broadcastAddress);
+    }
+
+    static std::set<std::string> uriSchemes() { return {"peer"}; }
+
+    void init() override
+    {
+        auto peers(peers_.lock());
+
+        for (auto & peer : PeerStoreConfig::peers.get())
+            peers->push_back(peer);
+
+        try {
+            for (auto & peer : discoverPeers())
+                if (std::find(peers->begin(), peers->end(), peer) == peers->end())
+                    peers->push_back(peer);
+        } catch (SysError & e) {
+            warn("cannot discover peers: %s", e.msg());
+        }
+
+        debug("found %d peers: %s", peers->size(), concatStringsSep(" ", *peers));
+    }
+
+    std::vector<std::string> discoverPeers()
+    {
+        AutoCloseFD fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (!fd) throw SysError("creating UDP socket");
+
+        int one = 1;
+        if (setsockopt(fd.get(), SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) == -1)
+            throw SysError("enabling broadcast");
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(discoveryPort);
+        if (inet_pton(AF_INET, broadcastAddress.c_str(), &addr.sin_addr) != 1)
+            throw Error("invalid broadcast address '%s'", broadcastAddress);
+
+        if (sendto(fd.get(), peerDiscoveryRequest.data(), peerDiscoveryRequest.size(), 0,
+                (struct sockaddr *) &addr, sizeof(addr)) == -1)
+            throw SysError("sending discovery request to '%s'", broadcastAddress);
+
+        std::vector<std::string> peers;
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(discoveryTimeout);
+
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) break;
+
+            struct pollfd pfd = { .fd = fd.get(), .events = POLLIN };
+            if (poll(&pfd, 1, left) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for discovery replies");
+            }
+            if (!(pfd.revents & POLLIN)) continue;
+
+            char buf[128];
+            struct sockaddr_in from;
+            socklen_t fromLen = sizeof(from);
+            auto n = recvfrom(fd.get(), buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromLen);
+            if (n == -1) continue;
+
+            std::string reply(buf, n);
+            if (!hasPrefix(reply, peerDiscoveryReply)) continue;
+            auto port = string2Int<unsigned int>(trim(reply.substr(peerDiscoveryReply.size())));
+            if (!port) continue;
+
+            char host[INET_ADDRSTRLEN];
+            if (!inet_ntop(AF_INET, &from.sin_addr, host, sizeof(host))) continue;
+
+            auto peer = fmt("http://%s:%d", host, *port);
+            if (std::find(peers.begin(), peers.end(), peer) == peers.end())
+                peers.push_back(peer);
+        }
+
+        return peers;
+    }
+
+    std::vector<std::string> getPeers()
+    {
+        return *peers_.lock();
+    }
+
+    bool fileExists(const std::string & path) override
+    {
+        return findPeer(path).has_value();
+    }
+
+    /* Return the first peer that has the given file. */
+    std::optional<std::string> findPeer(const std::string & path)
+    {
+        for (auto & peer : getPeers()) {
+            try {
+                FileTransferRequest request(peer + "/" + path);
+                request.head = true;
+                request.tries = 1;
+                getFileTransfer()->download(request);
+                return peer;
+            } catch (FileTransferError & e) {
+                if (e.error != FileTransfer::NotFound)
+                    debug("cannot query peer '%s': %s", peer, e.what());
+            }
+        }
+        return std::nullopt;
+    }
+
+    void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType) override
+    {
+        throw Error("cannot write to peer store '%s'", getUri());
+    }
+
+    void getFile(const std::string & path, Sink & sink) override
+    {
+        auto peer = findPeer(path);
+        if (!peer)
+            throw NoSuchBinaryCacheFile("file '%s' does not exist on any peer", path);
+        FileTransferRequest request(*peer + "/" + path);
+        getFileTransfer()->download(std::move(request), sink);
+    }
+
+    StorePathSet queryAllValidPaths() override
+    {
+        unsupported("queryAllValidPaths");
+    }
+};
+
+static RegisterStoreImplementation<PeerStore, PeerStoreConfig> regPeerStore;
+
+
+/* The maximum number of connections served at the same time, and how
+   long (in seconds) a connection may wait for the peer. */
+static constexpr size_t maxPeerConnections = 64;
+static constexpr time_t peerConnectionTimeout = 60;
+
+
+/* Serve a single HTTP request from a peer. */
+static void servePeerRequest(ref<Store> store, int fd, const std::optional<SecretKey> & secretKey)
+{
+    FdSource from(fd);
+    FdSink to(fd);
+
+    auto readLine = [&]() {
+        std::string line;
+        while (true) {
+            char c;
+            from(&c, 1);
+            if (c == '\n') break;
+            if (line.size() > 8192) throw Error("HTTP request line too long");
+            line += c;
+        }
+        return chomp(line);
+    };
+
+    auto requestLine = tokenizeString<std::vector<std::string>>(readLine(), " ");
+    while (!readLine().empty()) ;
+
+    auto respond = [&](const std::string & status, const std::string & contentType,
+        uint64_t length, bool head, std::function<void(Sink &)> body)
+    {
+        to(fmt("HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                status, contentType, length));
+        if (!head) body(to);
+        to.flush();
+    };
+
+    auto notFound = [&](bool head) {
+        respond("404 Not Found", "text/plain", 0, head, [](Sink &) {});
+    };
+
+    if (requestLine.size() != 3 || (requestLine[0] != "GET" && requestLine[0] != "HEAD"))
+        return respond("400 Bad Request", "text/plain", 0, true, [](Sink &) {});
+
+    bool head = requestLine[0] == "HEAD";
+    auto & path = requestLine[1];
+
+    if (path == "/nix-cache-info") {
+        auto s = "StoreDir: " + store->storeDir + "\n";
+        return respond("200 OK", "text/x-nix-cache-info", s.size(), head, [&](Sink & sink) { sink(s); });
+    }
+
+    std::string hashPart;
+    bool wantNar;
+    if (path.size() == 41 && hasSuffix(path, ".narinfo")) {
+        hashPart = path.substr(1, 32);
+        wantNar = false;
+    } else if (path.size() == 41 && hasPrefix(path, "/nar/") && hasSuffix(path, ".nar")) {
+        hashPart = path.substr(5, 32);
+        wantNar = true;
+    } else
+        return notFound(head);
+
+    auto storePath = store->queryPathFromHashPart(hashPart);
+    if (!storePath) return notFound(head);
+
+    auto info = store->queryPathInfo(*storePath);
+
+    if (wantNar)
+        return respond("200 OK", "application/x-nix-nar", info->narSize, head, [&](Sink & sink) {
+            store->narFromPath(*storePath, sink);
+        });
+
+    NarInfo narInfo(*info);
+    narInfo.url = "nar/" + hashPart + ".nar";
+    narInfo.compression = "none";
+    narInfo.fileHash = info->narHash;
+    narInfo.fileSize = info->narSize;
+    if (secretKey)
+        narInfo.sign(*store, *secretKey);
+
+    auto s = narInfo.to_string(*store);
+    respond("200 OK", "text/x-nix-narinfo", s.size(), head, [&](Sink & sink) { sink(s); });
+}
+
+
+void servePeer(ref<Store> store, const std::string & address,
+    uint16_t discoveryPort, uint16_t httpPort,
+    std::optional<SecretKey> secretKey)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+        throw Error("invalid IPv4 address '%s'", address);
+    addr.sin_port = htons(httpPort);
+
+    AutoCloseFD httpFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!httpFd) throw SysError("creating TCP socket");
+
+    int one = 1;
+    setsockopt(httpFd.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(httpFd.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("binding to TCP port %d on '%s'", httpPort, address);
+
+    if (listen(httpFd.get(), 64) == -1)
+        throw SysError("listening on TCP port %d", httpPort);
+
+    AutoCloseFD udpFd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (!udpFd) throw SysError("creating UDP socket");
+
+    addr.sin_port = htons(discoveryPort);
+    if (bind(udpFd.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("binding to UDP port %d on '%s'", discoveryPort, address);
+
+    printInfo("serving '%s' to peers on %s, TCP port %d (discovery on UDP port %d)",
+        store->getUri(), address, httpPort, discoveryPort);
+
+    /* Written to when we're interrupted, which stops both the loop
+       below and the discovery thread. It's never read from, so both
+       see it. */
+    Pipe shutdown;
+    shutdown.create();
+    auto stop = [&]() { writeFull(shutdown.writeSide.get(), "x", false); };
+    auto callback = createInterruptCallback(stop);
+
+    /* Wait until `fd' is readable. Returns false if we're shutting
+       down. */
+    auto waitFor = [&](int fd) {
+        struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = shutdown.readSide.get(), .events = POLLIN },
+        };
+        while (true) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("polling for peer requests");
+            }
+            if (fds[1].revents) return false;
+            if (fds[0].revents) return true;
+        }
+    };
+
+    std::thread discoveryThread([&]() {
+        auto reply = peerDiscoveryReply + fmt("%d\n", httpPort);
+        try {
+            while (waitFor(udpFd.get())) {
+                char buf[128];
+                struct sockaddr_in from;
+                socklen_t fromLen = sizeof(from);
+                auto n = recvfrom(udpFd.get(), buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromLen);
+                if (n == -1) continue;
+                if (std::string(buf, n) != peerDiscoveryRequest) continue;
+                sendto(udpFd.get(), reply.data(), reply.size(), 0, (struct sockaddr *) &from, fromLen);
+            }
+        } catch (Error & e) {
+            printError("error answering discovery requests: %s", e.what());
+        }
+    });
+
+    /* The number of connections being served. It's shared with the
+       connection threads, which are detached. */
+    struct Connections
+    {
+        Sync<size_t> active{0};
+        std::condition_variable changed;
+    };
+    auto connections = std::make_shared<Connections>();
+
+    Finally cleanup([&]() {
+        stop();
+        discoveryThread.join();
+        /* Let the connections finish; they're interrupted as well, and
+           time out otherwise. */
+        auto active(connections->active.lock());
+        while (*active) active.wait(connections->changed);
+    });
+
+    while (true) {
+        checkInterrupt();
+
+        {
+            auto active(connections->active.lock());
+            if (*active >= maxPeerConnections) {
+                active.wait_for(connections->changed, std::chrono::milliseconds(100));
+                continue;
+            }
+        }
+
+        if (!waitFor(httpFd.get())) break;
+
+        AutoCloseFD remote = accept4(httpFd.get(), nullptr, nullptr, SOCK_CLOEXEC);
+        if (!remote) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            throw SysError("accepting connection");
+        }
+
+        /* Don't let an unresponsive peer hold a connection forever. */
+        struct timeval timeout = { .tv_sec = peerConnectionTimeout, .tv_usec = 0 };
+        setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(remote.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        ++*connections->active.lock();
+
+        std::thread([store, secretKey, connections, remote{std::make_shared<AutoCloseFD>(std::move(remote))}]() {
+            try {
+                servePeerRequest(store, remote->get(), secretKey);
+            } catch (BaseError & e) {
+                debug("error serving peer: %s", e.what());
+            }
+            *remote = -1;
+            --*connections->active.lock();
+            connections->changed.notify_all();
+        }).detach();
+    }
+
+    checkInterrupt();
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "store-api.hh"
+#include "crypto.hh"
+
+namespace nix {
+
+/* Peer stores ("peer://") let machines on a local network substitute
+   paths from each other's stores. A client broadcasts a discovery
+   request on a UDP port; each peer that runs servePeer() replies with
+   the TCP port on which it serves its store as an (uncompressed)
+   HTTP binary cache. */
+
+const uint16_t defaultPeerDiscoveryPort = 5380;
+
+const std::string peerDiscoveryRequest = "nix-peer-discover-1\n";
+
+/* The reply is followed by the HTTP port. */
+const std::string peerDiscoveryReply = "nix-peer-1 ";
+
+/* Serve the valid paths of ‘store’ to peers: answer discovery
+   requests on UDP port ‘discoveryPort’, and serve the store over
+   HTTP on TCP port ‘httpPort’, both on the IPv4 address ‘address’.
+   If ‘secretKey’ is set, path info is signed with it in addition to
+   any signatures the paths already have. This function runs until
+   it's interrupted, and then throws Interrupted. */
+void servePeer(ref<Store> store, const std::string & address,
+    uint16_t discoveryPort, uint16_t httpPort,
+    std::optional<SecretKey> secretKey);
+
+}
@@ -30,13 +30,19 @@ static std::optional<GenerationNumber> parseName(const string & profileName, con
 
 
 std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path profile)
+{
+    return findGenerations(profile, readDirectory(dirOf(profile)));
+}
+
+
+std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path profile, const DirEntries & entries)
 {
     Generations gens;
 
     Path profileDir = dirOf(profile);
     auto profileName = std::string(baseNameOf(profile));
 
-    for (auto & i : readDirectory(profileDir)) {
+    for (auto & i : entries) {
         if (auto n = parseName(profileName, i.name)) {
             auto path = profileDir + "/" + i.name;
             gens.push_back({
@@ -209,7 +215,7 @@ void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun)
 }
 
 
-void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, bool dryRun)
+time_t parseOlderThanTimeSpec(const string & timeSpec)
 {
     time_t curTime = time(0);
     string strDays = string(timeSpec, 0, timeSpec.size() - 1);
@@ -218,9 +224,13 @@ void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, b
     if (!days || *days < 1)
         throw Error("invalid number of days specifier '%1%'", timeSpec);
 
-    time_t oldTime = curTime - *days * 24 * 3600;
+    return curTime - *days * 24 * 3600;
+}
+
 
-    deleteGenerationsOlderThan(profile, oldTime, dryRun);
+void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, bool dryRun)
+{
+    deleteGenerationsOlderThan(profile, parseOlderThanTimeSpec(timeSpec), dryRun);
 }
 
 
@@ -2,6 +2,7 @@
 
 #include "types.hh"
 #include "pathlocks.hh"
+#include "util.hh"
 
 #include <time.h>
 
@@ -28,6 +29,12 @@ typedef std::list<Generation> Generations;
    the current generation. */
 std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path profile);
 
+/* Like findGenerations(), but take the generation links from
+   `entries' rather than reading the directory containing the
+   profile. When processing many profiles in the same directory, this
+   avoids reading the directory once per profile. */
+std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path profile, const DirEntries & entries);
+
 class LocalFSStore;
 
 Path createGeneration(ref<LocalFSStore> store, Path profile, StorePath outPath);
@@ -42,6 +49,11 @@ void deleteOldGenerations(const Path & profile, bool dryRun);
 
 void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun);
 
+/* Parse a time specification like `30d' for
+   deleteGenerationsOlderThan(), returning the corresponding point in
+   time. */
+time_t parseOlderThanTimeSpec(const string & timeSpec);
+
 void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, bool dryRun);
 
 void switchLink(Path link, Path target);
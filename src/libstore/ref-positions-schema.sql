@@ -0,0 +1,17 @@
+-- Extension of the sql schema that records where references occur
+-- in the contents of store paths. Won't be loaded unless the
+-- setting `index-reference-positions` is enabled.
+
+create table if not exists RefPositions (
+    referrer  integer not null,
+    reference integer not null,
+    file      text not null,    -- relative to the root of the referrer
+    symlink   integer not null, -- whether the reference is in a symlink target
+    offset    integer not null,
+    excerpt   text not null,
+    foreign key (referrer) references ValidPaths(id) on delete cascade,
+    foreign key (reference) references ValidPaths(id) on delete cascade
+);
+
+create index if not exists IndexRefPositionsReferrer on RefPositions(referrer);
+create index if not exists IndexRefPositionsReference on RefPositions(reference);
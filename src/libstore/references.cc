@@ -3,8 +3,17 @@
 #include "util.hh"
 #include "archive.hh"
 
+#include <array>
 #include <map>
 #include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
@@ -13,36 +22,92 @@ namespace nix {
 static unsigned int refLength = 32; /* characters */
 
 
-static void search(const unsigned char * s, size_t len,
-    StringSet & hashes, StringSet & seen)
+/* Set bit `i % 64' of `mask[i / 64]' if `s[i]' is a base32
+   character. */
+static void classify(const unsigned char * s, size_t len, uint64_t * mask)
 {
-    static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
+    /* Outputs are scanned in parallel, so this must be initialised
+       only once. */
+    static const auto isBase32 = []() {
+        std::array<bool, 256> isBase32{};
         for (unsigned int i = 0; i < base32Chars.size(); ++i)
             isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
+        return isBase32;
+    }();
+
+    size_t i = 0;
+
+#if __SSE2__
+    /* The base32 characters are the digits and the lowercase letters
+       except 'e', 'o', 't' and 'u'. Classify 16 bytes at a time. Note
+       that bytes >= 0x80 compare as negative. */
+    const __m128i below0 = _mm_set1_epi8('0' - 1), above9 = _mm_set1_epi8('9' + 1);
+    const __m128i belowA = _mm_set1_epi8('a' - 1), aboveZ = _mm_set1_epi8('z' + 1);
+    const __m128i e = _mm_set1_epi8('e'), o = _mm_set1_epi8('o');
+    const __m128i t = _mm_set1_epi8('t'), u = _mm_set1_epi8('u');
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, below0), _mm_cmpgt_epi8(above9, c));
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(c, belowA), _mm_cmpgt_epi8(aboveZ, c));
+        __m128i excluded = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(c, e), _mm_cmpeq_epi8(c, o)),
+            _mm_or_si128(_mm_cmpeq_epi8(c, t), _mm_cmpeq_epi8(c, u)));
+        __m128i base32 = _mm_andnot_si128(excluded, _mm_or_si128(digit, letter));
+        mask[i / 64] |= (uint64_t) (uint16_t) _mm_movemask_epi8(base32) << (i % 64);
     }
+#endif
 
-    for (size_t i = 0; i + refLength <= len; ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
-            }
-        if (!match) continue;
+    for (; i < len; ++i)
+        if (isBase32[s[i]]) mask[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+
+/* Call `f' with the offset of every position in `s' that starts a
+   run of at least `refLength' base32 characters, i.e. every position
+   where a reference could start. */
+template<typename F>
+static void findCandidates(const unsigned char * s, size_t len, F f)
+{
+    if (len < refLength) return;
+
+    /* Compute a bitmap of the base32 characters in `s', with a zero
+       word at the end. */
+    size_t nrWords = (len + 63) / 64;
+    std::vector<uint64_t> mask(nrWords + 1, 0);
+    classify(s, len, mask.data());
+
+    /* A reference can only start at a position followed by at least
+       `refLength' base32 characters. Find those positions 64 at a
+       time by and-ing the bitmap with shifted copies of itself, so
+       that bit `i' ends up set iff bits `i' .. `i + 31' were all set.
+       The next word provides the required lookahead. */
+    for (size_t w = 0; w < nrWords; ++w) {
+        if (!mask[w]) continue;
+        uint64_t lo = mask[w], hi = mask[w + 1];
+        for (unsigned int k = 1; k < refLength; k *= 2) {
+            lo &= (lo >> k) | (hi << (64 - k));
+            hi &= hi >> k;
+        }
+        for (uint64_t starts = lo; starts; starts &= starts - 1)
+            f(w * 64 + __builtin_ctzll(starts));
+    }
+}
+
+
+static void search(const unsigned char * s, size_t len,
+    StringSet & hashes, StringSet & seen)
+{
+    if (hashes.empty()) return;
+
+    findCandidates(s, len, [&](size_t i) {
         string ref((const char *) s + i, refLength);
         if (hashes.erase(ref)) {
             debug(format("found reference to '%1%' at offset '%2%'")
                   % ref % i);
             seen.insert(ref);
         }
-        ++i;
-    }
+    });
 }
 
 
@@ -116,30 +181,182 @@ PathSet scanForReferences(Sink & toTee,
 }
 
 
+static std::string filterPrintable(std::string s)
+{
+    for (auto & c : s)
+        if (!isprint((unsigned char) c)) c = '.';
+    return s;
+}
+
+
+std::map<std::string, std::vector<ReferencePosition>> scanForReferencePositions(
+    const Path & path, const StringSet & hashParts)
+{
+    std::map<std::string, std::vector<ReferencePosition>> res;
+
+    const size_t margin = 32;
+
+    std::function<void(const Path &)> visit;
+
+    visit = [&](const Path & rel) {
+        auto p = path + rel;
+        auto st = lstat(p);
+
+        if (S_ISDIR(st.st_mode)) {
+            for (auto & i : readDirectory(p))
+                visit(rel + "/" + i.name);
+        }
+
+        else if (S_ISREG(st.st_mode)) {
+            AutoCloseFD fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!fd) throw SysError("opening file '%1%'", p);
+
+            /* Scan the file in chunks, keeping the last `refLength - 1'
+               bytes of the previous chunk in front of the buffer to
+               catch references that span two chunks. */
+            StringSet remaining = hashParts;
+            std::vector<std::pair<std::string, uint64_t>> found;
+            std::vector<unsigned char> buf(refLength - 1 + 65536);
+            size_t kept = 0;
+            uint64_t bufOffset = 0;
+
+            while (!remaining.empty()) {
+                checkInterrupt();
+                auto n = read(fd.get(), buf.data() + kept, buf.size() - kept);
+                if (n == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("reading file '%1%'", p);
+                }
+                if (n == 0) break;
+                size_t len = kept + n;
+                findCandidates(buf.data(), len, [&](size_t i) {
+                    std::string ref((const char *) buf.data() + i, refLength);
+                    if (remaining.erase(ref))
+                        found.emplace_back(ref, bufOffset + i);
+                });
+                kept = std::min(len, (size_t) refLength - 1);
+                memmove(buf.data(), buf.data() + len - kept, kept);
+                bufOffset += len - kept;
+            }
+
+            /* Read the context of each occurrence. */
+            for (auto & [hash, offset] : found) {
+                auto start = offset >= margin ? offset - margin : 0;
+                std::string excerpt(offset - start + refLength + margin, 0);
+                auto n = pread(fd.get(), excerpt.data(), excerpt.size(), start);
+                if (n == -1)
+                    throw SysError("reading file '%1%'", p);
+                excerpt.resize(n);
+                res[hash].push_back({
+                    .file = rel,
+                    .offset = offset,
+                    .excerpt = filterPrintable(std::move(excerpt)),
+                });
+            }
+        }
+
+        else if (S_ISLNK(st.st_mode)) {
+            auto target = readLink(p);
+            for (auto & hash : hashParts) {
+                auto pos = target.find(hash);
+                if (pos != std::string::npos)
+                    res[hash].push_back({
+                        .file = rel,
+                        .symlink = true,
+                        .offset = pos,
+                        .excerpt = target,
+                    });
+            }
+        }
+    };
+
+    visit("");
+
+    return res;
+}
+
+
 RewritingSink::RewritingSink(const std::string & from, const std::string & to, Sink & nextSink)
-    : from(from), to(to), nextSink(nextSink)
+    : RewritingSink(StringMap{{from, to}}, nextSink)
 {
-    assert(from.size() == to.size());
 }
 
-void RewritingSink::operator () (std::string_view data)
+RewritingSink::RewritingSink(const StringMap & rewrites, Sink & nextSink)
+    : rewrites(rewrites), nextSink(nextSink)
 {
-    std::string s(prev);
-    s.append(data);
+    for (auto & [from, to] : this->rewrites) {
+        if (!length) length = from.size();
+        assert(from.size() == length && to.size() == length);
+        if (from.size() != refLength
+            || from.find_first_not_of(base32Chars) != std::string::npos)
+            hashParts = false;
+        starts[(unsigned char) from[0]] = true;
+        index.emplace(from, to);
+    }
+}
 
-    size_t j = 0;
-    while ((j = s.find(from, j)) != string::npos) {
-        matches.push_back(pos + j);
-        s.replace(j, from.size(), to);
+size_t RewritingSink::rewrite(std::string_view s, size_t end)
+{
+    size_t done = 0;
+
+    auto check = [&](size_t i) {
+        if (i >= end || i < done || !starts[(unsigned char) s[i]]) return;
+        auto j = index.find(s.substr(i, length));
+        if (j == index.end()) return;
+        if (i > done) nextSink(s.substr(done, i - done));
+        nextSink(j->second);
+        matches.push_back(pos + i);
+        done = i + length;
+    };
+
+    /* Candidates are found in increasing order, so matches never
+       overlap. */
+    if (hashParts)
+        findCandidates((const unsigned char *) s.data(), s.size(), check);
+    else
+        for (size_t i = 0; i + length <= s.size(); ++i)
+            check(i);
+
+    if (done < end) {
+        nextSink(s.substr(done, end - done));
+        done = end;
     }
 
-    prev = s.size() < from.size() ? s : std::string(s, s.size() - from.size() + 1, from.size() - 1);
+    pos += done;
+    return done;
+}
 
-    auto consumed = s.size() - prev.size();
+void RewritingSink::operator () (std::string_view data)
+{
+    if (!length) {
+        pos += data.size();
+        nextSink(data);
+        return;
+    }
 
-    pos += consumed;
+    /* A match can start at any of the last `length - 1' bytes we've
+       seen, so those are held back in `prev' until the next chunk
+       arrives. Small chunks are simply accumulated there. */
+    if (data.size() < length) {
+        prev.append(data);
+        auto done = rewrite(prev, prev.size() >= length ? prev.size() - length + 1 : 0);
+        prev.erase(0, done);
+        return;
+    }
+
+    /* Handle the matches that start in `prev', using the first bytes
+       of `data'. */
+    if (!prev.empty()) {
+        auto prevSize = prev.size();
+        prev.append(data.substr(0, length - 1));
+        auto done = rewrite(prev, prevSize);
+        data.remove_prefix(done - prevSize);
+        prev.clear();
+    }
 
-    if (consumed) nextSink(s.substr(0, consumed));
+    /* Handle `data' in place. */
+    auto done = rewrite(data, data.size() >= length ? data.size() - length + 1 : 0);
+    prev.assign(data.substr(done));
 }
 
 void RewritingSink::flush()
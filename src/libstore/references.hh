@@ -3,25 +3,85 @@
 #include "types.hh"
 #include "hash.hh"
 
+#include <unordered_map>
+
 namespace nix {
 
 std::pair<PathSet, HashResult> scanForReferences(const Path & path, const PathSet & refs);
 
 PathSet scanForReferences(Sink & toTee, const Path & path, const PathSet & refs);
 
+/* A place in a store path where a reference occurs: the first
+   occurrence in a regular file, or in the target of a symlink. */
+struct ReferencePosition
+{
+    /* The file relative to the root of the store path, e.g. "/bin/foo",
+       or "" for the root itself. */
+    Path file;
+    bool symlink = false;
+    /* The offset of the hash in the file contents or symlink target. */
+    uint64_t offset = 0;
+    /* The contents around the hash, with unprintable characters replaced
+       by '.', or the entire symlink target. */
+    std::string excerpt;
+};
+
+/* Find the files and symlinks in `path' that contain each of the
+   hash parts `hashParts'. Unlike scanForReferences(), this walks the
+   file system tree rather than a NAR serialisation, so that the
+   positions are relative to files. */
+std::map<std::string, std::vector<ReferencePosition>> scanForReferencePositions(
+    const Path & path, const StringSet & hashParts);
+
+/* A sink that replaces every occurrence of the keys of `rewrites' by
+   the corresponding values in a single pass, and passes the result to
+   `nextSink'. All keys and values must have the same length (e.g. the
+   hash parts of store paths). Data is passed through without copying,
+   except for the few bytes at the end of each chunk that could be the
+   start of a match spanning the next chunk. */
 struct RewritingSink : Sink
 {
-    std::string from, to, prev;
+    const StringMap rewrites;
     Sink & nextSink;
+
+    /* The stream offset of the data that hasn't been passed to
+       `nextSink' yet, and that data. */
     uint64_t pos = 0;
+    std::string prev;
 
+    /* The stream offsets of the matches. */
     std::vector<uint64_t> matches;
 
     RewritingSink(const std::string & from, const std::string & to, Sink & nextSink);
 
+    RewritingSink(const StringMap & rewrites, Sink & nextSink);
+
+    /* `index' points into `rewrites'. */
+    RewritingSink(const RewritingSink &) = delete;
+    RewritingSink & operator = (const RewritingSink &) = delete;
+
     void operator () (std::string_view data) override;
 
     void flush();
+
+private:
+
+    /* The length of the keys. */
+    size_t length = 0;
+
+    /* Whether all keys are base-32 hash parts, whose candidate
+       positions can be found quickly. */
+    bool hashParts = true;
+
+    std::unordered_map<std::string_view, std::string_view> index;
+
+    /* Whether each byte can start a key. */
+    bool starts[256] = {};
+
+    /* Rewrite the matches in `s' that start before `end', and pass
+       `s' up to `end' or the end of the last match to `nextSink'.
+       Return the number of bytes passed. */
+    size_t rewrite(std::string_view s, size_t end);
 };
 
 struct HashModuloSink : AbstractHashSink
@@ -1,5 +1,6 @@
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
+#include "binary-cache-store.hh"
 #include "json.hh"
 
 #include <sys/types.h>
@@ -22,8 +23,7 @@ Path RemoteFSAccessor::makeCacheFile(std::string_view hashPart, const std::strin
     return fmt("%s/%s.%s", cacheDir, hashPart, ext);
 }
 
-void RemoteFSAccessor::addToCache(std::string_view hashPart, const std::string & nar,
-    ref<FSAccessor> narAccessor)
+void RemoteFSAccessor::addToCache(std::string_view hashPart, ref<FSAccessor> narAccessor)
 {
     nars.emplace(hashPart, narAccessor);
 
@@ -33,10 +33,6 @@ void RemoteFSAccessor::addToCache(std::string_view hashPart, const std::string &
             JSONPlaceholder jsonRoot(str);
             listNar(jsonRoot, narAccessor, "", true);
             writeFile(makeCacheFile(hashPart, "ls"), str.str());
-
-            /* FIXME: do this asynchronously. */
-            writeFile(makeCacheFile(hashPart, "nar"), nar);
-
         } catch (...) {
             ignoreException();
         }
@@ -55,7 +51,6 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
     auto i = nars.find(std::string(storePath.hashPart()));
     if (i != nars.end()) return {i->second, restPath};
 
-    StringSink sink;
     std::string listing;
     Path cacheFile;
 
@@ -86,18 +81,50 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
         } catch (SysError &) { }
 
         try {
-            *sink.s = nix::readFile(cacheFile);
-
-            auto narAccessor = makeNarAccessor(sink.s);
-            nars.emplace(storePath.hashPart(), narAccessor);
+            auto narAccessor = makeNarFileAccessor(cacheFile);
+            addToCache(storePath.hashPart(), narAccessor);
             return {narAccessor, restPath};
-
         } catch (SysError &) { }
     }
 
-    store->narFromPath(storePath, sink);
-    auto narAccessor = makeNarAccessor(sink.s);
-    addToCache(storePath.hashPart(), *sink.s, narAccessor);
+    /* Chunked NARs in binary caches can be read piecemeal, which
+       avoids fetching a large NAR to read one small file. */
+    if (auto binaryCacheStore = store.dynamic_pointer_cast<BinaryCacheStore>()) {
+        if (auto narAccessor = binaryCacheStore->getChunkedNarAccessor(storePath)) {
+            nars.emplace(storePath.hashPart(), ref<FSAccessor>(narAccessor));
+            return {ref<FSAccessor>(narAccessor), restPath};
+        }
+    }
+
+    /* Write the NAR to a file rather than to memory, since it can be
+       arbitrarily large. Without a cache directory, use an anonymous
+       temporary file that goes away when the accessor does. */
+    AutoCloseFD fd;
+    Path narFile;
+    if (cacheDir != "") {
+        narFile = makeCacheFile(storePath.hashPart(), "nar");
+        auto tmpFile = fmt("%s.tmp-%d", narFile, getpid());
+        fd = open(tmpFile.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("creating NAR cache file '%s'", tmpFile);
+        AutoDelete delTmpFile(tmpFile, false);
+        {
+            FdSink sink(fd.get());
+            store->narFromPath(storePath, sink);
+            sink.flush();
+        }
+        if (rename(tmpFile.c_str(), narFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpFile, narFile);
+        delTmpFile.cancel();
+    } else {
+        std::tie(fd, narFile) = createTempFile();
+        unlink(narFile.c_str());
+        FdSink sink(fd.get());
+        store->narFromPath(storePath, sink);
+        sink.flush();
+    }
+
+    auto narAccessor = makeNarFileAccessor(narFile, std::move(fd));
+    addToCache(storePath.hashPart(), narAccessor);
     return {narAccessor, restPath};
 }
 
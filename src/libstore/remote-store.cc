@@ -12,6 +12,7 @@
 #include "logging.hh"
 #include "callback.hh"
 #include "filetransfer.hh"
+#include "compression.hh"
 
 namespace nix {
 
@@ -50,6 +51,31 @@ void write(const Store & store, Sink & out, const ContentAddress & ca)
 }
 
 
+ValidPathInfo read(const Store & store, Source & from, Phantom<ValidPathInfo> _)
+{
+    auto path = store.parseStorePath(readString(from));
+    auto deriver = readString(from);
+    auto narHash = Hash::parseAny(readString(from), htSHA256);
+    ValidPathInfo info(path, narHash);
+    if (deriver != "") info.deriver = store.parseStorePath(deriver);
+    info.references = read(store, from, Phantom<StorePathSet> {});
+    from >> info.registrationTime >> info.narSize >> info.ultimate;
+    info.sigs = readStrings<StringSet>(from);
+    info.ca = parseContentAddressOpt(readString(from));
+    return info;
+}
+
+void write(const Store & store, Sink & out, const ValidPathInfo & info)
+{
+    out << store.printStorePath(info.path)
+        << (info.deriver ? store.printStorePath(*info.deriver) : "")
+        << info.narHash.to_string(Base16, false);
+    write(store, out, info.references);
+    out << info.registrationTime << info.narSize << info.ultimate
+        << info.sigs << renderContentAddress(info.ca);
+}
+
+
 std::optional<StorePath> read(const Store & store, Source & from, Phantom<std::optional<StorePath>> _)
 {
     auto s = readString(from);
@@ -143,8 +169,18 @@ void RemoteStore::initConnection(Connection & conn)
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
             conn.to << false;
 
+        if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 31)
+            conn.to << narCompression.get() << narCompressionLevel.to_string();
+
         auto ex = conn.processStderr();
         if (ex) std::rethrow_exception(ex);
+
+        if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 31) {
+            conn.narCompression = readString(conn.from);
+            if (conn.narCompression != narCompression.get())
+                debug("daemon does not support NAR compression method '%s', using '%s'",
+                    narCompression.get(), conn.narCompression);
+        }
     }
     catch (Error & e) {
         throw Error("cannot open connection to remote store '%s': %s", getUri(), e.what());
@@ -239,6 +275,79 @@ ConnectionHandle RemoteStore::getConnection()
 }
 
 
+RemoteStore::~RemoteStore()
+{
+    if (prefetchThread.joinable()) {
+        _prefetchState.lock()->quit = true;
+        prefetchWakeup.notify_one();
+        prefetchThread.join();
+    }
+}
+
+
+void RemoteStore::prefetchSubstitutes(const StorePathSet & paths)
+{
+    if (paths.empty()) return;
+
+    {
+        auto state(_prefetchState.lock());
+        if (state->quit) return;
+        state->pending.insert(paths.begin(), paths.end());
+
+        if (!prefetchThread.joinable()) {
+            if (GET_PROTOCOL_MINOR(getProtocol()) < 35) {
+                state->pending.clear();
+                state->quit = true;
+                return;
+            }
+
+            /* The connection is opened here rather than by the
+               thread, since the thread may still be running while
+               this store is being destroyed, and opening a connection
+               calls into the derived class. */
+            std::shared_ptr<Connection> conn;
+            try {
+                conn = openConnectionWrapper();
+                initConnection(*conn);
+            } catch (Error & e) {
+                debug("not prefetching substitute info: %s", e.what());
+                state->pending.clear();
+                state->quit = true;
+                return;
+            }
+
+            prefetchThread = std::thread([this, conn]() {
+                try {
+                    while (true) {
+                        StorePathSet batch;
+                        {
+                            auto state(_prefetchState.lock());
+                            while (state->pending.empty() && !state->quit)
+                                state.wait(prefetchWakeup);
+                            if (state->pending.empty()) return;
+                            std::swap(batch, state->pending);
+                        }
+
+                        conn->to << wopPrefetchSubstitutes;
+                        worker_proto::write(*this, conn->to, batch);
+                        auto ex = conn->processStderr();
+                        if (ex) std::rethrow_exception(ex);
+                        readInt(conn->from);
+                    }
+                } catch (std::exception & e) {
+                    debug("prefetching substitute info: %s", e.what());
+                    auto state(_prefetchState.lock());
+                    state->pending.clear();
+                    state->quit = true;
+                }
+            });
+        }
+    }
+
+    prefetchWakeup.notify_one();
+}
+
+
 bool RemoteStore::isValidPathUncached(const StorePath & path)
 {
     auto conn(getConnection());
@@ -348,16 +457,22 @@ void RemoteStore::querySubstitutablePathInfos(const StorePathCAMap & pathsMap, S
 
 ref<const ValidPathInfo> RemoteStore::readValidPathInfo(ConnectionHandle & conn, const StorePath & path)
 {
-    auto deriver = readString(conn->from);
-    auto narHash = Hash::parseAny(readString(conn->from), htSHA256);
+    return readValidPathInfo(conn->from, conn->daemonVersion, path);
+}
+
+
+ref<const ValidPathInfo> RemoteStore::readValidPathInfo(Source & from, unsigned int daemonVersion, const StorePath & path)
+{
+    auto deriver = readString(from);
+    auto narHash = Hash::parseAny(readString(from), htSHA256);
     auto info = make_ref<ValidPathInfo>(path, narHash);
     if (deriver != "") info->deriver = parseStorePath(deriver);
-    info->references = worker_proto::read(*this, conn->from, Phantom<StorePathSet> {});
-    conn->from >> info->registrationTime >> info->narSize;
-    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
-        conn->from >> info->ultimate;
-        info->sigs = readStrings<StringSet>(conn->from);
-        info->ca = parseContentAddressOpt(readString(conn->from));
+    info->references = worker_proto::read(*this, from, Phantom<StorePathSet> {});
+    from >> info->registrationTime >> info->narSize;
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 16) {
+        from >> info->ultimate;
+        info->sigs = readStrings<StringSet>(from);
+        info->ca = parseContentAddressOpt(readString(from));
     }
     return info;
 }
@@ -390,6 +505,29 @@ void RemoteStore::queryPathInfoUncached(const StorePath & path,
 }
 
 
+std::map<StorePath, ref<const ValidPathInfo>> RemoteStore::queryPathInfosUncached(const StorePathSet & paths)
+{
+    {
+        auto conn(getConnection());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 28) {
+            conn->to << wopQueryPathInfos;
+            worker_proto::write(*this, conn->to, paths);
+            conn.processStderr();
+            std::map<StorePath, ref<const ValidPathInfo>> res;
+            auto count = readNum<size_t>(conn->from);
+            while (count--) {
+                auto path = parseStorePath(readString(conn->from));
+                res.insert_or_assign(path, readValidPathInfo(conn, path));
+            }
+            return res;
+        }
+    }
+
+    /* Older daemons need one request per path. */
+    return Store::queryPathInfosUncached(paths);
+}
+
+
 void RemoteStore::queryReferrers(const StorePath & path,
     StorePathSet & referrers)
 {
@@ -410,6 +548,31 @@ StorePathSet RemoteStore::queryValidDerivers(const StorePath & path)
 }
 
 
+std::optional<std::map<StorePath, std::vector<ReferencePosition>>>
+RemoteStore::queryReferencePositions(const StorePath & path)
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 32)
+        return std::nullopt;
+    conn->to << wopQueryReferencePositions << printStorePath(path);
+    conn.processStderr();
+    if (!readInt(conn->from))
+        return std::nullopt;
+    std::map<StorePath, std::vector<ReferencePosition>> positions;
+    auto count = readNum<size_t>(conn->from);
+    while (count--) {
+        auto ref = parseStorePath(readString(conn->from));
+        ReferencePosition pos;
+        pos.file = readString(conn->from);
+        pos.symlink = readInt(conn->from);
+        pos.offset = readNum<uint64_t>(conn->from);
+        pos.excerpt = readString(conn->from);
+        positions[ref].push_back(std::move(pos));
+    }
+    return positions;
+}
+
+
 StorePathSet RemoteStore::queryDerivationOutputs(const StorePath & path)
 {
     if (GET_PROTOCOL_MINOR(getProtocol()) >= 0x16) {
@@ -589,8 +752,15 @@ void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
                  << repair << !checkSigs;
 
         if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 23) {
+            auto method = conn->narCompression;
             conn.withFramedSink([&](Sink & sink) {
-                copyNAR(source, sink);
+                if (method == "none")
+                    copyNAR(source, sink);
+                else {
+                    auto compressor = makeCompressionSink(method, sink, false, narCompressionLevel);
+                    copyNAR(source, *compressor);
+                    compressor->finish();
+                }
             });
         } else if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 21) {
             conn.processStderr(0, &source);
@@ -602,6 +772,53 @@ void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
 }
 
 
+void RemoteStore::addMultipleToStore(PathsSource & pathsToCopy, Activity & act,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    if (GET_PROTOCOL_MINOR(getProtocol()) < 30)
+        return Store::addMultipleToStore(pathsToCopy, act, repair, checkSigs);
+
+    /* Send all paths in a single request, rather than waiting for a
+       round trip per path. */
+    auto conn(getConnection());
+    conn->to << wopAddMultipleToStore << repair << !checkSigs;
+    auto method = conn->narCompression;
+    conn.withFramedSink([&](Sink & framed) {
+        /* The whole stream is compressed, not each NAR separately,
+           so that small paths compress well too. */
+        auto compressor = makeCompressionSink(method, framed, false, narCompressionLevel);
+        auto & sink(*compressor);
+        size_t nrDone = 0;
+        sink << pathsToCopy.size();
+        for (auto & [info, narWriter] : pathsToCopy) {
+            act.progress(nrDone, pathsToCopy.size(), 1, 0);
+            worker_proto::write(*this, sink, info);
+            narWriter(sink);
+            nrDone++;
+        }
+        compressor->finish();
+        act.progress(nrDone, pathsToCopy.size(), 0, 0);
+    });
+}
+
+
+void RemoteStore::addMultipleToStore(Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    if (GET_PROTOCOL_MINOR(getProtocol()) < 30)
+        return Store::addMultipleToStore(source, repair, checkSigs);
+
+    auto conn(getConnection());
+    conn->to << wopAddMultipleToStore << repair << !checkSigs;
+    auto method = conn->narCompression;
+    conn.withFramedSink([&](Sink & sink) {
+        auto compressor = makeCompressionSink(method, sink, false, narCompressionLevel);
+        source.drainInto(*compressor);
+        compressor->finish();
+    });
+}
+
+
 StorePath RemoteStore::addTextToStore(const string & name, const string & s,
     const StorePathSet & references, RepairFlag repair)
 {
@@ -664,6 +881,15 @@ BuildResult RemoteStore::buildDerivation(const StorePath & drvPath, const BasicD
     unsigned int status;
     conn->from >> status >> res.errorMsg;
     res.status = (BuildResult::Status) status;
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 34) {
+        conn->from >> res.timesBuilt >> res.isNonDeterministic >> res.startTime >> res.stopTime;
+        std::map<std::string, uint64_t> metrics;
+        for (auto n = readNum<size_t>(conn->from); n; --n) {
+            auto name = readString(conn->from);
+            metrics.insert_or_assign(name, readNum<uint64_t>(conn->from));
+        }
+        res.setMetrics(metrics);
+    }
     return res;
 }
 
@@ -686,6 +912,24 @@ void RemoteStore::addTempRoot(const StorePath & path)
 }
 
 
+void RemoteStore::addTempRoots(const StorePathSet & paths)
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 28) {
+        for (auto & path : paths) {
+            conn->to << wopAddTempRoot << printStorePath(path);
+            conn.processStderr();
+            readInt(conn->from);
+        }
+        return;
+    }
+    conn->to << wopAddTempRoots;
+    worker_proto::write(*this, conn->to, paths);
+    conn.processStderr();
+    readInt(conn->from);
+}
+
+
 void RemoteStore::addIndirectRoot(const Path & path)
 {
     auto conn(getConnection());
@@ -729,8 +973,10 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     worker_proto::write(*this, conn->to, options.pathsToDelete);
     conn->to << options.ignoreLiveness
         << options.maxFreed
+        /* Older daemons ignore this. */
+        << options.incremental
         /* removed options */
-        << 0 << 0 << 0;
+        << 0 << 0;
 
     conn.processStderr();
 
@@ -738,10 +984,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    pathInfoCache.clear();
 }
 
 
@@ -834,7 +1077,14 @@ void RemoteStore::narFromPath(const StorePath & path, Sink & sink)
     auto conn(connections->get());
     conn->to << wopNarFromPath << printStorePath(path);
     conn->processStderr();
-    copyNAR(conn->from, sink);
+    if (conn->narCompression == "none")
+        copyNAR(conn->from, sink);
+    else {
+        FramedSource framed(conn->from);
+        auto decompressor = makeDecompressionSink(conn->narCompression, sink);
+        framed.drainInto(*decompressor);
+        decompressor->finish();
+    }
 }
 
 ref<FSAccessor> RemoteStore::getFSAccessor()
@@ -858,6 +1108,42 @@ static Logger::Fields readFields(Source & from)
     return fields;
 }
 
+/* Handle a log message from the daemon, whether it was sent by itself
+   or as part of a batch. Return false if `msg' is not a log
+   message. */
+static bool processLogMessage(uint64_t msg, Source & from)
+{
+    if (msg == STDERR_NEXT)
+        printError(chomp(readString(from)));
+
+    else if (msg == STDERR_START_ACTIVITY) {
+        auto act = readNum<ActivityId>(from);
+        auto lvl = (Verbosity) readInt(from);
+        auto type = (ActivityType) readInt(from);
+        auto s = readString(from);
+        auto fields = readFields(from);
+        auto parent = readNum<ActivityId>(from);
+        logger->startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    else if (msg == STDERR_STOP_ACTIVITY) {
+        auto act = readNum<ActivityId>(from);
+        logger->stopActivity(act);
+    }
+
+    else if (msg == STDERR_RESULT) {
+        auto act = readNum<ActivityId>(from);
+        auto type = (ResultType) readInt(from);
+        auto fields = readFields(from);
+        logger->result(act, type, fields);
+    }
+
+    else
+        return false;
+
+    return true;
+}
+
 
 std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source * source, bool flush)
 {
@@ -892,30 +1178,18 @@ std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source *
             }
         }
 
-        else if (msg == STDERR_NEXT)
-            printError(chomp(readString(from)));
-
-        else if (msg == STDERR_START_ACTIVITY) {
-            auto act = readNum<ActivityId>(from);
-            auto lvl = (Verbosity) readInt(from);
-            auto type = (ActivityType) readInt(from);
-            auto s = readString(from);
-            auto fields = readFields(from);
-            auto parent = readNum<ActivityId>(from);
-            logger->startActivity(act, lvl, type, s, fields, parent);
-        }
-
-        else if (msg == STDERR_STOP_ACTIVITY) {
-            auto act = readNum<ActivityId>(from);
-            logger->stopActivity(act);
+        else if (msg == STDERR_BATCH) {
+            auto batch = readString(from);
+            StringSource source(batch);
+            while (source.pos < batch.size()) {
+                auto msg2 = readNum<uint64_t>(source);
+                if (!processLogMessage(msg2, source))
+                    throw Error("got unexpected message type %x in a batch from Nix daemon", msg2);
+            }
         }
 
-        else if (msg == STDERR_RESULT) {
-            auto act = readNum<ActivityId>(from);
-            auto type = (ResultType) readInt(from);
-            auto fields = readFields(from);
-            logger->result(act, type, fields);
-        }
+        else if (processLogMessage(msg, from))
+            ;
 
         else if (msg == STDERR_LAST)
             break;
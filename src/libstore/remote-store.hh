@@ -2,6 +2,7 @@
 
 #include <limits>
 #include <string>
+#include <thread>
 
 #include "store-api.hh"
 
@@ -25,6 +26,14 @@ struct RemoteStoreConfig : virtual StoreConfig
 
     const Setting<unsigned int> maxConnectionAge{(StoreConfig*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
+
+    const Setting<std::string> narCompression{(StoreConfig*) this, "none",
+            "nar-compression",
+            "compression method (e.g. `zstd`) for NARs sent over the connection, if supported by the daemon"};
+
+    const Setting<std::optional<int>> narCompressionLevel{(StoreConfig*) this, {},
+            "nar-compression-level",
+            "compression level for NARs sent over the connection (empty means the method's default)"};
 };
 
 /* FIXME: RemoteStore is a misnomer - should be something like
@@ -37,6 +46,8 @@ public:
 
     RemoteStore(const Params & params);
 
+    ~RemoteStore();
+
     /* Implementations of abstract store API methods. */
 
     bool isValidPathUncached(const StorePath & path) override;
@@ -49,10 +60,17 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfosUncached(const StorePathSet & paths) override;
+
+    void prefetchSubstitutes(const StorePathSet & paths) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
 
+    std::optional<std::map<StorePath, std::vector<ReferencePosition>>>
+    queryReferencePositions(const StorePath & path) override;
+
     StorePathSet queryDerivationOutputs(const StorePath & path) override;
 
     std::map<std::string, std::optional<StorePath>> queryPartialDerivationOutputMap(const StorePath & path) override;
@@ -78,6 +96,12 @@ public:
     void addToStore(const ValidPathInfo & info, Source & nar,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    void addMultipleToStore(PathsSource & pathsToCopy, Activity & act,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
+    void addMultipleToStore(Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
     StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair) override;
 
@@ -94,6 +118,8 @@ public:
 
     void addTempRoot(const StorePath & path) override;
 
+    void addTempRoots(const StorePathSet & paths) override;
+
     void addIndirectRoot(const Path & path) override;
 
     void syncWithGC() override;
@@ -124,6 +150,8 @@ public:
         FdSink to;
         FdSource from;
         unsigned int daemonVersion;
+        /* The NAR compression method agreed with the daemon. */
+        std::string narCompression = "none";
         std::chrono::time_point<std::chrono::steady_clock> startTime;
 
         virtual ~Connection();
@@ -153,10 +181,25 @@ protected:
 
     ref<const ValidPathInfo> readValidPathInfo(ConnectionHandle & conn, const StorePath & path);
 
+    ref<const ValidPathInfo> readValidPathInfo(Source & from, unsigned int daemonVersion, const StorePath & path);
+
 private:
 
     std::atomic_bool failed{false};
 
+    /* The paths queued by prefetchSubstitutes() for the thread that
+       passes them on to the daemon, on a connection of its own so
+       that it doesn't hold up other operations. */
+    struct PrefetchState
+    {
+        StorePathSet pending;
+        bool quit = false;
+    };
+
+    Sync<PrefetchState> _prefetchState;
+    std::condition_variable prefetchWakeup;
+    std::thread prefetchThread;
+
 };
 
 
@@ -136,10 +136,22 @@ ref<Aws::Client::ClientConfiguration> S3Helper::makeConfig(const string & region
     res->connectTimeoutMs = 5 * 1000;
     res->retryStrategy = std::make_shared<RetryStrategy>();
     res->caFile = settings.caFile;
+
+    /* Allow as many parallel requests (and keep as many connections
+       open for reuse) as the HTTP binary cache store. Asynchronous
+       requests are run on a shared pool of that many threads, rather
+       than on a new thread per request. */
+    size_t maxConnections = fileTransferSettings.httpConnections;
+    if (!maxConnections) maxConnections = 100;
+    static auto executor =
+        std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxConnections);
+    res->maxConnections = maxConnections;
+    res->executor = executor;
+
     return res;
 }
 
-S3Helper::FileTransferResult S3Helper::getObject(
+static Aws::S3::Model::GetObjectRequest makeGetObjectRequest(
     const std::string & bucketName, const std::string & key)
 {
     debug("fetching 's3://%s/%s'...", bucketName, key);
@@ -149,18 +161,24 @@ S3Helper::FileTransferResult S3Helper::getObject(
         .WithBucket(bucketName)
         .WithKey(key);
 
-    request.SetResponseStreamFactory([&]() {
+    request.SetResponseStreamFactory([]() {
         return Aws::New<std::stringstream>("STRINGSTREAM");
     });
 
-    FileTransferResult res;
+    return request;
+}
 
-    auto now1 = std::chrono::steady_clock::now();
+static S3Helper::FileTransferResult getObjectResult(
+    const std::string & key,
+    Aws::S3::Model::GetObjectOutcome && outcome,
+    std::chrono::steady_clock::time_point now1)
+{
+    S3Helper::FileTransferResult res;
 
     try {
 
         auto result = checkAws(fmt("AWS error fetching '%s'", key),
-            client->GetObject(request));
+            std::move(outcome));
 
         res.data = decompress(result.GetContentEncoding(),
             dynamic_cast<std::stringstream &>(result.GetBody()).str());
@@ -177,6 +195,41 @@ S3Helper::FileTransferResult S3Helper::getObject(
     return res;
 }
 
+S3Helper::FileTransferResult S3Helper::getObject(
+    const std::string & bucketName, const std::string & key)
+{
+    auto request = makeGetObjectRequest(bucketName, key);
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    return getObjectResult(key, client->GetObject(request), now1);
+}
+
+void S3Helper::getObject(
+    const std::string & bucketName, const std::string & key,
+    Callback<FileTransferResult> callback)
+{
+    auto request = makeGetObjectRequest(bucketName, key);
+
+    auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    client->GetObjectAsync(request,
+        [callbackPtr, key, now1](
+            const Aws::S3::S3Client *,
+            const Aws::S3::Model::GetObjectRequest &,
+            Aws::S3::Model::GetObjectOutcome outcome,
+            const std::shared_ptr<const Aws::Client::AsyncCallerContext> &)
+        {
+            try {
+                (*callbackPtr)(getObjectResult(key, std::move(outcome), now1));
+            } catch (...) {
+                callbackPtr->rethrow();
+            }
+        });
+}
+
 S3BinaryCacheStore::S3BinaryCacheStore(const Params & params)
     : BinaryCacheStoreConfig(params)
     , BinaryCacheStore(params)
@@ -417,6 +470,39 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
             throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
     }
 
+    /* Fetch files (in particular .narinfos) without blocking the
+       caller, so that e.g. queryMissing() can look up many paths in
+       parallel, as with HTTP binary caches. */
+    void getFile(const std::string & path,
+        Callback<std::shared_ptr<std::string>> callback) noexcept override
+    {
+        stats.get++;
+
+        auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
+
+        try {
+            s3Helper.getObject(bucketName, path,
+                {[this, callbackPtr, path](std::future<S3Helper::FileTransferResult> result) {
+                    try {
+                        auto res = result.get();
+
+                        stats.getBytes += res.data ? res.data->size() : 0;
+                        stats.getTimeMs += res.durationMs;
+
+                        if (res.data)
+                            printTalkative("downloaded 's3://%s/%s' (%d bytes) in %d ms",
+                                bucketName, path, res.data->size(), res.durationMs);
+
+                        (*callbackPtr)(std::move(res.data));
+                    } catch (...) {
+                        callbackPtr->rethrow();
+                    }
+                }});
+        } catch (...) {
+            callbackPtr->rethrow();
+        }
+    }
+
     StorePathSet queryAllValidPaths() override
     {
         StorePathSet paths;
@@ -3,6 +3,7 @@
 #if ENABLE_S3
 
 #include "ref.hh"
+#include "callback.hh"
 
 namespace Aws { namespace Client { class ClientConfiguration; } }
 namespace Aws { namespace S3 { class S3Client; } }
@@ -26,6 +27,14 @@ struct S3Helper
 
     FileTransferResult getObject(
         const std::string & bucketName, const std::string & key);
+
+    /* Fetch an object using the SDK's asynchronous API, and call
+       `callback' with the result on one of the SDK's executor
+       threads. The result has no data if the object doesn't exist or
+       isn't accessible. */
+    void getObject(
+        const std::string & bucketName, const std::string & key,
+        Callback<FileTransferResult> callback);
 };
 
 }
@@ -1,5 +1,8 @@
 #include "sqlite.hh"
 #include "util.hh"
+#include "globals.hh"
+#include "metrics.hh"
+#include "finally.hh"
 
 #include <sqlite3.h>
 
@@ -25,14 +28,47 @@ namespace nix {
         throw SQLiteError("%s: %s (in '%s')", fs.s, sqlite3_errstr(exterr), path);
 }
 
+/* Like the handler installed by sqlite3_busy_timeout() with a timeout
+   of one hour, but records the time spent waiting for locks. */
+static int busyHandler(void *, int count)
+{
+    static const int delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+    const int nrDelays = sizeof(delays) / sizeof(delays[0]);
+    const int64_t timeout = 60 * 60 * 1000;
+
+    int64_t delay, waited;
+    if (count < nrDelays) {
+        delay = delays[count];
+        waited = 0;
+        for (int n = 0; n < count; n++) waited += delays[n];
+    } else {
+        delay = delays[nrDelays - 1];
+        waited = 0;
+        for (int n = 0; n < nrDelays; n++) waited += delays[n];
+        waited += (int64_t) (count - nrDelays) * delay;
+    }
+
+    if (waited >= timeout) return 0;
+    delay = std::min(delay, timeout - waited);
+
+    auto & m(metrics::getMetrics());
+    if (count == 0) m.sqliteBusyWaits++;
+    auto before = std::chrono::steady_clock::now();
+    sqlite3_sleep(delay);
+    m.sqliteBusyWaitMicros += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - before).count();
+
+    return 1;
+}
+
 SQLite::SQLite(const Path & path, bool create)
 {
     if (sqlite3_open_v2(path.c_str(), &db,
             SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), 0) != SQLITE_OK)
         throw Error("cannot open SQLite database '%s'", path);
 
-    if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
-        throwSQLiteError(db, "setting timeout");
+    if (sqlite3_busy_handler(db, busyHandler, nullptr) != SQLITE_OK)
+        throwSQLiteError(db, "setting busy handler");
 
     exec("pragma foreign_keys = 1");
 }
@@ -74,6 +110,7 @@ void SQLiteStmt::create(sqlite3 * db, const string & sql)
         throwSQLiteError(db, fmt("creating statement '%s'", sql));
     this->db = db;
     this->sql = sql;
+    metrics = &metrics::statementMetrics(sql);
 }
 
 SQLiteStmt::~SQLiteStmt()
@@ -97,9 +134,36 @@ SQLiteStmt::Use::Use(SQLiteStmt & stmt)
 
 SQLiteStmt::Use::~Use()
 {
+    if (stepped) {
+        try {
+            record();
+        } catch (...) {
+            ignoreException();
+        }
+    }
     sqlite3_reset(stmt);
 }
 
+void SQLiteStmt::Use::record()
+{
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+    bool slow = settings.sqliteSlowQueryThreshold
+        && (uint64_t) micros >= settings.sqliteSlowQueryThreshold * 1000;
+
+    if (stmt.metrics) {
+        stmt.metrics->executions++;
+        stmt.metrics->micros += micros;
+        if (slow) stmt.metrics->slow++;
+    }
+
+    if (slow) {
+        auto sql = sqlite3_expanded_sql(stmt.stmt);
+        Finally freeSql([&]() { sqlite3_free(sql); });
+        warn("SQLite statement took %d ms: %s", micros / 1000, sql ? sql : stmt.sql.c_str());
+    }
+}
+
 SQLiteStmt::Use & SQLiteStmt::Use::operator () (std::string_view value, bool notNull)
 {
     if (notNull) {
@@ -139,7 +203,11 @@ SQLiteStmt::Use & SQLiteStmt::Use::bind()
 
 int SQLiteStmt::Use::step()
 {
-    return sqlite3_step(stmt);
+    auto before = std::chrono::steady_clock::now();
+    int r = sqlite3_step(stmt);
+    elapsed += std::chrono::steady_clock::now() - before;
+    stepped = true;
+    return r;
 }
 
 void SQLiteStmt::Use::exec()
@@ -222,6 +290,10 @@ void handleSQLiteBusy(const SQLiteBusy & e)
     t.tv_sec = 0;
     t.tv_nsec = (random() % 100) * 1000 * 1000; /* <= 0.1s */
     nanosleep(&t, 0);
+
+    auto & m(metrics::getMetrics());
+    m.sqliteRetries++;
+    m.sqliteRetryMicros += t.tv_nsec / 1000;
 }
 
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <string>
 
@@ -10,6 +11,8 @@ struct sqlite3_stmt;
 
 namespace nix {
 
+namespace metrics { struct StatementMetrics; }
+
 /* RAII wrapper to close a SQLite database automatically. */
 struct SQLite
 {
@@ -36,6 +39,7 @@ struct SQLiteStmt
     sqlite3 * db = 0;
     sqlite3_stmt * stmt = 0;
     std::string sql;
+    metrics::StatementMetrics * metrics = 0;
     SQLiteStmt() { }
     SQLiteStmt(sqlite3 * db, const std::string & sql) { create(db, sql); }
     void create(sqlite3 * db, const std::string & s);
@@ -49,8 +53,14 @@ struct SQLiteStmt
     private:
         SQLiteStmt & stmt;
         unsigned int curArg = 1;
+        bool stepped = false;
+        std::chrono::steady_clock::duration elapsed{0};
         Use(SQLiteStmt & stmt);
 
+        /* Record the execution of the statement in its metrics, and
+           log it if it was slow. */
+        void record();
+
     public:
 
         ~Use();
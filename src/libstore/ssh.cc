@@ -1,4 +1,10 @@
 #include "ssh.hh"
+#include "globals.hh"
+#include "pathlocks.hh"
+#include "hash.hh"
+
+#include <sys/socket.h>
+#include <sys/un.h>
 
 namespace nix {
 
@@ -14,6 +20,17 @@ SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool
         throw Error("invalid SSH host name '%s'", host);
 }
 
+SSHMaster::~SSHMaster()
+{
+    try {
+        auto state(state_.lock());
+        if (state->persistentMaster != -1)
+            state->persistentMaster.wait();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
 void SSHMaster::addCommonSSHOpts(Strings & args)
 {
     for (auto & i : tokenizeString<Strings>(getEnv("NIX_SSHOPTS").value_or("")))
@@ -87,6 +104,11 @@ Path SSHMaster::startMaster()
 
     if (state->sshMaster != -1) return state->socketPath;
 
+    if (settings.sshMasterPersist) {
+        state->socketPath = startPersistentMaster(*state);
+        return state->socketPath;
+    }
+
     state->tmpDir = std::make_unique<AutoDelete>(createTempDir("", "nix", true, true, 0700));
 
     state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
@@ -131,4 +153,97 @@ Path SSHMaster::startMaster()
     return state->socketPath;
 }
 
+/* Return whether an SSH master is listening on `socketPath'. */
+static bool masterRunning(const Path & socketPath)
+{
+    AutoCloseFD fd = socket(PF_UNIX, SOCK_STREAM
+        #ifdef SOCK_CLOEXEC
+        | SOCK_CLOEXEC
+        #endif
+        , 0);
+    if (!fd)
+        throw SysError("cannot create Unix domain socket");
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() + 1 >= sizeof(addr.sun_path))
+        throw Error("socket path '%1%' is too long", socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    return ::connect(fd.get(), (struct sockaddr *) &addr, sizeof(addr)) == 0;
+}
+
+Path SSHMaster::startPersistentMaster(State & state)
+{
+    /* The socket is shared by all processes of this user that connect
+       to the same host in the same way, e.g. all instances of the
+       build hook. */
+    auto dir = getCacheDir() + "/nix/ssh";
+    createDirs(dir);
+    auto socketPath = dir + "/" + compressHash(hashString(htSHA256,
+            host + "\n" + keyFile + (compress ? "\nC" : "")), 16).to_string(Base32, false);
+
+    AutoCloseFD lock = openLockFile(socketPath + ".lock", true);
+    lockFile(lock.get(), ltWrite, true);
+
+    if (masterRunning(socketPath)) return socketPath;
+
+    unlink(socketPath.c_str());
+
+    /* A previous master has gone away; reap the process that started
+       it before replacing it. */
+    if (state.persistentMaster != -1)
+        state.persistentMaster.wait();
+
+    Pipe out;
+    out.create();
+
+    ProcessOptions options;
+    options.dieWithParent = false;
+
+    Pid pid = startProcess([&]() {
+        restoreSignals();
+
+        close(out.readSide.get());
+
+        if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+            throw SysError("duping over stdout");
+
+        /* The master outlives us, so it must not keep our stderr
+           open (which is a log pipe for the build hook). */
+        AutoCloseFD devNull = open("/dev/null", O_RDWR);
+        if (!devNull || dup2(devNull.get(), STDERR_FILENO) == -1)
+            throw SysError("cannot redirect stderr to /dev/null");
+
+        Strings args =
+            { "ssh", host.c_str(), "-M", "-N", "-S", socketPath
+            , "-o", fmt("ControlPersist=%d", settings.sshMasterPersist)
+            , "-o", "LocalCommand=echo started"
+            , "-o", "PermitLocalCommand=yes"
+            };
+        addCommonSSHOpts(args);
+        execvp(args.begin()->c_str(), stringsToCharPtrs(args).data());
+
+        throw SysError("unable to execute '%s'", args.front());
+    }, options);
+
+    out.writeSide = -1;
+
+    std::string reply;
+    try {
+        reply = readLine(out.readSide.get());
+    } catch (EndOfFile & e) { }
+
+    if (reply != "started")
+        throw Error("failed to start SSH master connection to '%s'", host);
+
+    /* Don't kill the master when we exit; it terminates by itself
+       after it has been idle for `ssh-master-persist' seconds. With
+       ControlPersist the master runs in a forked child, so `pid'
+       exits on its own and only needs to be waited for. */
+    state.persistentMaster = pid.release();
+
+    return socketPath;
+}
+
 }
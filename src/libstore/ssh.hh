@@ -19,6 +19,10 @@ private:
     struct State
     {
         Pid sshMaster;
+        /* The ssh process that started the persistent master. It
+           exits once the master has backgrounded itself, and is
+           reaped by the destructor. */
+        Pid persistentMaster;
         std::unique_ptr<AutoDelete> tmpDir;
         Path socketPath;
     };
@@ -27,10 +31,14 @@ private:
 
     void addCommonSSHOpts(Strings & args);
 
+    Path startPersistentMaster(State & state);
+
 public:
 
     SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1);
 
+    ~SSHMaster();
+
     struct Connection
     {
         Pid sshPid;
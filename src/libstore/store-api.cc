@@ -9,12 +9,42 @@
 #include "url.hh"
 #include "archive.hh"
 #include "callback.hh"
+#include "worker-protocol.hh"
+#include "finally.hh"
 
 #include <regex>
 
 namespace nix {
 
 
+/* The fields of BuildResult returned by getMetrics(). */
+#define BUILD_METRICS(X) \
+    X(cpuUser) X(cpuSystem) X(peakMemory) X(ioRead) X(ioWritten) \
+    X(lockTime) X(setupTime) X(scanTime) X(registrationTime)
+
+static uint64_t metricValue(uint64_t n) { return n; }
+static uint64_t metricValue(std::chrono::microseconds t) { return t.count(); }
+
+std::map<std::string, uint64_t> BuildResult::getMetrics() const
+{
+    std::map<std::string, uint64_t> res;
+    #define X(name) if (name) res.emplace(#name, metricValue(*name));
+    BUILD_METRICS(X)
+    #undef X
+    return res;
+}
+
+void BuildResult::setMetrics(const std::map<std::string, uint64_t> & metrics)
+{
+    /* Ignore unknown metrics, which may be sent by newer versions. */
+    #define X(name) \
+        if (auto i = metrics.find(#name); i != metrics.end()) \
+            name = decltype(name)::value_type(i->second);
+    BUILD_METRICS(X)
+    #undef X
+}
+
+
 bool Store::isInStore(const Path & path) const
 {
     return isInDir(path, storeDir);
@@ -347,7 +377,7 @@ ValidPathInfo Store::addToStoreSlow(std::string_view name, const Path & srcPath,
 
 Store::Store(const Params & params)
     : StoreConfig(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize)
 {
 }
 
@@ -357,19 +387,22 @@ std::string Store::getUri()
     return "";
 }
 
-bool Store::PathInfoCacheValue::isKnownNow()
+void Store::upsertPathInfoCache(const std::string & hashPart, PathInfoCacheValue value)
 {
-    std::chrono::duration ttl = didExist()
+    auto ttl = value.didExist()
         ? std::chrono::seconds(settings.ttlPositiveNarInfoCache)
         : std::chrono::seconds(settings.ttlNegativeNarInfoCache);
-
-    return std::chrono::steady_clock::now() < time_point + ttl;
+    pathInfoCache.upsert(hashPart, std::move(value), ttl);
 }
 
+Derivation readDerivationCommon(Store& store, const StorePath& drvPath, bool requireValidPath, bool outputsOnly);
+
 std::map<std::string, std::optional<StorePath>> Store::queryPartialDerivationOutputMap(const StorePath & path)
 {
     std::map<std::string, std::optional<StorePath>> outputs;
-    auto drv = readInvalidDerivation(path);
+    /* Only the outputs are needed here, so don't bother decoding the
+       rest of the derivation. */
+    auto drv = readDerivationCommon(*this, path, false, true);
     for (auto& [outputName, output] : drv.outputsAndOptPaths(*this)) {
         outputs.emplace(outputName, output.second);
     }
@@ -401,21 +434,21 @@ bool Store::isValidPath(const StorePath & storePath)
 {
     std::string hashPart(storePath.hashPart());
 
-    {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(hashPart);
-        if (res && res->isKnownNow()) {
-            stats.narInfoReadAverted++;
-            return res->didExist();
-        }
+    checkPathInfoCache();
+
+    if (auto res = pathInfoCache.get(hashPart)) {
+        stats.narInfoReadAverted++;
+        stats.pathInfoCacheHits++;
+        return res->didExist();
     }
 
+    stats.pathInfoCacheMisses++;
+
     if (diskCache) {
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(hashPart,
+            upsertPathInfoCache(hashPart,
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -477,28 +510,27 @@ void Store::queryPathInfo(const StorePath & storePath,
     try {
         hashPart = storePath.hashPart();
 
-        {
-            auto res = state.lock()->pathInfoCache.get(hashPart);
-            if (res && res->isKnownNow()) {
-                stats.narInfoReadAverted++;
-                if (!res->didExist())
-                    throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
-                return callback(ref<const ValidPathInfo>(res->value));
-            }
+        checkPathInfoCache();
+
+        if (auto res = pathInfoCache.get(hashPart)) {
+            stats.narInfoReadAverted++;
+            stats.pathInfoCacheHits++;
+            if (!res->didExist())
+                throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
+            return callback(ref<const ValidPathInfo>(res->value));
         }
 
+        stats.pathInfoCacheMisses++;
+
         if (diskCache) {
             auto res = diskCache->lookupNarInfo(getUri(), hashPart);
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(hashPart,
-                        res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
-                    if (res.first == NarInfoDiskCache::oInvalid ||
-                        !goodStorePath(storePath, res.second->path))
-                        throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
-                }
+                upsertPathInfoCache(hashPart,
+                    res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
+                if (res.first == NarInfoDiskCache::oInvalid ||
+                    !goodStorePath(storePath, res.second->path))
+                    throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
                 return callback(ref<const ValidPathInfo>(res.second));
             }
         }
@@ -516,10 +548,7 @@ void Store::queryPathInfo(const StorePath & storePath,
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = info });
-                }
+                upsertPathInfoCache(hashPart, PathInfoCacheValue { .value = info });
 
                 auto storePath = parseStorePath(storePathS);
 
@@ -534,6 +563,88 @@ void Store::queryPathInfo(const StorePath & storePath,
 }
 
 
+std::map<StorePath, ref<const ValidPathInfo>> Store::queryPathInfos(const StorePathSet & paths)
+{
+    std::map<StorePath, ref<const ValidPathInfo>> res;
+    StorePathSet missing;
+
+    checkPathInfoCache();
+
+    for (auto & path : paths) {
+        if (auto info = pathInfoCache.get(std::string(path.hashPart()))) {
+            stats.narInfoReadAverted++;
+            stats.pathInfoCacheHits++;
+            if (info->didExist() && goodStorePath(path, info->value->path))
+                res.insert_or_assign(path, ref<const ValidPathInfo>(info->value));
+        } else {
+            stats.pathInfoCacheMisses++;
+            missing.insert(path);
+        }
+    }
+
+    if (missing.empty()) return res;
+
+    auto infos = queryPathInfosUncached(missing);
+
+    for (auto & path : missing) {
+        auto i = infos.find(path);
+        upsertPathInfoCache(std::string(path.hashPart()),
+            i == infos.end()
+            ? PathInfoCacheValue{}
+            : PathInfoCacheValue{ .value = i->second.get_ptr() });
+    }
+
+    res.merge(infos);
+    return res;
+}
+
+
+std::map<StorePath, ref<const ValidPathInfo>> Store::queryPathInfosUncached(const StorePathSet & paths)
+{
+    struct State
+    {
+        size_t left;
+        std::map<StorePath, ref<const ValidPathInfo>> infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size()});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const StorePath & path) {
+        checkInterrupt();
+        queryPathInfo(path, {[path, &state_, &wakeup](std::future<ref<const ValidPathInfo>> fut) {
+            auto state(state_.lock());
+            try {
+                state->infos.insert_or_assign(path, fut.get());
+            } catch (InvalidPath &) {
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->infos);
+        }
+        state.wait(wakeup);
+    }
+}
+
+
 void Store::substitutePaths(const StorePathSet & paths)
 {
     std::vector<StorePathWithOutputs> paths2;
@@ -556,6 +667,35 @@ void Store::substitutePaths(const StorePathSet & paths)
 }
 
 
+std::map<DrvOutput, Realisation> Store::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    /* Don't start a thread pool for a single query, the common case
+       of a derivation with one output. */
+    if (ids.size() <= 1) {
+        std::map<DrvOutput, Realisation> res;
+        for (auto & id : ids)
+            if (auto realisation = queryRealisation(id))
+                res.insert_or_assign(id, *realisation);
+        return res;
+    }
+
+    Sync<std::map<DrvOutput, Realisation>> res;
+
+    ThreadPool pool;
+
+    for (auto & id : ids)
+        pool.enqueue([&, id]() {
+            checkInterrupt();
+            if (auto realisation = queryRealisation(id))
+                res.lock()->insert_or_assign(id, *realisation);
+        });
+
+    pool.process();
+
+    return std::move(*res.lock());
+}
+
+
 StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
     struct State
@@ -611,10 +751,13 @@ string Store::makeValidityRegistration(const StorePathSet & paths,
 {
     string s = "";
 
+    auto infos = queryPathInfos(paths);
+
     for (auto & i : paths) {
         s += printStorePath(i) + "\n";
 
-        auto info = queryPathInfo(i);
+        auto j = infos.find(i);
+        auto info = j != infos.end() ? j->second : queryPathInfo(i);
 
         if (showHash) {
             s += info->narHash.to_string(Base16, false) + "\n";
@@ -641,12 +784,33 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
 {
     auto jsonList = jsonOut.list();
 
-    for (auto & storePath : storePaths) {
+    std::map<StorePath, std::pair<uint64_t, uint64_t>> allClosureSizes;
+    if (showClosureSize)
+        allClosureSizes = getClosureSizes(storePaths);
+
+    /* Query the path infos in batches and write each batch before
+       querying the next, so that memory use doesn't grow with the
+       number of paths (e.g. for `nix path-info --json --all'). */
+    const size_t batchSize = 1024;
+    std::map<StorePath, ref<const ValidPathInfo>> infos;
+    auto batchEnd = storePaths.begin();
+
+    for (auto i = storePaths.begin(); i != storePaths.end(); ++i) {
+        auto & storePath = *i;
+
+        if (i == batchEnd) {
+            StorePathSet batch;
+            for (size_t n = 0; n < batchSize && batchEnd != storePaths.end(); ++n, ++batchEnd)
+                batch.insert(*batchEnd);
+            infos = queryPathInfos(batch);
+        }
+
         auto jsonPath = jsonList.object();
         jsonPath.attr("path", printStorePath(storePath));
 
         try {
-            auto info = queryPathInfo(storePath);
+            auto cached = infos.find(storePath);
+            auto info = cached != infos.end() ? cached->second : queryPathInfo(storePath);
 
             jsonPath
                 .attr("narHash", info->narHash.to_string(hashBase, true))
@@ -664,7 +828,8 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
             std::pair<uint64_t, uint64_t> closureSizes;
 
             if (showClosureSize) {
-                closureSizes = getClosureSize(info->path);
+                auto i = allClosureSizes.find(info->path);
+                closureSizes = i != allClosureSizes.end() ? i->second : getClosureSize(info->path);
                 jsonPath.attr("closureSize", closureSizes.first);
             }
 
@@ -726,27 +891,259 @@ std::pair<uint64_t, uint64_t> Store::getClosureSize(const StorePath & storePath)
 
 const Store::Stats & Store::getStats()
 {
+    stats.pathInfoCacheSize = pathInfoCache.size();
+    return stats;
+}
+
+
+void Store::addMultipleToStore(PathsSource & pathsToCopy, Activity & act,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    std::atomic<size_t> nrDone{0};
+    std::atomic<size_t> nrFailed{0};
+    std::atomic<uint64_t> nrRunning{0};
+
+    auto showProgress = [&]() {
+        act.progress(nrDone, pathsToCopy.size(), nrRunning, nrFailed);
+    };
+
+    std::map<StorePath, size_t> indices;
+    StorePathSet paths;
+    for (size_t n = 0; n < pathsToCopy.size(); ++n) {
+        indices.insert_or_assign(pathsToCopy[n].first.path, n);
+        paths.insert(pathsToCopy[n].first.path);
+    }
+
+    /* The NARs are fetched into temporary files on 'copy-jobs'
+       threads, in topological order but without waiting for the
+       references of a path to be added, so that a slow or
+       high-latency source is kept busy. Only adding the paths to this
+       store is ordered by references. To bound the space used by the
+       temporary files, these threads stay within 'window' paths of
+       the first path that hasn't been added yet, and don't start a
+       fetch that would take the NARs being fetched or waiting to be
+       added over 'copy-spool-size' bytes. A path that can be added
+       before its NAR has been fetched is fetched by the thread adding
+       it, regardless of these limits. */
+    size_t jobs = std::max(1U, settings.copyJobs.get());
+    size_t window = 4 * jobs;
+    uint64_t maxSpooled = settings.copySpoolSize;
+
+    struct Fetch
     {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
+        enum { NotStarted, Fetching, Done } status = NotStarted;
+        std::optional<Path> tempFile;
+        std::exception_ptr exception;
+        bool added = false;
+        /* The NAR size counted in 'FetchState::spooled'. */
+        uint64_t spooled = 0;
+    };
+
+    struct FetchState
+    {
+        std::vector<Fetch> fetches;
+        size_t firstNotAdded = 0;
+        bool stopped = false;
+        uint64_t spooled = 0;
+
+        void release(Fetch & item)
+        {
+            if (item.tempFile) {
+                deletePath(*item.tempFile);
+                item.tempFile.reset();
+            }
+            spooled -= item.spooled;
+            item.spooled = 0;
+        }
+    };
+
+    Sync<FetchState> fetchState_;
+    fetchState_.lock()->fetches.resize(pathsToCopy.size());
+    std::condition_variable wakeup;
+
+    auto fetch = [&](size_t n, bool now) {
+        auto & [info, narWriter] = pathsToCopy[n];
+
+        {
+            auto fetchState(fetchState_.lock());
+            auto & item(fetchState->fetches[n]);
+            if (!now)
+                while (!fetchState->stopped
+                    && item.status == Fetch::NotStarted
+                    && (n >= fetchState->firstNotAdded + window
+                        || (fetchState->spooled && fetchState->spooled + info.narSize > maxSpooled)))
+                    fetchState.wait(wakeup);
+            if (fetchState->stopped || item.status != Fetch::NotStarted) return;
+            item.status = Fetch::Fetching;
+            item.spooled = info.narSize;
+            fetchState->spooled += item.spooled;
+        }
+
+        std::optional<AutoDelete> tempFile;
+        std::exception_ptr exception;
+
+        try {
+            if (!isValidPath(info.path)) {
+                auto [fd, path] = createTempFile("nix-copy");
+                tempFile.emplace(path, false);
+                FdSink sink(fd.get());
+                narWriter(sink);
+                sink.flush();
+            }
+        } catch (...) {
+            exception = std::current_exception();
+        }
+
+        auto fetchState(fetchState_.lock());
+        auto & item(fetchState->fetches[n]);
+        item.status = Fetch::Done;
+        item.exception = exception;
+        if (tempFile && !fetchState->stopped && !item.added) {
+            item.tempFile = (Path) *tempFile;
+            tempFile->cancel();
+        } else
+            fetchState->release(item);
+        wakeup.notify_all();
+    };
+
+    /* Note: process() isn't called on this pool, so it needs an extra
+       thread to have 'jobs' workers. */
+    ThreadPool fetchPool(jobs + 1);
+
+    Finally stopFetching([&]() {
+        auto fetchState(fetchState_.lock());
+        fetchState->stopped = true;
+        for (auto & item : fetchState->fetches)
+            if (item.tempFile)
+                fetchState->release(item);
+        wakeup.notify_all();
+    });
+
+    for (size_t n = 0; n < pathsToCopy.size(); ++n)
+        fetchPool.enqueue(std::bind(fetch, n, false));
+
+    /* Wait for the NAR of path 'n' to be fetched, fetching it now if
+       no other thread has started to do so. */
+    auto getNar = [&](size_t n) {
+        fetch(n, true);
+        auto fetchState(fetchState_.lock());
+        auto & item(fetchState->fetches[n]);
+        while (item.status != Fetch::Done)
+            fetchState.wait(wakeup);
+        if (item.exception)
+            std::rethrow_exception(item.exception);
+        return item.tempFile;
+    };
+
+    auto markAdded = [&](size_t n) {
+        auto fetchState(fetchState_.lock());
+        auto & item(fetchState->fetches[n]);
+        item.added = true;
+        if (item.tempFile)
+            fetchState->release(item);
+        while (fetchState->firstNotAdded < fetchState->fetches.size()
+            && fetchState->fetches[fetchState->firstNotAdded].added)
+            fetchState->firstNotAdded++;
+        wakeup.notify_all();
+    };
+
+    ThreadPool pool;
+
+    processGraph<StorePath>(pool, paths,
+
+        [&](const StorePath & path) {
+            auto & info = pathsToCopy[indices.at(path)].first;
+
+            if (isValidPath(info.path)) {
+                nrDone++;
+                showProgress();
+                return StorePathSet();
+            }
+
+            return info.references;
+        },
+
+        [&](const StorePath & path) {
+            checkInterrupt();
+
+            auto n = indices.at(path);
+            auto & info = pathsToCopy[n].first;
+
+            Finally done([&]() { markAdded(n); });
+
+            if (!isValidPath(info.path)) {
+                MaintainCount<decltype(nrRunning)> mc(nrRunning);
+                showProgress();
+                try {
+                    auto tempFile = getNar(n);
+                    if (!tempFile)
+                        throw Error("NAR for '%s' was not fetched", printStorePath(info.path));
+                    AutoCloseFD fd = open(tempFile->c_str(), O_RDONLY | O_CLOEXEC);
+                    if (!fd) throw SysError("opening '%s'", *tempFile);
+                    FdSource source(fd.get());
+                    addToStore(info, source, repair, checkSigs);
+                } catch (Error & e) {
+                    nrFailed++;
+                    if (!settings.keepGoing)
+                        throw e;
+                    logger->log(lvlError, fmt("could not copy %s: %s", printStorePath(path), e.what()));
+                    showProgress();
+                    return;
+                }
+            }
+
+            nrDone++;
+            showProgress();
+        });
+}
+
+
+void Store::addMultipleToStore(Source & source, RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    auto count = readNum<uint64_t>(source);
+
+    for (uint64_t n = 0; n < count; ++n) {
+        auto info = worker_proto::read(*this, source, Phantom<ValidPathInfo> {});
+        info.ultimate = false;
+
+        /* Pass exactly one NAR to addToStore(), which may otherwise
+           read the rest of the stream. */
+        auto narSource = sinkToSource([&](Sink & sink) {
+            TeeSource tee { source, sink };
+            ParseSink ether;
+            parseDump(ether, tee);
+        });
+
+        addToStore(info, *narSource, repair, checkSigs);
+
+        /* addToStore() doesn't read the NAR if the path is already
+           valid. */
+        NullSink null;
+        narSource->drainInto(null);
     }
-    return stats;
 }
 
 
-void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
-    const StorePath & storePath, RepairFlag repair, CheckSigsFlag checkSigs)
+static std::string copyPathMessage(Store & srcStore, Store & dstStore, const StorePath & storePath)
 {
-    auto srcUri = srcStore->getUri();
-    auto dstUri = dstStore->getUri();
+    auto srcUri = srcStore.getUri();
+    auto dstUri = dstStore.getUri();
 
-    Activity act(*logger, lvlInfo, actCopyPath,
+    return
         srcUri == "local" || srcUri == "daemon"
-        ? fmt("copying path '%s' to '%s'", srcStore->printStorePath(storePath), dstUri)
+        ? fmt("copying path '%s' to '%s'", srcStore.printStorePath(storePath), dstUri)
           : dstUri == "local" || dstUri == "daemon"
-        ? fmt("copying path '%s' from '%s'", srcStore->printStorePath(storePath), srcUri)
-          : fmt("copying path '%s' from '%s' to '%s'", srcStore->printStorePath(storePath), srcUri, dstUri),
-        {srcStore->printStorePath(storePath), srcUri, dstUri});
+        ? fmt("copying path '%s' from '%s'", srcStore.printStorePath(storePath), srcUri)
+          : fmt("copying path '%s' from '%s' to '%s'", srcStore.printStorePath(storePath), srcUri, dstUri);
+}
+
+
+void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
+    const StorePath & storePath, RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    Activity act(*logger, lvlInfo, actCopyPath,
+        copyPathMessage(*srcStore, *dstStore, storePath),
+        {srcStore->printStorePath(storePath), srcStore->getUri(), dstStore->getUri()});
     PushActivity pact(act.id);
 
     auto info = srcStore->queryPathInfo(storePath);
@@ -768,7 +1165,9 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
-    auto source = sinkToSource([&](Sink & sink) {
+    /* Fetch (and decompress) the NAR in a separate thread, so that
+       it's not held up by the destination store unpacking it. */
+    auto source = sinkToSourceThreaded([&](Sink & sink) {
         LambdaSink progressSink([&](std::string_view data) {
             total += data.size();
             act.progress(total, info->narSize);
@@ -800,77 +1199,55 @@ std::map<StorePath, StorePath> copyPaths(ref<Store> srcStore, ref<Store> dstStor
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
-    std::atomic<size_t> nrDone{0};
-    std::atomic<size_t> nrFailed{0};
-    std::atomic<uint64_t> bytesExpected{0};
-    std::atomic<uint64_t> nrRunning{0};
+    /* Fetch all the path infos at once rather than one round trip
+       per path for the sort and another one below. */
+    auto infos = srcStore->queryPathInfos(missing);
 
-    auto showProgress = [&]() {
-        act.progress(nrDone, missing.size(), nrRunning, nrFailed);
-    };
+    /* The destination store wants references before referrers. */
+    auto sorted = srcStore->topoSortPaths(missing, infos);
+    std::reverse(sorted.begin(), sorted.end());
 
-    ThreadPool pool;
+    uint64_t bytesExpected = 0;
+    Store::PathsSource pathsToCopy;
 
-    processGraph<StorePath>(pool,
-        StorePathSet(missing.begin(), missing.end()),
-
-        [&](const StorePath & storePath) {
-            auto info = srcStore->queryPathInfo(storePath);
-            auto storePathForDst = storePath;
-            if (info->ca && info->references.empty()) {
-                storePathForDst = dstStore->makeFixedOutputPathFromCA(storePath.name(), *info->ca);
-                if (dstStore->storeDir == srcStore->storeDir)
-                    assert(storePathForDst == storePath);
-                if (storePathForDst != storePath)
-                    debug("replaced path '%s' to '%s' for substituter '%s'", srcStore->printStorePath(storePath), dstStore->printStorePath(storePathForDst), dstStore->getUri());
-            }
-            pathsMap.insert_or_assign(storePath, storePathForDst);
+    for (auto & storePath : sorted) {
+        auto i = infos.find(storePath);
+        auto info = i != infos.end() ? i->second : srcStore->queryPathInfo(storePath);
 
-            if (dstStore->isValidPath(storePath)) {
-                nrDone++;
-                showProgress();
-                return StorePathSet();
-            }
-
-            bytesExpected += info->narSize;
-            act.setExpected(actCopyPath, bytesExpected);
-
-            return info->references;
-        },
-
-        [&](const StorePath & storePath) {
-            checkInterrupt();
-
-            auto info = srcStore->queryPathInfo(storePath);
+        auto storePathForDst = storePath;
+        if (info->ca && info->references.empty()) {
+            storePathForDst = dstStore->makeFixedOutputPathFromCA(storePath.name(), *info->ca);
+            if (dstStore->storeDir == srcStore->storeDir)
+                assert(storePathForDst == storePath);
+            if (storePathForDst != storePath)
+                debug("replaced path '%s' to '%s' for substituter '%s'", srcStore->printStorePath(storePath), dstStore->printStorePath(storePathForDst), dstStore->getUri());
+        }
+        pathsMap.insert_or_assign(storePath, storePathForDst);
+
+        ValidPathInfo infoForDst = *info;
+        infoForDst.path = storePathForDst;
+        infoForDst.ultimate = false;
+
+        bytesExpected += info->narSize;
+
+        pathsToCopy.emplace_back(std::move(infoForDst),
+            [srcStore, dstStore, storePath, narSize(info->narSize)](Sink & sink) {
+                Activity act(*logger, lvlInfo, actCopyPath,
+                    copyPathMessage(*srcStore, *dstStore, storePath),
+                    {srcStore->printStorePath(storePath), srcStore->getUri(), dstStore->getUri()});
+                uint64_t total = 0;
+                LambdaSink progressSink([&](std::string_view data) {
+                    total += data.size();
+                    act.progress(total, narSize);
+                });
+                TeeSink tee { sink, progressSink };
+                srcStore->narFromPath(storePath, tee);
+            });
+    }
 
-            auto storePathForDst = storePath;
-            if (info->ca && info->references.empty()) {
-                storePathForDst = dstStore->makeFixedOutputPathFromCA(storePath.name(), *info->ca);
-                if (dstStore->storeDir == srcStore->storeDir)
-                    assert(storePathForDst == storePath);
-                if (storePathForDst != storePath)
-                    debug("replaced path '%s' to '%s' for substituter '%s'", srcStore->printStorePath(storePath), dstStore->printStorePath(storePathForDst), dstStore->getUri());
-            }
-            pathsMap.insert_or_assign(storePath, storePathForDst);
+    act.setExpected(actCopyPath, bytesExpected);
 
-            if (!dstStore->isValidPath(storePathForDst)) {
-                MaintainCount<decltype(nrRunning)> mc(nrRunning);
-                showProgress();
-                try {
-                    copyStorePath(srcStore, dstStore, storePath, repair, checkSigs);
-                } catch (Error &e) {
-                    nrFailed++;
-                    if (!settings.keepGoing)
-                        throw e;
-                    logger->log(lvlError, fmt("could not copy %s: %s", dstStore->printStorePath(storePath), e.what()));
-                    showProgress();
-                    return;
-                }
-            }
-
-            nrDone++;
-            showProgress();
-        });
+    dstStore->addMultipleToStore(pathsToCopy, act, repair, checkSigs);
 
     return pathsMap;
 }
@@ -1014,23 +1391,23 @@ Derivation Store::derivationFromPath(const StorePath & drvPath)
     return readDerivation(drvPath);
 }
 
-Derivation readDerivationCommon(Store& store, const StorePath& drvPath, bool requireValidPath)
+Derivation readDerivationCommon(Store& store, const StorePath& drvPath, bool requireValidPath, bool outputsOnly)
 {
     auto accessor = store.getFSAccessor();
     try {
         return parseDerivation(store,
             accessor->readFile(store.printStorePath(drvPath), requireValidPath),
-            Derivation::nameFromPath(drvPath));
+            Derivation::nameFromPath(drvPath), outputsOnly);
     } catch (FormatError & e) {
         throw Error("error parsing derivation '%s': %s", store.printStorePath(drvPath), e.msg());
     }
 }
 
 Derivation Store::readDerivation(const StorePath & drvPath)
-{ return readDerivationCommon(*this, drvPath, true); }
+{ return readDerivationCommon(*this, drvPath, true, false); }
 
 Derivation Store::readInvalidDerivation(const StorePath & drvPath)
-{ return readDerivationCommon(*this, drvPath, false); }
+{ return readDerivationCommon(*this, drvPath, false, false); }
 
 }
 
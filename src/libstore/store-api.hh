@@ -11,6 +11,7 @@
 #include "config.hh"
 #include "derivations.hh"
 #include "path-info.hh"
+#include "references.hh"
 
 #include <atomic>
 #include <limits>
@@ -113,6 +114,13 @@ struct GCOptions
 
     /* Stop after at least `maxFreed' bytes have been freed. */
     uint64_t maxFreed{std::numeric_limits<uint64_t>::max()};
+
+    /* For `gcDeleteDead', only consider the paths that may have
+       become garbage since the last complete incremental collection,
+       i.e. the closures of the roots that have been removed since,
+       and the paths that have been added since. If there was no such
+       collection, do a full one. */
+    bool incremental{false};
 };
 
 
@@ -166,6 +174,25 @@ struct BuildResult
        was repeated). */
     time_t startTime = 0, stopTime = 0;
 
+    /* The CPU time, peak memory use and I/O (in bytes) of the
+       builder, if the build ran in a cgroup (see `use-cgroups'). */
+    std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+    std::optional<uint64_t> peakMemory, ioRead, ioWritten;
+
+    /* The time spent by Nix itself on a local build: waiting for the
+       locks on the outputs, setting up the build environment,
+       scanning the outputs for references, and registering the
+       outputs (including the scanning). */
+    std::optional<std::chrono::microseconds> lockTime, setupTime, scanTime, registrationTime;
+
+    /* The measurements above that are known, as a map from their
+       names (e.g. `cpuUser') to their values in microseconds or
+       bytes. This is how they are sent to clients and shown in
+       JSON. */
+    std::map<std::string, uint64_t> getMetrics() const;
+
+    void setMetrics(const std::map<std::string, uint64_t> & metrics);
+
     bool success() {
         return status == Built || status == Substituted || status == AlreadyValid;
     }
@@ -209,29 +236,28 @@ protected:
 
     struct PathInfoCacheValue {
 
-        // Time of cache entry creation or update
-        std::chrono::time_point<std::chrono::steady_clock> time_point = std::chrono::steady_clock::now();
-
         // Null if missing
         std::shared_ptr<const ValidPathInfo> value;
 
-        // Whether the value is valid as a cache entry. The path may not exist.
-        bool isKnownNow();
-
         // Past tense, because a path can only be assumed to exists when
-        // isKnownNow() && didExist()
+        // it is in the cache and didExist()
         inline bool didExist() {
           return value != nullptr;
         }
     };
 
-    struct State
-    {
-        // FIXME: fix key
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
-    };
+    /* Cache of path info, keyed on the hash part of the store path.
+       Entries expire after 'narinfo-cache-positive-ttl' or
+       'narinfo-cache-negative-ttl' seconds. */
+    // FIXME: fix key
+    SharedLRUCache<std::string, PathInfoCacheValue> pathInfoCache;
+
+    void upsertPathInfoCache(const std::string & hashPart, PathInfoCacheValue value);
 
-    Sync<State> state;
+    /* Called before answering a query from the path info cache.
+       Stores whose contents can be changed behind their back (e.g. by
+       other processes) can override this to flush the cache. */
+    virtual void checkPathInfoCache() { }
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -250,6 +276,11 @@ public:
 
     StorePath parseStorePath(std::string_view path) const;
 
+    /* Like parseStorePath(), but for paths from a trusted source,
+       such as the Nix database, which are only checked to be in the
+       store and not validated again. */
+    StorePath parseTrustedStorePath(std::string_view path) const;
+
     std::optional<StorePath> maybeParseStorePath(std::string_view path) const;
 
     std::string printStorePath(const StorePath & path) const;
@@ -372,6 +403,12 @@ public:
     void queryPathInfo(const StorePath & path,
         Callback<ref<const ValidPathInfo>> callback) noexcept;
 
+    /* Query information about a set of paths. Paths that are not
+       valid are omitted from the result. This is more efficient than
+       calling queryPathInfo() for each path on stores that can answer
+       many queries at once (like the local store and the daemon). */
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfos(const StorePathSet & paths);
+
     /* Check whether the given valid path info is sufficiently attested, by
        either being signed by a trusted public key or content-addressed, in
        order to be included in the given store.
@@ -392,10 +429,20 @@ protected:
     virtual void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept = 0;
 
+    /* Bulk version of queryPathInfoUncached(). The result contains
+       only the valid paths. The default implementation runs
+       queryPathInfo() on each path in parallel. */
+    virtual std::map<StorePath, ref<const ValidPathInfo>> queryPathInfosUncached(const StorePathSet & paths);
+
 public:
 
     virtual std::optional<const Realisation> queryRealisation(const DrvOutput &) = 0;
 
+    /* Bulk version of queryRealisation(). The result contains only
+       the outputs that have a realisation. The default implementation
+       runs queryRealisation() on each output in parallel. */
+    virtual std::map<DrvOutput, Realisation> queryRealisations(const std::set<DrvOutput> & ids);
+
     /* Queries the set of incoming FS references for a store path.
        The result is not cleared. */
     virtual void queryReferrers(const StorePath & path, StorePathSet & referrers)
@@ -407,6 +454,13 @@ public:
        not exist anymore.) */
     virtual StorePathSet queryValidDerivers(const StorePath & path) { return {}; };
 
+    /* Return where in the contents of `path' each of its references
+       occurs, if this was recorded when `path' was registered (see
+       the `index-reference-positions' setting). */
+    virtual std::optional<std::map<StorePath, std::vector<ReferencePosition>>>
+    queryReferencePositions(const StorePath & path)
+    { return std::nullopt; }
+
     /* Query the outputs of the derivation denoted by `path'. */
     virtual StorePathSet queryDerivationOutputs(const StorePath & path);
 
@@ -433,10 +487,34 @@ public:
     virtual void querySubstitutablePathInfos(const StorePathCAMap & paths,
         SubstitutablePathInfos & infos) { return; };
 
+    /* Hint that `paths' may be substituted soon, so that their
+       substitute info can be fetched in the background ahead of time
+       (see the `prefetch-substitutes' setting, which the caller is
+       expected to check). Queued paths are still queried when the
+       store is closed. */
+    virtual void prefetchSubstitutes(const StorePathSet & paths) { };
+
     /* Import a path into the store. */
     virtual void addToStore(const ValidPathInfo & info, Source & narSource,
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs) = 0;
 
+    /* Paths to be imported by addMultipleToStore(), in topological
+       order (references first), each with a function that writes its
+       NAR to a sink. */
+    typedef std::vector<std::pair<ValidPathInfo, std::function<void(Sink &)>>> PathsSource;
+
+    /* Import multiple paths into the store. The default
+       implementation calls addToStore() for each path, in parallel
+       where the references allow it, and reports progress on 'act'. */
+    virtual void addMultipleToStore(PathsSource & pathsToCopy, Activity & act,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
+    /* Import multiple paths from a stream consisting of the number of
+       paths followed by, for each path, its ValidPathInfo (in worker
+       protocol format) and its NAR. */
+    virtual void addMultipleToStore(Source & source,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -540,6 +618,14 @@ public:
     virtual void addTempRoot(const StorePath & path)
     { warn("not creating temp root, store doesn't support GC"); }
 
+    /* Add a set of store paths as temporary roots. This is cheaper
+       than calling addTempRoot() for each path on some stores. */
+    virtual void addTempRoots(const StorePathSet & paths)
+    {
+        for (auto & path : paths)
+            addTempRoot(path);
+    }
+
     /* Add an indirect root, which is merely a symlink to `path' from
        /nix/var/nix/gcroots/auto/<hash of `path'>.  `path' is supposed
        to be a symlink to a store path.  The garbage collector will
@@ -601,6 +687,13 @@ public:
        the closure. */
     std::pair<uint64_t, uint64_t> getClosureSize(const StorePath & storePath);
 
+    /* Return the closure size (as returned by getClosureSize()) of
+       each of `paths'. This is much faster than calling
+       getClosureSize() for each path if the closures overlap, since
+       the combined closure is traversed only once. Paths that are not
+       valid are omitted from the result. */
+    std::map<StorePath, std::pair<uint64_t, uint64_t>> getClosureSizes(const StorePathSet & paths);
+
     /* Optimise the disk space usage of the Nix store by hard-linking files
        with the same contents. */
     virtual void optimiseStore() { };
@@ -618,6 +711,15 @@ public:
     virtual void repairPath(const StorePath & path)
     { unsupported("repairPath"); }
 
+    /* Repair the given paths. The default implementation repairs them
+       one at a time; stores that build or substitute locally repair
+       them concurrently. */
+    virtual void repairPaths(const StorePathSet & paths)
+    {
+        for (auto & path : paths)
+            repairPath(path);
+    }
+
     /* Add signatures to the specified store path. The signatures are
        not verified. */
     virtual void addSignatures(const StorePath & storePath, const StringSet & sigs)
@@ -661,6 +763,12 @@ public:
        relation.  If p refers to q, then p precedes q in this list. */
     StorePaths topoSortPaths(const StorePathSet & paths);
 
+    /* Same, but using the given path infos, as returned by
+       queryPathInfos(). Paths that have no info are treated as
+       having no references. */
+    StorePaths topoSortPaths(const StorePathSet & paths,
+        const std::map<StorePath, ref<const ValidPathInfo>> & infos);
+
     /* Export multiple paths in the format expected by ‘nix-store
        --import’. */
     void exportPaths(const StorePathSet & paths, Sink & sink);
@@ -673,6 +781,19 @@ public:
        access. */
     StorePaths importPaths(Source & source, CheckSigsFlag checkSigs = CheckSigs);
 
+    /* Export 'paths' as a bundle: the NARs of the paths, each
+       compressed separately with 'compression', followed by an index
+       of their path infos and locations. Unlike exportPaths(), this
+       allows the paths to be imported in parallel. */
+    void exportBundle(const StorePathSet & paths, Sink & sink,
+        const std::string & compression = "zstd");
+
+    /* Import all paths in a bundle created by exportBundle(), using
+       addMultipleToStore(). Since this reads the index at the end of
+       the bundle first, 'bundle' must be a regular file. Returns the
+       paths in the bundle. */
+    StorePaths importBundle(const Path & bundle, CheckSigsFlag checkSigs = CheckSigs);
+
     struct Stats
     {
         std::atomic<uint64_t> narInfoRead{0};
@@ -680,6 +801,9 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
+        std::atomic<uint64_t> pathInfoCacheFlushes{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -688,6 +812,11 @@ public:
         std::atomic<uint64_t> narWriteBytes{0};
         std::atomic<uint64_t> narWriteCompressedBytes{0};
         std::atomic<uint64_t> narWriteCompressionTimeMs{0};
+        std::atomic<uint64_t> narWriteChunks{0};
+        std::atomic<uint64_t> narWriteChunksAverted{0};
+        std::atomic<uint64_t> dbReadQueries{0};
+        std::atomic<uint64_t> dbReadWaits{0};
+        std::atomic<uint64_t> dbReadWaitMicroseconds{0};
     };
 
     const Stats & getStats();
@@ -701,7 +830,7 @@ public:
        occasionally flush their path info cache. */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /* Establish a connection to the store, for store types that have
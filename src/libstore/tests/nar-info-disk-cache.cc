@@ -0,0 +1,52 @@
+#include "nar-info-disk-cache.hh"
+#include "util.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * NarInfoDiskCache realisations
+     * --------------------------------------------------------------------------*/
+
+    TEST(NarInfoDiskCache, realisations) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        /* The cache is a singleton, so this must happen before it's
+           first used. */
+        setenv("XDG_CACHE_HOME", tmpDir.c_str(), 1);
+
+        auto cache = getNarInfoDiskCache();
+        std::string uri = "http://example.org/cache";
+        cache->createCache(uri, "/nix/store", false, 40);
+
+        DrvOutput present { .drvHash = hashString(htSHA256, "present"), .outputName = "out" };
+        DrvOutput missing { .drvHash = hashString(htSHA256, "missing"), .outputName = "out" };
+        DrvOutput unknown { .drvHash = hashString(htSHA256, "unknown"), .outputName = "out" };
+
+        auto realisation = [](const DrvOutput & id) {
+            return std::make_shared<const Realisation>(Realisation {
+                .id = id,
+                .outPath = StorePath("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-" + id.outputName),
+            });
+        };
+
+        cache->upsertRealisation(uri, present, realisation(present));
+        cache->upsertRealisation(uri, missing, nullptr);
+
+        auto [outcome, cached] = cache->lookupRealisation(uri, present);
+        ASSERT_EQ(outcome, NarInfoDiskCache::oValid);
+        ASSERT_EQ(cached->outPath.to_string(), "g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-out");
+        ASSERT_EQ(cache->lookupRealisation(uri, missing).first, NarInfoDiskCache::oInvalid);
+        ASSERT_EQ(cache->lookupRealisation(uri, unknown).first, NarInfoDiskCache::oUnknown);
+
+        /* Entries are per binary cache. */
+        cache->createCache("http://example.org/other", "/nix/store", false, 40);
+        ASSERT_EQ(cache->lookupRealisation("http://example.org/other", present).first, NarInfoDiskCache::oUnknown);
+
+        /* A new realisation replaces a cached negative answer. */
+        cache->upsertRealisation(uri, missing, realisation(missing));
+        ASSERT_EQ(cache->lookupRealisation(uri, missing).first, NarInfoDiskCache::oValid);
+    }
+}
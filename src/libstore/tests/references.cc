@@ -0,0 +1,70 @@
+#include "references.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * RewritingSink
+     * --------------------------------------------------------------------------*/
+
+    static const std::string hash1 = "g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q";
+    static const std::string hash2 = "0c5kbb2m9nf3wrv27dhng4wc5ah1xk0v";
+    static const std::string hash3 = "zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz";
+
+    /* Feed `input' to a RewritingSink in chunks of `chunkSize'
+       bytes. */
+    static std::string rewrite(const StringMap & rewrites, const std::string & input,
+        size_t chunkSize, std::vector<uint64_t> * matches = nullptr)
+    {
+        StringSink out;
+        RewritingSink sink(rewrites, out);
+        for (size_t i = 0; i < input.size(); i += chunkSize)
+            sink(std::string_view(input).substr(i, chunkSize));
+        sink.flush();
+        EXPECT_EQ(sink.pos, input.size());
+        if (matches) *matches = sink.matches;
+        return *out.s;
+    }
+
+    TEST(RewritingSink, rewritesAcrossChunkBoundaries) {
+        auto input = "/nix/store/" + hash1 + "-foo " + hash1 + hash1 + " " + hash1;
+        auto expected = "/nix/store/" + hash2 + "-foo " + hash2 + hash2 + " " + hash2;
+
+        for (size_t chunkSize = 1; chunkSize <= input.size(); ++chunkSize) {
+            std::vector<uint64_t> matches;
+            ASSERT_EQ(rewrite({{hash1, hash2}}, input, chunkSize, &matches), expected)
+                << "chunk size " << chunkSize;
+            ASSERT_EQ(matches, (std::vector<uint64_t> {11, 48, 80, 113}));
+        }
+    }
+
+    TEST(RewritingSink, rewritesMultipleKeys) {
+        auto input = hash1 + "-" + hash2 + "-" + hash3 + "-" + hash1;
+        auto expected = hash2 + "-" + hash3 + "-" + hash3 + "-" + hash2;
+
+        StringMap rewrites{{hash1, hash2}, {hash2, hash3}};
+
+        for (size_t chunkSize : {1, 7, 31, 32, 33, 64, 1000})
+            ASSERT_EQ(rewrite(rewrites, input, chunkSize), expected)
+                << "chunk size " << chunkSize;
+    }
+
+    TEST(RewritingSink, rewritesKeysThatArentHashParts) {
+        auto input = std::string("abcabxabc");
+
+        for (size_t chunkSize = 1; chunkSize <= input.size(); ++chunkSize)
+            ASSERT_EQ(rewrite({{"abc", "XYZ"}, {"bxa", "---"}}, input, chunkSize), "XYZa---bc")
+                << "chunk size " << chunkSize;
+    }
+
+    TEST(RewritingSink, passesDataWithoutMatches) {
+        auto input = std::string(100, 'e') + hash1.substr(0, 31);
+
+        for (size_t chunkSize : {1, 5, 32, 1000})
+            ASSERT_EQ(rewrite({{hash1, hash2}}, input, chunkSize), input);
+
+        ASSERT_EQ(rewrite({}, input, 10), input);
+    }
+
+}
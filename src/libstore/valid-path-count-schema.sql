@@ -0,0 +1,17 @@
+-- Extension of the sql schema that keeps the number of valid paths up
+-- to date, so that a metadata snapshot can be checked without
+-- counting them. Won't be loaded unless the setting
+-- `metadata-snapshot` is set.
+
+create table if not exists ValidPathCount (
+    count integer not null
+);
+
+insert into ValidPathCount
+    select count(*) from ValidPaths where not exists (select 1 from ValidPathCount);
+
+create trigger if not exists ValidPathCountInsert after insert on ValidPaths
+    begin update ValidPathCount set count = count + 1; end;
+
+create trigger if not exists ValidPathCountDelete after delete on ValidPaths
+    begin update ValidPathCount set count = count - 1; end;
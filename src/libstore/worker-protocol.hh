@@ -9,7 +9,7 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION 0x11b
+#define PROTOCOL_VERSION 0x123
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -55,6 +55,11 @@ typedef enum {
     wopQueryDerivationOutputMap = 41,
     wopRegisterDrvOutput = 42,
     wopQueryRealisation = 43,
+    wopQueryPathInfos = 44,
+    wopAddTempRoots = 45,
+    wopAddMultipleToStore = 47,
+    wopQueryReferencePositions = 48,
+    wopPrefetchSubstitutes = 49,
 } WorkerOp;
 
 
@@ -66,6 +71,11 @@ typedef enum {
 #define STDERR_START_ACTIVITY 0x53545254
 #define STDERR_STOP_ACTIVITY  0x53544f50
 #define STDERR_RESULT         0x52534c54
+/* A string containing a sequence of STDERR_NEXT,
+   STDERR_START_ACTIVITY, STDERR_STOP_ACTIVITY and STDERR_RESULT
+   messages. Sent by daemons to clients with protocol version 1.33 or
+   later. */
+#define STDERR_BATCH          0x42415443
 
 
 class Store;
@@ -86,6 +96,7 @@ namespace worker_proto {
 MAKE_WORKER_PROTO(, std::string);
 MAKE_WORKER_PROTO(, StorePath);
 MAKE_WORKER_PROTO(, ContentAddress);
+MAKE_WORKER_PROTO(, ValidPathInfo);
 
 MAKE_WORKER_PROTO(template<typename T>, std::set<T>);
 
@@ -2,8 +2,11 @@
 #include "util.hh"
 #include "affinity.hh"
 
+#include <algorithm>
+
 #if __linux__
 #include <sched.h>
+#include <dirent.h>
 #endif
 
 namespace nix {
@@ -67,4 +70,145 @@ void restoreAffinity()
 }
 
 
+void setAffinity(const std::vector<int> & cpus)
+{
+#if __linux__
+    if (cpus.empty()) return;
+    cpu_set_t newAffinity;
+    CPU_ZERO(&newAffinity);
+    for (auto cpu : cpus)
+        CPU_SET(cpu, &newAffinity);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &newAffinity) == -1)
+        throw SysError("setting CPU affinity");
+#endif
+}
+
+
+#if __linux__
+/* Parse a CPU list like "0-3,8-11" as used in sysfs. */
+static std::vector<int> parseCPUList(const std::string & s)
+{
+    std::vector<int> cpus;
+    for (auto & range : tokenizeString<Strings>(s, ",\n")) {
+        auto dash = range.find('-');
+        auto first = string2Int<int>(range.substr(0, dash));
+        auto last = dash == std::string::npos ? first : string2Int<int>(range.substr(dash + 1));
+        if (!first || !last) throw Error("invalid CPU list '%s'", s);
+        for (int cpu = *first; cpu <= *last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+#endif
+
+
+std::vector<std::vector<int>> getCPUsByNode()
+{
+    std::vector<std::vector<int>> nodes;
+
+#if __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == -1)
+        return nodes;
+
+    auto isAllowed = [&](int cpu) {
+        return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed);
+    };
+
+    std::vector<int> seen;
+
+    Path nodesDir = "/sys/devices/system/node";
+    if (pathExists(nodesDir)) {
+        try {
+            for (auto & entry : readDirectory(nodesDir)) {
+                if (!hasPrefix(entry.name, "node") || !string2Int<int>(entry.name.substr(4))) continue;
+                std::vector<int> cpus;
+                for (auto cpu : parseCPUList(readFile(nodesDir + "/" + entry.name + "/cpulist")))
+                    if (isAllowed(cpu)) cpus.push_back(cpu);
+                if (cpus.empty()) continue;
+                seen.insert(seen.end(), cpus.begin(), cpus.end());
+                nodes.push_back(std::move(cpus));
+            }
+        } catch (Error & e) {
+            debug("cannot determine the NUMA topology: %s", e.what());
+            nodes.clear();
+            seen.clear();
+        }
+    }
+
+    /* Put any CPUs that don't belong to a node in a node of their
+       own. */
+    std::sort(seen.begin(), seen.end());
+    std::vector<int> rest;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (isAllowed(cpu) && !std::binary_search(seen.begin(), seen.end(), cpu))
+            rest.push_back(cpu);
+    if (!rest.empty()) nodes.push_back(std::move(rest));
+#endif
+
+    return nodes;
+}
+
+
+CPUAllocator::CPUAllocator(const std::vector<std::vector<int>> & nodes)
+    : free(nodes)
+{
+    for (size_t node = 0; node < free.size(); ++node) {
+        std::sort(free[node].begin(), free[node].end());
+        for (auto cpu : free[node])
+            nodeOf[cpu] = node;
+    }
+}
+
+
+std::vector<int> CPUAllocator::allocate(size_t count)
+{
+    std::vector<int> res;
+
+    size_t total = 0;
+    for (auto & cpus : free) total += cpus.size();
+    if (count == 0 || count > total) return res;
+
+    /* Take CPUs from the start of the given node's free list, which
+       keeps the CPUs of a job close together. */
+    auto take = [&](size_t node, size_t n) {
+        auto & cpus = free[node];
+        res.insert(res.end(), cpus.begin(), cpus.begin() + n);
+        cpus.erase(cpus.begin(), cpus.begin() + n);
+    };
+
+    std::optional<size_t> best;
+    for (size_t node = 0; node < free.size(); ++node)
+        if (free[node].size() >= count && (!best || free[node].size() < free[*best].size()))
+            best = node;
+
+    if (best)
+        take(*best, count);
+    else {
+        std::vector<size_t> order;
+        for (size_t node = 0; node < free.size(); ++node) order.push_back(node);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return free[a].size() > free[b].size();
+        });
+        for (auto node : order) {
+            auto n = std::min(count - res.size(), free[node].size());
+            take(node, n);
+            if (res.size() == count) break;
+        }
+    }
+
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+
+void CPUAllocator::release(const std::vector<int> & cpus)
+{
+    for (auto cpu : cpus) {
+        auto & node = free[nodeOf.at(cpu)];
+        node.insert(std::upper_bound(node.begin(), node.end(), cpu), cpu);
+    }
+}
+
+
 }
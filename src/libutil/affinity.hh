@@ -1,9 +1,46 @@
 #pragma once
 
+#include "types.hh"
+
+#include <map>
+#include <vector>
+
 namespace nix {
 
 void setAffinityTo(int cpu);
 int lockToCurrentCPU();
 void restoreAffinity();
 
+/* Restrict the current process to the given CPUs. An empty set
+   leaves the affinity unchanged. */
+void setAffinity(const std::vector<int> & cpus);
+
+/* Return the CPUs that the current process may run on, grouped by
+   NUMA node. Systems without NUMA information are treated as having
+   a single node. */
+std::vector<std::vector<int>> getCPUsByNode();
+
+/* Hands out disjoint sets of CPUs to concurrent jobs. A job gets its
+   CPUs from a single NUMA node if possible, so that its processes
+   share caches and local memory. */
+class CPUAllocator
+{
+    /* The free CPUs of every node, in ascending order. */
+    std::vector<std::vector<int>> free;
+
+    std::map<int, size_t> nodeOf;
+
+public:
+
+    CPUAllocator(const std::vector<std::vector<int>> & nodes);
+
+    /* Return 'count' free CPUs, taken from the node with the fewest
+       free CPUs that has enough of them, or otherwise from the nodes
+       with the most free CPUs. Returns an empty set if fewer than
+       'count' CPUs are free. */
+    std::vector<int> allocate(size_t count);
+
+    void release(const std::vector<int> & cpus);
+};
+
 }
@@ -14,6 +14,10 @@
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
+#include "io-uring.hh"
+
+#include <thread>
 
 namespace nix {
 
@@ -29,6 +33,14 @@ struct ArchiveSettings : Config
         "Whether to enable a Darwin-specific hack for dealing with file name collisions."};
     Setting<bool> preallocateContents{this, false, "preallocate-contents",
         "Whether to preallocate files when writing objects with known size."};
+    Setting<unsigned int> narDumpThreads{this, 8, "nar-dump-threads",
+        R"(
+          The number of threads used to read small files ahead when
+          serialising a directory tree to a NAR (e.g. when adding a
+          source tree to the store or hashing it). This hides the
+          latency of opening and reading many small files. Set to 0
+          or 1 to read files one at a time.
+        )"};
 };
 
 static ArchiveSettings archiveSettings;
@@ -50,6 +62,14 @@ static void dumpContents(const Path & path, size_t size,
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     if (!fd) throw SysError("opening file '%1%'", path);
 
+    /* If we're writing to a file descriptor directly (e.g. the daemon
+       serving wopNarFromPath), let the kernel copy the contents. */
+    if (auto fdSink = dynamic_cast<FdSink *>(&sink)) {
+        fdSink->sendFile(fd.get(), size);
+        writePadding(size, sink);
+        return;
+    }
+
     std::vector<char> buf(65536);
     size_t left = size;
 
@@ -64,6 +84,31 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
+/* Return the entries of a directory, sorted by their name in the NAR
+   (i.e. with the case hack undone on case-insensitive systems like
+   macOS), mapped to their name on disk. */
+static std::map<string, string> readEntries(const Path & path)
+{
+    std::map<string, string> unhacked;
+    for (auto & i : readDirectory(path))
+        if (archiveSettings.useCaseHack) {
+            string name(i.name);
+            size_t pos = i.name.find(caseHackSuffix);
+            if (pos != string::npos) {
+                debug(format("removing case hack suffix from '%1%'") % (path + "/" + i.name));
+                name.erase(pos);
+            }
+            if (unhacked.find(name) != unhacked.end())
+                throw Error("file name collision in between '%1%' and '%2%'",
+                   (path + "/" + unhacked[name]),
+                   (path + "/" + i.name));
+            unhacked[name] = i.name;
+        } else
+            unhacked[i.name] = i.name;
+    return unhacked;
+}
+
+
 static void dump(const Path & path, Sink & sink, PathFilter & filter)
 {
     checkInterrupt();
@@ -82,26 +127,7 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
     else if (S_ISDIR(st.st_mode)) {
         sink << "type" << "directory";
 
-        /* If we're on a case-insensitive system like macOS, undo
-           the case hack applied by restorePath(). */
-        std::map<string, string> unhacked;
-        for (auto & i : readDirectory(path))
-            if (archiveSettings.useCaseHack) {
-                string name(i.name);
-                size_t pos = i.name.find(caseHackSuffix);
-                if (pos != string::npos) {
-                    debug(format("removing case hack suffix from '%1%'") % (path + "/" + i.name));
-                    name.erase(pos);
-                }
-                if (unhacked.find(name) != unhacked.end())
-                    throw Error("file name collision in between '%1%' and '%2%'",
-                       (path + "/" + unhacked[name]),
-                       (path + "/" + i.name));
-                unhacked[name] = i.name;
-            } else
-                unhacked[i.name] = i.name;
-
-        for (auto & i : unhacked)
+        for (auto & i : readEntries(path))
             if (filter(path + "/" + i.first)) {
                 sink << "entry" << "(" << "name" << i.first << "node";
                 dump(path + "/" + i.second, sink, filter);
@@ -118,10 +144,215 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 }
 
 
+/* Parallel NAR serialisation. The tree is first walked to collect its
+   structure, then the NAR is emitted in order while a number of
+   threads read the contents of small files ahead of the emitter.
+   Larger files are streamed by the emitter itself, and the amount of
+   prefetched data waiting to be emitted is bounded. */
+
+static constexpr size_t maxPrefetchFileSize = 1024 * 1024;
+static constexpr size_t maxPrefetchBytes = 64 * 1024 * 1024;
+
+struct DumpNode
+{
+    enum { tRegular, tDirectory, tSymlink } type;
+    Path path;
+    bool executable = false;
+    size_t size = 0;
+    string target;
+    std::vector<std::pair<string, DumpNode>> entries;
+    /* Index of this file's prefetch job, if any. */
+    std::optional<size_t> prefetch;
+};
+
+
+struct Prefetcher
+{
+    struct Job
+    {
+        Path path;
+        size_t size;
+        bool done = false;
+        string contents;
+        std::exception_ptr ex;
+    };
+
+    struct State
+    {
+        std::vector<Job> jobs;
+        size_t next = 0;
+        size_t bytesPending = 0;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::vector<std::thread> threads;
+
+    ~Prefetcher()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thread : threads)
+            thread.join();
+    }
+
+    size_t add(const Path & path, size_t size)
+    {
+        auto state(state_.lock());
+        state->jobs.push_back({path, size});
+        return state->jobs.size() - 1;
+    }
+
+    void start(unsigned int nrThreads)
+    {
+        for (unsigned int n = 0; n < nrThreads; ++n)
+            threads.emplace_back([&]() { worker(); });
+    }
+
+    void worker()
+    {
+        while (true) {
+            Path path;
+            size_t size, i;
+
+            {
+                auto state(state_.lock());
+                while (!state->quit
+                    && state->next < state->jobs.size()
+                    && state->bytesPending + state->jobs[state->next].size > maxPrefetchBytes)
+                    state.wait(wakeup);
+                if (state->quit || state->next == state->jobs.size()) return;
+                i = state->next++;
+                path = state->jobs[i].path;
+                size = state->jobs[i].size;
+                state->bytesPending += size;
+            }
+
+            string contents;
+            std::exception_ptr ex;
+
+            try {
+                AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (!fd) throw SysError("opening file '%1%'", path);
+                contents.resize(size);
+                readFull(fd.get(), contents.data(), size);
+            } catch (...) {
+                ex = std::current_exception();
+            }
+
+            {
+                auto state(state_.lock());
+                state->jobs[i].done = true;
+                state->jobs[i].contents = std::move(contents);
+                state->jobs[i].ex = ex;
+            }
+            wakeup.notify_all();
+        }
+    }
+
+    /* Wait for the contents of job 'i'. Jobs must be taken in order. */
+    string take(size_t i)
+    {
+        auto state(state_.lock());
+        while (!state->jobs[i].done)
+            state.wait(wakeup);
+        auto & job = state->jobs[i];
+        state->bytesPending -= job.size;
+        wakeup.notify_all();
+        if (job.ex) std::rethrow_exception(job.ex);
+        return std::move(job.contents);
+    }
+};
+
+
+static DumpNode collect(const Path & path, PathFilter & filter, Prefetcher & prefetcher)
+{
+    checkInterrupt();
+
+    auto st = lstat(path);
+
+    DumpNode node;
+    node.path = path;
+
+    if (S_ISREG(st.st_mode)) {
+        node.type = DumpNode::tRegular;
+        node.executable = st.st_mode & S_IXUSR;
+        node.size = st.st_size;
+        if (node.size <= maxPrefetchFileSize)
+            node.prefetch = prefetcher.add(path, node.size);
+    }
+
+    else if (S_ISDIR(st.st_mode)) {
+        node.type = DumpNode::tDirectory;
+        for (auto & i : readEntries(path))
+            if (filter(path + "/" + i.first))
+                node.entries.emplace_back(i.first, collect(path + "/" + i.second, filter, prefetcher));
+    }
+
+    else if (S_ISLNK(st.st_mode)) {
+        node.type = DumpNode::tSymlink;
+        node.target = readLink(path);
+    }
+
+    else throw Error("file '%1%' has an unsupported type", path);
+
+    return node;
+}
+
+
+static void emit(const DumpNode & node, Sink & sink, Prefetcher & prefetcher)
+{
+    checkInterrupt();
+
+    sink << "(";
+
+    switch (node.type) {
+
+    case DumpNode::tRegular:
+        sink << "type" << "regular";
+        if (node.executable)
+            sink << "executable" << "";
+        if (node.prefetch) {
+            auto contents = prefetcher.take(*node.prefetch);
+            sink << "contents" << contents;
+        } else
+            dumpContents(node.path, node.size, sink);
+        break;
+
+    case DumpNode::tDirectory:
+        sink << "type" << "directory";
+        for (auto & i : node.entries) {
+            sink << "entry" << "(" << "name" << i.first << "node";
+            emit(i.second, sink, prefetcher);
+            sink << ")";
+        }
+        break;
+
+    case DumpNode::tSymlink:
+        sink << "type" << "symlink" << "target" << node.target;
+        break;
+    }
+
+    sink << ")";
+}
+
+
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     sink << narVersionMagic1;
-    dump(path, sink, filter);
+
+    if (archiveSettings.narDumpThreads <= 1 || !S_ISDIR(lstat(path).st_mode)) {
+        dump(path, sink, filter);
+        return;
+    }
+
+    Prefetcher prefetcher;
+    auto root = collect(path, filter, prefetcher);
+    auto nrJobs = prefetcher.state_.lock()->jobs.size();
+    if (nrJobs)
+        prefetcher.start(std::min((size_t) archiveSettings.narDumpThreads, nrJobs));
+    emit(root, sink, prefetcher);
 }
 
 
@@ -299,6 +530,19 @@ struct RestoreSink : ParseSink
 {
     Path dstPath;
     AutoCloseFD fd;
+    Path fdPath;
+
+    /* If set, file contents are written and closed asynchronously. */
+    std::unique_ptr<IoUring> ring;
+    uint64_t offset = 0;
+
+    void closeFile()
+    {
+        if (ring && fd)
+            ring->close(fd.release(), fdPath);
+        else
+            fd = -1;
+    }
 
     void createDirectory(const Path & path) override
     {
@@ -309,9 +553,12 @@ struct RestoreSink : ParseSink
 
     void createRegularFile(const Path & path) override
     {
+        closeFile();
         Path p = dstPath + path;
         fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
         if (!fd) throw SysError("creating file '%1%'", p);
+        fdPath = p;
+        offset = 0;
     }
 
     void isExecutable() override
@@ -343,7 +590,11 @@ struct RestoreSink : ParseSink
 
     void receiveContents(std::string_view data) override
     {
-        writeFull(fd.get(), data);
+        if (ring) {
+            ring->write(fd.get(), data, offset, fdPath);
+            offset += data.size();
+        } else
+            writeFull(fd.get(), data);
     }
 
     void createSymlink(const Path & path, const string & target) override
@@ -358,7 +609,10 @@ void restorePath(const Path & path, Source & source)
 {
     RestoreSink sink;
     sink.dstPath = path;
+    sink.ring = IoUring::create({IoUring::opWrite, IoUring::opClose});
     parseDump(sink, source);
+    sink.closeFile();
+    if (sink.ring) sink.ring->drain();
 }
 
 
@@ -0,0 +1,249 @@
+/* Throughput benchmarks for NARs, compression and hashing. Run with
+   `make bench', or run the libutil-bench program directly to select
+   benchmarks by name:
+
+     libutil-bench [--corpus PATH] [NAME...]
+
+   Every benchmark is run on a few generated corpora: `small-files'
+   (a tree of many small text files, like most store paths),
+   `binary' (a large file of partly compressible data, like
+   executables and libraries) and `compressed' (incompressible data,
+   like tarballs). With --corpus, a file or directory such as a store
+   path is measured as well. The benchmarks are the dumping, parsing
+   and restoring of the corpus as a NAR (`nar-dump', `nar-parse' and
+   `nar-restore'), compressing and decompressing the NAR with every
+   method and, for zstd, several levels (e.g. `compress-xz',
+   `decompress-xz', `compress-zstd-19'), and hashing it with every hash
+   type (e.g. `hash-sha256'). Each reports the throughput in MB/s of
+   NAR data, and the compression benchmarks also report the
+   compression ratio. */
+
+#include "archive.hh"
+#include "compression.hh"
+#include "hash.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iostream>
+
+using namespace nix;
+
+static std::set<std::string> selected;
+
+static bool wanted(const std::string & name)
+{
+    return selected.empty() || selected.count(name);
+}
+
+/* Run `fun' repeatedly for about a second, and print the throughput,
+   where `fun' returns the number of bytes processed per run. */
+template<typename F>
+static void measure(const std::string & corpus, const std::string & name, F fun, std::string extra = "")
+{
+    using namespace std::chrono;
+
+    if (!wanted(name)) return;
+
+    size_t runs = 0;
+    uint64_t bytes = 0;
+    nanoseconds total{0};
+
+    while (runs == 0 || total < seconds(1)) {
+        auto start = steady_clock::now();
+        bytes += fun();
+        total += duration_cast<nanoseconds>(steady_clock::now() - start);
+        runs++;
+    }
+
+    std::cout << fmt("%-14s %-20s %6d runs %10.1f MB/s%s\n",
+        corpus, name, runs, bytes / 1e6 / duration<double>(total).count(), extra);
+}
+
+struct CountingSink : Sink
+{
+    uint64_t size = 0;
+
+    void operator () (std::string_view data) override
+    {
+        size += data.size();
+    }
+};
+
+/* A deterministic pseudo-random number generator (xorshift64). */
+struct Random
+{
+    uint64_t x = 88172645463325252ULL;
+
+    uint64_t next()
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    }
+
+    std::string bytes(size_t size)
+    {
+        std::string s(size, 0);
+        for (size_t i = 0; i < size; ++i) s[i] = next();
+        return s;
+    }
+};
+
+/* Text made of words from a small vocabulary, which compresses
+   about as well as source code and documentation. */
+static std::string text(Random & random, size_t size)
+{
+    static const std::vector<std::string> words{
+        "the", "nix", "store", "path", "derivation", "build", "output", "if", "then", "else",
+        "return", "int", "const", "std::string", "{", "}", "(", ")", ";", "\n", "    ", "\n\n",
+    };
+    std::string s;
+    while (s.size() < size) {
+        s += words[random.next() % words.size()];
+        s += ' ';
+    }
+    s.resize(size);
+    return s;
+}
+
+static void makeSmallFiles(const Path & dir)
+{
+    Random random;
+    createDirs(dir);
+    for (int d = 0; d < 100; ++d) {
+        auto subdir = fmt("%s/dir%d", dir, d);
+        createDirs(subdir);
+        for (int f = 0; f < 200; ++f)
+            writeFile(fmt("%s/file%d", subdir, f), text(random, 100 + random.next() % 4000));
+        createSymlink("file0", subdir + "/link");
+    }
+}
+
+/* Alternate runs of random bytes, text and zeroes, like the code,
+   strings and padding of an executable. */
+static void makeBinary(const Path & file)
+{
+    Random random;
+    std::string s;
+    while (s.size() < (64 << 20)) {
+        auto size = 1024 + random.next() % 65536;
+        switch (random.next() % 3) {
+            case 0: s += random.bytes(size); break;
+            case 1: s += text(random, size); break;
+            case 2: s += std::string(size, 0); break;
+        }
+    }
+    writeFile(file, s);
+}
+
+static void makeCompressed(const Path & file)
+{
+    Random random;
+    writeFile(file, random.bytes(32 << 20));
+}
+
+static void benchCorpus(const std::string & corpus, const Path & path, const Path & tmpDir)
+{
+    StringSink nar;
+    dumpPath(path, nar);
+
+    measure(corpus, "nar-dump", [&]() {
+        CountingSink sink;
+        dumpPath(path, sink);
+        return sink.size;
+    });
+
+    measure(corpus, "nar-parse", [&]() {
+        ParseSink sink;
+        StringSource source(*nar.s);
+        parseDump(sink, source);
+        return nar.s->size();
+    });
+
+    measure(corpus, "nar-restore", [&]() {
+        auto dst = tmpDir + "/restored";
+        StringSource source(*nar.s);
+        restorePath(dst, source);
+        deletePath(dst);
+        return nar.s->size();
+    });
+
+    std::vector<std::pair<std::string, std::optional<int>>> methods{
+        {"xz", {}}, {"bzip2", {}}, {"br", {}},
+        {"zstd", 1}, {"zstd", 3}, {"zstd", 9}, {"zstd", 19},
+    };
+
+    for (auto & [method, level] : methods) {
+        auto suffix = level ? fmt("%s-%d", method, *level) : method;
+        if (!wanted("compress-" + suffix) && !wanted("decompress-" + suffix)) continue;
+
+        StringSink compressed;
+        {
+            auto sink = makeCompressionSink(method, compressed, false, level);
+            (*sink)(*nar.s);
+            sink->finish();
+        }
+        auto ratio = fmt("  ratio %.3f", (double) compressed.s->size() / nar.s->size());
+
+        measure(corpus, "compress-" + suffix, [&]() {
+            CountingSink count;
+            auto sink = makeCompressionSink(method, count, false, level);
+            (*sink)(*nar.s);
+            sink->finish();
+            return nar.s->size();
+        }, ratio);
+
+        measure(corpus, "decompress-" + suffix, [&]() {
+            NullSink null;
+            auto sink = makeDecompressionSink(method, null);
+            (*sink)(*compressed.s);
+            sink->finish();
+            return nar.s->size();
+        });
+    }
+
+    for (auto ht : {htMD5, htSHA1, htSHA256, htSHA512, htBLAKE3})
+        measure(corpus, "hash-" + printHashType(ht), [&]() {
+            HashSink sink(ht);
+            sink(*nar.s);
+            sink.finish();
+            return nar.s->size();
+        });
+}
+
+int main(int argc, char * * argv)
+{
+    try {
+        std::vector<Path> corpora;
+        for (int n = 1; n < argc; ++n) {
+            std::string arg = argv[n];
+            if (arg == "--corpus" && n + 1 < argc)
+                corpora.push_back(absPath(argv[++n]));
+            else
+                selected.insert(arg);
+        }
+
+        AutoDelete tmpDir(createTempDir("", "nix-bench"));
+
+        makeSmallFiles((Path) tmpDir + "/small-files");
+        benchCorpus("small-files", (Path) tmpDir + "/small-files", tmpDir);
+        deletePath((Path) tmpDir + "/small-files");
+
+        makeBinary((Path) tmpDir + "/binary");
+        benchCorpus("binary", (Path) tmpDir + "/binary", tmpDir);
+        deletePath((Path) tmpDir + "/binary");
+
+        makeCompressed((Path) tmpDir + "/compressed");
+        benchCorpus("compressed", (Path) tmpDir + "/compressed", tmpDir);
+        deletePath((Path) tmpDir + "/compressed");
+
+        for (auto & path : corpora)
+            benchCorpus(std::string(baseNameOf(path)), path, tmpDir);
+
+        return 0;
+    } catch (std::exception & e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,13 @@
+bench: libutil-bench_RUN
+
+programs += libutil-bench
+
+libutil-bench_DIR := $(d)
+
+libutil-bench_INSTALL_DIR :=
+
+libutil-bench_SOURCES := $(wildcard $(d)/*.cc)
+
+libutil-bench_CXXFLAGS += -I src/libutil
+
+libutil-bench_LIBS = libutil
@@ -0,0 +1,322 @@
+#include "blake3.hh"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <thread>
+
+namespace nix {
+
+/* See https://github.com/BLAKE3-team/BLAKE3-specs for the
+   specification. This follows the reference implementation. */
+
+static const Blake3::ChainingValue IV = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const size_t MSG_PERMUTATION[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+static constexpr uint32_t CHUNK_START = 1 << 0;
+static constexpr uint32_t CHUNK_END = 1 << 1;
+static constexpr uint32_t PARENT = 1 << 2;
+static constexpr uint32_t ROOT = 1 << 3;
+
+static constexpr size_t blockSize = 64;
+static constexpr size_t chunkSize = 1024;
+
+/* Large inputs are hashed in subtrees of this many chunks (512 KiB),
+   once at least 'batchSize' bytes are pending. */
+static constexpr unsigned int log2SubtreeChunks = 9;
+static constexpr size_t subtreeSize = chunkSize << log2SubtreeChunks;
+static constexpr size_t batchSize = 8 * subtreeSize;
+
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+
+static inline void g(uint32_t * state, size_t a, size_t b, size_t c, size_t d, uint32_t mx, uint32_t my)
+{
+    state[a] = state[a] + state[b] + mx;
+    state[d] = rotr(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = rotr(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + my;
+    state[d] = rotr(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = rotr(state[b] ^ state[c], 7);
+}
+
+
+static void compress(
+    const Blake3::ChainingValue & cv,
+    const uint32_t blockWords[16],
+    uint64_t counter,
+    uint32_t blockLen,
+    uint32_t flags,
+    uint32_t out[16])
+{
+    uint32_t state[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t) counter, (uint32_t) (counter >> 32), blockLen, flags
+    };
+
+    uint32_t m[16], tmp[16];
+    memcpy(m, blockWords, sizeof(m));
+
+    for (int round = 0; round < 7; ++round) {
+        g(state, 0, 4, 8, 12, m[0], m[1]);
+        g(state, 1, 5, 9, 13, m[2], m[3]);
+        g(state, 2, 6, 10, 14, m[4], m[5]);
+        g(state, 3, 7, 11, 15, m[6], m[7]);
+        g(state, 0, 5, 10, 15, m[8], m[9]);
+        g(state, 1, 6, 11, 12, m[10], m[11]);
+        g(state, 2, 7, 8, 13, m[12], m[13]);
+        g(state, 3, 4, 9, 14, m[14], m[15]);
+        for (size_t i = 0; i < 16; ++i)
+            tmp[i] = m[MSG_PERMUTATION[i]];
+        memcpy(m, tmp, sizeof(m));
+    }
+
+    for (size_t i = 0; i < 8; ++i) {
+        out[i] = state[i] ^ state[i + 8];
+        out[i + 8] = state[i + 8] ^ cv[i];
+    }
+}
+
+
+static Blake3::ChainingValue compressCV(
+    const Blake3::ChainingValue & cv,
+    const uint32_t blockWords[16],
+    uint64_t counter,
+    uint32_t blockLen,
+    uint32_t flags)
+{
+    uint32_t out[16];
+    compress(cv, blockWords, counter, blockLen, flags, out);
+    Blake3::ChainingValue res;
+    memcpy(res.data(), out, sizeof(res));
+    return res;
+}
+
+
+static void wordsFromBytes(const unsigned char * bytes, uint32_t words[16])
+{
+    for (size_t i = 0; i < 16; ++i)
+        words[i] =
+            (uint32_t) bytes[i * 4]
+            | (uint32_t) bytes[i * 4 + 1] << 8
+            | (uint32_t) bytes[i * 4 + 2] << 16
+            | (uint32_t) bytes[i * 4 + 3] << 24;
+}
+
+
+static void parentBlock(const Blake3::ChainingValue & left, const Blake3::ChainingValue & right, uint32_t blockWords[16])
+{
+    memcpy(blockWords, left.data(), 32);
+    memcpy(blockWords + 8, right.data(), 32);
+}
+
+
+static Blake3::ChainingValue parentCV(const Blake3::ChainingValue & left, const Blake3::ChainingValue & right)
+{
+    uint32_t blockWords[16];
+    parentBlock(left, right, blockWords);
+    return compressCV(IV, blockWords, 0, blockSize, PARENT);
+}
+
+
+struct ChunkState
+{
+    Blake3::ChainingValue cv;
+    uint64_t chunkCounter;
+    unsigned char block[64];
+    uint8_t blockLen = 0;
+    uint8_t blocksCompressed = 0;
+
+    ChunkState(uint64_t chunkCounter);
+    void update(std::string_view data);
+    void output(Blake3::ChainingValue & cv, uint32_t blockWords[16], uint32_t & blockLen, uint32_t & flags) const;
+    Blake3::ChainingValue chainingValue() const;
+};
+
+
+ChunkState::ChunkState(uint64_t chunkCounter)
+    : cv(IV), chunkCounter(chunkCounter)
+{
+    memset(block, 0, sizeof(block));
+}
+
+
+void ChunkState::update(std::string_view data)
+{
+    while (!data.empty()) {
+        /* Only compress a full block once more input arrives, since
+           the last block of a chunk needs the CHUNK_END flag. */
+        if (blockLen == blockSize) {
+            uint32_t blockWords[16];
+            wordsFromBytes(block, blockWords);
+            cv = compressCV(cv, blockWords, chunkCounter, blockSize,
+                blocksCompressed == 0 ? CHUNK_START : 0);
+            blocksCompressed++;
+            memset(block, 0, sizeof(block));
+            blockLen = 0;
+        }
+        auto n = std::min(blockSize - blockLen, data.size());
+        memcpy(block + blockLen, data.data(), n);
+        blockLen += n;
+        data.remove_prefix(n);
+    }
+}
+
+
+void ChunkState::output(Blake3::ChainingValue & cv, uint32_t blockWords[16], uint32_t & blockLen, uint32_t & flags) const
+{
+    cv = this->cv;
+    wordsFromBytes(block, blockWords);
+    blockLen = this->blockLen;
+    flags = (blocksCompressed == 0 ? CHUNK_START : 0) | CHUNK_END;
+}
+
+
+Blake3::ChainingValue ChunkState::chainingValue() const
+{
+    Blake3::ChainingValue cv;
+    uint32_t blockWords[16], blockLen, flags;
+    output(cv, blockWords, blockLen, flags);
+    return compressCV(cv, blockWords, chunkCounter, blockLen, flags);
+}
+
+
+/* Hash a complete, non-root subtree of 2^'log2Chunks' chunks starting
+   at chunk 'firstChunk'. */
+static Blake3::ChainingValue hashSubtree(std::string_view data, uint64_t firstChunk, unsigned int log2Chunks)
+{
+    std::vector<Blake3::ChainingValue> stack;
+    uint64_t nrChunks = (uint64_t) 1 << log2Chunks;
+    for (uint64_t i = 0; i < nrChunks; ++i) {
+        ChunkState chunk(firstChunk + i);
+        chunk.update(data.substr(i * chunkSize, chunkSize));
+        auto cv = chunk.chainingValue();
+        for (auto total = i + 1; !(total & 1); total >>= 1) {
+            cv = parentCV(stack.back(), cv);
+            stack.pop_back();
+        }
+        stack.push_back(cv);
+    }
+    assert(stack.size() == 1);
+    return stack[0];
+}
+
+
+Blake3::Blake3(unsigned int maxThreads)
+    : maxThreads(maxThreads)
+{
+}
+
+
+void Blake3::pushSubtree(ChainingValue cv, unsigned int log2Chunks)
+{
+    chunksDone += (uint64_t) 1 << log2Chunks;
+    for (auto total = chunksDone >> log2Chunks; !(total & 1); total >>= 1) {
+        cv = parentCV(cvStack.back(), cv);
+        cvStack.pop_back();
+    }
+    cvStack.push_back(cv);
+}
+
+
+void Blake3::hashSubtrees(std::string_view data)
+{
+    assert(data.size() % subtreeSize == 0);
+    size_t nrSubtrees = data.size() / subtreeSize;
+
+    std::vector<ChainingValue> cvs(nrSubtrees);
+    std::atomic<size_t> next{0};
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < nrSubtrees)
+            cvs[i] = hashSubtree(
+                data.substr(i * subtreeSize, subtreeSize),
+                chunksDone + ((uint64_t) i << log2SubtreeChunks),
+                log2SubtreeChunks);
+    };
+
+    size_t nrThreads = maxThreads ? maxThreads : std::max(1U, std::thread::hardware_concurrency());
+
+    std::vector<std::thread> threads;
+    for (size_t n = 1; n < std::min(nrThreads, nrSubtrees); ++n)
+        threads.emplace_back(worker);
+    worker();
+    for (auto & thread : threads)
+        thread.join();
+
+    for (auto & cv : cvs)
+        pushSubtree(cv, log2SubtreeChunks);
+}
+
+
+void Blake3::update(std::string_view data)
+{
+    pending.append(data);
+
+    /* Keep at least one byte pending, since the last chunk must be
+       finalised by finish(). */
+    if (pending.size() > batchSize) {
+        auto n = (pending.size() - 1) / subtreeSize * subtreeSize;
+        hashSubtrees(std::string_view(pending).substr(0, n));
+        pending.erase(0, n);
+    }
+}
+
+
+void Blake3::finish(unsigned char * out) const
+{
+    auto stack(cvStack);
+    auto chunksDone = this->chunksDone;
+    std::string_view data(pending);
+
+    while (data.size() > chunkSize) {
+        ChunkState chunk(chunksDone);
+        chunk.update(data.substr(0, chunkSize));
+        data.remove_prefix(chunkSize);
+        auto cv = chunk.chainingValue();
+        for (auto total = ++chunksDone; !(total & 1); total >>= 1) {
+            cv = parentCV(stack.back(), cv);
+            stack.pop_back();
+        }
+        stack.push_back(cv);
+    }
+
+    ChunkState chunk(chunksDone);
+    chunk.update(data);
+
+    ChainingValue cv;
+    uint32_t blockWords[16], blockLen, flags;
+    uint64_t counter = chunksDone;
+    chunk.output(cv, blockWords, blockLen, flags);
+
+    for (auto i = stack.rbegin(); i != stack.rend(); ++i) {
+        auto childCV = compressCV(cv, blockWords, counter, blockLen, flags);
+        cv = IV;
+        parentBlock(*i, childCV, blockWords);
+        counter = 0;
+        blockLen = blockSize;
+        flags = PARENT;
+    }
+
+    uint32_t words[16];
+    compress(cv, blockWords, 0, blockLen, flags | ROOT, words);
+    for (size_t i = 0; i < hashSize / 4; ++i)
+        for (size_t j = 0; j < 4; ++j)
+            out[i * 4 + j] = (words[i] >> (8 * j)) & 0xff;
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.hh"
+
+#include <array>
+
+namespace nix {
+
+/* A portable implementation of the BLAKE3 hash function (unkeyed,
+   32-byte output). Since BLAKE3 hashes its input as a binary tree of
+   1 KiB chunks, large inputs are split into subtrees that are hashed
+   in parallel. */
+class Blake3
+{
+public:
+
+    static constexpr size_t hashSize = 32;
+
+    typedef std::array<uint32_t, 8> ChainingValue;
+
+    /* 'maxThreads' bounds the number of threads used for hashing
+       large inputs (0 means the number of CPUs). */
+    Blake3(unsigned int maxThreads = 0);
+
+    void update(std::string_view data);
+
+    /* Write the hash of the input so far to 'out'. This doesn't
+       change the state, so more input can be added afterwards. */
+    void finish(unsigned char * out) const;
+
+private:
+
+    unsigned int maxThreads;
+
+    /* Input that hasn't been hashed yet. It is only hashed once more
+       input arrives, since the last chunk has to be finalised
+       differently. */
+    std::string pending;
+
+    /* The number of chunks hashed so far. */
+    uint64_t chunksDone = 0;
+
+    /* The chaining values of the complete subtrees hashed so far,
+       from largest to smallest. */
+    std::vector<ChainingValue> cvStack;
+
+    void pushSubtree(ChainingValue cv, unsigned int log2Chunks);
+
+    void hashSubtrees(std::string_view data);
+};
+
+}
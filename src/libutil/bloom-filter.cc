@@ -0,0 +1,87 @@
+#include "bloom-filter.hh"
+#include "hash.hh"
+#include "util.hh"
+
+#include <cmath>
+
+namespace nix {
+
+static const std::string magic = "nix-bloom-filter-1";
+
+BloomFilter::BloomFilter(uint64_t numBits, unsigned int numHashes)
+    : numBits(std::max(numBits, (uint64_t) 64))
+    , numHashes(std::max(numHashes, 1U))
+    , bits((this->numBits + 7) / 8, 0)
+{
+}
+
+BloomFilter BloomFilter::forCapacity(uint64_t capacity)
+{
+    /* The optimal size for a false positive rate p is
+       -n ln(p) / ln(2)^2 bits, with (m / n) ln(2) hash functions. */
+    return BloomFilter(std::ceil(capacity * 9.6), 7);
+}
+
+/* Compute the bit positions of ‘key’ by double hashing, using two
+   64-bit words of its SHA-256 hash. */
+template<typename F>
+void BloomFilter::forEachBit(std::string_view key, F f) const
+{
+    auto h = hashString(htSHA256, key);
+
+    uint64_t h1 = 0, h2 = 0;
+    for (int i = 0; i < 8; i++) {
+        h1 |= (uint64_t) h.hash[i] << (8 * i);
+        h2 |= (uint64_t) h.hash[8 + i] << (8 * i);
+    }
+    h2 |= 1;
+
+    for (unsigned int i = 0; i < numHashes; i++)
+        f((h1 + i * h2) % numBits);
+}
+
+void BloomFilter::insert(std::string_view key)
+{
+    forEachBit(key, [&](uint64_t bit) {
+        bits[bit / 8] |= 1 << (bit % 8);
+    });
+}
+
+bool BloomFilter::mayContain(std::string_view key) const
+{
+    bool res = true;
+    forEachBit(key, [&](uint64_t bit) {
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) res = false;
+    });
+    return res;
+}
+
+std::string BloomFilter::serialise() const
+{
+    return fmt("%s\n%d %d\n", magic, numBits, numHashes) + bits;
+}
+
+BloomFilter BloomFilter::parse(std::string_view data)
+{
+    auto nl1 = data.find('\n');
+    auto nl2 = nl1 == data.npos ? data.npos : data.find('\n', nl1 + 1);
+    if (nl2 == data.npos || data.substr(0, nl1) != magic)
+        throw Error("invalid Bloom filter");
+
+    auto params = tokenizeString<std::vector<std::string>>(std::string(data.substr(nl1 + 1, nl2 - nl1 - 1)), " ");
+    std::optional<uint64_t> numBits;
+    std::optional<unsigned int> numHashes;
+    if (params.size() == 2) {
+        numBits = string2Int<uint64_t>(params[0]);
+        numHashes = string2Int<unsigned int>(params[1]);
+    }
+    if (!numBits || !numHashes || *numBits < 64 || *numHashes < 1
+        || data.size() - nl2 - 1 != (*numBits + 7) / 8)
+        throw Error("invalid Bloom filter");
+
+    BloomFilter filter(*numBits, *numHashes);
+    filter.bits = data.substr(nl2 + 1);
+    return filter;
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "types.hh"
+
+namespace nix {
+
+/* A Bloom filter: a compact set of strings that can answer "definitely
+   not a member" or "possibly a member". Its serialised form is
+   independent of the platform, so that a filter written by one
+   machine can be read by another. */
+class BloomFilter
+{
+public:
+
+    /* Create an empty filter with the given number of bits and hash
+       functions. */
+    BloomFilter(uint64_t numBits, unsigned int numHashes);
+
+    /* Create an empty filter with a false positive rate of about 1%
+       once it holds ‘capacity’ elements. */
+    static BloomFilter forCapacity(uint64_t capacity);
+
+    void insert(std::string_view key);
+
+    /* Return false if ‘key’ was definitely never inserted. */
+    bool mayContain(std::string_view key) const;
+
+    std::string serialise() const;
+
+    /* Throws an Error if ‘data’ is not a valid serialised filter. */
+    static BloomFilter parse(std::string_view data);
+
+private:
+
+    uint64_t numBits;
+    unsigned int numHashes;
+    std::string bits;
+
+    template<typename F>
+    void forEachBit(std::string_view key, F f) const;
+};
+
+}
@@ -0,0 +1,94 @@
+#include "chunking.hh"
+
+#include <array>
+
+namespace nix {
+
+/* The random values of the gear hash. They are generated using
+   splitmix64 from a fixed seed; changing them would change all chunk
+   boundaries and thus defeat deduplication with existing chunks. */
+static const std::array<uint64_t, 256> & gearTable()
+{
+    static std::array<uint64_t, 256> table = []() {
+        std::array<uint64_t, 256> table;
+        uint64_t state = 0x6e69782d63646331ULL;
+        for (auto & n : table) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            n = z ^ (z >> 31);
+        }
+        return table;
+    }();
+    return table;
+}
+
+/* Return a mask with `bits' bits set, spread over the upper half of
+   the fingerprint (which depends on the most input bytes). */
+static uint64_t makeMask(unsigned int bits)
+{
+    uint64_t mask = 0;
+    for (unsigned int i = 0; i < bits; ++i)
+        mask |= 1ULL << (63 - 2 * i);
+    return mask;
+}
+
+ChunkingSink::ChunkingSink(ChunkCallback callback,
+    size_t minSize, size_t avgSize, size_t maxSize)
+    : callback(callback), minSize(minSize), avgSize(avgSize), maxSize(maxSize)
+{
+    assert(minSize <= avgSize && avgSize <= maxSize);
+
+    /* Normalised chunking: use a harder condition before the average
+       size and an easier one after, which narrows the distribution
+       of chunk sizes. */
+    unsigned int bits = 0;
+    while ((1ULL << (bits + 1)) <= avgSize) ++bits;
+    maskSmall = makeMask(bits + 2);
+    maskLarge = makeMask(bits >= 2 ? bits - 2 : 0);
+}
+
+void ChunkingSink::operator () (std::string_view data)
+{
+    auto & gear = gearTable();
+
+    while (!data.empty()) {
+        /* Bytes before the minimum chunk size can't end a chunk. */
+        if (chunk.size() < minSize) {
+            auto n = std::min(minSize - chunk.size(), data.size());
+            chunk.append(data.data(), n);
+            data.remove_prefix(n);
+            fingerprint = 0;
+            continue;
+        }
+
+        size_t i = 0;
+        bool boundary = false;
+        while (i < data.size()) {
+            auto size = chunk.size() + i;
+            fingerprint = (fingerprint << 1) + gear[(unsigned char) data[i++]];
+            if (!(fingerprint & (size < avgSize ? maskSmall : maskLarge))
+                || size + 1 >= maxSize)
+            {
+                boundary = true;
+                break;
+            }
+        }
+
+        chunk.append(data.data(), i);
+        data.remove_prefix(i);
+
+        if (boundary) {
+            callback(chunk);
+            chunk.clear();
+        }
+    }
+}
+
+void ChunkingSink::finish()
+{
+    if (!chunk.empty()) callback(chunk);
+    chunk.clear();
+}
+
+}
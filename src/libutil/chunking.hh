@@ -0,0 +1,35 @@
+#pragma once
+
+#include "serialise.hh"
+
+namespace nix {
+
+/* A sink that splits its input into content-defined chunks using the
+   FastCDC algorithm, and passes each chunk to a callback. Since chunk
+   boundaries depend only on the nearby contents, inserting or
+   removing data only changes the chunks around the modification,
+   which makes the chunks suitable for deduplication. */
+struct ChunkingSink : Sink
+{
+    typedef std::function<void(std::string_view chunk)> ChunkCallback;
+
+    ChunkingSink(ChunkCallback callback,
+        size_t minSize = 256 * 1024,
+        size_t avgSize = 1024 * 1024,
+        size_t maxSize = 4 * 1024 * 1024);
+
+    void operator () (std::string_view data) override;
+
+    /* Pass the last, possibly short chunk to the callback. */
+    void finish();
+
+private:
+
+    ChunkCallback callback;
+    size_t minSize, avgSize, maxSize;
+    uint64_t maskSmall, maskLarge;
+    uint64_t fingerprint = 0;
+    std::string chunk;
+};
+
+}
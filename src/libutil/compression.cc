@@ -2,6 +2,7 @@
 #include "util.hh"
 #include "finally.hh"
 #include "logging.hh"
+#include "sync.hh"
 
 #include <lzma.h>
 #include <bzlib.h>
@@ -13,7 +14,13 @@
 
 #include <zlib.h>
 
+#include <zstd.h>
+#include <zstd_errors.h>
+
 #include <iostream>
+#include <deque>
+#include <future>
+#include <thread>
 
 namespace nix {
 
@@ -110,10 +117,34 @@ struct XzDecompressionSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    XzDecompressionSink(Sink & nextSink, bool parallel) : nextSink(nextSink)
     {
-        lzma_ret ret = lzma_stream_decoder(
-            &strm, UINT64_MAX, LZMA_CONCATENATED);
+        lzma_ret ret;
+        bool done = false;
+
+        if (parallel) {
+#ifdef HAVE_LZMA_DECODER_MT
+            /* This only decompresses in parallel if the file has
+               several blocks with their sizes in the block headers,
+               as written by the multi-threaded encoder. */
+            lzma_mt mt_options = {};
+            mt_options.flags = LZMA_CONCATENATED;
+            mt_options.timeout = 300;
+            mt_options.threads = lzma_cputhreads();
+            if (mt_options.threads == 0)
+                mt_options.threads = 1;
+            /* Fall back to single-threaded decoding rather than using
+               too much memory. */
+            mt_options.memlimit_threading = lzma_physmem() / 4;
+            mt_options.memlimit_stop = UINT64_MAX;
+            ret = lzma_stream_decoder_mt(&strm, &mt_options);
+            done = true;
+#endif
+        }
+
+        if (!done)
+            ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma decoder");
 
@@ -268,18 +299,205 @@ ref<std::string> decompress(const std::string & method, const std::string & in)
     return ssink.s;
 }
 
-ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink)
+struct ZstdDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    ZSTD_DCtx * ctx;
+    std::vector<char> outbuf;
+    bool frameDone = true;
+
+    ZstdDecompressionSink(Sink & nextSink, std::string_view prefix = {})
+        : nextSink(nextSink)
+        , outbuf(ZSTD_DStreamOutSize())
+    {
+        ctx = ZSTD_createDCtx();
+        if (!ctx)
+            throw CompressionError("unable to initialise zstd decoder");
+
+        /* Accept the window sizes used for long-distance matching,
+           or, for deltas, the window covering the prefix. */
+        ZSTD_DCtx_setParameter(ctx, ZSTD_d_windowLogMax,
+            prefix.empty() ? 27 : ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+
+        if (!prefix.empty()) {
+            auto ret = ZSTD_DCtx_refPrefix(ctx, prefix.data(), prefix.size());
+            if (ZSTD_isError(ret))
+                throw CompressionError("unable to initialise zstd decoder: %s", ZSTD_getErrorName(ret));
+        }
+    }
+
+    ~ZstdDecompressionSink()
+    {
+        ZSTD_freeDCtx(ctx);
+    }
+
+    void finish() override
+    {
+        flush();
+        if (!frameDone)
+            throw CompressionError("zstd file is truncated");
+    }
+
+    void write(std::string_view data) override
+    {
+        ZSTD_inBuffer in { data.data(), data.size(), 0 };
+        ZSTD_outBuffer out;
+
+        do {
+            checkInterrupt();
+
+            out = { outbuf.data(), outbuf.size(), 0 };
+            auto inPos = in.pos;
+            size_t ret = ZSTD_decompressStream(ctx, &out, &in);
+            if (ZSTD_isError(ret))
+                throw CompressionError("error while decompressing zstd file: %s", ZSTD_getErrorName(ret));
+
+            /* A call that makes no progress (e.g. after a frame that
+               exactly filled the output buffer) returns the size of
+               the next frame header, so ignore it. */
+            if (in.pos != inPos || out.pos)
+                frameDone = ret == 0;
+
+            if (out.pos) nextSink({outbuf.data(), out.pos});
+        } while (in.pos < in.size || out.pos == out.size);
+    }
+};
+
+/* Decompress a zstd file that consists of several frames, as written
+   by ZstdCompressionSink in parallel mode, one frame per thread. Each
+   frame is buffered in memory, so this falls back to decompressing
+   the rest of the data as a stream at the first frame that doesn't
+   record its decompressed size (as is the case for files written in
+   streaming mode), or that is too large. The number of frames and
+   the decompressed bytes in flight are bounded. */
+struct ZstdParallelDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    std::string pending;
+    /* The frames being decompressed, and their decompressed sizes. */
+    std::deque<std::pair<std::future<std::string>, size_t>> frames;
+    size_t bytesInFlight = 0;
+    std::unique_ptr<ZstdDecompressionSink> streaming;
+    size_t maxFrames = std::max(1U, std::thread::hardware_concurrency());
+
+    static constexpr size_t maxFrameSize = 64 * 1024 * 1024;
+    static constexpr size_t maxBytesInFlight = 256 * 1024 * 1024;
+
+    /* The maximum size of a zstd frame header. */
+    static constexpr size_t maxFrameHeaderSize = 18;
+
+    ZstdParallelDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    { }
+
+    void finish() override
+    {
+        flush();
+        if (!streaming && !pending.empty() && pending.size() < maxFrameHeaderSize)
+            startStreaming();
+        if (streaming)
+            streaming->finish();
+        else {
+            writeFrames(0);
+            if (!pending.empty())
+                throw CompressionError("zstd file is truncated");
+        }
+    }
+
+    void write(std::string_view data) override
+    {
+        if (streaming) {
+            (*streaming)(data);
+            return;
+        }
+
+        pending.append(data);
+
+        size_t pos = 0;
+        while (pending.size() - pos >= maxFrameHeaderSize) {
+            auto contentSize = ZSTD_getFrameContentSize(pending.data() + pos, pending.size() - pos);
+            if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN
+                || contentSize == ZSTD_CONTENTSIZE_ERROR
+                || contentSize > maxFrameSize)
+            {
+                pending.erase(0, pos);
+                startStreaming();
+                return;
+            }
+            auto size = ZSTD_findFrameCompressedSize(pending.data() + pos, pending.size() - pos);
+            if (ZSTD_isError(size)) {
+                if (ZSTD_getErrorCode(size) != ZSTD_error_srcSize_wrong)
+                    throw CompressionError("error while decompressing zstd file: %s", ZSTD_getErrorName(size));
+                break;
+            }
+            startFrame(pending.substr(pos, size), contentSize);
+            pos += size;
+        }
+        pending.erase(0, pos);
+
+        if (pending.size() > maxFrameSize)
+            startStreaming();
+    }
+
+    void startFrame(std::string frame, size_t contentSize)
+    {
+        while (!frames.empty()
+            && (frames.size() >= maxFrames || bytesInFlight + contentSize > maxBytesInFlight))
+            writeFrame();
+        bytesInFlight += contentSize;
+        frames.emplace_back(std::async(std::launch::async, [frame{std::move(frame)}]() {
+            StringSink sink;
+            ZstdDecompressionSink decompressor(sink);
+            decompressor(frame);
+            decompressor.finish();
+            return std::move(*sink.s);
+        }), contentSize);
+    }
+
+    /* Write the oldest frame in progress. */
+    void writeFrame()
+    {
+        nextSink(frames.front().first.get());
+        bytesInFlight -= frames.front().second;
+        frames.pop_front();
+    }
+
+    void writeFrames(size_t keep)
+    {
+        while (frames.size() > keep)
+            writeFrame();
+    }
+
+    void startStreaming()
+    {
+        writeFrames(0);
+        streaming = std::make_unique<ZstdDecompressionSink>(nextSink);
+        auto data = std::move(pending);
+        pending.clear();
+        (*streaming)(data);
+    }
+};
+
+ref<CompressionSink> makeDeltaDecompressionSink(std::string_view base, Sink & nextSink)
+{
+    return make_ref<ZstdDecompressionSink>(nextSink, base);
+}
+
+ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink, bool parallel)
 {
     if (method == "none" || method == "")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzDecompressionSink>(nextSink);
+        return make_ref<XzDecompressionSink>(nextSink, parallel);
     else if (method == "bzip2")
         return make_ref<BzipDecompressionSink>(nextSink);
     else if (method == "gzip")
         return make_ref<GzipDecompressionSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliDecompressionSink>(nextSink);
+    else if (method == "zstd" && parallel)
+        return make_ref<ZstdParallelDecompressionSink>(nextSink);
+    else if (method == "zstd")
+        return make_ref<ZstdDecompressionSink>(nextSink);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -469,7 +687,149 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     }
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+struct ZstdCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    ZSTD_CCtx * ctx;
+    std::vector<char> outbuf;
+
+    /* In parallel mode, the input is split into frames of
+       'frameSize' bytes that are compressed independently on
+       separate threads, so that they can be decompressed in parallel
+       as well (see ZstdParallelDecompressionSink). */
+    static constexpr size_t frameSize = 16 * 1024 * 1024;
+    bool framed = false;
+    int level;
+    std::string frame;
+    std::deque<std::future<std::string>> frames;
+    size_t maxFrames = std::max(1U, std::thread::hardware_concurrency());
+
+    ZstdCompressionSink(Sink & nextSink, bool parallel, std::optional<int> level, bool longDistance,
+        std::string_view prefix = {})
+        : nextSink(nextSink)
+        , outbuf(ZSTD_CStreamOutSize())
+        , level(level.value_or(ZSTD_CLEVEL_DEFAULT))
+    {
+        ctx = ZSTD_createCCtx();
+        if (!ctx)
+            throw CompressionError("unable to initialise zstd encoder");
+
+        check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, this->level));
+
+        if (longDistance || !prefix.empty())
+            check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_enableLongDistanceMatching, 1));
+
+        if (!prefix.empty()) {
+            /* Make the window large enough to find matches anywhere in
+               the prefix (like `zstd --patch-from'). */
+            auto bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+            int windowLog = bounds.lowerBound;
+            while (windowLog < bounds.upperBound && (1ULL << windowLog) < prefix.size())
+                windowLog++;
+            check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_windowLog, windowLog));
+            check(ZSTD_CCtx_refPrefix(ctx, prefix.data(), prefix.size()));
+        }
+
+        /* Long-distance matching needs a window larger than a frame,
+           so in that case use zstd's own multi-threading, which
+           produces a single frame. */
+        if (parallel && !longDistance && prefix.empty())
+            framed = true;
+
+        else if (parallel) {
+            auto threads = std::max(1U, std::thread::hardware_concurrency());
+            if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, threads)))
+                printMsg(lvlError, "warning: parallel zstd compression requested but not supported, falling back to single-threaded compression");
+        }
+    }
+
+    ~ZstdCompressionSink()
+    {
+        ZSTD_freeCCtx(ctx);
+    }
+
+    static void check(size_t ret)
+    {
+        if (ZSTD_isError(ret))
+            throw CompressionError("error while compressing zstd file: %s", ZSTD_getErrorName(ret));
+    }
+
+    void startFrame()
+    {
+        while (frames.size() >= maxFrames) {
+            nextSink(frames.front().get());
+            frames.pop_front();
+        }
+
+        frames.push_back(std::async(std::launch::async, [data{std::move(frame)}, level{level}]() {
+            auto ctx = ZSTD_createCCtx();
+            if (!ctx)
+                throw CompressionError("unable to initialise zstd encoder");
+            Finally freeCtx([&]() { ZSTD_freeCCtx(ctx); });
+            check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level));
+            /* Single-shot compression records the frame's size in
+               its header. */
+            std::string out(ZSTD_compressBound(data.size()), 0);
+            auto size = ZSTD_compress2(ctx, out.data(), out.size(), data.data(), data.size());
+            check(size);
+            out.resize(size);
+            return out;
+        }));
+
+        frame.clear();
+    }
+
+    void finish() override
+    {
+        flush();
+
+        if (framed) {
+            if (!frame.empty() || frames.empty())
+                startFrame();
+            for (auto & f : frames)
+                nextSink(f.get());
+            frames.clear();
+            return;
+        }
+
+        ZSTD_inBuffer in { nullptr, 0, 0 };
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out { outbuf.data(), outbuf.size(), 0 };
+            remaining = ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_end);
+            check(remaining);
+            if (out.pos) nextSink({outbuf.data(), out.pos});
+        } while (remaining);
+    }
+
+    void write(std::string_view data) override
+    {
+        if (framed) {
+            while (!data.empty()) {
+                checkInterrupt();
+                auto n = std::min(data.size(), frameSize - frame.size());
+                frame.append(data.substr(0, n));
+                data.remove_prefix(n);
+                if (frame.size() == frameSize)
+                    startFrame();
+            }
+            return;
+        }
+
+        ZSTD_inBuffer in { data.data(), data.size(), 0 };
+
+        while (in.pos < in.size) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out { outbuf.data(), outbuf.size(), 0 };
+            check(ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_continue));
+            if (out.pos) nextSink({outbuf.data(), out.pos});
+        }
+    }
+};
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel, std::optional<int> level, bool longDistance)
 {
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
@@ -479,10 +839,61 @@ ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & next
         return make_ref<BzipCompressionSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliCompressionSink>(nextSink);
+    else if (method == "zstd")
+        return make_ref<ZstdCompressionSink>(nextSink, parallel, level, longDistance);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
 
+ref<CompressionSink> makeDeltaCompressionSink(std::string_view base, Sink & nextSink, std::optional<int> level)
+{
+    return make_ref<ZstdCompressionSink>(nextSink, false, level, true, base);
+}
+
+bool isStreamCompressionMethod(const std::string & method)
+{
+    return method == "none" || method == "xz" || method == "bzip2"
+        || method == "br" || method == "zstd";
+}
+
+std::unique_ptr<Source> makeDecompressionSource(const std::string & method, Source & source,
+    bool parallel)
+{
+    return sinkToSource([method, &source, parallel](Sink & sink) {
+        auto decompressor = makeDecompressionSink(method, sink, parallel);
+        source.drainInto(*decompressor);
+        decompressor->finish();
+    });
+}
+
+struct BackgroundCompressionSink : CompressionSink
+{
+    ref<CompressionSink> sink;
+    BackgroundSink background;
+
+    BackgroundCompressionSink(ref<CompressionSink> sink)
+        : sink(sink)
+        , background(*sink)
+    { }
+
+    void write(std::string_view data) override
+    {
+        background(data);
+    }
+
+    void finish() override
+    {
+        flush();
+        background.finish();
+        sink->finish();
+    }
+};
+
+ref<CompressionSink> makeBackgroundSink(ref<CompressionSink> sink)
+{
+    return make_ref<BackgroundCompressionSink>(sink);
+}
+
 ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
 {
     StringSink ssink;
@@ -4,6 +4,7 @@
 #include "types.hh"
 #include "serialise.hh"
 
+#include <optional>
 #include <string>
 
 namespace nix {
@@ -15,11 +16,46 @@ struct CompressionSink : BufferedSink
 
 ref<std::string> decompress(const std::string & method, const std::string & in);
 
-ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
+/* Return a sink that decompresses data compressed using `method'. If
+   `parallel' is set, xz files with several blocks and zstd files with
+   several frames (as written by makeCompressionSink() with `parallel'
+   set) are decompressed on several threads. */
+ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink,
+    bool parallel = false);
 
 ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+/* Return a sink that compresses data using `method'. `level' is the
+   compression level (none means the method's default), and
+   `longDistance' enables long-distance matching, which finds
+   repetitions far apart in large inputs at the expense of memory.
+   Both are currently only supported by zstd. */
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel = false, std::optional<int> level = {}, bool longDistance = false);
+
+/* Return a sink that compresses data with zstd relative to `base'
+   (like `zstd --patch-from'), so that the output is small if the data
+   is similar to `base'. It can only be decompressed by
+   makeDeltaDecompressionSink() with the same `base'. `base' must
+   remain valid until finish() has been called. */
+ref<CompressionSink> makeDeltaCompressionSink(std::string_view base, Sink & nextSink, std::optional<int> level = {});
+
+ref<CompressionSink> makeDeltaDecompressionSink(std::string_view base, Sink & nextSink);
+
+/* Return a sink that feeds its data to `sink' on a separate thread,
+   so that the caller doesn't have to wait for compression. Errors
+   are rethrown by finish(). */
+ref<CompressionSink> makeBackgroundSink(ref<CompressionSink> sink);
+
+/* Return whether `method' can be used both for compression and
+   decompression, i.e. whether it's usable on a connection where
+   either side may be sending. */
+bool isStreamCompressionMethod(const std::string & method);
+
+/* Return a source that decompresses the data read from `source'.
+   `parallel' is as for makeDecompressionSink(). */
+std::unique_ptr<Source> makeDecompressionSource(const std::string & method, Source & source,
+    bool parallel = false);
 
 MakeError(UnknownCompressionMethod, Error);
 
@@ -332,6 +332,29 @@ template<> std::string BaseSetting<StringMap>::to_string() const
     return concatStringsSep(" ", kvstrs);
 }
 
+template<> void BaseSetting<std::optional<int>>::set(const std::string & str, bool append)
+{
+    if (str == "")
+        value.reset();
+    else if (auto n = string2Int<int>(str))
+        value = *n;
+    else
+        throw UsageError("setting '%s' has invalid value '%s'", name, str);
+}
+
+template<> std::string BaseSetting<std::optional<int>>::to_string() const
+{
+    return value ? std::to_string(*value) : "";
+}
+
+template<> std::map<std::string, nlohmann::json> BaseSetting<std::optional<int>>::toJSONObject()
+{
+    auto obj = AbstractSetting::toJSONObject();
+    obj.emplace("value", value ? nlohmann::json(*value) : nlohmann::json());
+    obj.emplace("defaultValue", defaultValue ? nlohmann::json(*defaultValue) : nlohmann::json());
+    return obj;
+}
+
 template class BaseSetting<int>;
 template class BaseSetting<unsigned int>;
 template class BaseSetting<long>;
@@ -343,6 +366,7 @@ template class BaseSetting<std::string>;
 template class BaseSetting<Strings>;
 template class BaseSetting<StringSet>;
 template class BaseSetting<StringMap>;
+template class BaseSetting<std::optional<int>>;
 
 void PathSetting::set(const std::string & str, bool append)
 {
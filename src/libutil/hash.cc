@@ -7,6 +7,8 @@
 #include "args.hh"
 #include "hash.hh"
 #include "archive.hh"
+#include "blake3.hh"
+#include "sha256.hh"
 #include "split.hh"
 #include "util.hh"
 
@@ -23,12 +25,13 @@ static size_t regularHashSize(HashType type) {
     case htSHA1: return sha1HashSize;
     case htSHA256: return sha256HashSize;
     case htSHA512: return sha512HashSize;
+    case htBLAKE3: return blake3HashSize;
     }
     abort();
 }
 
 
-std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512" };
+std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512", "blake3" };
 
 
 Hash::Hash(HashType type) : type(type)
@@ -272,12 +275,17 @@ Hash newHashAllowEmpty(std::string hashStr, std::optional<HashType> ht)
 }
 
 
-union Ctx
+struct Ctx
 {
-    MD5_CTX md5;
-    SHA_CTX sha1;
-    SHA256_CTX sha256;
-    SHA512_CTX sha512;
+    union
+    {
+        MD5_CTX md5;
+        SHA_CTX sha1;
+        SHA256_CTX sha256;
+        Sha256Ctx sha256hw;
+        SHA512_CTX sha512;
+    };
+    Blake3 blake3;
 };
 
 
@@ -285,7 +293,10 @@ static void start(HashType ht, Ctx & ctx)
 {
     if (ht == htMD5) MD5_Init(&ctx.md5);
     else if (ht == htSHA1) SHA1_Init(&ctx.sha1);
-    else if (ht == htSHA256) SHA256_Init(&ctx.sha256);
+    else if (ht == htSHA256) {
+        if (haveHardwareSha256()) sha256Init(ctx.sha256hw);
+        else SHA256_Init(&ctx.sha256);
+    }
     else if (ht == htSHA512) SHA512_Init(&ctx.sha512);
 }
 
@@ -295,8 +306,12 @@ static void update(HashType ht, Ctx & ctx,
 {
     if (ht == htMD5) MD5_Update(&ctx.md5, data.data(), data.size());
     else if (ht == htSHA1) SHA1_Update(&ctx.sha1, data.data(), data.size());
-    else if (ht == htSHA256) SHA256_Update(&ctx.sha256, data.data(), data.size());
+    else if (ht == htSHA256) {
+        if (haveHardwareSha256()) sha256Update(ctx.sha256hw, data);
+        else SHA256_Update(&ctx.sha256, data.data(), data.size());
+    }
     else if (ht == htSHA512) SHA512_Update(&ctx.sha512, data.data(), data.size());
+    else if (ht == htBLAKE3) ctx.blake3.update(data);
 }
 
 
@@ -304,8 +319,12 @@ static void finish(HashType ht, Ctx & ctx, unsigned char * hash)
 {
     if (ht == htMD5) MD5_Final(hash, &ctx.md5);
     else if (ht == htSHA1) SHA1_Final(hash, &ctx.sha1);
-    else if (ht == htSHA256) SHA256_Final(hash, &ctx.sha256);
+    else if (ht == htSHA256) {
+        if (haveHardwareSha256()) sha256Final(hash, ctx.sha256hw);
+        else SHA256_Final(hash, &ctx.sha256);
+    }
     else if (ht == htSHA512) SHA512_Final(hash, &ctx.sha512);
+    else if (ht == htBLAKE3) ctx.blake3.finish(hash);
 }
 
 
@@ -390,6 +409,7 @@ std::optional<HashType> parseHashTypeOpt(std::string_view s)
     else if (s == "sha1") return htSHA1;
     else if (s == "sha256") return htSHA256;
     else if (s == "sha512") return htSHA512;
+    else if (s == "blake3") return htBLAKE3;
     else return std::optional<HashType> {};
 }
 
@@ -409,6 +429,7 @@ string printHashType(HashType ht)
     case htSHA1: return "sha1";
     case htSHA256: return "sha256";
     case htSHA512: return "sha512";
+    case htBLAKE3: return "blake3";
     default:
         // illegal hash type enum value internally, as opposed to external input
         // which should be validated with nice error message.
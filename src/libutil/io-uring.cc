@@ -0,0 +1,336 @@
+#include "io-uring.hh"
+#include "config.hh"
+#include "util.hh"
+
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace nix {
+
+struct IoUringSettings : Config
+{
+    Setting<bool> useIoUring{this, false, "use-io-uring",
+        R"(
+          If set to `true` (Linux only), batch the system calls made
+          when unpacking NARs into the file system and when deleting
+          trees (e.g. during garbage collection) using io_uring. This
+          helps with paths containing many small files. It has no
+          effect if the kernel doesn't support io_uring.
+        )"};
+
+    Setting<unsigned int> ioUringDepth{this, 256, "io-uring-depth",
+        "The maximum number of operations in flight when `use-io-uring` is enabled."};
+};
+
+static IoUringSettings ioUringSettings;
+
+static GlobalConfig::Register rIoUringSettings(&ioUringSettings);
+
+
+#if HAVE_IO_URING
+
+struct IoUring::Ring
+{
+    AutoCloseFD fd;
+    unsigned int entries;
+
+    void * sqPtr = MAP_FAILED, * cqPtr = MAP_FAILED;
+    size_t sqSize = 0, cqSize = 0;
+    io_uring_sqe * sqes = (io_uring_sqe *) MAP_FAILED;
+    size_t sqesSize = 0;
+
+    unsigned * sqHead, * sqTail, * sqMask, * sqArray;
+    unsigned * cqHead, * cqTail, * cqMask;
+    io_uring_cqe * cqes;
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqPtr != MAP_FAILED && cqPtr != sqPtr) munmap(cqPtr, cqSize);
+        if (sqPtr != MAP_FAILED) munmap(sqPtr, sqSize);
+    }
+};
+
+
+struct IoUring::Request
+{
+    Op op;
+    int fd;
+    std::string data;
+    Path path;
+    uint64_t offset = 0;
+    int flags = 0;
+};
+
+
+static uint8_t toOpcode(IoUring::Op op)
+{
+    switch (op) {
+    case IoUring::opWrite: return IORING_OP_WRITE;
+    case IoUring::opClose: return IORING_OP_CLOSE;
+    case IoUring::opUnlink: return IORING_OP_UNLINKAT;
+    }
+    abort();
+}
+
+
+std::unique_ptr<IoUring> IoUring::create(std::initializer_list<Op> ops)
+{
+    if (!ioUringSettings.useIoUring) return nullptr;
+
+    auto ring = std::make_unique<Ring>();
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, std::max(1U, ioUringSettings.ioUringDepth.get()), &params);
+    if (!ring->fd) {
+        debug("cannot use io_uring: %s", strerror(errno));
+        return nullptr;
+    }
+    ring->entries = params.sq_entries;
+
+    /* Check that the kernel supports the operations we need. */
+    std::vector<char> probeBuf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    auto probe = (io_uring_probe *) probeBuf.data();
+    if (syscall(__NR_io_uring_register, ring->fd.get(), IORING_REGISTER_PROBE, probe, 256) == -1) {
+        debug("cannot use io_uring: %s", strerror(errno));
+        return nullptr;
+    }
+    for (auto op : ops) {
+        auto opcode = toOpcode(op);
+        if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+            debug("cannot use io_uring: kernel doesn't support operation %d", opcode);
+            return nullptr;
+        }
+    }
+
+    ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqSize = ring->cqSize = std::max(ring->sqSize, ring->cqSize);
+
+    ring->sqPtr = mmap(nullptr, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd.get(), IORING_OFF_SQ_RING);
+    if (ring->sqPtr == MAP_FAILED)
+        throw SysError("mapping io_uring submission queue");
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqPtr = ring->sqPtr;
+    else {
+        ring->cqPtr = mmap(nullptr, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd.get(), IORING_OFF_CQ_RING);
+        if (ring->cqPtr == MAP_FAILED)
+            throw SysError("mapping io_uring completion queue");
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *) mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd.get(), IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        throw SysError("mapping io_uring submission queue entries");
+
+    auto sq = (char *) ring->sqPtr, cq = (char *) ring->cqPtr;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return std::unique_ptr<IoUring>(new IoUring(std::move(ring)));
+}
+
+
+IoUring::IoUring(std::unique_ptr<Ring> ring)
+    : ring(std::move(ring))
+{
+}
+
+
+IoUring::~IoUring()
+{
+    /* The kernel may still access the buffers of pending requests, so
+       wait for them. */
+    while (inFlight && !broken) {
+        try {
+            drain();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    for (auto & i : fds)
+        if (i.second.closeRequested)
+            ::close(i.first);
+}
+
+
+void IoUring::queue(std::unique_ptr<Request> req)
+{
+    while (inFlight >= ring->entries)
+        submitAndReap(1);
+
+    auto tail = *ring->sqTail;
+    auto index = tail & *ring->sqMask;
+    auto & sqe = ring->sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = toOpcode(req->op);
+    sqe.fd = req->fd;
+
+    switch (req->op) {
+    case opWrite:
+        sqe.addr = (uint64_t) req->data.data();
+        sqe.len = req->data.size();
+        sqe.off = req->offset;
+        break;
+    case opClose:
+        break;
+    case opUnlink:
+        sqe.addr = (uint64_t) req->data.c_str();
+        sqe.unlink_flags = req->flags;
+        break;
+    }
+
+    /* The kernel may see the entry as soon as the tail is updated,
+       so it must be complete by then. */
+    sqe.user_data = (uint64_t) req.release();
+
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    inFlight++;
+}
+
+
+void IoUring::write(int fd, std::string_view data, uint64_t offset, const Path & path)
+{
+    queue(std::make_unique<Request>(Request { opWrite, fd, std::string(data), path, offset }));
+    fds[fd].pendingWrites++;
+}
+
+
+void IoUring::close(int fd, const Path & path)
+{
+    auto i = fds.find(fd);
+    if (i != fds.end() && i->second.pendingWrites) {
+        i->second.closeRequested = true;
+        i->second.path = path;
+        return;
+    }
+    if (i != fds.end()) fds.erase(i);
+    queue(std::make_unique<Request>(Request { opClose, fd, "", path }));
+}
+
+
+void IoUring::unlinkAt(int dirFd, const std::string & name, int flags, const Path & path)
+{
+    queue(std::make_unique<Request>(Request { opUnlink, dirFd, name, path, 0, flags }));
+}
+
+
+void IoUring::submitAndReap(unsigned int wait)
+{
+    while (true) {
+        auto toSubmit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring->fd.get(), toSubmit, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) != -1)
+            break;
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            broken = true;
+            throw SysError("submitting I/O requests");
+        }
+        checkInterrupt();
+    }
+
+    std::exception_ptr ex;
+    std::vector<std::pair<int, Path>> toClose;
+
+    auto head = *ring->cqHead;
+    auto tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        auto & cqe = ring->cqes[head & *ring->cqMask];
+        std::unique_ptr<Request> req((Request *) cqe.user_data);
+        auto res = cqe.res;
+        inFlight--;
+
+        if (req->op == opWrite) {
+            auto & state = fds[req->fd];
+            if (!--state.pendingWrites && state.closeRequested) {
+                toClose.emplace_back(req->fd, state.path);
+                fds.erase(req->fd);
+            }
+        }
+
+        try {
+            complete(*req, res);
+        } catch (...) {
+            if (!ex) ex = std::current_exception();
+        }
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    for (auto & [fd, path] : toClose)
+        queue(std::make_unique<Request>(Request { opClose, fd, "", path }));
+
+    if (ex) std::rethrow_exception(ex);
+}
+
+
+void IoUring::complete(Request & req, int res)
+{
+    switch (req.op) {
+    case opWrite:
+        if (res < 0) {
+            errno = -res;
+            throw SysError("writing to file '%1%'", req.path);
+        }
+        if ((size_t) res != req.data.size())
+            throw Error("short write to file '%1%'", req.path);
+        break;
+    case opClose:
+        if (res < 0) {
+            errno = -res;
+            throw SysError("closing file '%1%'", req.path);
+        }
+        break;
+    case opUnlink:
+        if (res < 0 && res != -ENOENT) {
+            errno = -res;
+            throw SysError("cannot unlink '%1%'", req.path);
+        }
+        break;
+    }
+}
+
+
+void IoUring::drain()
+{
+    while (inFlight)
+        submitAndReap(inFlight);
+}
+
+#else
+
+struct IoUring::Ring { };
+struct IoUring::Request { };
+
+std::unique_ptr<IoUring> IoUring::create(std::initializer_list<Op> ops)
+{
+    return nullptr;
+}
+
+IoUring::~IoUring() { }
+void IoUring::write(int fd, std::string_view data, uint64_t offset, const Path & path) { abort(); }
+void IoUring::close(int fd, const Path & path) { abort(); }
+void IoUring::unlinkAt(int dirFd, const std::string & name, int flags, const Path & path) { abort(); }
+void IoUring::drain() { }
+
+#endif
+
+}
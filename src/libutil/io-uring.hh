@@ -0,0 +1,78 @@
+#pragma once
+
+#include "types.hh"
+
+#include <map>
+
+namespace nix {
+
+/* A minimal wrapper around Linux's io_uring interface, used to batch
+   the many small system calls made when unpacking or deleting trees
+   with lots of files. Operations are queued and submitted in
+   batches, with a bounded number in flight. Since they complete
+   asynchronously, errors are thrown by whatever call reaps the
+   failing operation; callers must call drain() before relying on the
+   results. */
+class IoUring
+{
+public:
+
+    enum Op { opWrite, opClose, opUnlink };
+
+    /* Return a ring supporting the given operations, or nullptr if
+       io_uring is disabled (the 'use-io-uring' setting) or not
+       supported by the kernel. */
+    static std::unique_ptr<IoUring> create(std::initializer_list<Op> ops);
+
+    /* Waits for all pending operations, ignoring errors. */
+    ~IoUring();
+
+    /* Write 'data' at 'offset' in 'fd'. The data is copied. */
+    void write(int fd, std::string_view data, uint64_t offset, const Path & path);
+
+    /* Close 'fd' once the writes queued for it have completed. The
+       ring takes ownership of 'fd'. */
+    void close(int fd, const Path & path);
+
+    /* Unlink 'name' relative to 'dirFd', ignoring ENOENT. 'dirFd'
+       must stay open until the operation has completed. */
+    void unlinkAt(int dirFd, const std::string & name, int flags, const Path & path);
+
+    /* Wait for all pending operations to complete. */
+    void drain();
+
+private:
+
+    struct Ring;
+    struct Request;
+
+    std::unique_ptr<Ring> ring;
+
+    unsigned int inFlight = 0;
+
+    /* Whether io_uring_enter() failed, in which case pending
+       operations can't be waited for. */
+    bool broken = false;
+
+    /* The number of writes in flight per file descriptor, and whether
+       it should be closed once they're done. */
+    struct FdState
+    {
+        unsigned int pendingWrites = 0;
+        bool closeRequested = false;
+        Path path;
+    };
+    std::map<int, FdState> fds;
+
+    IoUring(std::unique_ptr<Ring> ring);
+
+    void queue(std::unique_ptr<Request> req);
+
+    /* Submit the queued operations and reap completions, waiting
+       until at least 'wait' operations have completed. */
+    void submitAndReap(unsigned int wait);
+
+    void complete(Request & req, int res);
+};
+
+}
@@ -8,14 +8,21 @@ namespace nix {
 void toJSON(std::ostream & str, const char * start, const char * end)
 {
     str << '"';
-    for (auto i = start; i != end; i++)
+    /* Write runs of characters that don't need escaping in one go
+       rather than one character at a time. */
+    auto run = start;
+    for (auto i = start; i != end; i++) {
+        if (*i != '\"' && *i != '\\' && !(*i >= 0 && *i < 32)) continue;
+        str.write(run, i - run);
+        run = i + 1;
         if (*i == '\"' || *i == '\\') str << '\\' << *i;
         else if (*i == '\n') str << "\\n";
         else if (*i == '\r') str << "\\r";
         else if (*i == '\t') str << "\\t";
-        else if (*i >= 0 && *i < 32)
+        else
             str << "\\u" << std::setfill('0') << std::setw(4) << std::hex << (uint16_t) *i << std::dec;
-        else str << *i;
+    }
+    str.write(run, end - run);
     str << '"';
 }
 
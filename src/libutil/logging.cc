@@ -1,8 +1,10 @@
 #include "logging.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <chrono>
 #include <nlohmann/json.hpp>
 #include <iostream>
 
@@ -113,6 +115,39 @@ void warnOnce(bool & haveWarned, const FormatOrString & fs)
     }
 }
 
+struct StartupPhases
+{
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    std::vector<std::pair<std::string, std::chrono::steady_clock::duration>> pending;
+    bool printed = false;
+};
+
+static Sync<StartupPhases> startupPhases;
+
+static void printStartupPhase(const std::string & phase, std::chrono::steady_clock::duration d)
+{
+    debug("startup: %s took %.1f ms", phase,
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0);
+}
+
+void startupPhase(std::string_view phase)
+{
+    auto state(startupPhases.lock());
+    if (state->printed) return;
+    auto now = std::chrono::steady_clock::now();
+    state->pending.emplace_back(phase, now - state->last);
+    state->last = now;
+}
+
+void printStartupPhases()
+{
+    auto state(startupPhases.lock());
+    for (auto & [phase, d] : state->pending)
+        printStartupPhase(phase, d);
+    state->pending.clear();
+    state->printed = true;
+}
+
 void writeToStderr(const string & s)
 {
     try {
@@ -130,6 +165,83 @@ Logger * makeSimpleLogger(bool printBuildLogs)
     return new SimpleLogger(printBuildLogs);
 }
 
+static thread_local Logger * threadLogger = nullptr;
+
+Logger * setThreadLogger(Logger * logger)
+{
+    auto prev = threadLogger;
+    threadLogger = logger;
+    return prev;
+}
+
+struct ThreadLocalLogger : Logger
+{
+    Logger & fallback;
+
+    ThreadLocalLogger(Logger & fallback) : fallback(fallback) { }
+
+    Logger & get()
+    {
+        return threadLogger ? *threadLogger : fallback;
+    }
+
+    void stop() override
+    {
+        fallback.stop();
+    }
+
+    bool isVerbose() override
+    {
+        return get().isVerbose();
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        get().log(lvl, fs);
+    }
+
+    void logEI(const ErrorInfo & ei) override
+    {
+        get().logEI(ei);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        get().warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        get().startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        get().stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        get().result(act, type, fields);
+    }
+
+    void writeToStdout(std::string_view s) override
+    {
+        get().writeToStdout(s);
+    }
+
+    std::optional<char> ask(std::string_view s) override
+    {
+        return get().ask(s);
+    }
+};
+
+Logger * makeThreadLocalLogger(Logger & fallback)
+{
+    return new ThreadLocalLogger(fallback);
+}
+
 std::atomic<uint64_t> nextId{(uint64_t) getpid() << 32};
 
 Activity::Activity(Logger & logger, Verbosity lvl, ActivityType type,
@@ -142,6 +254,21 @@ Activity::Activity(Logger & logger, Verbosity lvl, ActivityType type,
 struct JSONLogger : Logger {
     Logger & prevLogger;
 
+    /* Progress results are emitted at most once per
+       'progressInterval' per activity, since e.g. file transfers
+       report progress for every chunk of data, which with many
+       parallel transfers floods the log. A suppressed result is
+       emitted before any later message about its activity. */
+    static constexpr std::chrono::milliseconds progressInterval{100};
+
+    struct ProgressState
+    {
+        std::chrono::steady_clock::time_point lastEmitted;
+        std::optional<Fields> pending;
+    };
+
+    Sync<std::map<ActivityId, ProgressState>> progress_;
+
     JSONLogger(Logger & prevLogger) : prevLogger(prevLogger) { }
 
     bool isVerbose() override {
@@ -231,6 +358,17 @@ struct JSONLogger : Logger {
 
     void stopActivity(ActivityId act) override
     {
+        std::optional<Fields> pending;
+        {
+            auto progress(progress_.lock());
+            auto i = progress->find(act);
+            if (i != progress->end()) {
+                pending = std::move(i->second.pending);
+                progress->erase(i);
+            }
+        }
+        if (pending) writeResult(act, resProgress, *pending);
+
         nlohmann::json json;
         json["action"] = "stop";
         json["id"] = act;
@@ -238,6 +376,31 @@ struct JSONLogger : Logger {
     }
 
     void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        std::optional<Fields> pending;
+        {
+            auto progress(progress_.lock());
+            if (type == resProgress) {
+                auto now = std::chrono::steady_clock::now();
+                auto & state = (*progress)[act];
+                if (now < state.lastEmitted + progressInterval) {
+                    state.pending = fields;
+                    return;
+                }
+                state.lastEmitted = now;
+                state.pending.reset();
+            } else {
+                auto i = progress->find(act);
+                if (i != progress->end())
+                    pending.swap(i->second.pending);
+            }
+        }
+        if (pending) writeResult(act, resProgress, *pending);
+
+        writeResult(act, type, fields);
+    }
+
+    void writeResult(ActivityId act, ResultType type, const Fields & fields)
     {
         nlohmann::json json;
         json["action"] = "result";
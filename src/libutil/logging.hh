@@ -31,6 +31,9 @@ typedef enum {
     resProgress = 105,
     resSetExpected = 106,
     resPostBuildLogLine = 107,
+    /* The measurements of a build (see BuildResult::getMetrics()):
+       the derivation path, followed by pairs of names and values. */
+    resBuildMetrics = 108,
 } ResultType;
 
 typedef uint64_t ActivityId;
@@ -166,6 +169,16 @@ Logger * makeSimpleLogger(bool printBuildLogs = true);
 
 Logger * makeJSONLogger(Logger & prevLogger);
 
+/* Return a logger that forwards everything to the logger set for the
+   calling thread by setThreadLogger(), or to 'fallback' if the thread
+   has none. This allows threads serving different clients to send
+   their messages to different places. */
+Logger * makeThreadLocalLogger(Logger & fallback);
+
+/* Set the logger used by the calling thread if the global logger was
+   created by makeThreadLocalLogger(). Returns the previous one. */
+Logger * setThreadLogger(Logger * logger);
+
 bool handleJSONLogMessage(const std::string & msg,
     const Activity & act, std::map<ActivityId, Activity> & activities,
     bool trusted);
@@ -215,6 +228,16 @@ inline void warn(const std::string & fs, const Args & ... args)
 
 void warnOnce(bool & haveWarned, const FormatOrString & fs);
 
+/* Record the end of a phase of the program's startup, such as
+   reading the configuration or loading plugins. */
+void startupPhase(std::string_view phase);
+
+/* Show the startup phases recorded so far, with the time each one
+   took, at debug verbosity. This is called once the command line has
+   been parsed, since the verbosity isn't known before that. It marks
+   the end of startup: later calls to startupPhase() are ignored. */
+void printStartupPhases();
+
 void writeToStderr(const string & s);
 
 }
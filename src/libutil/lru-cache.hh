@@ -1,28 +1,39 @@
 #pragma once
 
+#include "sync.hh"
+
+#include <algorithm>
 #include <cassert>
-#include <map>
+#include <chrono>
 #include <list>
+#include <memory>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 namespace nix {
 
 /* A simple least-recently used cache. Not thread-safe. */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
 class LRUCache
 {
 private:
 
     size_t capacity;
 
-    // Stupid wrapper to get around circular dependency between Data
-    // and LRU.
-    struct LRUIterator;
+    struct Item;
+
+    using Data = std::unordered_map<Key, Item, Hash>;
 
-    using Data = std::map<Key, std::pair<LRUIterator, Value>>;
-    using LRU = std::list<typename Data::iterator>;
+    /* Pointers to the keys in 'data', least recently used first.
+       Unlike iterators, these stay valid when 'data' is rehashed. */
+    using LRU = std::list<const Key *>;
 
-    struct LRUIterator { typename LRU::iterator it; };
+    struct Item
+    {
+        typename LRU::iterator it;
+        Value value;
+    };
 
     Data data;
     LRU lru;
@@ -40,25 +51,24 @@ public:
 
         if (data.size() >= capacity) {
             /* Retire the oldest item. */
-            auto oldest = lru.begin();
-            data.erase(*oldest);
-            lru.erase(oldest);
+            auto oldest = data.find(*lru.front());
+            assert(oldest != data.end());
+            lru.pop_front();
+            data.erase(oldest);
         }
 
-        auto res = data.emplace(key, std::make_pair(LRUIterator(), value));
+        auto res = data.emplace(key, Item { lru.end(), value });
         assert(res.second);
         auto & i(res.first);
 
-        auto j = lru.insert(lru.end(), i);
-
-        i->second.first.it = j;
+        i->second.it = lru.insert(lru.end(), &i->first);
     }
 
     bool erase(const Key & key)
     {
         auto i = data.find(key);
         if (i == data.end()) return false;
-        lru.erase(i->second.first.it);
+        lru.erase(i->second.it);
         data.erase(i);
         return true;
     }
@@ -71,11 +81,9 @@ public:
         if (i == data.end()) return {};
 
         /* Move this item to the back of the LRU list. */
-        lru.erase(i->second.first.it);
-        auto j = lru.insert(lru.end(), i);
-        i->second.first.it = j;
+        lru.splice(lru.end(), lru, i->second.it);
 
-        return i->second.second;
+        return i->second.value;
     }
 
     size_t size()
@@ -90,4 +98,90 @@ public:
     }
 };
 
+
+/* A thread-safe LRU cache. It is split into shards that are locked
+   independently, so concurrent lookups of different keys rarely
+   contend. Items are evicted per shard, so the cache as a whole is
+   only approximately least-recently used. Items can be given a
+   time-to-live, after which lookups no longer return them. */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class SharedLRUCache
+{
+public:
+
+    using Clock = std::chrono::steady_clock;
+
+private:
+
+    struct Entry
+    {
+        Value value;
+        Clock::time_point expires;
+    };
+
+    using Shard = LRUCache<Key, Entry, Hash>;
+
+    std::vector<std::unique_ptr<Sync<Shard>>> shards;
+
+    Hash hash;
+
+    Sync<Shard> & shardFor(const Key & key)
+    {
+        return *shards[hash(key) % shards.size()];
+    }
+
+public:
+
+    /* Create a cache of at most 'capacity' items, split into at most
+       'maxShards' shards. Small caches get fewer shards, so that they
+       behave like a plain LRU cache. */
+    SharedLRUCache(size_t capacity, size_t maxShards = 16)
+    {
+        size_t nrShards = std::clamp(capacity / 1024, (size_t) 1, std::max(maxShards, (size_t) 1));
+        for (size_t n = 0; n < nrShards; ++n)
+            shards.push_back(std::make_unique<Sync<Shard>>(Shard((capacity + nrShards - 1) / nrShards)));
+    }
+
+    /* Insert or upsert an item in the cache. If 'ttl' is set, the
+       item expires after that time. */
+    void upsert(const Key & key, const Value & value, std::optional<Clock::duration> ttl = {})
+    {
+        auto expires = ttl ? Clock::now() + *ttl : Clock::time_point::max();
+        shardFor(key).lock()->upsert(key, Entry { value, expires });
+    }
+
+    bool erase(const Key & key)
+    {
+        return shardFor(key).lock()->erase(key);
+    }
+
+    /* Look up an item in the cache. If it exists and hasn't expired,
+       it becomes the most recently used item. */
+    std::optional<Value> get(const Key & key)
+    {
+        auto shard(shardFor(key).lock());
+        auto entry = shard->get(key);
+        if (!entry) return {};
+        if (entry->expires != Clock::time_point::max() && Clock::now() >= entry->expires) {
+            shard->erase(key);
+            return {};
+        }
+        return std::move(entry->value);
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        for (auto & shard : shards)
+            n += shard->lock()->size();
+        return n;
+    }
+
+    void clear()
+    {
+        for (auto & shard : shards)
+            shard->lock()->clear();
+    }
+};
+
 }
@@ -0,0 +1,80 @@
+#include "parallel-walk.hh"
+#include "thread-pool.hh"
+#include "util.hh"
+
+#include <atomic>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nix {
+
+/* The maximum number of directories waiting in the thread pool's
+   queue. Each holds its parent directory open, so beyond this,
+   directories are walked by the thread that found them. */
+static constexpr size_t maxQueuedDirs = 256;
+
+void walkDirectoryParallel(const Path & path,
+    std::function<bool(const WalkEntry & entry)> visit,
+    size_t maxThreads)
+{
+    auto st = lstat(path);
+    if (!visit({AT_FDCWD, path.c_str(), path, st}) || !S_ISDIR(st.st_mode))
+        return;
+
+    ThreadPool pool(maxThreads);
+
+    std::atomic<size_t> queued{0};
+
+    std::function<void(int parentFd, const std::string & name, const Path & path)> walkDir;
+
+    walkDir = [&](int parentFd, const std::string & name, const Path & path) {
+        checkInterrupt();
+
+        auto fd = std::make_shared<AutoCloseFD>(
+            openat(parentFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (!*fd) throw SysError("opening directory '%1%'", path);
+
+        /* fdopendir() takes ownership of its argument, so give it a
+           copy of the descriptor that we use for the *at() calls. */
+        int fdDir = dup(fd->get());
+        if (fdDir == -1) throw SysError("duplicating file descriptor");
+        AutoCloseDir dir(fdopendir(fdDir));
+        if (!dir) {
+            close(fdDir);
+            throw SysError("opening directory '%1%'", path);
+        }
+
+        struct dirent * dirent;
+        while (errno = 0, dirent = readdir(dir.get())) { /* sic */
+            checkInterrupt();
+
+            std::string childName = dirent->d_name;
+            if (childName == "." || childName == "..") continue;
+            Path childPath = path + "/" + childName;
+
+            struct stat st;
+            if (fstatat(fd->get(), childName.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+                throw SysError("getting status of '%1%'", childPath);
+
+            if (!visit({fd->get(), childName.c_str(), childPath, st}) || !S_ISDIR(st.st_mode))
+                continue;
+
+            if (queued < maxQueuedDirs) {
+                queued++;
+                pool.enqueue([&walkDir, &queued, fd, childName, childPath]() {
+                    queued--;
+                    walkDir(fd->get(), childName, childPath);
+                });
+            } else
+                walkDir(fd->get(), childName, childPath);
+        }
+        if (errno) throw SysError("reading directory '%1%'", path);
+    };
+
+    pool.enqueue([&]() { walkDir(AT_FDCWD, path, path); });
+
+    pool.process();
+}
+
+}
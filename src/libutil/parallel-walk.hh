@@ -0,0 +1,34 @@
+#pragma once
+
+#include "types.hh"
+
+#include <functional>
+#include <sys/stat.h>
+
+namespace nix {
+
+/* A file visited by walkDirectoryParallel(). Operations on the file
+   should use `dirFd' and `name' (e.g. fchmodat(dirFd, name, ...))
+   rather than `path', so that the kernel doesn't have to resolve the
+   full path again. `path' is meant for error messages. */
+struct WalkEntry
+{
+    /* The parent directory, or AT_FDCWD for the root of the walk. */
+    int dirFd;
+    const char * name;
+    const Path & path;
+    const struct stat & st;
+};
+
+/* Call `visit' for `path' and for every file below it. A directory is
+   visited before its contents, and its contents are only visited if
+   `visit' returns true (the return value is ignored for other
+   files). Subdirectories are walked concurrently on up to
+   `maxThreads' threads (0 means the number of CPUs), so `visit' must
+   be thread-safe. If `visit' throws, the walk stops and the exception
+   is propagated to the caller. */
+void walkDirectoryParallel(const Path & path,
+    std::function<bool(const WalkEntry & entry)> visit,
+    size_t maxThreads = 0);
+
+}
@@ -1,16 +1,59 @@
 #include "serialise.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <cstring>
 #include <cerrno>
 #include <memory>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 
 #include <boost/coroutine2/coroutine.hpp>
 
+#include <sys/uio.h>
+
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 
 namespace nix {
 
 
+SinkStreamBuf::SinkStreamBuf(Sink & sink, size_t bufSize)
+    : sink(sink), buffer(new char[bufSize])
+{
+    setp(buffer.get(), buffer.get() + bufSize);
+}
+
+
+SinkStreamBuf::~SinkStreamBuf()
+{
+    try { sync(); } catch (...) { ignoreException(); }
+}
+
+
+SinkStreamBuf::int_type SinkStreamBuf::overflow(int_type c)
+{
+    sync();
+    if (c != traits_type::eof()) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+
+int SinkStreamBuf::sync()
+{
+    size_t n = pptr() - pbase();
+    setp(pbase(), epptr());
+    if (n) sink({pbase(), n});
+    return 0;
+}
+
+
 void BufferedSink::operator () (std::string_view data)
 {
     if (!buffer) buffer = decltype(buffer)(new char[bufSize]);
@@ -19,8 +62,12 @@ void BufferedSink::operator () (std::string_view data)
         /* Optimisation: bypass the buffer if the data exceeds the
            buffer size. */
         if (bufPos + data.size() >= bufSize) {
-            flush();
-            write(data);
+            size_t n = bufPos;
+            bufPos = 0;
+            if (n)
+                writeGather({buffer.get(), n}, data);
+            else
+                write(data);
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -56,9 +103,9 @@ static void warnLargeDump()
 }
 
 
-void FdSink::write(std::string_view data)
+void FdSink::countWritten(size_t n)
 {
-    written += data.size();
+    written += n;
     static bool warned = false;
     if (warn && !warned) {
         if (written > threshold) {
@@ -66,6 +113,12 @@ void FdSink::write(std::string_view data)
             warned = true;
         }
     }
+}
+
+
+void FdSink::write(std::string_view data)
+{
+    countWritten(data.size());
     try {
         writeFull(fd, data);
     } catch (SysError & e) {
@@ -75,6 +128,71 @@ void FdSink::write(std::string_view data)
 }
 
 
+void FdSink::writeGather(std::string_view data1, std::string_view data2)
+{
+    countWritten(data1.size() + data2.size());
+
+    struct iovec iov[2] = {
+        { (void *) data1.data(), data1.size() },
+        { (void *) data2.data(), data2.size() },
+    };
+    struct iovec * v = iov;
+    int count = 2;
+
+    while (count) {
+        checkInterrupt();
+        ssize_t n = ::writev(fd, v, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            _good = false;
+            throw SysError("writing to file");
+        }
+        /* Skip the parts that have been written. */
+        while (count && (size_t) n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count) {
+            v->iov_base = (char *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+}
+
+
+void FdSink::sendFile(int srcFd, uint64_t len)
+{
+    flush();
+
+#if __linux__
+    while (len) {
+        checkInterrupt();
+        auto n = sendfile(fd, srcFd, nullptr, std::min(len, (uint64_t) 1 << 30));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Not supported for this kind of file, so copy the rest
+               the usual way. */
+            if (errno == EINVAL || errno == ENOSYS || errno == EAGAIN) break;
+            _good = false;
+            throw SysError("writing to file");
+        }
+        if (n == 0) throw EndOfFile("unexpected end-of-file");
+        written += n;
+        len -= n;
+    }
+#endif
+
+    std::vector<char> buf(65536);
+    while (len) {
+        auto n = std::min(len, (uint64_t) buf.size());
+        readFull(srcFd, buf.data(), n);
+        write({buf.data(), n});
+        len -= n;
+    }
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -116,9 +234,25 @@ std::string Source::drain()
 
 size_t BufferedSource::read(char * data, size_t len)
 {
+    /* Optimisation: bypass the buffer for large reads. */
+    if (!bufPosIn && len >= bufSize)
+        return readUnbuffered(data, len);
+
     if (!buffer) buffer = decltype(buffer)(new char[bufSize]);
 
-    if (!bufPosIn) bufPosIn = readUnbuffered(buffer.get(), bufSize);
+    if (!bufPosIn) {
+        bufPosIn = readUnbuffered(buffer.get(), bufSize);
+
+        /* If the buffer was filled completely, more data is likely
+           available, so use a bigger buffer next time to reduce the
+           number of reads. */
+        if (bufPosIn == bufSize && bufSize < maxBufSize) {
+            auto newBuffer = decltype(buffer)(new char[bufSize * 2]);
+            memcpy(newBuffer.get(), buffer.get(), bufPosIn);
+            buffer = std::move(newBuffer);
+            bufSize *= 2;
+        }
+    }
 
     /* Copy out the data in the buffer. */
     size_t n = len > bufPosIn - bufPosOut ? bufPosIn - bufPosOut : len;
@@ -252,6 +386,186 @@ std::unique_ptr<Source> sinkToSource(
 }
 
 
+/* A bounded queue of data passed from one thread to another. Small
+   writes are coalesced to keep the locking overhead down. */
+struct ChunkQueue
+{
+    struct State
+    {
+        std::deque<std::string> chunks;
+        size_t size = 0;
+        bool closed = false;
+        bool cancelled = false;
+        std::exception_ptr ex;
+    };
+
+    const size_t maxSize;
+    Sync<State> state_;
+    std::condition_variable pushed, popped;
+
+    ChunkQueue(size_t maxSize) : maxSize(maxSize) { }
+
+    /* Append data to the queue, blocking while it's full. Returns
+       false if the consumer has gone away. */
+    bool push(std::string_view data)
+    {
+        if (data.empty()) return true;
+        auto state(state_.lock());
+        while (state->size >= maxSize && !state->cancelled)
+            state.wait(popped);
+        if (state->cancelled) return false;
+        if (!state->chunks.empty() && state->chunks.back().size() < 64 * 1024)
+            state->chunks.back().append(data);
+        else
+            state->chunks.emplace_back(data);
+        state->size += data.size();
+        pushed.notify_one();
+        return true;
+    }
+
+    /* Signal that no more data will be pushed, optionally because
+       of an error that is to be rethrown by pop(). */
+    void close(std::exception_ptr ex = nullptr)
+    {
+        auto state(state_.lock());
+        state->closed = true;
+        state->ex = ex;
+        pushed.notify_one();
+    }
+
+    /* Signal that no more data will be popped. */
+    void cancel()
+    {
+        auto state(state_.lock());
+        state->cancelled = true;
+        popped.notify_one();
+    }
+
+    /* Remove the next chunk from the queue, blocking while it's
+       empty. Returns nothing once the queue has been closed and
+       drained. */
+    std::optional<std::string> pop()
+    {
+        auto state(state_.lock());
+        while (state->chunks.empty() && !state->closed)
+            state.wait(pushed);
+        if (state->chunks.empty()) {
+            if (state->ex) std::rethrow_exception(state->ex);
+            return std::nullopt;
+        }
+        auto data = std::move(state->chunks.front());
+        state->chunks.pop_front();
+        state->size -= data.size();
+        popped.notify_one();
+        return data;
+    }
+};
+
+
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof,
+    size_t maxPending)
+{
+    struct ThreadedSource : Source
+    {
+        std::function<void()> eof;
+        ChunkQueue queue;
+        std::thread thread;
+
+        std::string cur;
+        size_t pos = 0;
+
+        ThreadedSource(std::function<void(Sink &)> fun, std::function<void()> eof, size_t maxPending)
+            : eof(eof), queue(maxPending)
+        {
+            thread = std::thread([this, fun, act(getCurActivity())]() {
+                PushActivity pact(act);
+                try {
+                    LambdaSink sink([&](std::string_view data) {
+                        if (!queue.push(data))
+                            throw Error("reader of threaded source has gone away");
+                    });
+                    fun(sink);
+                    queue.close();
+                } catch (...) {
+                    queue.close(std::current_exception());
+                }
+            });
+        }
+
+        ~ThreadedSource()
+        {
+            queue.cancel();
+            thread.join();
+        }
+
+        size_t read(char * data, size_t len) override
+        {
+            if (pos == cur.size()) {
+                auto next = queue.pop();
+                if (!next) { eof(); abort(); }
+                cur = std::move(*next);
+                pos = 0;
+            }
+
+            auto n = std::min(cur.size() - pos, len);
+            memcpy(data, cur.data() + pos, n);
+            pos += n;
+
+            return n;
+        }
+    };
+
+    return std::make_unique<ThreadedSource>(fun, eof, maxPending);
+}
+
+
+struct BackgroundSink::State
+{
+    ChunkQueue queue;
+    std::exception_ptr ex;
+    std::thread thread;
+
+    State(size_t maxPending) : queue(maxPending) { }
+};
+
+BackgroundSink::BackgroundSink(Sink & sink, size_t maxPending)
+    : state(std::make_unique<State>(maxPending))
+{
+    state->thread = std::thread([&sink, st(state.get())]() {
+        try {
+            while (auto data = st->queue.pop())
+                sink(*data);
+        } catch (...) {
+            st->ex = std::current_exception();
+            st->queue.cancel();
+        }
+    });
+}
+
+BackgroundSink::~BackgroundSink()
+{
+    state->queue.close();
+    if (state->thread.joinable())
+        state->thread.join();
+}
+
+void BackgroundSink::operator () (std::string_view data)
+{
+    /* If the other sink failed, finish() will report it. */
+    state->queue.push(data);
+}
+
+void BackgroundSink::finish()
+{
+    state->queue.close();
+    if (state->thread.joinable())
+        state->thread.join();
+    if (state->ex) std::rethrow_exception(state->ex);
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <streambuf>
 
 #include "types.hh"
 #include "util.hh"
@@ -25,6 +26,26 @@ struct NullSink : Sink
     { }
 };
 
+/* A std::streambuf that passes its output to a Sink in chunks of at
+   most ‘bufSize’ bytes, so that printers that write to a std::ostream
+   can stream to a sink. Errors thrown by the sink are only propagated
+   if the stream has badbit exceptions enabled. */
+struct SinkStreamBuf : std::streambuf
+{
+    Sink & sink;
+    std::unique_ptr<char[]> buffer;
+
+    SinkStreamBuf(Sink & sink, size_t bufSize = 32 * 1024);
+
+    ~SinkStreamBuf();
+
+protected:
+    int_type overflow(int_type c) override;
+
+    int sync() override;
+};
+
+
 /* A buffered abstract sink. Warning: a BufferedSink should not be
    used from multiple threads concurrently. */
 struct BufferedSink : virtual Sink
@@ -40,6 +61,16 @@ struct BufferedSink : virtual Sink
     void flush();
 
     virtual void write(std::string_view data) = 0;
+
+    /* Write 'data1' followed by 'data2'. This is used to write the
+       contents of the buffer together with data that bypasses it, so
+       sinks that support gather writes (like FdSink) can do it in a
+       single system call. */
+    virtual void writeGather(std::string_view data1, std::string_view data2)
+    {
+        write(data1);
+        write(data2);
+    }
 };
 
 
@@ -66,13 +97,19 @@ struct Source
 };
 
 
-/* A buffered abstract source. Warning: a BufferedSource should not be
-   used from multiple threads concurrently. */
+/* A buffered abstract source. Requests for at least ‘bufSize’ bytes
+   are read directly into the caller's memory when the buffer is
+   empty. The buffer grows (up to ‘maxBufSize’) while reads keep
+   filling it completely, i.e. when the underlying source has more
+   data available than the buffer can hold. Warning: a BufferedSource
+   should not be used from multiple threads concurrently. */
 struct BufferedSource : Source
 {
     size_t bufSize, bufPosIn, bufPosOut;
     std::unique_ptr<char[]> buffer;
 
+    static constexpr size_t maxBufSize = 1024 * 1024;
+
     BufferedSource(size_t bufSize = 32 * 1024)
         : bufSize(bufSize), bufPosIn(0), bufPosOut(0), buffer(nullptr) { }
 
@@ -111,10 +148,19 @@ struct FdSink : BufferedSink
 
     void write(std::string_view data) override;
 
+    /* Uses writev(). */
+    void writeGather(std::string_view data1, std::string_view data2) override;
+
+    /* Write ‘len’ bytes read from ‘srcFd’. Where possible, this uses
+       sendfile() so that the data isn't copied through user space. */
+    void sendFile(int srcFd, uint64_t len);
+
     bool good() override;
 
 private:
     bool _good = true;
+
+    void countWritten(size_t n);
 };
 
 
@@ -290,6 +336,41 @@ std::unique_ptr<Source> sinkToSource(
         throw EndOfFile("coroutine has finished");
     });
 
+/* Like sinkToSource(), but execute the function in a separate
+   thread, so that producing and consuming the data happen in
+   parallel. At most ‘maxPending’ bytes are queued between the two
+   threads; beyond that, the producer blocks. Exceptions thrown by
+   the function are rethrown by the source. */
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof = []() {
+        throw EndOfFile("producer thread has finished");
+    },
+    size_t maxPending = 8 * 1024 * 1024);
+
+
+/* A sink that passes its data to another sink on a separate thread,
+   so that the writer doesn't have to wait for it. At most
+   ‘maxPending’ bytes are queued; beyond that, writes block. If the
+   other sink throws an exception, further data is discarded and the
+   exception is rethrown by finish(). */
+struct BackgroundSink : Sink
+{
+    BackgroundSink(Sink & sink, size_t maxPending = 64 * 1024 * 1024);
+
+    ~BackgroundSink();
+
+    void operator () (std::string_view data) override;
+
+    /* Wait until all queued data has been passed to the other
+       sink. */
+    void finish();
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
 
 void writePadding(size_t len, Sink & sink);
 void writeString(std::string_view s, Sink & sink);
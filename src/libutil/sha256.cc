@@ -0,0 +1,159 @@
+#include "sha256.hh"
+#include "util.hh"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#endif
+
+namespace nix {
+
+#if HAVE_SHA_NI
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+static bool detectSha256()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    bool ssse3 = ecx & bit_SSSE3, sse41 = ecx & bit_SSE4_1;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    return ssse3 && sse41 && (ebx & bit_SHA);
+}
+
+
+/* Process 'nrBlocks' 64-byte blocks using the SHA-NI instructions. The
+   instructions operate on the state in the order ABEF/CDGH, so it is
+   converted on entry and exit. */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress(uint32_t state[8], const unsigned char * data, size_t nrBlocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; nrBlocks; --nrBlocks, data += 64) {
+        __m128i abefSave = state0, cdghSave = state1;
+        __m128i w[4];
+
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; ++i) {
+            __m128i msg;
+            if (i < 4)
+                msg = w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + i * 16)), byteSwap);
+            else {
+                msg = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                msg = _mm_add_epi32(msg, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                msg = w[i & 3] = _mm_sha256msg2_epu32(msg, w[(i + 3) & 3]);
+            }
+            msg = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i *) &K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+#else
+
+static bool detectSha256()
+{
+    return false;
+}
+
+static void compress(uint32_t state[8], const unsigned char * data, size_t nrBlocks)
+{
+    abort();
+}
+
+#endif
+
+
+bool haveHardwareSha256()
+{
+    static bool have = detectSha256() && !getEnv("NIX_DISABLE_SHA_EXTENSIONS");
+    return have;
+}
+
+
+void sha256Init(Sha256Ctx & ctx)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx.state, iv, sizeof(iv));
+    ctx.bufLen = 0;
+    ctx.bytes = 0;
+}
+
+
+void sha256Update(Sha256Ctx & ctx, std::string_view data)
+{
+    ctx.bytes += data.size();
+
+    if (ctx.bufLen) {
+        auto n = std::min(sizeof(ctx.buf) - ctx.bufLen, data.size());
+        memcpy(ctx.buf + ctx.bufLen, data.data(), n);
+        ctx.bufLen += n;
+        data.remove_prefix(n);
+        if (ctx.bufLen < sizeof(ctx.buf)) return;
+        compress(ctx.state, ctx.buf, 1);
+        ctx.bufLen = 0;
+    }
+
+    if (auto nrBlocks = data.size() / 64) {
+        compress(ctx.state, (const unsigned char *) data.data(), nrBlocks);
+        data.remove_prefix(nrBlocks * 64);
+    }
+
+    memcpy(ctx.buf, data.data(), data.size());
+    ctx.bufLen = data.size();
+}
+
+
+void sha256Final(unsigned char * hash, Sha256Ctx & ctx)
+{
+    uint64_t bits = ctx.bytes * 8;
+
+    /* Pad with 0x80, zeroes and the big-endian bit length. */
+    unsigned char pad[72] = { 0x80 };
+    size_t padLen = (ctx.bufLen < 56 ? 56 : 120) - ctx.bufLen;
+    for (int i = 0; i < 8; ++i)
+        pad[padLen + i] = bits >> (56 - 8 * i);
+    sha256Update(ctx, std::string_view((char *) pad, padLen + 8));
+
+    for (int i = 0; i < 8; ++i)
+        for (int j = 0; j < 4; ++j)
+            hash[i * 4 + j] = ctx.state[i] >> (24 - 8 * j);
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.hh"
+
+namespace nix {
+
+/* A SHA-256 implementation that uses the CPU's SHA extensions. Its
+   speed doesn't depend on how OpenSSL was built, which matters
+   because nearly all hashing in Nix is SHA-256. It must only be used
+   if haveHardwareSha256() returns true; otherwise callers should use
+   OpenSSL. */
+
+struct Sha256Ctx
+{
+    uint32_t state[8];
+    unsigned char buf[64];
+    size_t bufLen;
+    uint64_t bytes;
+};
+
+/* Return whether this CPU supports the SHA extensions (checked once).
+   Setting the environment variable NIX_DISABLE_SHA_EXTENSIONS
+   disables them. */
+bool haveHardwareSha256();
+
+void sha256Init(Sha256Ctx & ctx);
+
+void sha256Update(Sha256Ctx & ctx, std::string_view data);
+
+void sha256Final(unsigned char * hash, Sha256Ctx & ctx);
+
+}
@@ -2,6 +2,19 @@
 #include <archive_entry.h>
 
 #include "serialise.hh"
+#include "archive.hh"
+#include "compression.hh"
+#include "finally.hh"
+#include "tarfile.hh"
+#include "thread-pool.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <condition_variable>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
 
 namespace nix {
 
@@ -18,7 +31,7 @@ struct TarArchive {
             throw Error(reason, archive_error_string(this->archive));
     }
 
-    TarArchive(Source & source) : buffer(4096)
+    TarArchive(Source & source) : buffer(65536)
     {
         this->archive = archive_read_new();
         this->source = &source;
@@ -66,7 +79,7 @@ private:
         *buffer = self->buffer.data();
 
         try {
-            return self->source->read((char *) self->buffer.data(), 4096);
+            return self->source->read((char *) self->buffer.data(), self->buffer.size());
         } catch (EndOfFile &) {
             return 0;
         } catch (std::exception & err) {
@@ -80,6 +93,33 @@ private:
     }
 };
 
+static void getTimes(struct archive_entry * entry, struct timespec times[2])
+{
+    times[1] = { archive_entry_mtime(entry), archive_entry_mtime_nsec(entry) };
+    times[0] = archive_entry_atime_is_set(entry)
+        ? (struct timespec) { archive_entry_atime(entry), archive_entry_atime_nsec(entry) }
+        : times[1];
+}
+
+static void setTimes(const Path & path, struct archive_entry * entry, int flags = 0)
+{
+    struct timespec times[2];
+    getTimes(entry, times);
+    if (utimensat(AT_FDCWD, path.c_str(), times, flags) == -1)
+        throw SysError("setting the modification time of '%s'", path);
+}
+
+/* Extract an archive into `destDir'. This thread decompresses and
+   decodes the archive, while the contents of small regular files
+   (which is most of them in source tarballs) are written by a pool of
+   threads, so that decompression doesn't wait for file creation.
+   Directories, symlinks and large files are created by this thread,
+   and directory permissions and times are applied at the end, once
+   nothing is written to them anymore. Like libarchive's
+   ARCHIVE_EXTRACT_SECURE_NODOTDOT and ARCHIVE_EXTRACT_SECURE_SYMLINKS,
+   members with `..' in their path or inside a symlink from the
+   archive are rejected. Unusual file types are left to
+   archive_read_extract(). */
 static void extract_archive(TarArchive & archive, const Path & destDir)
 {
     int flags = ARCHIVE_EXTRACT_FFLAGS
@@ -88,7 +128,85 @@ static void extract_archive(TarArchive & archive, const Path & destDir)
         | ARCHIVE_EXTRACT_SECURE_SYMLINKS
         | ARCHIVE_EXTRACT_SECURE_NODOTDOT;
 
+    /* Files up to this size are buffered and written by the pool,
+       up to this many bytes in total. */
+    const int64_t maxBufferedFile = 1 << 20;
+    const uint64_t maxBuffered = 64 << 20;
+
+    struct State
+    {
+        uint64_t buffered = 0;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Writing is mostly waiting for the file system, so use a few
+       threads even on small machines. */
+    auto makePool = []() {
+        return std::make_unique<ThreadPool>(std::max(std::thread::hardware_concurrency(), 4U) + 1);
+    };
+    auto pool = makePool();
+
+    Finally cancel([&]() { pool->cancel(); });
+
+    auto checkFailed = [&]() {
+        auto state(state_.lock());
+        if (state->exception) std::rethrow_exception(state->exception);
+    };
+
+    /* Wait until the pool has written everything enqueued so far. */
+    auto flush = [&]() {
+        pool->process();
+        pool = makePool();
+        checkFailed();
+    };
+
+    std::unordered_set<std::string> seen, dirs, symlinks;
+    std::vector<std::pair<Path, struct archive_entry *>> dirEntries;
+    Finally freeDirEntries([&]() {
+        for (auto & [_, entry] : dirEntries)
+            archive_entry_free(entry);
+    });
+
+    /* Create the parent directories of a member, each only once. */
+    std::function<void(const std::string &)> ensureDir;
+    ensureDir = [&](const std::string & rel) {
+        if (rel.empty() || dirs.count(rel)) return;
+        auto slash = rel.rfind('/');
+        ensureDir(slash == std::string::npos ? "" : rel.substr(0, slash));
+        auto path = destDir + "/" + rel;
+        if (mkdir(path.c_str(), 0777) == -1) {
+            if (errno != EEXIST)
+                throw SysError("creating directory '%s'", path);
+            if (!S_ISDIR(lstat(path).st_mode))
+                throw Error("tarball member '%s' is inside a non-directory", rel);
+        }
+        dirs.insert(rel);
+    };
+
+    /* Return the normalised path of a member relative to `destDir',
+       after checking that it's safe to create. */
+    auto memberPath = [&](const std::string & name) {
+        std::string rel;
+        for (auto & component : tokenizeString<Strings>(name, "/")) {
+            if (component == ".") continue;
+            if (component == "..")
+                throw Error("tarball member '%s' refers to a parent directory", name);
+            if (symlinks.count(rel))
+                throw Error("tarball member '%s' is inside a symlink", name);
+            if (!rel.empty()) rel += '/';
+            rel += component;
+        }
+        return rel;
+    };
+
+    std::vector<char> buf(65536);
+
     for (;;) {
+        checkFailed();
+
         struct archive_entry * entry;
         int r = archive_read_next_header(archive.archive, &entry);
         if (r == ARCHIVE_EOF) break;
@@ -97,10 +215,130 @@ static void extract_archive(TarArchive & archive, const Path & destDir)
         else
             archive.check(r);
 
-        archive_entry_set_pathname(entry,
-            (destDir + "/" + archive_entry_pathname(entry)).c_str());
+        std::string name = archive_entry_pathname(entry);
+        auto rel = memberPath(name);
+        if (rel.empty()) continue;
+        auto path = destDir + "/" + rel;
+        auto slash = rel.rfind('/');
+        ensureDir(slash == std::string::npos ? "" : rel.substr(0, slash));
+
+        /* A member that replaces an earlier one has to wait for it to
+           have been written. */
+        if (!seen.insert(rel).second) {
+            flush();
+            struct stat st;
+            if (lstat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+                if (unlink(path.c_str()) == -1)
+                    throw SysError("removing '%s'", path);
+                symlinks.erase(rel);
+            }
+        }
 
-        archive.check(archive_read_extract(archive.archive, entry, flags));
+        if (auto hardlink = archive_entry_hardlink(entry)) {
+            flush();
+            auto target = destDir + "/" + memberPath(hardlink);
+            if (link(target.c_str(), path.c_str()) == -1)
+                throw SysError("creating hard link from '%s' to '%s'", path, target);
+            continue;
+        }
+
+        auto perm = archive_entry_perm(entry) & 01777;
+
+        switch (archive_entry_filetype(entry)) {
+
+        case AE_IFDIR:
+            ensureDir(rel);
+            dirEntries.emplace_back(path, archive_entry_clone(entry));
+            break;
+
+        case AE_IFLNK:
+            if (symlink(archive_entry_symlink(entry), path.c_str()) == -1)
+                throw SysError("creating symlink '%s'", path);
+            symlinks.insert(rel);
+            setTimes(path, entry, AT_SYMLINK_NOFOLLOW);
+            break;
+
+        case AE_IFREG: {
+            auto size = archive_entry_size(entry);
+
+            if (archive_entry_size_is_set(entry) && size <= maxBufferedFile) {
+                auto contents = std::make_shared<std::string>();
+                contents->reserve(size);
+                while (true) {
+                    auto n = archive_read_data(archive.archive, buf.data(), buf.size());
+                    if (n < 0) archive.check(n);
+                    if (n == 0) break;
+                    contents->append(buf.data(), n);
+                }
+
+                struct timespec times[2];
+                getTimes(entry, times);
+
+                {
+                    auto state(state_.lock());
+                    while (state->buffered > maxBuffered && !state->exception)
+                        state.wait(wakeup);
+                    state->buffered += contents->size();
+                }
+
+                pool->enqueue([&, path, perm, times, contents]() {
+                    try {
+                        AutoCloseFD fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+                        if (!fd) throw SysError("creating file '%s'", path);
+                        writeFull(fd.get(), *contents);
+                        if (fchmod(fd.get(), perm) == -1)
+                            throw SysError("setting permissions on '%s'", path);
+                        if (futimens(fd.get(), times) == -1)
+                            throw SysError("setting the modification time of '%s'", path);
+                    } catch (...) {
+                        auto state(state_.lock());
+                        if (!state->exception) state->exception = std::current_exception();
+                    }
+                    auto state(state_.lock());
+                    state->buffered -= contents->size();
+                    wakeup.notify_all();
+                });
+            } else {
+                AutoCloseFD fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+                if (!fd) throw SysError("creating file '%s'", path);
+                while (true) {
+                    auto n = archive_read_data(archive.archive, buf.data(), buf.size());
+                    if (n < 0) archive.check(n);
+                    if (n == 0) break;
+                    writeFull(fd.get(), {buf.data(), (size_t) n});
+                }
+                if (fchmod(fd.get(), perm) == -1)
+                    throw SysError("setting permissions on '%s'", path);
+                struct timespec times[2];
+                getTimes(entry, times);
+                if (futimens(fd.get(), times) == -1)
+                    throw SysError("setting the modification time of '%s'", path);
+            }
+            break;
+        }
+
+        default:
+            flush();
+            archive_entry_set_pathname(entry, path.c_str());
+            archive.check(archive_read_extract(archive.archive, entry, flags));
+        }
+    }
+
+    flush();
+
+    /* Apply the directory permissions and times, deepest first, so
+       that changing their contents doesn't change the times and a
+       read-only directory doesn't get in the way of the ones below
+       it. The archive can list directories in any order, and if it
+       lists one several times, the last one wins. */
+    auto depth = [](const Path & path) { return std::count(path.begin(), path.end(), '/'); };
+    std::stable_sort(dirEntries.begin(), dirEntries.end(), [&](auto & a, auto & b) {
+        return depth(a.first) > depth(b.first);
+    });
+    for (auto & [path, entry] : dirEntries) {
+        if (chmod(path.c_str(), archive_entry_perm(entry) & 01777) == -1)
+            throw SysError("setting permissions on '%s'", path);
+        setTimes(path, entry);
     }
 
     archive.close();
@@ -114,12 +352,203 @@ void unpackTarfile(Source & source, const Path & destDir)
     extract_archive(archive, destDir);
 }
 
+/* Return the compression method of a tarball that we can decompress
+   on several threads, if any. */
+static std::optional<std::string> parallelCompressionMethod(const Path & tarFile)
+{
+    AutoCloseFD fd = open(tarFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening '%s'", tarFile);
+    unsigned char magic[6];
+    auto n = read(fd.get(), magic, sizeof(magic));
+    if (n == 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+        return "xz";
+    if (n >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+        return "zstd";
+    return std::nullopt;
+}
+
 void unpackTarfile(const Path & tarFile, const Path & destDir)
 {
+    /* libarchive decompresses on a single thread, so decompress xz
+       and zstd tarballs ourselves. This is faster if they consist of
+       several blocks or frames, as written by `xz -T' and `zstd -T'. */
+    if (auto method = parallelCompressionMethod(tarFile)) {
+        AutoCloseFD fd = open(tarFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) throw SysError("opening '%s'", tarFile);
+        FdSource file(fd.get());
+        auto decompressed = makeDecompressionSource(*method, file, true);
+        unpackTarfile(*decompressed, destDir);
+        return;
+    }
+
     auto archive = TarArchive(tarFile);
 
     createDirs(destDir);
     extract_archive(archive, destDir);
 }
 
+struct TarNode
+{
+    enum { tpUnknown, tpRegular, tpDirectory, tpSymlink } type = tpUnknown;
+    bool executable = false;
+    /* The location of the contents of a regular file in the
+       temporary file. */
+    uint64_t offset = 0, size = 0;
+    std::string target;
+    std::map<std::string, TarNode> entries;
+    std::optional<time_t> mtime;
+};
+
+static TarNode & lookupNode(TarNode & root, const std::string & path)
+{
+    auto node = &root;
+    for (auto & name : tokenizeString<Strings>(path, "/")) {
+        if (name == ".") continue;
+        if (name == "..")
+            throw Error("tarball member '%s' refers to a parent directory", path);
+        if (node->type != TarNode::tpDirectory && node->type != TarNode::tpUnknown)
+            throw Error("tarball member '%s' is inside a non-directory", path);
+        node->type = TarNode::tpDirectory;
+        node = &node->entries[name];
+    }
+    return *node;
+}
+
+static void dumpNode(const TarNode & node, int fdContents, Sink & sink)
+{
+    sink << "(";
+
+    switch (node.type) {
+
+    case TarNode::tpRegular: {
+        sink << "type" << "regular";
+        if (node.executable)
+            sink << "executable" << "";
+        sink << "contents" << node.size;
+        std::vector<char> buf(65536);
+        uint64_t pos = node.offset, left = node.size;
+        while (left) {
+            auto n = pread(fdContents, buf.data(), std::min(left, (uint64_t) buf.size()), pos);
+            if (n <= 0) throw SysError("reading temporary file");
+            sink({buf.data(), (size_t) n});
+            pos += n;
+            left -= n;
+        }
+        writePadding(node.size, sink);
+        break;
+    }
+
+    case TarNode::tpDirectory:
+    case TarNode::tpUnknown:
+        sink << "type" << "directory";
+        for (auto & [name, child] : node.entries) {
+            sink << "entry" << "(" << "name" << name << "node";
+            dumpNode(child, fdContents, sink);
+            sink << ")";
+        }
+        break;
+
+    case TarNode::tpSymlink:
+        sink << "type" << "symlink" << "target" << node.target;
+        break;
+    }
+
+    sink << ")";
+}
+
+time_t tarballToNar(Source & source, Sink & sink)
+{
+    auto archive = TarArchive(source);
+
+    /* Nobody else needs to see the contents file, so get rid of it
+       right away. */
+    auto [fdContents, contentsPath] = createTempFile();
+    unlink(contentsPath.c_str());
+    uint64_t contentsSize = 0;
+
+    TarNode root;
+    root.type = TarNode::tpDirectory;
+    time_t newest = 0;
+
+    std::vector<char> buf(65536);
+
+    for (;;) {
+        struct archive_entry * entry;
+        int r = archive_read_next_header(archive.archive, &entry);
+        if (r == ARCHIVE_EOF) break;
+        else if (r == ARCHIVE_WARN)
+            warn(archive_error_string(archive.archive));
+        else
+            archive.check(r);
+
+        std::string path = archive_entry_pathname(entry);
+        auto & node = lookupNode(root, path);
+        if (&node == &root)
+            continue;
+
+        time_t mtime = archive_entry_mtime(entry);
+        node.mtime = mtime;
+        newest = std::max(newest, mtime);
+
+        if (auto hardlink = archive_entry_hardlink(entry)) {
+            auto & target = lookupNode(root, hardlink);
+            if (target.type != TarNode::tpRegular)
+                throw Error("hard link '%s' in tarball doesn't refer to a regular file", path);
+            auto copy = target;
+            copy.mtime = mtime;
+            node = std::move(copy);
+            continue;
+        }
+
+        switch (archive_entry_filetype(entry)) {
+
+        case AE_IFREG: {
+            node = TarNode();
+            node.type = TarNode::tpRegular;
+            node.mtime = mtime;
+            node.executable = archive_entry_perm(entry) & S_IXUSR;
+            node.offset = contentsSize;
+            while (true) {
+                auto n = archive_read_data(archive.archive, buf.data(), buf.size());
+                if (n < 0) archive.check(n);
+                if (n == 0) break;
+                writeFull(fdContents.get(), {buf.data(), (size_t) n});
+                contentsSize += n;
+            }
+            node.size = contentsSize - node.offset;
+            break;
+        }
+
+        case AE_IFDIR:
+            if (node.type != TarNode::tpDirectory) {
+                node = TarNode();
+                node.mtime = mtime;
+            }
+            node.type = TarNode::tpDirectory;
+            break;
+
+        case AE_IFLNK:
+            node = TarNode();
+            node.type = TarNode::tpSymlink;
+            node.mtime = mtime;
+            node.target = archive_entry_symlink(entry);
+            break;
+
+        default:
+            throw Error("tarball member '%s' has an unsupported type", path);
+        }
+    }
+
+    archive.close();
+
+    if (root.entries.size() != 1)
+        throw Error("tarball contains an unexpected number of top-level files");
+    auto & top = root.entries.begin()->second;
+
+    sink << narVersionMagic1;
+    dumpNode(top, fdContents.get(), sink);
+
+    return top.mtime ? *top.mtime : newest;
+}
+
 }
@@ -6,4 +6,12 @@ void unpackTarfile(Source & source, const Path & destDir);
 
 void unpackTarfile(const Path & tarFile, const Path & destDir);
 
+/* Write a NAR serialisation of the single top-level file or
+   directory in a tarball to `sink', without unpacking the tarball.
+   Since tarballs aren't sorted the way NARs are, file contents are
+   buffered in a temporary file until the whole tarball has been
+   read. Returns the modification time of the top-level entry (or
+   of its newest member, if the tarball doesn't record it). */
+time_t tarballToNar(Source & source, Sink & sink);
+
 }
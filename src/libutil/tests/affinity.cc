@@ -0,0 +1,56 @@
+#include "affinity.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * CPUAllocator
+     * --------------------------------------------------------------------------*/
+
+    TEST(CPUAllocator, prefersSingleNode) {
+        CPUAllocator allocator({{0, 1, 2, 3}, {4, 5, 6, 7}});
+
+        ASSERT_EQ(allocator.allocate(3), (std::vector<int>{0, 1, 2}));
+        // the first node has the fewest free CPUs that suffice
+        ASSERT_EQ(allocator.allocate(1), (std::vector<int>{3}));
+        ASSERT_EQ(allocator.allocate(2), (std::vector<int>{4, 5}));
+    }
+
+    TEST(CPUAllocator, spansNodesIfNecessary) {
+        CPUAllocator allocator({{0, 1, 2, 3}, {4, 5, 6, 7}});
+
+        ASSERT_EQ(allocator.allocate(2), (std::vector<int>{0, 1}));
+        // the fullest node is used up first
+        ASSERT_EQ(allocator.allocate(5), (std::vector<int>{2, 4, 5, 6, 7}));
+        ASSERT_EQ(allocator.allocate(2), (std::vector<int>{}));
+        ASSERT_EQ(allocator.allocate(1), (std::vector<int>{3}));
+    }
+
+    TEST(CPUAllocator, reusesReleasedCPUs) {
+        CPUAllocator allocator({{0, 1, 2, 3}});
+
+        auto a = allocator.allocate(2);
+        auto b = allocator.allocate(2);
+        ASSERT_EQ(allocator.allocate(1), (std::vector<int>{}));
+
+        allocator.release(a);
+        ASSERT_EQ(allocator.allocate(2), a);
+        allocator.release(b);
+        ASSERT_EQ(allocator.allocate(4), (std::vector<int>{}));
+        ASSERT_EQ(allocator.allocate(2), b);
+    }
+
+    TEST(getCPUsByNode, includesCurrentCPU) {
+        auto nodes = getCPUsByNode();
+#if __linux__
+        auto cpu = lockToCurrentCPU();
+        restoreAffinity();
+        bool found = false;
+        for (auto & cpus : nodes)
+            for (auto i : cpus)
+                if (i == cpu) found = true;
+        ASSERT_TRUE(found);
+#endif
+    }
+}
@@ -0,0 +1,78 @@
+#include "archive.hh"
+#include "config.hh"
+#include "finally.hh"
+#include "util.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * dumpPath
+     * --------------------------------------------------------------------------*/
+
+    TEST(dumpPath, parallelMatchesSequential) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        createDirs(tmpDir + "/a/b");
+        for (int i = 0; i < 300; ++i)
+            writeFile(fmt("%s/%s/file-%d", tmpDir, i % 2 ? "a" : "a/b", i), std::string(i * 37, 'x' + i % 3));
+        writeFile(tmpDir + "/big", std::string(3 * 1024 * 1024 + 5, 'y'));
+        writeFile(tmpDir + "/exe", "#! /bin/sh\n");
+        chmod((tmpDir + "/exe").c_str(), 0755);
+        createSymlink("a/b", tmpDir + "/link");
+
+        PathFilter filter = [](const Path & path) { return baseNameOf(path) != "file-7"; };
+
+        ASSERT_TRUE(globalConfig.set("nar-dump-threads", "1"));
+        StringSink sequential;
+        dumpPath(tmpDir, sequential, filter);
+
+        ASSERT_TRUE(globalConfig.set("nar-dump-threads", "8"));
+        StringSink parallel;
+        dumpPath(tmpDir, parallel, filter);
+
+        ASSERT_EQ(*sequential.s, *parallel.s);
+        ASSERT_EQ(sequential.s->find("file-7\0", 0, 7), std::string::npos);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * restorePath / deletePath with io_uring
+     * --------------------------------------------------------------------------*/
+
+    TEST(restorePath, ioUring) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        createDirs(tmpDir + "/src/a/b");
+        for (int i = 0; i < 1000; ++i)
+            writeFile(fmt("%s/src/%s/file-%d", tmpDir, i % 2 ? "a" : "a/b", i), std::string(i * 37, 'x' + i % 3));
+        writeFile(tmpDir + "/src/big", std::string(3 * 1024 * 1024 + 5, 'y'));
+        writeFile(tmpDir + "/src/exe", "#! /bin/sh\n");
+        chmod((tmpDir + "/src/exe").c_str(), 0755);
+        createSymlink("a/b", tmpDir + "/src/link");
+
+        StringSink nar;
+        dumpPath(tmpDir + "/src", nar);
+
+        Finally restoreSettings([]() {
+            globalConfig.set("use-io-uring", "false");
+            globalConfig.set("io-uring-depth", "256");
+        });
+        ASSERT_TRUE(globalConfig.set("use-io-uring", "true"));
+        ASSERT_TRUE(globalConfig.set("io-uring-depth", "16"));
+
+        StringSource source(*nar.s);
+        restorePath(tmpDir + "/dst", source);
+
+        StringSink nar2;
+        dumpPath(tmpDir + "/dst", nar2);
+        ASSERT_EQ(*nar.s, *nar2.s);
+
+        uint64_t bytesFreed;
+        deletePath(tmpDir + "/dst", bytesFreed);
+        ASSERT_FALSE(pathExists(tmpDir + "/dst"));
+        ASSERT_GE(bytesFreed, 3 * 1024 * 1024);
+    }
+}
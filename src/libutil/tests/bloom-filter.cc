@@ -0,0 +1,45 @@
+#include "bloom-filter.hh"
+#include "error.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * BloomFilter
+     * --------------------------------------------------------------------------*/
+
+    TEST(BloomFilter, containsInsertedKeys) {
+        auto filter = BloomFilter::forCapacity(1000);
+        for (int i = 0; i < 1000; i++)
+            filter.insert(std::to_string(i));
+        for (int i = 0; i < 1000; i++)
+            ASSERT_TRUE(filter.mayContain(std::to_string(i)));
+    }
+
+    TEST(BloomFilter, hasFewFalsePositives) {
+        auto filter = BloomFilter::forCapacity(1000);
+        for (int i = 0; i < 1000; i++)
+            filter.insert(std::to_string(i));
+        int falsePositives = 0;
+        for (int i = 1000; i < 11000; i++)
+            if (filter.mayContain(std::to_string(i))) falsePositives++;
+        ASSERT_LT(falsePositives, 200);
+    }
+
+    TEST(BloomFilter, roundTrips) {
+        auto filter = BloomFilter::forCapacity(100);
+        filter.insert("foo");
+        auto filter2 = BloomFilter::parse(filter.serialise());
+        ASSERT_TRUE(filter2.mayContain("foo"));
+        ASSERT_FALSE(filter2.mayContain("bar"));
+        ASSERT_EQ(filter2.serialise(), filter.serialise());
+    }
+
+    TEST(BloomFilter, rejectsCorruptData) {
+        auto data = BloomFilter::forCapacity(100).serialise();
+        ASSERT_THROW(BloomFilter::parse("foo"), Error);
+        ASSERT_THROW(BloomFilter::parse(data.substr(0, data.size() - 1)), Error);
+        ASSERT_THROW(BloomFilter::parse("nix-bloom-filter-1\n64 x\n12345678"), Error);
+    }
+
+}
@@ -0,0 +1,64 @@
+#include "chunking.hh"
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace nix {
+
+    static std::string randomData(size_t size, unsigned int seed)
+    {
+        std::mt19937 gen(seed);
+        std::string s(size, 0);
+        for (auto & c : s) c = gen();
+        return s;
+    }
+
+    static std::vector<std::string> chunk(std::string_view data, size_t pieceSize)
+    {
+        std::vector<std::string> chunks;
+        ChunkingSink sink([&](std::string_view chunk) { chunks.emplace_back(chunk); },
+            1024, 4096, 16384);
+        for (size_t pos = 0; pos < data.size(); pos += pieceSize)
+            sink(data.substr(pos, pieceSize));
+        sink.finish();
+        return chunks;
+    }
+
+    /* ----------------------------------------------------------------------------
+     * ChunkingSink
+     * --------------------------------------------------------------------------*/
+
+    TEST(ChunkingSink, chunksConcatenateToInput) {
+        auto data = randomData(1000000, 1);
+        std::string joined;
+        for (auto & c : chunk(data, 1000)) {
+            ASSERT_GE(c.size(), 1024);
+            ASSERT_LE(c.size(), 16384);
+            joined += c;
+        }
+        ASSERT_EQ(joined, data);
+    }
+
+    TEST(ChunkingSink, boundariesDontDependOnWriteSize) {
+        auto data = randomData(300000, 2);
+        ASSERT_EQ(chunk(data, 1), chunk(data, 65536));
+    }
+
+    TEST(ChunkingSink, insertionOnlyAffectsNearbyChunks) {
+        auto data = randomData(1000000, 3);
+        auto modified = data.substr(0, 500000) + "inserted" + data.substr(500000);
+
+        auto a = chunk(data, 4096);
+        auto b = chunk(modified, 4096);
+        std::set<std::string> as(a.begin(), a.end());
+        size_t shared = 0;
+        for (auto & c : b) shared += as.count(c);
+
+        ASSERT_GE(shared + 3, b.size());
+    }
+
+    TEST(ChunkingSink, emptyInputHasNoChunks) {
+        ASSERT_TRUE(chunk("", 1).empty());
+    }
+
+}
@@ -33,6 +33,21 @@ namespace nix {
         ASSERT_EQ(*o, str);
     }
 
+    TEST(decompress, decompressZstdCompressed) {
+        auto method = "zstd";
+        auto str = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+        ref<std::string> o = decompress(method, *compress(method, str));
+
+        ASSERT_EQ(*o, str);
+    }
+
+    TEST(decompress, decompressTruncatedZstd) {
+        auto compressed = *compress("zstd", "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf");
+        compressed.resize(compressed.size() - 4);
+
+        ASSERT_THROW(decompress("zstd", compressed), CompressionError);
+    }
+
     TEST(decompress, decompressBrCompressed) {
         auto method = "br";
         auto str = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
@@ -75,4 +90,135 @@ namespace nix {
         ASSERT_STREQ((*strSink.s).c_str(), inputString);
     }
 
+    TEST(makeCompressionSink, zstdWithLevelAndLongDistanceMatching) {
+        StringSink strSink;
+        std::string inputString;
+        for (int i = 0; i < 10000; ++i)
+            inputString += fmt("line %d\n", i);
+        auto sink = makeCompressionSink("zstd", strSink, true, 19, true);
+        (*sink)(inputString);
+        sink->finish();
+
+        ASSERT_EQ(*decompress("zstd", *strSink.s), inputString);
+    }
+
+    TEST(makeCompressionSink, zstdParallelFrames) {
+        std::string inputString;
+        for (int i = 0; inputString.size() < 40 * 1024 * 1024; ++i)
+            inputString += fmt("line %d\n", i);
+
+        StringSink strSink;
+        auto sink = makeCompressionSink("zstd", strSink, true, 1);
+        (*sink)(inputString);
+        sink->finish();
+
+        /* Both the parallel and the streaming decoder must accept the
+           frames written in parallel mode. */
+        for (auto parallel : {true, false}) {
+            StringSink outSink;
+            auto decompressionSink = makeDecompressionSink("zstd", outSink, parallel);
+            (*decompressionSink)(*strSink.s);
+            decompressionSink->finish();
+            ASSERT_EQ(*outSink.s, inputString);
+        }
+    }
+
+    TEST(makeDecompressionSink, zstdParallelMixedFrames) {
+        /* A parallel frame followed by a frame of unknown size, which
+           must be decompressed as a stream. */
+        std::string first, second;
+        for (int i = 0; first.size() < 20 * 1024 * 1024; ++i)
+            first += fmt("line %d\n", i);
+        for (int i = 0; i < 10000; ++i)
+            second += fmt("other line %d\n", i);
+
+        StringSink strSink;
+        {
+            auto sink = makeCompressionSink("zstd", strSink, true, 1);
+            (*sink)(first);
+            sink->finish();
+        }
+        {
+            auto sink = makeCompressionSink("zstd", strSink);
+            (*sink)(second);
+            sink->finish();
+        }
+
+        StringSink outSink;
+        auto decompressionSink = makeDecompressionSink("zstd", outSink, true);
+        (*decompressionSink)(*strSink.s);
+        decompressionSink->finish();
+        ASSERT_EQ(*outSink.s, first + second);
+    }
+
+    TEST(makeDecompressionSink, zstdParallelStreamingInput) {
+        std::string inputString;
+        for (int i = 0; i < 10000; ++i)
+            inputString += fmt("line %d\n", i);
+
+        StringSink strSink;
+        auto sink = makeCompressionSink("zstd", strSink);
+        (*sink)(inputString);
+        sink->finish();
+
+        StringSink outSink;
+        auto decompressionSink = makeDecompressionSink("zstd", outSink, true);
+        (*decompressionSink)(*strSink.s);
+        decompressionSink->finish();
+        ASSERT_EQ(*outSink.s, inputString);
+    }
+
+    TEST(makeDecompressionSink, xzParallel) {
+        std::string inputString;
+        for (int i = 0; i < 10000; ++i)
+            inputString += fmt("line %d\n", i);
+
+        StringSink strSink;
+        auto sink = makeCompressionSink("xz", strSink, true);
+        (*sink)(inputString);
+        sink->finish();
+
+        StringSink outSink;
+        auto decompressionSink = makeDecompressionSink("xz", outSink, true);
+        (*decompressionSink)(*strSink.s);
+        decompressionSink->finish();
+        ASSERT_EQ(*outSink.s, inputString);
+    }
+
+    TEST(makeDeltaCompressionSink, compressAndDecompress) {
+        std::string base, target;
+        for (int i = 0; i < 100000; ++i) {
+            base += fmt("line %d of version 1\n", i * 7919 % 100003);
+            target += fmt("line %d of version %d\n", i * 7919 % 100003, i == 5000 ? 2 : 1);
+        }
+
+        StringSink delta;
+        auto sink = makeDeltaCompressionSink(base, delta);
+        (*sink)(target);
+        sink->finish();
+
+        ASSERT_LT(delta.s->size(), 1000);
+
+        StringSink strSink;
+        auto decompressionSink = makeDeltaDecompressionSink(base, strSink);
+        (*decompressionSink)(*delta.s);
+        decompressionSink->finish();
+
+        ASSERT_EQ(*strSink.s, target);
+    }
+
+    TEST(makeBackgroundSink, compressAndDecompress) {
+        StringSink strSink;
+        std::string inputString;
+        for (int i = 0; i < 10000; ++i)
+            inputString += fmt("line %d of the build log\n", i);
+        auto sink = makeBackgroundSink(makeCompressionSink("bzip2", strSink));
+
+        for (size_t pos = 0; pos < inputString.size(); pos += 100)
+            (*sink)(std::string_view(inputString).substr(pos, 100));
+        sink->finish();
+
+        ASSERT_EQ(*decompress("bzip2", *strSink.s), inputString);
+    }
+
 }
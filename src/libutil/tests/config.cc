@@ -113,6 +113,23 @@ namespace nix {
         }
     }
 
+    TEST(Config, optionalIntSetting) {
+        Config config;
+        Setting<std::optional<int>> setting{&config, {}, "level", "description"};
+
+        ASSERT_EQ(setting.get(), std::nullopt);
+        ASSERT_EQ(setting.to_string(), "");
+
+        ASSERT_TRUE(config.set("level", "-1"));
+        ASSERT_EQ(setting.get(), -1);
+        ASSERT_EQ(setting.to_string(), "-1");
+
+        ASSERT_TRUE(config.set("level", ""));
+        ASSERT_EQ(setting.get(), std::nullopt);
+
+        ASSERT_THROW(config.set("level", "fast"), UsageError);
+    }
+
     TEST(Config, resetOverriden) {
         Config config;
         config.resetOverriden();
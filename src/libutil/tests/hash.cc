@@ -1,4 +1,8 @@
 #include "hash.hh"
+#include "blake3.hh"
+#include "sha256.hh"
+
+#include <openssl/sha.h>
 #include <gtest/gtest.h>
 
 namespace nix {
@@ -72,4 +76,78 @@ namespace nix {
                 "7299aeadb6889018501d289e4900f7e4331b99dec4b5433a"
                 "c7d329eeb6dd26545e96e55b874be909");
     }
+
+    TEST(hashString, testKnownBLAKE3Hashes1) {
+        // values taken from: https://github.com/BLAKE3-team/BLAKE3/blob/master/test_vectors/test_vectors.json
+        auto s = "";
+
+        auto hash = hashString(HashType::htBLAKE3, s);
+        ASSERT_EQ(hash.to_string(Base::Base16, true),
+                "blake3:af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262");
+    }
+
+    TEST(hashString, testKnownBLAKE3Hashes2) {
+        // the test vectors use the repeating byte sequence 0, 1, ..., 250
+        std::string s;
+        for (size_t i = 0; i < 102400; ++i)
+            s.push_back(i % 251);
+
+        auto hash = hashString(HashType::htBLAKE3, s.substr(0, 1025));
+        ASSERT_EQ(hash.to_string(Base::Base16, true),
+                "blake3:d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444");
+
+        hash = hashString(HashType::htBLAKE3, s);
+        ASSERT_EQ(hash.to_string(Base::Base16, true),
+                "blake3:bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085");
+    }
+
+    TEST(hashString, testBLAKE3Parallel) {
+        // large inputs are hashed in parallel subtrees, which must
+        // not depend on the number of threads or how the input is split
+        std::string s;
+        for (size_t i = 0; i < 9 * 1024 * 1024 + 12345; ++i)
+            s.push_back(i % 251);
+
+        unsigned char h1[Blake3::hashSize], h2[Blake3::hashSize], h3[Blake3::hashSize];
+
+        Blake3 b1(1);
+        b1.update(s);
+        b1.finish(h1);
+
+        Blake3 b2(4);
+        b2.update(s);
+        b2.finish(h2);
+
+        Blake3 b3(4);
+        for (size_t i = 0; i < s.size(); i += 100000)
+            b3.update(std::string_view(s).substr(i, 100000));
+        b3.finish(h3);
+
+        ASSERT_EQ(memcmp(h1, h2, sizeof(h1)), 0);
+        ASSERT_EQ(memcmp(h1, h3, sizeof(h1)), 0);
+    }
+
+    TEST(hashString, testHardwareSHA256) {
+        if (!haveHardwareSha256())
+            GTEST_SKIP() << "CPU lacks SHA extensions";
+
+        std::string s;
+        for (size_t i = 0; i < 10000; ++i)
+            s.push_back(i * 7);
+
+        // compare against OpenSSL for all lengths around the padding
+        // boundaries and for inputs fed in pieces
+        for (size_t len : {0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 10000}) {
+            unsigned char expected[32], actual[32];
+            SHA256((const unsigned char *) s.data(), len, expected);
+
+            Sha256Ctx ctx;
+            sha256Init(ctx);
+            for (size_t i = 0; i < len; i += 37)
+                sha256Update(ctx, std::string_view(s).substr(i, std::min((size_t) 37, len - i)));
+            sha256Final(actual, ctx);
+
+            ASSERT_EQ(memcmp(expected, actual, 32), 0) << "length " << len;
+        }
+    }
 }
@@ -72,6 +72,13 @@ namespace nix {
         ASSERT_EQ(out.str(), "\"\\t\"");
     }
 
+    TEST(toJSON, escapesBetweenUnescapedRuns) {
+        std::stringstream out;
+        toJSON(out, std::string("a\"b\\c\x01" "d\ne"));
+
+        ASSERT_EQ(out.str(), "\"a\\\"b\\\\c\\u0001d\\ne\"");
+    }
+
     TEST(toJSON, quotesNewline) {
         std::stringstream out;
         toJSON(out, "\n");
@@ -365,6 +365,46 @@ namespace nix {
 
     }
 
+    /* ----------------------------------------------------------------------------
+     * JSONLogger
+     * --------------------------------------------------------------------------*/
+
+    struct RecordingLogger : Logger
+    {
+        std::vector<std::string> msgs;
+        void log(Verbosity lvl, const FormatOrString & fs) override { msgs.push_back(fs.s); }
+        void logEI(const ErrorInfo & ei) override { }
+    };
+
+    TEST(JSONLogger, rateLimitsProgress) {
+        RecordingLogger rec;
+        std::unique_ptr<Logger> json(makeJSONLogger(rec));
+
+        for (uint64_t i = 1; i <= 1000; ++i)
+            json->result(1, resProgress, {i, 1000});
+        json->result(2, resProgress, {5, 10});
+        json->stopActivity(1);
+
+        ASSERT_EQ(rec.msgs, (std::vector<std::string>{
+            "@nix {\"action\":\"result\",\"fields\":[1,1000],\"id\":1,\"type\":105}",
+            "@nix {\"action\":\"result\",\"fields\":[5,10],\"id\":2,\"type\":105}",
+            "@nix {\"action\":\"result\",\"fields\":[1000,1000],\"id\":1,\"type\":105}",
+            "@nix {\"action\":\"stop\",\"id\":1}",
+        }));
+    }
+
+    TEST(JSONLogger, flushesProgressBeforeOtherResults) {
+        RecordingLogger rec;
+        std::unique_ptr<Logger> json(makeJSONLogger(rec));
+
+        json->result(1, resProgress, {1, 3});
+        json->result(1, resProgress, {2, 3});
+        json->result(1, resSetPhase, {"install"});
+
+        ASSERT_EQ(rec.msgs.size(), 3);
+        ASSERT_EQ(rec.msgs[1], "@nix {\"action\":\"result\",\"fields\":[2,3],\"id\":1,\"type\":105}");
+    }
+
 }
 
 #endif
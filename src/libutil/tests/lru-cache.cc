@@ -1,6 +1,8 @@
 #include "lru-cache.hh"
 #include <gtest/gtest.h>
 
+#include <thread>
+
 namespace nix {
 
     /* ----------------------------------------------------------------------------
@@ -127,4 +129,84 @@ namespace nix {
         ASSERT_EQ(c.size(), 0);
         ASSERT_EQ(c.get("one").value_or("empty"), "empty");
     }
+
+    /* ----------------------------------------------------------------------------
+     * eviction after rehashing
+     * --------------------------------------------------------------------------*/
+
+    TEST(LRUCache, evictsOldestAfterManyInserts) {
+        LRUCache<int, int> c(1000);
+        for (int i = 0; i < 5000; ++i) {
+            c.upsert(i, i);
+            /* Keep the first item alive. */
+            ASSERT_EQ(c.get(0), 0);
+        }
+        ASSERT_EQ(c.size(), 1000);
+        ASSERT_EQ(c.get(4000).has_value(), false);
+        ASSERT_EQ(c.get(4001), 4001);
+        ASSERT_EQ(c.get(4999), 4999);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * SharedLRUCache
+     * --------------------------------------------------------------------------*/
+
+    TEST(SharedLRUCache, smallCacheIsExact) {
+        SharedLRUCache<std::string, std::string> c(2);
+        c.upsert("one", "eins");
+        c.upsert("two", "zwei");
+        ASSERT_EQ(c.get("one"), "eins");
+        c.upsert("three", "drei");
+        ASSERT_EQ(c.size(), 2);
+        ASSERT_EQ(c.get("two").has_value(), false);
+        ASSERT_EQ(c.get("one"), "eins");
+        ASSERT_EQ(c.get("three"), "drei");
+    }
+
+    TEST(SharedLRUCache, respectsCapacity) {
+        SharedLRUCache<int, int> c(16384);
+        for (int i = 0; i < 100000; ++i)
+            c.upsert(i, i);
+        ASSERT_LE(c.size(), 16384);
+        ASSERT_EQ(c.get(99999), 99999);
+        c.clear();
+        ASSERT_EQ(c.size(), 0);
+    }
+
+    TEST(SharedLRUCache, eraseAndUpsert) {
+        SharedLRUCache<std::string, std::string> c(10);
+        c.upsert("one", "eins");
+        c.upsert("one", "uno");
+        ASSERT_EQ(c.get("one"), "uno");
+        ASSERT_EQ(c.erase("one"), true);
+        ASSERT_EQ(c.erase("one"), false);
+        ASSERT_EQ(c.get("one").has_value(), false);
+    }
+
+    TEST(SharedLRUCache, expiredItemsAreDropped) {
+        SharedLRUCache<std::string, std::string> c(10);
+        c.upsert("forever", "1");
+        c.upsert("expired", "2", std::chrono::seconds(0));
+        c.upsert("later", "3", std::chrono::hours(1));
+        ASSERT_EQ(c.get("forever"), "1");
+        ASSERT_EQ(c.get("expired").has_value(), false);
+        ASSERT_EQ(c.get("later"), "3");
+        ASSERT_EQ(c.size(), 2);
+    }
+
+    TEST(SharedLRUCache, concurrentAccess) {
+        SharedLRUCache<int, int> c(65536);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t)
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < 20000; ++i) {
+                    c.upsert(t * 20000 + i, i);
+                    auto v = c.get(t * 20000 + i / 2);
+                    if (v) ASSERT_EQ(*v, i / 2);
+                }
+            });
+        for (auto & thread : threads)
+            thread.join();
+        ASSERT_LE(c.size(), 65536);
+    }
 }
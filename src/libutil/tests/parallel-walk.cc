@@ -0,0 +1,75 @@
+#include "parallel-walk.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * walkDirectoryParallel
+     * --------------------------------------------------------------------------*/
+
+    TEST(walkDirectoryParallel, visitsEveryFile) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        std::set<Path> expected{tmpDir};
+        for (int i = 0; i < 20; ++i) {
+            auto dir = fmt("%s/d%d", tmpDir, i);
+            createDirs(dir + "/sub");
+            expected.insert(dir);
+            expected.insert(dir + "/sub");
+            for (int j = 0; j < 20; ++j) {
+                writeFile(fmt("%s/sub/f%d", dir, j), "x");
+                expected.insert(fmt("%s/sub/f%d", dir, j));
+            }
+        }
+        createSymlink("d0", tmpDir + "/link");
+        expected.insert(tmpDir + "/link");
+
+        Sync<std::set<Path>> visited;
+        walkDirectoryParallel(tmpDir, [&](const WalkEntry & entry) {
+            /* The entry must be usable with the *at() functions. */
+            struct stat st;
+            if (fstatat(entry.dirFd, entry.name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                throw SysError("getting status of '%s'", entry.path);
+            EXPECT_EQ(st.st_ino, entry.st.st_ino);
+            EXPECT_TRUE(visited.lock()->insert(entry.path).second);
+            return true;
+        }, 4);
+
+        ASSERT_EQ(*visited.lock(), expected);
+    }
+
+    TEST(walkDirectoryParallel, skipsDirectories) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        createDirs(tmpDir + "/a/b");
+        createDirs(tmpDir + "/skip/c");
+        writeFile(tmpDir + "/skip/f", "x");
+
+        Sync<std::set<Path>> visited;
+        walkDirectoryParallel(tmpDir, [&](const WalkEntry & entry) {
+            visited.lock()->insert(entry.path);
+            return baseNameOf(entry.path) != "skip";
+        }, 4);
+
+        ASSERT_EQ(*visited.lock(), (std::set<Path>{tmpDir, tmpDir + "/a", tmpDir + "/a/b", tmpDir + "/skip"}));
+    }
+
+    TEST(walkDirectoryParallel, propagatesExceptions) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        for (int i = 0; i < 10; ++i)
+            createDirs(fmt("%s/d%d/e", tmpDir, i));
+
+        ASSERT_THROW(walkDirectoryParallel(tmpDir, [&](const WalkEntry & entry) {
+            if (baseNameOf(entry.path) == "e") throw Error("failure");
+            return true;
+        }, 4), Error);
+    }
+
+}
@@ -0,0 +1,222 @@
+#include "serialise.hh"
+#include "util.hh"
+#include <gtest/gtest.h>
+
+#include <ostream>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * SinkStreamBuf
+     * --------------------------------------------------------------------------*/
+
+    struct ChunkSink : Sink
+    {
+        std::vector<std::string> chunks;
+        void operator () (std::string_view data) override
+        {
+            chunks.emplace_back(data);
+        }
+    };
+
+    TEST(SinkStreamBuf, writesToSinkOnFlush) {
+        StringSink sink;
+        SinkStreamBuf buf(sink);
+        std::ostream str(&buf);
+        str << "hello " << 42;
+        str.flush();
+        ASSERT_EQ(*sink.s, "hello 42");
+    }
+
+    TEST(SinkStreamBuf, bufferIsBounded) {
+        ChunkSink sink;
+        {
+            SinkStreamBuf buf(sink, 4);
+            std::ostream str(&buf);
+            str << "abcdefghij";
+        }
+        ASSERT_EQ(sink.chunks, (std::vector<std::string>{"abcd", "efgh", "ij"}));
+    }
+
+    TEST(SinkStreamBuf, propagatesSinkErrors) {
+        struct FailingSink : Sink
+        {
+            void operator () (std::string_view data) override
+            {
+                throw Error("write failed");
+            }
+        } sink;
+        SinkStreamBuf buf(sink, 4);
+        std::ostream str(&buf);
+        str.exceptions(std::ios::badbit);
+        ASSERT_THROW(str << "abcdefgh", Error);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * sinkToSourceThreaded
+     * --------------------------------------------------------------------------*/
+
+    TEST(sinkToSourceThreaded, passesDataInOrder) {
+        std::string expected;
+        for (int i = 0; i < 100000; i++) expected += std::to_string(i);
+
+        auto source = sinkToSourceThreaded([&](Sink & sink) {
+            for (size_t pos = 0; pos < expected.size(); pos += 1000)
+                sink(std::string_view(expected).substr(pos, 1000));
+        }, []() { throw EndOfFile("done"); }, 4096);
+
+        ASSERT_EQ(source->drain(), expected);
+    }
+
+    TEST(sinkToSourceThreaded, rethrowsProducerErrors) {
+        auto source = sinkToSourceThreaded([&](Sink & sink) {
+            sink("foo");
+            throw Error("producer failed");
+        });
+
+        ASSERT_THROW(source->drain(), Error);
+    }
+
+    TEST(sinkToSourceThreaded, canBeDestroyedEarly) {
+        auto source = sinkToSourceThreaded([&](Sink & sink) {
+            while (true) sink("data");
+        }, []() { throw EndOfFile("done"); }, 16);
+
+        char buf[4];
+        (*source)(buf, sizeof(buf));
+        ASSERT_EQ(std::string(buf, sizeof(buf)), "data");
+        source.reset();
+    }
+
+    /* ----------------------------------------------------------------------------
+     * BackgroundSink
+     * --------------------------------------------------------------------------*/
+
+    TEST(BackgroundSink, passesDataInOrder) {
+        ChunkSink sink;
+        BackgroundSink background(sink, 16);
+        for (int i = 0; i < 1000; i++)
+            background(std::to_string(i));
+        background.finish();
+
+        std::string expected, got;
+        for (int i = 0; i < 1000; i++) expected += std::to_string(i);
+        for (auto & chunk : sink.chunks) got += chunk;
+        ASSERT_EQ(got, expected);
+    }
+
+    TEST(BackgroundSink, rethrowsSinkErrors) {
+        struct FailingSink : Sink
+        {
+            void operator () (std::string_view data) override
+            {
+                throw Error("write failed");
+            }
+        } sink;
+        BackgroundSink background(sink, 16);
+        for (int i = 0; i < 100; i++)
+            background("abcdefgh");
+        ASSERT_THROW(background.finish(), Error);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * FdSink::sendFile
+     * --------------------------------------------------------------------------*/
+
+    TEST(FdSink, sendFileFromRegularFile) {
+        auto [src, srcPath] = createTempFile();
+        AutoDelete delSrc(srcPath, false);
+        std::string data(100000, 'x');
+        writeFull(src.get(), data);
+        ASSERT_EQ(lseek(src.get(), 0, SEEK_SET), 0);
+
+        auto [dst, dstPath] = createTempFile();
+        AutoDelete delDst(dstPath, false);
+        {
+            FdSink sink(dst.get());
+            sink("head");
+            sink.sendFile(src.get(), data.size());
+            sink("tail");
+            ASSERT_EQ(sink.written, data.size() + 4);
+        }
+
+        ASSERT_EQ(readFile(dstPath), "head" + data + "tail");
+    }
+
+    TEST(FdSink, sendFileFallsBackForPipes) {
+        Pipe pipe;
+        pipe.create();
+        writeFull(pipe.writeSide.get(), "hello world");
+
+        auto [dst, dstPath] = createTempFile();
+        AutoDelete delDst(dstPath, false);
+        {
+            FdSink sink(dst.get());
+            sink.sendFile(pipe.readSide.get(), 5);
+        }
+
+        ASSERT_EQ(readFile(dstPath), "hello");
+    }
+
+    /* ----------------------------------------------------------------------------
+     * FdSink::writeGather / BufferedSource
+     * --------------------------------------------------------------------------*/
+
+    TEST(FdSink, gathersBufferAndLargeWrites) {
+        auto [dst, dstPath] = createTempFile();
+        AutoDelete delDst(dstPath, false);
+        std::string data(100000, 'x');
+        {
+            FdSink sink(dst.get());
+            sink << "head";
+            sink(data);
+            sink << "tail";
+            ASSERT_EQ(sink.written, 16 + data.size());
+        }
+
+        StringSink expected;
+        expected << "head";
+        expected(data);
+        expected << "tail";
+        ASSERT_EQ(readFile(dstPath), *expected.s);
+    }
+
+    struct CountingSource : BufferedSource
+    {
+        std::string data;
+        size_t pos = 0;
+        std::vector<size_t> reads;
+
+        size_t readUnbuffered(char * buf, size_t len) override
+        {
+            if (pos == data.size()) throw EndOfFile("end of data");
+            auto n = data.copy(buf, len, pos);
+            pos += n;
+            reads.push_back(len);
+            return n;
+        }
+    };
+
+    TEST(BufferedSource, bypassesBufferForLargeReads) {
+        CountingSource source;
+        source.data = std::string(1 << 20, 'x');
+        std::string buf(100000, 0);
+        source(buf.data(), buf.size());
+        ASSERT_EQ(source.reads, std::vector<size_t>{buf.size()});
+    }
+
+    TEST(BufferedSource, growsBuffer) {
+        CountingSource source;
+        for (size_t i = 0; i < 4 << 20; ++i)
+            source.data.push_back(i % 251);
+        std::string result;
+        char c[100];
+        while (result.size() < source.data.size()) {
+            auto n = source.read(c, sizeof(c));
+            result.append(c, n);
+        }
+        ASSERT_EQ(result, source.data);
+        ASSERT_EQ(source.reads.back(), BufferedSource::maxBufSize);
+    }
+
+}
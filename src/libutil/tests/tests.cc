@@ -2,6 +2,7 @@
 #include "types.hh"
 
 #include <limits.h>
+#include <sys/stat.h>
 #include <gtest/gtest.h>
 
 namespace nix {
@@ -347,6 +348,24 @@ namespace nix {
         ASSERT_EQ(string2Int<int>("-100"), -100);
     }
 
+    /* ----------------------------------------------------------------------------
+     * string2IntWithUnitPrefix
+     * --------------------------------------------------------------------------*/
+
+    TEST(string2IntWithUnitPrefix, unitPrefixes) {
+        ASSERT_EQ(string2IntWithUnitPrefix<uint64_t>("3"), 3);
+        ASSERT_EQ(string2IntWithUnitPrefix<uint64_t>("2K"), 2048);
+        ASSERT_EQ(string2IntWithUnitPrefix<uint64_t>("1T"), 1ULL << 40);
+        ASSERT_EQ(string2IntWithUnitPrefix<uint16_t>("63K"), 63 * 1024);
+    }
+
+    TEST(string2IntWithUnitPrefix, outOfRange) {
+        ASSERT_THROW(string2IntWithUnitPrefix<uint16_t>("64K"), UsageError);
+        ASSERT_THROW(string2IntWithUnitPrefix<uint16_t>("70000"), UsageError);
+        ASSERT_THROW(string2IntWithUnitPrefix<unsigned int>("4G"), UsageError);
+        ASSERT_THROW(string2IntWithUnitPrefix<uint64_t>("16777216T"), UsageError);
+    }
+
     /* ----------------------------------------------------------------------------
      * statusOk
      * --------------------------------------------------------------------------*/
@@ -587,4 +606,53 @@ namespace nix {
         ASSERT_EQ(filterANSIEscapes("f𐍈𐍈bär", true, 4), "f𐍈𐍈b");
     }
 
+    /* ----------------------------------------------------------------------------
+     * runProgram
+     * --------------------------------------------------------------------------*/
+
+    TEST(runProgram, capturesStdout) {
+        ASSERT_EQ(runProgram("echo", true, { "hello" }), "hello\n");
+    }
+
+    TEST(runProgram, passesInput) {
+        ASSERT_EQ(runProgram("cat", true, {}, "some input"), "some input");
+    }
+
+    TEST(runProgram, setsEnvironmentAndDirectory) {
+        RunOptions opts("sh", { "-c", "echo $FOO; pwd" });
+        opts.environment = std::map<std::string, std::string> { { "FOO", "bar" } };
+        opts.chdir = "/";
+        auto res = runProgram(opts);
+        ASSERT_EQ(res.first, 0);
+        ASSERT_EQ(res.second, "bar\n/\n");
+    }
+
+    TEST(runProgram, mergesStderr) {
+        RunOptions opts("sh", { "-c", "echo out; echo err >&2" });
+        opts.mergeStderrToStdout = true;
+        ASSERT_EQ(runProgram(opts).second, "out\nerr\n");
+    }
+
+    TEST(runProgram, returnsExitStatus) {
+        auto res = runProgram(RunOptions("sh", { "-c", "exit 3" }));
+        ASSERT_TRUE(WIFEXITED(res.first));
+        ASSERT_EQ(WEXITSTATUS(res.first), 3);
+        ASSERT_THROW(runProgram("false", true), ExecError);
+    }
+
+    TEST(runProgram, missingProgram) {
+        ASSERT_THROW(runProgram("nix-no-such-program", true), ExecError);
+        ASSERT_THROW(runProgram("/nix-no-such-dir/program", false), ExecError);
+    }
+
+    TEST(runProgram, runsScriptsWithoutInterpreter) {
+        auto tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+        auto script = tmpDir + "/script";
+        writeFile(script, "echo \"$@\"\n");
+        chmod(script.c_str(), 0755);
+        ASSERT_EQ(runProgram(script, true, { "a", "b" }), "a b\n");
+        ASSERT_THROW(runProgram(script, false), ExecError);
+    }
+
 }
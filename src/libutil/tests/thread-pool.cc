@@ -0,0 +1,122 @@
+#include "thread-pool.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * ThreadPool
+     * --------------------------------------------------------------------------*/
+
+    TEST(ThreadPool, runsHigherPrioritiesFirst) {
+        // with one thread, all items are run by process() in order
+        ThreadPool pool(1);
+        std::vector<int> order;
+
+        pool.enqueue([&]() { order.push_back(0); });
+        pool.enqueue([&]() { order.push_back(1); }, 1);
+        pool.enqueue([&]() { order.push_back(2); });
+        pool.enqueue([&]() {
+            order.push_back(3);
+            pool.enqueue([&]() { order.push_back(4); }, 1);
+        }, 2);
+
+        pool.process();
+
+        ASSERT_EQ(order, (std::vector<int>{3, 1, 4, 0, 2}));
+    }
+
+    TEST(ThreadPool, submitReturnsResults) {
+        ThreadPool pool(4);
+        std::vector<std::future<int>> results;
+
+        for (int i = 0; i < 100; ++i)
+            results.push_back(pool.submit([i]() {
+                if (i == 42) throw Error("failure");
+                return i * i;
+            }));
+
+        // the exception doesn't stop the other items
+        pool.process();
+
+        for (int i = 0; i < 100; ++i)
+            if (i == 42)
+                ASSERT_THROW(results[i].get(), Error);
+            else
+                ASSERT_EQ(results[i].get(), i * i);
+    }
+
+    TEST(ThreadPool, cancelDiscardsPendingItems) {
+        ThreadPool pool(1);
+        int ran = 0;
+
+        for (int i = 0; i < 10; ++i)
+            pool.enqueue([&, i]() {
+                ran++;
+                if (i == 3) pool.cancel();
+            });
+
+        ASSERT_NO_THROW(pool.process());
+        ASSERT_EQ(ran, 4);
+    }
+
+    TEST(ThreadPool, cancelStopsRunningItems) {
+        ThreadPool pool(4);
+        std::atomic<int> stopped{0};
+
+        for (int i = 0; i < 3; ++i)
+            pool.enqueue([&]() {
+                try {
+                    while (true) {
+                        checkInterrupt();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                } catch (Interrupted &) {
+                    stopped++;
+                    throw;
+                }
+            });
+
+        pool.enqueue([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            pool.cancel();
+        }, 1);
+
+        ASSERT_NO_THROW(pool.process());
+        ASSERT_EQ(stopped, 3);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * processGraph
+     * --------------------------------------------------------------------------*/
+
+    TEST(processGraph, processesDependenciesFirst) {
+        ThreadPool pool(4);
+        std::set<int> nodes;
+        for (int i = 0; i < 1000; ++i) nodes.insert(i);
+
+        /* Every node depends on the nodes with half its number, and on
+           nodes outside the graph, which are ignored. */
+        Sync<std::vector<int>> order_;
+        processGraph<int>(pool, nodes,
+            [](const int & n) { return std::set<int>{n / 2, n / 3, n + 1000}; },
+            [&](const int & n) { order_.lock()->push_back(n); });
+
+        auto order(order_.lock());
+        ASSERT_EQ(order->size(), nodes.size());
+        std::map<int, size_t> position;
+        for (size_t i = 0; i < order->size(); ++i)
+            position[(*order)[i]] = i;
+        for (int n = 1; n < 1000; ++n) {
+            ASSERT_LT(position[n / 2], position[n]);
+            ASSERT_LT(position[n / 3], position[n]);
+        }
+    }
+
+    TEST(processGraph, detectsCycles) {
+        ThreadPool pool(4);
+        ASSERT_THROW(processGraph<int>(pool, {1, 2, 3},
+            [](const int & n) { return std::set<int>{n % 3 + 1}; },
+            [](const int & n) { }), Error);
+    }
+}
@@ -0,0 +1,54 @@
+#include "topo-sort.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * topoSort
+     * --------------------------------------------------------------------------*/
+
+    static std::vector<std::string> sort(const std::map<std::string, std::set<std::string>> & graph)
+    {
+        std::set<std::string> items;
+        for (auto & i : graph) items.insert(i.first);
+        return topoSort<std::string>(items,
+            [&](const std::string & item) { return graph.at(item); },
+            [](const std::string & item, const std::string & parent) {
+                return Error("cycle from '%s' to '%s'", parent, item);
+            });
+    }
+
+    TEST(topoSort, sortsParentsBeforeChildren) {
+        ASSERT_EQ(sort({
+            {"a", {"b", "c"}},
+            {"b", {"d"}},
+            {"c", {"d", "x"}},
+            {"d", {"d"}},
+        }), (std::vector<std::string>{"a", "c", "b", "d"}));
+    }
+
+    TEST(topoSort, handlesDeepGraphs) {
+        std::map<std::string, std::set<std::string>> graph;
+        for (int i = 0; i < 100000; ++i)
+            graph[fmt("%06d", i)] = {fmt("%06d", i + 1)};
+        auto sorted = sort(graph);
+        ASSERT_EQ(sorted.size(), 100000);
+        ASSERT_EQ(sorted.front(), "000000");
+        ASSERT_EQ(sorted.back(), "099999");
+    }
+
+    TEST(topoSort, detectsCycles) {
+        std::set<std::string> items{"a", "b", "c"};
+        std::pair<std::string, std::string> cycle;
+        ASSERT_THROW(topoSort<std::string>(items,
+            [](const std::string & item) {
+                return std::set<std::string>{item == "c" ? "a" : std::string(1, item[0] + 1)};
+            },
+            [&](const std::string & item, const std::string & parent) {
+                cycle = {parent, item};
+                return Error("cycle");
+            }), Error);
+        ASSERT_EQ(cycle, (std::pair<std::string, std::string>{"c", "a"}));
+    }
+}
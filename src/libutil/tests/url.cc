@@ -1,6 +1,9 @@
 #include "url.hh"
+#include "url-parts.hh"
 #include <gtest/gtest.h>
 
+#include <random>
+
 namespace nix {
 
 /* ----------- tests for url.hh --------------------------------------------------*/
@@ -215,6 +218,87 @@ namespace nix {
         ASSERT_THROW(parseURL(""), Error);
     }
 
+    /* The regular expression that parseURL() used to be based on. */
+    static std::optional<ParsedURL> parseURLWithRegex(const std::string & url)
+    {
+        static std::regex uriRegex(
+            "((" + schemeRegex + "):"
+            + "(?:(?://(" + authorityRegex + ")(" + absPathRegex + "))|(/?" + pathRegex + ")))"
+            + "(?:\\?(" + queryRegex + "))?"
+            + "(?:#(" + queryRegex + "))?",
+            std::regex::ECMAScript);
+
+        std::smatch match;
+        if (!std::regex_match(url, match, uriRegex)) return std::nullopt;
+
+        return ParsedURL{
+            .url = url,
+            .base = match[1],
+            .scheme = match[2],
+            .authority = match[3].matched ? std::optional<std::string>(match[3]) : std::nullopt,
+            .path = match[4].matched ? match[4] : match[5],
+            .query = decodeQuery(match[6]),
+            .fragment = percentDecode(std::string(match[7])),
+        };
+    }
+
+    TEST(parseURL, agreesWithRegex) {
+        /* Generate random URLs from pieces that exercise the
+           different parts of the grammar. */
+        std::vector<std::string> pieces{
+            "http", "git+ssh", "file", "X", "1", ":", "//", "/", "@", "[", "]",
+            "::1", "80", "a", "b.c", "%41", "%4", "%", "?", "#", "=", "&",
+            " ", "\"", "!", "~", "-", "_", "{", "^", "\\", "\n",
+        };
+
+        std::mt19937 rng(42);
+        auto withScheme = std::uniform_int_distribution<>(0, 3);
+        auto nrPieces = std::uniform_int_distribution<>(0, 10);
+        auto piece = std::uniform_int_distribution<size_t>(0, pieces.size() - 1);
+
+        size_t valid = 0;
+
+        for (int n = 0; n < 20000; ++n) {
+            std::string url;
+            if (withScheme(rng)) url = withScheme(rng) > 1 ? "https://" : "git+file:";
+            for (int m = nrPieces(rng); m > 0; --m)
+                url += pieces[piece(rng)];
+
+            auto expected = parseURLWithRegex(url);
+
+            std::optional<ParsedURL> parsed;
+            try {
+                parsed = parseURL(url);
+            } catch (BadURL &) {
+            } catch (Error &) {
+                /* A file URL with an authority; see below. */
+                ASSERT_TRUE(expected) << url;
+                continue;
+            }
+
+            ASSERT_EQ((bool) parsed, (bool) expected) << url;
+            if (!parsed) continue;
+            valid++;
+
+            if (parsed->scheme.find("file") != std::string::npos && parsed->path == "/" && expected->path.empty())
+                expected->path = "/";
+            ASSERT_EQ(parsed->base, expected->base) << url;
+            ASSERT_EQ(parsed->authority, expected->authority) << url;
+            ASSERT_EQ(*parsed, *expected) << url;
+        }
+
+        ASSERT_GT(valid, 1000);
+    }
+
+    TEST(isValidRef, agreesWithRegex) {
+        for (auto s : {"", "master", "release-21.05", "feature/foo_bar", "-x", ".x", "a b", "a:b", "_a", "0"})
+            ASSERT_EQ(isValidRef(s), std::regex_match(s, refRegex)) << s;
+        for (auto s : {"", "0123456789abcdef0123456789ABCDEF01234567", "0123456789abcdef0123456789abcdef0123456", "g123456789abcdef0123456789abcdef01234567"})
+            ASSERT_EQ(isValidRev(s), std::regex_match(s, revRegex)) << s;
+        for (auto s : {"", "nixpkgs", "nix-2_4", "0nix", "-a", "a.b", "A"})
+            ASSERT_EQ(isValidFlakeId(s), std::regex_match(s, flakeIdRegex)) << s;
+    }
+
     /* ----------------------------------------------------------------------------
      * decodeQuery
      * --------------------------------------------------------------------------*/
@@ -1,5 +1,6 @@
 #include "thread-pool.hh"
 #include "affinity.hh"
+#include "finally.hh"
 
 namespace nix {
 
@@ -40,14 +41,15 @@ void ThreadPool::shutdown()
         thr.join();
 }
 
-void ThreadPool::enqueue(const work_t & t)
+void ThreadPool::enqueue(const work_t & t, int priority)
 {
     auto state(state_.lock());
     if (quit)
         throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
+    state->pending[priority].push(t);
+    state->nrPending++;
     /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
+    if (state->nrPending > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
         state->workers.emplace_back(&ThreadPool::doWork, this, false);
     work.notify_one();
 }
@@ -60,12 +62,19 @@ void ThreadPool::process()
     try {
         doWork(true);
 
-        auto state(state_.lock());
+        {
+            auto state(state_.lock());
 
-        assert(quit);
+            assert(quit);
+
+            if (state->exception)
+                std::rethrow_exception(state->exception);
+
+        }
 
-        if (state->exception)
-            std::rethrow_exception(state->exception);
+        /* Wait for the items that were running when the pool was
+           cancelled. */
+        if (cancelled) shutdown();
 
     } catch (...) {
         /* In the exceptional case, some workers may still be
@@ -78,10 +87,29 @@ void ThreadPool::process()
     }
 }
 
+void ThreadPool::cancel()
+{
+    auto state(state_.lock());
+    state->pending.clear();
+    state->nrPending = 0;
+    cancelled = true;
+    quit = true;
+    work.notify_all();
+}
+
 void ThreadPool::doWork(bool mainThread)
 {
+    /* Make checkInterrupt() throw in work items when the pool is shut
+       down (worker threads) or cancelled (all threads). */
+    auto prevInterruptCheck = interruptCheck;
+    Finally restoreInterruptCheck([&]() {
+        if (mainThread) interruptCheck = prevInterruptCheck;
+    });
+
     if (!mainThread)
         interruptCheck = [&]() { return (bool) quit; };
+    else
+        interruptCheck = [&]() { return cancelled || (prevInterruptCheck && prevInterruptCheck()); };
 
     bool didWork = false;
     std::exception_ptr exc;
@@ -95,7 +123,9 @@ void ThreadPool::doWork(bool mainThread)
                 assert(state->active);
                 state->active--;
 
-                if (exc) {
+                /* Exceptions thrown after cancel() are presumably
+                   due to the cancellation, so ignore them. */
+                if (exc && !cancelled) {
 
                     if (!state->exception) {
                         state->exception = exc;
@@ -122,7 +152,7 @@ void ThreadPool::doWork(bool mainThread)
             while (true) {
                 if (quit) return;
 
-                if (!state->pending.empty()) break;
+                if (state->nrPending) break;
 
                 /* If there are no active or pending items, and the
                    main thread is running process(), then no new items
@@ -136,8 +166,12 @@ void ThreadPool::doWork(bool mainThread)
                 state.wait(work);
             }
 
-            w = std::move(state->pending.front());
-            state->pending.pop();
+            auto highest = std::prev(state->pending.end());
+            w = std::move(highest->second.front());
+            highest->second.pop();
+            if (highest->second.empty())
+                state->pending.erase(highest);
+            state->nrPending--;
             state->active++;
         }
 
@@ -5,8 +5,10 @@
 
 #include <queue>
 #include <functional>
+#include <future>
 #include <thread>
 #include <map>
+#include <algorithm>
 #include <atomic>
 
 namespace nix {
@@ -14,7 +16,9 @@ namespace nix {
 MakeError(ThreadPoolShutDown, Error);
 
 /* A simple thread pool that executes a queue of work items
-   (lambdas). */
+   (lambdas). Items with a higher priority are started first; items
+   with the same priority are started in the order in which they were
+   enqueued. */
 class ThreadPool
 {
 public:
@@ -23,11 +27,31 @@ public:
 
     ~ThreadPool();
 
-    // FIXME: use std::packaged_task?
     typedef std::function<void()> work_t;
 
     /* Enqueue a function to be executed by the thread pool. */
-    void enqueue(const work_t & t);
+    void enqueue(const work_t & t, int priority = 0);
+
+    /* Enqueue a function and return a future for its result. Unlike
+       with enqueue(), an exception thrown by the function is stored
+       in the future rather than stopping process(). If the pool stops
+       before the function has run, the future's get() throws
+       std::future_error. */
+    template<typename F>
+    auto submit(F && f, int priority = 0) -> std::future<decltype(f())>
+    {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+        auto future = task->get_future();
+        enqueue([task]() { (*task)(); }, priority);
+        return future;
+    }
+
+    /* Discard all pending work items and ask the running ones to stop
+       (i.e. make checkInterrupt() throw while they run). process()
+       then returns once the running items have finished, without
+       propagating their exceptions. Can be called from any thread,
+       including from a work item. */
+    void cancel();
 
     /* Execute work items until the queue is empty. Note that work
        items are allowed to add new items to the queue; this is
@@ -44,14 +68,16 @@ private:
 
     struct State
     {
-        std::queue<work_t> pending;
+        /* Pending work items by priority. */
+        std::map<int, std::queue<work_t>> pending;
+        size_t nrPending = 0;
         size_t active = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
         bool draining = false;
     };
 
-    std::atomic_bool quit{false};
+    std::atomic_bool quit{false}, cancelled{false};
 
     Sync<State> state_;
 
@@ -72,71 +98,81 @@ void processGraph(
     std::function<std::set<T>(const T &)> getEdges,
     std::function<void(const T &)> processNode)
 {
+    /* Nodes are numbered by their position in 'nodes'. */
+    std::vector<const T *> index;
+    index.reserve(nodes.size());
+    for (auto & node : nodes)
+        index.push_back(&node);
+
+    auto find = [&](const T & node) -> std::optional<uint32_t> {
+        auto i = std::lower_bound(index.begin(), index.end(), node,
+            [](const T * a, const T & b) { return *a < b; });
+        if (i == index.end() || node < **i) return std::nullopt;
+        return i - index.begin();
+    };
+
     struct Graph {
-        std::set<T> left;
-        std::map<T, std::set<T>> refs, rrefs;
+        size_t left;
+        /* Whether the edges of a node have been fetched. */
+        std::vector<bool> known;
+        std::vector<bool> done;
+        /* The number of unprocessed dependencies of each node, and
+           the nodes that depend on it. */
+        std::vector<uint32_t> refs;
+        std::vector<std::vector<uint32_t>> rrefs;
     };
 
-    Sync<Graph> graph_(Graph{nodes, {}, {}});
+    Sync<Graph> graph_(Graph{
+        .left = index.size(),
+        .known = std::vector<bool>(index.size(), false),
+        .done = std::vector<bool>(index.size(), false),
+        .refs = std::vector<uint32_t>(index.size(), 0),
+        .rrefs = std::vector<std::vector<uint32_t>>(index.size()),
+    });
 
-    std::function<void(const T &)> worker;
+    std::function<void(uint32_t)> worker;
 
-    worker = [&](const T & node) {
+    worker = [&](uint32_t n) {
 
-        {
-            auto graph(graph_.lock());
-            auto i = graph->refs.find(node);
-            if (i == graph->refs.end())
-                goto getRefs;
-            goto doWork;
-        }
+        if (!graph_.lock()->known[n]) {
+            auto refs = getEdges(*index[n]);
 
-    getRefs:
-        {
-            auto refs = getEdges(node);
-            refs.erase(node);
-
-            {
-                auto graph(graph_.lock());
-                for (auto & ref : refs)
-                    if (graph->left.count(ref)) {
-                        graph->refs[node].insert(ref);
-                        graph->rrefs[ref].insert(node);
-                    }
-                if (graph->refs[node].empty())
-                    goto doWork;
-            }
+            auto graph(graph_.lock());
+            graph->known[n] = true;
+            for (auto & ref : refs)
+                if (auto m = find(ref); m && *m != n && !graph->done[*m]) {
+                    graph->refs[n]++;
+                    graph->rrefs[*m].push_back(n);
+                }
+            if (graph->refs[n]) return;
         }
 
-        return;
-
-    doWork:
-        processNode(node);
+        processNode(*index[n]);
 
         /* Enqueue work for all nodes that were waiting on this one
            and have no unprocessed dependencies. */
         {
             auto graph(graph_.lock());
-            for (auto & rref : graph->rrefs[node]) {
-                auto & refs(graph->refs[rref]);
-                auto i = refs.find(node);
-                assert(i != refs.end());
-                refs.erase(i);
-                if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
+            for (auto m : graph->rrefs[n]) {
+                assert(graph->refs[m]);
+                /* Give nodes that became runnable a higher
+                   priority than the initial ones, so that chains
+                   of dependencies finish as early as possible. */
+                if (!--graph->refs[m])
+                    pool.enqueue(std::bind(worker, m), 1);
             }
-            graph->left.erase(node);
-            graph->refs.erase(node);
-            graph->rrefs.erase(node);
+            graph->left--;
+            graph->done[n] = true;
+            graph->rrefs[n] = {};
         }
     };
 
-    for (auto & node : nodes)
-        pool.enqueue(std::bind(worker, std::ref(node)));
+    for (uint32_t n = 0; n < index.size(); ++n)
+        pool.enqueue(std::bind(worker, n));
 
     pool.process();
 
-    if (!graph_.lock()->left.empty())
+    if (graph_.lock()->left)
         throw Error("graph processing incomplete (cyclic reference?)");
 }
 
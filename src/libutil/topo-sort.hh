@@ -2,6 +2,8 @@
 
 #include "error.hh"
 
+#include <algorithm>
+
 namespace nix {
 
 template<typename T>
@@ -9,30 +11,66 @@ std::vector<T> topoSort(std::set<T> items,
         std::function<std::set<T>(const T &)> getChildren,
         std::function<Error(const T &, const T &)> makeCycleError)
 {
-    std::vector<T> sorted;
-    std::set<T> visited, parents;
+    /* Number the items by their position in 'items', and store the
+       edges between them in a flat array: the children of item n are
+       edges[offsets[n]] .. edges[offsets[n + 1] - 1]. The graph is
+       then traversed depth-first using an explicit stack rather than
+       recursion, since it can be both large and deep. */
+    std::vector<const T *> index;
+    index.reserve(items.size());
+    for (auto & i : items)
+        index.push_back(&i);
 
-    std::function<void(const T & path, const T * parent)> dfsVisit;
+    uint32_t size = index.size();
 
-    dfsVisit = [&](const T & path, const T * parent) {
-        if (parents.count(path)) throw makeCycleError(path, *parent);
+    std::vector<uint32_t> offsets, edges;
+    offsets.reserve(size + 1);
 
-        if (!visited.insert(path).second) return;
-        parents.insert(path);
+    for (uint32_t n = 0; n < size; ++n) {
+        offsets.push_back(edges.size());
+        for (auto & child : getChildren(*index[n])) {
+            /* Don't traverse into items that don't exist in our
+               starting set. */
+            auto i = std::lower_bound(index.begin(), index.end(), child,
+                [](const T * a, const T & b) { return *a < b; });
+            if (i == index.end() || child < **i) continue;
+            uint32_t m = i - index.begin();
+            if (m != n) edges.push_back(m);
+        }
+    }
+    offsets.push_back(edges.size());
 
-        std::set<T> references = getChildren(path);
+    enum { unvisited, visiting, visited };
+    std::vector<uint8_t> status(size, unvisited);
 
-        for (auto & i : references)
-            /* Don't traverse into items that don't exist in our starting set. */
-            if (i != path && items.count(i))
-                dfsVisit(i, &path);
+    std::vector<T> sorted;
+    sorted.reserve(size);
 
-        sorted.push_back(path);
-        parents.erase(path);
-    };
+    /* Items being visited, and the next edge to look at. */
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
 
-    for (auto & i : items)
-        dfsVisit(i, nullptr);
+    for (uint32_t root = 0; root < size; ++root) {
+        if (status[root] != unvisited) continue;
+        status[root] = visiting;
+        stack.emplace_back(root, offsets[root]);
+
+        while (!stack.empty()) {
+            auto & [n, next] = stack.back();
+            if (next < offsets[n + 1]) {
+                auto m = edges[next++];
+                if (status[m] == visiting)
+                    throw makeCycleError(*index[m], *index[n]);
+                if (status[m] == unvisited) {
+                    status[m] = visiting;
+                    stack.emplace_back(m, offsets[m]);
+                }
+            } else {
+                status[n] = visited;
+                sorted.push_back(*index[n]);
+                stack.pop_back();
+            }
+        }
+    }
 
     std::reverse(sorted.begin(), sorted.end());
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <regex>
 
 namespace nix {
@@ -42,4 +43,12 @@ const static std::string refAndOrRevRegex = "(?:(" + revRegexS + ")|(?:(" + refR
 const static std::string flakeIdRegexS = "[a-zA-Z][a-zA-Z0-9_-]*";
 extern std::regex flakeIdRegex;
 
+/* Hand-written equivalents of std::regex_match() with the regular
+   expressions above, which is too slow for code that runs for every
+   URL or flake reference. */
+bool isValidQuery(std::string_view s); // queryRegex
+bool isValidRef(std::string_view s); // refRegex
+bool isValidRev(std::string_view s); // revRegex
+bool isValidFlakeId(std::string_view s); // flakeIdRegex
+
 }
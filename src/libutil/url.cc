@@ -2,6 +2,9 @@
 #include "url-parts.hh"
 #include "util.hh"
 
+#include <algorithm>
+#include <cstring>
+
 namespace nix {
 
 std::regex refRegex(refRegexS, std::regex::ECMAScript);
@@ -9,63 +12,239 @@ std::regex badGitRefRegex(badGitRefRegexS, std::regex::ECMAScript);
 std::regex revRegex(revRegexS, std::regex::ECMAScript);
 std::regex flakeIdRegex(flakeIdRegexS, std::regex::ECMAScript);
 
+/* The character classes of the regular expressions in url-parts.hh.
+   These are used by the hand-written parsers below, since std::regex
+   is too slow for code that's called for every URL. */
+
+static bool isAlnum(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static bool isHex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static bool isUnreserved(char c)
+{
+    return isAlnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static bool isSubDelim(char c)
+{
+    return c && strchr("!$&'\"()*+,;=", c);
+}
+
+static bool isHostnameChar(char c)
+{
+    return isUnreserved(c) || isSubDelim(c);
+}
+
+static bool isUserChar(char c)
+{
+    return isHostnameChar(c) || c == ':';
+}
+
+static bool isPChar(char c)
+{
+    return isHostnameChar(c) || c == ':' || c == '@';
+}
+
+static bool isQueryChar(char c)
+{
+    return isPChar(c) || c == '/' || c == '?' || c == ' ' || c == '"';
+}
+
+/* Skip the characters starting at 's[pos]' that are in a character
+   class or are percent-encoded. */
+template<typename F>
+static size_t skip(std::string_view s, size_t pos, F inClass)
+{
+    while (pos < s.size()) {
+        if (inClass(s[pos]))
+            pos++;
+        else if (s[pos] == '%' && pos + 2 < s.size() && isHex(s[pos + 1]) && isHex(s[pos + 2]))
+            pos += 3;
+        else
+            break;
+    }
+    return pos;
+}
+
+template<typename F>
+static bool matches(std::string_view s, F inClass)
+{
+    return skip(s, 0, inClass) == s.size();
+}
+
+/* Skip a sequence of "/" followed by a segment, optionally followed
+   by a final "/" (i.e. absPathRegex). */
+static size_t skipSegments(std::string_view s, size_t pos)
+{
+    while (pos < s.size() && s[pos] == '/') {
+        auto end = skip(s, pos + 1, isPChar);
+        if (end == pos + 1) return end;
+        pos = end;
+    }
+    return pos;
+}
+
+static bool isPort(std::string_view s)
+{
+    if (s.size() < 2 || s[0] != ':') return false;
+    for (auto c : s.substr(1))
+        if (c < '0' || c > '9') return false;
+    return true;
+}
+
+/* Whether 's' matches authorityRegex. */
+static bool isAuthority(std::string_view s)
+{
+    auto at = s.find('@');
+    if (at != s.npos) {
+        if (!matches(s.substr(0, at), isUserChar)) return false;
+        s = s.substr(at + 1);
+    }
+
+    auto isIPv6Char = [](char c) { return isHex(c) || c == ':'; };
+
+    if (!s.empty() && s[0] == '[') {
+        auto end = s.find(']');
+        if (end == s.npos || end == 1) return false;
+        for (auto c : s.substr(1, end - 1))
+            if (!isIPv6Char(c)) return false;
+        return end + 1 == s.size() || isPort(s.substr(end + 1));
+    }
+
+    if (!s.empty() && std::all_of(s.begin(), s.end(), isIPv6Char))
+        return true;
+
+    auto colon = s.find(':');
+    return matches(s.substr(0, colon), isHostnameChar)
+        && (colon == s.npos || isPort(s.substr(colon)));
+}
+
+bool isValidQuery(std::string_view s)
+{
+    return matches(s, isQueryChar);
+}
+
+bool isValidRef(std::string_view s)
+{
+    if (s.empty() || !isAlnum(s[0])) return false;
+    for (auto c : s.substr(1))
+        if (!isAlnum(c) && c != '_' && c != '.' && c != '/' && c != '-') return false;
+    return true;
+}
+
+bool isValidRev(std::string_view s)
+{
+    return s.size() == 40 && std::all_of(s.begin(), s.end(), isHex);
+}
+
+bool isValidFlakeId(std::string_view s)
+{
+    if (s.empty() || !((s[0] >= 'a' && s[0] <= 'z') || (s[0] >= 'A' && s[0] <= 'Z'))) return false;
+    for (auto c : s.substr(1))
+        if (!isAlnum(c) && c != '_' && c != '-') return false;
+    return true;
+}
+
 ParsedURL parseURL(const std::string & url)
 {
-    static std::regex uriRegex(
-        "((" + schemeRegex + "):"
-        + "(?:(?://(" + authorityRegex + ")(" + absPathRegex + "))|(/?" + pathRegex + ")))"
-        + "(?:\\?(" + queryRegex + "))?"
-        + "(?:#(" + queryRegex + "))?",
-        std::regex::ECMAScript);
-
-    std::smatch match;
-
-    if (std::regex_match(url, match, uriRegex)) {
-        auto & base = match[1];
-        std::string scheme = match[2];
-        auto authority = match[3].matched
-            ? std::optional<std::string>(match[3]) : std::nullopt;
-        std::string path = match[4].matched ? match[4] : match[5];
-        auto & query = match[6];
-        auto & fragment = match[7];
-
-        auto isFile = scheme.find("file") != std::string::npos;
-
-        if (authority && *authority != "" && isFile)
-            throw Error("file:// URL '%s' has unexpected authority '%s'",
-                url, *authority);
-
-        if (isFile && path.empty())
-            path = "/";
-
-        return ParsedURL{
-            .url = url,
-            .base = base,
-            .scheme = scheme,
-            .authority = authority,
-            .path = path,
-            .query = decodeQuery(query),
-            .fragment = percentDecode(std::string(fragment))
-        };
+    /* This accepts the same URLs as the regular expression
+       "((" + schemeRegex + "):"
+       + "(?:(?://(" + authorityRegex + ")(" + absPathRegex + "))|(/?" + pathRegex + ")))"
+       + "(?:\\?(" + queryRegex + "))?"
+       + "(?:#(" + queryRegex + "))?". */
+    std::string_view s(url);
+
+    auto bad = [&]() { return BadURL("'%s' is not a valid URL", url); };
+
+    if (s.empty() || s[0] < 'a' || s[0] > 'z') throw bad();
+    size_t pos = 1;
+    while (pos < s.size() && ((s[pos] >= 'a' && s[pos] <= 'z') || (s[pos] >= '0' && s[pos] <= '9')
+            || s[pos] == '+' || s[pos] == '.' || s[pos] == '-'))
+        pos++;
+    if (pos == s.size() || s[pos] != ':') throw bad();
+    std::string scheme(s.substr(0, pos));
+    pos++;
+
+    std::optional<std::string> authority;
+    std::string path;
+
+    if (s.substr(pos, 2) == "//") {
+        pos += 2;
+        /* The authority can't contain any of these characters, and
+           must be followed by one of them. */
+        auto end = std::min(s.find_first_of("/?#", pos), s.size());
+        auto a = s.substr(pos, end - pos);
+        if (!isAuthority(a)) throw bad();
+        authority = a;
+        pos = skipSegments(s, end);
+        path = s.substr(end, pos - end);
+    } else {
+        auto start = pos;
+        if (pos < s.size() && s[pos] == '/') pos++;
+        auto end = skip(s, pos, isPChar);
+        if (end == pos) throw bad();
+        pos = skipSegments(s, end);
+        path = s.substr(start, pos - start);
     }
 
-    else
-        throw BadURL("'%s' is not a valid URL", url);
+    auto base = s.substr(0, pos);
+
+    std::string_view query, fragment;
+
+    if (pos < s.size() && s[pos] == '?') {
+        auto end = skip(s, pos + 1, isQueryChar);
+        query = s.substr(pos + 1, end - pos - 1);
+        pos = end;
+    }
+
+    if (pos < s.size() && s[pos] == '#') {
+        auto end = skip(s, pos + 1, isQueryChar);
+        fragment = s.substr(pos + 1, end - pos - 1);
+        pos = end;
+    }
+
+    if (pos != s.size()) throw bad();
+
+    auto isFile = scheme.find("file") != std::string::npos;
+
+    if (authority && *authority != "" && isFile)
+        throw Error("file:// URL '%s' has unexpected authority '%s'",
+            url, *authority);
+
+    if (isFile && path.empty())
+        path = "/";
+
+    return ParsedURL{
+        .url = url,
+        .base = std::string(base),
+        .scheme = scheme,
+        .authority = authority,
+        .path = path,
+        .query = decodeQuery(std::string(query)),
+        .fragment = percentDecode(fragment)
+    };
 }
 
 std::string percentDecode(std::string_view in)
 {
+    auto hexValue = [](char c) {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    };
+
     std::string decoded;
+    decoded.reserve(in.size());
     for (size_t i = 0; i < in.size(); ) {
         if (in[i] == '%') {
-            if (i + 2 >= in.size())
-                throw BadURL("invalid URI parameter '%s'", in);
-            try {
-                decoded += std::stoul(std::string(in, i + 1, 2), 0, 16);
-                i += 3;
-            } catch (...) {
+            if (i + 2 >= in.size() || !isHex(in[i + 1]) || !isHex(in[i + 2]))
                 throw BadURL("invalid URI parameter '%s'", in);
-            }
+            decoded += (char) (hexValue(in[i + 1]) * 16 + hexValue(in[i + 2]));
+            i += 3;
         } else
             decoded += in[i++];
     }
@@ -3,6 +3,7 @@
 #include "sync.hh"
 #include "finally.hh"
 #include "serialise.hh"
+#include "io-uring.hh"
 
 #include <cctype>
 #include <cerrno>
@@ -31,7 +32,9 @@
 #endif
 
 #ifdef __linux__
+#include <sched.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
 
@@ -383,7 +386,8 @@ void writeLine(int fd, string s)
 }
 
 
-static void _deletePath(int parentfd, const Path & path, uint64_t & bytesFreed)
+static void _deletePath(int parentfd, const Path & path, uint64_t & bytesFreed, IoUring * ring,
+    const std::function<void(const struct stat &)> & onEntry)
 {
     checkInterrupt();
 
@@ -398,6 +402,8 @@ static void _deletePath(int parentfd, const Path & path, uint64_t & bytesFreed)
     if (!S_ISDIR(st.st_mode) && st.st_nlink == 1)
         bytesFreed += st.st_size;
 
+    if (onEntry) onEntry(st);
+
     if (S_ISDIR(st.st_mode)) {
         /* Make the directory accessible. */
         const auto PERM_MASK = S_IRUSR | S_IWUSR | S_IXUSR;
@@ -413,7 +419,16 @@ static void _deletePath(int parentfd, const Path & path, uint64_t & bytesFreed)
         if (!dir)
             throw SysError("opening directory '%1%'", path);
         for (auto & i : readDirectory(dir.get(), path))
-            _deletePath(dirfd(dir.get()), path + "/" + i.name, bytesFreed);
+            _deletePath(dirfd(dir.get()), path + "/" + i.name, bytesFreed, ring, onEntry);
+
+        /* The entries must be gone before the directory can be
+           removed, and 'dir' must stay open until then. */
+        if (ring) ring->drain();
+    }
+
+    else if (ring) {
+        ring->unlinkAt(parentfd, name, 0, path);
+        return;
     }
 
     int flags = S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0;
@@ -423,7 +438,8 @@ static void _deletePath(int parentfd, const Path & path, uint64_t & bytesFreed)
     }
 }
 
-static void _deletePath(const Path & path, uint64_t & bytesFreed)
+static void _deletePath(const Path & path, uint64_t & bytesFreed,
+    const std::function<void(const struct stat &)> & onEntry)
 {
     Path dir = dirOf(path);
     if (dir == "")
@@ -438,7 +454,11 @@ static void _deletePath(const Path & path, uint64_t & bytesFreed)
         throw SysError("opening directory '%1%'", path);
     }
 
-    _deletePath(dirfd.get(), path, bytesFreed);
+    auto ring = IoUring::create({IoUring::opUnlink});
+
+    _deletePath(dirfd.get(), path, bytesFreed, ring.get(), onEntry);
+
+    if (ring) ring->drain();
 }
 
 
@@ -453,7 +473,15 @@ void deletePath(const Path & path, uint64_t & bytesFreed)
 {
     //Activity act(*logger, lvlDebug, format("recursively deleting path '%1%'") % path);
     bytesFreed = 0;
-    _deletePath(path, bytesFreed);
+    _deletePath(path, bytesFreed, {});
+}
+
+
+void deletePath(const Path & path, uint64_t & bytesFreed,
+    const std::function<void(const struct stat &)> & onEntry)
+{
+    bytesFreed = 0;
+    _deletePath(path, bytesFreed, onEntry);
 }
 
 
@@ -968,6 +996,10 @@ void killUser(uid_t uid)
 //////////////////////////////////////////////////////////////////////
 
 
+/* The signal mask at startup, restored in child processes. */
+static sigset_t savedSignalMask;
+
+
 /* Wrapper around vfork to prevent the child process from clobbering
    the caller's stack frame in the parent. */
 static pid_t doFork(bool allowVfork, std::function<void()> fun) __attribute__((noinline));
@@ -1058,25 +1090,177 @@ std::pair<int, std::string> runProgram(const RunOptions & options_)
     return {status, std::move(*sink.s)};
 }
 
-void runProgram2(const RunOptions & options)
+#if __linux__
+
+/* The state shared by spawnProgram() with its child. Since the child
+   shares the parent's memory until it calls execve(), everything it
+   needs is prepared by the parent, and the child only makes system
+   calls. */
+struct SpawnState
+{
+    const RunOptions & options;
+    int stdoutFd, stdinFd;
+    /* The paths to try executing, in order. */
+    std::vector<std::string> candidates;
+    std::vector<char *> argv, envp;
+    /* The arguments for running a candidate that isn't a binary with
+       /bin/sh, like execvp() does. The script path is filled in by
+       the child. Empty if there is no PATH search. */
+    std::vector<char *> shArgv;
+    /* Set by the child if it fails before executing the program. */
+    int error = 0;
+    const char * failedStep = nullptr;
+};
+
+
+static int spawnChild(void * arg)
 {
-    checkInterrupt();
+    auto & st = *(SpawnState *) arg;
+    auto & options = st.options;
 
-    assert(!(options.standardIn && options.input));
+    auto fail = [&](const char * step) {
+        st.error = errno;
+        st.failedStep = step;
+        _exit(127);
+    };
 
-    std::unique_ptr<Source> source_;
-    Source * source = options.standardIn;
+    /* The parent's signal handlers would run on its memory, so reset
+       them. Signals are blocked until the mask is restored below. */
+    for (int sig = 1; sig < NSIG; ++sig) {
+        struct sigaction act;
+        if (sigaction(sig, nullptr, &act) == 0
+            && act.sa_handler != SIG_DFL && act.sa_handler != SIG_IGN)
+        {
+            act.sa_handler = SIG_DFL;
+            act.sa_flags = 0;
+            sigaction(sig, &act, nullptr);
+        }
+    }
 
-    if (options.input) {
-        source_ = std::make_unique<StringSource>(*options.input);
-        source = source_.get();
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+        fail("setting death signal");
+    restoreAffinity();
+
+    if (st.stdoutFd != -1 && dup2(st.stdoutFd, STDOUT_FILENO) == -1)
+        fail("dupping stdout");
+    if (options.mergeStderrToStdout && dup2(STDOUT_FILENO, STDERR_FILENO) == -1)
+        fail("dupping stdout into stderr");
+    if (st.stdinFd != -1 && dup2(st.stdinFd, STDIN_FILENO) == -1)
+        fail("dupping stdin");
+
+    if (options.chdir && chdir(options.chdir->c_str()) == -1)
+        fail("changing directory");
+    /* glibc's setgid(), setgroups() and setuid() apply the change to
+       every thread of the process, by signalling the other threads.
+       Those are the parent's threads, since we share its memory (and
+       thus glibc's thread list), so use the system calls, which only
+       affect the calling thread, i.e. us. */
+#ifdef SYS_setresuid32
+    long sysSetresgid = SYS_setresgid32, sysSetgroups = SYS_setgroups32, sysSetresuid = SYS_setresuid32;
+#else
+    long sysSetresgid = SYS_setresgid, sysSetgroups = SYS_setgroups, sysSetresuid = SYS_setresuid;
+#endif
+    if (options.gid && syscall(sysSetresgid, *options.gid, *options.gid, *options.gid) == -1)
+        fail("setgid");
+    /* Drop all other groups if we're setgid. */
+    if (options.gid && syscall(sysSetgroups, 0, nullptr) == -1)
+        fail("setgroups");
+    if (options.uid && syscall(sysSetresuid, *options.uid, *options.uid, *options.uid) == -1)
+        fail("setuid");
+
+    if (sigprocmask(SIG_SETMASK, &savedSignalMask, nullptr))
+        fail("restoring signals");
+
+    /* Search the candidates like execvp() does. */
+    int error = ENOENT;
+    for (auto & path : st.candidates) {
+        execve(path.c_str(), st.argv.data(), st.envp.data());
+        if (errno == ENOEXEC && !st.shArgv.empty()) {
+            st.shArgv[1] = (char *) path.c_str();
+            execve(st.shArgv[0], st.shArgv.data(), st.envp.data());
+        }
+        if (errno == EACCES)
+            error = EACCES;
+        else if (errno != ENOENT && errno != ENOTDIR) {
+            error = errno;
+            break;
+        }
     }
 
-    /* Create a pipe. */
-    Pipe out, in;
-    if (options.standardOut) out.create();
-    if (source) in.create();
+    errno = error;
+    fail("executing");
+    return 127;
+}
+
+
+/* Start a program using clone(CLONE_VM | CLONE_VFORK), i.e. without
+   copying the page tables of the parent, which is expensive if the
+   parent is large (e.g. an evaluator using many gigabytes of
+   memory). Unlike vfork(), this runs the child on its own stack. */
+static Pid spawnProgram(const RunOptions & options, int stdoutFd, int stdinFd)
+{
+    SpawnState st { options, stdoutFd, stdinFd };
+
+    if (!options.searchPath || options.program.find('/') != std::string::npos)
+        st.candidates.push_back(options.program);
+    else
+        for (auto & dir : tokenizeString<Strings>(getEnv("PATH").value_or("/bin:/usr/bin"), ":"))
+            st.candidates.push_back(dir + "/" + options.program);
 
+    Strings args(options.args);
+    args.push_front(options.program);
+    st.argv = stringsToCharPtrs(args);
+
+    if (options.searchPath) {
+        st.shArgv = { (char *) "/bin/sh", nullptr };
+        st.shArgv.insert(st.shArgv.end(), st.argv.begin() + 1, st.argv.end());
+    }
+
+    Strings env;
+    if (options.environment) {
+        for (auto & [name, value] : *options.environment)
+            env.push_back(name + "=" + value);
+        st.envp = stringsToCharPtrs(env);
+    } else {
+        for (size_t i = 0; environ[i]; ++i)
+            st.envp.push_back(environ[i]);
+        st.envp.push_back(nullptr);
+    }
+
+    std::vector<char> stack(256 * 1024);
+
+    /* Block all signals, so that no handler runs in the child before
+       it has reset them. */
+    sigset_t all, old;
+    sigfillset(&all);
+    if (pthread_sigmask(SIG_SETMASK, &all, &old))
+        throw SysError("blocking signals");
+
+    pid_t child = clone(spawnChild, stack.data() + stack.size(), CLONE_VM | CLONE_VFORK | SIGCHLD, &st);
+    auto cloneErrno = errno;
+
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    if (child == -1) {
+        errno = cloneErrno;
+        throw SysError("unable to fork");
+    }
+
+    Pid pid(child);
+
+    if (st.failedStep) {
+        int status = pid.wait();
+        throw ExecError(status, "cannot start program '%s': %s: %s",
+            options.program, st.failedStep, strerror(st.error));
+    }
+
+    return pid;
+}
+
+#else
+
+static Pid spawnProgram(const RunOptions & options, int stdoutFd, int stdinFd)
+{
     ProcessOptions processOptions;
     // vfork implies that the environment of the main process and the fork will
     // be shared (technically this is undefined, but in practice that's the
@@ -1084,16 +1268,15 @@ void runProgram2(const RunOptions & options)
     if (options.environment)
         processOptions.allowVfork = false;
 
-    /* Fork. */
-    Pid pid = startProcess([&]() {
+    return startProcess([&]() {
         if (options.environment)
             replaceEnv(*options.environment);
-        if (options.standardOut && dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+        if (stdoutFd != -1 && dup2(stdoutFd, STDOUT_FILENO) == -1)
             throw SysError("dupping stdout");
         if (options.mergeStderrToStdout)
             if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1)
                 throw SysError("cannot dup stdout into stderr");
-        if (source && dup2(in.readSide.get(), STDIN_FILENO) == -1)
+        if (stdinFd != -1 && dup2(stdinFd, STDIN_FILENO) == -1)
             throw SysError("dupping stdin");
 
         if (options.chdir && chdir((*options.chdir).c_str()) == -1)
@@ -1120,6 +1303,31 @@ void runProgram2(const RunOptions & options)
 
         throw SysError("executing '%1%'", options.program);
     }, processOptions);
+}
+
+#endif
+
+
+void runProgram2(const RunOptions & options)
+{
+    checkInterrupt();
+
+    assert(!(options.standardIn && options.input));
+
+    std::unique_ptr<Source> source_;
+    Source * source = options.standardIn;
+
+    if (options.input) {
+        source_ = std::make_unique<StringSource>(*options.input);
+        source = source_.get();
+    }
+
+    /* Create a pipe. */
+    Pipe out, in;
+    if (options.standardOut) out.create();
+    if (source) in.create();
+
+    Pid pid = spawnProgram(options, out.writeSide.get(), source ? in.readSide.get() : -1);
 
     out.writeSide = -1;
 
@@ -1583,8 +1791,6 @@ void triggerInterrupt()
     }
 }
 
-static sigset_t savedSignalMask;
-
 void startSignalHandlerThread()
 {
     updateWindowSize();
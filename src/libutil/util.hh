@@ -123,6 +123,11 @@ void deletePath(const Path & path);
 
 void deletePath(const Path & path, uint64_t & bytesFreed);
 
+/* Like deletePath(), but also call 'onEntry' with the status of
+   every file and directory just before it is deleted. */
+void deletePath(const Path & path, uint64_t & bytesFreed,
+    const std::function<void(const struct stat &)> & onEntry);
+
 std::string getUserName();
 
 /* Return $HOME or the user's home directory from /etc/passwd. */
@@ -415,7 +420,8 @@ std::optional<N> string2Int(const std::string & s)
 template<class N>
 N string2IntWithUnitPrefix(std::string s)
 {
-    N multiplier = 1;
+    auto orig = s;
+    uint64_t multiplier = 1;
     if (!s.empty()) {
         char u = std::toupper(*s.rbegin());
         if (std::isalpha(u)) {
@@ -427,8 +433,12 @@ N string2IntWithUnitPrefix(std::string s)
             s.resize(s.size() - 1);
         }
     }
-    if (auto n = string2Int<N>(s))
-        return *n * multiplier;
+    if (auto n = string2Int<N>(s)) {
+        N res;
+        if (__builtin_mul_overflow(*n, multiplier, &res))
+            throw UsageError("'%s' is out of range", orig);
+        return res;
+    }
     throw UsageError("'%s' is not an integer", s);
 }
 
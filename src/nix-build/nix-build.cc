@@ -317,6 +317,8 @@ static void main_nix_build(int argc, char * * argv)
             state->forceValue(v);
             getDerivations(*state, v, "", *autoArgs, drvs, false);
         }
+
+        prefetchDrvPaths(*state, drvs);
     }
 
     state->printStats();
@@ -23,7 +23,25 @@ void removeOldGenerations(std::string dir)
 
     bool canWrite = access(dir.c_str(), W_OK) == 0;
 
-    for (auto & i : readDirectory(dir)) {
+    auto entries = readDirectory(dir);
+
+    /* Group the generation links (`<profile>-<number>-link') by
+       profile, so that finding the generations of each profile
+       doesn't require reading the directory again. */
+    std::map<std::string, DirEntries> generationLinks;
+    for (auto & i : entries) {
+        if (!hasSuffix(i.name, "-link")) continue;
+        auto s = std::string(i.name, 0, i.name.size() - 5);
+        auto dash = s.rfind('-');
+        if (dash == std::string::npos || !string2Int<GenerationNumber>(s.substr(dash + 1))) continue;
+        generationLinks[s.substr(0, dash)].push_back(i);
+    }
+
+    std::optional<time_t> olderThan;
+    if (deleteOlderThan != "")
+        olderThan = parseOlderThanTimeSpec(deleteOlderThan);
+
+    for (auto & i : entries) {
         checkInterrupt();
 
         auto path = dir + "/" + i.name;
@@ -37,9 +55,20 @@ void removeOldGenerations(std::string dir)
                 if (e.errNo == ENOENT) continue;
             }
             if (link.find("link") != string::npos) {
+                /* Skip profiles that have nothing to delete without
+                   locking them. Since deleting generations is
+                   typically done regularly, this is most of them. */
+                auto [gens, curGen] = findGenerations(path, generationLinks[i.name]);
+                size_t candidates = 0;
+                for (auto & gen : gens)
+                    if (!olderThan || gen.creationTime < *olderThan) candidates++;
+                /* With `--delete-older-than', the newest generation
+                   older than the cutoff is kept. */
+                if (gens.size() < 2 || candidates < (olderThan ? 2 : 1)) continue;
+
                 printInfo(format("removing old generations of profile %1%") % path);
-                if (deleteOlderThan != "")
-                    deleteGenerationsOlderThan(path, deleteOlderThan, dryRun);
+                if (olderThan)
+                    deleteGenerationsOlderThan(path, *olderThan, dryRun);
                 else
                     deleteOldGenerations(path, dryRun);
             }
@@ -67,6 +96,7 @@ static int main_nix_collect_garbage(int argc, char * * argv)
                 deleteOlderThan = getArg(*arg, arg, end);
             }
             else if (*arg == "--dry-run") dryRun = true;
+            else if (*arg == "--incremental") options.incremental = true;
             else if (*arg == "--max-freed")
                 options.maxFreed = std::max(getIntArg<int64_t>(*arg, arg, end, true), (int64_t) 0);
             else
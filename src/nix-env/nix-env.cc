@@ -15,6 +15,7 @@
 #include "value-to-json.hh"
 #include "xml-writer.hh"
 #include "legacy.hh"
+#include "query-cache.hh"
 
 #include <cerrno>
 #include <ctime>
@@ -115,6 +116,8 @@ static void getAllExprs(EvalState & state,
         if (stat(path2.c_str(), &st) == -1)
             continue; // ignore dangling symlinks in ~/.nix-defexpr
 
+        if (state.trackedInputs) state.trackedInputs->paths.insert(path2);
+
         if (isNixExpr(path2, st) && (!S_ISREG(st.st_mode) || hasSuffix(path2, ".nix"))) {
             /* Strip off the `.nix' filename suffix (if applicable),
                otherwise the attribute cannot be selected with the
@@ -146,6 +149,8 @@ static void getAllExprs(EvalState & state,
 
 static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
 {
+    if (state.trackedInputs) state.trackedInputs->paths.insert(path);
+
     struct stat st;
     if (stat(path.c_str(), &st) == -1)
         throw SysError("getting information about '%1%'", path);
@@ -884,6 +889,22 @@ static void queryJSON(Globals & globals, vector<DrvInfo> & elems)
 }
 
 
+/* Return the key of the `nix-env -qa' query cache entry for the
+   derivations at `attrPath' in the active Nix expression. */
+static std::string queryCacheKey(Globals & globals, const string & attrPath)
+{
+    auto & state(*globals.state);
+    auto key = fmt("%s\n%s\n%s\n%s\n%s\n%s\n%d\n%d\n",
+        nixVersion, state.store->storeDir,
+        absPath(globals.instSource.nixExprPath), attrPath,
+        globals.instSource.systemFilter, settings.thisSystem.get(),
+        evalSettings.pureEval.get(), evalSettings.restrictEval.get());
+    for (auto & i : state.getSearchPath())
+        key += i.first + "=" + i.second + "\n";
+    return key;
+}
+
+
 static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
 {
     Strings remaining;
@@ -935,10 +956,32 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     if (source == sInstalled || compareVersions || printStatus)
         installedElems = queryInstalled(*globals.state, globals.profile);
 
-    if (source == sAvailable || compareVersions)
-        loadDerivations(*globals.state, globals.instSource.nixExprPath,
-            globals.instSource.systemFilter, *globals.instSource.autoArgs,
-            attrPath, availElems);
+    if (source == sAvailable || compareVersions) {
+        /* Use the query cache, unless the result depends on
+           arguments that aren't part of the key. Only complete
+           queries create cache entries, since that evaluates the
+           needed fields of every derivation. */
+        std::optional<QueryCache> queryCache;
+        if (evalSettings.useEvalCache && globals.instSource.autoArgs->empty()) {
+            QueryCache::Fields needed;
+            if (source == sAvailable) {
+                needed.meta = jsonOutput || printMeta || printDescription;
+                needed.outputs = printOutPath || printStatus || globals.prebuiltOnly;
+                needed.drvPath = printDrvPath;
+            }
+            queryCache.emplace(*globals.state, queryCacheKey(globals, attrPath), needed);
+        }
+
+        if (auto cached = queryCache ? queryCache->lookup() : std::nullopt)
+            availElems = std::move(*cached);
+        else {
+            loadDerivations(*globals.state, globals.instSource.nixExprPath,
+                globals.instSource.systemFilter, *globals.instSource.autoArgs,
+                attrPath, availElems);
+            if (queryCache && opArgs.empty())
+                queryCache->store(availElems);
+        }
+    }
 
     DrvInfos elems_ = filterBySelector(*globals.state,
         source == sInstalled ? installedElems : availElems,
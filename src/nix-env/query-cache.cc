@@ -0,0 +1,349 @@
+#include "query-cache.hh"
+#include "json.hh"
+#include "json-to-value.hh"
+#include "value-to-json.hh"
+#include "eval-inline.hh"
+#include "store-api.hh"
+
+#include <sstream>
+
+namespace nix {
+
+/* Return a string that changes if the contents of `path' have
+   changed. Paths that resolve into the Nix store are immutable, so
+   they're identified by their resolved path. Other files are
+   identified by the hash of their contents, and directories by the
+   NAR hash of the whole tree, since the evaluation may have copied
+   it to the store or read files below it; metadata such as the mtime
+   can't be trusted to change on every edit. `resolvedDirs' caches the resolution of directories,
+   since evaluations typically read many files in the same
+   directories. */
+static std::string fingerprintPath(EvalState & state, const Path & path, std::map<Path, Path> & resolvedDirs)
+{
+    try {
+        auto dir = dirOf(path);
+        auto i = resolvedDirs.find(dir);
+        if (i == resolvedDirs.end())
+            i = resolvedDirs.emplace(dir, canonPath(dir, true)).first;
+
+        auto resolved = (i->second == "/" ? "" : i->second) + "/" + std::string(baseNameOf(path));
+        if (state.store->isInStore(resolved))
+            return "store:" + resolved;
+
+        struct stat st;
+        if (lstat(resolved.c_str(), &st) == -1)
+            return "missing";
+        if (S_ISLNK(st.st_mode)) {
+            resolved = canonPath(resolved, true);
+            if (state.store->isInStore(resolved))
+                return "store:" + resolved;
+            if (stat(resolved.c_str(), &st) == -1)
+                return "missing";
+        }
+
+        if (S_ISREG(st.st_mode))
+            return "file:" + hashFile(htSHA256, resolved).to_string(Base32, false);
+
+        if (S_ISDIR(st.st_mode))
+            return "dir:" + hashPath(htSHA256, resolved).first.to_string(Base32, false);
+
+        return fmt("%o", st.st_mode & S_IFMT);
+    } catch (Error &) {
+        return "missing";
+    }
+}
+
+
+static std::string getEnvForEval(const std::string & name)
+{
+    return evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name).value_or("");
+}
+
+
+static Value & getAttr(EvalState & state, Value & v, const std::string & name)
+{
+    state.forceAttrs(v);
+    auto i = v.attrs->find(state.symbols.create(name));
+    if (i == v.attrs->end())
+        throw Error("query cache entry lacks attribute '%s'", name);
+    state.forceValue(*i->value);
+    return *i->value;
+}
+
+
+QueryCache::QueryCache(EvalState & state, const std::string & key, Fields needed)
+    : state(state)
+    , path(getCacheDir() + "/nix/nix-env-query-v1/" + hashString(htSHA256, key).to_string(Base32, false))
+    , fields(needed)
+{
+    if (pathExists(path)) {
+        try {
+            auto & vTop(*state.allocValue());
+            parseJSON(state, readFile(path), vTop, true);
+
+            /* Keep caching the fields that were cached before, so
+               that different queries don't keep replacing each
+               other's entries. */
+            Fields cachedFields;
+            auto & vFields(getAttr(state, vTop, "fields"));
+            state.forceList(vFields);
+            for (unsigned int n = 0; n < vFields.listSize(); ++n) {
+                auto field = state.forceStringNoCtx(*vFields.listElems()[n]);
+                if (field == "meta") cachedFields.meta = true;
+                else if (field == "outputs") cachedFields.outputs = true;
+                else if (field == "drvPath") cachedFields.drvPath = true;
+            }
+
+            bool complete =
+                (cachedFields.meta || !needed.meta)
+                && (cachedFields.outputs || !needed.outputs)
+                && (cachedFields.drvPath || !needed.drvPath);
+
+            fields.meta |= cachedFields.meta;
+            fields.outputs |= cachedFields.outputs;
+            fields.drvPath |= cachedFields.drvPath;
+
+            auto & vInputs(getAttr(state, vTop, "inputs"));
+
+            bool upToDate = complete;
+
+            std::map<Path, Path> resolvedDirs;
+            auto & vFiles(getAttr(state, vInputs, "files"));
+            for (auto & i : *vFiles.attrs) {
+                if (!upToDate) break;
+                if (fingerprintPath(state, i.name, resolvedDirs) != state.forceStringNoCtx(*i.value)) {
+                    debug("query cache '%s' is stale because '%s' has changed", path, i.name);
+                    upToDate = false;
+                }
+            }
+
+            auto & vEnv(getAttr(state, vInputs, "env"));
+            for (auto & i : *vEnv.attrs) {
+                if (!upToDate) break;
+                if (getEnvForEval(i.name) != state.forceStringNoCtx(*i.value)) {
+                    debug("query cache '%s' is stale because environment variable '%s' has changed", path, i.name);
+                    upToDate = false;
+                }
+            }
+
+            if (upToDate) {
+                debug("using query cache '%s'", path);
+                DrvInfos elems;
+                Value * vFail = nullptr;
+                auto & vDrvs(getAttr(state, vTop, "drvs"));
+                state.forceList(vDrvs);
+                for (unsigned int n = 0; n < vDrvs.listSize(); ++n) {
+                    auto & vDrv(*vDrvs.listElems()[n]);
+                    auto attrPath = state.forceStringNoCtx(getAttr(state, vDrv, "attrPath"));
+                    auto & vAttrs(getAttr(state, vDrv, "attrs"));
+                    state.forceAttrs(vAttrs);
+                    auto attrs = vAttrs.attrs;
+
+                    /* Attributes that gave an assertion failure are
+                       replaced by values that fail in the same way,
+                       so that `nix-env' still skips the derivation
+                       when it needs them. */
+                    auto & vFailed(getAttr(state, vDrv, "failed"));
+                    state.forceList(vFailed);
+                    if (vFailed.listSize()) {
+                        if (!vFail) {
+                            vFail = state.allocValue();
+                            state.eval(state.parseExprFromString("x: assert false; x", "/"), *vFail);
+                        }
+                        attrs = state.allocBindings(attrs->size() + 2 * vFailed.listSize());
+                        for (auto & i : *vAttrs.attrs)
+                            attrs->push_back(i);
+                        for (unsigned int m = 0; m < vFailed.listSize(); ++m) {
+                            auto name = state.forceStringNoCtx(*vFailed.listElems()[m]);
+                            auto fail = [&](const Symbol & sym) {
+                                auto v = state.allocValue();
+                                mkApp(*v, *vFail, *vFail);
+                                attrs->push_back(Attr(sym, v));
+                            };
+                            if (name == "outputs") {
+                                fail(state.sOutPath);
+                                fail(state.sOutputs);
+                            } else
+                                fail(state.symbols.create(name));
+                        }
+                        attrs->sort();
+                    }
+
+                    elems.push_back(DrvInfo(state, attrPath, attrs));
+                }
+                cached = std::move(elems);
+            }
+        } catch (Error & e) {
+            debug("ignoring query cache '%s': %s", path, e.what());
+        }
+    }
+
+    if (!cached)
+        state.trackedInputs = std::make_unique<EvalState::TrackedInputs>();
+}
+
+
+QueryCache::~QueryCache()
+{
+    state.trackedInputs.reset();
+}
+
+
+std::optional<DrvInfos> QueryCache::lookup()
+{
+    return cached;
+}
+
+
+void QueryCache::store(DrvInfos & elems)
+{
+    if (cached || !state.trackedInputs) return;
+
+    if (state.trackedInputs->uncacheable) {
+        debug("not caching the query result because the evaluation used %s", *state.trackedInputs->uncacheable);
+        return;
+    }
+
+    std::ostringstream str;
+
+    try {
+        JSONObject top(str);
+
+        {
+            auto list = top.list("fields");
+            if (fields.meta) list.elem("meta");
+            if (fields.outputs) list.elem("outputs");
+            if (fields.drvPath) list.elem("drvPath");
+        }
+
+        /* Store the attributes that DrvInfo looks at, so that the
+           cached derivations can be queried like normal ones. The
+           fields are evaluated before anything is written, since
+           `nix-env' skips derivations that give an assertion failure
+           rather than failing, and the cache must do the same. */
+        {
+            auto list = top.list("drvs");
+            for (auto & i : elems) {
+                StringSet failed;
+
+                auto get = [&](const std::string & field, auto fun) {
+                    try {
+                        fun();
+                    } catch (AssertionError &) {
+                        failed.insert(field);
+                    }
+                };
+
+                std::string system;
+                get("system", [&]() { system = i.querySystem(); });
+
+                std::string drvPath;
+                if (fields.drvPath)
+                    get("drvPath", [&]() { drvPath = i.queryDrvPath(); });
+
+                DrvInfo::Outputs outputs;
+                std::string outPath;
+                if (fields.outputs)
+                    get("outputs", [&]() {
+                        outputs = i.queryOutputs();
+                        outPath = i.queryOutPath();
+                    });
+
+                StringSet metaNames;
+                if (fields.meta)
+                    get("meta", [&]() {
+                        metaNames = i.queryMetaNames();
+                        for (auto & name : metaNames) {
+                            std::ostringstream dummy;
+                            PathSet context;
+                            if (auto v = i.queryMeta(name))
+                                printValueAsJSON(state, true, *v, dummy, context);
+                        }
+                    });
+
+                auto obj = list.object();
+                obj.attr("attrPath", i.attrPath);
+
+                {
+                    auto list = obj.list("failed");
+                    for (auto & field : failed)
+                        list.elem(field);
+                }
+
+                auto attrs = obj.object("attrs");
+                attrs.attr("name", i.queryName());
+
+                if (!failed.count("system"))
+                    attrs.attr("system", system);
+
+                if (drvPath != "")
+                    attrs.attr("drvPath", drvPath);
+
+                if (fields.outputs && !failed.count("outputs")) {
+                    attrs.attr("outPath", outPath);
+                    {
+                        auto names = attrs.list("outputs");
+                        for (auto & j : outputs)
+                            names.elem(j.first);
+                    }
+                    for (auto & j : outputs)
+                        attrs.object(j.first).attr("outPath", j.second);
+                }
+
+                if (fields.meta && !failed.count("meta")) {
+                    /* Invalid meta attributes are stored as null,
+                       which is invalid as well. */
+                    auto meta = attrs.object("meta");
+                    for (auto & name : metaNames) {
+                        auto placeholder = meta.placeholder(name);
+                        Value * v = i.queryMeta(name);
+                        if (!v)
+                            placeholder.write(nullptr);
+                        else {
+                            PathSet context;
+                            printValueAsJSON(state, true, *v, placeholder, context);
+                        }
+                    }
+                }
+            }
+        }
+
+        /* Evaluating the fields above may have accessed more inputs,
+           so record them last. */
+        auto inputs = std::move(state.trackedInputs);
+
+        if (inputs->uncacheable) {
+            debug("not caching the query result because the evaluation used %s", *inputs->uncacheable);
+            return;
+        }
+
+        auto obj = top.object("inputs");
+        {
+            std::map<Path, Path> resolvedDirs;
+            auto files = obj.object("files");
+            for (auto & p : inputs->paths)
+                files.attr(p, fingerprintPath(state, p, resolvedDirs));
+        }
+        {
+            auto env = obj.object("env");
+            for (auto & [name, value] : inputs->envVars)
+                env.attr(name, value);
+        }
+    } catch (Error & e) {
+        state.trackedInputs.reset();
+        debug("not caching the query result: %s", e.what());
+        return;
+    }
+
+    try {
+        createDirs(dirOf(path));
+        auto tmp = path + ".tmp-" + std::to_string(getpid());
+        writeFile(tmp, str.str());
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    } catch (SysError & e) {
+        warn("cannot write query cache: %s", e.msg());
+    }
+}
+
+}
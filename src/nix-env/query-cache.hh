@@ -0,0 +1,49 @@
+#pragma once
+
+#include "get-drvs.hh"
+
+namespace nix {
+
+/* A cache of the derivations found by `nix-env -qa', so that
+   repeated queries don't have to evaluate anything. A cache entry is
+   valid as long as the files and environment variables read while
+   evaluating it are unchanged. */
+class QueryCache
+{
+public:
+
+    /* The derivation attributes that must be available from the
+       cache, besides the name and system. */
+    struct Fields
+    {
+        bool meta = false;
+        bool outputs = false;
+        bool drvPath = false;
+    };
+
+    /* Open the cache entry identified by `key'. If it's not usable,
+       start recording the inputs of evaluation, so that store() can
+       create it. */
+    QueryCache(EvalState & state, const std::string & key, Fields needed);
+
+    ~QueryCache();
+
+    /* Return the cached derivations, if the entry is up to date and
+       has all the needed fields. */
+    std::optional<DrvInfos> lookup();
+
+    /* Write a cache entry for `elems', if the evaluation was
+       cacheable. This evaluates the needed fields of every
+       derivation. If that fails, the entry is not written, and the
+       error is left to be reported when `elems' are used. */
+    void store(DrvInfos & elems);
+
+private:
+
+    EvalState & state;
+    Path path;
+    Fields fields;
+    std::optional<DrvInfos> cached;
+};
+
+}
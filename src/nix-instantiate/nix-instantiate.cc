@@ -60,6 +60,7 @@ void processExpr(EvalState & state, const Strings & attrPaths,
         } else {
             DrvInfos drvs;
             getDerivations(state, v, "", autoArgs, drvs, false);
+            prefetchDrvPaths(state, drvs);
             for (auto & i : drvs) {
                 Path drvPath = i.queryDrvPath();
 
@@ -81,6 +82,10 @@ void processExpr(EvalState & state, const Strings & attrPaths,
             }
         }
     }
+
+    /* The results may refer to sources that are still being copied
+       to the store. */
+    state.waitForSourceCopies();
 }
 
 
@@ -9,6 +9,7 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "graphml.hh"
+#include "compression.hh"
 #include "legacy.hh"
 
 #include <iostream>
@@ -749,8 +750,10 @@ static void opRepairPath(Strings opFlags, Strings opArgs)
     if (!opFlags.empty())
         throw UsageError("no flags expected");
 
+    StorePathSet paths;
     for (auto & i : opArgs)
-        store->repairPath(store->followLinksToStorePath(i));
+        paths.insert(store->followLinksToStorePath(i));
+    store->repairPaths(paths);
 }
 
 /* Optimise the disk space usage of the Nix store by hard-linking
@@ -783,6 +786,19 @@ static void opServe(Strings opFlags, Strings opArgs)
     out.flush();
     unsigned int clientVersion = readInt(in);
 
+    /* Agree on the compression of NARs sent in either direction. */
+    std::string narCompression = "none";
+    std::optional<int> narCompressionLevel;
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 6) {
+        narCompression = readString(in);
+        if (auto level = string2Int<int>(readString(in)))
+            narCompressionLevel = *level;
+        if (!isStreamCompressionMethod(narCompression))
+            narCompression = "none";
+        out << narCompression;
+        out.flush();
+    }
+
     auto getBuildSettings = [&]() {
         // FIXME: changing options here doesn't work if we're
         // building through the daemon.
@@ -850,13 +866,30 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
-            case cmdDumpStorePath:
-                store->narFromPath(store->parseStorePath(readString(in)), out);
+            case cmdDumpStorePath: {
+                auto path = store->parseStorePath(readString(in));
+                if (narCompression == "none")
+                    store->narFromPath(path, out);
+                else {
+                    std::exception_ptr ex;
+                    FramedSink framed(out, ex);
+                    auto compressor = makeCompressionSink(narCompression, framed, false, narCompressionLevel);
+                    store->narFromPath(path, *compressor);
+                    compressor->finish();
+                }
                 break;
+            }
 
             case cmdImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
-                store->importPaths(in, NoCheckSigs); // FIXME: should we skip sig checking?
+                if (narCompression == "none")
+                    store->importPaths(in, NoCheckSigs); // FIXME: should we skip sig checking?
+                else {
+                    FramedSource framed(in);
+                    auto source = makeDecompressionSource(narCompression, framed);
+                    store->importPaths(*source, NoCheckSigs);
+                    source->drain();
+                }
                 out << 1; // indicate success
                 break;
             }
@@ -906,6 +939,13 @@ static void opServe(Strings opFlags, Strings opArgs)
                 if (GET_PROTOCOL_MINOR(clientVersion) >= 3)
                     out << status.timesBuilt << status.isNonDeterministic << status.startTime << status.stopTime;
 
+                if (GET_PROTOCOL_MINOR(clientVersion) >= 7) {
+                    auto metrics = status.getMetrics();
+                    out << metrics.size();
+                    for (auto & [name, value] : metrics)
+                        out << name << value;
+                }
+
                 break;
             }
 
@@ -937,12 +977,19 @@ static void opServe(Strings opFlags, Strings opArgs)
                 if (info.narSize == 0)
                     throw Error("narInfo is too old and missing the narSize field");
 
-                SizedSource sizedSource(in, info.narSize);
+                if (narCompression == "none") {
+                    SizedSource sizedSource(in, info.narSize);
 
-                store->addToStore(info, sizedSource, NoRepair, NoCheckSigs);
+                    store->addToStore(info, sizedSource, NoRepair, NoCheckSigs);
 
-                // consume all the data that has been sent before continuing.
-                sizedSource.drainAll();
+                    // consume all the data that has been sent before continuing.
+                    sizedSource.drainAll();
+                } else {
+                    FramedSource framed(in);
+                    auto source = makeDecompressionSource(narCompression, framed);
+                    store->addToStore(info, *source, NoRepair, NoCheckSigs);
+                    source->drain();
+                }
 
                 out << 1; // indicate success
 
@@ -24,8 +24,12 @@ App Installable::toApp(EvalState & state)
         checkProgram(program);
 
         std::vector<StorePathWithOutputs> context2;
-        for (auto & [path, name] : context)
-            context2.push_back({state.store->parseStorePath(path), {name}});
+        for (auto & [path, name] : context) {
+            auto storePath = state.store->parseStorePath(path);
+            if (name.empty())
+                state.copyLazyTree(storePath);
+            context2.push_back({std::move(storePath), {name}});
+        }
 
         return App {
             .context = std::move(context2),
@@ -4,11 +4,56 @@
 #include "shared.hh"
 #include "store-api.hh"
 #include "local-fs-store.hh"
+#include "finally.hh"
 
 #include <nlohmann/json.hpp>
 
 using namespace nix;
 
+/* A logger that records the measurements of builds (resBuildMetrics
+   results) and passes everything on to another logger. */
+struct BuildMetricsLogger : Logger
+{
+    Logger & next;
+
+    std::map<std::string, std::map<std::string, uint64_t>> metrics;
+
+    BuildMetricsLogger(Logger & next) : next(next) { }
+
+    void stop() override { next.stop(); }
+
+    bool isVerbose() override { return next.isVerbose(); }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override { next.log(lvl, fs); }
+
+    void logEI(const ErrorInfo & ei) override { next.logEI(ei); }
+
+    void warn(const std::string & msg) override { next.warn(msg); }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        next.startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override { next.stopActivity(act); }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        if (type == resBuildMetrics && !fields.empty() && fields[0].type == Field::tString) {
+            auto & m = metrics[fields[0].s];
+            for (size_t n = 1; n + 1 < fields.size(); n += 2)
+                if (fields[n].type == Field::tString && fields[n + 1].type == Field::tInt)
+                    m.insert_or_assign(fields[n].s, fields[n + 1].i);
+        }
+        next.result(act, type, fields);
+    }
+
+    void writeToStdout(std::string_view s) override { next.writeToStdout(s); }
+
+    std::optional<char> ask(std::string_view s) override { return next.ask(s); }
+};
+
 struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
 {
     Path outLink = "result";
@@ -52,8 +97,17 @@ struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
 
     void run(ref<Store> store) override
     {
+        /* With --json, record the measurements of the builds, so that
+           they can be included in the output. */
+        auto prevLogger = logger;
+        BuildMetricsLogger metricsLogger(*prevLogger);
+        if (json) logger = &metricsLogger;
+        Finally restoreLogger([&]() { logger = prevLogger; });
+
         auto buildables = build(store, dryRun ? Realise::Nothing : Realise::Outputs, installables, buildMode);
 
+        logger = prevLogger;
+
         if (dryRun) return;
 
         if (outLink != "")
@@ -80,7 +134,17 @@ struct CmdBuild : InstallablesCommand, MixDryRun, MixJSON, MixProfile
 
         updateProfile(buildables);
 
-        if (json) logger->cout("%s", buildablesToJSON(buildables, store).dump());
+        if (json) {
+            auto res = buildablesToJSON(buildables, store);
+            for (auto & entry : res) {
+                auto drvPath = entry.find("drvPath");
+                if (drvPath == entry.end()) continue;
+                auto i = metricsLogger.metrics.find(drvPath->get<std::string>());
+                if (i != metricsLogger.metrics.end())
+                    entry["metrics"] = i->second;
+            }
+            logger->cout("%s", res.dump());
+        }
     }
 };
 
@@ -10,10 +10,14 @@
 #include "finally.hh"
 #include "legacy.hh"
 #include "daemon.hh"
+#include "metrics.hh"
+#include "lock.hh"
 
 #include <algorithm>
 #include <climits>
 #include <cstring>
+#include <queue>
+#include <thread>
 
 #include <unistd.h>
 #include <signal.h>
@@ -26,6 +30,7 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #if __APPLE__ || __FreeBSD__
 #include <sys/ucred.h>
@@ -151,13 +156,293 @@ static ref<Store> openUncachedStore()
 }
 
 
+/* The identity of a client, determined when accepting its
+   connection. */
+struct ClientInfo
+{
+    TrustedFlag trusted = NotTrusted;
+    std::string user;
+    PeerInfo peer;
+};
+
+
+/* Determine who is connected to `remote', and throw an error if they
+   are not allowed to connect. */
+static ClientInfo authenticateClient(int remote)
+{
+    ClientInfo client;
+    auto & peer(client.peer);
+    peer = getPeerInfo(remote);
+
+    struct passwd * pw = peer.uidKnown ? getpwuid(peer.uid) : 0;
+    client.user = pw ? pw->pw_name : std::to_string(peer.uid);
+    auto & user(client.user);
+
+    struct group * gr = peer.gidKnown ? getgrgid(peer.gid) : 0;
+    string group = gr ? gr->gr_name : std::to_string(peer.gid);
+
+    Strings trustedUsers = settings.trustedUsers;
+    Strings allowedUsers = settings.allowedUsers;
+
+    if (matchUser(user, group, trustedUsers))
+        client.trusted = Trusted;
+
+    if ((!client.trusted && !matchUser(user, group, allowedUsers)) || group == settings.buildUsersGroup)
+        throw Error("user '%1%' is not allowed to connect to the Nix daemon", user);
+
+    printInfo(format((string) "accepted connection from pid %1%, user %2%" + (client.trusted ? " (trusted)" : ""))
+        % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
+        % (peer.uidKnown ? user : "<unknown>"));
+
+    return client;
+}
+
+
+/* The main loop of a pre-forked daemon worker (the
+   `daemon-prefork-workers` setting): accept connections on `fdSocket'
+   one at a time with a store that stays open, until the connection
+   limit is reached or the daemon that started us has exited. */
+static void servePreforked(int fdSocket, pid_t daemonPid)
+{
+    auto store = openUncachedStore();
+
+    /* Connections can change settings, so restore them afterwards
+       for the next connection. */
+    std::map<std::string, AbstractConfig::SettingInfo> initialSettings;
+    globalConfig.getSettings(initialSettings);
+    auto initialVerbosity = verbosity;
+
+    auto restoreSettings = [&]() {
+        std::map<std::string, AbstractConfig::SettingInfo> current;
+        globalConfig.getSettings(current);
+        for (auto & [name, info] : initialSettings) {
+            auto i = current.find(name);
+            if (i != current.end() && i->second.value != info.value)
+                globalConfig.set(name, info.value);
+        }
+        verbosity = initialVerbosity;
+    };
+
+    /* All workers wait for connections on the same socket, so make
+       it non-blocking to let the ones that lose the race for a
+       connection go back to waiting. */
+    int flags = fcntl(fdSocket, F_GETFL);
+    if (flags == -1 || fcntl(fdSocket, F_SETFL, flags | O_NONBLOCK) == -1)
+        throw SysError("making the daemon socket non-blocking");
+
+    auto maxConnections = settings.daemonPreforkConnections.get();
+
+    for (unsigned int served = 0; !maxConnections || served < maxConnections; ) {
+        /* Wake up every second to notice that the daemon has exited,
+           e.g. because it is being restarted. */
+        struct pollfd fds[1] = {{ .fd = fdSocket, .events = POLLIN }};
+        auto res = poll(fds, 1, 1000);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("waiting for connections");
+        }
+        if (getppid() != daemonPid) break;
+        if (res == 0) continue;
+
+        /* A previous client that hung up could have interrupted us;
+           that must not affect the next one. We notice that the
+           daemon exits through getppid() rather than through
+           signals. */
+        _isInterrupted = false;
+
+        AutoCloseFD remote = accept(fdSocket, nullptr, nullptr);
+        if (!remote) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            throw SysError("accepting connection");
+        }
+
+        served++;
+
+        try {
+            closeOnExec(remote.get());
+
+            /* On some systems, the connection inherits O_NONBLOCK
+               from the socket. */
+            int flags = fcntl(remote.get(), F_GETFL);
+            if (flags == -1 || fcntl(remote.get(), F_SETFL, flags & ~O_NONBLOCK) == -1)
+                throw SysError("making the connection blocking");
+
+            auto client = authenticateClient(remote.get());
+
+            auto prevLogger = logger;
+            Finally restore([&]() {
+                /* processConnection() installs a logger for the
+                   client. */
+                if (logger != prevLogger) {
+                    delete logger;
+                    logger = prevLogger;
+                }
+                restoreSettings();
+            });
+
+            FdSource from(remote.get());
+            FdSink to(remote.get());
+            processConnection(store, from, to, client.trusted, NotRecursive, [&](Store & store) {
+                store.createUser(client.user, client.peer.uid);
+                setBuildSlotUser(client.user);
+            });
+        } catch (Interrupted & e) {
+            /* The client hung up, which ends the connection like it
+               would end a forked connection process. */
+            debug("client hung up");
+        } catch (Error & error) {
+            ErrorInfo ei = error.info();
+            ei.msg = hintfmt("error processing connection: %1%", ei.msg.str());
+            logError(ei);
+        }
+    }
+}
+
+
+/* Serves connections from threads that share a single store (the
+   `threaded-daemon` setting). A thread is started whenever no idle
+   thread is available, and is kept around for later connections. */
+struct ConnectionThreads : std::enable_shared_from_this<ConnectionThreads>
+{
+    struct Connection
+    {
+        AutoCloseFD fd;
+        TrustedFlag trusted;
+        std::string user;
+        PeerInfo peer;
+    };
+
+    /* Unlike in the forking daemon, the path info cache is shared by
+       all connections, so it's worth keeping. */
+    ref<Store> store = openStore(settings.storeUri);
+
+    ConnectionThreads()
+    {
+        /* The cache lives as long as the daemon, so it must notice
+           paths registered or deleted by processes that use the
+           store directly. */
+        if (auto localStore = store.dynamic_pointer_cast<LocalStore>())
+            localStore->checkExternalChanges = true;
+    }
+
+    struct State
+    {
+        std::queue<Connection> pending;
+        size_t idle = 0;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    void enqueue(Connection && conn)
+    {
+        auto state(state_.lock());
+        state->pending.push(std::move(conn));
+        if (state->pending.size() > state->idle)
+            std::thread([self(shared_from_this())]() { self->serve(); }).detach();
+        else
+            wakeup.notify_one();
+    }
+
+    void serve()
+    {
+        while (true) {
+            Connection conn;
+            {
+                auto state(state_.lock());
+                state->idle++;
+                while (state->pending.empty())
+                    state.wait(wakeup);
+                state->idle--;
+                conn = std::move(state->pending.front());
+                state->pending.pop();
+            }
+
+            try {
+                FdSource from(conn.fd.get());
+                FdSink to(conn.fd.get());
+                processConnection(store, from, to, conn.trusted, NotRecursive, [&](Store & store) {
+                    store.createUser(conn.user, conn.peer.uid);
+                    setBuildSlotUser(conn.user);
+                }, Threaded);
+            } catch (Error & error) {
+                ErrorInfo ei = error.info();
+                ei.msg = hintfmt("error processing connection: %1%", ei.msg.str());
+                logError(ei);
+            } catch (...) {
+                ignoreException();
+            }
+        }
+    }
+};
+
+
+/* Answer every connection on `fd' with an HTTP response containing
+   the daemon's metrics. */
+static void serveMetrics(int fd)
+{
+    while (true) {
+        AutoCloseFD remote = accept(fd, nullptr, nullptr);
+        if (!remote) {
+            if (errno == EINTR) continue;
+            logError(SysError("accepting metrics connection").info());
+            return;
+        }
+
+        try {
+            closeOnExec(remote.get());
+
+            /* Read (and ignore) the request, but don't let a client
+               that doesn't send one block the others. */
+            struct timeval timeout { .tv_sec = 1, .tv_usec = 0 };
+            setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            char buf[4096];
+            [[gnu::unused]] auto n = read(remote.get(), buf, sizeof(buf));
+
+            auto body = metrics::renderMetrics();
+            writeFull(remote.get(),
+                fmt("HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %d\r\n"
+                    "\r\n", body.size())
+                + body, false);
+        } catch (...) {
+            ignoreException();
+        }
+    }
+}
+
 static void daemonLoop()
 {
     if (chdir("/") == -1)
         throw SysError("cannot change current directory");
 
-    //  Get rid of children automatically; don't let them become zombies.
-    setSigChldAction(true);
+    AutoCloseFD fdMetrics;
+
+    if (settings.metricsSocket != "") {
+        /* Let the processes serving connections update the
+           metrics. */
+        metrics::shareMetrics();
+        createDirs(dirOf(settings.metricsSocket));
+        fdMetrics = createUnixDomainSocket(settings.metricsSocket, 0666);
+        std::thread(serveMetrics, fdMetrics.get()).detach();
+    }
+
+    std::shared_ptr<ConnectionThreads> threads;
+    bool prefork = false;
+
+    if (settings.threadedDaemon) {
+        /* Send the messages of each connection to its own client. */
+        logger = makeThreadLocalLogger(*logger);
+        threads = std::make_shared<ConnectionThreads>();
+    } else if (settings.daemonPreforkWorkers > 0) {
+        /* The workers are reaped (and replaced) below. */
+        prefork = true;
+    } else {
+        //  Get rid of children automatically; don't let them become zombies.
+        setSigChldAction(true);
+    }
 
     AutoCloseFD fdSocket;
 
@@ -176,6 +461,59 @@ static void daemonLoop()
         fdSocket = createUnixDomainSocket(settings.nixDaemonSocketFile, 0666);
     }
 
+    /* In prefork mode, keep the configured number of workers
+       accepting connections, and replace them when they exit. */
+    if (prefork) {
+        auto daemonPid = getpid();
+
+        auto startWorker = [&]() {
+            ProcessOptions options;
+            options.errorPrefix = "unexpected Nix daemon error: ";
+            options.dieWithParent = false;
+            options.runExitHandlers = true;
+            options.allowVfork = false;
+            return startProcess([&]() {
+                fdMetrics = -1;
+
+                //  Background the worker.
+                if (setsid() == -1)
+                    throw SysError("creating a new session");
+
+                servePreforked(fdSocket.get(), daemonPid);
+
+                exit(0);
+            }, options);
+        };
+
+        std::set<pid_t> workers;
+
+        try {
+            while (true) {
+                while (workers.size() < settings.daemonPreforkWorkers)
+                    workers.insert(startWorker());
+
+                int status;
+                auto pid = waitpid(-1, &status, 0);
+                checkInterrupt();
+                if (pid == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("waiting for daemon workers");
+                }
+                if (!workers.erase(pid)) continue;
+
+                /* Don't respawn workers in a tight loop if they fail
+                   right away, e.g. because the store can't be
+                   opened. */
+                if (!statusOk(status)) {
+                    printError("daemon worker %d %s", pid, statusToString(status));
+                    sleep(1);
+                }
+            }
+        } catch (Interrupted & e) {
+            return;
+        }
+    }
+
     //  Loop accepting connections.
     while (1) {
 
@@ -194,27 +532,15 @@ static void daemonLoop()
 
             closeOnExec(remote.get());
 
-            TrustedFlag trusted = NotTrusted;
-            PeerInfo peer = getPeerInfo(remote.get());
+            auto client = authenticateClient(remote.get());
+            auto trusted = client.trusted;
+            auto & user(client.user);
+            auto & peer(client.peer);
 
-            struct passwd * pw = peer.uidKnown ? getpwuid(peer.uid) : 0;
-            string user = pw ? pw->pw_name : std::to_string(peer.uid);
-
-            struct group * gr = peer.gidKnown ? getgrgid(peer.gid) : 0;
-            string group = gr ? gr->gr_name : std::to_string(peer.gid);
-
-            Strings trustedUsers = settings.trustedUsers;
-            Strings allowedUsers = settings.allowedUsers;
-
-            if (matchUser(user, group, trustedUsers))
-                trusted = Trusted;
-
-            if ((!trusted && !matchUser(user, group, allowedUsers)) || group == settings.buildUsersGroup)
-                throw Error("user '%1%' is not allowed to connect to the Nix daemon", user);
-
-            printInfo(format((string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""))
-                % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
-                % (peer.uidKnown ? user : "<unknown>"));
+            if (threads) {
+                threads->enqueue({std::move(remote), trusted, user, peer});
+                continue;
+            }
 
             //  Fork a child to handle the connection.
             ProcessOptions options;
@@ -224,6 +550,7 @@ static void daemonLoop()
             options.allowVfork = false;
             startProcess([&]() {
                 fdSocket = -1;
+                fdMetrics = -1;
 
                 //  Background the daemon.
                 if (setsid() == -1)
@@ -249,6 +576,7 @@ static void daemonLoop()
                         throw Error("if you run 'nix-daemon' as root, then you MUST set 'build-users-group'!");
 #endif
                     store.createUser(user, peer.uid);
+                    setBuildSlotUser(user);
                 });
 
                 exit(0);
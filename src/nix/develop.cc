@@ -3,6 +3,7 @@
 #include "common-args.hh"
 #include "shared.hh"
 #include "store-api.hh"
+#include "local-fs-store.hh"
 #include "derivations.hh"
 #include "affinity.hh"
 #include "progress-bar.hh"
@@ -18,6 +19,9 @@ struct DevelopSettings : Config
 
     Setting<std::string> bashPromptSuffix{this, "", "bash-prompt-suffix",
         "Suffix appended to the `PS1` environment variable in `nix develop` shells."};
+
+    Setting<bool> cacheEnvironments{this, true, "develop-cache",
+        "Whether `nix develop` and `nix print-dev-env` remember the build environment of each installable in `~/.cache/nix/develop`, so that it's not computed again if the derivation (or, for flakes, the flake and its lock file) hasn't changed."};
 };
 
 static DevelopSettings developSettings;
@@ -294,22 +298,92 @@ struct Common : InstallableCommand, MixProfile
         return {"devShell." + settings.thisSystem.get(), "defaultPackage." + settings.thisSystem.get()};
     }
 
+    /* The build environments of previous invocations are cached in
+       ~/.cache/nix/develop, one entry per installable, consisting of
+       a GC root for the environment and a file recording the
+       derivation and (for flakes) the flake fingerprint that it was
+       computed from. If the fingerprint is unchanged, the environment
+       is used without evaluating anything; otherwise, if the
+       installable still evaluates to the same derivation, it's used
+       without building the environment derivation again. */
+    std::optional<Path> getCacheEntry()
+    {
+        if (!developSettings.cacheEnvironments) return std::nullopt;
+        auto key = fmt("%s;%s", installable->what(), hashString(htSHA256, getEnvSh).to_string(Base32, false));
+        if (auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable))
+            key += ";" + concatStringsSep(" ", flake->getActualAttrPaths());
+        /* For `--file' and `--expr', what() is only the attribute
+           path. */
+        else if (file) {
+            auto path = resolveExprPath(lookupFileArg(*getEvalState(), *file));
+            key += fmt(";%s;%s", path, hashFile(htSHA256, path).to_string(Base32, false));
+        }
+        else if (expr)
+            key += ";" + *expr;
+        return getCacheDir() + "/nix/develop/" + hashString(htSHA256, key).to_string(Base32, false);
+    }
+
+    std::string getFingerprint()
+    {
+        /* Like the evaluation cache, only trust the fingerprint in
+           pure evaluation mode. */
+        if (auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable))
+            if (evalSettings.useEvalCache && evalSettings.pureEval)
+                return flake->getLockedFlake()->getFingerprint().to_string(Base16, false);
+        return "";
+    }
+
     StorePath getShellOutPath(ref<Store> store)
     {
         auto path = installable->getStorePath();
         if (path && hasSuffix(path->to_string(), "-env"))
             return *path;
-        else {
-            auto drvs = toDerivations(store, {installable});
 
-            if (drvs.size() != 1)
-                throw Error("'%s' needs to evaluate to a single derivation, but it evaluated to %d derivations",
-                    installable->what(), drvs.size());
+        auto localStore = store.dynamic_pointer_cast<LocalFSStore>();
+        auto cacheEntry = localStore ? getCacheEntry() : std::nullopt;
+        auto fingerprint = cacheEntry ? getFingerprint() : "";
+
+        /* The derivation path, the fingerprint and the environment
+           of the cache entry, if any. */
+        std::optional<std::tuple<std::string, std::string, StorePath>> cached;
+        if (cacheEntry && pathExists(*cacheEntry + ".info")) {
+            try {
+                auto info = tokenizeString<std::vector<std::string>>(readFile(*cacheEntry + ".info"), "\n");
+                auto outPath = store->parseStorePath(readLink(*cacheEntry));
+                if (!info.empty() && store->isValidPath(outPath))
+                    cached.emplace(info[0], info.size() > 1 ? info[1] : "", outPath);
+            } catch (Error & e) {
+                debug("ignoring cached environment '%s': %s", *cacheEntry, e.what());
+            }
+        }
+
+        if (cached && !fingerprint.empty() && std::get<1>(*cached) == fingerprint) {
+            debug("using cached environment '%s'", store->printStorePath(std::get<2>(*cached)));
+            return std::get<2>(*cached);
+        }
 
-            auto & drvPath = *drvs.begin();
+        auto drvs = toDerivations(store, {installable});
 
-            return getDerivationEnvironment(store, drvPath);
+        if (drvs.size() != 1)
+            throw Error("'%s' needs to evaluate to a single derivation, but it evaluated to %d derivations",
+                installable->what(), drvs.size());
+
+        auto & drvPath = *drvs.begin();
+
+        auto outPath =
+            cached && std::get<0>(*cached) == store->printStorePath(drvPath)
+            ? std::get<2>(*cached)
+            : getDerivationEnvironment(store, drvPath);
+
+        if (cacheEntry) {
+            localStore->addPermRoot(outPath, *cacheEntry);
+            auto tmp = fmt("%s.info.tmp-%d", *cacheEntry, getpid());
+            writeFile(tmp, store->printStorePath(drvPath) + "\n" + fingerprint + "\n");
+            if (rename(tmp.c_str(), (*cacheEntry + ".info").c_str()) == -1)
+                throw SysError("renaming '%s'", tmp);
         }
+
+        return outPath;
     }
 
     std::pair<BuildEnvironment, std::string> getBuildEnvironment(ref<Store> store)
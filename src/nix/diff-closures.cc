@@ -2,47 +2,10 @@
 #include "shared.hh"
 #include "store-api.hh"
 #include "common-args.hh"
-#include "names.hh"
-
-#include <regex>
+#include "closure-summary.hh"
 
 namespace nix {
 
-struct Info
-{
-    std::string outputName;
-};
-
-// name -> version -> store paths
-typedef std::map<std::string, std::map<std::string, std::map<StorePath, Info>>> GroupedPaths;
-
-GroupedPaths getClosureInfo(ref<Store> store, const StorePath & toplevel)
-{
-    StorePathSet closure;
-    store->computeFSClosure({toplevel}, closure);
-
-    GroupedPaths groupedPaths;
-
-    for (auto & path : closure) {
-        /* Strip the output name. Unfortunately this is ambiguous (we
-           can't distinguish between output names like "bin" and
-           version suffixes like "unstable"). */
-        static std::regex regex("(.*)-([a-z]+|lib32|lib64)");
-        std::smatch match;
-        std::string name(path.name());
-        std::string outputName;
-        if (std::regex_match(name, match, regex)) {
-            name = match[1];
-            outputName = match[2];
-        }
-
-        DrvName drvName(name);
-        groupedPaths[drvName.name][drvName.version].emplace(path, Info { .outputName = outputName });
-    }
-
-    return groupedPaths;
-}
-
 std::string showVersions(const std::set<std::string> & versions)
 {
     if (versions.empty()) return "∅";
@@ -58,39 +21,42 @@ void printClosureDiff(
     const StorePath & afterPath,
     std::string_view indent)
 {
-    auto beforeClosure = getClosureInfo(store, beforePath);
-    auto afterClosure = getClosureInfo(store, afterPath);
-
-    std::set<std::string> allNames;
-    for (auto & [name, _] : beforeClosure) allNames.insert(name);
-    for (auto & [name, _] : afterClosure) allNames.insert(name);
-
-    for (auto & name : allNames) {
-        auto & beforeVersions = beforeClosure[name];
-        auto & afterVersions = afterClosure[name];
-
-        auto totalSize = [&](const std::map<std::string, std::map<StorePath, Info>> & versions)
-        {
-            uint64_t sum = 0;
-            for (auto & [_, paths] : versions)
-                for (auto & [path, _] : paths)
-                    sum += store->queryPathInfo(path)->narSize;
-            return sum;
-        };
-
-        auto beforeSize = totalSize(beforeVersions);
-        auto afterSize = totalSize(afterVersions);
+    auto beforeSummary = getClosureSummary(*store, beforePath);
+    auto afterSummary = getClosureSummary(*store, afterPath);
+
+    /* Both summaries are sorted by name and version, so walk them in
+       parallel, one package name at a time. */
+    auto & before = beforeSummary.entries;
+    auto & after = afterSummary.entries;
+    auto i = before.begin(), j = after.begin();
+
+    while (i != before.end() || j != after.end()) {
+        std::string name = i == before.end() ? j->name
+            : j == after.end() ? i->name
+            : std::min(i->name, j->name);
+
+        uint64_t beforeSize = 0, afterSize = 0;
+        std::set<std::string> removed, added;
+
+        while (true) {
+            bool inBefore = i != before.end() && i->name == name;
+            bool inAfter = j != after.end() && j->name == name;
+            if (!inBefore && !inAfter) break;
+            if (inBefore && inAfter && i->version == j->version) {
+                beforeSize += i++->narSize;
+                afterSize += j++->narSize;
+            } else if (inBefore && (!inAfter || i->version < j->version)) {
+                removed.insert(i->version);
+                beforeSize += i++->narSize;
+            } else {
+                added.insert(j->version);
+                afterSize += j++->narSize;
+            }
+        }
+
         auto sizeDelta = (int64_t) afterSize - (int64_t) beforeSize;
         auto showDelta = std::abs(sizeDelta) >= 8 * 1024;
 
-        std::set<std::string> removed, unchanged;
-        for (auto & [version, _] : beforeVersions)
-            if (!afterVersions.count(version)) removed.insert(version); else unchanged.insert(version);
-
-        std::set<std::string> added;
-        for (auto & [version, _] : afterVersions)
-            if (!beforeVersions.count(version)) added.insert(version);
-
         if (showDelta || !removed.empty() || !added.empty()) {
             std::vector<std::string> items;
             if (!removed.empty() || !added.empty())
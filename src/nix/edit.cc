@@ -35,7 +35,7 @@ struct CmdEdit : InstallableCommand
         } catch (NoPositionInfo &) {
         }
 
-        if (pos == noPos)
+        if (!pos)
             throw Error("cannot find position information for '%s", installable->what());
 
         stopProgressBar();
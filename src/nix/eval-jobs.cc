@@ -0,0 +1,335 @@
+#include "command.hh"
+#include "common-args.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+#include "get-drvs.hh"
+#include "value-to-json.hh"
+#include "progress-bar.hh"
+#include "sync.hh"
+#include "globals.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <condition_variable>
+#include <thread>
+
+#include <sys/resource.h>
+
+using namespace nix;
+
+typedef std::vector<std::string> JobPath;
+
+/* Set in the environment of worker processes, which run the same
+   command line as the master. */
+static const std::string workerEnvVar = "_NIX_EVAL_JOBS_WORKER";
+
+struct CmdEvalJobs : SourceExprCommand
+{
+    size_t nrWorkers = 1;
+    size_t maxMemorySize = 4096;
+    bool forceRecurse = false;
+    bool meta = false;
+
+    CmdEvalJobs()
+    {
+        addFlag({
+            .longName = "workers",
+            .description = "Number of evaluation worker processes.",
+            .labels = {"n"},
+            .handler = {&nrWorkers},
+        });
+
+        addFlag({
+            .longName = "max-memory-size",
+            .description = "Restart a worker when its memory usage exceeds *size* megabytes.",
+            .labels = {"size"},
+            .handler = {&maxMemorySize},
+        });
+
+        addFlag({
+            .longName = "force-recurse",
+            .description = "Recurse into all attribute sets, not just those containing `recurseForDerivations = true`.",
+            .handler = {&forceRecurse, true},
+        });
+
+        addFlag({
+            .longName = "meta",
+            .description = "Include the `meta` attribute of every derivation.",
+            .handler = {&meta, true},
+        });
+
+        expectArgs({
+            .label = "installable",
+            .optional = true,
+            .handler = {&installable},
+            .completer = {[&](size_t, std::string_view prefix) {
+                completeInstallable(prefix);
+            }}
+        });
+    }
+
+    std::string description() override
+    {
+        return "evaluate the derivations in an attribute set using multiple processes";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "eval-jobs.md"
+          ;
+    }
+
+    Category category() override { return catSecondary; }
+
+    /* The worker process. For every "do" request, it evaluates the
+       attribute at the given attribute path, and replies with a JSON
+       object describing the derivation, the names of the attributes
+       to recurse into, or an error. It says "restart" instead of
+       "next" once its memory usage exceeds the maximum, after which
+       the master replaces it with a fresh process. Workers are
+       executed afresh rather than forked from the master, which is
+       multithreaded, since the garbage collector and the evaluator
+       don't work in a forked child of a multithreaded process. */
+    void worker(ref<Store> store, int from, int to)
+    {
+        auto state = getEvalState();
+
+        Value * vRoot = nullptr;
+
+        while (true) {
+            writeLine(to, "next");
+
+            auto s = readLine(from);
+            if (s == "exit") return;
+            if (!hasPrefix(s, "do "))
+                throw Error("unexpected request '%s' to evaluation worker", s);
+            auto attrPath = nlohmann::json::parse(s.substr(3)).get<JobPath>();
+
+            auto reply = nlohmann::json::object();
+
+            try {
+                if (!vRoot) {
+                    auto v = parseInstallable(store, installable)->toValue(*state).first;
+                    vRoot = state->allocValue();
+                    state->autoCallFunction(*getAutoArgs(*state), *v, *vRoot);
+                }
+
+                auto v = vRoot;
+                for (auto & name : attrPath) {
+                    state->forceAttrs(*v);
+                    auto a = v->attrs->find(state->symbols.create(name));
+                    if (a == v->attrs->end())
+                        throw Error("attribute '%s' disappeared", name);
+                    v = a->value;
+                }
+                state->forceValue(*v);
+
+                if (auto drv = getDerivation(*state, *v, false)) {
+                    reply["name"] = drv->queryName();
+                    reply["system"] = drv->querySystem();
+                    reply["drvPath"] = drv->queryDrvPath();
+                    auto outputs = nlohmann::json::object();
+                    for (auto & [name, path] : drv->queryOutputs())
+                        outputs[name] = path;
+                    reply["outputs"] = std::move(outputs);
+                    if (meta) {
+                        auto jsonMeta = nlohmann::json::object();
+                        for (auto & name : drv->queryMetaNames()) {
+                            auto vMeta = drv->queryMeta(name);
+                            if (!vMeta) continue;
+                            std::ostringstream str;
+                            PathSet context;
+                            printValueAsJSON(*state, true, *vMeta, str, context);
+                            jsonMeta[name] = nlohmann::json::parse(str.str());
+                        }
+                        reply["meta"] = std::move(jsonMeta);
+                    }
+                }
+
+                else if (v->type() == nAttrs) {
+                    auto recurse = attrPath.empty() || forceRecurse;
+                    if (!recurse) {
+                        auto a = v->attrs->find(state->sRecurseForDerivations);
+                        recurse = a != v->attrs->end() && state->forceBool(*a->value, a->pos);
+                    }
+                    if (recurse) {
+                        StringSet names;
+                        for (auto & attr : *v->attrs)
+                            names.insert(std::string(attr.name));
+                        reply["attrs"] = names;
+                    }
+                }
+            } catch (Error & e) {
+                reply["error"] = filterANSIEscapes(e.msg(), true);
+            }
+
+            writeLine(to, reply.dump());
+
+            struct rusage r;
+            getrusage(RUSAGE_SELF, &r);
+            #if __APPLE__
+            size_t maxRSS = r.ru_maxrss / 1024;
+            #else
+            size_t maxRSS = r.ru_maxrss;
+            #endif
+            if (maxRSS > maxMemorySize * 1024) {
+                writeLine(to, "restart");
+                return;
+            }
+        }
+    }
+
+    void run(ref<Store> store) override
+    {
+        stopProgressBar();
+
+        if (getEnv(workerEnvVar)) {
+            worker(store, STDIN_FILENO, STDOUT_FILENO);
+            return;
+        }
+
+        if (!nrWorkers)
+            throw UsageError("'--workers' must be at least 1");
+
+        /* Prepare the execution of the workers here, since the forked
+           children of the handler threads may not allocate memory. */
+        auto program = pathExists("/proc/self/exe") ? readLink("/proc/self/exe") : settings.nixBinDir + "/nix";
+        Strings env;
+        for (auto & [name, value] : getEnv())
+            env.push_back(name + "=" + value);
+        env.push_back(workerEnvVar + "=1");
+        auto envp = stringsToCharPtrs(env);
+
+        struct State
+        {
+            std::list<JobPath> todo{JobPath()};
+            size_t active = 0;
+            std::exception_ptr exc;
+        };
+
+        Sync<State> state_;
+        std::condition_variable wakeup;
+
+        /* Return the next attribute path to evaluate, or nothing if
+           all attributes have been evaluated. */
+        auto next = [&]() -> std::optional<JobPath> {
+            auto state(state_.lock());
+            while (true) {
+                if (state->exc) return std::nullopt;
+                if (!state->todo.empty()) {
+                    auto attrPath = std::move(state->todo.front());
+                    state->todo.pop_front();
+                    state->active++;
+                    return attrPath;
+                }
+                if (!state->active) return std::nullopt;
+                state.wait(wakeup);
+            }
+        };
+
+        auto finish = [&](const JobPath & attrPath, nlohmann::json reply) {
+            {
+                auto state(state_.lock());
+                if (reply.contains("attrs")) {
+                    for (auto & name : reply["attrs"]) {
+                        auto attrPath2(attrPath);
+                        attrPath2.push_back(name);
+                        state->todo.push_back(std::move(attrPath2));
+                    }
+                } else if (!reply.empty()) {
+                    reply["attr"] = concatStringsSep(".", attrPath);
+                    std::cout << reply.dump() << "\n" << std::flush;
+                }
+                state->active--;
+            }
+            wakeup.notify_all();
+        };
+
+        /* Each handler thread talks to one worker process at a time,
+           starting a new one whenever the previous one exits. */
+        auto handler = [&]() {
+            try {
+                while (true) {
+                    Pipe toWorker, fromWorker;
+                    toWorker.create();
+                    fromWorker.create();
+
+                    ProcessOptions options;
+                    options.allowVfork = false;
+
+                    /* The worker talks to us over its stdin and
+                       stdout. The pipes of the other workers are
+                       closed on exec. */
+                    Pid pid = startProcess([&]() {
+                        if (dup2(toWorker.readSide.get(), STDIN_FILENO) == -1)
+                            throw SysError("dupping stdin");
+                        if (dup2(fromWorker.writeSide.get(), STDOUT_FILENO) == -1)
+                            throw SysError("dupping stdout");
+                        execve(program.c_str(), savedArgv, envp.data());
+                        throw SysError("unable to execute '%s'", program);
+                    }, options);
+
+                    toWorker.readSide = -1;
+                    fromWorker.writeSide = -1;
+
+                    while (true) {
+                        auto s = readLine(fromWorker.readSide.get());
+                        if (s == "restart") {
+                            pid.wait();
+                            break;
+                        }
+                        if (s != "next")
+                            throw Error("unexpected message '%s' from evaluation worker", s);
+
+                        auto attrPath = next();
+                        if (!attrPath) {
+                            writeLine(toWorker.writeSide.get(), "exit");
+                            pid.wait();
+                            return;
+                        }
+
+                        writeLine(toWorker.writeSide.get(), "do " + nlohmann::json(*attrPath).dump());
+
+                        std::string reply;
+                        try {
+                            reply = readLine(fromWorker.readSide.get());
+                        } catch (EndOfFile &) {
+                            /* The worker died, e.g. because it ran out of
+                               stack. Report the attribute as failed. */
+                            auto status = pid.wait();
+                            finish(*attrPath, {{"error", fmt("evaluation worker %s", statusToString(status))}});
+                            break;
+                        }
+
+                        finish(*attrPath, nlohmann::json::parse(reply));
+                    }
+                }
+            } catch (...) {
+                {
+                    auto state(state_.lock());
+                    if (!state->exc) state->exc = std::current_exception();
+                }
+                wakeup.notify_all();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t n = 0; n < nrWorkers; ++n)
+            threads.emplace_back(handler);
+
+        for (auto & thread : threads)
+            thread.join();
+
+        if (auto exc = state_.lock()->exc)
+            std::rethrow_exception(exc);
+    }
+
+private:
+
+    std::string installable{"."};
+};
+
+static auto rCmdEvalJobs = registerCommand<CmdEvalJobs>("eval-jobs");
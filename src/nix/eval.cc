@@ -7,6 +7,7 @@
 #include "json.hh"
 #include "value-to-json.hh"
 #include "progress-bar.hh"
+#include "eval-cache.hh"
 
 using namespace nix;
 
@@ -60,8 +61,37 @@ struct CmdEval : MixJSON, InstallableCommand
 
         auto state = getEvalState();
 
-        auto [v, pos] = installable->toValue(*state);
+        Value * v;
+        Pos pos;
         PathSet context;
+        std::shared_ptr<eval_cache::AttrCursor> cursor;
+
+        if (apply || writeTo)
+            std::tie(v, pos) = installable->toValue(*state);
+        else {
+            /* Go through the evaluation cache, so that repeated
+               evaluations of the same string, Boolean, integer or list
+               of strings (such as a 'drvPath' or 'meta.platforms')
+               don't need to evaluate anything. */
+            cursor = installable->getCursor(*state).first;
+            if (auto cached = cursor->getCachedValue()) {
+                v = state->allocValue();
+                if (auto s = std::get_if<eval_cache::string_t>(&*cached)) {
+                    PathSet context2;
+                    for (auto & c : s->second)
+                        context2.insert(c.second.empty() ? c.first : "!" + c.second + "!" + c.first);
+                    mkString(*v, s->first, context2);
+                } else if (auto i = std::get_if<eval_cache::int_t>(&*cached))
+                    mkInt(*v, i->x);
+                else if (auto l = std::get_if<std::vector<std::string>>(&*cached)) {
+                    state->mkList(*v, l->size());
+                    for (auto [n, s] : enumerate(*l))
+                        mkString(*(v->listElems()[n] = state->allocValue()), s);
+                } else
+                    mkBool(*v, std::get<bool>(*cached));
+            } else
+                v = &cursor->forceValue();
+        }
 
         if (apply) {
             auto vApply = state->allocValue();
@@ -92,9 +122,9 @@ struct CmdEval : MixJSON, InstallableCommand
                         try {
                             if (attr.name == "." || attr.name == "..")
                                 throw Error("invalid file name '%s'", attr.name);
-                            recurse(*attr.value, *attr.pos, path + "/" + std::string(attr.name));
+                            recurse(*attr.value, state->positions[attr.pos], path + "/" + std::string(attr.name));
                         } catch (Error & e) {
-                            e.addTrace(*attr.pos, hintfmt("while evaluating the attribute '%s'", attr.name));
+                            e.addTrace(state->positions[attr.pos], hintfmt("while evaluating the attribute '%s'", attr.name));
                             throw;
                         }
                 }
@@ -111,14 +141,20 @@ struct CmdEval : MixJSON, InstallableCommand
         }
 
         else if (json) {
-            JSONPlaceholder jsonOut(std::cout);
-            printValueAsJSON(*state, true, *v, jsonOut, context);
+            std::cout.flush();
+            FdSink out(STDOUT_FILENO);
+            printValueAsJSON(*state, true, *v, out, context);
+            out.flush();
         }
 
         else {
             state->forceValueDeep(*v);
             logger->cout("%s", *v);
         }
+
+        /* The result may refer to sources that are still being copied
+           to the store. */
+        state->waitForSourceCopies();
     }
 };
 
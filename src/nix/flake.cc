@@ -12,6 +12,7 @@
 #include "registry.hh"
 #include "json.hh"
 #include "eval-cache.hh"
+#include "finally.hh"
 
 #include <nlohmann/json.hpp>
 #include <queue>
@@ -121,7 +122,7 @@ struct CmdFlakeUpdate : FlakeCommand
 };
 
 static void enumerateOutputs(EvalState & state, Value & vFlake,
-    std::function<void(const std::string & name, Value & vProvide, const Pos & pos)> callback)
+    std::function<void(const std::string & name, Value & vProvide, const PosIdx pos)> callback)
 {
     state.forceAttrs(vFlake);
 
@@ -131,7 +132,7 @@ static void enumerateOutputs(EvalState & state, Value & vFlake,
     state.forceAttrs(*aOutputs->value);
 
     for (auto & attr : *aOutputs->value->attrs)
-        callback(attr.name, *attr.value, *attr.pos);
+        callback(attr.name, *attr.value, attr.pos);
 }
 
 struct CmdFlakeInfo : FlakeCommand, MixJSON
@@ -217,6 +218,7 @@ struct CmdFlakeListInputs : FlakeCommand, MixJSON
 struct CmdFlakeCheck : FlakeCommand
 {
     bool build = true;
+    size_t evalWorkers = 1;
 
     CmdFlakeCheck()
     {
@@ -225,6 +227,13 @@ struct CmdFlakeCheck : FlakeCommand
             .description = "Do not build checks.",
             .handler = {&build, false}
         });
+
+        addFlag({
+            .longName = "eval-workers",
+            .description = "Check the flake outputs using *n* processes.",
+            .labels = {"n"},
+            .handler = {&evalWorkers},
+        });
     }
 
     std::string description() override
@@ -243,18 +252,29 @@ struct CmdFlakeCheck : FlakeCommand
     {
         settings.readOnlyMode = !build;
 
-        auto state = getEvalState();
+        std::shared_ptr<EvalState> state = getEvalState();
         auto flake = lockFlake();
 
         // FIXME: rewrite to use EvalCache.
 
-        auto checkSystemName = [&](const std::string & system, const Pos & pos) {
+        auto checkSystemName = [&](const std::string & system, const PosIdx pos) {
             // FIXME: what's the format of "system"?
             if (system.find('-') == std::string::npos)
-                throw Error("'%s' is not a valid system type, at %s", system, pos);
+                throw Error("'%s' is not a valid system type, at %s", system, state->positions[pos]);
         };
 
-        auto checkDerivation = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        /* With `--eval-workers', every worker evaluates the flake, but
+           only checks the attributes that hash to its shard. The hash
+           of the attribute path doesn't depend on the order in which
+           attributes are visited, which differs between processes. */
+        size_t nrShards = 1, shard = 0;
+
+        auto mine = [&](const std::string & attrPath) {
+            return nrShards == 1 || std::hash<std::string>{}(attrPath) % nrShards == shard;
+        };
+
+        auto checkDerivation = [&](const std::string & attrPath, Value & v, const PosIdx pos) -> std::optional<StorePath> {
+            if (!mine(attrPath)) return std::nullopt;
             try {
                 auto drvInfo = getDerivation(*state, v, false);
                 if (!drvInfo)
@@ -262,14 +282,19 @@ struct CmdFlakeCheck : FlakeCommand
                 // FIXME: check meta attributes
                 return store->parseStorePath(drvInfo->queryDrvPath());
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the derivation '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the derivation '%s'", attrPath));
                 throw;
             }
         };
 
         std::vector<StorePathWithOutputs> drvPaths;
 
-        auto checkApp = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        std::function<void(StorePathWithOutputs && path)> addCheck = [&](StorePathWithOutputs && path) {
+            drvPaths.push_back(std::move(path));
+        };
+
+        auto checkApp = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
+            if (!mine(attrPath)) return;
             try {
                 #if 0
                 // FIXME
@@ -280,12 +305,13 @@ struct CmdFlakeCheck : FlakeCommand
                 }
                 #endif
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the app definition '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the app definition '%s'", attrPath));
                 throw;
             }
         };
 
-        auto checkOverlay = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        auto checkOverlay = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
+            if (!mine(attrPath)) return;
             try {
                 state->forceValue(v, pos);
                 if (!v.isLambda() || v.lambda.fun->matchAttrs || std::string(v.lambda.fun->arg) != "final")
@@ -296,12 +322,13 @@ struct CmdFlakeCheck : FlakeCommand
                 // FIXME: if we have a 'nixpkgs' input, use it to
                 // evaluate the overlay.
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the overlay '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the overlay '%s'", attrPath));
                 throw;
             }
         };
 
-        auto checkModule = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        auto checkModule = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
+            if (!mine(attrPath)) return;
             try {
                 state->forceValue(v, pos);
                 if (v.isLambda()) {
@@ -310,9 +337,9 @@ struct CmdFlakeCheck : FlakeCommand
                 } else if (v.type() == nAttrs) {
                     for (auto & attr : *v.attrs)
                         try {
-                            state->forceValue(*attr.value, *attr.pos);
+                            state->forceValue(*attr.value, attr.pos);
                         } catch (Error & e) {
-                            e.addTrace(*attr.pos, hintfmt("while evaluating the option '%s'", attr.name));
+                            e.addTrace(state->positions[attr.pos], hintfmt("while evaluating the option '%s'", attr.name));
                             throw;
                         }
                 } else
@@ -320,14 +347,14 @@ struct CmdFlakeCheck : FlakeCommand
                 // FIXME: if we have a 'nixpkgs' input, use it to
                 // check the module.
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the NixOS module '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the NixOS module '%s'", attrPath));
                 throw;
             }
         };
 
-        std::function<void(const std::string & attrPath, Value & v, const Pos & pos)> checkHydraJobs;
+        std::function<void(const std::string & attrPath, Value & v, const PosIdx pos)> checkHydraJobs;
 
-        checkHydraJobs = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        checkHydraJobs = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
             try {
                 state->forceAttrs(v, pos);
 
@@ -335,19 +362,20 @@ struct CmdFlakeCheck : FlakeCommand
                     throw Error("jobset should not be a derivation at top-level");
 
                 for (auto & attr : *v.attrs) {
-                    state->forceAttrs(*attr.value, *attr.pos);
+                    state->forceAttrs(*attr.value, attr.pos);
                     if (!state->isDerivation(*attr.value))
                         checkHydraJobs(attrPath + "." + (std::string) attr.name,
-                            *attr.value, *attr.pos);
+                            *attr.value, attr.pos);
                 }
 
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the Hydra jobset '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the Hydra jobset '%s'", attrPath));
                 throw;
             }
         };
 
-        auto checkNixOSConfiguration = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        auto checkNixOSConfiguration = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
+            if (!mine(attrPath)) return;
             try {
                 Activity act(*logger, lvlChatty, actUnknown,
                     fmt("checking NixOS configuration '%s'", attrPath));
@@ -357,12 +385,13 @@ struct CmdFlakeCheck : FlakeCommand
                 if (!state->isDerivation(*vToplevel))
                     throw Error("attribute 'config.system.build.toplevel' is not a derivation");
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the NixOS configuration '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the NixOS configuration '%s'", attrPath));
                 throw;
             }
         };
 
-        auto checkTemplate = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        auto checkTemplate = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
+            if (!mine(attrPath)) return;
             try {
                 Activity act(*logger, lvlChatty, actUnknown,
                     fmt("checking template '%s'", attrPath));
@@ -372,7 +401,7 @@ struct CmdFlakeCheck : FlakeCommand
                 if (auto attr = v.attrs->get(state->symbols.create("path"))) {
                     if (attr->name == state->symbols.create("path")) {
                         PathSet context;
-                        auto path = state->coerceToPath(*attr->pos, *attr->value, context);
+                        auto path = state->coerceToPath(attr->pos, *attr->value, context);
                         if (!store->isInStore(path))
                             throw Error("template '%s' has a bad 'path' attribute");
                         // TODO: recursively check the flake in 'path'.
@@ -381,7 +410,7 @@ struct CmdFlakeCheck : FlakeCommand
                     throw Error("template '%s' lacks attribute 'path'", attrPath);
 
                 if (auto attr = v.attrs->get(state->symbols.create("description")))
-                    state->forceStringNoCtx(*attr->value, *attr->pos);
+                    state->forceStringNoCtx(*attr->value, attr->pos);
                 else
                     throw Error("template '%s' lacks attribute 'description'", attrPath);
 
@@ -391,12 +420,13 @@ struct CmdFlakeCheck : FlakeCommand
                         throw Error("template '%s' has unsupported attribute '%s'", attrPath, name);
                 }
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the template '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the template '%s'", attrPath));
                 throw;
             }
         };
 
-        auto checkBundler = [&](const std::string & attrPath, Value & v, const Pos & pos) {
+        auto checkBundler = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
+            if (!mine(attrPath)) return;
             try {
                 state->forceValue(v, pos);
                 if (!v.isLambda())
@@ -406,12 +436,12 @@ struct CmdFlakeCheck : FlakeCommand
                     v.lambda.fun->formals->argNames.find(state->symbols.create("system")) == v.lambda.fun->formals->argNames.end())
                     throw Error("bundler must take formal arguments 'program' and 'system'");
             } catch (Error & e) {
-                e.addTrace(pos, hintfmt("while checking the template '%s'", attrPath));
+                e.addTrace(state->positions[pos], hintfmt("while checking the template '%s'", attrPath));
                 throw;
             }
         };
 
-        {
+        auto checkFlake = [&]() {
             Activity act(*logger, lvlInfo, actUnknown, "evaluating flake");
 
             auto vFlake = state->allocValue();
@@ -419,7 +449,7 @@ struct CmdFlakeCheck : FlakeCommand
 
             enumerateOutputs(*state,
                 *vFlake,
-                [&](const std::string & name, Value & vOutput, const Pos & pos) {
+                [&](const std::string & name, Value & vOutput, const PosIdx pos) {
                     Activity act(*logger, lvlChatty, actUnknown,
                         fmt("checking flake output '%s'", name));
 
@@ -429,14 +459,14 @@ struct CmdFlakeCheck : FlakeCommand
                         if (name == "checks") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs) {
-                                checkSystemName(attr.name, *attr.pos);
-                                state->forceAttrs(*attr.value, *attr.pos);
+                                checkSystemName(attr.name, attr.pos);
+                                state->forceAttrs(*attr.value, attr.pos);
                                 for (auto & attr2 : *attr.value->attrs) {
                                     auto drvPath = checkDerivation(
                                         fmt("%s.%s.%s", name, attr.name, attr2.name),
-                                        *attr2.value, *attr2.pos);
-                                    if ((std::string) attr.name == settings.thisSystem.get())
-                                        drvPaths.push_back({drvPath});
+                                        *attr2.value, attr2.pos);
+                                    if (drvPath && (std::string) attr.name == settings.thisSystem.get())
+                                        addCheck({*drvPath});
                                 }
                             }
                         }
@@ -444,51 +474,51 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "packages") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs) {
-                                checkSystemName(attr.name, *attr.pos);
-                                state->forceAttrs(*attr.value, *attr.pos);
+                                checkSystemName(attr.name, attr.pos);
+                                state->forceAttrs(*attr.value, attr.pos);
                                 for (auto & attr2 : *attr.value->attrs)
                                     checkDerivation(
                                         fmt("%s.%s.%s", name, attr.name, attr2.name),
-                                        *attr2.value, *attr2.pos);
+                                        *attr2.value, attr2.pos);
                             }
                         }
 
                         else if (name == "apps") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs) {
-                                checkSystemName(attr.name, *attr.pos);
-                                state->forceAttrs(*attr.value, *attr.pos);
+                                checkSystemName(attr.name, attr.pos);
+                                state->forceAttrs(*attr.value, attr.pos);
                                 for (auto & attr2 : *attr.value->attrs)
                                     checkApp(
                                         fmt("%s.%s.%s", name, attr.name, attr2.name),
-                                        *attr2.value, *attr2.pos);
+                                        *attr2.value, attr2.pos);
                             }
                         }
 
                         else if (name == "defaultPackage" || name == "devShell") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs) {
-                                checkSystemName(attr.name, *attr.pos);
+                                checkSystemName(attr.name, attr.pos);
                                 checkDerivation(
                                     fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                             }
                         }
 
                         else if (name == "defaultApp") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs) {
-                                checkSystemName(attr.name, *attr.pos);
+                                checkSystemName(attr.name, attr.pos);
                                 checkApp(
                                     fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                             }
                         }
 
                         else if (name == "legacyPackages") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs) {
-                                checkSystemName(attr.name, *attr.pos);
+                                checkSystemName(attr.name, attr.pos);
                                 // FIXME: do getDerivations?
                             }
                         }
@@ -500,7 +530,7 @@ struct CmdFlakeCheck : FlakeCommand
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs)
                                 checkOverlay(fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                         }
 
                         else if (name == "nixosModule")
@@ -510,18 +540,20 @@ struct CmdFlakeCheck : FlakeCommand
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs)
                                 checkModule(fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                         }
 
                         else if (name == "nixosConfigurations") {
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs)
                                 checkNixOSConfiguration(fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                         }
 
-                        else if (name == "hydraJobs")
-                            checkHydraJobs(name, vOutput, pos);
+                        else if (name == "hydraJobs") {
+                            if (mine(name))
+                                checkHydraJobs(name, vOutput, pos);
+                        }
 
                         else if (name == "defaultTemplate")
                             checkTemplate(name, vOutput, pos);
@@ -530,7 +562,7 @@ struct CmdFlakeCheck : FlakeCommand
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs)
                                 checkTemplate(fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                         }
 
                         else if (name == "defaultBundler")
@@ -540,22 +572,135 @@ struct CmdFlakeCheck : FlakeCommand
                             state->forceAttrs(vOutput, pos);
                             for (auto & attr : *vOutput.attrs)
                                 checkBundler(fmt("%s.%s", name, attr.name),
-                                    *attr.value, *attr.pos);
+                                    *attr.value, attr.pos);
                         }
 
-                        else
+                        else if (shard == 0)
                             warn("unknown flake output '%s'", name);
 
                     } catch (Error & e) {
-                        e.addTrace(pos, hintfmt("while checking flake output '%s'", name));
+                        e.addTrace(state->positions[pos], hintfmt("while checking flake output '%s'", name));
                         throw;
                     }
                 });
+        };
+
+        if (evalWorkers <= 1) {
+            /* Start building the checks while evaluating the rest of
+               the flake. */
+            std::unique_ptr<BuildPipeline> pipeline;
+            if (build && settings.pipelinedBuilds) {
+                pipeline = std::make_unique<BuildPipeline>(store);
+                addCheck = [&](StorePathWithOutputs && path) {
+                    pipeline->checkFailure();
+                    pipeline->add({std::move(path)});
+                };
+                state->buildImports = [&](auto & paths) { pipeline->buildImports(paths); };
+            }
+            Finally resetBuildImports([&]() { state->buildImports = nullptr; });
+
+            checkFlake();
+
+            if (pipeline) {
+                Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
+                pipeline->finish();
+            }
+
+            else if (build && !drvPaths.empty()) {
+                Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
+                store->buildPaths(drvPaths);
+            }
+
+            return;
         }
 
-        if (build && !drvPaths.empty()) {
+        /* Fork the workers. They send the checks to the parent as
+           soon as they're evaluated, so that the builds start right
+           away. A worker that fails prints its error and says
+           "failed", after which the others are killed. */
+        struct Worker
+        {
+            Pid pid;
+            AutoCloseFD from;
+        };
+
+        std::list<Worker> workers;
+
+        for (size_t n = 0; n < evalWorkers; ++n) {
+            Pipe pipe;
+            pipe.create();
+
+            ProcessOptions options;
+            options.allowVfork = false;
+
+            auto & worker = workers.emplace_back();
+            worker.pid = startProcess([&]() {
+                closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, pipe.writeSide.get()});
+                /* Don't use the store connection of the parent. */
+                state = std::make_shared<EvalState>(searchPath, openStore());
+                nrShards = evalWorkers;
+                shard = n;
+                addCheck = [&](StorePathWithOutputs && path) {
+                    writeLine(pipe.writeSide.get(), path.to_string(*store));
+                };
+                try {
+                    checkFlake();
+                } catch (Error & e) {
+                    logError(e.info());
+                    writeLine(pipe.writeSide.get(), "failed");
+                    _exit(1);
+                }
+                _exit(0);
+            }, options);
+
+            pipe.writeSide = -1;
+            worker.from = std::move(pipe.readSide);
+        }
+
+        /* Start the build thread only now, so that it doesn't hold
+           any locks when forking. */
+        std::unique_ptr<BuildPipeline> pipeline;
+        if (build)
+            pipeline = std::make_unique<BuildPipeline>(store);
+
+        std::atomic<bool> failed{false};
+
+        std::vector<std::thread> threads;
+
+        for (auto & worker : workers)
+            threads.emplace_back([&, from = worker.from.get()]() {
+                try {
+                    while (true) {
+                        auto s = readLine(from);
+                        if (s == "failed") {
+                            failed = true;
+                            for (auto & worker2 : workers)
+                                ::kill(worker2.pid, SIGKILL);
+                            return;
+                        }
+                        if (pipeline)
+                            pipeline->add({store->parsePathWithOutputs(s)});
+                    }
+                } catch (EndOfFile &) {
+                } catch (...) {
+                    ignoreException();
+                }
+            });
+
+        for (auto & thread : threads)
+            thread.join();
+
+        for (auto & worker : workers) {
+            auto status = worker.pid.wait();
+            if (!failed && status != 0)
+                throw Error("flake check worker %s", statusToString(status));
+        }
+
+        if (failed) throw Exit(1);
+
+        if (pipeline) {
             Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
-            store->buildPaths(drvPaths);
+            pipeline->finish();
         }
     }
 };
@@ -766,6 +911,8 @@ struct CmdFlakeArchive : FlakeCommand, MixJSON, MixDryRun
 
         StorePathSet sources;
 
+        if (!dryRun)
+            fetchers::ensureTreeInStore(store, *flake.flake.sourceInfo);
         sources.insert(flake.flake.sourceInfo->storePath);
         if (jsonRoot)
             jsonRoot->attr("path", store->printStorePath(flake.flake.sourceInfo->storePath));
@@ -778,10 +925,13 @@ struct CmdFlakeArchive : FlakeCommand, MixJSON, MixDryRun
             for (auto & [inputName, input] : node.inputs) {
                 if (auto inputNode = std::get_if<0>(&input)) {
                     auto jsonObj3 = jsonObj2 ? jsonObj2->object(inputName) : std::optional<JSONObject>();
-                    auto storePath =
-                        dryRun
-                        ? (*inputNode)->lockedRef.input.computeStorePath(*store)
-                        : (*inputNode)->lockedRef.input.fetch(store).first.storePath;
+                    auto storePath = [&]() {
+                        if (dryRun)
+                            return (*inputNode)->lockedRef.input.computeStorePath(*store);
+                        auto tree = (*inputNode)->lockedRef.input.fetch(store).first;
+                        fetchers::ensureTreeInStore(store, tree);
+                        return tree.storePath;
+                    }();
                     if (jsonObj3)
                         jsonObj3->attr("path", store->printStorePath(storePath));
                     sources.insert(std::move(storePath));
@@ -918,8 +1068,12 @@ struct CmdFlakeShow : FlakeCommand
                         if (visitor.isDerivation())
                             showDerivation();
                         else if (attrPath.size() <= 2)
-                            // FIXME: handle recurseIntoAttrs
                             recurse();
+                        else {
+                            auto attr = visitor.maybeGetAttr(state->sRecurseForDerivations);
+                            if (attr && attr->getBool())
+                                recurse();
+                        }
                     }
                 }
 
@@ -289,6 +289,8 @@ void mainWrapped(int argc, char * * argv)
 
     if (completions) return;
 
+    startupPhase("command line");
+
     if (args.showVersion) {
         printVersion(programName);
         return;
@@ -325,6 +327,9 @@ void mainWrapped(int argc, char * * argv)
         settings.ttlPositiveNarInfoCache = 0;
     }
 
+    startupPhase("network check");
+    printStartupPhases();
+
     args.command->second->prepare();
     args.command->second->run();
 }
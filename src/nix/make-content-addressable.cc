@@ -41,9 +41,8 @@ struct CmdMakeContentAddressable : StorePathsCommand, MixJSON
             auto oldInfo = store->queryPathInfo(path);
             std::string oldHashPart(path.hashPart());
 
-            StringSink sink;
-            store->narFromPath(path, sink);
-
+            /* The hash parts of the references that have been
+               rewritten already, and their replacements. */
             StringMap rewrites;
 
             StorePathSet references;
@@ -56,12 +55,15 @@ struct CmdMakeContentAddressable : StorePathsCommand, MixJSON
                     auto replacement = i != remappings.end() ? i->second : ref;
                     // FIXME: warn about unremapped paths?
                     if (replacement != ref)
-                        rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
+                        rewrites.insert_or_assign(std::string(ref.hashPart()), std::string(replacement.hashPart()));
                     references.insert(std::move(replacement));
                 }
             }
 
-            *sink.s = rewriteStrings(*sink.s, rewrites);
+            StringSink sink;
+            RewritingSink rsink(rewrites, sink);
+            store->narFromPath(path, rsink);
+            rsink.flush();
 
             HashModuloSink hashModuloSink(htSHA256, oldHashPart);
             hashModuloSink(*sink.s);
@@ -95,6 +95,10 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         else {
 
+            std::map<StorePath, std::pair<uint64_t, uint64_t>> closureSizes;
+            if (showClosureSize)
+                closureSizes = store->getClosureSizes(StorePathSet(storePaths.begin(), storePaths.end()));
+
             for (auto & storePath : storePaths) {
                 auto info = store->queryPathInfo(storePath);
                 auto storePathS = store->printStorePath(storePath);
@@ -107,8 +111,10 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
                 if (showSize)
                     printSize(info->narSize);
 
-                if (showClosureSize)
-                    printSize(store->getClosureSize(info->path).first);
+                if (showClosureSize) {
+                    auto i = closureSizes.find(storePath);
+                    printSize(i != closureSizes.end() ? i->second.first : store->getClosureSize(storePath).first);
+                }
 
                 if (showSigs) {
                     std::cout << '\t';
@@ -0,0 +1,62 @@
+#include "shared.hh"
+#include "globals.hh"
+#include "store-api.hh"
+#include "fetchers.hh"
+#include "pathlocks.hh"
+#include "legacy.hh"
+
+using namespace nix;
+
+/* Helper started by fetchers::downloadFile() and
+   fetchers::downloadTarball() when 'tarball-refresh-in-background'
+   is enabled. It fetches a file or tarball again to update its entry
+   in the fetcher cache. */
+static int main_refresh_download(int argc, char * * argv)
+{
+    {
+        if (argc != 4)
+            throw UsageError("called without required arguments");
+
+        std::string type = argv[1];
+        std::string url = argv[2];
+        std::string name = argv[3];
+
+        /* Apply the settings that the parent overrode, which it
+           sends on our standard input. */
+        {
+            FdSource source(STDIN_FILENO);
+            auto count = readNum<size_t>(source);
+            for (size_t i = 0; i < count; ++i) {
+                auto name = readString(source);
+                auto value = readString(source);
+                globalConfig.set(name, value);
+            }
+        }
+
+        settings.tarballTtl = 0;
+        settings.tarballRefreshInBackground = false;
+
+        /* Don't refresh the same URL in several processes at once. */
+        auto lockPath = getCacheDir() + "/nix/refresh-locks/"
+            + hashString(htSHA256, type + " " + url + " " + name).to_string(Base32, false);
+        createDirs(dirOf(lockPath));
+        AutoCloseFD fdLock = openLockFile(lockPath, true);
+        if (!lockFile(fdLock.get(), ltWrite, false))
+            return 0;
+
+        initPlugins();
+
+        auto store = openStore();
+
+        if (type == "file")
+            fetchers::downloadFile(store, url, name, false);
+        else if (type == "tarball")
+            fetchers::downloadTarball(store, url, name, false);
+        else
+            throw UsageError("unknown download type '%s'", type);
+
+        return 0;
+    }
+}
+
+static RegisterLegacyCommand r_refresh_download("__refresh_download", main_refresh_download);
@@ -23,6 +23,7 @@ extern "C" {
 #include "shared.hh"
 #include "eval.hh"
 #include "eval-inline.hh"
+#include "eval-snapshot.hh"
 #include "attr-path.hh"
 #include "store-api.hh"
 #include "common-eval-args.hh"
@@ -62,12 +63,14 @@ struct NixRepl
 
     NixRepl(const Strings & searchPath, nix::ref<Store> store);
     ~NixRepl();
-    void mainLoop(const std::vector<std::string> & files);
+    void mainLoop(const std::vector<std::string> & files, const std::optional<Path> & snapshot);
     StringSet completePrefix(string prefix);
     bool getLine(string & input, const std::string &prompt);
     StorePath getDerivationPath(Value & v);
     bool processLine(string line);
     void loadFile(const Path & path);
+    void loadSnapshot(const Path & path);
+    void saveSnapshot(const Path & path);
     void initEnv();
     void reloadFiles();
     void addAttrsToScope(Value & attrs);
@@ -177,7 +180,7 @@ namespace {
     }
 }
 
-void NixRepl::mainLoop(const std::vector<std::string> & files)
+void NixRepl::mainLoop(const std::vector<std::string> & files, const std::optional<Path> & snapshot)
 {
     string error = ANSI_RED "error:" ANSI_NORMAL " ";
     std::cout << "Welcome to Nix version " << nixVersion << ". Type :? for help." << std::endl << std::endl;
@@ -186,6 +189,10 @@ void NixRepl::mainLoop(const std::vector<std::string> & files)
         loadedFiles.push_back(i);
 
     reloadFiles();
+    if (snapshot) {
+        std::cout << format("Loading snapshot '%1%'...") % *snapshot << std::endl;
+        loadSnapshot(*snapshot);
+    }
     if (!loadedFiles.empty()) std::cout << std::endl;
 
     // Allow nix-repl specific settings in .inputrc
@@ -419,6 +426,7 @@ bool NixRepl::processLine(string line)
              << "  :p <expr>     Evaluate and print expression recursively\n"
              << "  :q            Exit nix-repl\n"
              << "  :r            Reload all files\n"
+             << "  :save <path>  Save the variables in scope to a snapshot\n"
              << "  :s <expr>     Build dependencies of derivation, then start nix-shell\n"
              << "  :t <expr>     Describe result of evaluation\n"
              << "  :u <expr>     Build derivation, then start nix-shell\n"
@@ -441,6 +449,10 @@ bool NixRepl::processLine(string line)
         reloadFiles();
     }
 
+    else if (command == ":save") {
+        saveSnapshot(arg);
+    }
+
     else if (command == ":e" || command == ":edit") {
         Value v;
         evalString(arg, v);
@@ -452,7 +464,7 @@ bool NixRepl::processLine(string line)
             auto filename = state->coerceToString(noPos, v, context);
             pos.file = state->symbols.create(filename);
         } else if (v.isLambda()) {
-            pos = v.lambda.fun->pos;
+            pos = state->positions[v.lambda.fun->pos];
         } else {
             // assume it's a derivation
             pos = findDerivationFilename(*state, v, arg);
@@ -478,7 +490,7 @@ bool NixRepl::processLine(string line)
         Value v, f, result;
         evalString(arg, v);
         evalString("drv: (import <nixpkgs> {}).runCommand \"shell\" { buildInputs = [ drv ]; } \"\"", f);
-        state->callFunction(f, v, result, Pos());
+        state->callFunction(f, v, result, noPos);
 
         StorePath drvPath = getDerivationPath(result);
         runProgram(settings.nixBinDir + "/nix-shell", Strings{state->store->printStorePath(drvPath)});
@@ -576,6 +588,50 @@ void NixRepl::loadFile(const Path & path)
 }
 
 
+/* Snapshots contain the variables in scope as an attribute set and
+   the loaded files as a list, so that `:r' still works after loading
+   a snapshot. */
+void NixRepl::loadSnapshot(const Path & path)
+{
+    auto roots = readEvalSnapshot(*state, path);
+    auto vars = roots.find("vars");
+    auto files = roots.find("files");
+    if (vars == roots.end() || files == roots.end())
+        throw Error("'%s' is not a snapshot of a REPL session", path);
+
+    state->forceList(*files->second);
+    for (unsigned int n = 0; n < files->second->listSize(); ++n) {
+        auto file = state->forceStringNoCtx(*files->second->listElems()[n]);
+        loadedFiles.remove(file);
+        loadedFiles.push_back(file);
+    }
+
+    addAttrsToScope(*vars->second);
+}
+
+
+void NixRepl::saveSnapshot(const Path & path)
+{
+    if (path.empty())
+        throw Error("':save' requires a file name");
+
+    Value vVars;
+    state->mkAttrs(vVars, staticEnv.vars.size());
+    for (auto & [name, displ] : staticEnv.vars)
+        vVars.attrs->push_back(Attr(name, env->values[displ]));
+    vVars.attrs->sort();
+
+    Value vFiles;
+    state->mkList(vFiles, loadedFiles.size());
+    unsigned int n = 0;
+    for (auto & file : loadedFiles)
+        mkString(*(vFiles.listElems()[n++] = state->allocValue()), file);
+
+    writeEvalSnapshot(*state, {{"vars", &vVars}, {"files", &vFiles}}, absPath(path));
+    std::cout << format("Saved %1% variables.") % vVars.attrs->size() << std::endl;
+}
+
+
 void NixRepl::initEnv()
 {
     env = &state->allocEnv(envSize);
@@ -701,7 +757,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
             str << "«derivation ";
             Bindings::iterator i = v.attrs->find(state->sDrvPath);
             PathSet context;
-            Path drvPath = i != v.attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "???";
+            Path drvPath = i != v.attrs->end() ? state->coerceToPath(i->pos, *i->value, context) : "???";
             str << drvPath << "»";
         }
 
@@ -761,7 +817,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
     case nFunction:
         if (v.isLambda()) {
             std::ostringstream s;
-            s << v.lambda.fun->pos;
+            s << state->positions[v.lambda.fun->pos];
             str << ANSI_BLUE "«lambda @ " << filterANSIEscapes(s.str()) << "»" ANSI_NORMAL;
         } else if (v.isPrimOp()) {
             str << ANSI_MAGENTA "«primop»" ANSI_NORMAL;
@@ -787,9 +843,18 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
 struct CmdRepl : StoreCommand, MixEvalArgs
 {
     std::vector<std::string> files;
+    std::optional<Path> snapshot;
 
     CmdRepl()
     {
+        addFlag({
+            .longName = "snapshot",
+            .description = "Start with the variables saved in *path* by the `:save` command.",
+            .labels = {"path"},
+            .handler = {&snapshot},
+            .completer = completePath
+        });
+
         expectArgs({
             .label = "files",
             .handler = {&files},
@@ -814,7 +879,7 @@ struct CmdRepl : StoreCommand, MixEvalArgs
         evalSettings.pureEval = false;
         auto repl = std::make_unique<NixRepl>(searchPath, openStore());
         repl->autoArgs = getAutoArgs(*repl->state);
-        repl->mainLoop(files);
+        repl->mainLoop(files, snapshot);
     }
 };
 
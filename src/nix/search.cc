@@ -9,6 +9,8 @@
 #include "shared.hh"
 #include "eval-cache.hh"
 #include "attr-path.hh"
+#include "installables.hh"
+#include "flake/flake.hh"
 
 #include <regex>
 #include <fstream>
@@ -30,6 +32,42 @@ std::string hilite(const std::string & s, const std::smatch & m, std::string pos
           + std::string(m.suffix());
 }
 
+/* A search index records the attribute path, name, version and
+   description of every package found by a search, so that later
+   searches of the same locked flake don't need to evaluate anything.
+   Each package is stored on a line, with its fields separated by NUL
+   characters. */
+struct SearchEntry
+{
+    std::string attrPath, pname, version, description;
+};
+
+static void appendEntry(std::string & index, const SearchEntry & entry)
+{
+    index.append(entry.attrPath).push_back(0);
+    index.append(entry.pname).push_back(0);
+    index.append(entry.version).push_back(0);
+    index.append(entry.description).push_back('\n');
+}
+
+/* Returns nothing if the index is corrupt (e.g. truncated). */
+static std::optional<std::vector<SearchEntry>> parseSearchIndex(std::string_view index)
+{
+    std::vector<SearchEntry> entries;
+    while (!index.empty()) {
+        SearchEntry entry;
+        for (auto field : {&entry.attrPath, &entry.pname, &entry.version, &entry.description}) {
+            auto end = index.find(field == &entry.description ? '\n' : '\0');
+            if (end == index.npos)
+                return std::nullopt;
+            *field = index.substr(0, end);
+            index.remove_prefix(end + 1);
+        }
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
 struct CmdSearch : InstallableCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -81,6 +119,76 @@ struct CmdSearch : InstallableCommand, MixJSON
 
         uint64_t results = 0;
 
+        auto show = [&](const SearchEntry & entry)
+        {
+            size_t found = 0;
+
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
+
+            for (auto & regex : regexes) {
+                std::regex_search(entry.attrPath, attrPathMatch, regex);
+                std::regex_search(entry.pname, nameMatch, regex);
+                std::regex_search(entry.description, descriptionMatch, regex);
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                    found++;
+            }
+
+            if (found == res.size()) {
+                results++;
+                if (json) {
+                    auto jsonElem = jsonOut->object(entry.attrPath);
+                    jsonElem.attr("pname", entry.pname);
+                    jsonElem.attr("version", entry.version);
+                    jsonElem.attr("description", entry.description);
+                } else {
+                    if (results > 1) logger->cout("");
+                    logger->cout(
+                        "* %s%s",
+                        wrap("\e[0;1m", hilite(entry.attrPath, attrPathMatch, "\e[0;1m")),
+                        entry.version != "" ? " (" + entry.version + ")" : "");
+                    if (entry.description != "")
+                        logger->cout(
+                            "  %s", hilite(entry.description, descriptionMatch, ANSI_NORMAL));
+                }
+            }
+        };
+
+        /* Use the search index of a locked flake if it exists, and
+           otherwise create it while walking the packages. This is
+           only done if the evaluation cache is used, since otherwise
+           the flake may not evaluate to the same packages every
+           time. */
+        std::optional<Path> indexPath;
+        std::string newIndex;
+
+        if (auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable);
+            flake && evalSettings.useEvalCache && evalSettings.pureEval)
+        {
+            auto key = hashString(htSHA256,
+                fmt("%s;%s",
+                    flake->getLockedFlake()->getFingerprint().to_string(Base16, false),
+                    concatStringsSep(";", flake->getActualAttrPaths())));
+            indexPath = getCacheDir() + "/nix/search-index-v1/" + key.to_string(Base32, false);
+
+            if (pathExists(*indexPath)) {
+                /* A corrupt index is treated as missing, and is
+                   replaced below. */
+                if (auto entries = parseSearchIndex(readFile(*indexPath))) {
+                    debug("using search index '%s'", *indexPath);
+                    for (auto & entry : *entries)
+                        show(entry);
+                    if (!json && !results)
+                        throw Error("no results for the given search term(s)!");
+                    return;
+                }
+                warn("search index '%s' is corrupt; rebuilding it", *indexPath);
+            }
+        }
+
         std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)> visit;
 
         visit = [&](eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)
@@ -99,49 +207,23 @@ struct CmdSearch : InstallableCommand, MixJSON
                 };
 
                 if (cursor.isDerivation()) {
-                    size_t found = 0;
-
                     DrvName name(cursor.getAttr("name")->getString());
 
                     auto aMeta = cursor.maybeGetAttr("meta");
                     auto aDescription = aMeta ? aMeta->maybeGetAttr("description") : nullptr;
                     auto description = aDescription ? aDescription->getString() : "";
                     std::replace(description.begin(), description.end(), '\n', ' ');
-                    auto attrPath2 = concatStringsSep(".", attrPath);
-
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-
-                    for (auto & regex : regexes) {
-                        std::regex_search(attrPath2, attrPathMatch, regex);
-                        std::regex_search(name.name, nameMatch, regex);
-                        std::regex_search(description, descriptionMatch, regex);
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                            found++;
-                    }
 
-                    if (found == res.size()) {
-                        results++;
-                        if (json) {
-                            auto jsonElem = jsonOut->object(attrPath2);
-                            jsonElem.attr("pname", name.name);
-                            jsonElem.attr("version", name.version);
-                            jsonElem.attr("description", description);
-                        } else {
-                            auto name2 = hilite(name.name, nameMatch, "\e[0;2m");
-                            if (results > 1) logger->cout("");
-                            logger->cout(
-                                "* %s%s",
-                                wrap("\e[0;1m", hilite(attrPath2, attrPathMatch, "\e[0;1m")),
-                                name.version != "" ? " (" + name.version + ")" : "");
-                            if (description != "")
-                                logger->cout(
-                                    "  %s", hilite(description, descriptionMatch, ANSI_NORMAL));
-                        }
-                    }
+                    SearchEntry entry {
+                        concatStringsSep(".", attrPath),
+                        name.name,
+                        name.version,
+                        description
+                    };
+
+                    if (indexPath) appendEntry(newIndex, entry);
+
+                    show(entry);
                 }
 
                 else if (
@@ -168,6 +250,18 @@ struct CmdSearch : InstallableCommand, MixJSON
         for (auto & [cursor, prefix] : installable->getCursors(*state))
             visit(*cursor, parseAttrPath(*state, prefix), true);
 
+        if (indexPath) {
+            try {
+                createDirs(dirOf(*indexPath));
+                auto tmp = *indexPath + ".tmp-" + std::to_string(getpid());
+                writeFile(tmp, newIndex);
+                if (rename(tmp.c_str(), indexPath->c_str()) == -1)
+                    throw SysError("renaming '%s' to '%s'", tmp, *indexPath);
+            } catch (SysError & e) {
+                warn("cannot write search index: %s", e.msg());
+            }
+        }
+
         if (!json && !results)
             throw Error("no results for the given search term(s)!");
     }
@@ -0,0 +1,37 @@
+#include "command.hh"
+#include "binary-cache-store.hh"
+
+using namespace nix;
+
+struct CmdStoreAddDelta : StoreCommand
+{
+    Path base, target;
+
+    CmdStoreAddDelta()
+    {
+        expectArg("base", &base);
+        expectArg("target", &target);
+    }
+
+    std::string description() override
+    {
+        return "add a delta between two store paths to a binary cache";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-add-delta.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto binaryCache = store.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!binaryCache)
+            throw UsageError("'%s' is not a binary cache", store->getUri());
+        binaryCache->addDelta(store->parseStorePath(base), store->parseStorePath(target));
+    }
+};
+
+static auto rStoreAddDelta = registerCommand2<CmdStoreAddDelta>({"store", "add-delta"});
@@ -0,0 +1,65 @@
+#include "command.hh"
+#include "store-api.hh"
+
+using namespace nix;
+
+struct CmdStoreExportBundle : StorePathsCommand
+{
+    Path output;
+    std::string compression = "zstd";
+
+    CmdStoreExportBundle()
+        : StorePathsCommand(true)
+    {
+        addFlag({
+            .longName = "output",
+            .shortName = 'o',
+            .description = "Write the bundle to *path*.",
+            .labels = {"path"},
+            .handler = {&output},
+        });
+
+        addFlag({
+            .longName = "compression",
+            .description = "Compress the NAR of every path with *method* (`zstd`, `xz`, `bzip2`, `br` or `none`).",
+            .labels = {"method"},
+            .handler = {&compression},
+        });
+    }
+
+    std::string description() override
+    {
+        return "write the closure of store paths to a bundle file";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-export-bundle.md"
+          ;
+    }
+
+    void run(ref<Store> store, StorePaths storePaths) override
+    {
+        if (output.empty())
+            throw UsageError("'--output' is required");
+
+        auto tmp = absPath(output) + ".tmp";
+        AutoDelete deleteTmp(tmp, false);
+
+        {
+            AutoCloseFD fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (!fd)
+                throw SysError("creating '%s'", tmp);
+            FdSink sink(fd.get());
+            store->exportBundle(StorePathSet(storePaths.begin(), storePaths.end()), sink, compression);
+            sink.flush();
+        }
+
+        if (rename(tmp.c_str(), absPath(output).c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, output);
+        deleteTmp.cancel();
+    }
+};
+
+static auto rStoreExportBundle = registerCommand2<CmdStoreExportBundle>({"store", "export-bundle"});
@@ -0,0 +1,42 @@
+#include "command.hh"
+#include "store-api.hh"
+
+using namespace nix;
+
+struct CmdStoreImportBundle : StoreCommand
+{
+    Path bundle;
+
+    CheckSigsFlag checkSigs = CheckSigs;
+
+    CmdStoreImportBundle()
+    {
+        expectArg("bundle", &bundle);
+
+        addFlag({
+            .longName = "no-check-sigs",
+            .description = "Do not require that paths are signed by trusted keys.",
+            .handler = {&checkSigs, NoCheckSigs},
+        });
+    }
+
+    std::string description() override
+    {
+        return "import the store paths in a bundle file";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-import-bundle.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        for (auto & path : store->importBundle(absPath(bundle), checkSigs))
+            logger->cout(store->printStorePath(path));
+    }
+};
+
+static auto rStoreImportBundle = registerCommand2<CmdStoreImportBundle>({"store", "import-bundle"});
@@ -19,8 +19,7 @@ struct CmdStoreRepair : StorePathsCommand
 
     void run(ref<Store> store, std::vector<StorePath> storePaths) override
     {
-        for (auto & path : storePaths)
-            store->repairPath(path);
+        store->repairPaths(StorePathSet(storePaths.begin(), storePaths.end()));
     }
 };
 
@@ -0,0 +1,50 @@
+#include "command.hh"
+#include "debuginfo-server.hh"
+
+using namespace nix;
+
+struct CmdStoreServeDebugInfo : StoreCommand
+{
+    std::string listenAddress = "127.0.0.1";
+    uint16_t port = 8002;
+
+    CmdStoreServeDebugInfo()
+    {
+        addFlag({
+            .longName = "listen-address",
+            .description = "IPv4 address on which to serve debug info files (`0.0.0.0` for all interfaces).",
+            .labels = {"address"},
+            .handler = {&listenAddress},
+        });
+
+        addFlag({
+            .longName = "port",
+            .description = "TCP port on which to serve debug info files.",
+            .labels = {"port"},
+            .handler = {&port},
+        });
+    }
+
+    std::string description() override
+    {
+        return "serve the debug info files in a binary cache to debuggers";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-serve-debuginfo.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto binaryCacheStore = store.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!binaryCacheStore)
+            throw UsageError("'nix store serve-debuginfo' requires a binary cache store");
+
+        serveDebugInfo(ref<BinaryCacheStore>(binaryCacheStore), listenAddress, port, getCacheDir() + "/nix/debuginfo");
+    }
+};
+
+static auto rStoreServeDebugInfo = registerCommand2<CmdStoreServeDebugInfo>({"store", "serve-debuginfo"});
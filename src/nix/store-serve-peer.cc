@@ -0,0 +1,68 @@
+#include "command.hh"
+#include "peer-store.hh"
+
+using namespace nix;
+
+struct CmdStoreServePeer : StoreCommand
+{
+    std::string listenAddress = "127.0.0.1";
+    uint16_t port = 5381;
+    uint16_t discoveryPort = defaultPeerDiscoveryPort;
+    Path secretKeyFile;
+
+    CmdStoreServePeer()
+    {
+        addFlag({
+            .longName = "listen-address",
+            .description = "IPv4 address on which to serve peers (`0.0.0.0` for all interfaces).",
+            .labels = {"address"},
+            .handler = {&listenAddress},
+        });
+
+        addFlag({
+            .longName = "port",
+            .description = "TCP port on which to serve store paths.",
+            .labels = {"port"},
+            .handler = {&port},
+        });
+
+        addFlag({
+            .longName = "discovery-port",
+            .description = "UDP port on which to answer discovery requests.",
+            .labels = {"port"},
+            .handler = {&discoveryPort},
+        });
+
+        addFlag({
+            .longName = "key-file",
+            .shortName = 'k',
+            .description = "File containing the secret key with which to sign served paths.",
+            .labels = {"file"},
+            .handler = {&secretKeyFile},
+            .completer = completePath
+        });
+    }
+
+    std::string description() override
+    {
+        return "serve the Nix store to peers on the local network";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-serve-peer.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        std::optional<SecretKey> secretKey;
+        if (!secretKeyFile.empty())
+            secretKey = SecretKey(readFile(secretKeyFile));
+
+        servePeer(store, listenAddress, discoveryPort, port, secretKey);
+    }
+};
+
+static auto rStoreServePeer = registerCommand2<CmdStoreServePeer>({"store", "serve-peer"});
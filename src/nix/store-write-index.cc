@@ -0,0 +1,29 @@
+#include "command.hh"
+#include "binary-cache-store.hh"
+
+using namespace nix;
+
+struct CmdStoreWriteIndex : StoreCommand
+{
+    std::string description() override
+    {
+        return "write the index of valid paths of a binary cache";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-write-index.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto binaryCache = store.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!binaryCache)
+            throw UsageError("'%s' is not a binary cache", store->getUri());
+        binaryCache->writeIndex();
+    }
+};
+
+static auto rStoreWriteIndex = registerCommand2<CmdStoreWriteIndex>({"store", "write-index"});
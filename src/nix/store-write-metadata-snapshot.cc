@@ -0,0 +1,36 @@
+#include "command.hh"
+#include "local-store.hh"
+
+using namespace nix;
+
+struct CmdStoreWriteMetadataSnapshot : StoreCommand
+{
+    Path path;
+
+    CmdStoreWriteMetadataSnapshot()
+    {
+        expectArg("path", &path);
+    }
+
+    std::string description() override
+    {
+        return "write a read-only snapshot of the metadata of the valid paths in a local store";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-write-metadata-snapshot.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto localStore = store.dynamic_pointer_cast<LocalStore>();
+        if (!localStore)
+            throw UsageError("'%s' is not a local store", store->getUri());
+        localStore->writeMetadataSnapshot(absPath(path));
+    }
+};
+
+static auto rStoreWriteMetadataSnapshot = registerCommand2<CmdStoreWriteMetadataSnapshot>({"store", "write-metadata-snapshot"});
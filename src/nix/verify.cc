@@ -4,15 +4,130 @@
 #include "sync.hh"
 #include "thread-pool.hh"
 #include "references.hh"
+#include "local-fs-store.hh"
+#include "sqlite.hh"
 
 #include <atomic>
 
 using namespace nix;
 
+static const char * schema = R"sql(
+
+create table if not exists Verified (
+    store       text not null,
+    hashPart    text not null,
+    narHash     text not null,
+    fingerprint text not null,
+    timestamp   integer not null,
+    primary key (store, hashPart)
+);
+)sql";
+
+/* A record of the store paths whose contents have been verified,
+   together with a fingerprint of their metadata at the time. This
+   lets `--incremental' skip the paths that haven't changed since. */
+struct VerifyCache
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt add, lookup;
+    };
+
+    Sync<State> _state;
+
+    std::string storeUri;
+
+    VerifyCache(const std::string & storeUri)
+        : storeUri(storeUri)
+    {
+        auto state(_state.lock());
+
+        auto dbPath = getCacheDir() + "/nix/verify-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+        state->db.isCache();
+        state->db.exec("pragma main.journal_mode = wal");
+        state->db.exec(schema);
+
+        state->add.create(state->db,
+            "insert or replace into Verified(store, hashPart, narHash, fingerprint, timestamp) values (?, ?, ?, ?, ?)");
+
+        state->lookup.create(state->db,
+            "select narHash, fingerprint from Verified where store = ? and hashPart = ?");
+    }
+
+    bool isVerified(const ValidPathInfo & info, const Hash & fingerprint)
+    {
+        auto state(_state.lock());
+        auto q(state->lookup.use()(storeUri)(info.path.hashPart()));
+        return q.next()
+            && q.getStr(0) == info.narHash.to_string(Base32, true)
+            && q.getStr(1) == fingerprint.to_string(Base32, false);
+    }
+
+    void add(const ValidPathInfo & info, const Hash & fingerprint)
+    {
+        auto state(_state.lock());
+        state->add.use()
+            (storeUri)
+            (info.path.hashPart())
+            (info.narHash.to_string(Base32, true))
+            (fingerprint.to_string(Base32, false))
+            (time(0)).exec();
+    }
+};
+
+/* Compute a fingerprint of the store path at 'path' from the metadata
+   of its files, without reading their contents. Returns nothing if a
+   file was changed so recently that a subsequent change might not be
+   visible in its metadata. */
+static std::optional<Hash> fingerprintStorePath(const Path & path)
+{
+    HashSink sink(htSHA256);
+    time_t now = time(0);
+    bool racy = false;
+
+    std::function<void(const Path &, const std::string &)> walk;
+    walk = [&](const Path & path, const std::string & relPath) {
+        checkInterrupt();
+
+        auto st = lstat(path);
+
+        if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1)
+            racy = true;
+
+        sink << relPath
+             << (uint64_t) st.st_mode
+             << (uint64_t) st.st_size
+             << (uint64_t) st.st_ino
+             << (uint64_t) st.st_mtime
+             << (uint64_t) st.st_ctime;
+
+        if (S_ISDIR(st.st_mode)) {
+            std::vector<std::string> names;
+            for (auto & entry : readDirectory(path))
+                names.push_back(entry.name);
+            std::sort(names.begin(), names.end());
+            for (auto & name : names)
+                walk(path + "/" + name, relPath + "/" + name);
+            sink << "";
+        }
+    };
+
+    walk(path, "");
+
+    if (racy) return std::nullopt;
+
+    return sink.finish().first;
+}
+
 struct CmdVerify : StorePathsCommand
 {
     bool noContents = false;
     bool noTrust = false;
+    bool incremental = false;
     Strings substituterUris;
     size_t sigsNeeded = 0;
 
@@ -30,6 +145,12 @@ struct CmdVerify : StorePathsCommand
             .handler = {&noTrust, true},
         });
 
+        addFlag({
+            .longName = "incremental",
+            .description = "Do not verify the contents of store paths that were verified by a previous run and have not changed since.",
+            .handler = {&incremental, true},
+        });
+
         addFlag({
             .longName = "substituter",
             .shortName = 's',
@@ -79,23 +200,42 @@ struct CmdVerify : StorePathsCommand
             act.progress(done, storePaths.size(), active, failed);
         };
 
+        std::shared_ptr<LocalFSStore> localStore;
+        std::unique_ptr<VerifyCache> verifyCache;
+        if (incremental && !noContents) {
+            localStore = store.dynamic_pointer_cast<LocalFSStore>();
+            if (!localStore)
+                throw UsageError("'--incremental' requires a local store");
+            verifyCache = std::make_unique<VerifyCache>(store->getUri());
+        }
+
         ThreadPool pool;
 
-        auto doPath = [&](const Path & storePath) {
+        auto checkPath = [&](ref<const ValidPathInfo> info) {
             try {
                 checkInterrupt();
 
                 MaintainCount<std::atomic<size_t>> mcActive(active);
                 update();
 
-                auto info = store->queryPathInfo(store->parseStorePath(storePath));
-
                 // Note: info->path can be different from storePath
                 // for binary cache stores when using --all (since we
                 // can't enumerate names efficiently).
                 Activity act2(*logger, lvlInfo, actUnknown, fmt("checking '%s'", store->printStorePath(info->path)));
 
-                if (!noContents) {
+                /* The fingerprint must be computed before hashing,
+                   so that changes made while hashing will be
+                   noticed by the next run. */
+                std::optional<Hash> fingerprint;
+                bool unchanged = false;
+                if (verifyCache) {
+                    fingerprint = fingerprintStorePath(localStore->toRealPath(store->printStorePath(info->path)));
+                    unchanged = fingerprint && verifyCache->isVerified(*info, *fingerprint);
+                    if (unchanged)
+                        debug("skipping unchanged path '%s'", store->printStorePath(info->path));
+                }
+
+                if (!noContents && !unchanged) {
 
                     std::unique_ptr<AbstractHashSink> hashSink;
                     if (!info->ca)
@@ -114,7 +254,8 @@ struct CmdVerify : StorePathsCommand
                             store->printStorePath(info->path),
                             info->narHash.to_string(Base32, true),
                             hash.first.to_string(Base32, true));
-                    }
+                    } else if (verifyCache && fingerprint)
+                        verifyCache->add(*info, *fingerprint);
                 }
 
                 if (!noTrust) {
@@ -176,8 +317,22 @@ struct CmdVerify : StorePathsCommand
             update();
         };
 
+        /* Query the path info of all paths first, and then check the
+           biggest paths first, so that the last few paths don't keep
+           one thread busy while the others are idle. */
         for (auto & storePath : storePaths)
-            pool.enqueue(std::bind(doPath, store->printStorePath(storePath)));
+            pool.enqueue([&, storePath(store->printStorePath(storePath))]() {
+                try {
+                    checkInterrupt();
+                    auto info = store->queryPathInfo(store->parseStorePath(storePath));
+                    pool.enqueue(std::bind(checkPath, info),
+                        (int) std::min(info->narSize >> 20, (uint64_t) std::numeric_limits<int>::max() - 1));
+                } catch (Error & e) {
+                    logError(e.info());
+                    failed++;
+                    update();
+                }
+            }, std::numeric_limits<int>::max());
 
         pool.process();
 
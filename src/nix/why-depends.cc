@@ -175,6 +175,35 @@ struct CmdWhyDepends : SourceExprCommand
                contain the reference. */
             std::map<std::string, Strings> hits;
 
+            auto getColour = [&](const std::string & hash) {
+                return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
+            };
+
+            /* Use the positions recorded when the path was built, if
+               any. References that have no recorded positions are
+               searched for in the contents below. */
+            if (auto positions = store->queryReferencePositions(node.path)) {
+                for (auto & [ref, poss] : *positions) {
+                    std::string hash(ref.hashPart());
+                    if (!hashes.count(hash)) continue;
+                    hashes.erase(hash);
+                    auto sorted = poss;
+                    std::sort(sorted.begin(), sorted.end(),
+                        [](const ReferencePosition & a, const ReferencePosition & b) { return a.file < b.file; });
+                    for (auto & pos : sorted) {
+                        auto p2 = pos.file == "" ? "/" : std::string(pos.file, 1);
+                        auto i = pos.excerpt.find(hash);
+                        if (i == std::string::npos) continue;
+                        if (pos.symlink)
+                            hits[hash].emplace_back(fmt("%s -> %s\n", p2,
+                                    hilite(pos.excerpt, i, StorePath::HashLen, getColour(hash))));
+                        else
+                            hits[hash].emplace_back(fmt("%s: …%s…\n", p2,
+                                    hilite(pos.excerpt, i, StorePath::HashLen, getColour(hash))));
+                    }
+                }
+            }
+
             std::function<void(const Path &)> visitPath;
 
             visitPath = [&](const Path & p) {
@@ -182,10 +211,6 @@ struct CmdWhyDepends : SourceExprCommand
 
                 auto p2 = p == pathS ? "/" : std::string(p, pathS.size() + 1);
 
-                auto getColour = [&](const std::string & hash) {
-                    return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
-                };
-
                 if (st.type == FSAccessor::Type::tDirectory) {
                     auto names = accessor->readDirectory(p);
                     for (auto & name : names)
@@ -224,7 +249,8 @@ struct CmdWhyDepends : SourceExprCommand
 
             // FIXME: should use scanForReferences().
 
-            visitPath(pathS);
+            if (!hashes.empty())
+                visitPath(pathS);
 
             RunPager pager;
             for (auto & ref : refs) {
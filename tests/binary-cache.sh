@@ -52,11 +52,44 @@ basicDownloadTests() {
 basicDownloadTests
 
 
+# Substitution still works when substitute info is prefetched during
+# evaluation.
+clearStore
+clearCacheCache
+nix-build --option prefetch-substitutes true --substituters "file://$cacheDir" --no-require-sigs dependencies.nix --no-out-link
+nix-store --check-validity $outPath
+
+
 # Test HttpBinaryCacheStore.
 export _NIX_FORCE_HTTP=1
 basicDownloadTests
 
 
+# Substitute info prefetched during evaluation ends up in the NAR info
+# disk cache, so a later build doesn't need the .narinfo files. With a
+# daemon, the daemon does the prefetching.
+prefetchTest() {
+    nix-instantiate --option prefetch-substitutes true --substituters "file://$cacheDir" dependencies.nix
+    mkdir -p $TEST_ROOT/narinfos
+    mv $cacheDir/*.narinfo $TEST_ROOT/narinfos/
+    nix-build -j0 --substituters "file://$cacheDir" --no-require-sigs dependencies.nix --no-out-link
+    mv $TEST_ROOT/narinfos/*.narinfo $cacheDir/
+}
+
+clearStore
+clearCacheCache
+prefetchTest
+
+clearStore
+clearCacheCache
+NIX_CONFIG="substituters = file://$cacheDir
+require-sigs = false
+max-jobs = 0" startDaemon
+prefetchTest
+killDaemon
+unset NIX_REMOTE
+
+
 # Test whether Nix notices if the NAR doesn't match the hash in the NAR info.
 clearStore
 
@@ -239,7 +272,32 @@ nix copy --to "file://$cacheDir?index-debug-info=1&compression=none" $outPath
 
 diff -u \
     <(cat $cacheDir/debuginfo/02623eda209c26a59b1a8638ff7752f6b945c26b.debug | jq -S) \
-    <(echo '{"archive":"../nar/100vxs724qr46phz8m24iswmg9p3785hsyagz0kchf6q6gf06sw6.nar","member":"lib/debug/.build-id/02/623eda209c26a59b1a8638ff7752f6b945c26b.debug"}' | jq -S)
+    <(echo '{"archive":"../nar/100vxs724qr46phz8m24iswmg9p3785hsyagz0kchf6q6gf06sw6.nar","member":"lib/debug/.build-id/02/623eda209c26a59b1a8638ff7752f6b945c26b.debug","path":"'$outPath'"}' | jq -S)
+
+# Serve the indexed debug info files over the debuginfod protocol.
+if [[ -n $(type -p curl) ]]; then
+    port=$((20000 + RANDOM % 10000))
+    rm -rf $TEST_HOME/.cache/nix/debuginfo
+    nix store serve-debuginfo --store "file://$cacheDir" --port $port &
+    serverPid=$!
+    for i in $(seq 1 50); do
+        curl -s http://127.0.0.1:$port/ > /dev/null && break
+        sleep 0.1
+    done
+
+    # A client that never sends its request doesn't stop others from
+    # being served.
+    exec 5<>/dev/tcp/127.0.0.1/$port
+
+    [[ $(curl -sf http://127.0.0.1:$port/buildid/02623eda209c26a59b1a8638ff7752f6b945c26b/debuginfo) = foo ]]
+    [[ -e $TEST_HOME/.cache/nix/debuginfo/02623eda209c26a59b1a8638ff7752f6b945c26b.debug ]]
+    [[ $(curl -s -o /dev/null -w '%{http_code}' http://127.0.0.1:$port/buildid/0000000000000000000000000000000000000000/debuginfo) = 404 ]]
+    [[ $(curl -s -o /dev/null -w '%{http_code}' http://127.0.0.1:$port/nar/foo) = 404 ]]
+
+    exec 5>&-
+    kill -9 $serverPid
+    wait $serverPid || true
+fi
 
 # Test against issue https://github.com/NixOS/nix/issues/3964
 #
@@ -271,3 +329,84 @@ nix-store --delete $outPath $docPath
 # -vvv is the level that logs during the loop
 timeout 60 nix-build --no-out-link -E "$expr" --option substituters "file://$cacheDir" \
   --option trusted-binary-caches "file://$cacheDir"  --no-require-sigs
+
+
+# Test writing the index of valid paths.
+nix store write-index --store "file://$cacheDir"
+xzcat $cacheDir/nix-cache-index.xz | grep -q "^$(hashpart $outPath)$"
+(! xzcat $cacheDir/nix-cache-index.xz | grep -q "^$(hashpart $docPath)$")
+
+# Paths added after the index was written can still be substituted.
+stalePaths=()
+for i in 1 2; do
+    echo "stale $i" > $TEST_ROOT/stale-$i
+    stalePaths+=($(nix-store --add $TEST_ROOT/stale-$i))
+done
+nix copy --to "file://$cacheDir" "${stalePaths[@]}"
+(! xzcat $cacheDir/nix-cache-index.xz | grep -q "^$(hashpart ${stalePaths[0]})$")
+nix-store --delete "${stalePaths[@]}"
+nix-store -r "${stalePaths[@]}" --option substituters "file://$cacheDir" --no-require-sigs
+
+# The same goes for HTTP caches, whose index is kept in the NAR info
+# disk cache.
+if [[ -n $(type -p python3) ]]; then
+    port=$((20000 + RANDOM % 10000))
+    (cd $cacheDir && exec python3 -m http.server --bind 127.0.0.1 $port) > /dev/null 2>&1 &
+    httpPid=$!
+    for i in $(seq 1 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$port) 2> /dev/null && break
+        sleep 0.1
+    done
+
+    nix store write-index --store "file://$cacheDir"
+
+    # Substituting several paths fetches the index.
+    nix-store --delete "${stalePaths[@]}"
+    nix-store -r "${stalePaths[@]}" --option substituters "http://127.0.0.1:$port" --no-require-sigs
+
+    newPaths=()
+    for i in 1 2; do
+        echo "new $i" > $TEST_ROOT/new-$i
+        newPaths+=($(nix-store --add $TEST_ROOT/new-$i))
+    done
+    nix copy --to "file://$cacheDir" "${newPaths[@]}"
+    nix-store --delete "${newPaths[@]}"
+    nix-store -r "${newPaths[@]}" --option substituters "http://127.0.0.1:$port" --no-require-sigs
+
+    kill $httpPid
+    wait $httpPid || true
+fi
+
+
+# Test the Bloom filter of valid paths. A path whose .narinfo was
+# added behind Nix's back is missing from the filter, so it's
+# reported as invalid unless the filter is ignored.
+bloomCache=$TEST_ROOT/bloom-cache
+rm -rf $bloomCache
+nix copy --to "file://$bloomCache" $docPath
+nix store write-index --store "file://$bloomCache?bloom-filter-capacity=100"
+[ -e $bloomCache/nix-cache-bloom ]
+[ -s $bloomCache/nix-cache-bloom-generation ]
+nix path-info --store "file://$bloomCache" $docPath
+cp $cacheDir/$(hashpart $outPath).narinfo $bloomCache/
+(! nix path-info --store "file://$bloomCache" $outPath)
+nix path-info --store "file://$bloomCache?use-index=false" $outPath
+
+# Adding paths, even concurrently, invalidates the filter instead of
+# updating it, so none of them are reported as missing.
+nix store write-index --store "file://$bloomCache"
+[ -s $bloomCache/nix-cache-bloom-generation ]
+bloomPaths=()
+for i in 1 2 3 4; do
+    echo "bloom $i" > $TEST_ROOT/bloom-$i
+    bloomPaths+=($(nix-store --add $TEST_ROOT/bloom-$i))
+done
+for p in "${bloomPaths[@]}"; do
+    nix copy --to "file://$bloomCache" $p &
+done
+wait
+[ ! -s $bloomCache/nix-cache-bloom-generation ]
+nix path-info --store "file://$bloomCache" "${bloomPaths[@]}"
+nix store write-index --store "file://$bloomCache"
+[ -s $bloomCache/nix-cache-bloom-generation ]
+nix path-info --store "file://$bloomCache" "${bloomPaths[@]}"
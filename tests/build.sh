@@ -10,3 +10,28 @@ nix build -f multiple-outputs.nix --json a.all b.all | jq --exit-status '
     (.drvPath | match(".*multiple-outputs-b.drv")) and
     (.outputs.out | match(".*multiple-outputs-b")))
 '
+
+# Pipelined builds give the same result.
+nix build -f multiple-outputs.nix --json --no-link --pipelined-builds a.all b.all | jq --exit-status '
+  (.[0].outputs.first | match(".*multiple-outputs-a-first"))
+  and (.[1].outputs.out | match(".*multiple-outputs-b"))
+'
+
+# Evaluation errors are still reported when builds are pipelined.
+expect 1 nix build -f multiple-outputs.nix --no-link --pipelined-builds a.all does-not-exist
+
+# The JSON output includes the measurements of the builds.
+clearStore
+nix build -f dependencies.nix --json --no-link | jq --exit-status '
+  (.[0].metrics.registrationTime >= 0) and (.[0].metrics.setupTime >= 0)
+'
+
+# NIX_SHOW_BUILD_STATS prints statistics about the goals of the build.
+clearStore
+NIX_SHOW_BUILD_STATS=1 nix-build dependencies.nix --no-out-link 2> $TEST_ROOT/build-stats.log
+sed -n '/^{/,$p' $TEST_ROOT/build-stats.log | jq --exit-status '
+  (.goals.derivations > 0) and (.goals.builds > 0) and (.goals.maxLive > 0)
+  and (.goals | has("substitutions"))
+  and (.bytes.derivationGoal > 0) and (.bytes.buildState > 0)
+  and (.bytes.goals >= .bytes.derivationGoal)
+'
@@ -0,0 +1,85 @@
+source common.sh
+
+clearStore
+
+# Derivations using the builtin builders that run in the Nix process.
+cat > $TEST_ROOT/builtin-builders.nix <<EOF
+rec {
+  hello = derivation {
+    name = "hello";
+    system = "builtin";
+    builder = "builtin:write-file";
+    text = "Hello";
+  };
+
+  script = derivation {
+    name = "script";
+    system = "builtin";
+    builder = "builtin:write-file";
+    text = "#! /bin/sh";
+    destination = "/bin/script";
+    executable = "1";
+  };
+
+  readme = derivation {
+    name = "readme";
+    system = "builtin";
+    builder = "builtin:write-file";
+    text = "Read me";
+    destination = "/share/readme";
+  };
+
+  concat = derivation {
+    name = "concat";
+    system = "builtin";
+    builder = "builtin:concat";
+    srcs = "\${hello} \${builtins.toFile "world" " world"}";
+  };
+
+  join = derivation {
+    name = "join";
+    system = "builtin";
+    builder = "builtin:symlink-join";
+    paths = "\${script} \${readme}";
+  };
+
+  # Sets \$out without declaring it as an output.
+  undeclared = derivation {
+    name = "undeclared";
+    system = "builtin";
+    builder = "builtin:write-file";
+    outputs = [ "dev" ];
+    out = "$TEST_ROOT/undeclared";
+    text = "Oops";
+  };
+
+  outside = derivation {
+    name = "outside";
+    system = "builtin";
+    builder = "builtin:concat";
+    srcs = "$TEST_ROOT/builtin-builders.nix";
+  };
+}
+EOF
+
+for opt in true false; do
+    clearStore
+
+    outPath=$(nix-build --no-out-link --option builtins-in-process $opt $TEST_ROOT/builtin-builders.nix -A concat)
+    [[ $(cat $outPath) = "Hello world" ]]
+
+    outPath=$(nix-build --no-out-link --option builtins-in-process $opt $TEST_ROOT/builtin-builders.nix -A join)
+    [[ -x $outPath/bin/script ]]
+    [[ $(cat $outPath/share/readme) = "Read me" ]]
+    [[ $(readlink $outPath/bin/script) = $(nix-build --no-out-link $TEST_ROOT/builtin-builders.nix -A script)/bin/script ]]
+done
+
+# A builtin running in the Nix process can't read paths that aren't inputs.
+(! nix-build --no-out-link $TEST_ROOT/builtin-builders.nix -A outside) 2>&1 | grep -q 'not an input'
+
+# Builtins only write to the outputs of the derivation, whatever its
+# environment says.
+for opt in true false; do
+    (! nix-build --no-out-link --option builtins-in-process $opt $TEST_ROOT/builtin-builders.nix -A undeclared) 2>&1 | grep -q "requires an output named 'out'"
+    [[ ! -e $TEST_ROOT/undeclared ]]
+done
@@ -0,0 +1,39 @@
+source common.sh
+
+# This needs a cgroup v2 hierarchy that we can write to.
+ownCgroup=/sys/fs/cgroup$(sed -n 's/^0:://p' /proc/self/cgroup)
+if [[ ! -e /sys/fs/cgroup/cgroup.controllers || ! -w $ownCgroup/cgroup.procs ]] \
+    || ! grep -q memory /sys/fs/cgroup/cgroup.controllers; then
+    echo "cgroup v2 is not writable; skipping cgroup tests"
+    exit 99
+fi
+
+clearStore
+
+# Run the builds from a cgroup of their own that contains this shell,
+# like nix-daemon.service contains the daemon.
+cgroup=$ownCgroup/nix-test-$$
+mkdir $cgroup
+echo $$ > $cgroup/cgroup.procs
+
+cleanup() {
+    echo $$ > $ownCgroup/cgroup.procs
+    rmdir $cgroup/nix-supervisor $cgroup
+}
+trap cleanup EXIT
+
+nix-build dependencies.nix --no-out-link --option use-cgroups true
+
+# Nix moved the processes of its cgroup into a leaf cgroup, so that the
+# memory controller could be enabled for the builds.
+grep -q nix-supervisor /proc/$$/cgroup
+[[ -z $(cat $cgroup/cgroup.procs) ]]
+grep -q memory $cgroup/cgroup.subtree_control
+
+# The cgroups of the builds are gone.
+(! ls -d $cgroup/nix-build-* 2> /dev/null)
+
+# Doing it again from inside the leaf cgroup uses the same parent.
+clearStore
+nix-build dependencies.nix --no-out-link --option use-cgroups true
+[[ ! -e $cgroup/nix-supervisor/nix-supervisor ]]
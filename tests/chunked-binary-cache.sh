@@ -0,0 +1,66 @@
+source common.sh
+
+clearStore
+clearCache
+
+cacheURI="file://$cacheDir?chunk-nars=true"
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to $cacheURI $outPath
+
+grep -q "Compression: chunked" $cacheDir/*.narinfo
+[[ -n $(ls $cacheDir/chunks) ]]
+
+HASH=$(nix hash path $outPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+HASH2=$(nix hash path $outPath)
+
+[[ $HASH = $HASH2 ]]
+
+# With a NAR listing, files can be read without fetching the whole NAR.
+clearCache
+clearCacheCache
+
+nix copy --to "$cacheURI&write-nar-listing=true" $outPath
+
+[[ $(nix store cat --store $cacheURI $outPath/foobar) = $(cat $outPath/foobar) ]]
+
+# Listing a directory doesn't need any chunks.
+rm -rf $cacheDir/chunks
+clearCacheCache
+nix store ls --store $cacheURI -l $outPath/ | grep -q foobar
+
+# With file hashes in the listing, substitute-from-links takes files
+# that are already in the store's .links directory from there.
+clearStore
+clearCache
+clearCacheCache
+
+rm -rf $TEST_ROOT/old $TEST_ROOT/new
+mkdir -p $TEST_ROOT/old/bin $TEST_ROOT/new/bin
+head -c 100000 /dev/urandom > $TEST_ROOT/old/bin/shared
+cp $TEST_ROOT/old/bin/shared $TEST_ROOT/new/bin/shared
+chmod +x $TEST_ROOT/old/bin/shared $TEST_ROOT/new/bin/shared
+echo old > $TEST_ROOT/old/version
+echo new > $TEST_ROOT/new/version
+ln -s bin/shared $TEST_ROOT/new/link
+
+oldPath=$(nix-store --add $TEST_ROOT/old)
+newPath=$(nix-store --add $TEST_ROOT/new)
+HASH=$(nix hash path $newPath)
+
+nix copy --to "$cacheURI&write-file-hashes=true" $newPath
+grep -q narHash $cacheDir/*.ls
+
+nix-store --delete $newPath
+nix-store --optimise
+
+nix copy --from $cacheURI $newPath --no-check-sigs --substitute-from-links -v 2>&1 | grep -q "reusing 1 files"
+
+[[ $(nix hash path $newPath) = $HASH ]]
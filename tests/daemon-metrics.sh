@@ -0,0 +1,35 @@
+source common.sh
+
+if [[ -z $(type -p curl) ]]; then
+    echo "curl not installed; skipping daemon metrics tests"
+    exit 99
+fi
+
+clearStore
+
+metricsSocket=$TEST_ROOT/daemon-metrics
+traceFile=$TEST_ROOT/daemon-trace
+
+NIX_CONFIG="metrics-socket = $metricsSocket
+daemon-trace-file = $traceFile" startDaemon
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix path-info $outPath
+
+curl -sf --unix-socket $metricsSocket http://localhost/metrics > $TEST_ROOT/metrics
+
+# Operations done by the forked connection processes are counted.
+grep -q '^nix_daemon_op_duration_seconds_count{op="QueryPathInfo"} [1-9]' $TEST_ROOT/metrics
+grep -q '^nix_daemon_op_duration_seconds_bucket{op="BuildPaths",le="+Inf"} [1-9]' $TEST_ROOT/metrics
+grep -q '^nix_daemon_connections_total [1-9]' $TEST_ROOT/metrics
+grep -q '^# TYPE nix_store_gc_lock_wait_seconds histogram' $TEST_ROOT/metrics
+
+# So are the statements executed on the Nix database.
+grep -q '^nix_store_sqlite_statements_total{sql="select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;"} [1-9]' $TEST_ROOT/metrics
+grep -q '^nix_store_sqlite_busy_waits_total [0-9]' $TEST_ROOT/metrics
+
+# Every request is traced.
+grep -q ' op=QueryPathInfo duration=[0-9.]* status=ok$' $traceFile
+grep -q ' op=BuildPaths duration=[0-9.]* status=ok$' $traceFile
+
+killDaemon
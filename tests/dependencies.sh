@@ -50,3 +50,14 @@ nix-store -q --referrers-closure "$input2OutPath" | grep "$outPath"
 # Check that the derivers are set properly.
 test $(nix-store -q --deriver "$outPath") = "$drvPath"
 nix-store -q --deriver "$input2OutPath" | grep -q -- "-input-2.drv"
+
+# The closure sizes of many paths computed at once must match the
+# sums of the NAR sizes of their closures.
+for p in $(nix-store -qR "$outPath"); do
+    expected=0
+    for q in $(nix-store -qR "$p"); do
+        expected=$((expected + $(nix path-info --json "$q" | jq '.[0].narSize')))
+    done
+    [[ $(nix path-info --json --closure-size -r "$outPath" | jq ".[] | select(.path == \"$p\") | .closureSize") = $expected ]]
+    nix path-info -rS "$outPath" | grep -q "^$p[[:space:]]*$expected\$"
+done
@@ -0,0 +1,22 @@
+with import ./config.nix;
+
+{ version }:
+
+let
+
+  dep = name: mkDerivation {
+    inherit name;
+    buildCommand = "mkdir $out; echo ${name} > $out/name";
+  };
+
+in
+
+mkDerivation {
+  name = "env";
+  buildCommand = ''
+    mkdir $out
+    echo ${dep "foo-${version}"} > $out/foo
+  '' + (if version == "1.0"
+    then "echo ${dep "bar-1.0"} > $out/bar"
+    else "echo ${dep "baz-3.0"} > $out/baz");
+}
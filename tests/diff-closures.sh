@@ -0,0 +1,26 @@
+source common.sh
+
+clearStore
+
+# Two generations of a profile, with a package that was upgraded, one
+# that was removed and one that was added.
+profile=$TEST_ROOT/diff-closures-profile
+nix-env -p $profile --set $(nix-build diff-closures.nix --argstr version 1.0 --no-out-link)
+nix-env -p $profile --set $(nix-build diff-closures.nix --argstr version 2.0 --no-out-link)
+
+summaries=$TEST_HOME/.cache/nix/closure-summaries-v1.sqlite
+rm -f $summaries
+
+# The output doesn't depend on whether the summaries come from the
+# cache.
+cold=$(nix store diff-closures $profile-1-link $profile-2-link)
+[[ -e $summaries ]]
+warm=$(nix store diff-closures $profile-1-link $profile-2-link)
+uncached=$(nix store diff-closures --option closure-summary-cache false $profile-1-link $profile-2-link)
+
+[[ $cold = "$warm" ]]
+[[ $cold = "$uncached" ]]
+
+echo "$cold" | grep -q 'foo: 1.0 → 2.0'
+echo "$cold" | grep -q 'bar: 1.0 → ∅'
+echo "$cold" | grep -q 'baz: ∅ → 3.0'
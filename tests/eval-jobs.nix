@@ -0,0 +1,23 @@
+with import ./config.nix;
+
+let
+  mk = name: mkDerivation {
+    inherit name;
+    buildCommand = "touch $out";
+    meta.description = "The ${name} package";
+  };
+in
+
+{
+  a = mk "a";
+  b = mk "b";
+  nested = {
+    recurseForDerivations = true;
+    c = mk "c";
+  };
+  hidden = {
+    d = mk "d";
+  };
+  broken = throw "this attribute is broken";
+  notADerivation = 42;
+}
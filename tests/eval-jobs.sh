@@ -0,0 +1,23 @@
+source common.sh
+
+clearStore
+
+nix eval-jobs -f eval-jobs.nix '' > $TEST_ROOT/jobs
+[[ $(wc -l < $TEST_ROOT/jobs) = 4 ]]
+[[ $(jq -r 'select(.attr == "nested.c") | .name' < $TEST_ROOT/jobs) = c ]]
+[[ $(jq -r 'select(.attr == "broken") | .error' < $TEST_ROOT/jobs) =~ "this attribute is broken" ]]
+drvPath=$(jq -r 'select(.attr == "a") | .drvPath' < $TEST_ROOT/jobs)
+[[ $drvPath = $(nix-instantiate eval-jobs.nix -A a) ]]
+nix-store --check-validity $drvPath
+(! jq -e 'select(.attr == "a") | .meta' < $TEST_ROOT/jobs)
+
+# Recurse into all attribute sets.
+[[ $(nix eval-jobs --force-recurse -f eval-jobs.nix '' | jq -r 'select(.attr == "hidden.d") | .name') = d ]]
+
+# Include the meta attributes.
+[[ $(nix eval-jobs --meta -f eval-jobs.nix '' | jq -r 'select(.attr == "b") | .meta.description') = "The b package" ]]
+
+# With several workers, that are restarted after every attribute, the
+# result is the same.
+nix eval-jobs --workers 3 --max-memory-size 0 -f eval-jobs.nix '' > $TEST_ROOT/jobs2
+diff <(sort $TEST_ROOT/jobs) <(sort $TEST_ROOT/jobs2)
@@ -0,0 +1,58 @@
+source common.sh
+
+clearStore
+
+file=$TEST_ROOT/eval-snapshot.nix
+snapshot=$TEST_ROOT/eval-snapshot
+rm -f $snapshot
+
+# Functions with their environments, recursive sets, builtins, and
+# thunks that are never evaluated.
+cat > $file <<EOF2
+rec {
+  xs = builtins.genList (i: i * i) 10;
+  sum = builtins.foldl' (a: b: a + b) 0 xs;
+  f = x: { inherit x; y = x + sum; };
+  s = builtins.concatStringsSep "," (map toString xs);
+  lazy = throw "not evaluated";
+  nested = { a.b.c = f 1; };
+  drv = derivation { name = "foo"; system = "x"; builder = "/bin/sh"; file = builtins.toFile "foo" "bar"; };
+}
+EOF2
+
+expr='builtins.toJSON { inherit (nested.a.b.c) x y; inherit sum s; g = (f 2).y; n = builtins.length xs; drv = drv.drvPath; }'
+
+# Evaluate part of it and save a snapshot.
+nix repl $file <<EOF2
+sum
+:save $snapshot
+EOF2
+[[ -e $snapshot ]]
+
+# Evaluating the expression from the snapshot gives the same result as
+# evaluating it from a fresh parse.
+fresh=$(nix repl $file <<< "$expr" | grep '^"{')
+fromSnapshot=$(nix repl --snapshot $snapshot <<< "$expr" | grep '^"{')
+[[ -n $fresh ]]
+[[ $fresh = "$fromSnapshot" ]]
+
+# The snapshot doesn't depend on the file anymore.
+echo 'throw "changed"' > $file
+[[ $(nix repl --snapshot $snapshot <<< "$expr" | grep '^"{') = "$fresh" ]]
+(nix repl --snapshot $snapshot <<< "lazy" 2>&1 || true) | grep -q 'not evaluated'
+
+# Variables of recursive sets and let expressions resolve to the same
+# bindings in a process that has interned their names in a different
+# order.
+file=$TEST_ROOT/eval-snapshot-bindings.nix
+rm -f $snapshot
+cat > $file <<EOF2
+let v1 = 1; v2 = 2; v3 = 3; v4 = 4; v5 = 5; in
+{ f = x: rec { a = v1 + x; b = v2 * 10 + a; c = v3 * 100 + b; d = v4 * 1000 + c; e = v5 * 10000 + d; }; }
+EOF2
+echo '{ ordering = { e = 0; d = 0; c = 0; b = 0; a = 0; v5 = 0; v4 = 0; v3 = 0; v2 = 0; v1 = 0; }; }' > $TEST_ROOT/eval-snapshot-order.nix
+
+nix repl $file <<EOF2
+:save $snapshot
+EOF2
+[[ $(nix repl $TEST_ROOT/eval-snapshot-order.nix --snapshot $snapshot <<< 'builtins.toJSON (f 0)' | grep '^"{') = '"{\"a\":1,\"b\":21,\"c\":321,\"d\":4321,\"e\":54321}"' ]]
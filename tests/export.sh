@@ -34,3 +34,28 @@ clearStore
 # Regression test: the derivers in exp_all2 are empty, which shouldn't
 # cause a failure.
 nix-store --import < $TEST_ROOT/exp_all2
+
+
+
+# Bundles.
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+HASH=$(nix hash path $outPath)
+closure=$(nix-store -qR $outPath | sort)
+
+nix store export-bundle -o $TEST_ROOT/bundle $outPath
+nix store export-bundle -o $TEST_ROOT/bundle-xz --compression xz $outPath
+
+for bundle in $TEST_ROOT/bundle $TEST_ROOT/bundle-xz; do
+    clearStore
+    [[ $(nix store import-bundle --no-check-sigs $bundle | sort) = $closure ]]
+    [[ $(nix hash path $outPath) = $HASH ]]
+    [[ $(nix-store -qR $outPath | sort) = $closure ]]
+done
+
+# Importing again is a no-op.
+nix store import-bundle --no-check-sigs $TEST_ROOT/bundle
+
+# A bundle can't be read from a pipe.
+(! nix store import-bundle --no-check-sigs <(cat $TEST_ROOT/bundle))
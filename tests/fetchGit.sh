@@ -103,6 +103,14 @@ path2=$(nix eval --impure --raw --expr "(builtins.fetchGit $repo).outPath")
 [ ! -e $path2/.git ]
 [[ $(cat $path2/dir1/foo) = foo ]]
 
+# Changes to the dirty tree should be picked up, even right after a
+# previous fetch.
+echo foo2 > $repo/dir1/foo
+path2b=$(nix eval --impure --raw --expr "(builtins.fetchGit $repo).outPath")
+[[ $(cat $path2b/dir1/foo) = foo2 ]]
+echo foo > $repo/dir1/foo
+[[ $(nix eval --impure --raw --expr "(builtins.fetchGit $repo).outPath") = $path2 ]]
+
 [[ $(nix eval --impure --raw --expr "(builtins.fetchGit $repo).rev") = 0000000000000000000000000000000000000000 ]]
 
 # ... unless we're using an explicit ref or rev.
@@ -179,3 +187,16 @@ git clone --depth 1 file://$repo $TEST_ROOT/shallow
 path6=$(nix eval --impure --raw --expr "(builtins.fetchTree { type = \"git\"; url = \"file://$TEST_ROOT/shallow\"; ref = \"dev\"; shallow = true; }).outPath")
 [[ $path3 = $path6 ]]
 [[ $(nix eval --impure --expr "(builtins.fetchTree { type = \"git\"; url = \"file://$TEST_ROOT/shallow\"; ref = \"dev\"; shallow = true; }).revCount or 123") == 123 ]]
+
+# Shallow fetches of a remote repository only fetch a single commit.
+path7=$(_NIX_FORCE_HTTP=1 nix eval --impure --raw --expr "(builtins.fetchTree { type = \"git\"; url = \"file://$repo\"; ref = \"dev\"; shallow = true; }).outPath")
+[[ $path6 = $path7 ]]
+[[ $(git -C $TEST_HOME/.cache/nix/gitv3-shallow/* rev-list --count --all) = 1 ]]
+
+# Servers that only serve the tips of refs (as with protocol v0 and
+# the default uploadpack.allowReachableSHA1InWant) refuse a shallow
+# fetch of an older commit; it falls back to fetching the whole ref.
+rm -rf $TEST_HOME/.cache/nix/gitv3-shallow
+path8=$(GIT_CONFIG_COUNT=1 GIT_CONFIG_KEY_0=protocol.version GIT_CONFIG_VALUE_0=0 \
+    nix eval --impure --raw --expr "(builtins.fetchTree { type = \"git\"; url = \"file://$repo\"; rev = \"$rev2\"; shallow = true; }).outPath")
+[[ $(cat $path8/hello) = world ]]
@@ -29,6 +29,20 @@ outPath=$(nix-build --expr 'import <nix/fetchurl.nix>' --argstr url file://$(pwd
 
 cmp $outPath fetchurl.sh
 
+# Test fetching from a hashed mirror when another mirror and the URL
+# don't have the file.
+clearStore
+
+hash=$(nix hash file --type sha256 --base16 ./fetchurl.sh)
+
+mkdir -p $TEST_ROOT/mirror/sha256
+cp ./fetchurl.sh $TEST_ROOT/mirror/sha256/$hash
+
+outPath=$(nix-build --expr 'import <nix/fetchurl.nix>' --argstr url file://$TEST_ROOT/no-such-file --argstr sha256 $hash --no-out-link \
+    --option hashed-mirrors "file://$TEST_ROOT/no-such-mirror file://$TEST_ROOT/mirror")
+
+cmp $outPath fetchurl.sh
+
 # Test that we can substitute from a different store dir.
 clearStore
 
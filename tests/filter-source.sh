@@ -23,3 +23,13 @@ checkFilter $TEST_ROOT/filterout1
 
 nix-build ./path.nix -o $TEST_ROOT/filterout2
 checkFilter $TEST_ROOT/filterout2
+
+# Sources are copied to the store in the background, but must be
+# valid once they're used or evaluation finishes.
+clearStore
+for i in $(seq 1 20); do echo $i > $TEST_ROOT/filterin/src-$i; done
+srcs=$(nix-instantiate --eval --strict --json -E "builtins.genList (i: \"\${/. + \"$TEST_ROOT/filterin/src-\${toString (i + 1)}\"}\") 20")
+for i in $(echo "$srcs" | tr -d '[]"' | tr ',' ' '); do
+    nix path-info $i > /dev/null
+done
+[[ $(nix-instantiate --eval -E "builtins.readFile \"\${$TEST_ROOT/filterin/src-7}\"") = '"7\n"' ]]
@@ -187,6 +187,28 @@ hash2=$(nix flake info flake1 --json --refresh | jq -r .revision)
 nix build -o $TEST_ROOT/result flake1#foo
 [[ -e $TEST_ROOT/result/hello ]]
 
+# Test that 'nix eval' uses the evaluation cache.
+drvPath=$(nix eval --raw flake1#foo.drvPath)
+nix eval --debug --raw flake1#foo.drvPath 2>&1 | grep 'using cached string attribute'
+[[ $(nix eval --raw flake1#foo.drvPath) = $drvPath ]]
+
+# Integers and lists of strings are cached as well.
+listFlakeDir=$TEST_ROOT/list-flake
+mkdir -p $listFlakeDir
+cat > $listFlakeDir/flake.nix <<EOF
+{
+  outputs = { self }: {
+    platforms = [ "x86_64-linux" "aarch64-linux" ];
+    count = 42;
+  };
+}
+EOF
+[[ $(nix eval --json path:$listFlakeDir#platforms) = '["x86_64-linux","aarch64-linux"]' ]]
+nix eval --debug --json path:$listFlakeDir#platforms 2>&1 | grep 'using cached list of strings attribute'
+[[ $(nix eval --json path:$listFlakeDir#platforms) = '["x86_64-linux","aarch64-linux"]' ]]
+[[ $(nix eval path:$listFlakeDir#count) = 42 ]]
+nix eval --debug path:$listFlakeDir#count 2>&1 | grep 'using cached integer attribute'
+
 # Test defaultPackage.
 nix build -o $TEST_ROOT/result flake1
 [[ -e $TEST_ROOT/result/hello ]]
@@ -194,6 +216,21 @@ nix build -o $TEST_ROOT/result flake1
 nix build -o $TEST_ROOT/result $flake1Dir
 nix build -o $TEST_ROOT/result git+file://$flake1Dir
 
+# Test that with lazy trees, a path: flake is only copied to the store
+# when needed.
+lazyDir=$TEST_ROOT/lazy
+rm -rf $lazyDir
+mkdir $lazyDir
+cp $flake1Dir/{flake.nix,simple.nix,simple.builder.sh,config.nix} $lazyDir/
+lazyPath=$(nix eval --raw --option lazy-trees true path:$lazyDir#outPath)
+[[ ! -e $lazyPath ]]
+nix build -o $TEST_ROOT/result --option lazy-trees true path:$lazyDir#foo
+[[ -e $TEST_ROOT/result/hello ]]
+[[ ! -e $lazyPath ]]
+nix flake archive --option lazy-trees true path:$lazyDir
+[[ -e $lazyPath ]]
+[[ $(nix eval --raw path:$lazyDir#outPath) = $lazyPath ]]
+
 # Check that store symlinks inside a flake are not interpreted as flakes.
 nix build -o $flake1Dir/result git+file://$flake1Dir
 nix path-info $flake1Dir/result
@@ -533,6 +570,30 @@ EOF
 
 (! nix flake check $flake3Dir)
 
+# Check a flake using several worker processes.
+cat > $flake3Dir/flake.nix <<EOF
+{
+  outputs = { flake1, self }: {
+    checks.$system = with import ./config.nix; builtins.listToAttrs (map (n: {
+      name = "check\${toString n}";
+      value = mkDerivation {
+        name = "check\${toString n}";
+        buildCommand = "echo \${toString n} > \$out";
+      };
+    }) [ 1 2 3 4 5 6 ]);
+    nixosModules.foo = {
+      a.b.c = 123;
+    };
+  };
+}
+EOF
+
+nix flake check --eval-workers 3 $flake3Dir
+[[ $(cat $(nix eval --raw $flake3Dir#checks.$system.check4.outPath)) = 4 ]]
+
+sed -i 's/a.b.c = 123;/a.b.c = 123; foo = assert false; true;/' $flake3Dir/flake.nix
+(! nix flake check --eval-workers 3 $flake3Dir)
+
 # Test 'follows' inputs.
 cat > $flake3Dir/flake.nix <<EOF
 {
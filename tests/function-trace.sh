@@ -71,3 +71,28 @@ function-trace exited (string):1:1 at
 "
 
 set -e
+
+# Aggregated profiles in collapsed stack format.
+profile=$TEST_ROOT/profile.folded
+rm -f $profile
+nix-instantiate --eval-profile-file $profile --eval-profile-weight allocations \
+    --expr 'let f = x: { inherit x; }; g = x: f (builtins.length x); in g [ 1 2 ]' > /dev/null
+grep -q "^'g' at .*;'f' at .* [0-9]*$" $profile
+
+# Exceeding the memory limit reports the functions that allocated most.
+expr='let l = builtins.genList (n: { x = n; }) 2000000; in builtins.length (builtins.deepSeq l l)'
+out=$(! nix-instantiate --eval --option eval-memory-limit 33554432 --expr "$expr" 2>&1)
+echo "$out" | grep -q "exceeds the memory limit"
+echo "$out" | grep -q "MiB  primop genList"
+[[ $(nix-instantiate --eval --option eval-memory-limit 0 --expr "$expr") = 2000000 ]]
+
+# Hitting the limit while readDir iterates over a cached directory
+# listing must not invalidate that listing.
+mkdir -p $TEST_ROOT/big-dir
+(cd $TEST_ROOT/big-dir && touch $(seq 1 5000))
+expr="let l = builtins.genList (n: builtins.readDir $TEST_ROOT/big-dir) 400; in builtins.length (builtins.deepSeq l l)"
+out=$(! nix-instantiate --eval --option eval-memory-limit 33554432 --expr "$expr" 2>&1)
+echo "$out" | grep -q "exceeds the memory limit"
+echo "$out" | grep -q "MiB  primop readDir"
+expr="builtins.foldl' (acc: n: acc + builtins.length (builtins.attrNames (builtins.readDir $TEST_ROOT/big-dir))) 0 (builtins.genList (n: n) 400)"
+[[ $(nix-instantiate --eval --option eval-memory-limit 33554432 --expr "$expr") = 2000000 ]]
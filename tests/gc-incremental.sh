@@ -0,0 +1,47 @@
+source common.sh
+
+clearStore
+
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -rvv "$drvPath")
+input2=$(readLink $outPath/input-2)
+
+rm -f "$NIX_STATE_DIR"/gcroots/foo "$NIX_STATE_DIR"/gcroots/bar
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+ln -sf $input2 "$NIX_STATE_DIR"/gcroots/bar
+
+# The first incremental collection has nothing to go on, so it
+# collects the whole store.
+nix-collect-garbage --incremental 2>&1 | grep -q 'collecting the whole store'
+cat $outPath/foobar
+if test -e $drvPath; then false; fi
+
+# Paths added since the last collection are examined.
+drvPath=$(nix-instantiate dependencies.nix)
+nix-collect-garbage --incremental 2>&1 | grep -q 'since the last collection'
+if test -e $drvPath; then false; fi
+cat $outPath/foobar
+
+# Removing a root makes its closure garbage, except for the paths
+# that are still reachable from other roots.
+rm "$NIX_STATE_DIR"/gcroots/foo
+nix-collect-garbage --incremental 2>&1 | grep -q 'since the last collection'
+if test -e $outPath/foobar; then false; fi
+cat $input2/bar
+
+rm "$NIX_STATE_DIR"/gcroots/bar
+nix-collect-garbage --incremental
+if test -e $input2/bar; then false; fi
+
+# A root that was deleted by other means since the last collection
+# doesn't hide the paths it kept alive.
+clearStore
+outPath=$(nix-build dependencies.nix --no-out-link)
+input2=$(readLink $outPath/input-2)
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+nix-collect-garbage --incremental
+cat $input2/bar
+rm "$NIX_STATE_DIR"/gcroots/foo
+nix-store --delete $outPath
+nix-collect-garbage --incremental 2>&1 | grep -q 'was deleted since the last collection'
+if test -e $input2/bar; then false; fi
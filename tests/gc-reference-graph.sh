@@ -0,0 +1,4 @@
+# Run the garbage collector tests with the in-memory reference graph.
+export NIX_CONFIG="gc-reference-graph = true"
+
+source gc.sh
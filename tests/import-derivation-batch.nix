@@ -0,0 +1,28 @@
+with import ./config.nix;
+
+let
+
+  # Each builder waits for the other one to start, so this only
+  # evaluates if both are built at the same time.
+  mkImport = name: other: import (mkDerivation {
+    inherit name;
+    buildCommand = ''
+      touch $syncDir/${name}
+      for i in $(seq 1 100); do
+        if [ -e $syncDir/${other} ]; then
+          echo '"${name}"' > $out
+          exit 0
+        fi
+        sleep 0.1
+      done
+      exit 1
+    '';
+    syncDir = builtins.getEnv "SYNC_DIR";
+  });
+
+in
+
+{
+  a = mkDerivation { name = "a"; buildCommand = "echo ${mkImport "ifd-a" "ifd-b"} > $out"; };
+  b = mkDerivation { name = "b"; buildCommand = "echo ${mkImport "ifd-b" "ifd-a"} > $out"; };
+}
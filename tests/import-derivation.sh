@@ -10,3 +10,23 @@ fi
 outPath=$(nix-build ./import-derivation.nix --no-out-link)
 
 [ "$(cat $outPath)" = FOO579 ]
+
+# Imports needed by different attributes are built concurrently.
+clearStore
+export SYNC_DIR=$TEST_ROOT/sync
+rm -rf $SYNC_DIR
+mkdir -p $SYNC_DIR
+nix-instantiate ./import-derivation-batch.nix --max-jobs 2
+
+clearStore
+rm -rf $SYNC_DIR
+mkdir -p $SYNC_DIR
+(! nix-instantiate ./import-derivation-batch.nix --max-jobs 2 --option batch-import-from-derivation false)
+
+# Imports are built by the pipeline when builds are pipelined.
+clearStore
+cat > $TEST_ROOT/pipelined.nix <<EOF2
+{ a = import $PWD/dependencies.nix; b = import $PWD/import-derivation.nix; }
+EOF2
+outPath=$(nix build -f $TEST_ROOT/pipelined.nix --pipelined-builds --no-link --json a b | jq -r '.[1].outputs.out')
+[ "$(cat $outPath)" = FOO579 ]
@@ -0,0 +1 @@
+builtins.fromTOML "x = 1\nx = 2"
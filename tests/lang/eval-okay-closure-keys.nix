@@ -0,0 +1,18 @@
+with builtins;
+
+let
+
+  keys = map (x: x.key);
+
+  # Integer and float keys that compare equal are the same key.
+  mixed = genericClosure {
+    startSet = [ { key = 1; } { key = 1.0; } { key = 2; } ];
+    operator = x: [ { key = 2.0; } ];
+  };
+
+  strings = genericClosure {
+    startSet = [ { key = "b"; } { key = "a"; } { key = "b"; } ];
+    operator = x: if x.key == "a" then [ { key = "c"; } { key = "a"; } ] else [];
+  };
+
+in [ (keys mixed) (keys strings) ]
@@ -0,0 +1,12 @@
+let
+  # A comment.
+  s1 = "a
+b";
+  s2 = "ab";
+  s3 = "a\r\nb";
+  s4 = ''
+    a
+    b
+  '';
+in
+[ s1 s2 s3 s4 ]
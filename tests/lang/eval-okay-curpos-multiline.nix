@@ -0,0 +1,8 @@
+let
+  /* a
+     comment */
+  s = ''
+    a
+  '';
+  x = __curPos;
+in [ x.line x.column ]
@@ -0,0 +1,4 @@
+# Values nested far deeper than native recursion could handle.
+let
+  deep = builtins.foldl' (acc: n: [ { x = acc; } ]) [] (builtins.genList (n: n) 200000);
+in builtins.stringLength (builtins.toJSON (builtins.deepSeq deep deep))
@@ -0,0 +1,8 @@
+with builtins;
+
+[ (escapeShellArg "foo")
+  (escapeShellArg "it's")
+  (escapeShellArg "")
+  (escapeShellArg 42)
+  (escapeShellArg /no-such-dir/foo)
+]
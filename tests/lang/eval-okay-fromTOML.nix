@@ -54,7 +54,8 @@
     physical.shape = "round"
     site."google.com" = true
 
-    # This is legal according to the spec, but cpptoml doesn't handle it.
+    # This is legal according to the spec, but conflicts with `[a.b.c]`
+    # below. Dotted keys are tested in the last document.
     #a.b.c = 1
     #a.d = 2
 
@@ -205,4 +206,30 @@
     e = [[123]]
   '')
 
+  (builtins.fromTOML ''
+    a.b.c = 1
+    a.d = 2
+    a."e.f" = { g.h = 3, i = [] }
+
+    [a.j]
+    k = 4
+
+    [s]
+    ml = """
+    Roses are red
+    Violets are blue"""
+    folded = """\
+      The quick \
+      brown fox."""
+    quotes = """Two quotes: "".""""
+    literal = ''''C:\Users\nix''''
+    unicode = "\u00e9\U0001F600"
+
+    [n]
+    max = 9223372036854775807
+    min = -9223372036854775808
+    inf = -inf
+    exp = 1E06
+  '')
+
 ]
@@ -0,0 +1,20 @@
+# `$', `'' and `${' in indented strings.
+
+let
+  b = "B";
+in
+
+[ ''a''${b}''
+  ''$${b}''
+  ''${b}$''
+  ''$b''
+  ''''$''
+  ''x'''y''
+  ''x''\ny''
+  ''x'y'$''
+  ''
+    ${b}
+      ''${b}
+    $${b}
+  ''
+]
@@ -0,0 +1,10 @@
+let
+  big = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 100));
+  f = { a1, a50 ? 0, a99, b }: a1;
+in
+[ (builtins.intersectAttrs { a3 = null; a10 = null; c = null; } big)
+  (builtins.intersectAttrs big { a3 = 1; a10 = 2; c = 3; })
+  (builtins.intersectAttrs (builtins.functionArgs f) big)
+  (builtins.intersectAttrs { } big)
+  (builtins.functionArgs f == builtins.functionArgs f)
+]
@@ -0,0 +1,30 @@
+# Places where the lexer has to decide where a token ends.
+
+let
+  x = 1;
+  a = { b = 2; };
+in
+
+[ # A URI, not a function.
+  (builtins.typeOf x:x)
+  ((x: x) 3)
+  x:x
+  http://example.org/a?b=c&d=e
+
+  # A path, not a division.
+  (builtins.typeOf 6/2)
+  (6 / 2)
+  (toString /foo/bar.nix)
+  (toString /foo/a+b/c-d_e)
+  (builtins.typeOf a.b/c)
+  a.b
+
+  # A `$' that doesn't start an antiquotation.
+  "a$"
+  "$"
+  "$${x}"
+  "\${x}"
+  "\$"
+  "${toString x}$"
+  "${"a"}${"b"}"
+]
@@ -0,0 +1,10 @@
+with builtins;
+
+[ (recursiveUpdate { foo = { bar = 1; baz = 2; }; } { foo = { bar = 3; }; qux = 4; })
+  (recursiveUpdate { a = { b = 1; }; } { a = 2; })
+  (recursiveUpdate { a = 1; } { a = { b = 2; }; })
+  (recursiveUpdate { a = { b = { c = 1; }; }; d = 5; } { a = { b = { e = 2; }; }; })
+  # Values are only evaluated when needed.
+  (recursiveUpdate { a = throw "fail"; b = 1; } { c = 2; }).b
+  (recursiveUpdate { } { x = 1; })
+]
@@ -8,4 +8,7 @@ with builtins;
   (replaceStrings [""] ["X"] "abc")
   (replaceStrings [""] ["X"] "")
   (replaceStrings ["-"] ["_"] "a-b")
+  (replaceStrings ["a" "ab"] ["1" "2"] "abab")
+  (replaceStrings ["ab" "a"] ["2" "1"] "abac")
+  (replaceStrings ["b" ""] ["X" "_"] "abc")
 ]
@@ -0,0 +1,11 @@
+let
+  big = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 100));
+  r = removeAttrs big [ "a99" "a0" "x" "a50" "a0" "a7" ];
+  i1 = builtins.intersectAttrs { a3 = null; a98 = null; b = null; } big;
+  i2 = builtins.intersectAttrs big { a3 = "x"; a98 = "y"; b = "z"; };
+in [
+  (builtins.length (builtins.attrNames r))
+  (r ? a0) (r ? a7) (r ? a50) (r ? a99) (r ? a1) r.a98
+  (builtins.attrNames i1) i1.a3
+  (builtins.attrNames i2) i2.a98
+]
@@ -5,4 +5,6 @@ with builtins;
   (sort lessThan [ "foo" "bar" "xyzzy" "fnord" ])
   (sort (x: y: x.key < y.key)
     [ { key = 1; value = "foo"; } { key = 2; value = "bar"; } { key = 1; value = "fnord"; } ]) 
+  (sort (x: y: x > y) [ 1 3 2 ])
+  (let __lessThan = x: y: lessThan y x; in sort (x: y: x < y) [ 1 3 2 ])
 ]
@@ -0,0 +1,8 @@
+with builtins;
+
+[ (splitString "/" "/usr/local/bin")
+  (splitString "," "a,b,,c")
+  (splitString "ab" "xabyabab")
+  (splitString "," "")
+  (splitString "" "abc")
+]
@@ -0,0 +1,8 @@
+let
+
+  # Deep enough to overflow the stack if tail calls used stack space.
+  count = n: acc: if n == 0 || acc < 0 then acc else count (n - 1) (acc + 1);
+
+  countAttrs = { n, acc }: if n == 0 || acc < 0 then acc else countAttrs { n = n - 1; acc = acc + 1; };
+
+in [ (count 1000000 0) (countAttrs { n = 100000; acc = 0; }) ]
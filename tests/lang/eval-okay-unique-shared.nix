@@ -0,0 +1,4 @@
+# Values that share their children a lot (here, a cyclic one) must not
+# make hashing them take exponential time.
+let x = { a = x; b = x; }; in
+builtins.deepSeq x (builtins.length (builtins.unique [ x x ]))
@@ -0,0 +1,20 @@
+with builtins;
+
+let
+  sets = [ { a = 1; b = [ 2 ]; } { b = [ 2 ]; a = 1; } { a = 1.0; b = [ 2.0 ]; } { a = 1; b = [ 3 ]; } ];
+  drvs = [
+    { type = "derivation"; outPath = "/a"; x = 1; }
+    { type = "derivation"; outPath = "/a"; x = 2; }
+    { type = "derivation"; outPath = "/b"; }
+  ];
+in
+
+[ (unique [ 3 2 3 4 ])
+  (unique [ "a" "b" "a" "c" "b" ])
+  (unique [ 1 1.0 { x = 1; } { x = 1; } [ 2 ] [ 2 ] null null ])
+  (unique [ ])
+  (unique sets)
+  (unique (deepSeq sets sets))
+  (map (d: d.outPath) (unique drvs))
+  (map (d: d.outPath) (unique (deepSeq drvs drvs)))
+]
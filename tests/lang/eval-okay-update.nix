@@ -0,0 +1,12 @@
+let
+  big = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 50));
+  small = { a10 = "x"; a42 = "y"; b = "z"; "0" = "w"; };
+  r1 = big // small;
+  r2 = small // big;
+in [
+  (builtins.length (builtins.attrNames r1))
+  r1.a10 r1.a42 r1.a11 r1.b r1."0"
+  (builtins.length (builtins.attrNames r2))
+  r2.a10 r2.a42 r2.b
+  (builtins.attrNames ({ c = 1; a = 2; } // { b = 3; d = 4; a = 5; }))
+]
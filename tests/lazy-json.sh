@@ -0,0 +1,26 @@
+source common.sh
+
+# Lazy parsing gives the same results as eager parsing.
+for i in lang/eval-okay-fromjson*.nix; do
+    expected=$(nix-instantiate --eval --strict --option lazy-from-json false $i)
+    [[ $(nix-instantiate --eval --strict --option lazy-from-json true $i) = "$expected" ]]
+done
+
+# Nested values are only parsed when accessed.
+doc='builtins.fromJSON "{\"a\": [1, {\"b\": 2}], \"c\": [1,, 2]}"'
+[[ $(nix-instantiate --eval --strict --option lazy-from-json true -E "($doc).a") = '[ 1 { b = 2; } ]' ]]
+(! nix-instantiate --eval --strict --option lazy-from-json false -E "($doc).a")
+(! nix-instantiate --eval --strict --option lazy-from-json true -E "($doc).c")
+
+# The top level is still checked.
+(! nix-instantiate --eval --option lazy-from-json true -E 'builtins.fromJSON "{\"a\": 1"')
+(! nix-instantiate --eval --option lazy-from-json true -E 'builtins.fromJSON "[1] 2"')
+
+# Missing elements are reported as parse errors.
+for doc in '[,1]' '[1,]' '{\"a\":}' '{\"a\":,\"b\":1}'; do
+    nix-instantiate --eval --strict --option lazy-from-json true -E "builtins.fromJSON \"$doc\"" 2>&1 | grep -q 'in JSON value'
+done
+
+# readFile of a large file.
+seq 1 100000 > $TEST_ROOT/numbers
+[[ $(nix-instantiate --eval -E "builtins.stringLength (builtins.readFile $TEST_ROOT/numbers)") = $(stat -c %s $TEST_ROOT/numbers) ]]
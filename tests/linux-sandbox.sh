@@ -35,3 +35,15 @@ nix-build check.nix -A nondeterministic --sandbox-paths /nix/store --no-out-link
 (! nix-build check.nix -A nondeterministic --sandbox-paths /nix/store --no-out-link --check -K 2> $TEST_ROOT/log)
 if grep -q 'error: renaming' $TEST_ROOT/log; then false; fi
 grep -q 'may not be deterministic' $TEST_ROOT/log
+
+# Builtin builders that normally run in the Nix process must write to
+# the diverted store.
+outPath=$(nix-build --no-out-link --option builtins-in-process true -E '
+  derivation {
+    name = "diverted-builtin";
+    system = "builtin";
+    builder = "builtin:write-file";
+    text = "hello";
+  }')
+[[ $(cat $TEST_ROOT/store0$outPath) = hello ]]
+[[ ! -e $outPath ]]
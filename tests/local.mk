@@ -2,11 +2,13 @@ nix_tests = \
   hash.sh lang.sh add.sh simple.sh dependencies.sh \
   config.sh \
   gc.sh \
+  gc-reference-graph.sh \
+  gc-incremental.sh \
   gc-concurrent.sh \
   gc-auto.sh \
   referrers.sh user-envs.sh logging.sh nix-build.sh misc.sh fixed.sh \
   gc-runtime.sh check-refs.sh filter-source.sh \
-  local-store.sh remote-store.sh export.sh export-graph.sh \
+  local-store.sh remote-store.sh threaded-daemon.sh prefork-daemon.sh daemon-metrics.sh export.sh export-graph.sh \
   timeout.sh secure-drv-outputs.sh nix-channel.sh \
   multiple-outputs.sh import-derivation.sh fetchurl.sh optimise-store.sh \
   binary-cache.sh \
@@ -15,7 +17,9 @@ nix_tests = \
   check-reqs.sh pass-as-file.sh tarball.sh restricted.sh \
   placeholders.sh nix-shell.sh \
   linux-sandbox.sh \
+  cgroups.sh \
   build-dry.sh \
+  builtin-builders.sh \
   build-remote-input-addressed.sh \
   ssh-relay.sh \
   nar-access.sh \
@@ -27,13 +31,25 @@ nix_tests = \
   signing.sh \
   shell.sh \
   brotli.sh \
+  chunked-binary-cache.sh \
+  nar-cache.sh \
+  nar-deltas.sh \
   pure-eval.sh \
   check.sh \
   plugins.sh \
   search.sh \
+  eval-jobs.sh \
+  nix-env-query-cache.sh \
+  metadata-snapshot.sh \
+  eval-snapshot.sh \
+  why-depends.sh \
+  diff-closures.sh \
   nix-copy-ssh.sh \
   post-hook.sh \
   function-trace.sh \
+  parse-cache.sh \
+  source-cache.sh \
+  lazy-json.sh \
   recursive.sh \
   describe-stores.sh \
   flakes.sh \
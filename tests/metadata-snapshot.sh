@@ -0,0 +1,25 @@
+source common.sh
+
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+snapshot=$TEST_ROOT/metadata-snapshot
+rm -f $snapshot
+nix store write-metadata-snapshot --store local $snapshot
+
+store="local?metadata-snapshot=$snapshot"
+
+# Queries through the snapshot give the same results as the database.
+[[ $(nix path-info --store "$store" --json -r $outPath) = $(nix path-info --store local --json -r $outPath) ]]
+[[ $(nix-store --store "$store" -qR $outPath) = $(nix-store --store local -qR $outPath) ]]
+
+# Paths added after the snapshot was written are looked up in the
+# database.
+otherPath=$(nix store add-file --store local ./dependencies.nix)
+nix path-info --store "$store" $otherPath
+
+# The snapshot is ignored once one of its paths has been deleted.
+nix-store --store local --delete $(nix-store -qR $outPath) > /dev/null
+nix path-info --store "$store" $otherPath 2>&1 | grep -q 'ignoring metadata snapshot'
+(! nix path-info --store "$store" $outPath)
@@ -24,3 +24,14 @@ eval_stdin_res=$(echo 'let a = {} // a; in a.foo' | nix-instantiate --eval -E -
 echo $eval_stdin_res | grep "at «stdin»:1:15:"
 echo $eval_stdin_res | grep "infinite recursion encountered"
 
+
+# Repeated file system lookups are answered by the metadata cache.
+mkdir -p $TEST_ROOT/fs-cache
+touch $TEST_ROOT/fs-cache/a
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats.json \
+  nix-instantiate --eval -E "
+    let dir = $TEST_ROOT/fs-cache; in
+    assert builtins.readDir dir == { a = \"regular\"; };
+    assert !builtins.pathExists (dir + \"/b\");
+    builtins.length (builtins.filter (n: builtins.pathExists (dir + \"/a\")) (builtins.genList (n: n) 100))" | grep -q 100
+(( $(jq .fsCache.hits $TEST_ROOT/stats.json) >= 100 ))
@@ -54,3 +54,10 @@ if nix-store --dump $storePath >/dev/full ; then
     echo "dumping to /dev/full should fail"
     exit -1
 fi
+
+# Stores that aren't local are read through a NAR file.
+rm -rf $TEST_ROOT/nar-access-cache
+nix copy --to file://$TEST_ROOT/nar-access-cache $storePath
+nix store cat --store file://$TEST_ROOT/nar-access-cache $storePath/foo/data > data.cat-cache
+diff -u data.cat-cache $storePath/foo/data
+nix store ls --store file://$TEST_ROOT/nar-access-cache -R $storePath/foo | grep data
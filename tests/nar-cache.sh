@@ -0,0 +1,75 @@
+source common.sh
+
+clearStore
+clearCache
+
+narCache=$TEST_ROOT/nar-cache
+rm -rf $narCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to file://$cacheDir $outPath
+
+HASH=$(nix hash path $outPath)
+
+# Substituting adds the NARs to the NAR cache.
+clearStore
+clearCacheCache
+
+nix copy --from file://$cacheDir $outPath --no-check-sigs --nar-cache $narCache
+
+[[ $(nix hash path $outPath) = $HASH ]]
+[[ -n $(ls $narCache/*.nar) ]]
+
+# Substituting again doesn't need the NARs in the binary cache.
+rm $cacheDir/nar/*
+clearStore
+clearCacheCache
+
+nix copy --from file://$cacheDir $outPath --no-check-sigs --nar-cache $narCache
+
+[[ $(nix hash path $outPath) = $HASH ]]
+
+# Without the NAR cache, substitution fails.
+clearStore
+clearCacheCache
+
+(! nix copy --from file://$cacheDir $outPath --no-check-sigs)
+
+# A truncated NAR in the cache is ignored.
+for i in $narCache/*.nar; do truncate -s 10 $i; done
+clearStore
+clearCacheCache
+
+(! nix copy --from file://$cacheDir $outPath --no-check-sigs --nar-cache $narCache)
+[[ -z $(ls $narCache/*.nar) ]]
+
+# So is a NAR of the right size with the wrong contents.
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to file://$cacheDir $outPath
+clearStore
+clearCacheCache
+
+nix copy --from file://$cacheDir $outPath --no-check-sigs --nar-cache $narCache
+[[ -n $(ls $narCache/*.nar) ]]
+
+rm $cacheDir/nar/*
+for i in $narCache/*.nar; do printf x | dd of=$i bs=1 seek=100 conv=notrunc 2> /dev/null; done
+clearStore
+clearCacheCache
+
+(! nix copy --from file://$cacheDir $outPath --no-check-sigs --nar-cache $narCache)
+[[ -z $(ls $narCache/*.nar) ]]
+
+# Old NARs are deleted when the cache grows beyond its maximum size.
+clearStore
+clearCache
+clearCacheCache
+rm -rf $narCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to file://$cacheDir $outPath
+clearStore
+
+nix copy --from file://$cacheDir $outPath --no-check-sigs --nar-cache $narCache --nar-cache-max-size 1
+[[ $(ls $narCache | wc -l) = 0 ]]
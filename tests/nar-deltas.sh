@@ -0,0 +1,41 @@
+source common.sh
+
+clearStore
+clearCache
+
+cat > $TEST_ROOT/versions.nix <<EOF2
+with import ${PWD}/config.nix;
+version: mkDerivation {
+  name = "delta-\${toString version}";
+  buildCommand = "mkdir \$out; seq 1 100000 > \$out/data; echo \${toString version} > \$out/version";
+}
+EOF2
+
+oldPath=$(nix-build $TEST_ROOT/versions.nix --arg version 1 --no-out-link)
+newPath=$(nix-build $TEST_ROOT/versions.nix --arg version 2 --no-out-link)
+
+nix copy --to file://$cacheDir $oldPath $newPath
+
+nix store add-delta --store file://$cacheDir $oldPath $newPath
+
+[[ -e $cacheDir/$(basename $newPath | cut -c1-32).deltas ]]
+[[ $(stat -c %s $cacheDir/deltas/*) -lt 1000 ]]
+
+HASH=$(nix hash path $newPath)
+
+# Substituting the new version only needs the delta if the old
+# version is present.
+nix-store --delete $newPath
+rm $cacheDir/nar/*
+clearCacheCache
+
+nix copy --from file://$cacheDir $newPath --no-check-sigs --substitute-deltas
+
+[[ $(nix hash path $newPath) = $HASH ]]
+[[ $(cat $newPath/version) = 2 ]]
+
+# Without the old version, the delta can't be used.
+nix-store --delete $newPath $oldPath
+clearCacheCache
+
+(! nix copy --from file://$cacheDir $newPath --no-check-sigs --substitute-deltas)
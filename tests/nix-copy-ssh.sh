@@ -18,3 +18,17 @@ clearStore
 nix copy --no-check-sigs --from "ssh://localhost?store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
 
 [ -f $outPath/foobar ]
+
+# Do the same with compressed NAR transfers.
+chmod -R u+w "$remoteRoot"
+rm -rf "$remoteRoot"
+
+nix copy --to "ssh://localhost?nar-compression=zstd&store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
+
+[ -f $remoteRoot$outPath/foobar ]
+
+clearStore
+
+nix copy --no-check-sigs --from "ssh://localhost?nar-compression=zstd&nar-compression-level=3&store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
+
+[ -f $outPath/foobar ]
@@ -0,0 +1,71 @@
+source common.sh
+
+clearStore
+
+cacheDir=$TEST_HOME/.cache/nix/nix-env-query-v1
+rm -rf $cacheDir
+
+cp ./config.nix $TEST_ROOT/
+cat > $TEST_ROOT/query-cache.nix <<EOF2
+with import ./config.nix;
+[
+  (mkDerivation { name = "foo-1.0"; builder = "/bin/sh"; meta.description = "first"; })
+  (mkDerivation { name = "bar-2.0"; builder = "/bin/sh"; meta.description = builtins.getEnv "QUERY_CACHE_DESC"; })
+  (mkDerivation { name = "broken-1.0"; builder = "/bin/sh"; meta = assert false; {}; })
+]
+EOF2
+
+# The first complete query creates a cache entry.
+nix-env -f $TEST_ROOT/query-cache.nix -qa --description > $TEST_ROOT/out1
+[[ $(ls $cacheDir | wc -l) = 1 ]]
+grep -q 'foo-1.0 *first' $TEST_ROOT/out1
+(! grep -q broken $TEST_ROOT/out1)
+
+# A repeated query gives the same result.
+nix-env -f $TEST_ROOT/query-cache.nix -qa --description > $TEST_ROOT/out2
+diff $TEST_ROOT/out1 $TEST_ROOT/out2
+
+# Fields that weren't cached are evaluated and added to the entry.
+nix-env -f $TEST_ROOT/query-cache.nix -qa --out-path | grep -q "foo-1.0 *$NIX_STORE_DIR"
+
+# Changing an environment variable read by the evaluation invalidates
+# the entry.
+QUERY_CACHE_DESC=second nix-env -f $TEST_ROOT/query-cache.nix -qa --description | grep -q 'bar-2.0 *second'
+
+# So does changing a source file.
+sed -i 's/first/changed/' $TEST_ROOT/query-cache.nix
+nix-env -f $TEST_ROOT/query-cache.nix -qa --description | grep -q 'foo-1.0 *changed'
+
+# Even if the edit keeps the size and the modification time.
+touch -r $TEST_ROOT/query-cache.nix $TEST_ROOT/query-cache.stamp
+sed -i 's/changed/CHANGED/' $TEST_ROOT/query-cache.nix
+touch -r $TEST_ROOT/query-cache.stamp $TEST_ROOT/query-cache.nix
+nix-env -f $TEST_ROOT/query-cache.nix -qa --description | grep -q 'foo-1.0 *CHANGED'
+
+# A file that appears earlier in the search path invalidates the entry.
+mkdir -p $TEST_ROOT/sp1 $TEST_ROOT/sp2
+echo '"sp2"' > $TEST_ROOT/sp2/desc.nix
+cat > $TEST_ROOT/query-cache-sp.nix <<EOF2
+with import ./config.nix;
+[ (mkDerivation { name = "sp-1.0"; builder = "/bin/sh"; meta.description = import <desc.nix>; }) ]
+EOF2
+nix-env -I $TEST_ROOT/sp1 -I $TEST_ROOT/sp2 -f $TEST_ROOT/query-cache-sp.nix -qa --description | grep -q 'sp-1.0 *sp2'
+echo '"sp1"' > $TEST_ROOT/sp1/desc.nix
+nix-env -I $TEST_ROOT/sp1 -I $TEST_ROOT/sp2 -f $TEST_ROOT/query-cache-sp.nix -qa --description | grep -q 'sp-1.0 *sp1'
+
+# So does a change deep inside a directory that is copied to the store.
+mkdir -p $TEST_ROOT/qc-dir/sub
+echo one > $TEST_ROOT/qc-dir/sub/file
+cat > $TEST_ROOT/query-cache-dir.nix <<EOF2
+with import ./config.nix;
+[ (mkDerivation { name = "dir-1.0"; builder = "/bin/sh"; meta.description = baseNameOf "\${./qc-dir}"; }) ]
+EOF2
+desc1=$(nix-env -f $TEST_ROOT/query-cache-dir.nix -qa --description)
+echo two > $TEST_ROOT/qc-dir/sub/file
+desc2=$(nix-env -f $TEST_ROOT/query-cache-dir.nix -qa --description)
+[[ $desc1 != "$desc2" ]]
+
+# The cache can be disabled.
+rm -rf $cacheDir
+nix-env -f $TEST_ROOT/query-cache.nix -qa --option eval-cache false > /dev/null
+[[ ! -e $cacheDir ]]
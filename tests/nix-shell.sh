@@ -81,6 +81,17 @@ echo foo | nix develop -f shell.nix shellDrv -c cat | grep -q foo
 # Ensure `nix develop -c` actually executes the command if stdout isn't a terminal
 nix develop -f shell.nix shellDrv -c echo foo |& grep -q foo
 
+# The environment is cached and protected from garbage collection.
+envPath=$(readlink $(ls -d $TEST_HOME/.cache/nix/develop/* | grep -v '\.info$'))
+[[ $envPath =~ -env$ ]]
+(! nix-store --delete $envPath)
+nix develop -f shell.nix shellDrv -c bash -c '[[ -n $stdenv ]]'
+nix develop --option develop-cache false -f shell.nix shellDrv -c bash -c '[[ -n $stdenv ]]'
+
+# Another expression with the same attribute path gets its own entry.
+nix develop --impure --expr "import $PWD/shell.nix {}" shellDrv -c bash -c '[[ -n $stdenv ]]'
+[[ $(ls -d $TEST_HOME/.cache/nix/develop/* | grep -v '\.info$' | wc -l) = 2 ]]
+
 # Test 'nix print-dev-env'.
 source <(nix print-dev-env -f shell.nix shellDrv)
 [[ -n $stdenv ]]
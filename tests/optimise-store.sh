@@ -41,3 +41,21 @@ if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
     echo ".links directory not empty after GC"
     exit 1
 fi
+
+# Links that weren't used by the deleted paths are only removed by a
+# full scan.
+touch $NIX_STORE_DIR/.links/unused
+
+nix-store --gc
+[[ -e $NIX_STORE_DIR/.links/unused ]]
+
+nix-store --gc --option gc-full-links-scan true
+[[ ! -e $NIX_STORE_DIR/.links/unused ]]
+
+# A collection that was interrupted before it checked the links is
+# followed by a full scan.
+touch $NIX_STORE_DIR/.links/unused
+touch $NIX_STATE_DIR/db/links-pending
+nix-store --gc
+[[ ! -e $NIX_STORE_DIR/.links/unused ]]
+[[ ! -e $NIX_STATE_DIR/db/links-pending ]]
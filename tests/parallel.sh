@@ -54,3 +54,65 @@ wait $pid4 || fail "instance 4 failed: $?"
 
 if test "$(cat $_NIX_TEST_SHARED.cur)" != 0; then fail "wrong current process count"; fi
 if test "$(cat $_NIX_TEST_SHARED.max)" != 3; then fail "not enough parallelism"; fi
+
+
+# Third, test that builds are limited by the machine-wide build slots
+# and the per-user quotas.
+echo "testing build-slots..."
+
+clearStore
+
+rm -f $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max
+
+outPath=$(nix-build -j10000 --option build-slots 2 parallel.nix --no-out-link)
+
+if test "$(cat $_NIX_TEST_SHARED.cur)" != 0; then fail "wrong current process count"; fi
+if test "$(cat $_NIX_TEST_SHARED.max)" != 2; then fail "build slots not respected"; fi
+
+clearStore
+
+rm -f $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max
+
+outPath=$(nix-build -j10000 --option build-slots 2 --option user-build-slots '*=1' parallel.nix --no-out-link)
+
+if test "$(cat $_NIX_TEST_SHARED.cur)" != 0; then fail "wrong current process count"; fi
+if test "$(cat $_NIX_TEST_SHARED.max)" != 1; then fail "user build slots not respected"; fi
+
+# A quota of 0 would never be satisfied, so it is rejected.
+clearStore
+(! nix-build -j10000 --option build-slots 2 --option user-build-slots '*=0' parallel.nix --no-out-link 2>&1) | grep -q "must be at least 1"
+
+
+# Fourth, test that a build waiting for another process building the
+# same derivation shows that build's log, and finishes right after it.
+echo "testing concurrent builds of the same derivation..."
+
+clearStore
+
+rm -f $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max
+
+drvPath=$(nix-instantiate parallel.nix --argstr sleepTime 5)
+
+nix-store -j1 --option compress-build-log false --option build-poll-interval 60 -r $drvPath &
+pid1=$!
+sleep 2
+nix-store -j1 --option compress-build-log false --option build-poll-interval 60 -r $drvPath 2> $TEST_ROOT/second.log &
+pid2=$!
+
+wait $pid1 || fail "instance 1 failed: $?"
+start=$(date +%s)
+wait $pid2 || fail "instance 2 failed: $?"
+(( $(date +%s) - start < 30 )) || fail "waiting build wasn't woken up"
+
+grep -q 'DOING' $TEST_ROOT/second.log
+
+# A build waiting for a build slot starts as soon as one is released.
+clearStore
+
+rm -f $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max
+
+start=$(date +%s)
+nix-build -j10000 --option build-slots 1 --option build-poll-interval 60 parallel.nix --no-out-link
+(( $(date +%s) - start < 60 )) || fail "builds waiting for a slot weren't woken up"
+
+if test "$(cat $_NIX_TEST_SHARED.max)" != 1; then fail "build slots not respected"; fi
@@ -0,0 +1,27 @@
+source common.sh
+
+export XDG_CACHE_HOME=$TEST_ROOT/cache
+cacheDir=$XDG_CACHE_HOME/nix/parse-cache
+
+rm -rf $cacheDir
+
+# Populate the cache, then check that evaluating from cached parse
+# trees gives the same results.
+for i in lang/eval-okay-*.nix; do
+    if test -e lang/$(basename $i .nix).flags; then continue; fi
+    expected=$(nix-instantiate --eval --strict --option parse-cache false $i 2> /dev/null) || continue
+    nix-instantiate --eval --strict --option parse-cache true $i > /dev/null 2>&1
+    [[ $(nix-instantiate --eval --strict --option parse-cache true $i 2> /dev/null) = "$expected" ]]
+done
+
+[[ $(ls $cacheDir | wc -l) -gt 0 ]]
+
+# Changing a file must invalidate its cache entry.
+echo '{ x = 1; }' > $TEST_ROOT/changing.nix
+[[ $(nix-instantiate --eval --option parse-cache true -A x $TEST_ROOT/changing.nix) = 1 ]]
+echo '{ x = 2; }' > $TEST_ROOT/changing.nix
+[[ $(nix-instantiate --eval --option parse-cache true -A x $TEST_ROOT/changing.nix) = 2 ]]
+
+# Corrupt cache entries are ignored.
+for i in $cacheDir/*; do echo garbage > $i; done
+[[ $(nix-instantiate --eval --option parse-cache true -A x $TEST_ROOT/changing.nix) = 2 ]]
@@ -0,0 +1,61 @@
+source common.sh
+
+clearStore
+
+NIX_CONFIG="daemon-prefork-workers = 2
+daemon-prefork-connections = 3" startDaemon
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+# Serve more clients than the workers accept before being replaced.
+pids=()
+for i in $(seq 1 10); do
+    nix path-info -r $outPath > $TEST_ROOT/paths-$i &
+    pids+=($!)
+done
+wait "${pids[@]}"
+
+for i in $(seq 2 10); do
+    cmp $TEST_ROOT/paths-1 $TEST_ROOT/paths-$i
+done
+
+(( $(wc -l < $TEST_ROOT/paths-1) > 1 ))
+
+# Builds and their logs work through a pre-forked worker.
+nix-build dependencies.nix --no-out-link --check 2>&1 | grep -q 'building.*dependencies-top'
+
+# Paths added by the store directly are visible to the workers.
+echo foo > $TEST_ROOT/foo
+path=$(NIX_REMOTE= nix-store --add $TEST_ROOT/foo)
+nix path-info $path
+
+killDaemon
+
+# With a single worker that is never replaced, every client is served
+# by the same process, which must not carry over state between them.
+NIX_CONFIG="daemon-prefork-workers = 1
+daemon-prefork-connections = 0" startDaemon
+
+silentBuild() {
+    nix-build --no-out-link "$@" -E "
+      with import ./config.nix;
+      mkDerivation {
+        name = \"silent\";
+        buildCommand = \"sleep 3; echo > \$out\";
+        r = \"$RANDOM-$RANDOM\";
+      }"
+}
+
+# Settings passed by one client don't apply to the next.
+(! silentBuild --max-silent-time 1 2>&1) | grep -q 'timed out'
+silentBuild > /dev/null
+
+# A client that is interrupted doesn't interrupt the next one.
+silentBuild > /dev/null 2>&1 &
+pid=$!
+sleep 1
+kill -INT $pid
+wait $pid || true
+timeout 5 nix path-info $outPath
+
+killDaemon
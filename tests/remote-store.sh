@@ -29,6 +29,20 @@ cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
 nix-store --gc --max-freed 1K
 
+# Copy a closure to the daemon, which receives all paths in one request.
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to file://$TEST_ROOT/batch-cache $outPath
+nix-store --delete $(nix-store -qR $outPath)
+nix copy --from file://$TEST_ROOT/batch-cache --no-check-sigs $outPath
+nix-store --check-validity $(nix-store -qR $outPath)
+nix-store --verify-path $outPath
+
+# Likewise with compressed NAR transfers.
+nix-store --delete $(nix-store -qR $outPath)
+nix copy --from file://$TEST_ROOT/batch-cache --to 'daemon?nar-compression=zstd' --no-check-sigs $outPath
+nix-store --verify-path $outPath
+nix store cat --store 'daemon?nar-compression=zstd' $outPath/foobar > /dev/null
+
 killDaemon
 
 user=$(whoami)
@@ -72,3 +72,19 @@ if [ "$(nix-hash $path2)" != "$hash" -o -e $path2/bad ]; then
     echo "path not repaired properly" >&2
     exit 1
 fi
+
+# Check that several paths can be repaired at once.
+path3=$(nix-store -qR $path | grep input-1)
+hash3=$(nix-hash $path3)
+
+chmod u+w $path2 $path3
+touch $path2/bad $path3/bad
+
+(! nix-store --verify --check-contents)
+
+nix-store --repair-path $path2 $path3 --substituters "file://$cacheDir" --no-require-sigs
+
+if [ "$(nix-hash $path2)" != "$hash" -o -e $path2/bad -o "$(nix-hash $path3)" != "$hash3" -o -e $path3/bad ]; then
+    echo "paths not repaired properly" >&2
+    exit 1
+fi
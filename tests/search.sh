@@ -23,3 +23,27 @@ clearCache
 nix search -f search.nix '' |grep -q foo
 nix search -f search.nix '' |grep -q bar
 nix search -f search.nix '' |grep -q hello
+
+## Search index
+
+# Searches of a locked flake use the index written by the first one,
+# and a corrupt index is rebuilt rather than being an error.
+flakeDir=$TEST_ROOT/search-flake
+rm -rf $flakeDir $TEST_HOME/.cache/nix/search-index-v1
+mkdir -p $flakeDir
+cp search.nix config.nix $flakeDir/
+cat > $flakeDir/flake.nix <<EOF2
+{
+  outputs = { self }: { legacyPackages.$system = import ./search.nix; };
+}
+EOF2
+
+nix search path:$flakeDir hello | grep -q hello
+index=$(echo $TEST_HOME/.cache/nix/search-index-v1/*)
+[[ -f $index ]]
+nix search path:$flakeDir hello | grep -q hello
+
+printf 'legacyPackages.truncated\0' > $index
+nix search path:$flakeDir hello 2>&1 | grep -q 'is corrupt'
+nix search path:$flakeDir hello | grep -q hello
+(! grep -q truncated $index)
@@ -0,0 +1,69 @@
+source common.sh
+
+export XDG_CACHE_HOME=$TEST_ROOT/cache
+cacheDir=$XDG_CACHE_HOME/nix/source-cache
+
+rm -rf $cacheDir $TEST_ROOT/source
+mkdir -p $TEST_ROOT/source/sub
+echo foo > $TEST_ROOT/source/foo
+echo bar > $TEST_ROOT/source/sub/bar
+echo baz > $TEST_ROOT/source/baz.bak
+
+# Files changed in the current second are not cached.
+sleep 1
+
+expr="let suffix = \".bak\"; in builtins.path {
+  path = $TEST_ROOT/source;
+  filter = path: type: builtins.trace \"filter called\" (builtins.match \".*\${suffix}\" path == null);
+}"
+
+evalPath() {
+    nix-instantiate --eval --option source-cache true -E "$expr" 2> $TEST_ROOT/log
+}
+
+# The first evaluation calls the filter and creates an entry.
+outPath=$(evalPath)
+grep -q 'filter called' $TEST_ROOT/log
+[[ $(ls $cacheDir | wc -l) = 1 ]]
+
+# The second one uses the entry without calling the filter.
+[[ $(evalPath) = "$outPath" ]]
+(! grep -q 'filter called' $TEST_ROOT/log)
+
+# A different filter doesn't use the entry.
+expr=${expr/.bak/.tmp}
+otherPath=$(evalPath)
+grep -q 'filter called' $TEST_ROOT/log
+[[ $otherPath != "$outPath" ]]
+expr=${expr/.tmp/.bak}
+
+# Changing, adding or removing a file invalidates the entry.
+echo changed > $TEST_ROOT/source/sub/bar
+sleep 1
+newPath=$(evalPath)
+grep -q 'filter called' $TEST_ROOT/log
+[[ $newPath != "$outPath" ]]
+
+touch $TEST_ROOT/source/new
+sleep 1
+[[ $(evalPath) != "$newPath" ]]
+grep -q 'filter called' $TEST_ROOT/log
+
+rm $TEST_ROOT/source/new
+sleep 1
+[[ $(evalPath) = "$newPath" ]]
+
+# Changing an excluded file doesn't.
+evalPath > /dev/null
+echo changed > $TEST_ROOT/source/baz.bak
+sleep 1
+[[ $(evalPath) = "$newPath" ]]
+(! grep -q 'filter called' $TEST_ROOT/log)
+
+# Filters that read files are not cached.
+rm -rf $cacheDir
+nix-instantiate --eval --option source-cache true -E "builtins.path {
+  path = $TEST_ROOT/source;
+  filter = path: type: builtins.pathExists (path + \".keep\");
+}"
+(! [[ -e $cacheDir ]])
@@ -50,3 +50,89 @@ rm -rf $TEST_ROOT/tmp
 mkdir -p $TEST_ROOT/tmp
 (! TMPDIR=$TEST_ROOT/tmp XDG_RUNTIME_DIR=$TEST_ROOT/tmp nix-env -f file://$(pwd)/bad.tar.xz -qa --out-path)
 (! [ -e $TEST_ROOT/tmp/bad ])
+
+# With tarball-refresh-in-background, a stale tarball is used right
+# away, and the refreshed version is used afterwards.
+tarball=$TEST_ROOT/refresh.tar
+echo 1 > $tarroot/marker
+(cd $TEST_ROOT && tar cf - tarball) > $tarball
+[[ $(nix eval --impure --raw --expr "builtins.readFile ((fetchTarball file://$tarball) + \"/marker\")") = 1 ]]
+
+echo 2 > $tarroot/marker
+(cd $TEST_ROOT && tar cf - tarball) > $tarball
+[[ $(nix eval --impure --raw --tarball-ttl 0 --tarball-refresh-in-background --expr "builtins.readFile ((fetchTarball file://$tarball) + \"/marker\")") = 1 ]]
+
+for i in $(seq 1 30); do
+    [[ $(nix eval --impure --raw --expr "builtins.readFile ((fetchTarball file://$tarball) + \"/marker\")") = 2 ]] && break
+    sleep 1
+done
+[[ $i -lt 30 ]]
+
+# Unusual tarball members. nix-prefetch-url --unpack and unpack-channel
+# extract the tarball, while nix flake prefetch turns it into a NAR
+# directly, so check that all three agree.
+members=$TEST_ROOT/members
+chmod -R u+w $members 2> /dev/null || true
+rm -rf $members
+mkdir -p $members/t
+
+unpackAll() {
+    local tarball=$1
+    local prefetched channel flake
+    prefetched=$(nix-prefetch-url --unpack --print-path file://$tarball | tail -n1)
+    channel=$(nix-build --no-out-link -E "derivation { name = \"channel\"; system = \"builtin\"; builder = \"builtin:unpack-channel\"; src = $tarball; channelName = \"c\"; }")/c
+    flake=$(nix flake prefetch --json "tarball+file://$tarball" | jq -r .storePath)
+    diff -r $prefetched $channel >&2
+    diff -r $prefetched $flake >&2
+    echo $prefetched
+}
+
+unpackFails() {
+    local tarball=$1
+    local message=$2
+    nix-prefetch-url --unpack file://$tarball 2>&1 | grep -q "$message"
+    nix-build --no-out-link -E "derivation { name = \"channel\"; system = \"builtin\"; builder = \"builtin:unpack-channel\"; src = $tarball; channelName = \"c\"; }" 2>&1 | grep -q "$message"
+    nix flake prefetch "tarball+file://$tarball" 2>&1 | grep -q "$message"
+}
+
+# A member with `..' in its path.
+echo evil > $members/evil
+(cd $members && tar cf dotdot.tar t && tar rf dotdot.tar -P --transform 's,^evil,t/../evil,' evil)
+unpackFails $members/dotdot.tar 'refers to a parent directory'
+
+# A member inside a symlink from the archive.
+mkdir -p $members/outside
+ln -s $members/outside $members/t/link
+echo foo > $members/foo
+(cd $members && tar cf symlink.tar t && tar rf symlink.tar --transform 's,^foo,t/link/foo,' foo)
+unpackFails $members/symlink.tar 'is inside a'
+[[ ! -e $members/outside/foo ]]
+rm $members/t/link
+
+# Hard links.
+echo hello > $members/t/a
+ln $members/t/a $members/t/b
+(cd $members && tar cf hardlink.tar t)
+tar tvf $members/hardlink.tar | grep -q 'link to'
+out=$(unpackAll $members/hardlink.tar)
+[[ $(cat $out/a) = hello ]]
+[[ $(cat $out/b) = hello ]]
+rm $members/t/a $members/t/b
+
+# A member that occurs twice; the last one wins.
+echo 1 > $members/t/dup
+(cd $members && tar cf dup.tar t)
+echo 2 > $members/t/dup
+(cd $members && tar rf dup.tar t/dup)
+out=$(unpackAll $members/dup.tar)
+[[ $(cat $out/dup) = 2 ]]
+rm $members/t/dup
+
+# Read-only directories, listed after their contents.
+mkdir -p $members/t/ro/sub
+echo x > $members/t/ro/sub/file
+chmod 555 $members/t/ro/sub $members/t/ro
+(cd $members && tar cf ro.tar --no-recursion t t/ro/sub/file t/ro/sub t/ro)
+out=$(unpackAll $members/ro.tar)
+[[ $(cat $out/ro/sub/file) = x ]]
+chmod -R u+w $members
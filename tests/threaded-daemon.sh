@@ -0,0 +1,46 @@
+source common.sh
+
+clearStore
+
+NIX_CONFIG="threaded-daemon = true" startDaemon
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+# Serve a number of concurrent clients from the same process.
+pids=()
+for i in $(seq 1 10); do
+    nix path-info -r $outPath > $TEST_ROOT/paths-$i &
+    pids+=($!)
+done
+wait "${pids[@]}"
+
+for i in $(seq 2 10); do
+    cmp $TEST_ROOT/paths-1 $TEST_ROOT/paths-$i
+done
+
+(( $(wc -l < $TEST_ROOT/paths-1) > 1 ))
+
+# Build logs are sent to the client that started the build.
+nix-build dependencies.nix --no-out-link --check 2>&1 | grep -q 'building.*dependencies-top'
+
+# The daemon's path info cache notices paths registered and deleted
+# by processes that access the store directly.
+echo foo > $TEST_ROOT/foo
+path=$(NIX_REMOTE= nix-store --add $TEST_ROOT/foo)
+nix path-info $path
+NIX_REMOTE= nix-store --delete $path
+sleep 2
+(! nix path-info $path)
+NIX_REMOTE= nix-store --add $TEST_ROOT/foo
+sleep 2
+nix path-info $path
+
+# Temporary roots registered by a client are released when it
+# disconnects, not when the daemon exits.
+echo bar > $TEST_ROOT/bar
+path=$(nix-store --add $TEST_ROOT/bar)
+(! ls $NIX_STATE_DIR/temproots | grep -- -)
+NIX_REMOTE= nix-store --delete $path
+[[ ! -e $path ]]
+
+killDaemon
@@ -174,6 +174,17 @@ nix-env -i foo-0.1 foo-1.0
 nix-env --set-flag priority 1 foo-0.1
 [ "$($profiles/test/bin/foo)" = "foo-0.1" ]
 
+# Directories are only merged when several packages have them;
+# otherwise the profile links to the directory in the package.
+nix-env -e '*'
+nix-env -i foo-1.0
+[[ -L $profiles/test/bin ]]
+nix-env -i bar-0.1
+[[ -d $profiles/test/bin && ! -L $profiles/test/bin ]]
+[[ -L $profiles/test/bin/foo && -L $profiles/test/bin/bar ]]
+[ "$($profiles/test/bin/foo)" = "foo-1.0" ]
+[ "$($profiles/test/bin/bar)" = "bar-0.1" ]
+
 # Test nix-env --set.
 nix-env --set $outPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
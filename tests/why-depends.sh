@@ -0,0 +1,19 @@
+source common.sh
+
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link --option index-reference-positions true)
+input2=$(nix-store -q --references $outPath | grep input-2)
+input0=$(nix-store -q --references $input2 | grep input-0)
+
+nix why-depends $outPath $input0 > $TEST_ROOT/why-depends
+grep -q 'input-2 -> ' $TEST_ROOT/why-depends
+grep -q 'input0: ' $TEST_ROOT/why-depends
+
+# The reference positions were recorded when the paths were built,
+# so `nix why-depends' doesn't need to read the files.
+chmod u+w $input2/input0
+chmod a-r $input2/input0
+nix why-depends --all $outPath $input0 > $TEST_ROOT/why-depends
+grep -q 'input0: ' $TEST_ROOT/why-depends
+chmod u+r $input2/input0